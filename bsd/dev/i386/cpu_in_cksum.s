@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ *  extern uint64_t os_cpu_in_cksum_sse2(const void *data, uint32_t len);
+ *  extern uint64_t os_cpu_in_cksum_avx2(const void *data, uint32_t len);
+ *
+ *  input :
+ *      data : starting address, any alignment
+ *      len : byte stream length, a multiple of 64
+ *
+ *  output :
+ *	the 64-bit sum of the 32-bit words in the byte stream, in host
+ *	byte order; the caller folds it into its own partial sum (2^32 is
+ *	1 modulo 0xffff, so (sum >> 32) + (sum & 0xffffffff) preserves the
+ *	16-bit 1's complement sum) and deals with odd addresses, trailing
+ *	bytes and byte swapping, as os_cpu_in_cksum_mbuf() does
+ *
+ *  Each 16 or 32-byte vector w3 : w2 : w1 : w0 is split into 0 : w2 : 0 : w0
+ *  (masked) and 0 : w3 : 0 : w1 (shifted right 32 bits per quadword), and
+ *  both are accumulated into 64-bit lanes, which cannot carry out for any
+ *  32-bit length.
+ */
+
+	.const
+	.align	5
+L_mask:
+	.quad	0x00000000ffffffff
+	.quad	0x00000000ffffffff
+	.quad	0x00000000ffffffff
+	.quad	0x00000000ffffffff
+
+#define Lmask	L_mask(%rip)
+
+#define	src		%rdi
+#define	len		%rsi
+#define	lend		%esi
+#define	t		%rcx
+
+	.globl	_os_cpu_in_cksum_sse2
+	.text
+	.align	4
+_os_cpu_in_cksum_sse2:
+	/* push callee-saved registers and set up base pointer */
+	push	%rbp
+	movq	%rsp, %rbp
+
+	mov	lend, lend	// zero-extend len
+
+#ifdef KERNEL
+	/* allocate stack space and save xmm0-xmm5 */
+	sub	$6*16, %rsp
+	movdqa	%xmm0, 0*16(%rsp)
+	movdqa	%xmm1, 1*16(%rsp)
+	movdqa	%xmm2, 2*16(%rsp)
+	movdqa	%xmm3, 3*16(%rsp)
+	movdqa	%xmm4, 4*16(%rsp)
+	movdqa	%xmm5, 5*16(%rsp)
+#endif
+
+	/* xmm0 accumulates the odd words, xmm1 the even ones */
+	movdqa	Lmask, %xmm5
+	pxor	%xmm0, %xmm0
+	pxor	%xmm1, %xmm1
+	shr	$6, len
+	jz	L_sse2_done
+
+L_sse2_loop:
+	movdqu	0*16(src), %xmm2
+	movdqu	1*16(src), %xmm3
+	movdqa	%xmm2, %xmm4
+	psrlq	$32, %xmm2
+	pand	%xmm5, %xmm4
+	paddq	%xmm2, %xmm0
+	paddq	%xmm4, %xmm1
+	movdqa	%xmm3, %xmm4
+	psrlq	$32, %xmm3
+	pand	%xmm5, %xmm4
+	paddq	%xmm3, %xmm0
+	paddq	%xmm4, %xmm1
+
+	movdqu	2*16(src), %xmm2
+	movdqu	3*16(src), %xmm3
+	movdqa	%xmm2, %xmm4
+	psrlq	$32, %xmm2
+	pand	%xmm5, %xmm4
+	paddq	%xmm2, %xmm0
+	paddq	%xmm4, %xmm1
+	movdqa	%xmm3, %xmm4
+	psrlq	$32, %xmm3
+	pand	%xmm5, %xmm4
+	paddq	%xmm3, %xmm0
+	paddq	%xmm4, %xmm1
+
+	add	$64, src
+	sub	$1, len
+	jnz	L_sse2_loop
+
+L_sse2_done:
+	/* add up the 4 quadword lanes */
+	paddq	%xmm1, %xmm0
+	movq	%xmm0, %rax
+	psrldq	$8, %xmm0
+	movq	%xmm0, t
+	add	t, %rax
+
+#ifdef KERNEL
+	/* restore xmm0-xmm5 and deallocate stack space */
+	movdqa	0*16(%rsp), %xmm0
+	movdqa	1*16(%rsp), %xmm1
+	movdqa	2*16(%rsp), %xmm2
+	movdqa	3*16(%rsp), %xmm3
+	movdqa	4*16(%rsp), %xmm4
+	movdqa	5*16(%rsp), %xmm5
+	add	$6*16, %rsp
+#endif
+
+	/* restore callee-saved registers */
+	pop	%rbp
+	ret
+
+	.globl	_os_cpu_in_cksum_avx2
+	.text
+	.align	4
+_os_cpu_in_cksum_avx2:
+	/* push callee-saved registers and set up base pointer */
+	push	%rbp
+	movq	%rsp, %rbp
+
+	mov	lend, lend	// zero-extend len
+
+#ifdef KERNEL
+	/*
+	 * allocate stack space and save all 256 bits of ymm0-ymm5; the
+	 * VEX-encoded instructions below clear the upper halves even when
+	 * operating on xmm registers.  The registers are restored in full
+	 * rather than with vzeroupper, which would discard the upper halves
+	 * of the interrupted thread's state.  Bits 511:256 of zmm0-zmm5
+	 * are not preserved, so this kernel must not be used on processors
+	 * with AVX-512 (see os_cpu_in_cksum_simd_init()).
+	 */
+	sub	$6*32, %rsp
+	vmovdqu	%ymm0, 0*32(%rsp)
+	vmovdqu	%ymm1, 1*32(%rsp)
+	vmovdqu	%ymm2, 2*32(%rsp)
+	vmovdqu	%ymm3, 3*32(%rsp)
+	vmovdqu	%ymm4, 4*32(%rsp)
+	vmovdqu	%ymm5, 5*32(%rsp)
+#endif
+
+	/* ymm0 accumulates the odd words, ymm1 the even ones */
+	vmovdqa	Lmask, %ymm5
+	vpxor	%ymm0, %ymm0, %ymm0
+	vpxor	%ymm1, %ymm1, %ymm1
+	shr	$6, len
+	jz	L_avx2_done
+
+L_avx2_loop:
+	vmovdqu	0*32(src), %ymm2
+	vmovdqu	1*32(src), %ymm3
+	vpsrlq	$32, %ymm2, %ymm4
+	vpand	%ymm5, %ymm2, %ymm2
+	vpaddq	%ymm4, %ymm0, %ymm0
+	vpaddq	%ymm2, %ymm1, %ymm1
+	vpsrlq	$32, %ymm3, %ymm4
+	vpand	%ymm5, %ymm3, %ymm3
+	vpaddq	%ymm4, %ymm0, %ymm0
+	vpaddq	%ymm3, %ymm1, %ymm1
+
+	add	$64, src
+	sub	$1, len
+	jnz	L_avx2_loop
+
+L_avx2_done:
+	/* add up the 8 quadword lanes */
+	vpaddq	%ymm1, %ymm0, %ymm0
+	vextracti128	$1, %ymm0, %xmm1
+	vpaddq	%xmm1, %xmm0, %xmm0
+	vmovq	%xmm0, %rax
+	vpextrq	$1, %xmm0, t
+	add	t, %rax
+
+#ifdef KERNEL
+	/* restore ymm0-ymm5 and deallocate stack space */
+	vmovdqu	0*32(%rsp), %ymm0
+	vmovdqu	1*32(%rsp), %ymm1
+	vmovdqu	2*32(%rsp), %ymm2
+	vmovdqu	3*32(%rsp), %ymm3
+	vmovdqu	4*32(%rsp), %ymm4
+	vmovdqu	5*32(%rsp), %ymm5
+	add	$6*32, %rsp
+#else
+	vzeroupper
+#endif
+
+	/* restore callee-saved registers */
+	pop	%rbp
+	ret
@@ -364,6 +364,55 @@ uiomove64(const addr64_t c_cp, int n, struct uio *uio)
 	return error;
 }
 
+extern uint32_t os_cpu_in_cksum(const void *, uint32_t, uint32_t);
+
+/*
+ * uiomove() that also adds the bytes moved to the 16-bit 1's complement
+ * partial sum in *sum (see os_cpu_in_cksum()), with cp at offset off of
+ * the checksummed data.  The move is done in pieces that fit the L1
+ * cache and each piece is summed right after being copied, so the data
+ * is brought in once for both.  On error, *sum covers what was moved.
+ */
+#define UIOMOVE_CKSUM_CHUNK     2048
+
+#define UIOMOVE_CKSUM_SWAP(s)   ((((s) & 0xff) << 8) | ((s) >> 8))
+
+int
+uiomove_cksum(const char *cp, int n, struct uio *uio, int off, uint32_t *sum)
+{
+	uint32_t psum = *sum;
+	int error = 0;
+
+	/*
+	 * Bytes at an odd offset are the low halves of their words: sum
+	 * them as if at an even one, with the sum byte swapped around it.
+	 */
+	if (off & 1) {
+		psum = (psum >> 16) + (psum & 0xffff);
+		psum = (psum >> 16) + (psum & 0xffff);
+		psum = UIOMOVE_CKSUM_SWAP(psum);
+	}
+	while (n > 0 && uio_resid(uio) > 0) {
+		user_ssize_t resid = uio_resid(uio);
+		int len = MIN(n, UIOMOVE_CKSUM_CHUNK);
+
+		error = uiomove(cp, len, uio);
+		/* short only at the end of the uio, or on error */
+		len = (int)(resid - uio_resid(uio));
+		psum = os_cpu_in_cksum(cp, (uint32_t)len, psum);
+		if (error != 0) {
+			break;
+		}
+		cp += len;
+		n -= len;
+	}
+	if (off & 1) {
+		psum = UIOMOVE_CKSUM_SWAP(psum);
+	}
+	*sum = psum;
+	return error;
+}
+
 /*
  * Give next character to user as result of read.
  */
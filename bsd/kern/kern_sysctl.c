@@ -623,6 +623,30 @@ sysctl_sched_stats_enable(__unused struct sysctl_oid *oidp, __unused void *arg1,
 
 SYSCTL_PROC(_kern, OID_AUTO, sched_stats_enable, CTLFLAG_LOCKED | CTLFLAG_WR, 0, 0, sysctl_sched_stats_enable, "-", "");
 
+#if __AMP__
+STATIC int
+sysctl_sched_steal_stats(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	uint32_t count = ml_get_cluster_count();
+	size_t buf_size = sizeof(struct sched_steal_stats) * count;
+	struct sched_steal_stats *buf;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, buf_size);
+	}
+
+	buf = (struct sched_steal_stats *)kalloc_data(buf_size, Z_ZERO | Z_WAITOK);
+	count = sched_steal_stats_get(buf, count);
+	error = SYSCTL_OUT(req, buf, sizeof(struct sched_steal_stats) * count);
+	kfree_data(buf, buf_size);
+	return error;
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_stats, CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, sysctl_sched_steal_stats, "S,sched_steal_stats", "Per-cluster idle steal statistics");
+#endif /* __AMP__ */
+
 extern uint32_t sched_debug_flags;
 SYSCTL_INT(_debug, OID_AUTO, sched, CTLFLAG_RW | CTLFLAG_LOCKED, &sched_debug_flags, 0, "scheduler debug");
 
@@ -3129,6 +3153,7 @@ enum {
 	LATENCY, LATENCY_MIN, LATENCY_MAX, LONG_TERM_SCAN_LIMIT,
 	LONG_TERM_SCAN_INTERVAL, LONG_TERM_SCAN_PAUSES,
 	SCAN_LIMIT, SCAN_INTERVAL, SCAN_PAUSES, SCAN_POSTPONES,
+	LONG_TERM_CASCADES, LONG_TERM_WHEEL,
 };
 extern uint64_t timer_sysctl_get(int);
 extern int      timer_sysctl_set(int, uint64_t);
@@ -3167,6 +3192,11 @@ SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, qlen,
 SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, scan_pauses,
     CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
     (void *) LONG_TERM_SCAN_PAUSES, 0, sysctl_timer, "Q", "");
+#if DEVELOPMENT || DEBUG
+SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, wheel,
+    CTLTYPE_QUAD | CTLFLAG_RW | CTLFLAG_LOCKED,
+    (void *) LONG_TERM_WHEEL, 0, sysctl_timer, "Q", "");
+#endif /* DEVELOPMENT || DEBUG */
 
 #if  DEBUG
 SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, enqueues,
@@ -3193,6 +3223,9 @@ SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, latency_min,
 SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, latency_max,
     CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
     (void *) LATENCY_MAX, 0, sysctl_timer, "Q", "");
+SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, cascades,
+    CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+    (void *) LONG_TERM_CASCADES, 0, sysctl_timer, "Q", "");
 #endif /* DEBUG */
 
 SYSCTL_PROC(_kern_timer, OID_AUTO, scan_limit,
@@ -4773,6 +4806,26 @@ SYSCTL_INT(_kern, OID_AUTO, ipc_portbt,
     CTLFLAG_RW | CTLFLAG_KERN | CTLFLAG_LOCKED,
     &ipc_portbt, 0, "");
 
+/*
+ * Copy-on-write transfer of large inline message content
+ */
+extern uint32_t ipc_kmsg_udata_cow_threshold;
+#if DEVELOPMENT || DEBUG
+SYSCTL_UINT(_kern, OID_AUTO, ipc_kmsg_udata_cow_threshold,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &ipc_kmsg_udata_cow_threshold, 0,
+    "Minimum page-aligned inline message content transferred copy-on-write (0 disables)");
+#else
+SYSCTL_UINT(_kern, OID_AUTO, ipc_kmsg_udata_cow_threshold,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &ipc_kmsg_udata_cow_threshold, 0,
+    "Minimum page-aligned inline message content transferred copy-on-write (0 disables)");
+#endif /* DEVELOPMENT || DEBUG */
+SCALABLE_COUNTER_DECLARE(ipc_kmsg_udata_cow_count);
+SCALABLE_COUNTER_DECLARE(ipc_kmsg_udata_cow_bytes);
+SYSCTL_SCALABLE_COUNTER(_kern, ipc_kmsg_udata_cow_count, ipc_kmsg_udata_cow_count,
+    "Messages whose inline content was transferred copy-on-write");
+SYSCTL_SCALABLE_COUNTER(_kern, ipc_kmsg_udata_cow_bytes, ipc_kmsg_udata_cow_bytes,
+    "Inline message bytes transferred copy-on-write");
+
 /*
  * Mach message signature validation control and outputs
  */
@@ -24,17 +24,45 @@
 //
 // @APPLE_OSREFERENCE_LICENSE_HEADER_END@
 
+#include <kern/kalloc.h>
 #include <kern/recount.h>
 #include <machine/machine_routines.h>
 #include <machine/smp.h>
 #include <sys/proc_info.h>
 #include <sys/resource_private.h>
+#include <sys/sysctl.h>
 #include <sys/sysproto.h>
 #include <sys/systm.h>
 #include <sys/types.h>
 
 // Recount's BSD-specific implementation for syscalls.
 
+static recount_cpu_kind_t
+_perflevel_index_to_cpu_kind(unsigned int perflevel)
+{
+#if __AMP__
+	extern cluster_type_t cpu_type_for_perflevel(int perflevel);
+	cluster_type_t cluster = cpu_type_for_perflevel(perflevel);
+#else // __AMP__
+	cluster_type_t cluster = CLUSTER_TYPE_SMP;
+#endif // !__AMP__
+
+	switch (cluster) {
+	case CLUSTER_TYPE_SMP:
+		// Default to first index for SMP.
+		return (recount_cpu_kind_t)0;
+#if __AMP__
+	case CLUSTER_TYPE_E:
+		return RCT_CPU_EFFICIENCY;
+	case CLUSTER_TYPE_P:
+		return RCT_CPU_PERFORMANCE;
+#endif // __AMP__
+	default:
+		panic("recount: unexpected CPU type %d for perflevel %d", cluster,
+		    perflevel);
+	}
+}
+
 #if CONFIG_PERVASIVE_CPI
 
 static struct thsc_cpi
@@ -167,32 +195,6 @@ _usage_to_proc_threadcounts(struct recount_usage *usage)
 	};
 }
 
-static recount_cpu_kind_t
-_perflevel_index_to_cpu_kind(unsigned int perflevel)
-{
-#if __AMP__
-	extern cluster_type_t cpu_type_for_perflevel(int perflevel);
-	cluster_type_t cluster = cpu_type_for_perflevel(perflevel);
-#else // __AMP__
-	cluster_type_t cluster = CLUSTER_TYPE_SMP;
-#endif // !__AMP__
-
-	switch (cluster) {
-	case CLUSTER_TYPE_SMP:
-		// Default to first index for SMP.
-		return (recount_cpu_kind_t)0;
-#if __AMP__
-	case CLUSTER_TYPE_E:
-		return RCT_CPU_EFFICIENCY;
-	case CLUSTER_TYPE_P:
-		return RCT_CPU_PERFORMANCE;
-#endif // __AMP__
-	default:
-		panic("recount: unexpected CPU type %d for perflevel %d", cluster,
-		    perflevel);
-	}
-}
-
 int
 proc_pidthreadcounts(
 	struct proc *p,
@@ -267,3 +269,39 @@ thread_selfcounts(__unused struct proc *p,
 }
 
 #endif // !CONFIG_PERVASIVE_CPI
+
+#pragma mark - scheduling latency
+
+// Export the scheduling latency histograms of each perflevel, as
+// `uint64_t[perflevel][scheduling bucket][bin]` -- see `struct
+// recount_sched_latency` for the bin layout.
+static int
+_sched_latency_histogram_sysctl(__unused struct sysctl_oid *oidp,
+    __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	const size_t kind_count = MIN(recount_topo_count(RCT_TOPO_CPU_KIND),
+	    RCT_CPU_KIND_COUNT);
+	unsigned int level_count = __builtin_popcount(ml_get_cpu_types());
+	const size_t len = MIN(kind_count, level_count);
+	const size_t size = len * sizeof(struct recount_sched_latency);
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, size);
+	}
+
+	struct recount_sched_latency *hists = kalloc_data(size, Z_WAITOK | Z_ZERO);
+	if (hists == NULL) {
+		return ENOMEM;
+	}
+	for (unsigned int i = 0; i < len; i++) {
+		recount_sched_latency_sum(_perflevel_index_to_cpu_kind(i), &hists[i]);
+	}
+	int error = SYSCTL_OUT(req, hists, size);
+	kfree_data(hists, size);
+	return error;
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, sched_latency_histogram,
+    CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0,
+    _sched_latency_histogram_sysctl, "Q",
+    "scheduling latency histograms by perflevel and bucket");
@@ -2176,6 +2176,8 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 	uint16_t headroom = 0;
 	ssize_t mlen;
 	boolean_t en_tracing = FALSE;
+	boolean_t sum_data = FALSE;
+	uint32_t datasum = 0;
 
 	if (uio != NULL) {
 		resid = uio_resid(uio);
@@ -2316,6 +2318,19 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 				    sosendjcl_ignore_capab) &&
 				    bigcl;
 
+				/*
+				 * Sum a datagram as it is copied in for a
+				 * protocol that would otherwise checksum it
+				 * later, unless a filter may still change it.
+				 */
+				if (top == NULL) {
+					sum_data = atomic &&
+					    (so->so_proto->pr_flags & PR_DATA_CKSUM) &&
+					    so->so_filt == NULL &&
+					    !(so->so_flags & SOF_CONTENT_FILTER);
+					datasum = 0;
+				}
+
 				socket_unlock(so, 0);
 
 				do {
@@ -2487,8 +2502,14 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 
 					space -= len;
 
-					error = uiomove(mtod(m, caddr_t),
-					    (int)len, uio);
+					if (sum_data) {
+						error = uiomove_cksum(mtod(m, caddr_t),
+						    (int)len, uio, top == NULL ? 0 :
+						    top->m_pkthdr.len, &datasum);
+					} else {
+						error = uiomove(mtod(m, caddr_t),
+						    (int)len, uio);
+					}
 
 					resid = uio_resid(uio);
 
@@ -2515,6 +2536,10 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 				if (error) {
 					goto out_locked;
 				}
+				if (sum_data) {
+					top->m_pkthdr.pkt_ext_flags |= PKTF_EXT_DATA_SUM;
+					top->m_pkthdr.csum_rx_val = (uint16_t)datasum;
+				}
 			}
 
 			if (dontroute) {
@@ -2564,6 +2589,11 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 				}
 #endif /* CONTENT_FILTER */
 			}
+			/* a filter attached while the data was copied in */
+			if (sum_data && top != NULL && (so->so_filt != NULL ||
+			    (so->so_flags & SOF_CONTENT_FILTER))) {
+				top->m_pkthdr.pkt_ext_flags &= ~PKTF_EXT_DATA_SUM;
+			}
 			error = (*so->so_proto->pr_usrreqs->pru_send)
 			    (so, sendflags, top, addr, control, p);
 
@@ -5123,6 +5153,7 @@ sosetoptlock(struct socket *so, struct sockopt *sopt, int dolock)
 		case SO_BROADCAST:
 		case SO_REUSEADDR:
 		case SO_REUSEPORT:
+		case SO_REUSEPORT_LB:
 		case SO_OOBINLINE:
 		case SO_TIMESTAMP:
 		case SO_TIMESTAMP_MONOTONIC:
@@ -5949,6 +5980,18 @@ sosetoptlock(struct socket *so, struct sockopt *sopt, int dolock)
 			}
 			break;
 		}
+		case SO_MAX_PACING_RATE:
+			error = sooptcopyin(sopt, &long_optval,
+			    sizeof(long_optval), sizeof(long_optval));
+			if (error != 0) {
+				goto out;
+			}
+			if (long_optval < 0) {
+				error = EINVAL;
+				goto out;
+			}
+			so->so_max_pacing_rate = (uint64_t)long_optval;
+			break;
 		default:
 			error = ENOPROTOOPT;
 			break;
@@ -6095,6 +6138,7 @@ sogetoptlock(struct socket *so, struct sockopt *sopt, int dolock)
 		case SO_KEEPALIVE:
 		case SO_REUSEADDR:
 		case SO_REUSEPORT:
+		case SO_REUSEPORT_LB:
 		case SO_BROADCAST:
 		case SO_OOBINLINE:
 		case SO_TIMESTAMP:
@@ -6444,6 +6488,10 @@ integer:
 		case SO_RECV_WAKE_PKT:
 			optval = (so->so_flags & SOF_RECV_WAKE_PKT);
 			goto integer;
+		case SO_MAX_PACING_RATE:
+			error = sooptcopyout(sopt, &so->so_max_pacing_rate,
+			    sizeof(so->so_max_pacing_rate));
+			break;
 		default:
 			error = ENOPROTOOPT;
 			break;
@@ -408,6 +408,7 @@ sonewconn_internal(struct socket *head, int connstatus)
 	    SOF1_QOSMARKING_ALLOWED | SOF1_QOSMARKING_POLICY_OVERRIDE);
 	so->so_background_thread = head->so_background_thread;
 	so->so_traffic_class = head->so_traffic_class;
+	so->so_max_pacing_rate = head->so_max_pacing_rate;
 	so->so_netsvctype = head->so_netsvctype;
 
 	if (soreserve(so, head->so_snd.sb_hiwat, head->so_rcv.sb_hiwat)) {
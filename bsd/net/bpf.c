@@ -133,6 +133,11 @@
 #include <kern/thread_call.h>
 #include <libkern/section_keywords.h>
 
+#include <mach/mach_vm.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+
+#include <os/atomic_private.h>
 #include <os/log.h>
 
 extern int tvtohz(struct timeval *);
@@ -196,6 +201,18 @@ static int bpf_hdr_comp_enable = 1;
 SYSCTL_INT(_debug, OID_AUTO, bpf_hdr_comp_enable, CTLFLAG_RW | CTLFLAG_LOCKED,
     &bpf_hdr_comp_enable, 1, "");
 
+static int bpf_threaded_code = 1;
+SYSCTL_INT(_debug, OID_AUTO, bpf_threaded_code, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &bpf_threaded_code, 0, "Run filters as pre-decoded threaded code");
+
+/*
+ * Limits on BIOCSETRING: the ring header takes the first page, and the
+ * blocks follow it.
+ */
+#define BPF_RING_HDRSIZE        PAGE_SIZE
+#define BPF_RING_MAXBLOCKS      1024
+#define BPF_RING_MAXSIZE        (64 * 1024 * 1024)
+
 static int sysctl_bpf_stats SYSCTL_HANDLER_ARGS;
 SYSCTL_PROC(_debug, OID_AUTO, bpf_stats, CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
     0, 0,
@@ -247,6 +264,12 @@ static void     bpf_set_packet_service_class(struct mbuf *, int);
 static void     bpf_acquire_d(struct bpf_d *);
 static void     bpf_release_d(struct bpf_d *);
 
+static int      bpf_setring(struct bpf_d *, struct bpf_ring_req *);
+static void     bpf_ring_free(struct bpf_d *);
+static void     bpf_ring_next(struct bpf_d *);
+static void     bpf_ring_complete(struct bpf_d *);
+static uint32_t bpf_ring_ready(struct bpf_d *);
+
 static  int bpf_devsw_installed;
 
 void bpf_init(void *unused);
@@ -1070,6 +1093,15 @@ bpfread(dev_t dev, struct uio *uio, int ioflag)
 
 	bpf_acquire_d(d);
 
+	/*
+	 * Packets captured into a ring are only returned through the ring
+	 */
+	if (d->bd_ring != NULL) {
+		bpf_release_d(d);
+		lck_mtx_unlock(bpf_mlock);
+		return EOPNOTSUPP;
+	}
+
 	/*
 	 * Restrict application to use a buffer the same size as
 	 * as kernel buffers.
@@ -1364,7 +1396,16 @@ bpf_timed_out(void *arg, __unused void *dummy)
 		 * now stuff to read, wake it up.
 		 */
 		d->bd_state = BPF_TIMED_OUT;
-		if (d->bd_slen != 0) {
+		if (d->bd_ring != NULL) {
+			/*
+			 * Hand the partially filled block to the process;
+			 * there is no read() to reset the state.
+			 */
+			if (d->bd_sbuf != NULL && d->bd_slen != 0) {
+				bpf_ring_complete(d);
+				bpf_wakeup(d);
+			}
+		} else if (d->bd_slen != 0) {
 			bpf_wakeup(d);
 		}
 	} else if (d->bd_state == BPF_DRAINING) {
@@ -1585,6 +1626,13 @@ bpf_setup(struct bpf_d *d_to, uuid_t uuid_from, ifnet_t ifp)
 		    __func__, error);
 		return error;
 	}
+	if (d_from->bd_ring != NULL || d_to->bd_ring != NULL) {
+		error = EINVAL;
+		os_log_error(OS_LOG_DEFAULT,
+		    "%s: capture ring in use error %d",
+		    __func__, error);
+		return error;
+	}
 
 	/*
 	 * Prevent any read while copying
@@ -1874,7 +1922,8 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 	case BIOCSBLEN: {               /* u_int */
 		u_int size;
 
-		if (d->bd_bif != 0 || (d->bd_flags & BPF_DETACHING)) {
+		if (d->bd_bif != 0 || (d->bd_flags & BPF_DETACHING) ||
+		    d->bd_ring != NULL) {
 			/*
 			 * Interface already attached, unable to change buffers
 			 */
@@ -2319,6 +2368,14 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 			error = EINVAL;
 			break;
 		}
+		if (int_arg != 0 && d->bd_ring != NULL) {
+			/*
+			 * Compressed headers refer to the previous packet,
+			 * which may be in a block already handed back
+			 */
+			error = EINVAL;
+			break;
+		}
 		if (int_arg != 0) {
 			d->bd_flags |= BPF_COMP_REQ;
 			if (bpf_hdr_comp_enable != 0) {
@@ -2342,6 +2399,17 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 		bcopy(&bcs, addr, sizeof(bcs));
 		break;
 	}
+
+	case BIOCSETRING: {             /* struct bpf_ring_req */
+		struct bpf_ring_req brr;
+
+		bcopy(addr, &brr, sizeof(brr));
+		error = bpf_setring(d, &brr);
+		if (error == 0) {
+			bcopy(&brr, addr, sizeof(brr));
+		}
+		break;
+	}
 	}
 
 	bpf_release_d(d);
@@ -2359,6 +2427,7 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
     u_long cmd)
 {
 	struct bpf_insn *fcode, *old;
+	struct bpf_tc *oldtc;
 	u_int flen, size;
 
 	while (d->bd_hbuf_read != 0) {
@@ -2370,15 +2439,20 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 	}
 
 	old = d->bd_filter;
+	oldtc = d->bd_tcode;
 	if (bf_insns == USER_ADDR_NULL) {
 		if (bf_len != 0) {
 			return EINVAL;
 		}
 		d->bd_filter = NULL;
+		d->bd_tcode = NULL;
 		reset_d(d);
 		if (old != 0) {
 			kfree_data_addr(old);
 		}
+		if (oldtc != NULL) {
+			bpf_tc_free(oldtc);
+		}
 		return 0;
 	}
 	flen = bf_len;
@@ -2394,6 +2468,8 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 	if (copyin(bf_insns, (caddr_t)fcode, size) == 0 &&
 	    bpf_validate(fcode, (int)flen)) {
 		d->bd_filter = fcode;
+		/* without threaded code, the filter is interpreted */
+		d->bd_tcode = bpf_tc_build(fcode, (int)flen);
 
 		if (cmd == BIOCSETF32 || cmd == BIOCSETF64) {
 			reset_d(d);
@@ -2402,6 +2478,9 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 		if (old != 0) {
 			kfree_data_addr(old);
 		}
+		if (oldtc != NULL) {
+			bpf_tc_free(oldtc);
+		}
 
 		return 0;
 	}
@@ -2454,7 +2533,7 @@ bpf_setif(struct bpf_d *d, ifnet_t theywant, bool do_reset, bool has_hbuf_read,
 		 * We found the requested interface.
 		 * Allocate the packet buffers.
 		 */
-		if (has_bufs_allocated == false) {
+		if (has_bufs_allocated == false && d->bd_ring == NULL) {
 			error = bpf_allocbufs(d);
 			if (error != 0) {
 				return error;
@@ -2668,9 +2747,10 @@ bpfselect(dev_t dev, int which, void * wql, struct proc *p)
 
 	switch (which) {
 	case FREAD:
-		if (d->bd_hlen != 0 ||
+		if (d->bd_ring != NULL ? bpf_ring_ready(d) != 0 :
+		    (d->bd_hlen != 0 ||
 		    ((d->bd_immediate ||
-		    d->bd_state == BPF_TIMED_OUT) && d->bd_slen != 0)) {
+		    d->bd_state == BPF_TIMED_OUT) && d->bd_slen != 0))) {
 			ret = 1;         /* read has data to return */
 		} else {
 			/*
@@ -2719,7 +2799,14 @@ filt_bpfread_common(struct knote *kn, struct kevent_qos_s *kev, struct bpf_d *d)
 	int ready = 0;
 	int64_t data = 0;
 
-	if (d->bd_immediate) {
+	if (d->bd_ring != NULL) {
+		/*
+		 * The amount of data is the number of completed
+		 * blocks the process has not handed back yet.
+		 */
+		data = bpf_ring_ready(d);
+		ready = (data > 0);
+	} else if (d->bd_immediate) {
 		/*
 		 * If there's data in the hold buffer, it's the
 		 * amount of data a read will return.
@@ -2950,8 +3037,13 @@ bpf_tap_imp(
 		}
 
 		++d->bd_rcount;
-		slen = bpf_filter(d->bd_filter, (u_char *)bpf_pkt,
-		    (u_int)bpf_pkt->bpfp_total_length, 0);
+		if (d->bd_tcode != NULL && bpf_threaded_code) {
+			slen = bpf_tc_filter(d->bd_tcode, bpf_pkt,
+			    (u_int)bpf_pkt->bpfp_total_length);
+		} else {
+			slen = bpf_filter(d->bd_filter, (u_char *)bpf_pkt,
+			    (u_int)bpf_pkt->bpfp_total_length, 0);
+		}
 
 		if (slen != 0) {
 			if (bp->bif_ifp->if_type == IFT_PKTAP &&
@@ -3618,6 +3710,7 @@ catchpacket(struct bpf_d *d, struct bpf_packet * pkt,
 	uint32_t totlen, curlen;
 	uint32_t hdrlen, caplen;
 	int do_wakeup = 0;
+	bool ring_complete = false;
 	u_char *payload;
 	struct timeval tv;
 
@@ -3643,7 +3736,39 @@ catchpacket(struct bpf_d *d, struct bpf_packet * pkt,
 	 * Round up the end of the previous packet to the next longword.
 	 */
 	curlen = BPF_WORDALIGN(d->bd_slen);
-	if (curlen + totlen > d->bd_bufsize) {
+	if (d->bd_ring != NULL) {
+		/*
+		 * Complete the current block if this packet does not fit,
+		 * then move to the next block unless the process holds
+		 * all of them.
+		 */
+		if (d->bd_sbuf != NULL && curlen + totlen > d->bd_bufsize) {
+			bpf_ring_complete(d);
+			do_wakeup = 1;
+		}
+		if (d->bd_sbuf == NULL) {
+			bpf_ring_next(d);
+			if (d->bd_sbuf == NULL) {
+				++d->bd_dcount;
+				d->bd_ring->br_hdr->brh_drops = d->bd_dcount;
+				if (do_wakeup) {
+					bpf_wakeup(d);
+				}
+				return;
+			}
+			curlen = 0;
+		}
+		/*
+		 * Hand the block over with this packet in it if the read
+		 * timeout already expired, or in immediate mode once the
+		 * process has caught up with the ring.
+		 */
+		ring_complete = d->bd_state == BPF_TIMED_OUT ||
+		    (d->bd_immediate && bpf_ring_ready(d) == 0);
+		if (d->bd_immediate || ring_complete) {
+			do_wakeup = 1;
+		}
+	} else if (curlen + totlen > d->bd_bufsize) {
 		/*
 		 * This packet will overflow the storage buffer.
 		 * Rotate the buffers if we can, then wakeup any
@@ -3848,6 +3973,9 @@ catchpacket(struct bpf_d *d, struct bpf_packet * pkt,
 	d->bd_bcs.bcs_total_hdr_size += pkt->bpfp_header_length;
 	d->bd_bcs.bcs_total_size += caplen;
 
+	if (ring_complete) {
+		bpf_ring_complete(d);
+	}
 	if (do_wakeup) {
 		bpf_wakeup(d);
 	}
@@ -3929,11 +4057,193 @@ bpf_freed(struct bpf_d *d)
 		panic("bpf buffer freed during read");
 	}
 
+	bpf_ring_free(d);
 	bpf_freebufs(d);
 
 	if (d->bd_filter) {
 		kfree_data_addr(d->bd_filter);
 	}
+	if (d->bd_tcode != NULL) {
+		bpf_tc_free(d->bd_tcode);
+	}
+}
+
+/*
+ * Set up a capture ring and map it into the calling process.  Must be
+ * done before the descriptor is attached to an interface, and replaces
+ * the store, hold and free buffers.
+ */
+static int
+bpf_setring(struct bpf_d *d, struct bpf_ring_req *brr)
+{
+	struct bpf_ring *br;
+	mach_vm_offset_t uaddr = 0;
+	vm_prot_t cur_prot, max_prot;
+	uint32_t block_size, block_count;
+	vm_size_t size;
+	kern_return_t kr;
+
+	LCK_MTX_ASSERT(bpf_mlock, LCK_MTX_ASSERT_OWNED);
+
+	if (d->bd_bif != NULL || d->bd_ring != NULL ||
+	    (d->bd_flags & (BPF_DETACHING | BPF_COMP_REQ)) != 0) {
+		return EINVAL;
+	}
+	if (brr->brr_block_size > BPF_BUFSIZE_CAP) {
+		return EINVAL;
+	}
+	block_size = BPF_WORDALIGN(brr->brr_block_size);
+	block_count = brr->brr_block_count;
+	if (block_size < sizeof(struct bpf_ring_block) + BPF_MINBUFSIZE ||
+	    block_count < 2 || block_count > BPF_RING_MAXBLOCKS ||
+	    (uint64_t)block_size * block_count > BPF_RING_MAXSIZE) {
+		return EINVAL;
+	}
+	size = round_page(BPF_RING_HDRSIZE + (vm_size_t)block_size * block_count);
+
+	br = kalloc_type(struct bpf_ring, Z_WAITOK_ZERO_NOFAIL);
+	kr = kmem_alloc(kernel_map, &br->br_kaddr, size, KMA_ZERO | KMA_DATA,
+	    VM_KERN_MEMORY_BSD);
+	if (kr != KERN_SUCCESS) {
+		kfree_type(struct bpf_ring, br);
+		return ENOMEM;
+	}
+	br->br_size = size;
+	br->br_block_size = block_size;
+	br->br_block_count = block_count;
+	br->br_hdr = (struct bpf_ring_hdr *)br->br_kaddr;
+	br->br_hdr->brh_block_size = block_size;
+	br->br_hdr->brh_block_count = block_count;
+	br->br_hdr->brh_block_offset = BPF_RING_HDRSIZE;
+
+	kr = mach_vm_remap_kernel(current_map(), &uaddr, size, 0,
+	    VM_FLAGS_ANYWHERE, VM_KERN_MEMORY_NONE, kernel_map, br->br_kaddr,
+	    FALSE, &cur_prot, &max_prot, VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS) {
+		kmem_free(kernel_map, br->br_kaddr, size);
+		kfree_type(struct bpf_ring, br);
+		return ENOMEM;
+	}
+
+	/*
+	 * The packet area of a block follows its header
+	 */
+	bpf_freebufs(d);
+	d->bd_ring = br;
+	d->bd_bufsize = block_size - sizeof(struct bpf_ring_block);
+	d->bd_sbuf = NULL;
+	d->bd_slen = 0;
+	d->bd_scnt = 0;
+
+	brr->brr_block_size = block_size;
+	brr->brr_addr = uaddr;
+	brr->brr_size = size;
+
+	os_log(OS_LOG_DEFAULT, "bpf%u capture ring %u blocks of %u bytes",
+	    d->bd_dev_minor, block_count, block_size);
+	return 0;
+}
+
+/*
+ * Release the kernel side of the ring; the process keeps its mapping
+ * until it unmaps it.
+ */
+static void
+bpf_ring_free(struct bpf_d *d)
+{
+	struct bpf_ring *br = d->bd_ring;
+
+	if (br == NULL) {
+		return;
+	}
+	d->bd_ring = NULL;
+	d->bd_sbuf = NULL;
+	d->bd_slen = 0;
+	d->bd_scnt = 0;
+	kmem_free(kernel_map, br->br_kaddr, br->br_size);
+	kfree_type(struct bpf_ring, br);
+}
+
+static struct bpf_ring_block *
+bpf_ring_slot(struct bpf_ring *br, uint32_t seq)
+{
+	return (struct bpf_ring_block *)(br->br_kaddr + BPF_RING_HDRSIZE +
+	           (vm_offset_t)(seq % br->br_block_count) * br->br_block_size);
+}
+
+/*
+ * Number of completed blocks the process has not handed back.  The
+ * consumer index is written by the process, so never trust it beyond
+ * the blocks actually completed.
+ */
+static uint32_t
+bpf_ring_pending(struct bpf_ring *br)
+{
+	uint32_t cons = os_atomic_load(&br->br_hdr->brh_cons, acquire);
+	uint32_t pending = br->br_prod - cons;
+
+	return MIN(pending, br->br_block_count);
+}
+
+/*
+ * Start filling the next block, if the process has handed one back.
+ * Leaves bd_sbuf NULL when the ring is full.
+ */
+static void
+bpf_ring_next(struct bpf_d *d)
+{
+	struct bpf_ring *br = d->bd_ring;
+
+	d->bd_slen = 0;
+	d->bd_scnt = 0;
+	if (bpf_ring_pending(br) >= br->br_block_count) {
+		d->bd_sbuf = NULL;
+		return;
+	}
+	d->bd_sbuf = (caddr_t)(bpf_ring_slot(br, br->br_prod) + 1);
+}
+
+/*
+ * Publish the block being filled to the process.
+ *
+ * This is what a read() is in ring mode, so the read timeout starts
+ * over: a timer armed by a waiting select or kevent is re-armed for
+ * the next block, and an expired one no longer applies.
+ */
+static void
+bpf_ring_complete(struct bpf_d *d)
+{
+	struct bpf_ring *br = d->bd_ring;
+	struct bpf_ring_block *blk = bpf_ring_slot(br, br->br_prod);
+
+	blk->brb_seq = br->br_prod;
+	blk->brb_len = d->bd_slen;
+	blk->brb_npkts = d->bd_scnt;
+	br->br_prod++;
+	os_atomic_store(&br->br_hdr->brh_prod, br->br_prod, release);
+
+	d->bd_sbuf = NULL;
+	d->bd_slen = 0;
+	d->bd_scnt = 0;
+
+	if (d->bd_state == BPF_WAITING) {
+		bpf_stop_timer(d);
+		d->bd_state = BPF_IDLE;
+		bpf_start_timer(d);
+	} else if (d->bd_state == BPF_TIMED_OUT) {
+		d->bd_state = BPF_IDLE;
+	}
+}
+
+/*
+ * Number of blocks ready for the process.  Only a predicate for select
+ * and kevent: partially filled blocks are completed by catchpacket()
+ * and bpf_timed_out().
+ */
+static uint32_t
+bpf_ring_ready(struct bpf_d *d)
+{
+	return bpf_ring_pending(d->bd_ring);
 }
 
 /*
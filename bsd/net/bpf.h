@@ -198,6 +198,40 @@ struct bpf_comp_stats {
 	uint64_t bcs_total_compressed_prefix_size; /* total size of compressed data */
 	uint64_t bcs_max_compressed_prefix_size; /* max compressed data size */
 };
+
+/*
+ * Shared memory capture ring (BIOCSETRING).
+ *
+ * The kernel maps the ring into the calling process: a page holding
+ * struct bpf_ring_hdr followed by brh_block_count blocks of brh_block_size
+ * bytes each, at brh_block_offset.  The kernel fills blocks in order and
+ * publishes a completed block by advancing brh_prod; the process hands
+ * blocks back by advancing brh_cons.  Block i of the stream lives at slot
+ * (i % brh_block_count).  Each block starts with a struct bpf_ring_block
+ * followed by brb_len bytes of packets in the read() format.
+ */
+struct bpf_ring_req {
+	uint32_t brr_block_size;        /* in: bytes per block */
+	uint32_t brr_block_count;       /* in: number of blocks */
+	uint64_t brr_addr;              /* out: address of the mapping */
+	uint64_t brr_size;              /* out: size of the mapping */
+};
+
+struct bpf_ring_hdr {
+	volatile uint32_t brh_prod;     /* blocks completed by the kernel */
+	volatile uint32_t brh_cons;     /* blocks released by the process */
+	uint32_t brh_block_size;
+	uint32_t brh_block_count;
+	uint32_t brh_block_offset;      /* offset of the first block */
+	uint32_t brh_pad;
+	volatile uint64_t brh_drops;    /* packets dropped for lack of a block */
+};
+
+struct bpf_ring_block {
+	uint64_t brb_seq;               /* stream index of this block */
+	uint32_t brb_len;               /* bytes of packet data */
+	uint32_t brb_npkts;             /* number of packets */
+};
 #endif /* PRIVATE */
 
 #if defined(__LP64__)
@@ -269,6 +303,7 @@ struct bpf_comp_stats {
 #define BIOCSHDRCOMP    _IOW('B', 135, int)
 #define BIOCGHDRCOMPSTATS    _IOR('B', 136, struct bpf_comp_stats)
 #define BIOCGHDRCOMPON  _IOR('B', 137, int)
+#define BIOCSETRING     _IOWR('B', 138, struct bpf_ring_req)
 #endif /* PRIVATE */
 /*
  * Structure prepended to each packet.
@@ -1460,6 +1495,12 @@ extern int      bpf_validate(const struct bpf_insn *, int);
 extern void     bpfdetach(struct ifnet *);
 extern void     bpfilterattach(int);
 extern u_int    bpf_filter(const struct bpf_insn *, u_char *, u_int, u_int);
+#ifdef BSD_KERNEL_PRIVATE
+struct bpf_tc;
+extern struct bpf_tc *bpf_tc_build(const struct bpf_insn *, int);
+extern void     bpf_tc_free(struct bpf_tc *);
+extern u_int    bpf_tc_filter(const struct bpf_tc *, struct bpf_packet *, u_int);
+#endif /* BSD_KERNEL_PRIVATE */
 #endif /* KERNEL_PRIVATE */
 
 #endif /* !defined(DRIVERKIT) */
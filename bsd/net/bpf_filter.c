@@ -76,6 +76,9 @@
 
 #ifdef KERNEL
 #include <sys/mbuf.h>
+#include <sys/sysctl.h>
+#include <kern/startup.h>
+#include <kern/zalloc.h>
 #endif
 #include <net/bpf.h>
 #ifdef KERNEL
@@ -888,3 +891,924 @@ bpf_validate(const struct bpf_insn *f, int len)
 	return BPF_CLASS(f[len - 1].code) == BPF_RET;
 }
 #endif
+
+#ifdef KERNEL
+/*
+ * Pre-decoded ("threaded") filter code.
+ *
+ * A validated program is translated once, when it is installed, into an
+ * array of bpf_tc_insn with a dense opcode, absolute branch targets and
+ * jumps to unconditional jumps already followed.  A packet load followed
+ * by a test of the loaded value against a constant, the bulk of what
+ * tcpdump emits, is fused into a single instruction when nothing else
+ * branches to the test.
+ *
+ * Packet loads first try the header and the first mbuf (or buflet) as
+ * contiguous buffers and only walk the chain through bp_x*() when the
+ * bytes are elsewhere, which yields the same bytes and the same failures
+ * as bpf_filter() does.  Instructions bpf_filter() does not implement
+ * become "ret #0", as they do in the interpreter.
+ */
+enum {
+	BTC_RET_K,
+	BTC_RET_A,
+	BTC_LD_W_ABS,
+	BTC_LD_H_ABS,
+	BTC_LD_B_ABS,
+	BTC_LD_W_IND,
+	BTC_LD_H_IND,
+	BTC_LD_B_IND,
+	BTC_LDX_MSH,
+	BTC_LD_LEN,
+	BTC_LDX_LEN,
+	BTC_LD_IMM,
+	BTC_LDX_IMM,
+	BTC_LD_MEM,
+	BTC_LDX_MEM,
+	BTC_ST,
+	BTC_STX,
+	BTC_JA,
+	BTC_JGT_K,
+	BTC_JGE_K,
+	BTC_JEQ_K,
+	BTC_JSET_K,
+	BTC_JGT_X,
+	BTC_JGE_X,
+	BTC_JEQ_X,
+	BTC_JSET_X,
+	BTC_ADD_X,
+	BTC_SUB_X,
+	BTC_MUL_X,
+	BTC_DIV_X,
+	BTC_AND_X,
+	BTC_OR_X,
+	BTC_LSH_X,
+	BTC_RSH_X,
+	BTC_ADD_K,
+	BTC_SUB_K,
+	BTC_MUL_K,
+	BTC_DIV_K,
+	BTC_AND_K,
+	BTC_OR_K,
+	BTC_LSH_K,
+	BTC_RSH_K,
+	BTC_NEG,
+	BTC_TAX,
+	BTC_TXA,
+	/* fused load and test, k is the offset and k2 the constant */
+	BTC_LD_W_ABS_JEQ,
+	BTC_LD_H_ABS_JEQ,
+	BTC_LD_B_ABS_JEQ,
+	BTC_LD_W_ABS_JSET,
+	BTC_LD_H_ABS_JSET,
+	BTC_LD_B_ABS_JSET,
+};
+
+#define BTC_NONE        0xffff
+
+struct bpf_tc_insn {
+	u_int16_t       op;
+	u_int16_t       jt;             /* absolute, taken */
+	u_int16_t       jf;             /* absolute, not taken */
+	u_int32_t       k;
+	u_int32_t       k2;
+};
+
+struct bpf_tc {
+	u_int32_t               bt_len;
+	struct bpf_tc_insn      bt_insns[];
+};
+
+/* contiguous views of the start of a packet */
+struct bpf_tc_pkt {
+	struct bpf_packet       *bp;
+	u_char                  *hdr;
+	u_int32_t               hdrlen;
+	u_char                  *data;
+	u_int32_t               datalen;
+};
+
+static u_int16_t
+bpf_tc_op(u_short code)
+{
+	switch (code) {
+	case BPF_RET | BPF_K:
+		return BTC_RET_K;
+	case BPF_RET | BPF_A:
+		return BTC_RET_A;
+	case BPF_LD | BPF_W | BPF_ABS:
+		return BTC_LD_W_ABS;
+	case BPF_LD | BPF_H | BPF_ABS:
+		return BTC_LD_H_ABS;
+	case BPF_LD | BPF_B | BPF_ABS:
+		return BTC_LD_B_ABS;
+	case BPF_LD | BPF_W | BPF_IND:
+		return BTC_LD_W_IND;
+	case BPF_LD | BPF_H | BPF_IND:
+		return BTC_LD_H_IND;
+	case BPF_LD | BPF_B | BPF_IND:
+		return BTC_LD_B_IND;
+	case BPF_LDX | BPF_MSH | BPF_B:
+		return BTC_LDX_MSH;
+	case BPF_LD | BPF_W | BPF_LEN:
+		return BTC_LD_LEN;
+	case BPF_LDX | BPF_W | BPF_LEN:
+		return BTC_LDX_LEN;
+	case BPF_LD | BPF_IMM:
+		return BTC_LD_IMM;
+	case BPF_LDX | BPF_IMM:
+		return BTC_LDX_IMM;
+	case BPF_LD | BPF_MEM:
+		return BTC_LD_MEM;
+	case BPF_LDX | BPF_MEM:
+		return BTC_LDX_MEM;
+	case BPF_ST:
+		return BTC_ST;
+	case BPF_STX:
+		return BTC_STX;
+	case BPF_JMP | BPF_JA:
+		return BTC_JA;
+	case BPF_JMP | BPF_JGT | BPF_K:
+		return BTC_JGT_K;
+	case BPF_JMP | BPF_JGE | BPF_K:
+		return BTC_JGE_K;
+	case BPF_JMP | BPF_JEQ | BPF_K:
+		return BTC_JEQ_K;
+	case BPF_JMP | BPF_JSET | BPF_K:
+		return BTC_JSET_K;
+	case BPF_JMP | BPF_JGT | BPF_X:
+		return BTC_JGT_X;
+	case BPF_JMP | BPF_JGE | BPF_X:
+		return BTC_JGE_X;
+	case BPF_JMP | BPF_JEQ | BPF_X:
+		return BTC_JEQ_X;
+	case BPF_JMP | BPF_JSET | BPF_X:
+		return BTC_JSET_X;
+	case BPF_ALU | BPF_ADD | BPF_X:
+		return BTC_ADD_X;
+	case BPF_ALU | BPF_SUB | BPF_X:
+		return BTC_SUB_X;
+	case BPF_ALU | BPF_MUL | BPF_X:
+		return BTC_MUL_X;
+	case BPF_ALU | BPF_DIV | BPF_X:
+		return BTC_DIV_X;
+	case BPF_ALU | BPF_AND | BPF_X:
+		return BTC_AND_X;
+	case BPF_ALU | BPF_OR | BPF_X:
+		return BTC_OR_X;
+	case BPF_ALU | BPF_LSH | BPF_X:
+		return BTC_LSH_X;
+	case BPF_ALU | BPF_RSH | BPF_X:
+		return BTC_RSH_X;
+	case BPF_ALU | BPF_ADD | BPF_K:
+		return BTC_ADD_K;
+	case BPF_ALU | BPF_SUB | BPF_K:
+		return BTC_SUB_K;
+	case BPF_ALU | BPF_MUL | BPF_K:
+		return BTC_MUL_K;
+	case BPF_ALU | BPF_DIV | BPF_K:
+		return BTC_DIV_K;
+	case BPF_ALU | BPF_AND | BPF_K:
+		return BTC_AND_K;
+	case BPF_ALU | BPF_OR | BPF_K:
+		return BTC_OR_K;
+	case BPF_ALU | BPF_LSH | BPF_K:
+		return BTC_LSH_K;
+	case BPF_ALU | BPF_RSH | BPF_K:
+		return BTC_RSH_K;
+	case BPF_ALU | BPF_NEG:
+		return BTC_NEG;
+	case BPF_MISC | BPF_TAX:
+		return BTC_TAX;
+	case BPF_MISC | BPF_TXA:
+		return BTC_TXA;
+	}
+	return BTC_NONE;
+}
+
+static u_int16_t
+bpf_tc_fused_op(u_int16_t ld, u_int16_t jmp)
+{
+	switch (jmp) {
+	case BTC_JEQ_K:
+		return ld - BTC_LD_W_ABS + BTC_LD_W_ABS_JEQ;
+	case BTC_JSET_K:
+		return ld - BTC_LD_W_ABS + BTC_LD_W_ABS_JSET;
+	}
+	return BTC_NONE;
+}
+
+static inline int
+bpf_tc_is_jump(u_int16_t op)
+{
+	return op >= BTC_JA && op <= BTC_JSET_X;
+}
+
+/* follow unconditional jumps from the instruction at t */
+static u_int
+bpf_tc_thread(const struct bpf_insn *f, u_int t)
+{
+	while (f[t].code == (BPF_JMP | BPF_JA)) {
+		t = t + 1 + f[t].k;
+	}
+	return t;
+}
+
+/*
+ * Translate a program that passed bpf_validate().
+ */
+struct bpf_tc *
+bpf_tc_build(const struct bpf_insn *f, int len)
+{
+	u_int16_t *map;
+	u_int8_t *target;
+	struct bpf_tc *tc;
+	struct bpf_tc_insn *ti;
+	u_int16_t op, next;
+	u_int i, n;
+
+	if (len < 1 || len > BPF_MAXINSNS) {
+		return NULL;
+	}
+	map = kalloc_data(len * sizeof(*map), Z_WAITOK | Z_ZERO);
+	target = kalloc_data(len, Z_WAITOK | Z_ZERO);
+	tc = kalloc_data(sizeof(*tc) + len * sizeof(tc->bt_insns[0]),
+	    Z_WAITOK | Z_ZERO);
+	if (map == NULL || target == NULL || tc == NULL) {
+		goto fail;
+	}
+
+	for (i = 0; i < (u_int)len; i++) {
+		op = bpf_tc_op(f[i].code);
+		if (op == BTC_JA) {
+			target[i + 1 + f[i].k] = 1;
+		} else if (bpf_tc_is_jump(op)) {
+			target[i + 1 + f[i].jt] = 1;
+			target[i + 1 + f[i].jf] = 1;
+		}
+	}
+
+	/* lay out the instructions, fusing where allowed */
+	for (i = 0, n = 0; i < (u_int)len; i++, n++) {
+		ti = &tc->bt_insns[n];
+		map[i] = (u_int16_t)n;
+		op = bpf_tc_op(f[i].code);
+		if (op == BTC_NONE) {
+			ti->op = BTC_RET_K;
+			ti->k = 0;
+			continue;
+		}
+		ti->op = op;
+		ti->k = f[i].k;
+		if (op >= BTC_LD_W_ABS && op <= BTC_LD_B_ABS &&
+		    i + 1 < (u_int)len && !target[i + 1]) {
+			next = bpf_tc_op(f[i + 1].code);
+			if ((next = bpf_tc_fused_op(op, next)) != BTC_NONE) {
+				ti->op = next;
+				ti->k2 = f[i + 1].k;
+				/* branch targets are resolved from map below */
+				ti->jt = (u_int16_t)(i + 2 + f[i + 1].jt);
+				ti->jf = (u_int16_t)(i + 2 + f[i + 1].jf);
+				map[++i] = (u_int16_t)n;
+				continue;
+			}
+		}
+		if (op == BTC_JA) {
+			ti->jt = (u_int16_t)(i + 1 + f[i].k);
+		} else if (bpf_tc_is_jump(op)) {
+			ti->jt = (u_int16_t)(i + 1 + f[i].jt);
+			ti->jf = (u_int16_t)(i + 1 + f[i].jf);
+		}
+	}
+	tc->bt_len = n;
+
+	for (i = 0; i < n; i++) {
+		ti = &tc->bt_insns[i];
+		if (bpf_tc_is_jump(ti->op) || ti->op >= BTC_LD_W_ABS_JEQ) {
+			ti->jt = map[bpf_tc_thread(f, ti->jt)];
+			if (ti->op != BTC_JA) {
+				ti->jf = map[bpf_tc_thread(f, ti->jf)];
+			}
+		}
+	}
+	kfree_data(map, len * sizeof(*map));
+	kfree_data(target, len);
+	return tc;
+
+fail:
+	if (map != NULL) {
+		kfree_data(map, len * sizeof(*map));
+	}
+	if (target != NULL) {
+		kfree_data(target, len);
+	}
+	if (tc != NULL) {
+		kfree_data(tc, sizeof(*tc) + len * sizeof(tc->bt_insns[0]));
+	}
+	return NULL;
+}
+
+void
+bpf_tc_free(struct bpf_tc *tc)
+{
+	kfree_data_addr(tc);
+}
+
+static void
+bpf_tc_pkt_init(struct bpf_tc_pkt *pk, struct bpf_packet *bp)
+{
+	pk->bp = bp;
+	pk->hdr = bp->bpfp_header;
+	pk->hdrlen = (u_int32_t)bp->bpfp_header_length;
+	pk->data = NULL;
+	pk->datalen = 0;
+
+	switch (bp->bpfp_type) {
+	case BPF_PACKET_TYPE_MBUF:
+		if (bp->bpfp_mbuf != NULL) {
+			pk->data = mtod(bp->bpfp_mbuf, u_char *);
+			pk->datalen = bp->bpfp_mbuf->m_len;
+		}
+		break;
+#if SKYWALK
+	case BPF_PACKET_TYPE_PKT: {
+		kern_buflet_t buflet;
+
+		buflet = kern_packet_get_next_buflet(bp->bpfp_pkt, NULL);
+		if (buflet != NULL &&
+		    (pk->data = buflet_get_address(buflet)) != NULL) {
+			pk->datalen = kern_buflet_get_data_length(buflet);
+		}
+		break;
+	}
+#endif /* SKYWALK */
+	default:
+		/* bp_x*() fail all loads, so must the fast path */
+		pk->hdrlen = 0;
+		break;
+	}
+}
+
+/* the size bytes at k, if they are contiguous in the header or first segment */
+static inline u_char *
+bpf_tc_ptr(const struct bpf_tc_pkt *pk, u_int32_t k, u_int32_t size)
+{
+	if (k < pk->hdrlen) {
+		return size <= pk->hdrlen - k ? pk->hdr + k : NULL;
+	}
+	k -= pk->hdrlen;
+	if (k < pk->datalen && size <= pk->datalen - k) {
+		return pk->data + k;
+	}
+	return NULL;
+}
+
+static inline int
+bpf_tc_ld_w(const struct bpf_tc_pkt *pk, u_int32_t k, u_int32_t *v)
+{
+	u_char *cp = bpf_tc_ptr(pk, k, sizeof(int32_t));
+	int err;
+
+	if (cp != NULL) {
+		*v = EXTRACT_LONG(cp);
+		return 0;
+	}
+	*v = bp_xword(pk->bp, k, &err);
+	return err;
+}
+
+static inline int
+bpf_tc_ld_h(const struct bpf_tc_pkt *pk, u_int32_t k, u_int32_t *v)
+{
+	u_char *cp = bpf_tc_ptr(pk, k, sizeof(int16_t));
+	int err;
+
+	if (cp != NULL) {
+		*v = EXTRACT_SHORT(cp);
+		return 0;
+	}
+	*v = bp_xhalf(pk->bp, k, &err);
+	return err;
+}
+
+static inline int
+bpf_tc_ld_b(const struct bpf_tc_pkt *pk, u_int32_t k, u_int32_t *v)
+{
+	u_char *cp = bpf_tc_ptr(pk, k, sizeof(u_int8_t));
+	int err;
+
+	if (cp != NULL) {
+		*v = *cp;
+		return 0;
+	}
+	*v = bp_xbyte(pk->bp, k, &err);
+	return err;
+}
+
+/*
+ * Execute pre-decoded filter code on a packet, with the same result as
+ * bpf_filter() on the program it was built from.
+ */
+u_int
+bpf_tc_filter(const struct bpf_tc *tc, struct bpf_packet *bp, u_int wirelen)
+{
+	const struct bpf_tc_insn *insns = tc->bt_insns;
+	const struct bpf_tc_insn *pc = insns;
+	u_int32_t A = 0, X = 0, v;
+	int32_t mem[BPF_MEMWORDS];
+	struct bpf_tc_pkt pk;
+
+	bzero(mem, sizeof(mem));
+	bpf_tc_pkt_init(&pk, bp);
+
+	for (;;) {
+		switch (pc->op) {
+		case BTC_RET_K:
+			return (u_int)pc->k;
+		case BTC_RET_A:
+			return (u_int)A;
+		case BTC_LD_W_ABS:
+			if (bpf_tc_ld_w(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LD_H_ABS:
+			if (bpf_tc_ld_h(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LD_B_ABS:
+			if (bpf_tc_ld_b(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LD_W_IND:
+			if (bpf_tc_ld_w(&pk, X + pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LD_H_IND:
+			if (bpf_tc_ld_h(&pk, X + pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LD_B_IND:
+			if (bpf_tc_ld_b(&pk, X + pc->k, &A) != 0) {
+				return 0;
+			}
+			break;
+		case BTC_LDX_MSH:
+			if (bpf_tc_ld_b(&pk, pc->k, &v) != 0) {
+				return 0;
+			}
+			X = (v & 0xf) << 2;
+			break;
+		case BTC_LD_LEN:
+			A = wirelen;
+			break;
+		case BTC_LDX_LEN:
+			X = wirelen;
+			break;
+		case BTC_LD_IMM:
+			A = pc->k;
+			break;
+		case BTC_LDX_IMM:
+			X = pc->k;
+			break;
+		/* memory indices were checked by bpf_validate() */
+		case BTC_LD_MEM:
+			A = mem[pc->k];
+			break;
+		case BTC_LDX_MEM:
+			X = mem[pc->k];
+			break;
+		case BTC_ST:
+			mem[pc->k] = A;
+			break;
+		case BTC_STX:
+			mem[pc->k] = X;
+			break;
+		case BTC_JA:
+			pc = &insns[pc->jt];
+			continue;
+		case BTC_JGT_K:
+			pc = &insns[(A > pc->k) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JGE_K:
+			pc = &insns[(A >= pc->k) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JEQ_K:
+			pc = &insns[(A == pc->k) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JSET_K:
+			pc = &insns[(A & pc->k) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JGT_X:
+			pc = &insns[(A > X) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JGE_X:
+			pc = &insns[(A >= X) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JEQ_X:
+			pc = &insns[(A == X) ? pc->jt : pc->jf];
+			continue;
+		case BTC_JSET_X:
+			pc = &insns[(A & X) ? pc->jt : pc->jf];
+			continue;
+		case BTC_ADD_X:
+			A += X;
+			break;
+		case BTC_SUB_X:
+			A -= X;
+			break;
+		case BTC_MUL_X:
+			A *= X;
+			break;
+		case BTC_DIV_X:
+			if (X == 0) {
+				return 0;
+			}
+			A /= X;
+			break;
+		case BTC_AND_X:
+			A &= X;
+			break;
+		case BTC_OR_X:
+			A |= X;
+			break;
+		case BTC_LSH_X:
+			A <<= X;
+			break;
+		case BTC_RSH_X:
+			A >>= X;
+			break;
+		case BTC_ADD_K:
+			A += pc->k;
+			break;
+		case BTC_SUB_K:
+			A -= pc->k;
+			break;
+		case BTC_MUL_K:
+			A *= pc->k;
+			break;
+		case BTC_DIV_K:
+			A /= pc->k;
+			break;
+		case BTC_AND_K:
+			A &= pc->k;
+			break;
+		case BTC_OR_K:
+			A |= pc->k;
+			break;
+		case BTC_LSH_K:
+			A <<= pc->k;
+			break;
+		case BTC_RSH_K:
+			A >>= pc->k;
+			break;
+		case BTC_NEG:
+			A = -A;
+			break;
+		case BTC_TAX:
+			X = A;
+			break;
+		case BTC_TXA:
+			A = X;
+			break;
+		case BTC_LD_W_ABS_JEQ:
+			if (bpf_tc_ld_w(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A == pc->k2) ? pc->jt : pc->jf];
+			continue;
+		case BTC_LD_H_ABS_JEQ:
+			if (bpf_tc_ld_h(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A == pc->k2) ? pc->jt : pc->jf];
+			continue;
+		case BTC_LD_B_ABS_JEQ:
+			if (bpf_tc_ld_b(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A == pc->k2) ? pc->jt : pc->jf];
+			continue;
+		case BTC_LD_W_ABS_JSET:
+			if (bpf_tc_ld_w(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A & pc->k2) ? pc->jt : pc->jf];
+			continue;
+		case BTC_LD_H_ABS_JSET:
+			if (bpf_tc_ld_h(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A & pc->k2) ? pc->jt : pc->jf];
+			continue;
+		case BTC_LD_B_ABS_JSET:
+			if (bpf_tc_ld_b(&pk, pc->k, &A) != 0) {
+				return 0;
+			}
+			pc = &insns[(A & pc->k2) ? pc->jt : pc->jf];
+			continue;
+		default:
+			return 0;
+		}
+		pc++;
+	}
+}
+
+#if DEVELOPMENT || DEBUG
+
+#include <kern/clock.h>
+
+#define BPF_TC_TEST_PROGS       2000
+#define BPF_TC_TEST_PKTS        32
+#define BPF_TC_TEST_MAXLEN      600
+
+static u_int32_t
+bpf_tc_test_rand(u_int64_t *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (u_int32_t)(*seed >> 33);
+}
+
+/* constants that occur in real filters, so that tests go both ways */
+static u_int32_t
+bpf_tc_test_const(u_int64_t *seed)
+{
+	static const u_int32_t consts[] = {
+		0, 1, 4, 6, 17, 20, 53, 80, 443, 0x800, 0x86dd, 0x1fff,
+		0x45, 0xffffffff
+	};
+
+	if (bpf_tc_test_rand(seed) % 4 == 0) {
+		return bpf_tc_test_rand(seed);
+	}
+	return consts[bpf_tc_test_rand(seed) % (sizeof(consts) / sizeof(consts[0]))];
+}
+
+static u_int32_t
+bpf_tc_test_offset(u_int64_t *seed)
+{
+	switch (bpf_tc_test_rand(seed) % 8) {
+	case 0:
+		return bpf_tc_test_rand(seed) % BPF_TC_TEST_MAXLEN;
+	case 1:
+		return bpf_tc_test_rand(seed) % bpf_maxbufsize;
+	default:
+		return bpf_tc_test_rand(seed) % 64;
+	}
+}
+
+static void
+bpf_tc_test_prog(u_int64_t *seed, struct bpf_insn *f, u_int len)
+{
+	static const u_short ld[] = {
+		BPF_LD | BPF_W | BPF_ABS, BPF_LD | BPF_H | BPF_ABS,
+		BPF_LD | BPF_B | BPF_ABS, BPF_LD | BPF_W | BPF_IND,
+		BPF_LD | BPF_H | BPF_IND, BPF_LD | BPF_B | BPF_IND,
+		BPF_LDX | BPF_MSH | BPF_B,
+	};
+	static const u_short misc[] = {
+		BPF_LD | BPF_W | BPF_LEN, BPF_LDX | BPF_W | BPF_LEN,
+		BPF_LD | BPF_IMM, BPF_LDX | BPF_IMM, BPF_LD | BPF_MEM,
+		BPF_LDX | BPF_MEM, BPF_ST, BPF_STX, BPF_MISC | BPF_TAX,
+		BPF_MISC | BPF_TXA, BPF_ALU | BPF_NEG, BPF_RET | BPF_A,
+	};
+	static const u_short jmp[] = { BPF_JGT, BPF_JGE, BPF_JEQ, BPF_JSET };
+	static const u_short alu[] = {
+		BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_AND, BPF_OR,
+		BPF_LSH, BPF_RSH,
+	};
+	struct bpf_insn *p;
+	u_int i, left;
+
+	for (i = 0; i < len; i++) {
+		p = &f[i];
+		bzero(p, sizeof(*p));
+		left = len - i - 1;     /* instructions after this one */
+		if (left == 0) {
+			p->code = BPF_RET | BPF_K;
+			p->k = bpf_tc_test_rand(seed) % 2 ? 0 : 0x40000;
+			break;
+		}
+		switch (bpf_tc_test_rand(seed) % 10) {
+		case 0:
+		case 1:
+		case 2:
+			p->code = ld[bpf_tc_test_rand(seed) % 7];
+			p->k = bpf_tc_test_offset(seed);
+			break;
+		case 3:
+		case 4:
+		case 5:
+			if (bpf_tc_test_rand(seed) % 8 == 0) {
+				p->code = BPF_JMP | BPF_JA;
+				p->k = bpf_tc_test_rand(seed) % left;
+				break;
+			}
+			p->code = BPF_JMP | jmp[bpf_tc_test_rand(seed) % 4] |
+			    (bpf_tc_test_rand(seed) % 4 ? BPF_K : BPF_X);
+			p->k = bpf_tc_test_const(seed);
+			p->jt = (u_char)(bpf_tc_test_rand(seed) % MIN(left, 256));
+			p->jf = (u_char)(bpf_tc_test_rand(seed) % MIN(left, 256));
+			break;
+		case 6:
+		case 7:
+			p->code = BPF_ALU | alu[bpf_tc_test_rand(seed) % 8] |
+			    (bpf_tc_test_rand(seed) % 2 ? BPF_K : BPF_X);
+			p->k = bpf_tc_test_rand(seed) % 32;
+			if (p->code == (BPF_ALU | BPF_DIV | BPF_K) && p->k == 0) {
+				p->k = 3;
+			}
+			break;
+		case 8:
+			p->code = misc[bpf_tc_test_rand(seed) % 12];
+			p->k = bpf_tc_test_rand(seed) % BPF_MEMWORDS;
+			if (p->code == (BPF_LD | BPF_IMM) ||
+			    p->code == (BPF_LDX | BPF_IMM)) {
+				p->k = bpf_tc_test_const(seed);
+			}
+			break;
+		default:
+			/* opcodes the interpreter rejects at run time */
+			p->code = bpf_tc_test_rand(seed) % 2 ?
+			    (BPF_RET | BPF_K) : (BPF_MISC | 0x40);
+			p->k = bpf_tc_test_rand(seed) % 2 ? 0 : 0x40000;
+			break;
+		}
+	}
+}
+
+/*
+ * An mbuf chain with random split points and an optional header, holding
+ * either an IPv4 TCP/UDP frame or random bytes.
+ */
+static struct mbuf *
+bpf_tc_test_pkt(u_int64_t *seed, struct bpf_packet *bp, u_char *hdr)
+{
+	u_char data[BPF_TC_TEST_MAXLEN];
+	struct mbuf *top = NULL, **mp = &top, *m;
+	u_int len, off, chunk, i;
+
+	len = bpf_tc_test_rand(seed) % BPF_TC_TEST_MAXLEN;
+	for (i = 0; i < len; i++) {
+		data[i] = (u_char)bpf_tc_test_rand(seed);
+	}
+	if (len >= 54 && bpf_tc_test_rand(seed) % 4 != 0) {
+		data[12] = 0x08;
+		data[13] = 0x00;
+		data[14] = 0x45 + bpf_tc_test_rand(seed) % 3;
+		data[20] = data[21] = 0;
+		data[23] = bpf_tc_test_rand(seed) % 2 ? 6 : 17;
+		data[36] = 0;
+		data[37] = bpf_tc_test_rand(seed) % 2 ? 80 : 53;
+	}
+
+	for (off = 0; off < len || top == NULL; off += chunk) {
+		m = m_get(M_WAIT, MT_DATA);
+		chunk = MIN(len - off, bpf_tc_test_rand(seed) % 5 == 0 ?
+		    bpf_tc_test_rand(seed) % 8 : (u_int)MLEN);
+		chunk = MIN(chunk, (u_int)MLEN);
+		bcopy(&data[off], mtod(m, u_char *), chunk);
+		m->m_len = chunk;
+		*mp = m;
+		mp = &m->m_next;
+	}
+
+	bzero(bp, sizeof(*bp));
+	bp->bpfp_type = BPF_PACKET_TYPE_MBUF;
+	bp->bpfp_mbuf = top;
+	if (bpf_tc_test_rand(seed) % 2) {
+		bp->bpfp_header = hdr;
+		bp->bpfp_header_length = 1 + bpf_tc_test_rand(seed) % 32;
+		for (i = 0; i < bp->bpfp_header_length; i++) {
+			hdr[i] = (u_char)bpf_tc_test_rand(seed);
+		}
+	}
+	bp->bpfp_total_length = bp->bpfp_header_length + len;
+	return top;
+}
+
+/*
+ * Run random programs over random packets through both the interpreter
+ * and the threaded code, and count the results that differ.
+ */
+static int
+bpf_tc_test(int64_t in, int64_t *out)
+{
+	struct bpf_insn f[64];
+	struct bpf_packet bps[BPF_TC_TEST_PKTS];
+	struct mbuf *ms[BPF_TC_TEST_PKTS];
+	u_char hdrs[BPF_TC_TEST_PKTS][32];
+	u_int64_t seed = (u_int64_t)in;
+	u_int i, j, len, progs = 0, accepted = 0, mismatches = 0;
+	struct bpf_tc *tc;
+	u_int r1, r2;
+
+	for (j = 0; j < BPF_TC_TEST_PKTS; j++) {
+		ms[j] = bpf_tc_test_pkt(&seed, &bps[j], hdrs[j]);
+	}
+
+	for (i = 0; i < BPF_TC_TEST_PROGS; i++) {
+		len = 1 + bpf_tc_test_rand(&seed) % 64;
+		bpf_tc_test_prog(&seed, f, len);
+		if (!bpf_validate(f, (int)len)) {
+			continue;
+		}
+		if ((tc = bpf_tc_build(f, (int)len)) == NULL) {
+			mismatches++;
+			continue;
+		}
+		progs++;
+		for (j = 0; j < BPF_TC_TEST_PKTS; j++) {
+			r1 = bpf_filter(f, (u_char *)&bps[j],
+			    (u_int)bps[j].bpfp_total_length, 0);
+			r2 = bpf_tc_filter(tc, &bps[j],
+			    (u_int)bps[j].bpfp_total_length);
+			if (r1 != r2) {
+				mismatches++;
+			} else if (r1 != 0) {
+				accepted++;
+			}
+		}
+		bpf_tc_free(tc);
+	}
+
+	for (j = 0; j < BPF_TC_TEST_PKTS; j++) {
+		m_freem(ms[j]);
+	}
+	printf("%s: %u programs, %u accepted, %u mismatches\n", __func__,
+	    progs, accepted, mismatches);
+	*out = (mismatches == 0 && progs > 0 && accepted > 0);
+	return 0;
+}
+SYSCTL_TEST_REGISTER(bpf_threaded_code, bpf_tc_test);
+
+/*
+ * Nanoseconds per thousand packets for "ip and tcp dst port 80" on a TCP
+ * frame, through the interpreter (in == 0) or the threaded code.
+ */
+static int
+bpf_tc_bench(int64_t in, int64_t *out)
+{
+	static const struct bpf_insn f[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x800, 0, 8),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 6),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+		BPF_STMT(BPF_LDX | BPF_MSH | BPF_B, 14),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0x40000),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	const u_int len = sizeof(f) / sizeof(f[0]);
+	const u_int iterations = 1000000;
+	struct bpf_packet bp = {};
+	struct bpf_tc *tc;
+	struct mbuf *m;
+	u_char *p;
+	uint64_t start, ns;
+	u_int i, r = 0;
+
+	if ((tc = bpf_tc_build(f, len)) == NULL) {
+		return ENOMEM;
+	}
+	m = m_get(M_WAIT, MT_DATA);
+	p = mtod(m, u_char *);
+	bzero(p, 54);
+	p[12] = 0x08;
+	p[14] = 0x45;
+	p[23] = 6;
+	p[37] = 80;
+	m->m_len = 54;
+	bp.bpfp_type = BPF_PACKET_TYPE_MBUF;
+	bp.bpfp_mbuf = m;
+	bp.bpfp_total_length = 54;
+
+	start = mach_absolute_time();
+	for (i = 0; i < iterations; i++) {
+		if (in == 0) {
+			r += bpf_filter(f, (u_char *)&bp, 54, 0) != 0;
+		} else {
+			r += bpf_tc_filter(tc, &bp, 54) != 0;
+		}
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+
+	m_freem(m);
+	bpf_tc_free(tc);
+	if (r != iterations) {
+		return EINVAL;
+	}
+	*out = (int64_t)(ns / (iterations / 1000));
+	return 0;
+}
+SYSCTL_TEST_REGISTER(bpf_threaded_code_bench, bpf_tc_bench);
+
+#endif /* DEVELOPMENT || DEBUG */
+#endif /* KERNEL */
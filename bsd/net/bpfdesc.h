@@ -110,6 +110,7 @@ struct bpf_d {
 	uint32_t        bd_rtout;       /* Read timeout in 'ticks' */
 	struct bpf_if   *bd_bif;         /* interface descriptor */
 	struct bpf_insn *bd_filter;     /* filter code */
+	struct bpf_tc   *bd_tcode;      /* pre-decoded filter code */
 	uint64_t        bd_rcount;      /* number of packets received */
 	uint64_t        bd_dcount;      /* number of received packets dropped */
 	uint64_t        bd_fcount;      /* number of received packets which matched filter */
@@ -150,6 +151,23 @@ struct bpf_d {
 	caddr_t         bd_prev_fbuf;
 
 	struct bpf_comp_stats bd_bcs;
+
+	struct bpf_ring *bd_ring;       /* shared memory capture ring */
+};
+
+/*
+ * Kernel side of a capture ring set up with BIOCSETRING.  While a ring
+ * is set, bd_sbuf points at the packet area of the block being filled
+ * (or is NULL when every block is held by the process) and there are
+ * no hold or free buffers.
+ */
+struct bpf_ring {
+	struct bpf_ring_hdr *br_hdr;    /* shared header, also the mapping base */
+	vm_offset_t     br_kaddr;       /* kernel address of the ring */
+	vm_size_t       br_size;        /* size of the ring */
+	uint32_t        br_prod;        /* kernel copy of brh_prod */
+	uint32_t        br_block_size;
+	uint32_t        br_block_count;
 };
 
 /* Values for bd_state */
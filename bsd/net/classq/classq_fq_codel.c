@@ -96,6 +96,114 @@ SYSCTL_QUAD(_net_classq, OID_AUTO, l4s_ce_threshold,
     "L4S CE threshold");
 #endif /* (DEBUG || DEVELOPMENT) */
 
+/*
+ * Coupled L4S marking, after the DualQ coupled AQM of RFC 9332 but
+ * without its separate L4S queue: fq_codel already gives every flow,
+ * L4S (ECT(1)) or classic, its own flow queue, and what is taken over
+ * is the coupling of the marking rates.  Per class, a PI2 controller
+ * drives a base probability p' from the queueing delay of the classic
+ * traffic.  Classic packets are marked, or dropped if not ECN capable,
+ * with probability p'^2 when they arrive; L4S packets are CE marked
+ * when they leave, right away past a shallow step threshold and
+ * otherwise with the coupled probability k * p'.
+ */
+static uint32_t fq_codel_l4s_coupled = 0;
+SYSCTL_UINT(_net_classq, OID_AUTO, l4s_coupled, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &fq_codel_l4s_coupled, 0,
+    "couple L4S marking to a PI2 controller on the classic traffic");
+
+static uint64_t fq_codel_l4s_coupled_step = (1ULL * 1000 * 1000); /* 1 ms */
+SYSCTL_QUAD(_net_classq, OID_AUTO, l4s_coupled_step,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &fq_codel_l4s_coupled_step,
+    "L4S step marking threshold in nanoseconds with coupled marking");
+
+#define PI2_TUPDATE     (16ULL * 1000 * 1000)   /* PI update interval, 16 ms */
+#define PI2_ALPHA       10995116LL      /* 0.16 Hz * Tupdate, scaled by 2^32 */
+#define PI2_BETA        219902326LL     /* 3.2 Hz * Tupdate, scaled by 2^32 */
+#define PI2_K           2               /* coupling factor */
+
+/* true with probability prob / 2^32 */
+static inline bool
+fq_pi2_random(uint64_t prob)
+{
+	return ((uint64_t)random() << 1) < prob;
+}
+
+/* Arrival time of the packet at the head of a flow queue, or 0 */
+static inline uint64_t
+fq_head_timestamp(fq_t *fq, classq_pkt_type_t ptype)
+{
+	if (fq_empty(fq, ptype)) {
+		return 0;
+	}
+	switch (ptype) {
+	case QP_MBUF:
+		return MBUFQ_FIRST(&fq->fq_mbufq)->m_pkthdr.pkt_timestamp;
+#if SKYWALK
+	case QP_PACKET:
+		return KPKTQ_FIRST(&fq->fq_kpktq)->pkt_timestamp;
+#endif /* SKYWALK */
+	default:
+		VERIFY(0);
+		/* NOTREACHED */
+		__builtin_unreachable();
+	}
+}
+
+/*
+ * Run the PI controller once every Tupdate.  Its input is the queueing
+ * delay of the classic traffic of the class at that moment: the sojourn
+ * time of the oldest packet at the head of a classic flow queue, which
+ * is what the head of a single classic queue would have waited.
+ */
+static void
+fq_pi2_update(fq_if_t *fqs, fq_if_classq_t *fq_cl, fq_t *fq, uint64_t now)
+{
+	int64_t curq, prevq, target, prob;
+	uint64_t head, oldest = now;
+	fq_t *cfq;
+
+	if (now < fq_cl->fcl_pi2_update) {
+		return;
+	}
+	STAILQ_FOREACH(cfq, &fq_cl->fcl_new_flows, fq_actlink) {
+		if (cfq->fq_tfc_type == FQ_TFC_C &&
+		    (head = fq_head_timestamp(cfq, fqs->fqs_ptype)) != 0) {
+			oldest = MIN(oldest, head);
+		}
+	}
+	STAILQ_FOREACH(cfq, &fq_cl->fcl_old_flows, fq_actlink) {
+		if (cfq->fq_tfc_type == FQ_TFC_C &&
+		    (head = fq_head_timestamp(cfq, fqs->fqs_ptype)) != 0) {
+			oldest = MIN(oldest, head);
+		}
+	}
+	curq = (int64_t)MIN(now - oldest, NSEC_PER_SEC);
+	prevq = (int64_t)fq_cl->fcl_pi2_prev_qdelay;
+	target = (int64_t)FQ_GROUP(fq)->fqg_target_qdelays[FQ_TFC_C];
+
+	prob = (int64_t)fq_cl->fcl_pi2_prob +
+	    ((curq - target) * PI2_ALPHA + (curq - prevq) * PI2_BETA) /
+	    (int64_t)NSEC_PER_SEC;
+	fq_cl->fcl_pi2_prob = (uint32_t)MIN(MAX(prob, 0), UINT32_MAX);
+	fq_cl->fcl_pi2_prev_qdelay = curq;
+	fq_cl->fcl_pi2_update = now + PI2_TUPDATE;
+}
+
+/* Fold a sojourn time into a per traffic type average and maximum */
+static inline void
+fq_sojourn_update(uint64_t *avg, uint64_t *max, uint64_t qdelay)
+{
+	if (*avg == 0) {
+		*avg = qdelay;
+	} else {
+		*avg = *avg - (*avg >> 3) + (qdelay >> 3);
+	}
+	if (qdelay > *max) {
+		*max = qdelay;
+	}
+}
+
 void
 fq_codel_init(void)
 {
@@ -374,6 +482,27 @@ fq_addq(fq_if_t *fqs, fq_if_group_t *fq_grp, pktsched_pkt_t *pkt,
 	 */
 	VERIFY(fq->fq_tfc_type == FQ_TFC_C);
 
+	/*
+	 * Coupled marking: classic traffic sees the square of the base
+	 * probability.  Flows that take flow advisories are left to those.
+	 */
+	if (ifclassq_enable_l4s && fq_codel_l4s_coupled != 0 &&
+	    fq_cl->fcl_pi2_prob != 0 &&
+	    !((fq->fq_flags & FQF_FLOWCTL_CAPABLE) &&
+	    (*pkt_flags & PKTF_FLOW_ADV)) &&
+	    fq_pi2_random(((uint64_t)fq_cl->fcl_pi2_prob *
+	    fq_cl->fcl_pi2_prob) >> 32)) {
+		if (pktsched_mark_ecn(pkt) == 0) {
+			fq_cl->fcl_stat.fcl_classic_ce_marked++;
+		} else {
+			droptype = DTYPE_EARLY;
+			fq_cl->fcl_stat.fcl_classic_pi2_drops += cnt;
+			fq_cl->fcl_stat.fcl_drop_early += cnt;
+			IFCQ_DROP_ADD(fqs->fqs_ifq, cnt, pktsched_get_pkt_len(pkt));
+			goto no_drop;
+		}
+	}
+
 	if (__improbable(FQ_IS_DELAY_HIGH(fq) || FQ_IS_OVERWHELMING(fq))) {
 		if ((fq->fq_flags & FQF_FLOWCTL_CAPABLE) &&
 		    (*pkt_flags & PKTF_FLOW_ADV)) {
@@ -664,8 +793,29 @@ fq_getq_flow(fq_if_t *fqs, fq_t *fq, pktsched_pkt_t *pkt, uint64_t now)
 		}
 	}
 
+	if (ifclassq_enable_l4s && fq_codel_l4s_coupled != 0) {
+		fq_pi2_update(fqs, fq_cl, fq, now);
+	}
+
 	if (ifclassq_enable_l4s && l4s_pkt) {
-		if ((l4s_ce_threshold != 0 && qdelay > l4s_ce_threshold) ||
+		fq_sojourn_update(&fq_cl->fcl_stat.fcl_l4s_avg_sojourn,
+		    &fq_cl->fcl_stat.fcl_l4s_max_sojourn, (uint64_t)qdelay);
+		if (fq_codel_l4s_coupled != 0 && l4s_ce_threshold == 0) {
+			if ((uint64_t)qdelay > fq_codel_l4s_coupled_step) {
+				if (pktsched_mark_ecn(pkt) == 0) {
+					fq_cl->fcl_stat.fcl_ce_marked++;
+				} else {
+					fq_cl->fcl_stat.fcl_ce_mark_failures++;
+				}
+			} else if (fq_pi2_random((uint64_t)PI2_K *
+			    fq_cl->fcl_pi2_prob)) {
+				if (pktsched_mark_ecn(pkt) == 0) {
+					fq_cl->fcl_stat.fcl_coupled_ce_marked++;
+				} else {
+					fq_cl->fcl_stat.fcl_ce_mark_failures++;
+				}
+			}
+		} else if ((l4s_ce_threshold != 0 && qdelay > l4s_ce_threshold) ||
 		    (l4s_ce_threshold == 0 && qdelay > FQ_TARGET_DELAY(fq))) {
 			if (pktsched_mark_ecn(pkt) == 0) {
 				fq_cl->fcl_stat.fcl_ce_marked++;
@@ -676,6 +826,8 @@ fq_getq_flow(fq_if_t *fqs, fq_t *fq, pktsched_pkt_t *pkt, uint64_t now)
 		/* skip steps not needed for L4S traffic */
 		goto out;
 	}
+	fq_sojourn_update(&fq_cl->fcl_stat.fcl_classic_avg_sojourn,
+	    &fq_cl->fcl_stat.fcl_classic_max_sojourn, (uint64_t)qdelay);
 
 	if (fq->fq_min_qdelay == 0 ||
 	    (qdelay > 0 && (u_int64_t)qdelay < fq->fq_min_qdelay)) {
@@ -53,6 +53,13 @@
 #include <skywalk/nexus/netif/nx_netif.h>
 #endif /* SKYWALK */
 
+static void ifclassq_mq_setup(struct ifclassq *);
+static void ifclassq_mq_teardown(struct ifclassq *);
+static errno_t ifclassq_mq_enqueue(struct ifclassq *, classq_pkt_t *,
+    classq_pkt_t *, u_int32_t, u_int32_t, boolean_t *);
+static int ifclassq_mq_dequeue(struct ifclassq *, mbuf_svc_class_t,
+    boolean_t, u_int32_t, u_int32_t, classq_pkt_t *, classq_pkt_t *,
+    u_int32_t *, u_int32_t *, u_int8_t);
 static errno_t ifclassq_dequeue_common(struct ifclassq *, mbuf_svc_class_t,
     u_int32_t, u_int32_t, classq_pkt_t *, classq_pkt_t *, u_int32_t *,
     u_int32_t *, boolean_t, u_int8_t);
@@ -109,6 +116,26 @@ SYSCTL_UINT(_net_classq, OID_AUTO, flow_control_adv,
 uint16_t fq_codel_quantum = 0;
 #endif /* DEBUG || DEVELOPMENT */
 
+static uint32_t ifclassq_mq_queues = 0;
+SYSCTL_UINT(_net_classq, OID_AUTO, mq_queues,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &ifclassq_mq_queues, 0,
+    "number of queues to spread the flows of newly attached interfaces over");
+
+#define IFCQ_MQ_MAX             16      /* max queues in multi-queue mode */
+
+/*
+ * The queues of a multi-queue ifclassq are locked with the front held,
+ * and their schedulers may convert those locks to full mutexes, so the
+ * front must not be held in spin mode.
+ */
+#define IFCQ_LOCK_DEQUEUE(_ifcq) do {                                   \
+	if (IFCQ_IS_MQ(_ifcq)) {                                        \
+	        IFCQ_LOCK(_ifcq);                                       \
+	} else {                                                        \
+	        IFCQ_LOCK_SPIN(_ifcq);                                  \
+	}                                                               \
+} while (0)
+
 static KALLOC_TYPE_DEFINE(ifcq_zone, struct ifclassq, NET_KT_DEFAULT);
 LCK_ATTR_DECLARE(ifcq_lock_attr, 0, 0);
 static LCK_GRP_DECLARE(ifcq_lock_group, "ifclassq locks");
@@ -181,6 +208,7 @@ ifclassq_setup(struct ifclassq *ifq, struct ifnet *ifp, uint32_t sflags)
 		err = ifclassq_pktsched_setup(ifq);
 		if (err == 0) {
 			ifq->ifcq_flags = (IFCQF_READY | IFCQF_ENABLED);
+			ifclassq_mq_setup(ifq);
 		}
 	}
 	IFCQ_UNLOCK(ifq);
@@ -201,6 +229,7 @@ ifclassq_teardown(struct ifclassq *ifq)
 			{ .rate = 0, .percent = 0, .depth = 0 };
 			(void) ifclassq_tbr_set(ifq, &tb, FALSE);
 		}
+		ifclassq_mq_teardown(ifq);
 		pktsched_teardown(ifq);
 		ifq->ifcq_flags &= ~IFCQF_READY;
 	}
@@ -240,6 +269,236 @@ ifclassq_pktsched_setup(struct ifclassq *ifq)
 	return err;
 }
 
+/*
+ * Split the front ifclassq into net.classq.mq_queues queues, each with
+ * its share of the queue and drop limits.  Only mbuf interfaces are
+ * split; the others keep the single queue.
+ */
+static void
+ifclassq_mq_setup(struct ifclassq *ifq)
+{
+	struct ifnet *ifp = ifq->ifcq_ifp;
+	u_int32_t n = MIN(ifclassq_mq_queues, IFCQ_MQ_MAX);
+	u_int32_t i;
+	int err = 0;
+
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+	VERIFY(!IFCQ_IS_MQ(ifq));
+
+	if (n < 2 || ifq != ifp->if_snd) {
+		return;
+	}
+#if SKYWALK
+	if ((ifp->if_eflags & IFEF_SKYWALK_NATIVE) != 0) {
+		return;
+	}
+#endif /* SKYWALK */
+
+	ifq->ifcq_mq = kalloc_type(struct ifclassq *, n, Z_WAITOK | Z_ZERO |
+	    Z_NOFAIL);
+	for (i = 0; i < n && err == 0; i++) {
+		struct ifclassq *cq = ifclassq_alloc();
+
+		cq->ifcq_ifp = ifp;
+		cq->ifcq_mq_front = ifq;
+		IFCQ_SET_MAXLEN(cq, MAX(IFCQ_MAXLEN(ifq) / n, 1));
+		IFCQ_PKT_DROP_LIMIT(cq) = IFCQ_PKT_DROP_LIMIT(ifq) / n;
+		IFCQ_TARGET_QDELAY(cq) = IFCQ_TARGET_QDELAY(ifq);
+		cq->ifcq_sflags = ifq->ifcq_sflags;
+
+		IFCQ_LOCK(cq);
+		err = ifclassq_pktsched_setup(cq);
+		if (err == 0) {
+			cq->ifcq_flags = (IFCQF_READY | IFCQF_ENABLED);
+		}
+		IFCQ_UNLOCK(cq);
+		ifq->ifcq_mq[i] = cq;
+	}
+	ifq->ifcq_mq_cnt = n;
+	ifq->ifcq_mq_next = 0;
+	ifq->ifcq_mq_granted = FALSE;
+
+	if (err != 0) {
+		printf("%s: failed to set up %u transmit queues, error %d\n",
+		    if_name(ifp), n, err);
+		ifclassq_mq_teardown(ifq);
+	}
+}
+
+static void
+ifclassq_mq_teardown(struct ifclassq *ifq)
+{
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+
+	if (!IFCQ_IS_MQ(ifq)) {
+		return;
+	}
+	for (u_int32_t i = 0; i < ifq->ifcq_mq_cnt; i++) {
+		if (ifq->ifcq_mq[i] == NULL) {
+			continue;
+		}
+		ifclassq_teardown(ifq->ifcq_mq[i]);
+		ifclassq_release(&ifq->ifcq_mq[i]);
+	}
+	kfree_type(struct ifclassq *, ifq->ifcq_mq_cnt, ifq->ifcq_mq);
+	ifq->ifcq_mq = NULL;
+	ifq->ifcq_mq_cnt = 0;
+	ifq->ifcq_mq_next = 0;
+	ifq->ifcq_mq_granted = FALSE;
+}
+
+/*
+ * Dequeue from the queues of a multi-queue ifclassq in deficit round
+ * robin, so that each gets about a quantum of bytes per turn however
+ * many flows were steered to it.  Each queue keeps its own deficit: a
+ * queue that overshoots its credit pays it off over its next turns,
+ * and one that empties loses what it had left.  A turn cut short by
+ * the limits is resumed by the next call.  The deficits are only
+ * touched here, under the front's lock.
+ */
+static int
+ifclassq_mq_dequeue(struct ifclassq *ifq, mbuf_svc_class_t sc,
+    boolean_t drvmgt, u_int32_t pkt_limit, u_int32_t byte_limit,
+    classq_pkt_t *head, classq_pkt_t *tail, u_int32_t *cnt, u_int32_t *len,
+    u_int8_t grp_idx)
+{
+	classq_pkt_t first = CLASSQ_PKT_INITIALIZER(first);
+	classq_pkt_t last = CLASSQ_PKT_INITIALIZER(last);
+	u_int32_t quantum, pkts = 0, bytes = 0, idle = 0;
+
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+	VERIFY(IFCQ_IS_MQ(ifq));
+
+	quantum = MAX(ifq->ifcq_ifp->if_mtu, FQ_IF_DEFAULT_QUANTUM);
+
+	while (pkts < pkt_limit && bytes < byte_limit &&
+	    idle < ifq->ifcq_mq_cnt) {
+		struct ifclassq *cq = ifq->ifcq_mq[ifq->ifcq_mq_next];
+		classq_pkt_t h = CLASSQ_PKT_INITIALIZER(h);
+		classq_pkt_t t = CLASSQ_PKT_INITIALIZER(t);
+		u_int32_t c = 0, l = 0;
+
+		if (!ifq->ifcq_mq_granted) {
+			cq->ifcq_mq_deficit += quantum;
+			ifq->ifcq_mq_granted = TRUE;
+		}
+
+		/* still paying off an overshoot from an earlier turn */
+		if (cq->ifcq_mq_deficit <= 0) {
+			goto next;
+		}
+
+		if (!IFCQ_IS_EMPTY(cq)) {
+			u_int32_t blimit = MIN(byte_limit - bytes,
+			    (u_int32_t)cq->ifcq_mq_deficit);
+
+			IFCQ_LOCK_SPIN(cq);
+			if (drvmgt) {
+				(void) fq_if_dequeue_sc_classq_multi(cq, sc,
+				    pkt_limit - pkts, blimit, &h, &t, &c, &l,
+				    grp_idx);
+			} else {
+				(void) fq_if_dequeue_classq_multi(cq,
+				    pkt_limit - pkts, blimit, &h, &t, &c, &l,
+				    grp_idx);
+			}
+			IFCQ_UNLOCK(cq);
+		}
+
+		if (h.cp_mbuf == NULL) {
+			/* nothing to send here; the turn and its credit end */
+			idle++;
+			cq->ifcq_mq_deficit = 0;
+			goto next;
+		}
+
+		idle = 0;
+		if (first.cp_mbuf == NULL) {
+			first = h;
+		} else {
+			last.cp_mbuf->m_nextpkt = h.cp_mbuf;
+		}
+		last = t;
+		pkts += c;
+		bytes += l;
+		cq->ifcq_mq_deficit -= l;
+
+		if (IFCQ_IS_EMPTY(cq)) {
+			cq->ifcq_mq_deficit = 0;
+		} else if (cq->ifcq_mq_deficit > 0) {
+			/* stopped by the caller's limits; resume next time */
+			continue;
+		}
+next:
+		ifq->ifcq_mq_granted = FALSE;
+		ifq->ifcq_mq_next = (ifq->ifcq_mq_next + 1) % ifq->ifcq_mq_cnt;
+	}
+
+	*head = first;
+	if (tail != NULL) {
+		*tail = last;
+	}
+	if (cnt != NULL) {
+		*cnt = pkts;
+	}
+	if (len != NULL) {
+		*len = bytes;
+	}
+	return 0;
+}
+
+/*
+ * Steer by flow so that a flow stays in order; packets without a flow
+ * hash all go to the first queue.  fq_codel files a chain under the
+ * flow of its first packet, so a chain is cut into runs of one flow,
+ * each enqueued on its own.  The first error is returned, and *pdrop
+ * is set if any run was dropped.
+ */
+static errno_t
+ifclassq_mq_enqueue(struct ifclassq *ifq, classq_pkt_t *head,
+    classq_pkt_t *tail, u_int32_t cnt, u_int32_t bytes, boolean_t *pdrop)
+{
+	struct mbuf *m = head->cp_mbuf, *last, *next;
+	errno_t err = 0, e;
+	boolean_t drop;
+
+	VERIFY(head->cp_ptype == QP_MBUF);
+
+	*pdrop = FALSE;
+	while (m != NULL) {
+		classq_pkt_t h = CLASSQ_PKT_INITIALIZER(h);
+		classq_pkt_t t = CLASSQ_PKT_INITIALIZER(t);
+		u_int32_t flowid = m->m_pkthdr.pkt_flowid;
+		u_int32_t c = 1, l = m_pktlen(m);
+
+		for (last = m; (next = last->m_nextpkt) != NULL &&
+		    next->m_pkthdr.pkt_flowid == flowid; last = next) {
+			c++;
+			l += m_pktlen(next);
+		}
+		if (m == head->cp_mbuf && next == NULL) {
+			/* a single flow, as chains usually are */
+			c = cnt;
+			l = bytes;
+			t = *tail;
+		} else {
+			last->m_nextpkt = NULL;
+			CLASSQ_PKT_INIT_MBUF(&t, last);
+		}
+		CLASSQ_PKT_INIT_MBUF(&h, m);
+
+		drop = FALSE;
+		e = fq_if_enqueue_classq(ifq->ifcq_mq[flowid % ifq->ifcq_mq_cnt],
+		    &h, &t, c, l, &drop);
+		if (err == 0) {
+			err = e;
+		}
+		*pdrop |= drop;
+		m = next;
+	}
+	return err;
+}
+
 void
 ifclassq_set_maxlen(struct ifclassq *ifq, u_int32_t maxqlen)
 {
@@ -276,7 +535,7 @@ ifclassq_get_len(struct ifclassq *ifq, mbuf_svc_class_t sc, u_int8_t grp_idx,
 
 		VERIFY(MBUF_VALID_SC(sc) || sc == MBUF_SC_UNSPEC);
 
-		err = fq_if_request_classq(ifq, CLASSQRQ_STAT_SC, &req);
+		err = ifclassq_request(ifq, CLASSQRQ_STAT_SC, &req);
 		if (packets != NULL) {
 			*packets = req.packets;
 		}
@@ -336,6 +595,9 @@ errno_t
 ifclassq_enqueue(struct ifclassq *ifq, classq_pkt_t *head, classq_pkt_t *tail,
     u_int32_t cnt, u_int32_t bytes, boolean_t *pdrop)
 {
+	if (__improbable(IFCQ_IS_MQ(ifq))) {
+		return ifclassq_mq_enqueue(ifq, head, tail, cnt, bytes, pdrop);
+	}
 	return fq_if_enqueue_classq(ifq, head, tail, cnt, bytes, pdrop);
 }
 
@@ -378,7 +640,19 @@ ifclassq_dequeue_common_default(struct ifclassq *ifq, mbuf_svc_class_t sc,
 	 * If the scheduler support dequeueing multiple packets at the
 	 * same time, call that one instead.
 	 */
-	if (drvmgt) {
+	if (IFCQ_IS_MQ(ifq)) {
+		int err;
+
+		IFCQ_LOCK(ifq);
+		err = ifclassq_mq_dequeue(ifq, sc, drvmgt, pkt_limit,
+		    byte_limit, head, tail, cnt, len, grp_idx);
+		IFCQ_UNLOCK(ifq);
+
+		if (err == 0 && head->cp_mbuf == NULL) {
+			err = EAGAIN;
+		}
+		return err;
+	} else if (drvmgt) {
 		int err;
 
 		IFCQ_LOCK_SPIN(ifq);
@@ -406,7 +680,7 @@ ifclassq_dequeue_common_default(struct ifclassq *ifq, mbuf_svc_class_t sc,
 
 dequeue_loop:
 	VERIFY(IFCQ_TBR_IS_ENABLED(ifq));
-	IFCQ_LOCK_SPIN(ifq);
+	IFCQ_LOCK_DEQUEUE(ifq);
 
 	while (i < pkt_limit && l < byte_limit) {
 		if (drvmgt) {
@@ -504,7 +778,65 @@ ifclassq_update(struct ifclassq *ifq, cqev_t ev)
 {
 	IFCQ_LOCK_ASSERT_HELD(ifq);
 	VERIFY(IFCQ_IS_READY(ifq));
-	fq_if_request_classq(ifq, CLASSQRQ_EVENT, (void *)ev);
+	ifclassq_request(ifq, CLASSQRQ_EVENT, (void *)ev);
+}
+
+/*
+ * Pass a request to the scheduler and, in multi-queue mode, to those
+ * of the queues, adding up what they report.
+ */
+int
+ifclassq_request(struct ifclassq *ifq, cqrq_t rq, void *arg)
+{
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+
+	if (__probable(!IFCQ_IS_MQ(ifq))) {
+		return fq_if_request_classq(ifq, rq, arg);
+	}
+
+	for (u_int32_t i = 0; i < ifq->ifcq_mq_cnt; i++) {
+		struct ifclassq *cq = ifq->ifcq_mq[i];
+
+		IFCQ_LOCK(cq);
+		switch (rq) {
+		case CLASSQRQ_PURGE_SC: {
+			cqrq_purge_sc_t *req = arg;
+			cqrq_purge_sc_t creq = { req->sc, req->flow, 0, 0 };
+
+			(void) fq_if_request_classq(cq, rq, &creq);
+			req->packets += creq.packets;
+			req->bytes += creq.bytes;
+			break;
+		}
+		case CLASSQRQ_STAT_SC: {
+			cqrq_stat_sc_t *req = arg;
+			cqrq_stat_sc_t creq = { req->sc, req->grp_idx, 0, 0 };
+
+			(void) fq_if_request_classq(cq, rq, &creq);
+			req->packets += creq.packets;
+			req->bytes += creq.bytes;
+			break;
+		}
+		case CLASSQRQ_THROTTLE:
+			if (((cqrq_throttle_t *)arg)->set) {
+				(void) fq_if_request_classq(cq, rq, arg);
+			}
+			break;
+		default:
+			(void) fq_if_request_classq(cq, rq, arg);
+			break;
+		}
+		IFCQ_UNLOCK(cq);
+	}
+
+	/*
+	 * The front's scheduler holds no packets and is asked last, so
+	 * that a purge leaves it with the counts the queues drained to.
+	 */
+	if (rq == CLASSQRQ_PURGE_SC || rq == CLASSQRQ_STAT_SC) {
+		return 0;
+	}
+	return fq_if_request_classq(ifq, rq, arg);
 }
 
 int
@@ -552,7 +884,24 @@ ifclassq_getqstats(struct ifclassq *ifq, u_int8_t gid, u_int32_t qid, void *ubuf
 	*(&ifqs->ifqs_dropcnt) = *(&ifq->ifcq_dropcnt);
 	ifqs->ifqs_scheduler = ifq->ifcq_type;
 
-	err = pktsched_getqstats(ifq, gid, qid, ifqs);
+	if (IFCQ_IS_MQ(ifq)) {
+		/* Totals over all the queues, class details of the first */
+		for (u_int32_t i = 0; i < ifq->ifcq_mq_cnt; i++) {
+			struct ifclassq *cq = ifq->ifcq_mq[i];
+
+			IFCQ_LOCK(cq);
+			PKTCNTR_ADD(&ifqs->ifqs_xmitcnt,
+			    cq->ifcq_xmitcnt.packets, cq->ifcq_xmitcnt.bytes);
+			PKTCNTR_ADD(&ifqs->ifqs_dropcnt,
+			    cq->ifcq_dropcnt.packets, cq->ifcq_dropcnt.bytes);
+			if (i == 0) {
+				err = pktsched_getqstats(cq, gid, qid, ifqs);
+			}
+			IFCQ_UNLOCK(cq);
+		}
+	} else {
+		err = pktsched_getqstats(ifq, gid, qid, ifqs);
+	}
 	IFCQ_UNLOCK(ifq);
 
 	if (err == 0 && (err = copyout((caddr_t)ifqs,
@@ -661,7 +1010,11 @@ ifclassq_tbr_dequeue_common(struct ifclassq *ifq, mbuf_svc_class_t sc,
 	 * ifclassq takes precedence over ALTQ queue;
 	 * ifcq_drain count is adjusted by the caller.
 	 */
-	if (drvmgt) {
+	if (IFCQ_IS_MQ(ifq)) {
+		(void) ifclassq_mq_dequeue(ifq, sc, drvmgt, 1,
+		    CLASSQ_DEQUEUE_MAX_BYTE_LIMIT, pkt, NULL, NULL, NULL,
+		    grp_idx);
+	} else if (drvmgt) {
 		fq_if_dequeue_sc_classq(ifq, sc, pkt, grp_idx);
 	} else {
 		fq_if_dequeue_classq(ifq, pkt, grp_idx);
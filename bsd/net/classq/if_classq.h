@@ -163,6 +163,22 @@ struct ifclassq {
 
 	/* token bucket regulator */
 	struct tb_regulator     ifcq_tbr;       /* TBR */
+
+	/*
+	 * Multi-queue mode (net.classq.mq_queues): the front ifclassq
+	 * steers each flow by its flow hash to one of ifcq_mq_cnt queues,
+	 * each an ifclassq with its own lock and scheduler, and dequeues
+	 * from them in deficit round robin.  The queues keep the packet
+	 * and byte counts of the front up to date through ifcq_mq_front;
+	 * the front's own scheduler holds no packets.  Each queue has its
+	 * own DRR deficit, which is protected by the front's lock.
+	 */
+	struct ifclassq         **ifcq_mq;      /* queues, on the front */
+	u_int32_t               ifcq_mq_cnt;
+	u_int32_t               ifcq_mq_next;   /* queue being served */
+	boolean_t               ifcq_mq_granted; /* it got its quantum */
+	struct ifclassq         *ifcq_mq_front; /* front, on a queue */
+	int32_t                 ifcq_mq_deficit; /* its DRR deficit, on a queue */
 };
 
 /* ifcq_flags */
@@ -175,6 +191,7 @@ struct ifclassq {
 #define IFCQ_IS_ENABLED(_ifcq)          ((_ifcq)->ifcq_flags & IFCQF_ENABLED)
 #define IFCQ_TBR_IS_ENABLED(_ifcq)      ((_ifcq)->ifcq_flags & IFCQF_TBR)
 #define IFCQ_IS_DESTROYED(_ifcq)        ((_ifcq)->ifcq_flags & IFCQF_DESTROYED)
+#define IFCQ_IS_MQ(_ifcq)               ((_ifcq)->ifcq_mq != NULL)
 
 /* classq enqueue return value */
 /* packet has to be dropped */
@@ -265,18 +282,40 @@ struct if_ifclassq_stats {
 #define IFCQ_LEN(_ifcq)         ((_ifcq)->ifcq_len)
 #define IFCQ_QFULL(_ifcq)       (IFCQ_LEN(_ifcq) >= (_ifcq)->ifcq_maxlen)
 #define IFCQ_IS_EMPTY(_ifcq)    (IFCQ_LEN(_ifcq) == 0)
-#define IFCQ_INC_LEN(_ifcq)     (IFCQ_LEN(_ifcq)++)
-#define IFCQ_DEC_LEN(_ifcq)     (IFCQ_LEN(_ifcq)--)
-#define IFCQ_ADD_LEN(_ifcq, _len) (IFCQ_LEN(_ifcq) += (_len))
-#define IFCQ_SUB_LEN(_ifcq, _len) (IFCQ_LEN(_ifcq) -= (_len))
+#define IFCQ_INC_LEN(_ifcq)     IFCQ_ADD_LEN(_ifcq, 1)
+#define IFCQ_DEC_LEN(_ifcq)     IFCQ_SUB_LEN(_ifcq, 1)
+#define IFCQ_ADD_LEN(_ifcq, _len) do {                                  \
+	IFCQ_LEN(_ifcq) += (_len);                                      \
+	if (__improbable((_ifcq)->ifcq_mq_front != NULL)) {             \
+	        atomic_add_32(&IFCQ_LEN((_ifcq)->ifcq_mq_front),        \
+	            (_len));                                            \
+	}                                                               \
+} while (0)
+#define IFCQ_SUB_LEN(_ifcq, _len) do {                                  \
+	IFCQ_LEN(_ifcq) -= (_len);                                      \
+	if (__improbable((_ifcq)->ifcq_mq_front != NULL)) {             \
+	        atomic_add_32(&IFCQ_LEN((_ifcq)->ifcq_mq_front),        \
+	            -(u_int32_t)(_len));                                \
+	}                                                               \
+} while (0)
 #define IFCQ_MAXLEN(_ifcq)      ((_ifcq)->ifcq_maxlen)
 #define IFCQ_SET_MAXLEN(_ifcq, _len) ((_ifcq)->ifcq_maxlen = (_len))
 #define IFCQ_TARGET_QDELAY(_ifcq)       ((_ifcq)->ifcq_target_qdelay)
 #define IFCQ_BYTES(_ifcq)       ((_ifcq)->ifcq_bytes)
-#define IFCQ_INC_BYTES(_ifcq, _len)     \
-    ((_ifcq)->ifcq_bytes = (_ifcq)->ifcq_bytes + (_len))
-#define IFCQ_DEC_BYTES(_ifcq, _len)     \
-    ((_ifcq)->ifcq_bytes = (_ifcq)->ifcq_bytes - (_len))
+#define IFCQ_INC_BYTES(_ifcq, _len) do {                                \
+	(_ifcq)->ifcq_bytes = (_ifcq)->ifcq_bytes + (_len);             \
+	if (__improbable((_ifcq)->ifcq_mq_front != NULL)) {             \
+	        atomic_add_32(&IFCQ_BYTES((_ifcq)->ifcq_mq_front),      \
+	            (_len));                                            \
+	}                                                               \
+} while (0)
+#define IFCQ_DEC_BYTES(_ifcq, _len) do {                                \
+	(_ifcq)->ifcq_bytes = (_ifcq)->ifcq_bytes - (_len);             \
+	if (__improbable((_ifcq)->ifcq_mq_front != NULL)) {             \
+	        atomic_add_32(&IFCQ_BYTES((_ifcq)->ifcq_mq_front),      \
+	            -(u_int32_t)(_len));                                \
+	}                                                               \
+} while (0)
 
 #define IFCQ_XMIT_ADD(_ifcq, _pkt, _len) do {                           \
 	PKTCNTR_ADD(&(_ifcq)->ifcq_xmitcnt, _pkt, _len);                \
@@ -308,6 +347,7 @@ extern void *ifclassq_poll_sc(struct ifclassq *, mbuf_svc_class_t,
 extern void ifclassq_update(struct ifclassq *, cqev_t);
 extern int ifclassq_attach(struct ifclassq *, u_int32_t, void *);
 extern void ifclassq_detach(struct ifclassq *);
+extern int ifclassq_request(struct ifclassq *, enum cqrq, void *);
 extern int ifclassq_getqstats(struct ifclassq *, u_int8_t, u_int32_t,
     void *, u_int32_t *);
 extern const char *ifclassq_ev2str(cqev_t);
@@ -401,6 +401,9 @@ static errno_t dlil_input_async(struct dlil_threading_info *, struct ifnet *,
 static errno_t dlil_input_sync(struct dlil_threading_info *, struct ifnet *,
     struct mbuf *, struct mbuf *, const struct ifnet_stat_increment_param *,
     boolean_t, struct thread *);
+static errno_t dlil_input_steer(struct dlil_threading_info *, struct ifnet *,
+    struct mbuf *, struct mbuf *, const struct ifnet_stat_increment_param *,
+    boolean_t, struct thread *);
 
 static void dlil_main_input_thread_func(void *, wait_result_t);
 static void dlil_main_input_thread_cont(void *, wait_result_t);
@@ -413,6 +416,8 @@ static void dlil_rxpoll_input_thread_cont(void *, wait_result_t);
 
 static int dlil_create_input_thread(ifnet_t, struct dlil_threading_info *,
     thread_continue_t *);
+static void dlil_create_steer_threads(ifnet_t, struct dlil_threading_info *);
+static void dlil_terminate_steer_threads(ifnet_t, struct dlil_threading_info *);
 static void dlil_terminate_input_thread(struct dlil_threading_info *);
 static void dlil_input_stats_add(const struct ifnet_stat_increment_param *,
     struct dlil_threading_info *, struct ifnet *, boolean_t);
@@ -467,6 +472,9 @@ static int sysctl_rcvq_maxlen SYSCTL_HANDLER_ARGS;
 static int sysctl_hwcksum_dbg_mode SYSCTL_HANDLER_ARGS;
 static int sysctl_hwcksum_dbg_partial_rxoff_forced SYSCTL_HANDLER_ARGS;
 static int sysctl_hwcksum_dbg_partial_rxoff_adj SYSCTL_HANDLER_ARGS;
+#if (DEVELOPMENT || DEBUG) && defined(__x86_64__)
+static int sysctl_cksum_simd SYSCTL_HANDLER_ARGS;
+#endif /* (DEVELOPMENT || DEBUG) && __x86_64__ */
 
 struct chain_len_stats tx_chain_len_stats;
 static int sysctl_tx_chain_len_stats SYSCTL_HANDLER_ARGS;
@@ -522,6 +530,7 @@ static KALLOC_TYPE_DEFINE(ifnet_fc_zone, struct ifnet_fc_entry, NET_KT_DEFAULT);
 
 extern void bpfdetach(struct ifnet *);
 extern void proto_input_run(void);
+extern unsigned int ml_wait_max_cpus(void);
 
 extern uint32_t udp_count_opportunistic(unsigned int ifindex,
     u_int32_t flags);
@@ -725,6 +734,12 @@ SYSCTL_PROC(_net_link_generic_system, OID_AUTO, hwcksum_dbg_partial_rxoff_adj,
     0, sysctl_hwcksum_dbg_partial_rxoff_adj, "I",
     "adjusted partial cksum rx offset");
 
+#if (DEVELOPMENT || DEBUG) && defined(__x86_64__)
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, cksum_simd,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, NULL, 0, sysctl_cksum_simd,
+    "I", "software cksum vector unit (0: scalar, 1: SSE2, 2: AVX2)");
+#endif /* (DEVELOPMENT || DEBUG) && __x86_64__ */
+
 static uint64_t hwcksum_dbg_verified = 0;
 SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
     hwcksum_dbg_verified, CTLFLAG_RD | CTLFLAG_LOCKED,
@@ -801,6 +816,24 @@ unsigned int net_rxpoll = 1;
 unsigned int net_affinity = 1;
 unsigned int net_async = 1;     /* 0: synchronous, 1: asynchronous */
 
+/*
+ * Receive flow steering: number of input threads created for each
+ * Ethernet interface using the asynchronous input model, taking effect
+ * when the interface is attached.  0 or 1 keeps a single input thread.
+ */
+#define DLIL_STEER_MAX  16
+static uint32_t dlil_rx_steer_queues = 0;
+static uint32_t dlil_rx_steer_seed;
+static int sysctl_rx_steer_queues SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, rx_steer_queues,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &dlil_rx_steer_queues, 0,
+    sysctl_rx_steer_queues, "IU", "input threads per interface for flow steering");
+
+static int sysctl_rx_steer_stats SYSCTL_HANDLER_ARGS;
+SYSCTL_NODE(_net_link_generic_system, OID_AUTO, rx_steer_stats,
+    CTLFLAG_RD | CTLFLAG_LOCKED, sysctl_rx_steer_stats,
+    "packets steered to each input thread of an interface");
+
 static kern_return_t dlil_affinity_set(struct thread *, u_int32_t);
 
 extern u_int32_t        inject_buckets;
@@ -2316,6 +2349,8 @@ dlil_clean_threading_info(struct dlil_threading_info *inp)
 	VERIFY(inp->dlth_driver_thread == THREAD_NULL);
 	VERIFY(inp->dlth_poller_thread == THREAD_NULL);
 	VERIFY(inp->dlth_affinity_tag == 0);
+	VERIFY(inp->dlth_steer == NULL && inp->dlth_nsteer == 0);
+	inp->dlth_steer_pkts = 0;
 #if IFNET_INPUT_SANITY_CHK
 	inp->dlth_pkts_cnt = 0;
 #endif /* IFNET_INPUT_SANITY_CHK */
@@ -2380,6 +2415,99 @@ dlil_affinity_set(struct thread *tp, u_int32_t tag)
 	           (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
 }
 
+/*
+ * Create the additional input threads used for receive flow steering.
+ * Each one gets its own affinity set (see dlil_create_input_thread), so
+ * the scheduler places them apart from each other.
+ */
+static void
+dlil_create_steer_threads(ifnet_t ifp, struct dlil_threading_info *inp)
+{
+	uint32_t n = MIN(dlil_rx_steer_queues, ml_wait_max_cpus());
+
+	VERIFY(inp != dlil_main_input_thread);
+	VERIFY(inp->dlth_steer == NULL);
+
+	if (n <= 1) {
+		return;
+	}
+
+	inp->dlth_steer = kalloc_type(struct dlil_threading_info *, n,
+	    Z_WAITOK_ZERO_NOFAIL);
+	inp->dlth_steer[0] = inp;
+	for (uint32_t i = 1; i < n; i++) {
+		struct dlil_threading_info *qinp;
+		thread_continue_t func = NULL;
+		int err;
+
+		qinp = kalloc_type(struct dlil_threading_info,
+		    Z_WAITOK_ZERO_NOFAIL);
+		ifnet_incr_pending_thread_count(ifp);
+		err = dlil_create_input_thread(ifp, qinp, &func);
+		VERIFY(err == 0 && func == dlil_input_thread_func);
+		inp->dlth_steer[i] = qinp;
+	}
+	inp->dlth_nsteer = n;
+	inp->dlth_strategy = dlil_input_steer;
+
+	if (dlil_verbose) {
+		DLIL_PRINTF("%s: %u input threads for flow steering\n",
+		    if_name(ifp), n);
+	}
+}
+
+/*
+ * Terminate the flow steering input threads of an interface being
+ * detached; called with the ifnet lock held exclusive, after the
+ * primary input thread is gone.
+ */
+static void
+dlil_terminate_steer_threads(ifnet_t ifp, struct dlil_threading_info *inp)
+{
+	struct dlil_threading_info **steer = inp->dlth_steer;
+	uint32_t n = inp->dlth_nsteer;
+
+	if (steer == NULL) {
+		return;
+	}
+	inp->dlth_steer = NULL;
+	inp->dlth_nsteer = 0;
+
+	for (uint32_t i = 1; i < n; i++) {
+		struct dlil_threading_info *qinp = steer[i];
+
+		/* tear down the input thread affinity */
+		if (qinp->dlth_affinity) {
+			(void) dlil_affinity_set(qinp->dlth_thread,
+			    THREAD_AFFINITY_TAG_NULL);
+			thread_deallocate(qinp->dlth_thread);
+			qinp->dlth_affinity_tag = 0;
+			qinp->dlth_affinity = FALSE;
+		}
+
+		lck_mtx_lock_spin(&qinp->dlth_lock);
+		qinp->dlth_flags |= DLIL_INPUT_TERMINATE;
+		if (!(qinp->dlth_flags & DLIL_INPUT_RUNNING)) {
+			wakeup_one((caddr_t)&qinp->dlth_flags);
+		}
+		lck_mtx_unlock(&qinp->dlth_lock);
+		ifnet_lock_done(ifp);
+
+		/* wait for the input thread to terminate */
+		lck_mtx_lock_spin(&qinp->dlth_lock);
+		while ((qinp->dlth_flags & DLIL_INPUT_TERMINATE_COMPLETE) == 0) {
+			(void) msleep(&qinp->dlth_flags, &qinp->dlth_lock,
+			    (PZERO - 1) | PSPIN, qinp->dlth_name, NULL);
+		}
+		lck_mtx_unlock(&qinp->dlth_lock);
+		ifnet_lock_exclusive(ifp);
+
+		dlil_clean_threading_info(qinp);
+		kfree_type(struct dlil_threading_info, qinp);
+	}
+	kfree_type(struct dlil_threading_info *, n, steer);
+}
+
 #if SKYWALK && defined(XNU_TARGET_OS_OSX)
 static void
 dlil_filter_event(struct eventhandler_entry_arg arg __unused,
@@ -2528,6 +2656,12 @@ dlil_init(void)
 
 	PE_parse_boot_argn("net_async", &net_async, sizeof(net_async));
 
+	if (PE_parse_boot_argn("net_rx_steer_queues", &dlil_rx_steer_queues,
+	    sizeof(dlil_rx_steer_queues))) {
+		dlil_rx_steer_queues = MIN(dlil_rx_steer_queues, DLIL_STEER_MAX);
+	}
+	read_frandom(&dlil_rx_steer_seed, sizeof(dlil_rx_steer_seed));
+
 	PE_parse_boot_argn("ifnet_debug", &ifnet_debug, sizeof(ifnet_debug));
 
 	VERIFY(dlil_pending_thread_cnt == 0);
@@ -4152,6 +4286,162 @@ dlil_input_sync(struct dlil_threading_info *inp,
 	return 0;
 }
 
+struct dlil_steer_key {
+	uint32_t        dsk_src[4];
+	uint32_t        dsk_dst[4];
+	uint16_t        dsk_sport;
+	uint16_t        dsk_dport;
+	uint8_t         dsk_proto;
+	uint8_t         dsk_pad[3];
+};
+
+/*
+ * Flow hash of an inbound Ethernet frame, whose link header has been
+ * stripped and is referred to by pkt_hdr.  Non-IP traffic hashes to 0;
+ * IP fragments hash on addresses and protocol only, so that all the
+ * fragments of a datagram stay together.
+ */
+static uint32_t
+dlil_steer_hash(struct mbuf *m)
+{
+	struct ether_header *eh = m->m_pkthdr.pkt_hdr;
+	struct dlil_steer_key key;
+	uint16_t ports[2];
+	int off;
+
+	if (m->m_pkthdr.pkt_flags & PKTF_FLOW_ID) {
+		return m->m_pkthdr.pkt_flowid;
+	}
+	if (eh == NULL || (caddr_t)eh == mtod(m, caddr_t)) {
+		return 0;
+	}
+
+	bzero(&key, sizeof(key));
+	switch (ntohs(eh->ether_type)) {
+	case ETHERTYPE_IP: {
+		struct ip ip;
+
+		if (m_pktlen(m) < (int)sizeof(ip)) {
+			return 0;
+		}
+		m_copydata(m, 0, sizeof(ip), &ip);
+		if (ip.ip_v != IPVERSION) {
+			return 0;
+		}
+		key.dsk_src[0] = ip.ip_src.s_addr;
+		key.dsk_dst[0] = ip.ip_dst.s_addr;
+		key.dsk_proto = ip.ip_p;
+		if (ntohs(ip.ip_off) & (IP_MF | IP_OFFMASK)) {
+			goto hash;
+		}
+		off = ip.ip_hl << 2;
+		break;
+	}
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr ip6;
+
+		if (m_pktlen(m) < (int)sizeof(ip6)) {
+			return 0;
+		}
+		m_copydata(m, 0, sizeof(ip6), &ip6);
+		if ((ip6.ip6_vfc & IPV6_VERSION_MASK) != IPV6_VERSION) {
+			return 0;
+		}
+		bcopy(&ip6.ip6_src, key.dsk_src, sizeof(key.dsk_src));
+		bcopy(&ip6.ip6_dst, key.dsk_dst, sizeof(key.dsk_dst));
+		key.dsk_proto = ip6.ip6_nxt;
+		off = sizeof(ip6);
+		break;
+	}
+	default:
+		return 0;
+	}
+
+	if ((key.dsk_proto == IPPROTO_TCP || key.dsk_proto == IPPROTO_UDP) &&
+	    m_pktlen(m) >= off + (int)sizeof(ports)) {
+		m_copydata(m, off, sizeof(ports), ports);
+		key.dsk_sport = ports[0];
+		key.dsk_dport = ports[1];
+	}
+hash:
+	return net_flowhash(&key, sizeof(key), dlil_rx_steer_seed);
+}
+
+/*
+ * Receive flow steering strategy: split the chain by flow hash and hand
+ * each part to the asynchronous strategy of the corresponding input
+ * thread.  All packets of a flow go to the same thread, which processes
+ * them in arrival order.
+ */
+static errno_t
+dlil_input_steer(struct dlil_threading_info *inp,
+    struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
+    const struct ifnet_stat_increment_param *s, boolean_t poll,
+    struct thread *tp)
+{
+#pragma unused(m_tail)
+	struct mbuf *heads[DLIL_STEER_MAX], *tails[DLIL_STEER_MAX];
+	struct ifnet_stat_increment_param qs[DLIL_STEER_MAX];
+	uint32_t n = inp->dlth_nsteer;
+	uint32_t bytes = 0, first;
+	struct mbuf *m, *next;
+
+	ASSERT(n > 1 && n <= DLIL_STEER_MAX);
+	if (m_head == NULL) {
+		return dlil_input_async(inp, ifp, m_head, m_tail, s, poll, tp);
+	}
+
+	bzero(heads, sizeof(heads[0]) * n);
+	bzero(qs, sizeof(qs[0]) * n);
+	for (m = m_head; m != NULL; m = next) {
+		uint32_t q = dlil_steer_hash(m) % n;
+
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (heads[q] == NULL) {
+			heads[q] = m;
+		} else {
+			tails[q]->m_nextpkt = m;
+		}
+		tails[q] = m;
+		qs[q].packets_in++;
+		qs[q].bytes_in += m_pktlen(m);
+		bytes += m_pktlen(m);
+	}
+
+	/*
+	 * The first thread given packets takes the remaining interface
+	 * stats; drivers may count the link header in bytes_in, so keep
+	 * the byte total as given.
+	 */
+	for (first = 0; heads[first] == NULL; first++) {
+		;
+	}
+	if (s->bytes_in > bytes) {
+		qs[first].bytes_in += s->bytes_in - bytes;
+	}
+	qs[first].errors_in = s->errors_in;
+	qs[first].packets_out = s->packets_out;
+	qs[first].bytes_out = s->bytes_out;
+	qs[first].errors_out = s->errors_out;
+	qs[first].collisions = s->collisions;
+	qs[first].dropped = s->dropped;
+
+	for (uint32_t q = first; q < n; q++) {
+		struct dlil_threading_info *qinp = inp->dlth_steer[q];
+
+		if (heads[q] == NULL) {
+			continue;
+		}
+		atomic_add_64(&qinp->dlth_steer_pkts, qs[q].packets_in);
+		/* only the primary thread joins the driver's affinity set */
+		(void) dlil_input_async(qinp, ifp, heads[q], tails[q], &qs[q],
+		    poll, q == 0 ? tp : NULL);
+	}
+
+	return 0;
+}
+
 #if SKYWALK
 errno_t
 ifnet_set_output_handler(struct ifnet *ifp, ifnet_output_func fn)
@@ -6030,6 +6320,9 @@ __private_extern__ void
 dlil_input_packet_list_extended(struct ifnet *ifp, struct mbuf *m,
     u_int32_t cnt, ifnet_model_t mode)
 {
+	if (if_gro_enabled) {
+		m = if_gro_input(m, &cnt);
+	}
 	return dlil_input_packet_list_common(ifp, m, cnt, mode, TRUE);
 }
 
@@ -6624,6 +6917,7 @@ dlil_output(ifnet_t ifp, protocol_family_t proto_family, mbuf_t packetlist,
 	char dst_linkaddr_buffer[MAX_LINKADDR * 4];
 	struct if_proto *proto = NULL;
 	mbuf_t  m = NULL;
+	mbuf_t  segs = NULL;
 	mbuf_t  send_head = NULL;
 	mbuf_t  *send_tail = &send_head;
 	int iorefcnt = 0;
@@ -6925,6 +7219,26 @@ preout_again:
 			goto cleanup;
 		}
 
+		/*
+		 * If the interface segments TSO packets in software, split
+		 * the packet now; each segment then goes through the rest
+		 * of this loop and on to the driver by itself.
+		 */
+		if (GSO_IPV4_NEEDED(ifp, m) || GSO_IPV6_NEEDED(ifp, m)) {
+			if (raw != 0) {
+				retval = EMSGSIZE;
+				m_freem(m);
+				goto cleanup;
+			}
+			retval = if_gso_tcp(ifp, &m, pre);
+			if (retval != 0) {
+				goto cleanup;
+			}
+		}
+next_seg:
+		segs = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+
 		ifp_inc_traffic_class_out(ifp, m);
 
 #if SKYWALK
@@ -7018,6 +7332,11 @@ preout_again:
 		}
 		KERNEL_DEBUG(DBG_FNC_DLIL_IFOUT | DBG_FUNC_END, 0, 0, 0, 0, 0);
 
+		if (segs != NULL) {
+			m = segs;
+			goto next_seg;
+		}
+
 next:
 		m = packetlist;
 		if (m != NULL) {
@@ -8806,6 +9125,12 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	ifp->if_data.ifi_tso_v6_mtu = if_data_saved.ifi_tso_v6_mtu;
 	ifnet_touch_lastchange(ifp);
 
+	if (if_gso_ifp_eligible(ifp)) {
+		if_set_xflags(ifp, IFXF_SW_GSO);
+	} else {
+		if_clear_xflags(ifp, IFXF_SW_GSO);
+	}
+
 	VERIFY(ifp->if_output_sched_model == IFNET_SCHED_MODEL_NORMAL ||
 	    ifp->if_output_sched_model == IFNET_SCHED_MODEL_DRIVER_MANAGED ||
 	    ifp->if_output_sched_model == IFNET_SCHED_MODEL_FQ_CODEL);
@@ -8827,6 +9152,7 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	VERIFY(dl_inp->dlth_driver_thread == THREAD_NULL);
 	VERIFY(dl_inp->dlth_poller_thread == THREAD_NULL);
 	VERIFY(dl_inp->dlth_affinity_tag == 0);
+	VERIFY(dl_inp->dlth_steer == NULL && dl_inp->dlth_nsteer == 0);
 
 #if IFNET_INPUT_SANITY_CHK
 	VERIFY(dl_inp->dlth_pkts_cnt == 0);
@@ -8848,6 +9174,9 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 			panic_plain("%s: ifp=%p couldn't get an input thread; "
 			    "err=%d", __func__, ifp, err);
 			/* NOTREACHED */
+		} else if (thfunc == dlil_input_thread_func &&
+		    ifp->if_family == IFNET_FAMILY_ETHERNET) {
+			dlil_create_steer_threads(ifp, ifp->if_inp);
 		}
 	}
 	/*
@@ -9796,6 +10125,9 @@ ifnet_detach_final(struct ifnet *ifp)
 			ifnet_lock_exclusive(ifp);
 		}
 
+		/* terminate the flow steering input threads, if any */
+		dlil_terminate_steer_threads(ifp, inp);
+
 		/* clean-up input thread state */
 		dlil_clean_threading_info(inp);
 		/* clean-up poll parameters */
@@ -10768,6 +11100,71 @@ sysctl_rxpoll SYSCTL_HANDLER_ARGS
 	return err;
 }
 
+static int
+sysctl_rx_steer_queues SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	uint32_t i;
+	int err;
+
+	i = dlil_rx_steer_queues;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL) {
+		return err;
+	}
+
+	if (i > DLIL_STEER_MAX) {
+		return EINVAL;
+	}
+
+	dlil_rx_steer_queues = i;
+	return err;
+}
+
+/*
+ * net.link.generic.system.rx_steer_stats.<ifindex>: number of packets
+ * steered to each input thread of the interface, as an array of
+ * uint64_t; empty when flow steering is off for the interface.
+ */
+static int
+sysctl_rx_steer_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp)
+	int *name = (int *)arg1;
+	u_int namelen = arg2;
+	uint64_t counts[DLIL_STEER_MAX];
+	struct dlil_threading_info *inp;
+	uint32_t n = 0;
+	ifnet_t ifp;
+	int idx;
+
+	if (req->newptr != USER_ADDR_NULL) {
+		return EPERM;
+	}
+	if (namelen != 1) {
+		return EINVAL;
+	}
+	idx = name[0];
+
+	ifnet_head_lock_shared();
+	if (!IF_INDEX_IN_RANGE(idx) || (ifp = ifindex2ifnet[idx]) == NULL) {
+		ifnet_head_done();
+		return ENOENT;
+	}
+	ifnet_lock_shared(ifp);
+	if ((inp = ifp->if_inp) != NULL && inp->dlth_steer != NULL) {
+		n = inp->dlth_nsteer;
+		for (uint32_t i = 0; i < n; i++) {
+			counts[i] = inp->dlth_steer[i]->dlth_steer_pkts;
+		}
+	}
+	ifnet_lock_done(ifp);
+	ifnet_head_done();
+
+	return SYSCTL_OUT(req, counts, n * sizeof(counts[0]));
+}
+
 static int
 sysctl_rxpoll_mode_holdtime SYSCTL_HANDLER_ARGS
 {
@@ -11188,7 +11585,7 @@ ifnet_get_throttle(struct ifnet *ifp, u_int32_t *level)
 	if (IFCQ_IS_ENABLED(ifq)) {
 		cqrq_throttle_t req = { 0, IFNET_THROTTLE_OFF };
 
-		err = fq_if_request_classq(ifq, CLASSQRQ_THROTTLE, &req);
+		err = ifclassq_request(ifq, CLASSQRQ_THROTTLE, &req);
 		*level = req.level;
 	}
 	IFCQ_UNLOCK(ifq);
@@ -11220,7 +11617,7 @@ ifnet_set_throttle(struct ifnet *ifp, u_int32_t level)
 	if (IFCQ_IS_ENABLED(ifq)) {
 		cqrq_throttle_t req = { 1, level };
 
-		err = fq_if_request_classq(ifq, CLASSQRQ_THROTTLE, &req);
+		err = ifclassq_request(ifq, CLASSQRQ_THROTTLE, &req);
 	}
 	IFCQ_UNLOCK(ifq);
 
@@ -12055,6 +12452,25 @@ sysctl_hwcksum_dbg_partial_rxoff_adj SYSCTL_HANDLER_ARGS
 	return err;
 }
 
+#if (DEVELOPMENT || DEBUG) && defined(__x86_64__)
+static int
+sysctl_cksum_simd SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	u_int32_t i;
+	int err;
+
+	i = os_cpu_in_cksum_simd;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL) {
+		return err;
+	}
+
+	return os_cpu_in_cksum_simd_set(i);
+}
+#endif /* (DEVELOPMENT || DEBUG) && __x86_64__ */
+
 static int
 sysctl_tx_chain_len_stats SYSCTL_HANDLER_ARGS
 {
@@ -180,6 +180,15 @@ struct dlil_threading_info {
 	lck_grp_t       *dlth_lock_grp; /* lock group (for lock stats) */
 	char            dlth_name[DLIL_THREADNAME_LEN]; /* name storage */
 
+	/*
+	 * Receive flow steering (interface input thread only): packets
+	 * are spread by flow hash across dlth_nsteer input threads, the
+	 * first of which is this one.
+	 */
+	struct dlil_threading_info **dlth_steer; /* steering queues */
+	uint32_t        dlth_nsteer;            /* # of steering queues */
+	uint64_t        dlth_steer_pkts;        /* # of pkts steered here */
+
 #if IFNET_INPUT_SANITY_CHK
 	/*
 	 * For debugging.
@@ -314,6 +323,12 @@ extern void dlil_input_packet_list(struct ifnet *, struct mbuf *);
 extern void dlil_input_packet_list_extended(struct ifnet *, struct mbuf *,
     u_int32_t, ifnet_model_t);
 
+extern uint32_t if_gro_enabled;
+extern struct mbuf *if_gro_input(struct mbuf *, u_int32_t *);
+extern uint32_t if_gso_enabled;
+extern boolean_t if_gso_ifp_eligible(struct ifnet *);
+extern int if_gso_tcp(struct ifnet *, struct mbuf **, uint32_t);
+
 extern errno_t dlil_resolve_multi(struct ifnet *,
     const struct sockaddr *, struct sockaddr *, size_t);
 
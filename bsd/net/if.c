@@ -1527,7 +1527,7 @@ if_qflush(struct ifnet *ifp, struct ifclassq *ifq, bool ifq_locked)
 	}
 
 	if (IFCQ_IS_ENABLED(ifq)) {
-		fq_if_request_classq(ifq, CLASSQRQ_PURGE, NULL);
+		ifclassq_request(ifq, CLASSQRQ_PURGE, NULL);
 	}
 
 	VERIFY(IFCQ_IS_EMPTY(ifq));
@@ -1566,7 +1566,7 @@ if_qflush_sc(struct ifnet *ifp, mbuf_svc_class_t sc, u_int32_t flow,
 	if (IFCQ_IS_ENABLED(ifq)) {
 		cqrq_purge_sc_t req = { sc, flow, 0, 0 };
 
-		fq_if_request_classq(ifq, CLASSQRQ_PURGE_SC, &req);
+		ifclassq_request(ifq, CLASSQRQ_PURGE_SC, &req);
 		cnt = req.packets;
 		len = req.bytes;
 	}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Generic receive offload for the legacy (mbuf) input path.
+ *
+ * Before a chain of received packets is handed to the protocols, in-order
+ * TCP segments of the same flow are coalesced into a single packet: the
+ * payload of each following segment is appended to the mbuf chain of the
+ * first one, whose IP length is extended, and the number of segments is
+ * recorded in m_pkthdr.seg_cnt.  This is the same super packet that the
+ * flowswitch builds for Skywalk interfaces (see flow_agg.c), and which
+ * tcp_input already accounts for as several segments.
+ *
+ * Only segments whose checksum has been fully validated (by the driver,
+ * or because they were looped back) are coalesced, and the TCP checksum
+ * of the super packet is not recomputed.  Interfaces that may forward the
+ * packet (bridge members, or when IP forwarding is on) are left alone.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/mcache.h>
+#include <sys/sysctl.h>
+
+#include <net/dlil.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/nat464_utils.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_var.h>
+#include <netinet/tcp.h>
+#include <netinet6/ip6_var.h>
+
+#define IF_GRO_FLOWS_MAX        16      /* flows tracked within a chain */
+
+/* if_gro_parse() verdicts */
+#define IF_GRO_PASS             0       /* not TCP, deliver as is */
+#define IF_GRO_FLUSH            1       /* unparsable, stop all flows */
+#define IF_GRO_FLOW             2       /* TCP segment, not mergeable */
+#define IF_GRO_MERGE            3       /* TCP segment, mergeable */
+
+struct if_gro_pkt {
+	uint8_t         *gp_l3;         /* IP header */
+	struct tcphdr   *gp_th;         /* TCP header */
+	uint32_t        gp_hlen;        /* IP and TCP header length */
+	uint32_t        gp_thlen;       /* TCP header length */
+	uint32_t        gp_ulen;        /* TCP payload length */
+	uint8_t         gp_af;
+};
+
+struct if_gro_flow {
+	struct mbuf             *gf_head;       /* super packet */
+	struct mbuf             *gf_tail;       /* last mbuf of gf_head */
+	struct if_gro_pkt       gf_pkt;         /* headers of gf_head */
+	uint32_t                gf_seq;         /* next in-order sequence */
+	uint32_t                gf_len;         /* IP length of gf_head */
+	uint8_t                 gf_segs;        /* segments in gf_head */
+};
+
+SYSCTL_DECL(_net_link_generic_system);
+SYSCTL_NODE(_net_link_generic_system, OID_AUTO, gro,
+    CTLFLAG_RW | CTLFLAG_LOCKED, 0, "generic receive offload");
+
+uint32_t if_gro_enabled = 1;
+SYSCTL_UINT(_net_link_generic_system_gro, OID_AUTO, enabled,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_gro_enabled, 0,
+    "coalesce received TCP segments");
+
+static uint32_t if_gro_max_segs = 32;
+static uint32_t if_gro_max_bytes = IP_MAXPACKET;
+static uint32_t if_gro_max_flows = 8;
+static int sysctl_gro_limit SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_link_generic_system_gro, OID_AUTO, max_segs,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_gro_max_segs, UINT8_MAX,
+    sysctl_gro_limit, "IU", "segments per coalesced packet");
+SYSCTL_PROC(_net_link_generic_system_gro, OID_AUTO, max_bytes,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_gro_max_bytes,
+    IP_MAXPACKET, sysctl_gro_limit, "IU", "IP length of a coalesced packet");
+SYSCTL_PROC(_net_link_generic_system_gro, OID_AUTO, max_flows,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_gro_max_flows,
+    IF_GRO_FLOWS_MAX, sysctl_gro_limit, "IU",
+    "flows coalesced at once within a packet chain");
+
+/*
+ * A segment with PSH set is the last one of its flow to be coalesced,
+ * so that the data is delivered without waiting for what follows it.
+ */
+static uint32_t if_gro_flush_push = 1;
+SYSCTL_UINT(_net_link_generic_system_gro, OID_AUTO, flush_push,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_gro_flush_push, 0,
+    "stop coalescing a flow at a segment with PSH");
+
+static uint64_t if_gro_segs_merged;
+static uint64_t if_gro_pkts_coalesced;
+SYSCTL_QUAD(_net_link_generic_system_gro, OID_AUTO, merged,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gro_segs_merged,
+    "segments appended to a preceding one");
+SYSCTL_QUAD(_net_link_generic_system_gro, OID_AUTO, coalesced,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gro_pkts_coalesced,
+    "packets carrying more than one segment");
+
+static int
+sysctl_gro_limit SYSCTL_HANDLER_ARGS
+{
+	uint32_t *limit = arg1;
+	uint32_t i;
+	int err;
+
+	i = *limit;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL) {
+		return err;
+	}
+
+	if (i < 1 || i > (uint32_t)arg2) {
+		return EINVAL;
+	}
+
+	*limit = i;
+	return err;
+}
+
+static boolean_t
+if_gro_ifp_eligible(struct ifnet *ifp)
+{
+	if (ifp->if_family == IFNET_FAMILY_LOOPBACK) {
+		return TRUE;
+	}
+	if (ifp->if_family != IFNET_FAMILY_ETHERNET) {
+		return FALSE;
+	}
+#if SKYWALK
+	/* the flowswitch has aggregated already */
+	if (ifp->if_capabilities & IFCAP_SKYWALK) {
+		return FALSE;
+	}
+#endif /* SKYWALK */
+	if ((ifp->if_hwassist & IFNET_LRO) || ifp->if_bridge != NULL) {
+		return FALSE;
+	}
+	return ipforwarding == 0 && ip6_forwarding == 0;
+}
+
+static int
+if_gro_parse(struct mbuf *m, struct if_gro_pkt *gp)
+{
+	struct ifnet *ifp = m->m_pkthdr.rcvif;
+	uint8_t *l3 = mtod(m, uint8_t *);
+	struct tcphdr *th;
+	uint32_t iphlen, len;
+
+	if (ifp->if_family == IFNET_FAMILY_ETHERNET) {
+		struct ether_header *eh = m->m_pkthdr.pkt_hdr;
+
+		if (eh == NULL || (uint8_t *)eh == l3) {
+			return IF_GRO_PASS;
+		}
+		if (eh->ether_type != htons(ETHERTYPE_IP) &&
+		    eh->ether_type != htons(ETHERTYPE_IPV6)) {
+			return IF_GRO_PASS;
+		}
+	}
+	if (m->m_len < (int)sizeof(struct ip) ||
+	    !IS_P2ALIGNED(l3, sizeof(uint32_t))) {
+		return IF_GRO_FLUSH;
+	}
+
+	switch (*l3 >> 4) {
+	case IPVERSION: {
+		struct ip *ip = (struct ip *)(void *)l3;
+
+		if (ip->ip_p != IPPROTO_TCP) {
+			return IF_GRO_PASS;
+		}
+		if (ip->ip_hl != sizeof(*ip) >> 2 ||
+		    (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0) {
+			return IF_GRO_FLUSH;
+		}
+		gp->gp_af = AF_INET;
+		iphlen = sizeof(*ip);
+		len = ntohs(ip->ip_len);
+		break;
+	}
+	case IPV6_VERSION >> 4: {
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)(void *)l3;
+
+		if (m->m_len < (int)sizeof(*ip6)) {
+			return IF_GRO_FLUSH;
+		}
+		if (ip6->ip6_nxt == IPPROTO_UDP ||
+		    ip6->ip6_nxt == IPPROTO_ICMPV6) {
+			return IF_GRO_PASS;
+		}
+		if (ip6->ip6_nxt != IPPROTO_TCP) {
+			return IF_GRO_FLUSH;
+		}
+		gp->gp_af = AF_INET6;
+		iphlen = sizeof(*ip6);
+		len = sizeof(*ip6) + ntohs(ip6->ip6_plen);
+		break;
+	}
+	default:
+		return IF_GRO_PASS;
+	}
+
+	if (m->m_len < (int)(iphlen + sizeof(*th))) {
+		return IF_GRO_FLUSH;
+	}
+	th = (struct tcphdr *)(void *)(l3 + iphlen);
+	gp->gp_thlen = th->th_off << 2;
+	gp->gp_hlen = iphlen + gp->gp_thlen;
+	if (gp->gp_thlen < sizeof(*th) || m->m_len < (int)gp->gp_hlen ||
+	    len < gp->gp_hlen) {
+		return IF_GRO_FLUSH;
+	}
+	gp->gp_l3 = l3;
+	gp->gp_th = th;
+	gp->gp_ulen = len - gp->gp_hlen;
+
+	/*
+	 * Only data segments with no flags other than ACK and PSH, with
+	 * a validated checksum and no link padding, are coalesced.
+	 */
+	if (gp->gp_ulen == 0 || (th->th_flags & ~TH_PUSH) != TH_ACK ||
+	    len != (uint32_t)m_pktlen(m) || !M_WRITABLE(m) ||
+	    (m->m_pkthdr.csum_flags & (CSUM_DATA_VALID | CSUM_PSEUDO_HDR)) !=
+	    (CSUM_DATA_VALID | CSUM_PSEUDO_HDR) ||
+	    m->m_pkthdr.csum_rx_val != 0xffff ||
+	    (m->m_pkthdr.pkt_flags & PKTF_WAKE_PKT)) {
+		return IF_GRO_FLOW;
+	}
+	return IF_GRO_MERGE;
+}
+
+static boolean_t
+if_gro_same_flow(struct if_gro_flow *f, struct mbuf *m, struct if_gro_pkt *gp)
+{
+	struct if_gro_pkt *fp = &f->gf_pkt;
+
+	if (f->gf_head->m_pkthdr.rcvif != m->m_pkthdr.rcvif ||
+	    fp->gp_af != gp->gp_af ||
+	    fp->gp_th->th_sport != gp->gp_th->th_sport ||
+	    fp->gp_th->th_dport != gp->gp_th->th_dport) {
+		return FALSE;
+	}
+	if (gp->gp_af == AF_INET) {
+		struct ip *fip = (struct ip *)(void *)fp->gp_l3;
+		struct ip *ip = (struct ip *)(void *)gp->gp_l3;
+
+		return fip->ip_src.s_addr == ip->ip_src.s_addr &&
+		       fip->ip_dst.s_addr == ip->ip_dst.s_addr;
+	} else {
+		struct ip6_hdr *fip6 = (struct ip6_hdr *)(void *)fp->gp_l3;
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)(void *)gp->gp_l3;
+
+		return IN6_ARE_ADDR_EQUAL(&fip6->ip6_src, &ip6->ip6_src) &&
+		       IN6_ARE_ADDR_EQUAL(&fip6->ip6_dst, &ip6->ip6_dst);
+	}
+}
+
+/*
+ * A segment is appended if it is the next one in sequence and carries
+ * the same acknowledgement, window, TCP options and IP header fields as
+ * the super packet, so that TCP sees what the individual segments said.
+ */
+static boolean_t
+if_gro_can_merge(struct if_gro_flow *f, struct mbuf *m, struct if_gro_pkt *gp)
+{
+	struct mbuf *head = f->gf_head;
+	struct tcphdr *fth = f->gf_pkt.gp_th;
+	struct tcphdr *th = gp->gp_th;
+
+	if (f->gf_segs >= if_gro_max_segs ||
+	    f->gf_len + gp->gp_ulen > if_gro_max_bytes) {
+		return FALSE;
+	}
+	if (ntohl(th->th_seq) != f->gf_seq || th->th_ack != fth->th_ack ||
+	    th->th_win != fth->th_win || gp->gp_thlen != f->gf_pkt.gp_thlen ||
+	    bcmp(fth + 1, th + 1, gp->gp_thlen - sizeof(*th)) != 0) {
+		return FALSE;
+	}
+	if (m->m_pkthdr.csum_flags != head->m_pkthdr.csum_flags ||
+	    m->m_pkthdr.vlan_tag != head->m_pkthdr.vlan_tag) {
+		return FALSE;
+	}
+	if (gp->gp_af == AF_INET) {
+		struct ip *fip = (struct ip *)(void *)f->gf_pkt.gp_l3;
+		struct ip *ip = (struct ip *)(void *)gp->gp_l3;
+
+		return fip->ip_tos == ip->ip_tos && fip->ip_ttl == ip->ip_ttl &&
+		       fip->ip_off == ip->ip_off;
+	} else {
+		struct ip6_hdr *fip6 = (struct ip6_hdr *)(void *)f->gf_pkt.gp_l3;
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)(void *)gp->gp_l3;
+
+		return fip6->ip6_flow == ip6->ip6_flow &&
+		       fip6->ip6_hlim == ip6->ip6_hlim;
+	}
+}
+
+static void
+if_gro_open(struct if_gro_flow *f, struct mbuf *m, struct if_gro_pkt *gp)
+{
+	f->gf_head = m;
+	f->gf_tail = m_last(m);
+	f->gf_pkt = *gp;
+	f->gf_seq = ntohl(gp->gp_th->th_seq) + gp->gp_ulen;
+	f->gf_len = gp->gp_hlen + gp->gp_ulen;
+	f->gf_segs = 1;
+}
+
+static void
+if_gro_merge(struct if_gro_flow *f, struct mbuf *m, struct if_gro_pkt *gp)
+{
+	struct mbuf *head = f->gf_head;
+	uint32_t ulen = gp->gp_ulen;
+
+	f->gf_pkt.gp_th->th_flags |= (gp->gp_th->th_flags & TH_PUSH);
+	f->gf_seq += ulen;
+	f->gf_len += ulen;
+	if (gp->gp_af == AF_INET) {
+		struct ip *ip = (struct ip *)(void *)f->gf_pkt.gp_l3;
+		uint16_t old = ip->ip_len;
+
+		ip->ip_len = htons((uint16_t)f->gf_len);
+		ip->ip_sum = nat464_cksum_fixup(ip->ip_sum, old, ip->ip_len, 0);
+	} else {
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)(void *)f->gf_pkt.gp_l3;
+
+		ip6->ip6_plen = htons((uint16_t)(f->gf_len - sizeof(*ip6)));
+	}
+
+	/* keep only the payload, as part of the super packet's chain */
+	m_adj(m, gp->gp_hlen);
+	(void) m_reinit(m, 0);
+	f->gf_tail->m_next = m;
+	f->gf_tail = m_last(m);
+
+	head->m_pkthdr.len += ulen;
+	head->m_pkthdr.seg_cnt = ++f->gf_segs;
+}
+
+/*
+ * Coalesce the segments of a received packet chain, in place; returns
+ * the new head of the chain and adjusts *cnt to the number of packets
+ * left in it.  Packets keep their relative order within a flow: a flow
+ * stops being coalesced as soon as one of its segments cannot be.
+ */
+struct mbuf *
+if_gro_input(struct mbuf *m_head, u_int32_t *cnt)
+{
+	struct if_gro_flow flows[IF_GRO_FLOWS_MAX];
+	struct mbuf *m, *next, *head = NULL, **tailp = &head;
+	struct ifnet *last_ifp = NULL;
+	boolean_t ifp_ok = FALSE;
+	uint32_t max_flows = MIN(if_gro_max_flows, IF_GRO_FLOWS_MAX);
+	uint32_t nflows = 0, victim = 0;
+	uint32_t merged = 0, coalesced = 0;
+
+	for (m = m_head; m != NULL; m = next) {
+		struct if_gro_pkt gp;
+		struct if_gro_flow *f = NULL;
+		int verdict = IF_GRO_PASS;
+		boolean_t push;
+
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+
+		if (m->m_pkthdr.rcvif != last_ifp) {
+			last_ifp = m->m_pkthdr.rcvif;
+			ifp_ok = (last_ifp != NULL && if_gro_ifp_eligible(last_ifp));
+		}
+		if (ifp_ok) {
+			verdict = if_gro_parse(m, &gp);
+		}
+
+		switch (verdict) {
+		case IF_GRO_PASS:
+			break;
+
+		case IF_GRO_FLUSH:
+			nflows = 0;
+			break;
+
+		case IF_GRO_FLOW:
+		case IF_GRO_MERGE:
+			for (uint32_t i = 0; i < nflows; i++) {
+				if (if_gro_same_flow(&flows[i], m, &gp)) {
+					f = &flows[i];
+					break;
+				}
+			}
+			push = (if_gro_flush_push &&
+			    (gp.gp_th->th_flags & TH_PUSH) != 0);
+			if (f != NULL && verdict == IF_GRO_MERGE &&
+			    if_gro_can_merge(f, m, &gp)) {
+				if_gro_merge(f, m, &gp);
+				merged++;
+				if (f->gf_segs == 2) {
+					coalesced++;
+				}
+				if (push) {
+					*f = flows[--nflows];
+				}
+				continue;
+			}
+			if (f != NULL) {
+				*f = flows[--nflows];
+			}
+			if (verdict == IF_GRO_MERGE && !push) {
+				if (nflows < max_flows) {
+					f = &flows[nflows++];
+				} else {
+					f = &flows[victim++ % max_flows];
+				}
+				if_gro_open(f, m, &gp);
+			}
+			break;
+
+		default:
+			VERIFY(0);
+			/* NOTREACHED */
+		}
+
+		*tailp = m;
+		tailp = &m->m_nextpkt;
+	}
+
+	if (merged != 0) {
+		*cnt = (*cnt > merged) ? *cnt - merged : 0;
+		atomic_add_64(&if_gro_segs_merged, merged);
+		atomic_add_64(&if_gro_pkts_coalesced, coalesced);
+	}
+	return head;
+}
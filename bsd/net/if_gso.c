@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Generic segmentation offload for interfaces without hardware TSO.
+ *
+ * Interfaces marked IFXF_SW_GSO accept TCP super-segments (CSUM_TSO_IPV4
+ * or CSUM_TSO_IPV6, with the MSS in m_pkthdr.tso_segsz) as if they did
+ * TSO, so that tcp_output, ip_output, pf and the interface filters run
+ * once per super-segment.  dlil_output splits the super-segment here,
+ * after framing and right before the packets are handed to the driver.
+ *
+ * As with the bridge (see gso_ip_tcp() in if_bridge.c), the first segment
+ * is the original mbuf, trimmed, and every following one is a copy of the
+ * headers in front of a reference to its share of the payload.  The IPv4
+ * header checksum is adjusted incrementally, and the TCP pseudo header
+ * sum is computed once and completed with the length of each segment.
+ * Unless the interface offloads the TCP checksum, it is then finished in
+ * software, which sums every byte of the payload exactly once.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/mcache.h>
+#include <sys/sysctl.h>
+
+#include <net/dlil.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/nat464_utils.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+SYSCTL_DECL(_net_link_generic_system);
+SYSCTL_NODE(_net_link_generic_system, OID_AUTO, gso,
+    CTLFLAG_RW | CTLFLAG_LOCKED, 0, "generic segmentation offload");
+
+/*
+ * Checked by tcp_set_tso(); super-segments already in flight are still
+ * split when this is turned off.
+ */
+uint32_t if_gso_enabled = 1;
+SYSCTL_UINT(_net_link_generic_system_gso, OID_AUTO, enabled,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_gso_enabled, 0,
+    "send TCP super-segments to interfaces that segment in software");
+
+static uint64_t if_gso_packets;
+static uint64_t if_gso_segments;
+static uint64_t if_gso_drops;
+SYSCTL_QUAD(_net_link_generic_system_gso, OID_AUTO, packets,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gso_packets,
+    "super-segments split");
+SYSCTL_QUAD(_net_link_generic_system_gso, OID_AUTO, segments,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gso_segments,
+    "segments produced");
+SYSCTL_QUAD(_net_link_generic_system_gso, OID_AUTO, drops,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gso_drops,
+    "super-segments dropped");
+
+/*
+ * Native Skywalk interfaces segment in netif (see nx_netif_gso.c).
+ */
+boolean_t
+if_gso_ifp_eligible(struct ifnet *ifp)
+{
+	if (ifp->if_eflags & IFEF_SKYWALK_NATIVE) {
+		return FALSE;
+	}
+	switch (ifp->if_family) {
+	case IFNET_FAMILY_ETHERNET:
+	case IFNET_FAMILY_UTUN:
+	case IFNET_FAMILY_IPSEC:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Make a copy of the first hlen bytes of m0, which are contiguous, in a
+ * new packet with the same packet header.  The copy starts pad bytes
+ * into the buffer, so that the IP header is 32-bit aligned.
+ */
+static struct mbuf *
+if_gso_copy_hdr(struct mbuf *m0, uint32_t hlen, uint32_t pad)
+{
+	struct mbuf *n;
+
+	if (MHLEN < pad + hlen) {
+		n = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
+	} else {
+		n = m_gethdr(M_NOWAIT, MT_DATA);
+	}
+	if (n == NULL) {
+		return NULL;
+	}
+	if (m_dup_pkthdr(n, m0, M_NOWAIT) == 0) {
+		m_freem(n);
+		return NULL;
+	}
+	n->m_data += pad;
+	bcopy(mtod(m0, caddr_t), mtod(n, caddr_t), hlen);
+	n->m_len = hlen;
+	return n;
+}
+
+/*
+ * Split the TCP super-segment *mp, whose IP header starts l3off bytes
+ * into the packet, into a list of packets linked by m_nextpkt.  On
+ * failure the super-segment is freed and *mp is set to NULL.
+ */
+int
+if_gso_tcp(struct ifnet *ifp, struct mbuf **mp, uint32_t l3off)
+{
+#pragma unused(ifp)
+	struct mbuf *m0 = *mp, *m, *n, **tailp, *cur;
+	struct ip *ip = NULL;
+	struct ip6_hdr *ip6 = NULL;
+	struct tcphdr *th;
+	uint32_t iphlen, thlen, hlen, mss, totlen, off, cur_off, len, pad;
+	uint32_t seq, nsegs;
+	uint16_t base, ip_id = 0;
+	boolean_t isipv4, hw_tcpsum;
+	uint8_t *l3;
+	int error = 0;
+
+	*mp = NULL;
+	isipv4 = (m0->m_pkthdr.csum_flags & CSUM_TSO_IPV4) != 0;
+	mss = m0->m_pkthdr.tso_segsz;
+	if (mss == 0) {
+		error = EMSGSIZE;
+		goto drop;
+	}
+
+	/* the IP header, and then all of the headers, must be contiguous */
+	hlen = l3off + (isipv4 ? sizeof(struct ip) : sizeof(struct ip6_hdr)) +
+	    sizeof(struct tcphdr);
+	if (m0->m_len < (int)hlen && (m0 = m_pullup(m0, hlen)) == NULL) {
+		error = ENOBUFS;
+		goto drop;
+	}
+	l3 = mtod(m0, uint8_t *) + l3off;
+	if (isipv4) {
+		ip = (struct ip *)(void *)l3;
+		iphlen = ip->ip_hl << 2;
+		if (ip->ip_p != IPPROTO_TCP || iphlen < sizeof(*ip) ||
+		    (ip->ip_off & htons(IP_MF | IP_OFFMASK)) != 0) {
+			error = EMSGSIZE;
+			goto drop;
+		}
+	} else {
+		ip6 = (struct ip6_hdr *)(void *)l3;
+		iphlen = sizeof(*ip6);
+		/* tcp_output does not use TSO along with extension headers */
+		if (ip6->ip6_nxt != IPPROTO_TCP) {
+			error = EMSGSIZE;
+			goto drop;
+		}
+	}
+	hlen = l3off + iphlen + sizeof(struct tcphdr);
+	if (m0->m_len < (int)hlen && (m0 = m_pullup(m0, hlen)) == NULL) {
+		error = ENOBUFS;
+		goto drop;
+	}
+	th = (struct tcphdr *)(void *)(mtod(m0, uint8_t *) + l3off + iphlen);
+	thlen = th->th_off << 2;
+	hlen = l3off + iphlen + thlen;
+	totlen = m0->m_pkthdr.len;
+	if (thlen < sizeof(*th) || totlen < hlen) {
+		error = EMSGSIZE;
+		goto drop;
+	}
+	if (m0->m_len < (int)hlen && (m0 = m_pullup(m0, hlen)) == NULL) {
+		error = ENOBUFS;
+		goto drop;
+	}
+	l3 = mtod(m0, uint8_t *) + l3off;
+	if (isipv4) {
+		ip = (struct ip *)(void *)l3;
+		ip_id = ntohs(ip->ip_id);
+		base = in_pseudo(ip->ip_src.s_addr, ip->ip_dst.s_addr,
+		    htons(IPPROTO_TCP));
+		hw_tcpsum = (m0->m_pkthdr.csum_flags & CSUM_TCP) != 0;
+	} else {
+		ip6 = (struct ip6_hdr *)(void *)l3;
+		base = in6_pseudo(&ip6->ip6_src, &ip6->ip6_dst,
+		    htonl(IPPROTO_TCP));
+		hw_tcpsum = (m0->m_pkthdr.csum_flags & CSUM_TCPIPV6) != 0;
+	}
+	th = (struct tcphdr *)(void *)(l3 + iphlen);
+	seq = ntohl(th->th_seq);
+
+	/*
+	 * Build the second and following segments from the headers of the
+	 * super-segment, as yet unmodified; cur and cur_off track where
+	 * the payload of the next segment starts.
+	 */
+	pad = (uint32_t)P2ROUNDUP(l3off, sizeof(uint32_t)) - l3off;
+	tailp = &m0->m_nextpkt;
+	cur = m0;
+	cur_off = hlen + mss;
+	nsegs = 1;
+	for (off = hlen + mss; off < totlen; off += len) {
+		len = MIN(mss, totlen - off);
+		while (cur_off >= (uint32_t)cur->m_len) {
+			cur_off -= cur->m_len;
+			cur = cur->m_next;
+		}
+		if ((n = if_gso_copy_hdr(m0, hlen, pad)) == NULL) {
+			error = ENOBUFS;
+			goto drop;
+		}
+		if ((n->m_next = m_copym(cur, cur_off, len, M_NOWAIT)) == NULL) {
+			m_freem(n);
+			error = ENOBUFS;
+			goto drop;
+		}
+		n->m_pkthdr.len = hlen + len;
+		cur_off += len;
+		*tailp = n;
+		tailp = &n->m_nextpkt;
+		nsegs++;
+	}
+
+	/* the first segment keeps m0, with its share of the payload only */
+	if (nsegs > 1) {
+		len = hlen + mss;
+		for (n = m0; len > (uint32_t)n->m_len; n = n->m_next) {
+			len -= n->m_len;
+		}
+		n->m_len = len;
+		if (n->m_next != NULL) {
+			m_freem(n->m_next);
+			n->m_next = NULL;
+		}
+		m0->m_pkthdr.len = hlen + mss;
+	}
+
+	for (m = m0; m != NULL; m = m->m_nextpkt) {
+		uint32_t plen = m->m_pkthdr.len - hlen;
+		uint16_t tlen = (uint16_t)(thlen + plen);
+
+		l3 = mtod(m, uint8_t *) + l3off;
+		th = (struct tcphdr *)(void *)(l3 + iphlen);
+		th->th_seq = htonl(seq);
+		seq += plen;
+		if (m != m0) {
+			th->th_flags &= ~TH_CWR;
+		}
+		if (m->m_nextpkt != NULL) {
+			th->th_flags &= ~(TH_FIN | TH_PUSH);
+		}
+
+		if (isipv4) {
+			uint16_t ip_len = htons((uint16_t)(iphlen + tlen));
+			uint16_t id = htons(ip_id++);
+
+			ip = (struct ip *)(void *)l3;
+			if (!(m->m_pkthdr.csum_flags & CSUM_IP)) {
+				ip->ip_sum = nat464_cksum_fixup(ip->ip_sum,
+				    ip->ip_len, ip_len, 0);
+				ip->ip_sum = nat464_cksum_fixup(ip->ip_sum,
+				    ip->ip_id, id, 0);
+			}
+			ip->ip_len = ip_len;
+			ip->ip_id = id;
+		} else {
+			ip6 = (struct ip6_hdr *)(void *)l3;
+			ip6->ip6_plen = htons(tlen);
+		}
+
+		/* the pseudo header sum, which is all that TSO expects */
+		th->th_sum = in_addword(base, htons(tlen));
+		if (!hw_tcpsum) {
+			uint16_t sum = th->th_sum;
+
+			th->th_sum = 0;
+			th->th_sum = (uint16_t)~in_addword(sum,
+			    m_sum16(m, l3off + iphlen, tlen));
+		}
+
+		m->m_pkthdr.csum_flags &= ~(CSUM_TSO_IPV4 | CSUM_TSO_IPV6);
+		m->m_pkthdr.tso_segsz = 0;
+		m->m_pkthdr.pkt_hdr = l3;
+	}
+
+	atomic_add_64(&if_gso_packets, 1);
+	atomic_add_64(&if_gso_segments, nsegs);
+	*mp = m0;
+	return 0;
+
+drop:
+	if (m0 != NULL) {
+		m_freem_list(m0);
+	}
+	atomic_add_64(&if_gso_drops, 1);
+	return error;
+}
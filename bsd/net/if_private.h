@@ -154,6 +154,7 @@ struct if_clonereq32 {
 #define IFXF_MARK_WAKE_PKT              0x00000800 /* Mark next input packet as wake packet */
 #define IFXF_FAST_PKT_DELIVERY          0x00001000 /* Fast Packet Delivery */
 #define IFXF_NO_TRAFFIC_SHAPING         0x00002000 /* Skip dummynet and netem traffic shaping */
+#define IFXF_SW_GSO                     0x00004000 /* TCP segmentation in software */
 
 /*
  * Current requirements for an AWDL interface.  Setting/clearing IFEF_AWDL
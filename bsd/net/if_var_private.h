@@ -1319,6 +1319,13 @@ struct ifmultiaddr {
     ((_ifp)->if_family == IFNET_FAMILY_ETHERNET &&               \
      (_ifp)->if_subfamily == IFNET_SUBFAMILY_THUNDERBOLT)
 
+/*
+ * Indicate whether or not TCP super-segments sent on the interface are
+ * split in software by dlil_output (see if_gso.c).
+ */
+#define IFNET_IS_SW_GSO(_ifp)                                           \
+    (((_ifp)->if_xflags & IFXF_SW_GSO) != 0)
+
 extern int if_index;
 extern struct ifnethead ifnet_head;
 extern struct ifnethead ifnet_ordered_head;
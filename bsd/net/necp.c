@@ -72,6 +72,7 @@
 #include <corecrypto/cchmac.h>
 #include <corecrypto/ccsha2.h>
 #include <os/refcnt.h>
+#include <os/atomic_private.h>
 #include <mach-o/loader.h>
 #include <net/network_agent.h>
 #include <net/necp.h>
@@ -152,6 +153,8 @@ u_int32_t necp_pass_keepalives = 1; // 0=Off, 1=On
 u_int32_t necp_pass_interpose = 1; // 0=Off, 1=On
 u_int32_t necp_restrict_multicast = 1; // 0=Off, 1=On
 u_int32_t necp_dedup_policies = 0; // 0=Off, 1=On
+u_int32_t necp_policy_compiler = 0; // 0=Off, 1=On
+u_int32_t necp_flow_cache = 0; // 0=Off, 1=On
 
 u_int32_t necp_drop_unentitled_order = 0;
 #ifdef XNU_TARGET_OS_WATCH
@@ -393,6 +396,9 @@ static size_t necp_kernel_socket_policies_map_counts[NECP_KERNEL_SOCKET_POLICIES
 static struct necp_kernel_socket_policy **necp_kernel_socket_policies_map[NECP_KERNEL_SOCKET_POLICIES_MAP_NUM_APP_ID_BUCKETS];
 static size_t necp_kernel_socket_policies_app_layer_map_count;
 static struct necp_kernel_socket_policy **necp_kernel_socket_policies_app_layer_map;
+#define NECP_POLICY_INDEX(index) (necp_policy_compiler ? (index) : NULL)   // Index to walk a map with, if any
+static struct necp_policy_index *necp_kernel_socket_policies_index[NECP_KERNEL_SOCKET_POLICIES_MAP_NUM_APP_ID_BUCKETS];
+static struct necp_policy_index *necp_kernel_socket_policies_app_layer_index;
 /*
  * A note on policy 'maps': these are used for boosting efficiency when matching policies. For each dimension of the map,
  * such as an ID, the 0 bucket is reserved for sockets/packets that do not have this parameter, while the other
@@ -409,12 +415,67 @@ static LIST_HEAD(_necpkernelipoutputpolicies, necp_kernel_ip_output_policy) necp
 #define NECP_IP_OUTPUT_MAP_ID_TO_BUCKET(id) (id ? (id%(NECP_KERNEL_IP_OUTPUT_POLICIES_MAP_NUM_ID_BUCKETS - 1) + 1) : 0)
 static size_t necp_kernel_ip_output_policies_map_counts[NECP_KERNEL_IP_OUTPUT_POLICIES_MAP_NUM_ID_BUCKETS];
 static struct necp_kernel_ip_output_policy **necp_kernel_ip_output_policies_map[NECP_KERNEL_IP_OUTPUT_POLICIES_MAP_NUM_ID_BUCKETS];
+static struct necp_policy_index *necp_kernel_ip_output_policies_index[NECP_KERNEL_IP_OUTPUT_POLICIES_MAP_NUM_ID_BUCKETS];
+
+/*
+ * The result of an IP output match is cached per flow in a direct-mapped
+ * table that is read without the policy lock.  Each slot is guarded by a
+ * sequence count, odd while the slot is being written: a reader copies
+ * the slot and keeps the copy only if the count was even and unchanged
+ * around it.  Slots are stamped with necp_flow_cache_gencount, which any
+ * change to what a match depends on bumps, so stale slots are simply
+ * never hit again.
+ *
+ * Matches that depend on more than the flow are not cached: those that
+ * consulted the drop-all bypass of the sending process, and any when a
+ * policy tests the route of the packet (local networks).
+ */
+#define NECP_FLOW_CACHE_SIZE    1024
+
+struct necp_ip_output_match {
+	necp_kernel_policy_id                   policy_id;      // NONE if no policy matched
+	necp_kernel_policy_result               result;
+	necp_kernel_policy_result_parameter     result_parameter;
+	u_int32_t                               route_rule_id;
+	necp_kernel_policy_result               drop_dest_policy_result;
+	necp_drop_all_bypass_check_result_t     drop_all_bypass;
+};
+
+struct necp_flow_key {
+	necp_kernel_policy_id   policy_id;
+	necp_kernel_policy_id   skip_policy_id;
+	u_int32_t               bound_interface_index;
+	u_int32_t               last_interface_index;
+	u_int16_t               protocol;
+	u_int16_t               pf_tag;
+	union necp_sockaddr_union local_addr;
+	union necp_sockaddr_union remote_addr;
+};
+
+struct necp_flow_cache_entry {
+	u_int32_t               nfe_seq;        // Odd while the entry is written
+	u_int32_t               nfe_gencount;   // 0 if never filled
+	struct necp_flow_key    nfe_key;
+	struct necp_ip_output_match nfe_match;
+};
+
+struct necp_flow_cache {
+	struct necp_flow_cache_entry *nfc_entries;
+	u_int32_t               nfc_mask;
+	u_int32_t               nfc_seed;
+};
+
+static struct necp_flow_cache necp_ip_output_flow_cache;
+static u_int32_t necp_flow_cache_gencount = 1;
+
 static struct necp_kernel_socket_policy pass_policy =
 {
 	.id = NECP_KERNEL_POLICY_ID_NO_MATCH,
 	.result = NECP_KERNEL_POLICY_RESULT_PASS,
 };
 
+static bool necp_flow_cache_init(struct necp_flow_cache *nfc, u_int32_t size);
+static void necp_flow_cache_invalidate(void);
 static struct necp_session *necp_create_session(void);
 static void necp_delete_session(struct necp_session *session);
 
@@ -436,7 +497,7 @@ static necp_kernel_policy_id necp_kernel_socket_policy_add(necp_policy_order ord
 static bool necp_kernel_socket_policy_delete(necp_kernel_policy_id policy_id);
 static bool necp_kernel_socket_policies_reprocess(void);
 static bool necp_kernel_socket_policies_update_uuid_table(void);
-static inline struct necp_kernel_socket_policy *necp_socket_find_policy_match_with_info_locked(struct necp_kernel_socket_policy **policy_search_array, struct necp_socket_info *info, necp_kernel_policy_filter *return_filter, u_int32_t *return_route_rule_id_array, size_t *return_route_rule_id_array_count, size_t route_rule_id_array_count, necp_kernel_policy_result *return_service_action, necp_kernel_policy_service *return_service, u_int32_t *return_netagent_array, u_int32_t *return_netagent_use_flags_array, size_t netagent_array_count, struct necp_client_parameter_netagent_type *required_agent_types, u_int32_t num_required_agent_types, proc_t proc, u_int16_t pf_tag, necp_kernel_policy_id *skip_policy_id, struct rtentry *rt, necp_kernel_policy_result *return_drop_dest_policy_result, necp_drop_all_bypass_check_result_t *return_drop_all_bypass, u_int32_t *return_flow_divert_aggregate_unit, struct socket *, int debug);
+static inline struct necp_kernel_socket_policy *necp_socket_find_policy_match_with_info_locked(struct necp_kernel_socket_policy **policy_search_array, struct necp_policy_index *policy_index, struct necp_socket_info *info, necp_kernel_policy_filter *return_filter, u_int32_t *return_route_rule_id_array, size_t *return_route_rule_id_array_count, size_t route_rule_id_array_count, necp_kernel_policy_result *return_service_action, necp_kernel_policy_service *return_service, u_int32_t *return_netagent_array, u_int32_t *return_netagent_use_flags_array, size_t netagent_array_count, struct necp_client_parameter_netagent_type *required_agent_types, u_int32_t num_required_agent_types, proc_t proc, u_int16_t pf_tag, necp_kernel_policy_id *skip_policy_id, struct rtentry *rt, necp_kernel_policy_result *return_drop_dest_policy_result, necp_drop_all_bypass_check_result_t *return_drop_all_bypass, u_int32_t *return_flow_divert_aggregate_unit, struct socket *, int debug);
 
 static necp_kernel_policy_id necp_kernel_ip_output_policy_add(necp_policy_order order, necp_policy_order suborder, u_int32_t session_order, int session_pid, u_int64_t condition_mask, u_int64_t condition_negated_mask, necp_kernel_policy_id cond_policy_id, ifnet_t cond_bound_interface, u_int32_t cond_last_interface_index, u_int16_t cond_protocol, union necp_sockaddr_union *cond_local_start, union necp_sockaddr_union *cond_local_end, u_int8_t cond_local_prefix, union necp_sockaddr_union *cond_remote_start, union necp_sockaddr_union *cond_remote_end, u_int8_t cond_remote_prefix, u_int16_t cond_packet_filter_tags, u_int16_t cond_scheme_port, necp_kernel_policy_result result, necp_kernel_policy_result_parameter result_parameter);
 static bool necp_kernel_ip_output_policy_delete(necp_kernel_policy_id policy_id);
@@ -558,6 +619,8 @@ SYSCTL_LONG(_net_necp, NECPCTL_SOCKET_POLICY_COUNT, socket_policy_count, CTLFLAG
 SYSCTL_LONG(_net_necp, NECPCTL_SOCKET_NON_APP_POLICY_COUNT, socket_non_app_policy_count, CTLFLAG_LOCKED | CTLFLAG_RD, &necp_kernel_socket_policies_non_app_count, "");
 SYSCTL_LONG(_net_necp, NECPCTL_IP_POLICY_COUNT, ip_policy_count, CTLFLAG_LOCKED | CTLFLAG_RD, &necp_kernel_ip_output_policies_count, "");
 SYSCTL_INT(_net_necp, NECPCTL_SESSION_COUNT, session_count, CTLFLAG_LOCKED | CTLFLAG_RD, &necp_session_count, 0, "");
+SYSCTL_INT(_net_necp, OID_AUTO, policy_compiler, CTLFLAG_LOCKED | CTLFLAG_RW, &necp_policy_compiler, 0, "Match policies through their compiled index instead of walking the maps");
+SYSCTL_INT(_net_necp, OID_AUTO, flow_cache, CTLFLAG_LOCKED | CTLFLAG_RW, &necp_flow_cache, 0, "Cache IP output policy matches per flow");
 
 static struct necp_drop_dest_policy necp_drop_dest_policy;
 static int necp_drop_dest_debug = 0;    // 0: off, 1: match, >1: every evaluation
@@ -735,6 +798,7 @@ sysctl_handle_necp_level SYSCTL_HANDLER_ARGS
 #pragma unused(arg1, arg2)
 	int error = sysctl_handle_int(oidp, oidp->oid_arg1, oidp->oid_arg2, req);
 	necp_drop_all_order = necp_get_first_order_for_priority(necp_drop_all_level);
+	necp_flow_cache_invalidate();
 	return error;
 }
 
@@ -1662,6 +1726,10 @@ necp_init(void)
 	necp_kernel_socket_policies_app_layer_map = NULL;
 
 	necp_drop_unentitled_order = necp_get_first_order_for_priority(necp_drop_unentitled_level);
+
+	if (!necp_flow_cache_init(&necp_ip_output_flow_cache, NECP_FLOW_CACHE_SIZE)) {
+		NECPLOG0(LOG_ERR, "Failed to allocate the IP output flow cache");
+	}
 }
 
 static void
@@ -4944,6 +5012,665 @@ necp_kernel_socket_policy_is_unnecessary(struct necp_kernel_socket_policy *polic
 	return FALSE;
 }
 
+// Policy Compiler
+// ---------------------
+/*
+ * Each map array is indexed by the most selective condition of its
+ * policies.  Of the conditions of a policy that require one exact value
+ * (a policy ID, pid, address prefix, account, app, uid, interface or
+ * protocol), the one whose value the fewest policies of the array share
+ * is its key, and the policy is listed under that key.  A policy without
+ * such a condition is listed as a wildcard.  Address prefixes are keyed by
+ * the masked address, for a few prefix lengths per address family.
+ *
+ * A lookup probes the key of each condition for the socket or packet, and
+ * the walk visits the union of those lists and the wildcards, in array
+ * order; every other policy fails its key condition.  A policy visited
+ * still has all its conditions checked, and while a skip is in effect the
+ * walk visits every policy, so the result is that of the linear walk.  The
+ * drop-all, drop-order and drop-dest checks only depend on a session order
+ * that grows along the array: at the next policy visited they give the
+ * answer they would have given at any policy passed over, and the last
+ * policy of the array is always visited.
+ */
+enum {
+	NECP_PI_POLICY_ID,
+	NECP_PI_PID,
+	NECP_PI_REMOTE_ADDR,
+	NECP_PI_LOCAL_ADDR,
+	NECP_PI_ACCOUNT_ID,
+	NECP_PI_REAL_APP_ID,
+	NECP_PI_APP_ID,
+	NECP_PI_UID,
+	NECP_PI_LAST_INTERFACE,
+	NECP_PI_BOUND_INTERFACE,
+	NECP_PI_PROTOCOL,
+	NECP_PI_MAX
+};
+
+#define NECP_PI_ADDR(dim)       ((dim) - NECP_PI_REMOTE_ADDR)   // 0 remote, 1 local
+#define NECP_PI_MAX_PLENS       8       // Prefix lengths probed per address family
+#define NECP_PI_MAX_LISTS       (1 + 2 + (NECP_PI_MAX - 3) + (2 * NECP_PI_MAX_PLENS))
+
+struct necp_pi_key {
+	u_int8_t                npk_dim;
+	u_int8_t                npk_family;
+	u_int8_t                npk_prefix;
+	u_int8_t                npk_pad;
+	u_int32_t               npk_value[4];   // Value, or address masked to the prefix
+};
+
+struct necp_pi_ent {
+	struct necp_pi_ent      *npe_next;
+	struct necp_pi_key      npe_key;
+	u_int32_t               npe_refs;       // Policies having this key
+	u_int32_t               npe_count;      // Policies listed under it
+	u_int32_t               *npe_pos;       // Their positions, ascending
+};
+
+struct necp_policy_index {
+	u_int32_t               npi_count;      // Policies in the array
+	u_int32_t               npi_dims;       // Dimensions with keys in use
+	u_int32_t               npi_hashmask;
+	struct necp_pi_ent      **npi_hash;
+	u_int32_t               npi_nwild;
+	u_int32_t               *npi_wild;
+	u_int32_t               *npi_pos;       // Storage for all the lists
+	u_int8_t                npi_nplen[2][2];        // [remote, local][inet, inet6]
+	u_int8_t                npi_plen[2][2][NECP_PI_MAX_PLENS];
+};
+
+struct necp_policy_query {
+	necp_kernel_policy_id   npq_policy_id;
+	necp_kernel_policy_id   npq_skip_policy_id;
+	pid_t                   npq_pid;
+	u_int32_t               npq_account_id;
+	necp_app_id             npq_real_app_id;
+	necp_app_id             npq_app_id;
+	uid_t                   npq_uid;
+	u_int32_t               npq_last_interface_index;
+	u_int32_t               npq_bound_interface_index;
+	u_int16_t               npq_protocol;
+	union necp_sockaddr_union *npq_remote;
+	union necp_sockaddr_union *npq_local;
+};
+
+struct necp_policy_cursor {
+	u_int32_t               npc_last;       // Position of the last policy
+	u_int32_t               npc_nlists;
+	struct {
+		const u_int32_t *pos;
+		const u_int32_t *end;
+	} npc_lists[NECP_PI_MAX_LISTS];
+};
+
+typedef u_int32_t (*necp_pi_keys_func)(void *policy, struct necp_pi_key *keys);
+
+static inline int
+necp_pi_afi(sa_family_t family)
+{
+	switch (family) {
+	case AF_INET:
+		return 0;
+	case AF_INET6:
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+static inline void
+necp_pi_scalar_key(struct necp_pi_key *key, u_int8_t dim, u_int32_t value)
+{
+	memset(key, 0, sizeof(*key));
+	key->npk_dim = dim;
+	key->npk_value[0] = value;
+}
+
+static bool
+necp_pi_addr_key(struct necp_pi_key *key, u_int8_t dim, const union necp_sockaddr_union *addr, u_int8_t prefix)
+{
+	const u_int8_t *bytes = NULL;
+	u_int8_t *value = (u_int8_t *)key->npk_value;
+	u_int32_t length = 0;
+
+	switch (addr->sin.sin_family) {
+	case AF_INET:
+		bytes = (const u_int8_t *)&addr->sin.sin_addr;
+		length = sizeof(addr->sin.sin_addr);
+		break;
+	case AF_INET6:
+		bytes = (const u_int8_t *)&addr->sin6.sin6_addr;
+		length = sizeof(addr->sin6.sin6_addr);
+		break;
+	default:
+		return false;
+	}
+	if (prefix > length * 8) {
+		return false;
+	}
+
+	memset(key, 0, sizeof(*key));
+	key->npk_dim = dim;
+	key->npk_family = addr->sin.sin_family;
+	key->npk_prefix = prefix;
+	memcpy(value, bytes, prefix / 8);
+	if (prefix % 8) {
+		value[prefix / 8] = bytes[prefix / 8] & (u_int8_t)~((1 << (8 - (prefix % 8))) - 1);
+	}
+	return true;
+}
+
+static inline bool
+necp_pi_addr_condition(u_int64_t mask, u_int64_t negated_mask, u_int64_t start, u_int64_t end, u_int64_t prefix)
+{
+	return (mask & (start | end | prefix)) == (start | prefix) && !(negated_mask & prefix);
+}
+
+static u_int32_t
+necp_pi_socket_policy_keys(void *arg, struct necp_pi_key *keys)
+{
+	struct necp_kernel_socket_policy *policy = arg;
+	u_int64_t mask = policy->condition_mask;
+	u_int64_t positive = mask & ~policy->condition_negated_mask;
+	u_int32_t n = 0;
+
+	if (!(mask & NECP_KERNEL_CONDITION_ALL_INTERFACES)) {
+		if (!(mask & NECP_KERNEL_CONDITION_BOUND_INTERFACE)) {
+			necp_pi_scalar_key(&keys[n++], NECP_PI_BOUND_INTERFACE, 0);
+		} else if (positive & NECP_KERNEL_CONDITION_BOUND_INTERFACE) {
+			necp_pi_scalar_key(&keys[n++], NECP_PI_BOUND_INTERFACE,
+			    policy->cond_bound_interface ? policy->cond_bound_interface->if_index : 0);
+		}
+	}
+	if (positive & NECP_KERNEL_CONDITION_PID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_PID, (u_int32_t)policy->cond_pid);
+	}
+	if (necp_pi_addr_condition(mask, policy->condition_negated_mask, NECP_KERNEL_CONDITION_REMOTE_START,
+	    NECP_KERNEL_CONDITION_REMOTE_END, NECP_KERNEL_CONDITION_REMOTE_PREFIX) &&
+	    necp_pi_addr_key(&keys[n], NECP_PI_REMOTE_ADDR, &policy->cond_remote_start, policy->cond_remote_prefix)) {
+		n++;
+	}
+	if (necp_pi_addr_condition(mask, policy->condition_negated_mask, NECP_KERNEL_CONDITION_LOCAL_START,
+	    NECP_KERNEL_CONDITION_LOCAL_END, NECP_KERNEL_CONDITION_LOCAL_PREFIX) &&
+	    necp_pi_addr_key(&keys[n], NECP_PI_LOCAL_ADDR, &policy->cond_local_start, policy->cond_local_prefix)) {
+		n++;
+	}
+	if (positive & NECP_KERNEL_CONDITION_ACCOUNT_ID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_ACCOUNT_ID, policy->cond_account_id);
+	}
+	if (positive & NECP_KERNEL_CONDITION_REAL_APP_ID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_REAL_APP_ID, policy->cond_real_app_id);
+	}
+	if (positive & NECP_KERNEL_CONDITION_APP_ID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_APP_ID, policy->cond_app_id);
+	}
+	if (positive & NECP_KERNEL_CONDITION_UID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_UID, (u_int32_t)policy->cond_uid);
+	}
+	if (positive & NECP_KERNEL_CONDITION_PROTOCOL) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_PROTOCOL, policy->cond_protocol);
+	}
+	return n;
+}
+
+static u_int32_t
+necp_pi_ip_output_policy_keys(void *arg, struct necp_pi_key *keys)
+{
+	struct necp_kernel_ip_output_policy *policy = arg;
+	u_int64_t mask = policy->condition_mask;
+	u_int64_t positive = mask & ~policy->condition_negated_mask;
+	u_int32_t n = 0;
+
+	if (!(mask & NECP_KERNEL_CONDITION_ALL_INTERFACES)) {
+		if (!(mask & NECP_KERNEL_CONDITION_BOUND_INTERFACE)) {
+			necp_pi_scalar_key(&keys[n++], NECP_PI_BOUND_INTERFACE, 0);
+		} else if (positive & NECP_KERNEL_CONDITION_BOUND_INTERFACE) {
+			necp_pi_scalar_key(&keys[n++], NECP_PI_BOUND_INTERFACE,
+			    policy->cond_bound_interface ? policy->cond_bound_interface->if_index : 0);
+		}
+	}
+	// Neither the policy ID nor the last interface condition can be negated
+	if (mask & NECP_KERNEL_CONDITION_POLICY_ID) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_POLICY_ID, policy->cond_policy_id);
+	}
+	if (necp_pi_addr_condition(mask, policy->condition_negated_mask, NECP_KERNEL_CONDITION_REMOTE_START,
+	    NECP_KERNEL_CONDITION_REMOTE_END, NECP_KERNEL_CONDITION_REMOTE_PREFIX) &&
+	    necp_pi_addr_key(&keys[n], NECP_PI_REMOTE_ADDR, &policy->cond_remote_start, policy->cond_remote_prefix)) {
+		n++;
+	}
+	if (necp_pi_addr_condition(mask, policy->condition_negated_mask, NECP_KERNEL_CONDITION_LOCAL_START,
+	    NECP_KERNEL_CONDITION_LOCAL_END, NECP_KERNEL_CONDITION_LOCAL_PREFIX) &&
+	    necp_pi_addr_key(&keys[n], NECP_PI_LOCAL_ADDR, &policy->cond_local_start, policy->cond_local_prefix)) {
+		n++;
+	}
+	if (mask & NECP_KERNEL_CONDITION_LAST_INTERFACE) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_LAST_INTERFACE, policy->cond_last_interface_index);
+	}
+	if (positive & NECP_KERNEL_CONDITION_PROTOCOL) {
+		necp_pi_scalar_key(&keys[n++], NECP_PI_PROTOCOL, policy->cond_protocol);
+	}
+	return n;
+}
+
+static inline u_int32_t
+necp_pi_hash(const struct necp_pi_key *key)
+{
+	return net_flowhash(key, sizeof(*key), 0);
+}
+
+static struct necp_pi_ent *
+necp_pi_lookup(struct necp_policy_index *npi, const struct necp_pi_key *key)
+{
+	struct necp_pi_ent *npe = npi->npi_hash[necp_pi_hash(key) & npi->npi_hashmask];
+
+	while (npe != NULL && memcmp(&npe->npe_key, key, sizeof(*key)) != 0) {
+		npe = npe->npe_next;
+	}
+	return npe;
+}
+
+static void
+necp_policy_index_free(struct necp_policy_index *npi)
+{
+	if (npi == NULL) {
+		return;
+	}
+	if (npi->npi_hash != NULL) {
+		for (u_int32_t b = 0; b <= npi->npi_hashmask; b++) {
+			struct necp_pi_ent *npe;
+
+			while ((npe = npi->npi_hash[b]) != NULL) {
+				npi->npi_hash[b] = npe->npe_next;
+				kfree_type(struct necp_pi_ent, npe);
+			}
+		}
+		kfree_type(struct necp_pi_ent *, npi->npi_hashmask + 1, npi->npi_hash);
+	}
+	if (npi->npi_pos != NULL) {
+		kfree_data(npi->npi_pos, npi->npi_count * sizeof(u_int32_t));
+	}
+	kfree_type(struct necp_policy_index, npi);
+}
+
+/*
+ * Drops the address keys of a family whose prefix lengths are too many
+ * to probe, keeping the others in place.
+ */
+static u_int32_t
+necp_pi_filter_keys(struct necp_pi_key *keys, u_int32_t n, bool allowed[2][2])
+{
+	u_int32_t kept = 0;
+
+	for (u_int32_t k = 0; k < n; k++) {
+		if (keys[k].npk_dim == NECP_PI_REMOTE_ADDR || keys[k].npk_dim == NECP_PI_LOCAL_ADDR) {
+			if (!allowed[NECP_PI_ADDR(keys[k].npk_dim)][necp_pi_afi(keys[k].npk_family)]) {
+				continue;
+			}
+		}
+		keys[kept++] = keys[k];
+	}
+	return kept;
+}
+
+static struct necp_policy_index *
+necp_policy_index_create(void **policies, necp_pi_keys_func keys_func)
+{
+	struct necp_policy_index *npi = NULL;
+	struct necp_pi_ent **chosen = NULL;
+	struct necp_pi_key keys[NECP_PI_MAX];
+	u_int64_t plens[2][2][3] = {};
+	bool allowed[2][2];
+	u_int32_t count = 0;
+	u_int32_t buckets = 16;
+	u_int32_t offset = 0;
+
+	if (policies == NULL) {
+		return NULL;
+	}
+	while (policies[count] != NULL) {
+		count++;
+	}
+	if (count == 0) {
+		return NULL;
+	}
+	while (buckets < count && buckets < (1 << 20)) {
+		buckets <<= 1;
+	}
+
+	npi = kalloc_type(struct necp_policy_index, Z_WAITOK | Z_ZERO);
+	if (npi == NULL) {
+		return NULL;
+	}
+	npi->npi_count = count;
+	npi->npi_hashmask = buckets - 1;
+	npi->npi_hash = kalloc_type(struct necp_pi_ent *, buckets, Z_WAITOK | Z_ZERO);
+	npi->npi_pos = kalloc_data(count * sizeof(u_int32_t), Z_WAITOK | Z_ZERO);
+	chosen = kalloc_type(struct necp_pi_ent *, count, Z_WAITOK | Z_ZERO);
+	if (npi->npi_hash == NULL || npi->npi_pos == NULL || chosen == NULL) {
+		goto fail;
+	}
+
+	// Only index the address prefixes of a family if a lookup can probe all their lengths
+	for (u_int32_t i = 0; i < count; i++) {
+		u_int32_t n = keys_func(policies[i], keys);
+
+		for (u_int32_t k = 0; k < n; k++) {
+			if (keys[k].npk_dim == NECP_PI_REMOTE_ADDR || keys[k].npk_dim == NECP_PI_LOCAL_ADDR) {
+				u_int8_t prefix = keys[k].npk_prefix;
+
+				plens[NECP_PI_ADDR(keys[k].npk_dim)][necp_pi_afi(keys[k].npk_family)][prefix / 64] |= 1ULL << (prefix % 64);
+			}
+		}
+	}
+	for (int a = 0; a < 2; a++) {
+		for (int f = 0; f < 2; f++) {
+			allowed[a][f] = (__builtin_popcountll(plens[a][f][0]) + __builtin_popcountll(plens[a][f][1]) +
+			    __builtin_popcountll(plens[a][f][2])) <= NECP_PI_MAX_PLENS;
+		}
+	}
+
+	// Count the policies having each key
+	for (u_int32_t i = 0; i < count; i++) {
+		u_int32_t n = necp_pi_filter_keys(keys, keys_func(policies[i], keys), allowed);
+
+		for (u_int32_t k = 0; k < n; k++) {
+			struct necp_pi_ent *npe = necp_pi_lookup(npi, &keys[k]);
+
+			if (npe == NULL) {
+				u_int32_t b = necp_pi_hash(&keys[k]) & npi->npi_hashmask;
+
+				npe = kalloc_type(struct necp_pi_ent, Z_WAITOK | Z_ZERO);
+				if (npe == NULL) {
+					goto fail;
+				}
+				npe->npe_key = keys[k];
+				npe->npe_next = npi->npi_hash[b];
+				npi->npi_hash[b] = npe;
+			}
+			npe->npe_refs++;
+		}
+	}
+
+	// List each policy under its rarest key
+	for (u_int32_t i = 0; i < count; i++) {
+		u_int32_t n = necp_pi_filter_keys(keys, keys_func(policies[i], keys), allowed);
+
+		for (u_int32_t k = 0; k < n; k++) {
+			struct necp_pi_ent *npe = necp_pi_lookup(npi, &keys[k]);
+
+			if (chosen[i] == NULL || npe->npe_refs < chosen[i]->npe_refs ||
+			    (npe->npe_refs == chosen[i]->npe_refs && npe->npe_key.npk_dim < chosen[i]->npe_key.npk_dim)) {
+				chosen[i] = npe;
+			}
+		}
+		if (chosen[i] != NULL) {
+			chosen[i]->npe_count++;
+		} else {
+			npi->npi_nwild++;
+		}
+	}
+
+	// Drop the unused keys and lay the lists out
+	for (u_int32_t b = 0; b <= npi->npi_hashmask; b++) {
+		struct necp_pi_ent **prev = &npi->npi_hash[b];
+		struct necp_pi_ent *npe;
+
+		while ((npe = *prev) != NULL) {
+			if (npe->npe_count == 0) {
+				*prev = npe->npe_next;
+				kfree_type(struct necp_pi_ent, npe);
+				continue;
+			}
+			npe->npe_pos = &npi->npi_pos[offset];
+			offset += npe->npe_count;
+			npe->npe_count = 0;
+			npi->npi_dims |= (1 << npe->npe_key.npk_dim);
+			if (npe->npe_key.npk_dim == NECP_PI_REMOTE_ADDR || npe->npe_key.npk_dim == NECP_PI_LOCAL_ADDR) {
+				int a = NECP_PI_ADDR(npe->npe_key.npk_dim);
+				int f = necp_pi_afi(npe->npe_key.npk_family);
+				u_int8_t p;
+
+				for (p = 0; p < npi->npi_nplen[a][f]; p++) {
+					if (npi->npi_plen[a][f][p] == npe->npe_key.npk_prefix) {
+						break;
+					}
+				}
+				if (p == npi->npi_nplen[a][f]) {
+					npi->npi_plen[a][f][npi->npi_nplen[a][f]++] = npe->npe_key.npk_prefix;
+				}
+			}
+			prev = &npe->npe_next;
+		}
+	}
+	npi->npi_wild = &npi->npi_pos[offset];
+	npi->npi_nwild = 0;
+	for (u_int32_t i = 0; i < count; i++) {
+		if (chosen[i] != NULL) {
+			chosen[i]->npe_pos[chosen[i]->npe_count++] = i;
+		} else {
+			npi->npi_wild[npi->npi_nwild++] = i;
+		}
+	}
+
+	kfree_type(struct necp_pi_ent *, count, chosen);
+	return npi;
+
+fail:
+	if (chosen != NULL) {
+		kfree_type(struct necp_pi_ent *, count, chosen);
+	}
+	necp_policy_index_free(npi);
+	return NULL;
+}
+
+static struct necp_policy_index *
+necp_policy_index_socket_create(struct necp_kernel_socket_policy **policies)
+{
+	return necp_policy_index_create((void **)policies, necp_pi_socket_policy_keys);
+}
+
+static struct necp_policy_index *
+necp_policy_index_ip_output_create(struct necp_kernel_ip_output_policy **policies)
+{
+	return necp_policy_index_create((void **)policies, necp_pi_ip_output_policy_keys);
+}
+
+static inline void
+necp_pi_probe(struct necp_policy_cursor *npc, struct necp_policy_index *npi, const struct necp_pi_key *key)
+{
+	struct necp_pi_ent *npe = necp_pi_lookup(npi, key);
+
+	if (npe != NULL) {
+		VERIFY(npc->npc_nlists < NECP_PI_MAX_LISTS);
+		npc->npc_lists[npc->npc_nlists].pos = npe->npe_pos;
+		npc->npc_lists[npc->npc_nlists].end = npe->npe_pos + npe->npe_count;
+		npc->npc_nlists++;
+	}
+}
+
+static void
+necp_policy_cursor_init(struct necp_policy_cursor *npc, struct necp_policy_index *npi, const struct necp_policy_query *npq)
+{
+	struct necp_pi_key key;
+	u_int32_t values[NECP_PI_MAX] = {
+		[NECP_PI_PID] = (u_int32_t)npq->npq_pid,
+		[NECP_PI_ACCOUNT_ID] = npq->npq_account_id,
+		[NECP_PI_REAL_APP_ID] = npq->npq_real_app_id,
+		[NECP_PI_APP_ID] = npq->npq_app_id,
+		[NECP_PI_UID] = (u_int32_t)npq->npq_uid,
+		[NECP_PI_LAST_INTERFACE] = npq->npq_last_interface_index,
+		[NECP_PI_BOUND_INTERFACE] = npq->npq_bound_interface_index,
+		[NECP_PI_PROTOCOL] = npq->npq_protocol,
+	};
+
+	npc->npc_last = npi->npi_count - 1;
+	npc->npc_nlists = 0;
+	if (npi->npi_nwild > 0) {
+		npc->npc_lists[0].pos = npi->npi_wild;
+		npc->npc_lists[0].end = npi->npi_wild + npi->npi_nwild;
+		npc->npc_nlists = 1;
+	}
+
+	for (u_int8_t dim = 0; dim < NECP_PI_MAX; dim++) {
+		if (!(npi->npi_dims & (1 << dim))) {
+			continue;
+		}
+		switch (dim) {
+		case NECP_PI_POLICY_ID:
+			// A skip policy is matched against the skip policy ID
+			necp_pi_scalar_key(&key, dim, npq->npq_policy_id);
+			necp_pi_probe(npc, npi, &key);
+			if (npq->npq_skip_policy_id != npq->npq_policy_id) {
+				necp_pi_scalar_key(&key, dim, npq->npq_skip_policy_id);
+				necp_pi_probe(npc, npi, &key);
+			}
+			break;
+		case NECP_PI_REMOTE_ADDR:
+		case NECP_PI_LOCAL_ADDR: {
+			union necp_sockaddr_union *addr = (dim == NECP_PI_REMOTE_ADDR) ? npq->npq_remote : npq->npq_local;
+			int a = NECP_PI_ADDR(dim);
+			int f;
+
+			if (addr == NULL || (f = necp_pi_afi(addr->sin.sin_family)) < 0) {
+				break;
+			}
+			for (u_int8_t p = 0; p < npi->npi_nplen[a][f]; p++) {
+				if (necp_pi_addr_key(&key, dim, addr, npi->npi_plen[a][f][p])) {
+					necp_pi_probe(npc, npi, &key);
+				}
+			}
+			break;
+		}
+		default:
+			necp_pi_scalar_key(&key, dim, values[dim]);
+			necp_pi_probe(npc, npi, &key);
+			break;
+		}
+	}
+}
+
+/*
+ * The first position at or after `from' that can match: the next policy
+ * on one of the lists, or else the last policy of the array.  Past the
+ * last policy, the position of the NULL that ends the array.
+ */
+static u_int32_t
+necp_policy_cursor_next(struct necp_policy_cursor *npc, u_int32_t from)
+{
+	u_int32_t next = npc->npc_last;
+
+	if (from > npc->npc_last) {
+		return npc->npc_last + 1;
+	}
+	for (u_int32_t l = 0; l < npc->npc_nlists; l++) {
+		const u_int32_t *pos = npc->npc_lists[l].pos;
+		const u_int32_t *end = npc->npc_lists[l].end;
+
+		while (pos < end && *pos < from) {
+			pos++;
+		}
+		npc->npc_lists[l].pos = pos;
+		if (pos < end && *pos < next) {
+			next = *pos;
+		}
+	}
+	return next;
+}
+
+// IP Output Flow Cache
+// ---------------------
+static void
+necp_flow_cache_invalidate(void)
+{
+	u_int32_t gencount = os_atomic_inc(&necp_flow_cache_gencount, release);
+
+	if (gencount == 0) {
+		// Entries with gencount 0 are empty
+		(void)os_atomic_cmpxchg(&necp_flow_cache_gencount, 0, 1, release);
+	}
+}
+
+static bool
+necp_flow_cache_init(struct necp_flow_cache *nfc, u_int32_t size)
+{
+	nfc->nfc_entries = kalloc_type(struct necp_flow_cache_entry, size, Z_WAITOK | Z_ZERO);
+	if (nfc->nfc_entries == NULL) {
+		return false;
+	}
+	nfc->nfc_mask = size - 1;
+	nfc->nfc_seed = RandomULong();
+	return true;
+}
+
+static void
+necp_flow_cache_destroy(struct necp_flow_cache *nfc)
+{
+	if (nfc->nfc_entries != NULL) {
+		kfree_type(struct necp_flow_cache_entry, nfc->nfc_mask + 1, nfc->nfc_entries);
+		nfc->nfc_entries = NULL;
+	}
+}
+
+static inline void
+necp_flow_key_init(struct necp_flow_key *key, necp_kernel_policy_id socket_policy_id, necp_kernel_policy_id socket_skip_policy_id, u_int32_t bound_interface_index, u_int32_t last_interface_index, u_int16_t protocol, union necp_sockaddr_union *local_addr, union necp_sockaddr_union *remote_addr, u_int16_t pf_tag)
+{
+	memset(key, 0, sizeof(*key));
+	key->policy_id = socket_policy_id;
+	key->skip_policy_id = socket_skip_policy_id;
+	key->bound_interface_index = bound_interface_index;
+	key->last_interface_index = last_interface_index;
+	key->protocol = protocol;
+	key->pf_tag = pf_tag;
+	memcpy(&key->local_addr, local_addr, sizeof(key->local_addr));
+	memcpy(&key->remote_addr, remote_addr, sizeof(key->remote_addr));
+}
+
+static inline struct necp_flow_cache_entry *
+necp_flow_cache_slot(struct necp_flow_cache *nfc, const struct necp_flow_key *key)
+{
+	return &nfc->nfc_entries[net_flowhash(key, sizeof(*key), nfc->nfc_seed) & nfc->nfc_mask];
+}
+
+static bool
+necp_flow_cache_lookup(struct necp_flow_cache *nfc, const struct necp_flow_key *key, struct necp_ip_output_match *match)
+{
+	struct necp_flow_cache_entry *nfe = necp_flow_cache_slot(nfc, key);
+	u_int32_t gencount = os_atomic_load(&necp_flow_cache_gencount, relaxed);
+	u_int32_t seq = os_atomic_load(&nfe->nfe_seq, acquire);
+	bool hit;
+
+	if (seq & 1) {
+		return false;
+	}
+	hit = (nfe->nfe_gencount == gencount && memcmp(&nfe->nfe_key, key, sizeof(*key)) == 0);
+	if (hit) {
+		memcpy(match, &nfe->nfe_match, sizeof(*match));
+	}
+	os_atomic_thread_fence(acquire);
+	return hit && os_atomic_load(&nfe->nfe_seq, relaxed) == seq;
+}
+
+/*
+ * Fills the slot of `key', unless another writer holds it.  `gencount' is
+ * the generation read before the match was made.
+ */
+static void
+necp_flow_cache_insert(struct necp_flow_cache *nfc, const struct necp_flow_key *key, const struct necp_ip_output_match *match, u_int32_t gencount)
+{
+	struct necp_flow_cache_entry *nfe = necp_flow_cache_slot(nfc, key);
+	u_int32_t seq = os_atomic_load(&nfe->nfe_seq, relaxed);
+
+	if ((seq & 1) || !os_atomic_cmpxchg(&nfe->nfe_seq, seq, seq + 1, relaxed)) {
+		return;
+	}
+	os_atomic_thread_fence(release);
+	nfe->nfe_gencount = gencount;
+	memcpy(&nfe->nfe_key, key, sizeof(*key));
+	memcpy(&nfe->nfe_match, match, sizeof(*match));
+	os_atomic_store(&nfe->nfe_seq, seq + 2, release);
+}
+
 static bool
 necp_kernel_socket_policies_reprocess(void)
 {
@@ -4969,10 +5696,14 @@ necp_kernel_socket_policies_reprocess(void)
 			    necp_kernel_socket_policies_map[app_i]);
 			necp_kernel_socket_policies_map[app_i] = NULL;
 		}
+		necp_policy_index_free(necp_kernel_socket_policies_index[app_i]);
+		necp_kernel_socket_policies_index[app_i] = NULL;
 
 		// Init counts
 		necp_kernel_socket_policies_map_counts[app_i] = 0;
 	}
+	necp_policy_index_free(necp_kernel_socket_policies_app_layer_index);
+	necp_kernel_socket_policies_app_layer_index = NULL;
 	if (necp_kernel_socket_policies_app_layer_map != NULL) {
 		kfree_type(struct necp_kernel_socket_policy *,
 		    necp_kernel_socket_policies_app_layer_map_count + 1,
@@ -5059,6 +5790,13 @@ necp_kernel_socket_policies_reprocess(void)
 			}
 		}
 	}
+
+	// Index the maps; a map without an index is walked linearly
+	for (app_i = 0; app_i < NECP_KERNEL_SOCKET_POLICIES_MAP_NUM_APP_ID_BUCKETS; app_i++) {
+		necp_kernel_socket_policies_index[app_i] = necp_policy_index_socket_create(necp_kernel_socket_policies_map[app_i]);
+	}
+	necp_kernel_socket_policies_app_layer_index = necp_policy_index_socket_create(necp_kernel_socket_policies_app_layer_map);
+
 	necp_kernel_socket_policies_dump_all();
 	BUMP_KERNEL_SOCKET_POLICIES_GENERATION_COUNT();
 	return TRUE;
@@ -6349,6 +7087,8 @@ necp_kernel_ip_output_policies_reprocess(void)
 			    necp_kernel_ip_output_policies_map[i]);
 			necp_kernel_ip_output_policies_map[i] = NULL;
 		}
+		necp_policy_index_free(necp_kernel_ip_output_policies_index[i]);
+		necp_kernel_ip_output_policies_index[i] = NULL;
 
 		// Init counts
 		necp_kernel_ip_output_policies_map_counts[i] = 0;
@@ -6410,6 +7150,13 @@ necp_kernel_ip_output_policies_reprocess(void)
 			}
 		}
 	}
+
+	// Index the maps; a map without an index is walked linearly
+	for (i = 0; i < NECP_KERNEL_IP_OUTPUT_POLICIES_MAP_NUM_ID_BUCKETS; i++) {
+		necp_kernel_ip_output_policies_index[i] = necp_policy_index_ip_output_create(necp_kernel_ip_output_policies_map[i]);
+	}
+	necp_flow_cache_invalidate();
+
 	necp_kernel_ip_output_policies_dump_all();
 	return TRUE;
 
@@ -6426,6 +7173,7 @@ fail:
 			necp_kernel_ip_output_policies_map[i] = NULL;
 		}
 	}
+	necp_flow_cache_invalidate();
 	return FALSE;
 }
 
@@ -7273,7 +8021,7 @@ necp_application_find_policy_match_internal(proc_t proc,
 	int debug = NECP_ENABLE_DATA_TRACE((&info.local_addr), (&info.remote_addr), info.protocol, info.pid);
 	NECP_DATA_TRACE_LOG_SOCKET(debug, "APPLICATION", "START", 0, 0);
 
-	matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_app_layer_map, &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, netagent_use_flags, NECP_MAX_NETAGENTS, required_agent_types, num_required_agent_types, info.used_responsible_pid ? responsible_proc : effective_proc, 0, NULL, NULL, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, NULL, debug);
+	matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_app_layer_map, NECP_POLICY_INDEX(necp_kernel_socket_policies_app_layer_index), &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, netagent_use_flags, NECP_MAX_NETAGENTS, required_agent_types, num_required_agent_types, info.used_responsible_pid ? responsible_proc : effective_proc, 0, NULL, NULL, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, NULL, debug);
 
 	// Check for loopback exception again after the policy match
 	if (bypass_type == NECP_BYPASS_TYPE_LOOPBACK &&
@@ -8690,7 +9438,7 @@ necp_socket_fillout_info_locked(struct inpcb *inp, struct sockaddr *override_loc
 #define IS_NECP_KERNEL_POLICY_IP_RESULT(result) (result == NECP_KERNEL_POLICY_RESULT_PASS || result == NECP_KERNEL_POLICY_RESULT_DROP || result == NECP_KERNEL_POLICY_RESULT_IP_TUNNEL || result == NECP_KERNEL_POLICY_RESULT_ROUTE_RULES)
 
 static inline struct necp_kernel_socket_policy *
-necp_socket_find_policy_match_with_info_locked(struct necp_kernel_socket_policy **policy_search_array, struct necp_socket_info *info,
+necp_socket_find_policy_match_with_info_locked(struct necp_kernel_socket_policy **policy_search_array, struct necp_policy_index *policy_index, struct necp_socket_info *info,
     necp_kernel_policy_filter *return_filter,
     u_int32_t *return_route_rule_id_array, size_t *return_route_rule_id_array_count, size_t route_rule_id_array_count,
     necp_kernel_policy_result *return_service_action, necp_kernel_policy_service *return_service,
@@ -8749,7 +9497,25 @@ necp_socket_find_policy_match_with_info_locked(struct necp_kernel_socket_policy
 	*return_drop_dest_policy_result = NECP_KERNEL_POLICY_RESULT_NONE;
 
 	if (policy_search_array != NULL) {
-		for (i = 0; policy_search_array[i] != NULL; i++) {
+		// With an index, only visit the policies that can match, except while skipping
+		struct necp_policy_cursor cursor;
+		bool indexed = (policy_index != NULL);
+		if (indexed) {
+			struct necp_policy_query query = {
+				.npq_pid = info->pid,
+				.npq_account_id = info->account_id,
+				.npq_real_app_id = info->real_application_id,
+				.npq_app_id = info->application_id,
+				.npq_uid = info->uid,
+				.npq_bound_interface_index = info->bound_interface_index,
+				.npq_protocol = info->protocol,
+				.npq_remote = &info->remote_addr,
+				.npq_local = &info->local_addr,
+			};
+			necp_policy_cursor_init(&cursor, policy_index, &query);
+		}
+		for (i = indexed ? (int)necp_policy_cursor_next(&cursor, 0) : 0; policy_search_array[i] != NULL;
+		    i = (indexed && !skip_order && !skip_session_order) ? (int)necp_policy_cursor_next(&cursor, i + 1) : i + 1) {
 			NECP_DATA_TRACE_LOG_POLICY(debug, "SOCKET", "EXAMINING");
 
 			if (necp_drop_all_order != 0 && policy_search_array[i]->session_order >= necp_drop_all_order) {
@@ -9177,7 +9943,7 @@ necp_socket_find_policy_match(struct inpcb *inp, struct sockaddr *override_local
 	u_int32_t route_rule_id_array[MAX_AGGREGATE_ROUTE_RULES] = {};
 	size_t route_rule_id_array_count = 0;
 
-	matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_map[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)], &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, NULL, NECP_MAX_NETAGENTS, NULL, 0, socket_proc ? socket_proc : current_proc(), 0, &skip_policy_id, inp->inp_route.ro_rt, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, so, debug);
+	matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_map[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)], NECP_POLICY_INDEX(necp_kernel_socket_policies_index[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)]), &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, NULL, NECP_MAX_NETAGENTS, NULL, 0, socket_proc ? socket_proc : current_proc(), 0, &skip_policy_id, inp->inp_route.ro_rt, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, so, debug);
 
 	// Check for loopback exception again after the policy match
 	if (bypass_type == NECP_BYPASS_TYPE_LOOPBACK &&
@@ -9589,12 +10355,11 @@ necp_ip_output_check_policy(struct necp_kernel_ip_output_policy *kernel_policy,
 }
 
 static inline struct necp_kernel_ip_output_policy *
-necp_ip_output_find_policy_match_locked(necp_kernel_policy_id socket_policy_id, necp_kernel_policy_id socket_skip_policy_id, u_int32_t bound_interface_index, u_int32_t last_interface_index, u_int16_t protocol, union necp_sockaddr_union *local_addr, union necp_sockaddr_union *remote_addr, struct rtentry *rt, u_int16_t pf_tag, u_int32_t *return_route_rule_id, necp_kernel_policy_result *return_drop_dest_policy_result, necp_drop_all_bypass_check_result_t *return_drop_all_bypass, int debug)
+necp_ip_output_find_policy_match_locked(struct necp_kernel_ip_output_policy **policy_search_array, struct necp_policy_index *policy_index, necp_kernel_policy_id socket_policy_id, necp_kernel_policy_id socket_skip_policy_id, u_int32_t bound_interface_index, u_int32_t last_interface_index, u_int16_t protocol, union necp_sockaddr_union *local_addr, union necp_sockaddr_union *remote_addr, struct rtentry *rt, u_int16_t pf_tag, u_int32_t *return_route_rule_id, necp_kernel_policy_result *return_drop_dest_policy_result, necp_drop_all_bypass_check_result_t *return_drop_all_bypass, int debug)
 {
 	u_int32_t skip_order = 0;
 	u_int32_t skip_session_order = 0;
 	struct necp_kernel_ip_output_policy *matched_policy = NULL;
-	struct necp_kernel_ip_output_policy **policy_search_array = necp_kernel_ip_output_policies_map[NECP_IP_OUTPUT_MAP_ID_TO_BUCKET(socket_policy_id)];
 	u_int32_t route_rule_id_array[MAX_AGGREGATE_ROUTE_RULES];
 	size_t route_rule_id_count = 0;
 	necp_drop_all_bypass_check_result_t drop_all_bypass = NECP_DROP_ALL_BYPASS_CHECK_RESULT_NONE;
@@ -9609,7 +10374,23 @@ necp_ip_output_find_policy_match_locked(necp_kernel_policy_id socket_policy_id,
 	*return_drop_dest_policy_result = NECP_KERNEL_POLICY_RESULT_NONE;
 
 	if (policy_search_array != NULL) {
-		for (int i = 0; policy_search_array[i] != NULL; i++) {
+		// With an index, only visit the policies that can match, except while skipping
+		struct necp_policy_cursor cursor;
+		bool indexed = (policy_index != NULL);
+		if (indexed) {
+			struct necp_policy_query query = {
+				.npq_policy_id = socket_policy_id,
+				.npq_skip_policy_id = socket_skip_policy_id,
+				.npq_last_interface_index = last_interface_index,
+				.npq_bound_interface_index = bound_interface_index,
+				.npq_protocol = protocol,
+				.npq_remote = remote_addr,
+				.npq_local = local_addr,
+			};
+			necp_policy_cursor_init(&cursor, policy_index, &query);
+		}
+		for (int i = indexed ? (int)necp_policy_cursor_next(&cursor, 0) : 0; policy_search_array[i] != NULL;
+		    i = (indexed && !skip_order && !skip_session_order) ? (int)necp_policy_cursor_next(&cursor, i + 1) : i + 1) {
 			NECP_DATA_TRACE_LOG_POLICY(debug, "IP", "EXAMINING");
 			if (necp_drop_all_order != 0 && policy_search_array[i]->session_order >= necp_drop_all_order) {
 				// We've hit a drop all rule
@@ -9682,6 +10463,45 @@ necp_ip_output_find_policy_match_locked(necp_kernel_policy_id socket_policy_id,
 	return matched_policy;
 }
 
+/*
+ * Matches an outgoing packet against the IP output policies, taking the
+ * result from the flow cache `nfc' when it has one and filling it in
+ * otherwise.
+ */
+static void
+necp_ip_output_find_policy_match_cached(struct necp_flow_cache *nfc, necp_kernel_policy_id socket_policy_id, necp_kernel_policy_id socket_skip_policy_id, u_int32_t bound_interface_index, u_int32_t last_interface_index, u_int16_t protocol, union necp_sockaddr_union *local_addr, union necp_sockaddr_union *remote_addr, struct rtentry *rt, u_int16_t pf_tag, struct necp_ip_output_match *match, int debug)
+{
+	struct necp_kernel_ip_output_policy *matched_policy = NULL;
+	int bucket = NECP_IP_OUTPUT_MAP_ID_TO_BUCKET(socket_policy_id);
+	bool use_cache = (necp_flow_cache && nfc->nfc_entries != NULL && debug == 0);
+	struct necp_flow_key key;
+	u_int32_t gencount = 0;
+
+	if (use_cache) {
+		necp_flow_key_init(&key, socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, local_addr, remote_addr, pf_tag);
+		if (necp_flow_cache_lookup(nfc, &key, match)) {
+			return;
+		}
+	}
+
+	memset(match, 0, sizeof(*match));
+	lck_rw_lock_shared(&necp_kernel_policy_lock);
+	gencount = os_atomic_load(&necp_flow_cache_gencount, acquire);
+	matched_policy = necp_ip_output_find_policy_match_locked(necp_kernel_ip_output_policies_map[bucket], NECP_POLICY_INDEX(necp_kernel_ip_output_policies_index[bucket]),
+	    socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, local_addr, remote_addr, rt, pf_tag,
+	    &match->route_rule_id, &match->drop_dest_policy_result, &match->drop_all_bypass, debug);
+	if (matched_policy != NULL) {
+		match->policy_id = matched_policy->id;
+		match->result = matched_policy->result;
+		memcpy(&match->result_parameter, &matched_policy->result_parameter, sizeof(match->result_parameter));
+	}
+	if (use_cache && match->drop_all_bypass == NECP_DROP_ALL_BYPASS_CHECK_RESULT_NONE &&
+	    !(necp_kernel_ip_output_policies_condition_mask & NECP_KERNEL_CONDITION_LOCAL_NETWORKS)) {
+		necp_flow_cache_insert(nfc, &key, match, gencount);
+	}
+	lck_rw_done(&necp_kernel_policy_lock);
+}
+
 static inline bool
 necp_output_bypass(struct mbuf *packet)
 {
@@ -9706,7 +10526,6 @@ necp_ip_output_find_policy_match(struct mbuf *packet, int flags, struct ip_out_a
 	necp_kernel_policy_id socket_policy_id = NECP_KERNEL_POLICY_ID_NONE;
 	necp_kernel_policy_id socket_skip_policy_id = NECP_KERNEL_POLICY_ID_NONE;
 	necp_kernel_policy_id matched_policy_id = NECP_KERNEL_POLICY_ID_NONE;
-	struct necp_kernel_ip_output_policy *matched_policy = NULL;
 	u_int16_t protocol = 0;
 	u_int32_t bound_interface_index = 0;
 	u_int32_t last_interface_index = 0;
@@ -9812,21 +10631,23 @@ necp_ip_output_find_policy_match(struct mbuf *packet, int flags, struct ip_out_a
 	}
 
 	// Match packet to policy
-	lck_rw_lock_shared(&necp_kernel_policy_lock);
-	u_int32_t route_rule_id = 0;
+	struct necp_ip_output_match match;
 
 	int debug = NECP_ENABLE_DATA_TRACE((&local_addr), (&remote_addr), protocol, 0);
 	NECP_DATA_TRACE_LOG_IP(debug, "IPv4", "START");
 
-	matched_policy = necp_ip_output_find_policy_match_locked(socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, &local_addr, &remote_addr, rt, pf_tag, &route_rule_id, &drop_dest_policy_result, &drop_all_bypass, debug);
-	if (matched_policy) {
-		matched_policy_id = matched_policy->id;
+	necp_ip_output_find_policy_match_cached(&necp_ip_output_flow_cache, socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, &local_addr, &remote_addr, rt, pf_tag, &match, debug);
+	u_int32_t route_rule_id = match.route_rule_id;
+	drop_dest_policy_result = match.drop_dest_policy_result;
+	drop_all_bypass = match.drop_all_bypass;
+	if (match.policy_id != NECP_KERNEL_POLICY_ID_NONE) {
+		matched_policy_id = match.policy_id;
 		if (result) {
-			*result = matched_policy->result;
+			*result = match.result;
 		}
 
 		if (result_parameter) {
-			memcpy(result_parameter, &matched_policy->result_parameter, sizeof(matched_policy->result_parameter));
+			memcpy(result_parameter, &match.result_parameter, sizeof(match.result_parameter));
 		}
 
 		if (route_rule_id != 0 &&
@@ -9835,7 +10656,7 @@ necp_ip_output_find_policy_match(struct mbuf *packet, int flags, struct ip_out_a
 		}
 
 		if (necp_debug > 1 || NECP_DATA_TRACE_POLICY_ON(debug)) {
-			NECPLOG(LOG_DEBUG, "IP Output: (ID %d BoundInterface %d LastInterface %d Proto %d) Policy %d Result %d Parameter %d Route Rule %u", socket_policy_id, bound_interface_index, last_interface_index, protocol, matched_policy->id, matched_policy->result, matched_policy->result_parameter.tunnel_interface_index, route_rule_id);
+			NECPLOG(LOG_DEBUG, "IP Output: (ID %d BoundInterface %d LastInterface %d Proto %d) Policy %d Result %d Parameter %d Route Rule %u", socket_policy_id, bound_interface_index, last_interface_index, protocol, match.policy_id, match.result, match.result_parameter.tunnel_interface_index, route_rule_id);
 		}
 	} else {
 		bool drop_all = false;
@@ -9863,8 +10684,6 @@ necp_ip_output_find_policy_match(struct mbuf *packet, int flags, struct ip_out_a
 		}
 	}
 
-	lck_rw_done(&necp_kernel_policy_lock);
-
 	return matched_policy_id;
 }
 
@@ -9878,7 +10697,6 @@ necp_ip6_output_find_policy_match(struct mbuf *packet, int flags, struct ip6_out
 	necp_kernel_policy_id socket_policy_id = NECP_KERNEL_POLICY_ID_NONE;
 	necp_kernel_policy_id socket_skip_policy_id = NECP_KERNEL_POLICY_ID_NONE;
 	necp_kernel_policy_id matched_policy_id = NECP_KERNEL_POLICY_ID_NONE;
-	struct necp_kernel_ip_output_policy *matched_policy = NULL;
 	u_int16_t protocol = 0;
 	u_int32_t bound_interface_index = 0;
 	u_int32_t last_interface_index = 0;
@@ -9981,21 +10799,23 @@ necp_ip6_output_find_policy_match(struct mbuf *packet, int flags, struct ip6_out
 	}
 
 	// Match packet to policy
-	lck_rw_lock_shared(&necp_kernel_policy_lock);
-	u_int32_t route_rule_id = 0;
+	struct necp_ip_output_match match;
 
 	int debug = NECP_ENABLE_DATA_TRACE((&local_addr), (&remote_addr), protocol, 0);
 	NECP_DATA_TRACE_LOG_IP(debug, "IPv6", "START");
 
-	matched_policy = necp_ip_output_find_policy_match_locked(socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, &local_addr, &remote_addr, rt, pf_tag, &route_rule_id, &drop_dest_policy_result, &drop_all_bypass, debug);
-	if (matched_policy) {
-		matched_policy_id = matched_policy->id;
+	necp_ip_output_find_policy_match_cached(&necp_ip_output_flow_cache, socket_policy_id, socket_skip_policy_id, bound_interface_index, last_interface_index, protocol, &local_addr, &remote_addr, rt, pf_tag, &match, debug);
+	u_int32_t route_rule_id = match.route_rule_id;
+	drop_dest_policy_result = match.drop_dest_policy_result;
+	drop_all_bypass = match.drop_all_bypass;
+	if (match.policy_id != NECP_KERNEL_POLICY_ID_NONE) {
+		matched_policy_id = match.policy_id;
 		if (result) {
-			*result = matched_policy->result;
+			*result = match.result;
 		}
 
 		if (result_parameter) {
-			memcpy(result_parameter, &matched_policy->result_parameter, sizeof(matched_policy->result_parameter));
+			memcpy(result_parameter, &match.result_parameter, sizeof(match.result_parameter));
 		}
 
 		if (route_rule_id != 0 &&
@@ -10004,7 +10824,7 @@ necp_ip6_output_find_policy_match(struct mbuf *packet, int flags, struct ip6_out
 		}
 
 		if (necp_debug > 1 || NECP_DATA_TRACE_POLICY_ON(debug)) {
-			NECPLOG(LOG_DEBUG, "IP6 Output: (ID %d BoundInterface %d LastInterface %d Proto %d) Policy %d Result %d Parameter %d Route Rule %u", socket_policy_id, bound_interface_index, last_interface_index, protocol, matched_policy->id, matched_policy->result, matched_policy->result_parameter.tunnel_interface_index, route_rule_id);
+			NECPLOG(LOG_DEBUG, "IP6 Output: (ID %d BoundInterface %d LastInterface %d Proto %d) Policy %d Result %d Parameter %d Route Rule %u", socket_policy_id, bound_interface_index, last_interface_index, protocol, match.policy_id, match.result, match.result_parameter.tunnel_interface_index, route_rule_id);
 		}
 	} else {
 		bool drop_all = false;
@@ -10032,11 +10852,336 @@ necp_ip6_output_find_policy_match(struct mbuf *packet, int flags, struct ip6_out
 		}
 	}
 
-	lck_rw_done(&necp_kernel_policy_lock);
-
 	return matched_policy_id;
 }
 
+#if (DEVELOPMENT || DEBUG)
+/*
+ * Policy matching rate against a synthetic table of `in' policies, most
+ * of them for remote hosts and /24s, with protocol, pid (policy ID at IP
+ * output), uid (last interface at IP output), address range and skip
+ * policies mixed in, in four sessions.  Flows go to the addresses of
+ * random policies, or elsewhere.  The walk through the index is first
+ * checked against the linear walk; the rate then follows the
+ * policy_compiler and flow_cache knobs.
+ */
+#define NECP_PM_TEST_FLOWS      256
+#define NECP_PM_TEST_CHECKS     4096
+#define NECP_PM_TEST_BASE_PID   100000
+
+struct necp_pm_test_flow {
+	union necp_sockaddr_union       remote;
+	u_int16_t                       protocol;
+	u_int32_t                       policy;
+};
+
+static u_int32_t
+necp_pm_test_rand(u_int64_t *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (u_int32_t)(*seed >> 33);
+}
+
+static void
+necp_pm_test_addr(union necp_sockaddr_union *addr, u_int32_t host)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin.sin_family = AF_INET;
+	addr->sin.sin_len = sizeof(struct sockaddr_in);
+	addr->sin.sin_addr.s_addr = htonl(0x0a000000 | (host & 0x00ffffff));
+}
+
+static void
+necp_pm_test_policy(struct necp_kernel_socket_policy *policy, u_int32_t i, u_int32_t n)
+{
+	policy->id = i + 1;
+	policy->order = i + 1;
+	policy->session_order = 1 + (u_int32_t)(((u_int64_t)i * 4) / n);
+	policy->condition_mask = NECP_KERNEL_CONDITION_ALL_INTERFACES;
+	policy->result = (i % 2) ? NECP_KERNEL_POLICY_RESULT_PASS : NECP_KERNEL_POLICY_RESULT_DROP;
+
+	switch (i % 16) {
+	case 0:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_REMOTE_START | NECP_KERNEL_CONDITION_REMOTE_END;
+		necp_pm_test_addr(&policy->cond_remote_start, 0xff0000 | (i & 0xff00));
+		necp_pm_test_addr(&policy->cond_remote_end, 0xff0000 | (i & 0xff00) | 0xff);
+		break;
+	case 1:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_REMOTE_START | NECP_KERNEL_CONDITION_REMOTE_PREFIX;
+		necp_pm_test_addr(&policy->cond_remote_start, i << 8);
+		policy->cond_remote_prefix = 24;
+		break;
+	case 2:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_REMOTE_START | NECP_KERNEL_CONDITION_REMOTE_PREFIX |
+		    NECP_KERNEL_CONDITION_PROTOCOL;
+		if (i % 32 == 2) {
+			policy->condition_negated_mask |= NECP_KERNEL_CONDITION_PROTOCOL;
+		}
+		necp_pm_test_addr(&policy->cond_remote_start, (i << 8) | 1);
+		policy->cond_remote_prefix = 32;
+		policy->cond_protocol = IPPROTO_TCP;
+		break;
+	case 3:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_PID;
+		policy->cond_pid = NECP_PM_TEST_BASE_PID + i;
+		break;
+	case 4:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_REMOTE_START | NECP_KERNEL_CONDITION_REMOTE_PREFIX;
+		necp_pm_test_addr(&policy->cond_remote_start, (i << 8) | 1);
+		policy->cond_remote_prefix = 32;
+		policy->result = NECP_KERNEL_POLICY_RESULT_SKIP;
+		policy->result_parameter.skip_policy_order = policy->order + 3;
+		break;
+	case 5:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_UID;
+		policy->cond_uid = i;
+		break;
+	default:
+		policy->condition_mask |= NECP_KERNEL_CONDITION_REMOTE_START | NECP_KERNEL_CONDITION_REMOTE_PREFIX;
+		necp_pm_test_addr(&policy->cond_remote_start, (i << 8) | 1);
+		policy->cond_remote_prefix = 32;
+		break;
+	}
+}
+
+static void
+necp_pm_test_ip_policy(struct necp_kernel_ip_output_policy *ip_policy, const struct necp_kernel_socket_policy *policy)
+{
+	ip_policy->id = policy->id;
+	ip_policy->order = policy->order;
+	ip_policy->session_order = policy->session_order;
+	ip_policy->condition_mask = policy->condition_mask & ~(NECP_KERNEL_CONDITION_PID | NECP_KERNEL_CONDITION_UID);
+	ip_policy->condition_negated_mask = policy->condition_negated_mask;
+	ip_policy->cond_protocol = policy->cond_protocol;
+	ip_policy->cond_remote_start = policy->cond_remote_start;
+	ip_policy->cond_remote_end = policy->cond_remote_end;
+	ip_policy->cond_remote_prefix = policy->cond_remote_prefix;
+	if (policy->condition_mask & NECP_KERNEL_CONDITION_PID) {
+		ip_policy->condition_mask |= NECP_KERNEL_CONDITION_POLICY_ID;
+		ip_policy->cond_policy_id = policy->id;
+	}
+	if (policy->condition_mask & NECP_KERNEL_CONDITION_UID) {
+		ip_policy->condition_mask |= NECP_KERNEL_CONDITION_LAST_INTERFACE;
+		ip_policy->cond_last_interface_index = policy->cond_uid;
+	}
+	ip_policy->result = policy->result;
+	ip_policy->result_parameter = policy->result_parameter;
+}
+
+static void
+necp_pm_test_flow(struct necp_pm_test_flow *flow, u_int32_t n, u_int64_t *seed)
+{
+	u_int32_t i = necp_pm_test_rand(seed) % n;
+
+	flow->policy = i;
+	flow->protocol = (necp_pm_test_rand(seed) % 2) ? IPPROTO_TCP : IPPROTO_UDP;
+	switch (necp_pm_test_rand(seed) % 4) {
+	case 0:
+		// Nowhere near a policy
+		necp_pm_test_addr(&flow->remote, 0xfe0000 | (necp_pm_test_rand(seed) & 0xffff));
+		break;
+	case 1:
+		necp_pm_test_addr(&flow->remote, (i << 8) | (necp_pm_test_rand(seed) & 0xff));
+		break;
+	default:
+		necp_pm_test_addr(&flow->remote, (i << 8) | 1);
+		break;
+	}
+}
+
+static void
+necp_pm_test_info(struct necp_socket_info *info, const struct necp_pm_test_flow *flow)
+{
+	memset(info, 0, sizeof(*info));
+	info->pid = NECP_PM_TEST_BASE_PID + flow->policy;
+	info->uid = flow->policy;
+	info->protocol = flow->protocol;
+	necp_pm_test_addr(&info->local_addr, 0xffffff);
+	memcpy(&info->remote_addr, &flow->remote, sizeof(info->remote_addr));
+}
+
+static struct necp_kernel_socket_policy *
+necp_pm_test_socket_match(struct necp_kernel_socket_policy **policies, struct necp_policy_index *index, const struct necp_pm_test_flow *flow)
+{
+	necp_kernel_policy_result drop_dest_policy_result = NECP_KERNEL_POLICY_RESULT_NONE;
+	struct necp_socket_info info;
+
+	necp_pm_test_info(&info, flow);
+	return necp_socket_find_policy_match_with_info_locked(policies, index, &info, NULL, NULL, NULL, 0, NULL, NULL, NULL, NULL, 0, NULL, 0,
+	           current_proc(), 0, NULL, NULL, &drop_dest_policy_result, NULL, NULL, NULL, 0);
+}
+
+static int
+necp_socket_match_test(int64_t in, int64_t *out)
+{
+	struct necp_kernel_socket_policy *policy_array = NULL;
+	struct necp_kernel_socket_policy **policies = NULL;
+	struct necp_policy_index *index = NULL;
+	struct necp_pm_test_flow *flows = NULL;
+	u_int32_t n = (u_int32_t)in;
+	u_int32_t lookups;
+	u_int64_t seed = 1;
+	u_int64_t start, ns;
+	int error = 0;
+
+	if (in <= 0 || in > 65536) {
+		return EINVAL;
+	}
+	lookups = MAX(10000, 64000000 / n);
+	policy_array = kalloc_type(struct necp_kernel_socket_policy, n, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	policies = kalloc_type(struct necp_kernel_socket_policy *, n + 1, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	flows = kalloc_type(struct necp_pm_test_flow, NECP_PM_TEST_FLOWS, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	for (u_int32_t i = 0; i < n; i++) {
+		necp_pm_test_policy(&policy_array[i], i, n);
+		policies[i] = &policy_array[i];
+	}
+	index = necp_policy_index_socket_create(policies);
+	if (index == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	for (u_int32_t c = 0; c < NECP_PM_TEST_CHECKS; c++) {
+		struct necp_pm_test_flow flow;
+
+		necp_pm_test_flow(&flow, n, &seed);
+		if (necp_pm_test_socket_match(policies, NULL, &flow) != necp_pm_test_socket_match(policies, index, &flow)) {
+			error = EIO;
+			goto done;
+		}
+	}
+
+	for (u_int32_t f = 0; f < NECP_PM_TEST_FLOWS; f++) {
+		necp_pm_test_flow(&flows[f], n, &seed);
+	}
+	start = mach_absolute_time();
+	for (u_int32_t l = 0; l < lookups; l++) {
+		(void)necp_pm_test_socket_match(policies, NECP_POLICY_INDEX(index), &flows[l % NECP_PM_TEST_FLOWS]);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	*out = (int64_t)((u_int64_t)lookups * NSEC_PER_SEC / MAX(ns, 1));
+
+done:
+	necp_policy_index_free(index);
+	kfree_type(struct necp_pm_test_flow, NECP_PM_TEST_FLOWS, flows);
+	kfree_type(struct necp_kernel_socket_policy *, n + 1, policies);
+	kfree_type(struct necp_kernel_socket_policy, n, policy_array);
+	return error;
+}
+SYSCTL_TEST_REGISTER(necp_socket_match, necp_socket_match_test);
+
+static void
+necp_pm_test_ip_match(struct necp_kernel_ip_output_policy **policies, struct necp_policy_index *index, struct necp_flow_cache *nfc,
+    const struct necp_pm_test_flow *flow, struct necp_ip_output_match *match)
+{
+	struct necp_kernel_ip_output_policy *matched_policy;
+	union necp_sockaddr_union local_addr;
+	union necp_sockaddr_union remote_addr;
+	struct necp_flow_key key;
+	u_int32_t gencount = 0;
+
+	necp_pm_test_addr(&local_addr, 0xffffff);
+	memcpy(&remote_addr, &flow->remote, sizeof(remote_addr));
+	if (nfc != NULL) {
+		necp_flow_key_init(&key, flow->policy + 1, NECP_KERNEL_POLICY_ID_NONE, 0, flow->policy, flow->protocol, &local_addr, &remote_addr, 0);
+		if (necp_flow_cache_lookup(nfc, &key, match)) {
+			return;
+		}
+		gencount = os_atomic_load(&necp_flow_cache_gencount, acquire);
+	}
+
+	memset(match, 0, sizeof(*match));
+	matched_policy = necp_ip_output_find_policy_match_locked(policies, index, flow->policy + 1, NECP_KERNEL_POLICY_ID_NONE, 0, flow->policy,
+	    flow->protocol, &local_addr, &remote_addr, NULL, 0, &match->route_rule_id, &match->drop_dest_policy_result, &match->drop_all_bypass, 0);
+	if (matched_policy != NULL) {
+		match->policy_id = matched_policy->id;
+		match->result = matched_policy->result;
+	}
+	if (nfc != NULL && match->drop_all_bypass == NECP_DROP_ALL_BYPASS_CHECK_RESULT_NONE) {
+		necp_flow_cache_insert(nfc, &key, match, gencount);
+	}
+}
+
+static int
+necp_ip_output_match_test(int64_t in, int64_t *out)
+{
+	struct necp_kernel_socket_policy policy;
+	struct necp_kernel_ip_output_policy *policy_array = NULL;
+	struct necp_kernel_ip_output_policy **policies = NULL;
+	struct necp_policy_index *index = NULL;
+	struct necp_pm_test_flow *flows = NULL;
+	struct necp_flow_cache nfc = {};
+	struct necp_ip_output_match linear, indexed;
+	u_int32_t n = (u_int32_t)in;
+	u_int32_t lookups;
+	u_int64_t seed = 1;
+	u_int64_t start, ns;
+	int error = 0;
+
+	if (in <= 0 || in > 65536) {
+		return EINVAL;
+	}
+	lookups = MAX(10000, 64000000 / n);
+	policy_array = kalloc_type(struct necp_kernel_ip_output_policy, n, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	policies = kalloc_type(struct necp_kernel_ip_output_policy *, n + 1, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	flows = kalloc_type(struct necp_pm_test_flow, NECP_PM_TEST_FLOWS, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	for (u_int32_t i = 0; i < n; i++) {
+		memset(&policy, 0, sizeof(policy));
+		necp_pm_test_policy(&policy, i, n);
+		necp_pm_test_ip_policy(&policy_array[i], &policy);
+		policies[i] = &policy_array[i];
+	}
+	index = necp_policy_index_ip_output_create(policies);
+	if (index == NULL || !necp_flow_cache_init(&nfc, NECP_FLOW_CACHE_SIZE)) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	for (u_int32_t c = 0; c < NECP_PM_TEST_CHECKS; c++) {
+		struct necp_pm_test_flow flow;
+
+		necp_pm_test_flow(&flow, n, &seed);
+		necp_pm_test_ip_match(policies, NULL, NULL, &flow, &linear);
+		necp_pm_test_ip_match(policies, index, NULL, &flow, &indexed);
+		if (memcmp(&linear, &indexed, sizeof(linear)) != 0) {
+			error = EIO;
+			goto done;
+		}
+		// A second lookup of the flow hits the cache
+		necp_pm_test_ip_match(policies, index, &nfc, &flow, &indexed);
+		necp_pm_test_ip_match(policies, index, &nfc, &flow, &indexed);
+		if (memcmp(&linear, &indexed, sizeof(linear)) != 0) {
+			error = EIO;
+			goto done;
+		}
+	}
+	necp_flow_cache_destroy(&nfc);
+	if (!necp_flow_cache_init(&nfc, NECP_FLOW_CACHE_SIZE)) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	for (u_int32_t f = 0; f < NECP_PM_TEST_FLOWS; f++) {
+		necp_pm_test_flow(&flows[f], n, &seed);
+	}
+	start = mach_absolute_time();
+	for (u_int32_t l = 0; l < lookups; l++) {
+		necp_pm_test_ip_match(policies, NECP_POLICY_INDEX(index), necp_flow_cache ? &nfc : NULL, &flows[l % NECP_PM_TEST_FLOWS], &indexed);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	*out = (int64_t)((u_int64_t)lookups * NSEC_PER_SEC / MAX(ns, 1));
+
+done:
+	necp_flow_cache_destroy(&nfc);
+	necp_policy_index_free(index);
+	kfree_type(struct necp_pm_test_flow, NECP_PM_TEST_FLOWS, flows);
+	kfree_type(struct necp_kernel_ip_output_policy *, n + 1, policies);
+	kfree_type(struct necp_kernel_ip_output_policy, n, policy_array);
+	return error;
+}
+SYSCTL_TEST_REGISTER(necp_ip_output_match, necp_ip_output_match_test);
+#endif /* DEVELOPMENT || DEBUG */
+
 // Utilities
 static bool
 necp_is_addr_in_range(struct sockaddr *addr, struct sockaddr *range_start, struct sockaddr *range_end)
@@ -11181,7 +12326,7 @@ necp_socket_is_allowed_to_send_recv_internal(struct inpcb *inp, struct sockaddr
 
 	u_int32_t route_rule_id_array[MAX_AGGREGATE_ROUTE_RULES];
 	size_t route_rule_id_array_count = 0;
-	struct necp_kernel_socket_policy *matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_map[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)], &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, NULL, NECP_MAX_NETAGENTS, NULL, 0, socket_proc ? socket_proc : current_proc(), pf_tag, return_skip_policy_id, inp->inp_route.ro_rt, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, so, debug);
+	struct necp_kernel_socket_policy *matched_policy = necp_socket_find_policy_match_with_info_locked(necp_kernel_socket_policies_map[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)], NECP_POLICY_INDEX(necp_kernel_socket_policies_index[NECP_SOCKET_MAP_APP_ID_TO_BUCKET(info.application_id)]), &info, &filter_control_unit, route_rule_id_array, &route_rule_id_array_count, MAX_AGGREGATE_ROUTE_RULES, &service_action, &service, netagent_ids, NULL, NECP_MAX_NETAGENTS, NULL, 0, socket_proc ? socket_proc : current_proc(), pf_tag, return_skip_policy_id, inp->inp_route.ro_rt, &drop_dest_policy_result, &drop_all_bypass, &flow_divert_aggregate_unit, so, debug);
 
 	// Check for loopback exception again after the policy match
 	if (bypass_type == NECP_BYPASS_TYPE_LOOPBACK &&
@@ -12031,6 +13176,7 @@ sysctl_handle_necp_drop_dest_level SYSCTL_HANDLER_ARGS
 
 		necp_drop_dest_entry->order = necp_get_first_order_for_priority(necp_drop_dest_entry->level);
 	}
+	necp_flow_cache_invalidate();
 	lck_rw_done(&necp_kernel_policy_lock);
 
 	return 0;
@@ -77,6 +77,7 @@
 #include <sys/random.h>
 #include <sys/mcache.h>
 #include <sys/protosw.h>
+#include <sys/sysctl.h>
 
 #include <libkern/crypto/md5.h>
 #include <libkern/libkern.h>
@@ -162,6 +163,40 @@ LCK_RW_DECLARE(pf_perim_lock, &pf_perim_lock_grp);
 struct pf_state_tree_lan_ext     pf_statetbl_lan_ext;
 struct pf_state_tree_ext_gwy     pf_statetbl_ext_gwy;
 
+/*
+ * Hash index over the two state key trees.  The trees stay authoritative
+ * for the ioctls; the index gives constant time lookups and is split
+ * into independently locked shards so that pf_test_established() can
+ * match packets of established flows without taking pf_lock.
+ *
+ * Every change to the index, or to the states list of an indexed key,
+ * is made holding both pf_lock and the key's shard lock(s); lookups hold
+ * either.  pf_test() and pf_test6() additionally hold the shard of the
+ * packet's flow across the TCP/UDP state test, so that a state is only
+ * ever updated by one path at a time.  That shard is recorded in
+ * pf_state_shard_held, which is only accessed by the owner of pf_lock.
+ */
+#define PF_STATE_HASH_SIZE      8192    /* buckets, per index */
+#define PF_STATE_HASH_MASK      (PF_STATE_HASH_SIZE - 1)
+#define PF_STATE_SHARDS         64
+
+LIST_HEAD(pf_state_hashhead, pf_state_key);
+
+struct pf_state_shard {
+	decl_lck_mtx_data(, pss_lock);
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+static struct pf_state_hashhead pf_statehash_lan_ext[PF_STATE_HASH_SIZE];
+static struct pf_state_hashhead pf_statehash_ext_gwy[PF_STATE_HASH_SIZE];
+static struct pf_state_shard    pf_state_shards[PF_STATE_SHARDS];
+static struct pf_state_shard    *pf_state_shard_held;
+static u_int32_t                pf_statehash_seed;
+
+static int pf_state_fastpath = 1;
+SYSCTL_NODE(_net, OID_AUTO, pf, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "pf");
+SYSCTL_INT(_net_pf, OID_AUTO, state_fastpath, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &pf_state_fastpath, 0, "Match established flows without pf_lock");
+
 struct pf_palist         pf_pabuf;
 struct pf_status         pf_status;
 
@@ -1102,6 +1137,312 @@ pf_addrcpy(struct pf_addr *dst, struct pf_addr *src, sa_family_t af)
 	}
 }
 
+struct pf_state_hash_host {
+	struct pf_addr          addr;
+	u_int16_t               port;
+	u_int16_t               pad;
+};
+
+/*
+ * Both endpoints are put in a canonical order, so that the two directions
+ * of a flow, and the lan_ext and ext_gwy keys of an untranslated state,
+ * all hash alike.
+ */
+static u_int32_t
+pf_state_hash(sa_family_t af, u_int8_t proto, struct pf_addr *a1,
+    u_int16_t p1, struct pf_addr *a2, u_int16_t p2)
+{
+	struct {
+		struct pf_state_hash_host       h[2];
+		u_int32_t                       af;
+		u_int32_t                       proto;
+	} k __attribute__((aligned(8)));
+	struct pf_state_hash_host x, y;
+	size_t alen;
+
+	alen = (af == AF_INET) ? sizeof(struct in_addr) :
+	    sizeof(struct in6_addr);
+	bzero(&x, sizeof(x));
+	bzero(&y, sizeof(y));
+	bzero(&k, sizeof(k));
+	if (a1 != NULL) {
+		bcopy(a1, &x.addr, alen);
+	}
+	if (a2 != NULL) {
+		bcopy(a2, &y.addr, alen);
+	}
+	x.port = p1;
+	y.port = p2;
+	if (memcmp(&x, &y, sizeof(x)) <= 0) {
+		k.h[0] = x;
+		k.h[1] = y;
+	} else {
+		k.h[0] = y;
+		k.h[1] = x;
+	}
+	k.af = af;
+	k.proto = proto;
+
+	return net_flowhash(&k, sizeof(k), pf_statehash_seed);
+}
+
+/*
+ * Only what pf_state_compare_lan_ext() and pf_state_compare_ext_gwy()
+ * always compare may be hashed: ports of protocols that have them, and
+ * the external endpoint only as far as the UDP extfilter looks at it.
+ */
+static u_int32_t
+pf_state_key_hash(sa_family_t af, u_int8_t proto, u_int8_t proto_variant,
+    struct pf_state_host *in, struct pf_state_host *ext)
+{
+	int             extfilter = PF_EXTFILTER_APD;
+	u_int16_t       iport = 0, eport = 0;
+
+	switch (proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		iport = in->xport.port;
+		break;
+	case IPPROTO_TCP:
+		iport = in->xport.port;
+		eport = ext->xport.port;
+		break;
+	case IPPROTO_UDP:
+		extfilter = proto_variant;
+		iport = in->xport.port;
+		if (extfilter < PF_EXTFILTER_AD) {
+			eport = ext->xport.port;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return pf_state_hash(af, proto, &in->addr, iport,
+	           extfilter < PF_EXTFILTER_EI ? &ext->addr : NULL, eport);
+}
+
+#define PF_STATE_KEY_HASH_LAN_EXT(k)                                    \
+	pf_state_key_hash((k)->af_lan, (k)->proto, (k)->proto_variant,  \
+	    &(k)->lan, &(k)->ext_lan)
+#define PF_STATE_KEY_HASH_EXT_GWY(k)                                    \
+	pf_state_key_hash((k)->af_gwy, (k)->proto, (k)->proto_variant,  \
+	    &(k)->gwy, &(k)->ext_gwy)
+
+static inline struct pf_state_shard *
+pf_state_shard(u_int32_t hashv)
+{
+	return &pf_state_shards[hashv & (PF_STATE_SHARDS - 1)];
+}
+
+static void
+pf_state_shard_lock(struct pf_state_shard *sh)
+{
+	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (sh != pf_state_shard_held) {
+		lck_mtx_lock(&sh->pss_lock);
+	}
+}
+
+static void
+pf_state_shard_unlock(struct pf_state_shard *sh)
+{
+	if (sh != pf_state_shard_held) {
+		lck_mtx_unlock(&sh->pss_lock);
+	}
+}
+
+/*
+ * Lock the shards through which sk is reachable without pf_lock, so that
+ * its states list may be changed.
+ */
+static void
+pf_state_key_lock(struct pf_state_key *sk)
+{
+	struct pf_state_shard *sh = NULL;
+
+	if (sk->hashed & PFSK_HASHED_LAN_EXT) {
+		sh = pf_state_shard(sk->hashv_lan_ext);
+		pf_state_shard_lock(sh);
+	}
+	if ((sk->hashed & PFSK_HASHED_EXT_GWY) &&
+	    pf_state_shard(sk->hashv_ext_gwy) != sh) {
+		pf_state_shard_lock(pf_state_shard(sk->hashv_ext_gwy));
+	}
+}
+
+static void
+pf_state_key_unlock(struct pf_state_key *sk)
+{
+	struct pf_state_shard *sh = NULL;
+
+	if (sk->hashed & PFSK_HASHED_LAN_EXT) {
+		sh = pf_state_shard(sk->hashv_lan_ext);
+		pf_state_shard_unlock(sh);
+	}
+	if ((sk->hashed & PFSK_HASHED_EXT_GWY) &&
+	    pf_state_shard(sk->hashv_ext_gwy) != sh) {
+		pf_state_shard_unlock(pf_state_shard(sk->hashv_ext_gwy));
+	}
+}
+
+static struct pf_state_key *
+pf_state_key_insert_lan_ext(struct pf_state_key *sk)
+{
+	struct pf_state_shard   *sh;
+	struct pf_state_key     *cur;
+
+	cur = RB_INSERT(pf_state_tree_lan_ext, &pf_statetbl_lan_ext, sk);
+	if (cur != NULL) {
+		return cur;
+	}
+
+	sk->hashv_lan_ext = PF_STATE_KEY_HASH_LAN_EXT(sk);
+	sh = pf_state_shard(sk->hashv_lan_ext);
+	pf_state_shard_lock(sh);
+	LIST_INSERT_HEAD(&pf_statehash_lan_ext[sk->hashv_lan_ext &
+	    PF_STATE_HASH_MASK], sk, hash_lan_ext);
+	sk->hashed |= PFSK_HASHED_LAN_EXT;
+	pf_state_shard_unlock(sh);
+
+	return NULL;
+}
+
+static struct pf_state_key *
+pf_state_key_insert_ext_gwy(struct pf_state_key *sk)
+{
+	struct pf_state_shard   *sh;
+	struct pf_state_key     *cur;
+
+	cur = RB_INSERT(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy, sk);
+	if (cur != NULL) {
+		return cur;
+	}
+
+	sk->hashv_ext_gwy = PF_STATE_KEY_HASH_EXT_GWY(sk);
+	sh = pf_state_shard(sk->hashv_ext_gwy);
+	pf_state_shard_lock(sh);
+	LIST_INSERT_HEAD(&pf_statehash_ext_gwy[sk->hashv_ext_gwy &
+	    PF_STATE_HASH_MASK], sk, hash_ext_gwy);
+	sk->hashed |= PFSK_HASHED_EXT_GWY;
+	pf_state_shard_unlock(sh);
+
+	return NULL;
+}
+
+static void
+pf_state_key_remove_lan_ext(struct pf_state_key *sk)
+{
+	struct pf_state_shard *sh;
+
+	RB_REMOVE(pf_state_tree_lan_ext, &pf_statetbl_lan_ext, sk);
+	if (sk->hashed & PFSK_HASHED_LAN_EXT) {
+		sh = pf_state_shard(sk->hashv_lan_ext);
+		pf_state_shard_lock(sh);
+		LIST_REMOVE(sk, hash_lan_ext);
+		sk->hashed &= ~PFSK_HASHED_LAN_EXT;
+		pf_state_shard_unlock(sh);
+	}
+}
+
+static void
+pf_state_key_remove_ext_gwy(struct pf_state_key *sk)
+{
+	struct pf_state_shard *sh;
+
+	RB_REMOVE(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy, sk);
+	if (sk->hashed & PFSK_HASHED_EXT_GWY) {
+		sh = pf_state_shard(sk->hashv_ext_gwy);
+		pf_state_shard_lock(sh);
+		LIST_REMOVE(sk, hash_ext_gwy);
+		sk->hashed &= ~PFSK_HASHED_EXT_GWY;
+		pf_state_shard_unlock(sh);
+	}
+}
+
+static struct pf_state_key *
+pf_state_key_find_lan_ext(struct pf_state_key_cmp *key, u_int32_t hashv)
+{
+	struct pf_state_key *sk;
+
+	LIST_FOREACH(sk, &pf_statehash_lan_ext[hashv & PF_STATE_HASH_MASK],
+	    hash_lan_ext) {
+		if (sk->hashv_lan_ext == hashv &&
+		    pf_state_compare_lan_ext((struct pf_state_key *)key,
+		    sk) == 0) {
+			return sk;
+		}
+	}
+	return NULL;
+}
+
+static struct pf_state_key *
+pf_state_key_find_ext_gwy(struct pf_state_key_cmp *key, u_int32_t hashv)
+{
+	struct pf_state_key *sk;
+
+	LIST_FOREACH(sk, &pf_statehash_ext_gwy[hashv & PF_STATE_HASH_MASK],
+	    hash_ext_gwy) {
+		if (sk->hashv_ext_gwy == hashv &&
+		    pf_state_compare_ext_gwy((struct pf_state_key *)key,
+		    sk) == 0) {
+			return sk;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Serialize pf_test() and pf_test6() against pf_test_established() for
+ * the flow of the packet being tested.  Returns NULL when called again
+ * from within an already serialized test, e.g. for a packet generated
+ * by pf itself.
+ */
+static struct pf_state_shard *
+pf_state_flow_lock(struct pf_pdesc *pd, u_int16_t sport, u_int16_t dport)
+{
+	struct pf_state_shard *sh;
+
+	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (pf_state_shard_held != NULL) {
+		return NULL;
+	}
+	sh = pf_state_shard(pf_state_hash(pd->af, pd->proto, pd->src, sport,
+	    pd->dst, dport));
+	lck_mtx_lock(&sh->pss_lock);
+	pf_state_shard_held = sh;
+
+	return sh;
+}
+
+static void
+pf_state_flow_unlock(struct pf_state_shard *sh)
+{
+	if (sh != NULL) {
+		VERIFY(pf_state_shard_held == sh);
+		pf_state_shard_held = NULL;
+		lck_mtx_unlock(&sh->pss_lock);
+	}
+}
+
+void
+pf_state_hash_init(void)
+{
+	int i;
+
+	for (i = 0; i < PF_STATE_HASH_SIZE; i++) {
+		LIST_INIT(&pf_statehash_lan_ext[i]);
+		LIST_INIT(&pf_statehash_ext_gwy[i]);
+	}
+	for (i = 0; i < PF_STATE_SHARDS; i++) {
+		lck_mtx_init(&pf_state_shards[i].pss_lock, &pf_lock_grp,
+		    LCK_ATTR_NULL);
+	}
+	pf_statehash_seed = RandomULong();
+}
+
 struct pf_state *
 pf_find_state_byid(struct pf_state_cmp *key)
 {
@@ -1121,20 +1462,19 @@ pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 
 	switch (dir) {
 	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
-		    (struct pf_state_key *)key);
+		sk = pf_state_key_find_lan_ext(key,
+		    PF_STATE_KEY_HASH_LAN_EXT(key));
 		break;
 	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy,
-		    (struct pf_state_key *)key);
+		sk = pf_state_key_find_ext_gwy(key,
+		    PF_STATE_KEY_HASH_EXT_GWY(key));
 		/*
 		 * NAT64 is done only on input, for packets coming in from
 		 * from the LAN side, need to lookup the lan_ext tree.
 		 */
 		if (sk == NULL) {
-			sk = RB_FIND(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext,
-			    (struct pf_state_key *)key);
+			sk = pf_state_key_find_lan_ext(key,
+			    PF_STATE_KEY_HASH_LAN_EXT(key));
 			if (sk && sk->af_lan == sk->af_gwy) {
 				sk = NULL;
 			}
@@ -1165,20 +1505,19 @@ pf_find_state_all(struct pf_state_key_cmp *key, u_int dir, int *more)
 
 	switch (dir) {
 	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext,
-		    &pf_statetbl_lan_ext, (struct pf_state_key *)key);
+		sk = pf_state_key_find_lan_ext(key,
+		    PF_STATE_KEY_HASH_LAN_EXT(key));
 		break;
 	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy,
-		    &pf_statetbl_ext_gwy, (struct pf_state_key *)key);
+		sk = pf_state_key_find_ext_gwy(key,
+		    PF_STATE_KEY_HASH_EXT_GWY(key));
 		/*
 		 * NAT64 is done only on input, for packets coming in from
 		 * from the LAN side, need to lookup the lan_ext tree.
 		 */
 		if ((sk == NULL) && pf_nat64_configured) {
-			sk = RB_FIND(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext,
-			    (struct pf_state_key *)key);
+			sk = pf_state_key_find_lan_ext(key,
+			    PF_STATE_KEY_HASH_LAN_EXT(key));
 			if (sk && sk->af_lan == sk->af_gwy) {
 				sk = NULL;
 			}
@@ -1455,8 +1794,7 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	VERIFY(s->state_key != NULL);
 	s->kif = kif;
 
-	if ((cur = RB_INSERT(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
-	    s->state_key)) != NULL) {
+	if ((cur = pf_state_key_insert_lan_ext(s->state_key)) != NULL) {
 		/* key exists. check for same kif, if none, add to key */
 		TAILQ_FOREACH(sp, &cur->states, next)
 		if (sp->kif == kif) {           /* collision! */
@@ -1470,8 +1808,8 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	}
 
 	/* if cur != NULL, we already found a state key and attached to it */
-	if (cur == NULL && (cur = RB_INSERT(pf_state_tree_ext_gwy,
-	    &pf_statetbl_ext_gwy, s->state_key)) != NULL) {
+	if (cur == NULL &&
+	    (cur = pf_state_key_insert_ext_gwy(s->state_key)) != NULL) {
 		/* must not happen. we must have found the sk above! */
 		pf_stateins_err("tree_ext_gwy", s, kif);
 		pf_detach_state(s, PF_DT_SKIP_EXTGWY);
@@ -4366,11 +4704,13 @@ pf_attach_state(struct pf_state_key *sk, struct pf_state *s, int tail)
 	sk->refcnt++;
 
 	/* list is sorted, if-bound states before floating */
+	pf_state_key_lock(sk);
 	if (tail) {
 		TAILQ_INSERT_TAIL(&sk->states, s, next);
 	} else {
 		TAILQ_INSERT_HEAD(&sk->states, s, next);
 	}
+	pf_state_key_unlock(sk);
 }
 
 static void
@@ -4395,16 +4735,16 @@ pf_detach_state(struct pf_state *s, int flags)
 		return;
 	}
 
+	pf_state_key_lock(sk);
 	s->state_key = NULL;
 	TAILQ_REMOVE(&sk->states, s, next);
+	pf_state_key_unlock(sk);
 	if (--sk->refcnt == 0) {
 		if (!(flags & PF_DT_SKIP_EXTGWY)) {
-			RB_REMOVE(pf_state_tree_ext_gwy,
-			    &pf_statetbl_ext_gwy, sk);
+			pf_state_key_remove_ext_gwy(sk);
 		}
 		if (!(flags & PF_DT_SKIP_LANEXT)) {
-			RB_REMOVE(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext, sk);
+			pf_state_key_remove_lan_ext(sk);
 		}
 		if (sk->app_state) {
 			pool_put(&pf_app_state_pl, sk->app_state);
@@ -4894,6 +5234,7 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	sa_family_t              af = pd->af;
 	struct pf_rule          *r, *a = NULL;
 	struct pf_ruleset       *ruleset = NULL;
+	struct pf_rule_class    *rc = NULL;
 	struct pf_src_node      *nsn = NULL;
 	struct tcphdr           *th = pd->hdr.tcp;
 	struct udphdr           *uh = pd->hdr.udp;
@@ -5227,7 +5568,18 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 		tag = nr->tag;
 	}
 
+	/* main ruleset rules that may match, the others are not visited */
+	if (r != NULL) {
+		rc = pf_rule_class_match(direction, kif, pd->af, pd->proto,
+		    saddr, daddr, (pd->proto == IPPROTO_TCP ||
+		    pd->proto == IPPROTO_UDP) ? th->th_dport : 0);
+	}
+
 	while (r != NULL) {
+		if (rc != NULL && asd == 0 &&
+		    (r = pf_rule_class_next(rc, r)) == NULL) {
+			break;
+		}
 		r->evaluations++;
 		if (pfi_kif_match(r->kif, kif) == r->ifnot) {
 			r = r->skip[PF_SKIP_IFP].ptr;
@@ -8841,13 +9193,11 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
 
-				RB_REMOVE(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk);
+				pf_state_key_remove_ext_gwy(sk);
 				sk->lan.xport.spi = sk->gwy.xport.spi =
 				    esp->spi;
 
-				if (RB_INSERT(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk)) {
+				if (pf_state_key_insert_ext_gwy(sk)) {
 					pf_detach_state(s, PF_DT_SKIP_EXTGWY);
 				} else {
 					*state = s;
@@ -8860,12 +9210,10 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
 
-				RB_REMOVE(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk);
+				pf_state_key_remove_lan_ext(sk);
 				sk->ext_lan.xport.spi = esp->spi;
 
-				if (RB_INSERT(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk)) {
+				if (pf_state_key_insert_lan_ext(sk)) {
 					pf_detach_state(s, PF_DT_SKIP_LANEXT);
 				} else {
 					*state = s;
@@ -9631,6 +9979,281 @@ pf_check_proto_cksum(pbuf_t *pbuf, int off, int len, u_int8_t p,
 	        }                                               \
 	} while (0)
 
+/*
+ * Window tracking of pf_test_state_tcp(), restricted to a segment that
+ * only carries ACK, on an unscrubbed and unmodulated state established in
+ * both directions.  Returns 0, leaving the state untouched, for anything
+ * that needs the full treatment.
+ */
+static int
+pf_tcp_track_established(struct tcphdr *th, u_int32_t p_len,
+    struct pf_state_peer *src, struct pf_state_peer *dst)
+{
+	u_int16_t       win = ntohs(th->th_win);
+	u_int32_t       seq, ack, end;
+	u_int8_t        sws, dws;
+	int             ackskew;
+
+	sws = (src->wscale & PF_WSCALE_FLAG) ?
+	    (src->wscale & PF_WSCALE_MASK) : TCP_MAX_WINSHIFT;
+	dws = (dst->wscale & PF_WSCALE_FLAG) ?
+	    (dst->wscale & PF_WSCALE_MASK) : TCP_MAX_WINSHIFT;
+
+	seq = ntohl(th->th_seq);
+	ack = ntohl(th->th_ack);
+	end = seq + p_len;
+	if (seq == end) {
+		/* Ease sequencing restrictions on no data packets */
+		seq = src->seqlo;
+		end = seq;
+	}
+	ackskew = dst->seqlo - ack;
+
+	if (!SEQ_GEQ(src->seqhi, end) ||
+	    !SEQ_GEQ(seq, src->seqlo - ((u_int32_t)dst->max_win << dws)) ||
+	    ackskew < -MAXACKWINDOW || ackskew > (MAXACKWINDOW << sws)) {
+		return 0;
+	}
+
+	if (src->max_win < win) {
+		src->max_win = win;
+	}
+	if (SEQ_GT(end, src->seqlo)) {
+		src->seqlo = end;
+	}
+	if (SEQ_GEQ(ack + ((u_int32_t)win << sws), dst->seqhi)) {
+		dst->seqhi = ack + MAX(((u_int32_t)win << sws), 1);
+	}
+	return 1;
+}
+
+/*
+ * Match a packet against an established, untranslated TCP or UDP state
+ * holding only the shard lock of its flow, before pf_lock is taken.
+ * Returns PF_PASS once the packet has been fully accounted for; anything
+ * else returns -1 and must go through pf_test() or pf_test6().  As in
+ * pf_af_hook(), ip_len and ip_off of an IPv4 packet are in host order.
+ */
+int
+pf_test_established(int dir, struct ifnet *ifp, struct mbuf *m, int af)
+{
+	struct pf_state_key_cmp  key;
+	struct pf_state_shard   *sh;
+	struct pf_state_key     *sk;
+	struct pf_state         *s;
+	struct pf_state_peer    *src, *dst;
+	struct pf_rule          *r, *a;
+	struct pfi_kif          *kif;
+	struct pf_mtag          *pf_mtag;
+	struct pf_addr          *saddr, *daddr;
+	union {
+		struct tcphdr   th;
+		struct udphdr   uh;
+	} l4;
+	u_int16_t                sport, dport;
+	u_int32_t                off, tot_len, hashv;
+	int                      proto, dirndx, action = -1;
+
+	if (!pf_state_fastpath || !pf_status.running ||
+	    pf_main_ruleset.rules[PF_RULESET_SCRUB].active.rcount != 0 ||
+	    pf_main_ruleset.rules[PF_RULESET_DUMMYNET].active.rcount != 0) {
+		return -1;
+	}
+
+	kif = (struct pfi_kif *)ifp->if_pf_kif;
+	if (kif == NULL || (kif->pfik_flags & PFI_IFLAG_SKIP) ||
+	    (pf_mtag = pf_get_mtag(m)) == NULL ||
+	    (pf_mtag->pftag_flags & PF_TAG_GENERATED)) {
+		return -1;
+	}
+
+	switch (af) {
+	case AF_INET: {
+		struct ip *h;
+
+		if (m->m_len < (int)sizeof(*h)) {
+			return -1;
+		}
+		h = mtod(m, struct ip *);
+		/* options and fragments are left to pf_test() */
+		if (h->ip_hl != (sizeof(*h) >> 2) ||
+		    (h->ip_off & (IP_MF | IP_OFFMASK)) != 0) {
+			return -1;
+		}
+		off = sizeof(*h);
+		tot_len = h->ip_len;
+		proto = h->ip_p;
+		saddr = (struct pf_addr *)(void *)&h->ip_src;
+		daddr = (struct pf_addr *)(void *)&h->ip_dst;
+		break;
+	}
+	case AF_INET6: {
+		struct ip6_hdr *h;
+
+		if (m->m_len < (int)sizeof(*h)) {
+			return -1;
+		}
+		h = mtod(m, struct ip6_hdr *);
+		/* extension headers are left to pf_test6() */
+		if (h->ip6_plen == 0) {
+			return -1;
+		}
+		off = sizeof(*h);
+		tot_len = ntohs(h->ip6_plen) + off;
+		proto = h->ip6_nxt;
+		saddr = (struct pf_addr *)(void *)&h->ip6_src;
+		daddr = (struct pf_addr *)(void *)&h->ip6_dst;
+		break;
+	}
+	default:
+		return -1;
+	}
+	if (tot_len > (u_int32_t)m->m_pkthdr.len) {
+		return -1;
+	}
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (tot_len < off + sizeof(l4.th)) {
+			return -1;
+		}
+		m_copydata(m, off, sizeof(l4.th), &l4.th);
+		if ((l4.th.th_off << 2) < (int)sizeof(l4.th) ||
+		    off + (l4.th.th_off << 2) > tot_len ||
+		    (l4.th.th_flags & (TH_SYN | TH_FIN | TH_RST | TH_URG |
+		    TH_ACK)) != TH_ACK) {
+			return -1;
+		}
+		sport = l4.th.th_sport;
+		dport = l4.th.th_dport;
+		break;
+	case IPPROTO_UDP:
+		if (tot_len < off + sizeof(l4.uh)) {
+			return -1;
+		}
+		m_copydata(m, off, sizeof(l4.uh), &l4.uh);
+		if (ntohs(l4.uh.uh_ulen) > tot_len - off ||
+		    ntohs(l4.uh.uh_ulen) < sizeof(l4.uh)) {
+			return -1;
+		}
+		sport = l4.uh.uh_sport;
+		dport = l4.uh.uh_dport;
+		/* IKE states are further keyed by the initiator cookie */
+		if (ntohs(sport) == PF_IKE_PORT && ntohs(dport) == PF_IKE_PORT) {
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+	if (sport == 0 || dport == 0) {
+		return -1;
+	}
+
+	bzero(&key, sizeof(key));
+	key.proto = proto;
+	key.proto_variant = PF_EXTFILTER_APD;
+	key.af_lan = key.af_gwy = af;
+	PF_ACPY(&key.lan.addr, saddr, af);
+	PF_ACPY(&key.ext_lan.addr, daddr, af);
+	key.lan.xport.port = sport;
+	key.ext_lan.xport.port = dport;
+	PF_ACPY(&key.ext_gwy.addr, saddr, af);
+	PF_ACPY(&key.gwy.addr, daddr, af);
+	key.ext_gwy.xport.port = sport;
+	key.gwy.xport.port = dport;
+
+	/* for these keys, the same as PF_STATE_KEY_HASH_{LAN_EXT,EXT_GWY} */
+	hashv = pf_state_hash(af, proto, saddr, sport, daddr, dport);
+	sh = pf_state_shard(hashv);
+	lck_mtx_lock(&sh->pss_lock);
+	atomic_add_64(&pf_status.fcounters[FCNT_STATE_SEARCH], 1);
+
+	if (dir == PF_OUT) {
+		sk = pf_state_key_find_lan_ext(&key, hashv);
+	} else {
+		sk = pf_state_key_find_ext_gwy(&key, hashv);
+	}
+	if (sk == NULL || sk->app_state != NULL || sk->af_lan != sk->af_gwy ||
+	    (STATE_ADDR_TRANSLATE(sk)) ||
+	    sk->lan.xport.port != sk->gwy.xport.port ||
+	    PF_ANEQ(&sk->ext_lan.addr, &sk->ext_gwy.addr, af) ||
+	    sk->ext_lan.xport.port != sk->ext_gwy.xport.port) {
+		goto done;
+	}
+
+	/* list is sorted, if-bound states before floating ones */
+	TAILQ_FOREACH(s, &sk->states, next) {
+		if (s->kif == pfi_all || s->kif == kif) {
+			break;
+		}
+	}
+	if (s == NULL) {
+		goto done;
+	}
+
+	r = s->rule.ptr;
+	a = s->anchor.ptr;
+	if (s->nat_rule.ptr != NULL || s->src_node != NULL ||
+	    s->nat_src_node != NULL || s->tag != 0 || s->log != 0 ||
+	    r->rt != 0 || PF_RTABLEID_IS_VALID(r->rtableid) ||
+	    r->src.addr.type == PF_ADDR_TABLE ||
+	    r->dst.addr.type == PF_ADDR_TABLE) {
+		goto done;
+	}
+
+	if (dir == sk->direction) {
+		src = &s->src;
+		dst = &s->dst;
+	} else {
+		src = &s->dst;
+		dst = &s->src;
+	}
+
+	if (proto == IPPROTO_TCP) {
+		if (s->timeout != PFTM_TCP_ESTABLISHED ||
+		    src->state != TCPS_ESTABLISHED ||
+		    dst->state != TCPS_ESTABLISHED ||
+		    src->scrub != NULL || dst->scrub != NULL ||
+		    src->seqdiff != 0 || dst->seqdiff != 0 ||
+		    src->seqlo == 0 ||
+		    !pf_tcp_track_established(&l4.th,
+		    tot_len - off - (l4.th.th_off << 2), src, dst)) {
+			goto done;
+		}
+	} else if (s->timeout != PFTM_UDP_MULTIPLE ||
+	    src->state != PFUDPS_MULTIPLE || dst->state != PFUDPS_MULTIPLE) {
+		goto done;
+	}
+	s->expire = pf_time_second();
+
+	dirndx = (dir == sk->direction) ? 0 : 1;
+	s->packets[dirndx]++;
+	s->bytes[dirndx] += tot_len;
+
+	/* the rest of what pf_test() accounts for a passed packet */
+	dirndx = (dir == PF_OUT);
+	atomic_add_64(&kif->pfik_bytes[af == AF_INET6][dirndx][0], tot_len);
+	atomic_add_64(&kif->pfik_packets[af == AF_INET6][dirndx][0], 1);
+	atomic_add_64(&r->packets[dirndx], 1);
+	atomic_add_64(&r->bytes[dirndx], tot_len);
+	if (a != NULL) {
+		atomic_add_64(&a->packets[dirndx], 1);
+		atomic_add_64(&a->bytes[dirndx], tot_len);
+	}
+	if (!(m->m_pkthdr.pkt_flags & PKTF_FLOW_ID) && sk->flowhash != 0) {
+		m->m_pkthdr.pkt_flowsrc = sk->flowsrc;
+		m->m_pkthdr.pkt_flowid = sk->flowhash;
+		m->m_pkthdr.pkt_flags |= PKTF_FLOW_ID;
+	}
+	m->m_pkthdr.pkt_proto = proto;
+	action = PF_PASS;
+done:
+	lck_mtx_unlock(&sh->pss_lock);
+
+	return action;
+}
+
 int
 pf_test_mbuf(int dir, struct ifnet *ifp, struct mbuf **m0,
     struct ether_header *eh, struct ip_fw_args *fwa)
@@ -9670,6 +10293,7 @@ pf_test(int dir, struct ifnet *ifp, pbuf_t **pbufp,
 	struct pf_state_key     *sk = NULL;
 	struct pf_ruleset       *ruleset = NULL;
 	struct pf_pdesc          pd;
+	struct pf_state_shard    *fl = NULL;
 	int                      off, dirndx, pqid = 0;
 
 	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
@@ -9824,6 +10448,7 @@ nonormalize:
 			REASON_SET(&reason, PFRES_INVPORT);
 			goto done;
 		}
+		fl = pf_state_flow_lock(&pd, th.th_sport, th.th_dport);
 		action = pf_test_state_tcp(&s, dir, kif, pbuf, off, h, &pd,
 		    &reason);
 		if (action == PF_NAT64) {
@@ -9875,6 +10500,7 @@ nonormalize:
 			return action;
 		}
 #endif /* DUMMYNET */
+		fl = pf_state_flow_lock(&pd, uh.uh_sport, uh.uh_dport);
 		action = pf_test_state_udp(&s, dir, kif, pbuf, off, h, &pd,
 		    &reason);
 		if (action == PF_NAT64) {
@@ -10056,6 +10682,7 @@ nonormalize:
 
 done:
 	if (action == PF_NAT64) {
+		pf_state_flow_unlock(fl);
 		*pbufp = NULL;
 		return action;
 	}
@@ -10121,16 +10748,18 @@ done:
 		    &pd);
 	}
 
-	kif->pfik_bytes[0][dir == PF_OUT][action != PF_PASS] += pd.tot_len;
-	kif->pfik_packets[0][dir == PF_OUT][action != PF_PASS]++;
+	/* shared with pf_test_established(), which runs without pf_lock */
+	atomic_add_64(&kif->pfik_bytes[0][dir == PF_OUT][action != PF_PASS],
+	    pd.tot_len);
+	atomic_add_64(&kif->pfik_packets[0][dir == PF_OUT][action != PF_PASS], 1);
 
 	if (action == PF_PASS || r->action == PF_DROP) {
 		dirndx = (dir == PF_OUT);
-		r->packets[dirndx]++;
-		r->bytes[dirndx] += pd.tot_len;
+		atomic_add_64(&r->packets[dirndx], 1);
+		atomic_add_64(&r->bytes[dirndx], pd.tot_len);
 		if (a != NULL) {
-			a->packets[dirndx]++;
-			a->bytes[dirndx] += pd.tot_len;
+			atomic_add_64(&a->packets[dirndx], 1);
+			atomic_add_64(&a->bytes[dirndx], pd.tot_len);
 		}
 		if (s != NULL) {
 			sk = s->state_key;
@@ -10191,6 +10820,8 @@ done:
 		}
 	}
 
+	pf_state_flow_unlock(fl);
+
 	VERIFY(pbuf == NULL || pd.mp == NULL || pd.mp == pbuf);
 
 	if (*pbufp) {
@@ -10268,6 +10899,7 @@ pf_test6(int dir, struct ifnet *ifp, pbuf_t **pbufp,
 	struct pf_state_key     *sk = NULL;
 	struct pf_ruleset       *ruleset = NULL;
 	struct pf_pdesc          pd;
+	struct pf_state_shard    *fl = NULL;
 	int                      off, terminal = 0, dirndx, rh_cnt = 0;
 	u_int8_t                 nxt;
 	boolean_t                fwd = FALSE;
@@ -10481,6 +11113,7 @@ nonormalize:
 			REASON_SET(&reason, PFRES_INVPORT);
 			goto done;
 		}
+		fl = pf_state_flow_lock(&pd, th.th_sport, th.th_dport);
 		action = pf_test_state_tcp(&s, dir, kif, pbuf, off, h, &pd,
 		    &reason);
 		if (action == PF_NAT64) {
@@ -10532,6 +11165,7 @@ nonormalize:
 			return action;
 		}
 #endif /* DUMMYNET */
+		fl = pf_state_flow_lock(&pd, uh.uh_sport, uh.uh_dport);
 		action = pf_test_state_udp(&s, dir, kif, pbuf, off, h, &pd,
 		    &reason);
 		if (action == PF_NAT64) {
@@ -10712,6 +11346,7 @@ nonormalize:
 
 done:
 	if (action == PF_NAT64) {
+		pf_state_flow_unlock(fl);
 		*pbufp = NULL;
 		return action;
 	}
@@ -10771,16 +11406,18 @@ done:
 		    &pd);
 	}
 
-	kif->pfik_bytes[1][dir == PF_OUT][action != PF_PASS] += pd.tot_len;
-	kif->pfik_packets[1][dir == PF_OUT][action != PF_PASS]++;
+	/* shared with pf_test_established(), which runs without pf_lock */
+	atomic_add_64(&kif->pfik_bytes[1][dir == PF_OUT][action != PF_PASS],
+	    pd.tot_len);
+	atomic_add_64(&kif->pfik_packets[1][dir == PF_OUT][action != PF_PASS], 1);
 
 	if (action == PF_PASS || r->action == PF_DROP) {
 		dirndx = (dir == PF_OUT);
-		r->packets[dirndx]++;
-		r->bytes[dirndx] += pd.tot_len;
+		atomic_add_64(&r->packets[dirndx], 1);
+		atomic_add_64(&r->bytes[dirndx], pd.tot_len);
 		if (a != NULL) {
-			a->packets[dirndx]++;
-			a->bytes[dirndx] += pd.tot_len;
+			atomic_add_64(&a->packets[dirndx], 1);
+			atomic_add_64(&a->bytes[dirndx], pd.tot_len);
 		}
 		if (s != NULL) {
 			sk = s->state_key;
@@ -10839,6 +11476,8 @@ done:
 		}
 	}
 
+	pf_state_flow_unlock(fl);
+
 	VERIFY(pbuf == NULL || pd.mp == NULL || pd.mp == pbuf);
 
 	if (*pbufp) {
@@ -0,0 +1,779 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Compiled classification of the main filter ruleset.
+ *
+ * When the active filter rules of the main ruleset change, every rule is
+ * indexed along the dimensions that pf_test_rule() checks first: direction,
+ * address family, protocol, interface, source and destination prefix and
+ * destination port.  A rule either matches any value of a dimension (it is
+ * set in that dimension's wildcard bitmap) or exactly one key, in which case
+ * it is listed in a hash bucket for that key.  Addresses are kept as a tuple
+ * space, one set of keys per prefix length in use.
+ *
+ * For a packet, the bitmaps of all dimensions are intersected into the set
+ * of candidate rules.  The candidate set is a superset of the rules that can
+ * match, and pf_test_rule() still runs every check on each candidate it
+ * visits, in ruleset order; it merely skips the rules that are known not to
+ * match.  First-match (quick) and last-match semantics are thus unchanged.
+ *
+ * Anchors are only filtered at the main level: the rules inside an anchor
+ * are evaluated linearly, with skip steps, as before.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/mbuf.h>
+
+#include <kern/zalloc.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/ip6.h>
+
+#include <net/if.h>
+#include <net/pfvar.h>
+
+enum {
+	PF_RC_PROTO,
+	PF_RC_IFP,
+	PF_RC_SRC_ADDR,
+	PF_RC_DST_ADDR,
+	PF_RC_DST_PORT,
+	PF_RC_MAX
+};
+
+#define PF_RC_ADDR_DIM(d)       ((d) - PF_RC_SRC_ADDR)
+#define PF_RC_PLEN_MAX          128
+
+/* rules sharing one key of a dimension, in ruleset order */
+struct pf_rc_ent {
+	struct pf_rc_ent        *rce_next;
+	struct pf_addr           rce_addr;
+	u_int32_t                rce_tag;
+	u_int32_t                rce_cnt;
+	u_int32_t                rce_size;
+	u_int32_t               *rce_idx;
+};
+
+struct pf_rc_dim {
+	u_int64_t               *rcd_wild;      /* rules matching any key */
+	struct pf_rc_ent       **rcd_hash;
+};
+
+struct pf_rule_class {
+	u_int32_t                rc_ticket;
+	u_int32_t                rc_nrules;
+	u_int32_t                rc_nwords;
+	u_int32_t                rc_hashmask;
+	struct pf_rule         **rc_rules;      /* indexed by pf_rule nr */
+	u_int64_t               *rc_diraf[2][2]; /* [in, out][inet, inet6] */
+	struct pf_rc_dim         rc_dim[PF_RC_MAX];
+	/* prefix lengths in use, per address dimension and family */
+	u_int8_t                 rc_plen[2][2][PF_RC_PLEN_MAX + 1];
+	u_int8_t                 rc_nplen[2][2];
+	u_int64_t               *rc_cand;       /* candidates of the last match */
+	u_int64_t               *rc_tmp;
+	u_int64_t               *rc_bitmaps;
+	size_t                   rc_bitmaps_size;
+};
+
+#define PF_RC_NBITMAPS          (4 + PF_RC_MAX + 2)
+
+static struct pf_rule_class *pf_filter_class;
+
+static int pf_rule_compiler = 1;
+SYSCTL_DECL(_net_pf);
+SYSCTL_INT(_net_pf, OID_AUTO, rule_compiler, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &pf_rule_compiler, 0, "Skip filter rules that cannot match a packet");
+
+static inline int
+pf_rc_afi(sa_family_t af)
+{
+	switch (af) {
+	case AF_INET:
+		return 0;
+	case AF_INET6:
+		return 1;
+	}
+	return -1;
+}
+
+static inline void
+pf_rc_setbit(u_int64_t *map, u_int32_t i)
+{
+	map[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline u_int32_t
+pf_rc_hash(const struct pf_addr *a, u_int32_t tag)
+{
+	u_int32_t h = tag * 0x9e3779b1;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		h = (h ^ a->addr32[i]) * 0x85ebca6b;
+		h ^= h >> 13;
+	}
+	return h ^ (h >> 16);
+}
+
+static void
+pf_rc_mask(struct pf_addr *dst, const struct pf_addr *src, u_int8_t plen,
+    sa_family_t af)
+{
+	int i, words = (af == AF_INET) ? 1 : 4;
+
+	bzero(dst, sizeof(*dst));
+	for (i = 0; i < words && plen > 0; i++) {
+		if (plen >= 32) {
+			dst->addr32[i] = src->addr32[i];
+			plen -= 32;
+		} else {
+			dst->addr32[i] = src->addr32[i] &
+			    htonl(~(0xffffffffU >> plen));
+			plen = 0;
+		}
+	}
+}
+
+/*
+ * Length of a contiguous netmask, 0 for an empty mask and -1 if the mask
+ * is not a prefix.
+ */
+static int
+pf_rc_prefixlen(const struct pf_addr *m, sa_family_t af)
+{
+	int i, j, plen = 0, words = (af == AF_INET) ? 1 : 4;
+
+	for (i = 0; i < words; i++) {
+		u_int32_t inv = ~ntohl(m->addr32[i]);
+
+		if (inv == 0) {
+			plen += 32;
+			continue;
+		}
+		if ((inv & (inv + 1)) != 0) {
+			return -1;
+		}
+		plen += __builtin_clz(inv);
+		for (j = i + 1; j < words; j++) {
+			if (m->addr32[j] != 0) {
+				return -1;
+			}
+		}
+		break;
+	}
+	return plen;
+}
+
+static struct pf_rc_ent *
+pf_rc_lookup(struct pf_rule_class *rc, int dim, const struct pf_addr *addr,
+    u_int32_t tag)
+{
+	struct pf_rc_ent *e;
+
+	e = rc->rc_dim[dim].rcd_hash[pf_rc_hash(addr, tag) & rc->rc_hashmask];
+	for (; e != NULL; e = e->rce_next) {
+		if (e->rce_tag == tag &&
+		    bcmp(&e->rce_addr, addr, sizeof(*addr)) == 0) {
+			break;
+		}
+	}
+	return e;
+}
+
+static void
+pf_rc_insert(struct pf_rule_class *rc, int dim, const struct pf_addr *addr,
+    u_int32_t tag, u_int32_t idx)
+{
+	struct pf_rc_ent *e, **head;
+
+	if ((e = pf_rc_lookup(rc, dim, addr, tag)) == NULL) {
+		e = kalloc_type(struct pf_rc_ent, Z_WAITOK_ZERO_NOFAIL);
+		e->rce_addr = *addr;
+		e->rce_tag = tag;
+		head = &rc->rc_dim[dim].rcd_hash[pf_rc_hash(addr, tag) &
+		    rc->rc_hashmask];
+		e->rce_next = *head;
+		*head = e;
+	}
+	if (e->rce_cnt == e->rce_size) {
+		u_int32_t size = e->rce_size ? e->rce_size * 2 : 4;
+		u_int32_t *p = kalloc_data(size * sizeof(*p),
+		    Z_WAITOK | Z_NOFAIL);
+
+		if (e->rce_cnt != 0) {
+			bcopy(e->rce_idx, p, e->rce_cnt * sizeof(*p));
+			kfree_data(e->rce_idx, e->rce_size * sizeof(*p));
+		}
+		e->rce_idx = p;
+		e->rce_size = size;
+	}
+	e->rce_idx[e->rce_cnt++] = idx;
+}
+
+static void
+pf_rc_index_addr(struct pf_rule_class *rc, int dim, struct pf_rule *r,
+    struct pf_rule_addr *ra, u_int32_t idx)
+{
+	struct pf_addr key;
+	int afi, plen;
+
+	afi = pf_rc_afi(r->af);
+	if (afi < 0 || ra->neg || ra->addr.type != PF_ADDR_ADDRMASK ||
+	    (plen = pf_rc_prefixlen(&ra->addr.v.a.mask, r->af)) <= 0) {
+		pf_rc_setbit(rc->rc_dim[dim].rcd_wild, idx);
+		return;
+	}
+	pf_rc_mask(&key, &ra->addr.v.a.addr, (u_int8_t)plen, r->af);
+	pf_rc_insert(rc, dim, &key, (r->af << 8) | plen, idx);
+}
+
+static void
+pf_rule_class_free(struct pf_rule_class *rc)
+{
+	struct pf_rc_ent *e;
+	u_int32_t d, i;
+
+	if (rc == NULL) {
+		return;
+	}
+	for (d = 0; d < PF_RC_MAX; d++) {
+		if (rc->rc_dim[d].rcd_hash == NULL) {
+			continue;
+		}
+		for (i = 0; i <= rc->rc_hashmask; i++) {
+			while ((e = rc->rc_dim[d].rcd_hash[i]) != NULL) {
+				rc->rc_dim[d].rcd_hash[i] = e->rce_next;
+				kfree_data(e->rce_idx,
+				    e->rce_size * sizeof(*e->rce_idx));
+				kfree_type(struct pf_rc_ent, e);
+			}
+		}
+		kfree_type(struct pf_rc_ent *, rc->rc_hashmask + 1,
+		    rc->rc_dim[d].rcd_hash);
+	}
+	kfree_type(struct pf_rule *, rc->rc_nrules, rc->rc_rules);
+	kfree_data(rc->rc_bitmaps, rc->rc_bitmaps_size);
+	kfree_type(struct pf_rule_class, rc);
+}
+
+static struct pf_rule_class *
+pf_rule_class_build(struct pf_rulequeue *rules, u_int32_t nrules)
+{
+	struct pf_rule_class *rc;
+	struct pf_rule *r;
+	struct pf_addr key;
+	u_int64_t plens[2][2][3];
+	u_int32_t i, d, nbuckets;
+	int di, afi, p;
+
+	if (nrules == 0) {
+		return NULL;
+	}
+
+	rc = kalloc_type(struct pf_rule_class, Z_WAITOK_ZERO_NOFAIL);
+	rc->rc_nrules = nrules;
+	rc->rc_nwords = (nrules + 63) / 64;
+	rc->rc_rules = kalloc_type(struct pf_rule *, nrules,
+	    Z_WAITOK_ZERO_NOFAIL);
+	rc->rc_bitmaps_size = PF_RC_NBITMAPS * rc->rc_nwords * sizeof(u_int64_t);
+	rc->rc_bitmaps = kalloc_data(rc->rc_bitmaps_size, Z_WAITOK_ZERO_NOFAIL);
+	nbuckets = 16;
+	while (nbuckets < nrules) {
+		nbuckets <<= 1;
+	}
+	rc->rc_hashmask = nbuckets - 1;
+
+	i = 0;
+	for (di = 0; di < 2; di++) {
+		for (afi = 0; afi < 2; afi++) {
+			rc->rc_diraf[di][afi] = &rc->rc_bitmaps[i++ * rc->rc_nwords];
+		}
+	}
+	for (d = 0; d < PF_RC_MAX; d++) {
+		rc->rc_dim[d].rcd_wild = &rc->rc_bitmaps[i++ * rc->rc_nwords];
+		rc->rc_dim[d].rcd_hash = kalloc_type(struct pf_rc_ent *,
+		    nbuckets, Z_WAITOK_ZERO_NOFAIL);
+	}
+	rc->rc_cand = &rc->rc_bitmaps[i++ * rc->rc_nwords];
+	rc->rc_tmp = &rc->rc_bitmaps[i++ * rc->rc_nwords];
+
+	bzero(plens, sizeof(plens));
+	i = 0;
+	TAILQ_FOREACH(r, rules, entries) {
+		/* candidates are visited by rule number */
+		if (i >= nrules || r->nr != i) {
+			pf_rule_class_free(rc);
+			return NULL;
+		}
+		rc->rc_rules[i] = r;
+
+		for (di = 0; di < 2; di++) {
+			if (r->direction &&
+			    r->direction != (di == 0 ? PF_IN : PF_OUT)) {
+				continue;
+			}
+			for (afi = 0; afi < 2; afi++) {
+				if (!r->af ||
+				    r->af == (afi == 0 ? AF_INET : AF_INET6)) {
+					pf_rc_setbit(rc->rc_diraf[di][afi], i);
+				}
+			}
+		}
+
+		bzero(&key, sizeof(key));
+		if (r->proto) {
+			pf_rc_insert(rc, PF_RC_PROTO, &key, r->proto, i);
+		} else {
+			pf_rc_setbit(rc->rc_dim[PF_RC_PROTO].rcd_wild, i);
+		}
+
+		/* pfi_kif_match() compares interfaces by identity */
+		if (r->kif != NULL && !r->ifnot) {
+			bcopy(&r->kif, &key, sizeof(r->kif));
+			pf_rc_insert(rc, PF_RC_IFP, &key, 0, i);
+		} else {
+			pf_rc_setbit(rc->rc_dim[PF_RC_IFP].rcd_wild, i);
+		}
+
+		pf_rc_index_addr(rc, PF_RC_SRC_ADDR, r, &r->src, i);
+		pf_rc_index_addr(rc, PF_RC_DST_ADDR, r, &r->dst, i);
+
+		bzero(&key, sizeof(key));
+		if ((r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+		    r->dst.xport.range.op == PF_OP_EQ) {
+			pf_rc_insert(rc, PF_RC_DST_PORT, &key,
+			    (r->proto << 16) | r->dst.xport.range.port[0], i);
+		} else {
+			pf_rc_setbit(rc->rc_dim[PF_RC_DST_PORT].rcd_wild, i);
+		}
+		i++;
+	}
+	if (i != nrules) {
+		pf_rule_class_free(rc);
+		return NULL;
+	}
+
+	/* collect the prefix lengths each address dimension has keys for */
+	for (d = PF_RC_SRC_ADDR; d <= PF_RC_DST_ADDR; d++) {
+		struct pf_rc_ent *e;
+		u_int32_t b;
+
+		for (b = 0; b <= rc->rc_hashmask; b++) {
+			for (e = rc->rc_dim[d].rcd_hash[b]; e != NULL;
+			    e = e->rce_next) {
+				afi = pf_rc_afi(e->rce_tag >> 8);
+				p = e->rce_tag & 0xff;
+				plens[PF_RC_ADDR_DIM(d)][afi][p / 64] |=
+				    1ULL << (p % 64);
+			}
+		}
+		for (afi = 0; afi < 2; afi++) {
+			u_int64_t *present = plens[PF_RC_ADDR_DIM(d)][afi];
+			u_int8_t *plen = rc->rc_plen[PF_RC_ADDR_DIM(d)][afi];
+			u_int8_t *nplen = &rc->rc_nplen[PF_RC_ADDR_DIM(d)][afi];
+
+			/* longest prefixes first, they tend to be the rarest */
+			for (p = PF_RC_PLEN_MAX; p > 0; p--) {
+				if (present[p / 64] & (1ULL << (p % 64))) {
+					plen[(*nplen)++] = (u_int8_t)p;
+				}
+			}
+		}
+	}
+	return rc;
+}
+
+/* AND the rules matching a key of a dimension into the candidates */
+static void
+pf_rc_and(struct pf_rule_class *rc, int dim, const struct pf_addr *addr,
+    u_int32_t tag)
+{
+	struct pf_rc_ent *e;
+	u_int32_t i;
+
+	bcopy(rc->rc_dim[dim].rcd_wild, rc->rc_tmp,
+	    rc->rc_nwords * sizeof(u_int64_t));
+	if ((e = pf_rc_lookup(rc, dim, addr, tag)) != NULL) {
+		for (i = 0; i < e->rce_cnt; i++) {
+			pf_rc_setbit(rc->rc_tmp, e->rce_idx[i]);
+		}
+	}
+	for (i = 0; i < rc->rc_nwords; i++) {
+		rc->rc_cand[i] &= rc->rc_tmp[i];
+	}
+}
+
+static void
+pf_rc_and_addr(struct pf_rule_class *rc, int dim, int afi, sa_family_t af,
+    const struct pf_addr *addr)
+{
+	struct pf_addr key;
+	struct pf_rc_ent *e;
+	u_int32_t i, n;
+	u_int8_t plen;
+
+	bcopy(rc->rc_dim[dim].rcd_wild, rc->rc_tmp,
+	    rc->rc_nwords * sizeof(u_int64_t));
+	for (n = 0; n < rc->rc_nplen[PF_RC_ADDR_DIM(dim)][afi]; n++) {
+		plen = rc->rc_plen[PF_RC_ADDR_DIM(dim)][afi][n];
+		pf_rc_mask(&key, addr, plen, af);
+		if ((e = pf_rc_lookup(rc, dim, &key, (af << 8) | plen)) != NULL) {
+			for (i = 0; i < e->rce_cnt; i++) {
+				pf_rc_setbit(rc->rc_tmp, e->rce_idx[i]);
+			}
+		}
+	}
+	for (i = 0; i < rc->rc_nwords; i++) {
+		rc->rc_cand[i] &= rc->rc_tmp[i];
+	}
+}
+
+static struct pf_rule_class *
+pf_rc_match(struct pf_rule_class *rc, int direction, struct pfi_kif *kif,
+    sa_family_t af, u_int8_t proto, struct pf_addr *saddr,
+    struct pf_addr *daddr, u_int16_t dport)
+{
+	struct pf_addr key;
+	int di, afi;
+
+	if ((afi = pf_rc_afi(af)) < 0) {
+		return NULL;
+	}
+	switch (direction) {
+	case PF_IN:
+		di = 0;
+		break;
+	case PF_OUT:
+		di = 1;
+		break;
+	default:
+		return NULL;
+	}
+
+	bcopy(rc->rc_diraf[di][afi], rc->rc_cand,
+	    rc->rc_nwords * sizeof(u_int64_t));
+	bzero(&key, sizeof(key));
+	pf_rc_and(rc, PF_RC_PROTO, &key, proto);
+	bcopy(&kif, &key, sizeof(kif));
+	pf_rc_and(rc, PF_RC_IFP, &key, 0);
+	pf_rc_and_addr(rc, PF_RC_SRC_ADDR, afi, af, saddr);
+	pf_rc_and_addr(rc, PF_RC_DST_ADDR, afi, af, daddr);
+	/* rules keyed on a port are tcp/udp, and excluded by proto otherwise */
+	if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+		bzero(&key, sizeof(key));
+		pf_rc_and(rc, PF_RC_DST_PORT, &key, (proto << 16) | dport);
+	}
+	return rc;
+}
+
+/*
+ * Rebuild the compiled classifier after the active rules of a ruleset
+ * changed.  Only the filter rules of the main ruleset are compiled.
+ */
+void
+pf_rule_compile(struct pf_ruleset *rs, int rs_num)
+{
+	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rs != &pf_main_ruleset || rs_num != PF_RULESET_FILTER) {
+		return;
+	}
+	pf_rule_class_free(pf_filter_class);
+	pf_filter_class = pf_rule_class_build(rs->rules[rs_num].active.ptr,
+	    rs->rules[rs_num].active.rcount);
+	if (pf_filter_class != NULL) {
+		pf_filter_class->rc_ticket = rs->rules[rs_num].active.ticket;
+	}
+}
+
+/*
+ * Compute the candidate filter rules for a packet.  Returns NULL when
+ * every rule has to be evaluated.
+ */
+struct pf_rule_class *
+pf_rule_class_match(int direction, struct pfi_kif *kif, sa_family_t af,
+    u_int8_t proto, struct pf_addr *saddr, struct pf_addr *daddr,
+    u_int16_t dport)
+{
+	struct pf_rule_class *rc = pf_filter_class;
+
+	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (!pf_rule_compiler || rc == NULL ||
+	    rc->rc_ticket !=
+	    pf_main_ruleset.rules[PF_RULESET_FILTER].active.ticket ||
+	    rc->rc_nrules !=
+	    pf_main_ruleset.rules[PF_RULESET_FILTER].active.rcount) {
+		return NULL;
+	}
+	return pf_rc_match(rc, direction, kif, af, proto, saddr, daddr, dport);
+}
+
+/*
+ * First candidate rule at or after r, NULL when no further rule of the
+ * main filter ruleset can match.
+ */
+struct pf_rule *
+pf_rule_class_next(struct pf_rule_class *rc, struct pf_rule *r)
+{
+	u_int32_t w = r->nr / 64;
+	u_int64_t bits;
+
+	if (r->nr >= rc->rc_nrules) {
+		return NULL;
+	}
+	bits = rc->rc_cand[w] & (~0ULL << (r->nr % 64));
+	while (bits == 0) {
+		if (++w == rc->rc_nwords) {
+			return NULL;
+		}
+		bits = rc->rc_cand[w];
+	}
+	return rc->rc_rules[w * 64 + __builtin_ctzll(bits)];
+}
+
+#if DEVELOPMENT || DEBUG
+
+#define PF_RC_TEST_RULES        2000
+#define PF_RC_TEST_PACKETS      20000
+
+static u_int32_t
+pf_rc_test_rand(u_int64_t *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (u_int32_t)(*seed >> 33);
+}
+
+/* a few networks, so that rules and packets overlap */
+static void
+pf_rc_test_addr(u_int64_t *seed, struct pf_addr *a, sa_family_t af)
+{
+	bzero(a, sizeof(*a));
+	if (af == AF_INET) {
+		a->addr32[0] = htonl(0x0a000000 |
+		    ((pf_rc_test_rand(seed) % 4) << 16) |
+		    (pf_rc_test_rand(seed) & 0x3ff));
+	} else {
+		a->addr32[0] = htonl(0x20010db8);
+		a->addr32[1] = htonl(pf_rc_test_rand(seed) % 4);
+		a->addr32[3] = htonl(pf_rc_test_rand(seed) & 0x3ff);
+	}
+}
+
+static void
+pf_rc_test_rule_addr(u_int64_t *seed, struct pf_rule_addr *ra, sa_family_t af)
+{
+	static const u_int8_t plens4[] = { 8, 14, 16, 24, 30, 32 };
+	static const u_int8_t plens6[] = { 32, 64, 120, 128 };
+	struct pf_addr a;
+	u_int8_t plen;
+
+	ra->addr.type = PF_ADDR_ADDRMASK;
+	switch (pf_rc_test_rand(seed) % 8) {
+	case 0:
+	case 1:
+		/* any */
+		return;
+	case 2:
+		ra->neg = 1;
+		break;
+	case 3:
+		/* not a prefix */
+		pf_rc_test_addr(seed, &ra->addr.v.a.addr, af);
+		ra->addr.v.a.mask.addr32[0] = htonl(0xff00ff00);
+		return;
+	}
+	if (af == AF_INET) {
+		plen = plens4[pf_rc_test_rand(seed) % sizeof(plens4)];
+	} else if (af == AF_INET6) {
+		plen = plens6[pf_rc_test_rand(seed) % sizeof(plens6)];
+	} else {
+		return;
+	}
+	pf_rc_test_addr(seed, &ra->addr.v.a.addr, af);
+	memset(&a, 0xff, sizeof(a));
+	pf_rc_mask(&ra->addr.v.a.mask, &a, plen, af);
+}
+
+/* the checks of pf_test_rule() that the classifier covers */
+static int
+pf_rc_test_linear(struct pf_rule *r, int direction, struct pfi_kif *kif,
+    sa_family_t af, u_int8_t proto, struct pf_addr *saddr,
+    struct pf_addr *daddr, u_int16_t dport)
+{
+	if (pfi_kif_match(r->kif, kif) == r->ifnot) {
+		return 0;
+	} else if (r->direction && r->direction != direction) {
+		return 0;
+	} else if (r->af && r->af != af) {
+		return 0;
+	} else if (r->proto && r->proto != proto) {
+		return 0;
+	} else if (PF_MISMATCHAW(&r->src.addr, saddr, af, r->src.neg, kif)) {
+		return 0;
+	} else if (PF_MISMATCHAW(&r->dst.addr, daddr, af, r->dst.neg, NULL)) {
+		return 0;
+	} else if (r->proto == proto &&
+	    (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+	    r->dst.xport.range.op &&
+	    !pf_match_port(r->dst.xport.range.op, r->dst.xport.range.port[0],
+	    r->dst.xport.range.port[1], dport)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Build random rulesets, and check for random packets that walking the
+ * candidates finds the same first (quick) and last matching rule as
+ * walking every rule.
+ */
+static int
+pf_rule_compile_test(int64_t in, int64_t *out)
+{
+	static const u_int8_t protos[] = { 0, IPPROTO_TCP, IPPROTO_UDP,
+		                           IPPROTO_ICMP };
+	static const sa_family_t afs[] = { 0, AF_INET, AF_INET6 };
+	struct pfi_kif kifs[3];
+	struct pf_rulequeue rules;
+	struct pf_rule *rarray, *r, *lfirst, *llast, *cfirst, *clast;
+	struct pf_rule_class *rc;
+	struct pf_addr saddr, daddr;
+	u_int64_t seed = (u_int64_t)in;
+	u_int32_t i, n, nrules, mismatches = 0;
+	int direction, visited = 0, matched = 0;
+	struct pfi_kif *kif;
+	sa_family_t af;
+	u_int8_t proto;
+	u_int16_t dport;
+
+	bzero(kifs, sizeof(kifs));
+	rarray = kalloc_type(struct pf_rule, PF_RC_TEST_RULES,
+	    Z_WAITOK_ZERO_NOFAIL);
+
+	for (n = 0; n < 8; n++) {
+		nrules = 1 + pf_rc_test_rand(&seed) % PF_RC_TEST_RULES;
+		bzero(rarray, PF_RC_TEST_RULES * sizeof(*rarray));
+		TAILQ_INIT(&rules);
+		for (i = 0; i < nrules; i++) {
+			r = &rarray[i];
+			r->nr = i;
+			r->os_fingerprint = PF_OSFP_ANY;
+			r->quick = (pf_rc_test_rand(&seed) % 16) == 0;
+			r->direction = pf_rc_test_rand(&seed) % 3;
+			r->af = afs[pf_rc_test_rand(&seed) % 3];
+			r->proto = protos[pf_rc_test_rand(&seed) % 4];
+			if (pf_rc_test_rand(&seed) % 2) {
+				r->kif = &kifs[pf_rc_test_rand(&seed) % 3];
+				r->ifnot = (pf_rc_test_rand(&seed) % 4) == 0;
+			}
+			pf_rc_test_rule_addr(&seed, &r->src, r->af);
+			pf_rc_test_rule_addr(&seed, &r->dst, r->af);
+			if (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) {
+				r->dst.xport.range.op =
+				    pf_rc_test_rand(&seed) % 3 ? PF_OP_EQ :
+				    (pf_rc_test_rand(&seed) % 2 ? PF_OP_NONE :
+				    PF_OP_GT);
+				r->dst.xport.range.port[0] =
+				    htons(pf_rc_test_rand(&seed) % 16);
+			}
+			TAILQ_INSERT_TAIL(&rules, r, entries);
+		}
+
+		rc = pf_rule_class_build(&rules, nrules);
+		if (rc == NULL) {
+			kfree_type(struct pf_rule, PF_RC_TEST_RULES, rarray);
+			return EINVAL;
+		}
+
+		for (i = 0; i < PF_RC_TEST_PACKETS; i++) {
+			direction = pf_rc_test_rand(&seed) % 2 ? PF_IN : PF_OUT;
+			af = pf_rc_test_rand(&seed) % 2 ? AF_INET : AF_INET6;
+			proto = protos[1 + pf_rc_test_rand(&seed) % 3];
+			kif = &kifs[pf_rc_test_rand(&seed) % 3];
+			pf_rc_test_addr(&seed, &saddr, af);
+			pf_rc_test_addr(&seed, &daddr, af);
+			dport = htons(pf_rc_test_rand(&seed) % 16);
+
+			lfirst = llast = NULL;
+			TAILQ_FOREACH(r, &rules, entries) {
+				if (pf_rc_test_linear(r, direction, kif, af,
+				    proto, &saddr, &daddr, dport)) {
+					if (lfirst == NULL && r->quick) {
+						lfirst = r;
+					}
+					llast = r;
+				}
+			}
+
+			cfirst = clast = NULL;
+			pf_rc_match(rc, direction, kif, af, proto, &saddr,
+			    &daddr, dport);
+			r = pf_rule_class_next(rc, TAILQ_FIRST(&rules));
+			while (r != NULL) {
+				visited++;
+				if (pf_rc_test_linear(r, direction, kif, af,
+				    proto, &saddr, &daddr, dport)) {
+					if (cfirst == NULL && r->quick) {
+						cfirst = r;
+					}
+					clast = r;
+				}
+				r = TAILQ_NEXT(r, entries);
+				if (r != NULL) {
+					r = pf_rule_class_next(rc, r);
+				}
+			}
+
+			if (lfirst != cfirst || llast != clast) {
+				mismatches++;
+			}
+			if (llast != NULL) {
+				matched++;
+			}
+		}
+		pf_rule_class_free(rc);
+	}
+	kfree_type(struct pf_rule, PF_RC_TEST_RULES, rarray);
+
+	printf("%s: %d packets matched, %d candidates visited, "
+	    "%u mismatches\n", __func__, matched, visited, mismatches);
+	*out = (mismatches == 0 && matched > 0);
+	return 0;
+}
+SYSCTL_TEST_REGISTER(pf_rule_compile, pf_rule_compile_test);
+
+#endif /* DEVELOPMENT || DEBUG */
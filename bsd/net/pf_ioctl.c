@@ -437,6 +437,7 @@ pfinit(void)
 	pf_init_ruleset(&pf_main_ruleset);
 	TAILQ_INIT(&pf_pabuf);
 	TAILQ_INIT(&state_list);
+	pf_state_hash_init();
 
 	_CASSERT((SC_BE & SCIDX_MASK) == SCIDX_BE);
 	_CASSERT((SC_BK_SYS & SCIDX_MASK) == SCIDX_BK_SYS);
@@ -1118,6 +1119,7 @@ pf_commit_rules(u_int32_t ticket, int rs_num, char *anchor)
 	rs->rules[rs_num].active.ticket =
 	    rs->rules[rs_num].inactive.ticket;
 	pf_calc_skip_steps(rs->rules[rs_num].active.ptr);
+	pf_rule_compile(rs, rs_num);
 
 
 	/* Purge the old rule list. */
@@ -2469,6 +2471,7 @@ pf_ruleset_cleanup(struct pf_ruleset *ruleset, int rs)
 	pf_calc_skip_steps(ruleset->rules[rs].active.ptr);
 	ruleset->rules[rs].active.ticket =
 	    ++ruleset->rules[rs].inactive.ticket;
+	pf_rule_compile(ruleset, rs);
 }
 
 /*
@@ -3177,6 +3180,7 @@ pfioctl_ioc_rule(u_long cmd, int minordev, struct pfioc_rule *pr, struct proc *p
 		ruleset->rules[rs_num].active.ticket++;
 
 		pf_calc_skip_steps(ruleset->rules[rs_num].active.ptr);
+		pf_rule_compile(ruleset, rs_num);
 #if SKYWALK && defined(XNU_TARGET_OS_OSX)
 		pf_process_compatibilities();
 #endif // SKYWALK && defined(XNU_TARGET_OS_OSX)
@@ -4564,6 +4568,22 @@ pf_af_hook(struct ifnet *ifp, struct mbuf **mppn, struct mbuf **mp,
 		return 0;
 	}
 
+	/*
+	 * For packets destined to locally hosted IP address
+	 * ip_output_list sets Mbuf's pkt header's rcvif to
+	 * the interface hosting the IP address.
+	 * While on the output path ifp passed to pf_af_hook
+	 * to such local communication is the loopback interface,
+	 * the input path derives ifp from mbuf packet header's
+	 * rcvif.
+	 * This asymmetry caues issues with PF.
+	 * To handle that case, we have a limited change here to
+	 * pass interface as loopback if packets are looped in.
+	 */
+	if (input && ((*mp)->m_pkthdr.pkt_flags & PKTF_LOOP)) {
+		pf_ifp = lo_ifp;
+	}
+
 	marks = net_thread_marks_push(NET_THREAD_HELD_PF);
 
 	if (marks != net_thread_marks_none) {
@@ -4571,6 +4591,11 @@ pf_af_hook(struct ifnet *ifp, struct mbuf **mppn, struct mbuf **mp,
 		if (!pf_is_enabled) {
 			goto done;
 		}
+		/* packets of established flows need not take pf_lock */
+		if (pf_test_established(input ? PF_IN : PF_OUT, pf_ifp, *mp,
+		    af) == PF_PASS) {
+			goto done;
+		}
 		lck_mtx_lock(&pf_lock);
 	}
 
@@ -4581,22 +4606,6 @@ pf_af_hook(struct ifnet *ifp, struct mbuf **mppn, struct mbuf **mp,
 		(*mp)->m_nextpkt = NULL;
 	}
 
-	/*
-	 * For packets destined to locally hosted IP address
-	 * ip_output_list sets Mbuf's pkt header's rcvif to
-	 * the interface hosting the IP address.
-	 * While on the output path ifp passed to pf_af_hook
-	 * to such local communication is the loopback interface,
-	 * the input path derives ifp from mbuf packet header's
-	 * rcvif.
-	 * This asymmetry caues issues with PF.
-	 * To handle that case, we have a limited change here to
-	 * pass interface as loopback if packets are looped in.
-	 */
-	if (input && ((*mp)->m_pkthdr.pkt_flags & PKTF_LOOP)) {
-		pf_ifp = lo_ifp;
-	}
-
 	switch (af) {
 #if INET
 	case AF_INET: {
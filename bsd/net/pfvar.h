@@ -1008,10 +1008,18 @@ struct pf_state_key {
 
 	RB_ENTRY(pf_state_key)   entry_lan_ext;
 	RB_ENTRY(pf_state_key)   entry_ext_gwy;
+	LIST_ENTRY(pf_state_key) hash_lan_ext;
+	LIST_ENTRY(pf_state_key) hash_ext_gwy;
+	u_int32_t        hashv_lan_ext;
+	u_int32_t        hashv_ext_gwy;
+	u_int8_t         hashed;        /* PFSK_HASHED_* */
 	struct pf_statelist      states;
 	u_int32_t        refcnt;
 };
 
+#define PFSK_HASHED_LAN_EXT     0x01
+#define PFSK_HASHED_EXT_GWY     0x02
+
 
 /* keep synced with struct pf_state, used in RB_FIND */
 struct pf_state_cmp {
@@ -2169,6 +2177,13 @@ __private_extern__ int pf_tbladdr_setup(struct pf_ruleset *,
 __private_extern__ void pf_tbladdr_remove(struct pf_addr_wrap *);
 __private_extern__ void pf_tbladdr_copyout(struct pf_addr_wrap *);
 __private_extern__ void pf_calc_skip_steps(struct pf_rulequeue *);
+struct pf_rule_class;
+__private_extern__ void pf_rule_compile(struct pf_ruleset *, int);
+__private_extern__ struct pf_rule_class *pf_rule_class_match(int,
+    struct pfi_kif *, sa_family_t, u_int8_t, struct pf_addr *,
+    struct pf_addr *, u_int16_t);
+__private_extern__ struct pf_rule *pf_rule_class_next(struct pf_rule_class *,
+    struct pf_rule *);
 __private_extern__ u_int32_t pf_calc_state_key_flowhash(struct pf_state_key *);
 
 extern struct pool pf_src_tree_pl, pf_rule_pl;
@@ -2179,6 +2194,7 @@ extern struct pool pf_app_state_pl;
 extern struct thread *pf_purge_thread;
 
 __private_extern__ void pfinit(void);
+__private_extern__ void pf_state_hash_init(void);
 __private_extern__ void pf_purge_thread_fn(void *, wait_result_t) __dead2;
 __private_extern__ void pf_purge_expired_src_nodes(void);
 __private_extern__ void pf_purge_expired_states(u_int32_t);
@@ -2213,6 +2229,8 @@ __private_extern__ int pf_test_mbuf(int, struct ifnet *, struct mbuf **,
 
 __private_extern__ int pf_test6_mbuf(int, struct ifnet *, struct mbuf **,
     struct ether_header *, struct ip_fw_args *);
+__private_extern__ int pf_test_established(int, struct ifnet *,
+    struct mbuf *, int);
 __private_extern__ void pf_poolmask(struct pf_addr *, struct pf_addr *,
     struct pf_addr *, struct pf_addr *, u_int8_t);
 __private_extern__ void pf_addr_inc(struct pf_addr *, sa_family_t);
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Calendar queue (R. Brown, CACM 1988) with a bitmap of the occupied
+ * buckets, shared by netem and dummynet in place of their binary heaps.
+ *
+ * The calendar keeps cq_cur, the number of the earliest bucket that may
+ * hold a due event.  An event whose bucket number is below cq_cur is
+ * filed in the cq_cur bucket, ahead of everything there, so that the
+ * earliest event is always the head of the first bucket, scanning from
+ * cq_cur, whose head belongs to the current lap.  Buckets are kept
+ * sorted and filled from the tail; as the emulators mostly schedule
+ * later than everything already queued, that is where insertion ends.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/sysctl.h>
+#include <kern/startup.h>
+#include <kern/zalloc.h>
+
+#include <net/pktsched/pktsched_calq.h>
+
+void
+calq_init(struct calq *cq, uint32_t shift)
+{
+	bzero(cq, sizeof(*cq));
+	cq->cq_shift = shift;
+	for (int i = 0; i < CALQ_BUCKETS; i++) {
+		TAILQ_INIT(&cq->cq_buckets[i]);
+	}
+}
+
+/* distance from bucket `from' to the next occupied bucket, or -1 */
+static int
+calq_next_bucket(struct calq *cq, uint64_t from)
+{
+	uint32_t start = (uint32_t)(from & CALQ_BUCKET_MASK);
+
+	for (uint32_t i = 0; i <= CALQ_WORDS; i++) {
+		uint32_t word = ((start / 64) + i) % CALQ_WORDS;
+		uint64_t bits = cq->cq_occupied[word];
+
+		if (i == 0) {
+			bits &= ~0ULL << (start % 64);
+		} else if (i == CALQ_WORDS) {
+			/* wrapped around to the part of the first word before start */
+			bits &= (1ULL << (start % 64)) - 1;
+		}
+		if (bits != 0) {
+			uint32_t idx = word * 64 + (uint32_t)__builtin_ctzll(bits);
+
+			return (int)((idx - start) & CALQ_BUCKET_MASK);
+		}
+	}
+	return -1;
+}
+
+void
+calq_insert(struct calq *cq, struct calq_entry *ce, uint64_t key)
+{
+	struct calq_bucket *bucket;
+	struct calq_entry *prev;
+	uint64_t b = key >> cq->cq_shift;
+	uint32_t idx;
+
+	ASSERT(!calq_queued(ce));
+
+	if (cq->cq_count == 0) {
+		cq->cq_cur = b;
+	} else if (b < cq->cq_cur) {
+		b = cq->cq_cur;
+	}
+	idx = (uint32_t)(b & CALQ_BUCKET_MASK);
+	bucket = &cq->cq_buckets[idx];
+
+	ce->ce_key = key;
+	TAILQ_FOREACH_REVERSE(prev, bucket, calq_bucket, ce_link) {
+		if (prev->ce_key <= key) {
+			break;
+		}
+	}
+	if (prev != NULL) {
+		TAILQ_INSERT_AFTER(bucket, prev, ce, ce_link);
+	} else {
+		TAILQ_INSERT_HEAD(bucket, ce, ce_link);
+	}
+	cq->cq_occupied[idx / 64] |= 1ULL << (idx % 64);
+	cq->cq_count++;
+}
+
+void
+calq_remove(struct calq *cq, struct calq_entry *ce)
+{
+	struct calq_bucket *bucket;
+	uint64_t b;
+	uint32_t idx;
+
+	ASSERT(calq_queued(ce));
+	ASSERT(cq->cq_count > 0);
+
+	b = MAX(ce->ce_key >> cq->cq_shift, cq->cq_cur);
+	idx = (uint32_t)(b & CALQ_BUCKET_MASK);
+	bucket = &cq->cq_buckets[idx];
+
+	TAILQ_REMOVE(bucket, ce, ce_link);
+	ce->ce_link.tqe_next = NULL;
+	ce->ce_link.tqe_prev = NULL;
+	if (TAILQ_EMPTY(bucket)) {
+		cq->cq_occupied[idx / 64] &= ~(1ULL << (idx % 64));
+	}
+	cq->cq_count--;
+}
+
+/*
+ * The event with the smallest key, left queued, or NULL if there is
+ * none.  Moves cq_cur up to that event's bucket.
+ */
+struct calq_entry *
+calq_first(struct calq *cq)
+{
+	struct calq_entry *ce, *min = NULL;
+	uint64_t b = cq->cq_cur;
+	uint32_t n = 0;
+	int dist;
+
+	if (cq->cq_count == 0) {
+		return NULL;
+	}
+	while ((dist = calq_next_bucket(cq, b)) >= 0) {
+		n += (uint32_t)dist;
+		if (n >= CALQ_BUCKETS) {
+			break;
+		}
+		b += (uint64_t)dist;
+		ce = TAILQ_FIRST(&cq->cq_buckets[b & CALQ_BUCKET_MASK]);
+		if ((ce->ce_key >> cq->cq_shift) <= b) {
+			cq->cq_cur = b;
+			return ce;
+		}
+		b++;
+		n++;
+	}
+
+	/* every event is at least a lap ahead; find the earliest directly */
+	for (uint32_t idx = 0; idx < CALQ_BUCKETS; idx++) {
+		ce = TAILQ_FIRST(&cq->cq_buckets[idx]);
+		if (ce != NULL && (min == NULL || ce->ce_key < min->ce_key)) {
+			min = ce;
+		}
+	}
+	VERIFY(min != NULL);
+	cq->cq_cur = min->ce_key >> cq->cq_shift;
+	return min;
+}
+
+#if (DEVELOPMENT || DEBUG)
+/*
+ * Packets per second through a calendar shared by `in' pipes, each
+ * sending at its own fixed rate: the earliest pipe is taken off, its
+ * packet is sent, and it is filed again for the next one.  Keys are in
+ * nanoseconds, in 16us buckets, and the pipes send one packet every
+ * 1us to 1ms.
+ */
+struct calq_pipe {
+	struct calq_entry       cp_ent;
+	uint64_t                cp_gap;         /* ns between packets */
+};
+
+static int
+calq_pps_test(int64_t in, int64_t *out)
+{
+	struct calq_pipe *pipes;
+	const uint32_t npkts = 1000000;
+	uint32_t npipes = (uint32_t)in;
+	struct calq *cq;
+	uint64_t start, ns, last = 0;
+	int error = 0;
+
+	if (in <= 0 || in > 100000) {
+		return EINVAL;
+	}
+	cq = kalloc_type(struct calq, Z_WAITOK | Z_NOFAIL);
+	pipes = kalloc_type(struct calq_pipe, npipes, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	calq_init(cq, 14);
+	for (uint32_t i = 0; i < npipes; i++) {
+		pipes[i].cp_gap = NSEC_PER_USEC + (random() % NSEC_PER_MSEC);
+		calq_insert(cq, &pipes[i].cp_ent, random() % pipes[i].cp_gap);
+	}
+
+	start = mach_absolute_time();
+	for (uint32_t i = 0; i < npkts; i++) {
+		struct calq_entry *ce = calq_first(cq);
+		struct calq_pipe *cp = __container_of(ce, struct calq_pipe, cp_ent);
+		uint64_t key = ce->ce_key;
+
+		if (key < last) {
+			error = EIO;
+			break;
+		}
+		last = key;
+		calq_remove(cq, ce);
+		calq_insert(cq, ce, key + cp->cp_gap);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+
+	for (uint32_t i = 0; i < npipes; i++) {
+		calq_remove(cq, &pipes[i].cp_ent);
+	}
+	if (cq->cq_count != 0) {
+		error = EIO;
+	}
+	kfree_type(struct calq_pipe, npipes, pipes);
+	kfree_type(struct calq, cq);
+	if (error == 0) {
+		*out = (int64_t)((uint64_t)npkts * NSEC_PER_SEC / MAX(ns, 1));
+	}
+	return error;
+}
+SYSCTL_TEST_REGISTER(calq_pps, calq_pps_test);
+#endif /* DEVELOPMENT || DEBUG */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_PKTSCHED_PKTSCHED_CALQ_H_
+#define _NET_PKTSCHED_PKTSCHED_CALQ_H_
+
+#ifdef BSD_KERNEL_PRIVATE
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <stdbool.h>
+
+/*
+ * Calendar queue: a priority queue of timed events, for the packet
+ * emulators (netem, dummynet) that hold many packets or pipes until a
+ * deadline.  Events are filed in CALQ_BUCKETS buckets by key, each
+ * bucket 2^shift key units wide and kept sorted; a bucket serves every
+ * key that maps to it modulo the calendar's span.  Inserting and
+ * finding the earliest event are O(1) when the keys are spread over
+ * the span, and removing any event is O(1).
+ *
+ * Entries are embedded in the caller's objects and are zeroed before
+ * first use.  A calendar does no locking of its own; its owner
+ * serializes access.
+ */
+#define CALQ_BUCKETS            1024
+#define CALQ_BUCKET_MASK        (CALQ_BUCKETS - 1)
+#define CALQ_WORDS              (CALQ_BUCKETS / 64)
+
+struct calq_entry {
+	TAILQ_ENTRY(calq_entry) ce_link;
+	uint64_t                ce_key;
+};
+
+TAILQ_HEAD(calq_bucket, calq_entry);
+
+struct calq {
+	uint64_t                cq_cur;         /* earliest bucket number in use */
+	uint32_t                cq_shift;       /* log2 of the bucket width */
+	uint32_t                cq_count;       /* events queued */
+	uint64_t                cq_occupied[CALQ_WORDS];
+	struct calq_bucket      cq_buckets[CALQ_BUCKETS];
+};
+
+__BEGIN_DECLS
+extern void calq_init(struct calq *cq, uint32_t shift);
+extern void calq_insert(struct calq *cq, struct calq_entry *ce, uint64_t key);
+extern void calq_remove(struct calq *cq, struct calq_entry *ce);
+extern struct calq_entry *calq_first(struct calq *cq);
+__END_DECLS
+
+static inline bool
+calq_queued(const struct calq_entry *ce)
+{
+	return ce->ce_link.tqe_prev != NULL;
+}
+
+#endif /* BSD_KERNEL_PRIVATE */
+#endif /* _NET_PKTSCHED_PKTSCHED_CALQ_H_ */
@@ -2076,6 +2076,14 @@ fq_if_getqstats_ifclassq(struct ifclassq *ifq, uint8_t gid, u_int32_t qid,
 	fcls->fcls_ce_marked = fq_cl->fcl_stat.fcl_ce_marked;
 	fcls->fcls_ce_mark_failures = fq_cl->fcl_stat.fcl_ce_mark_failures;
 	fcls->fcls_l4s_pkts = fq_cl->fcl_stat.fcl_l4s_pkts;
+	fcls->fcls_l4s_avg_sojourn = fq_cl->fcl_stat.fcl_l4s_avg_sojourn;
+	fcls->fcls_l4s_max_sojourn = fq_cl->fcl_stat.fcl_l4s_max_sojourn;
+	fcls->fcls_classic_avg_sojourn = fq_cl->fcl_stat.fcl_classic_avg_sojourn;
+	fcls->fcls_classic_max_sojourn = fq_cl->fcl_stat.fcl_classic_max_sojourn;
+	fcls->fcls_pi2_prob = fq_cl->fcl_pi2_prob;
+	fcls->fcls_coupled_ce_marked = fq_cl->fcl_stat.fcl_coupled_ce_marked;
+	fcls->fcls_classic_ce_marked = fq_cl->fcl_stat.fcl_classic_ce_marked;
+	fcls->fcls_classic_pi2_drops = fq_cl->fcl_stat.fcl_classic_pi2_drops;
 
 	/* Gather per flow stats */
 	flowstat_cnt = min((fcls->fcls_newflows_cnt +
@@ -71,6 +71,13 @@ struct fcl_stat {
 	uint64_t fcl_ce_marked;
 	uint64_t fcl_ce_mark_failures;
 	uint64_t fcl_l4s_pkts;
+	uint64_t fcl_l4s_avg_sojourn;
+	uint64_t fcl_l4s_max_sojourn;
+	uint64_t fcl_classic_avg_sojourn;
+	uint64_t fcl_classic_max_sojourn;
+	uint64_t fcl_coupled_ce_marked;
+	uint64_t fcl_classic_ce_marked;
+	uint64_t fcl_classic_pi2_drops;
 };
 
 /*
@@ -143,6 +150,10 @@ typedef struct fq_if_classq {
 	int64_t fcl_budget;             /* budget for this classq */
 	flowq_stailq_t fcl_new_flows;   /* List of new flows */
 	flowq_stailq_t fcl_old_flows;   /* List of old flows */
+	/* PI2 controller for coupled L4S marking */
+	uint32_t fcl_pi2_prob;          /* p', scaled by 2^32 */
+	uint64_t fcl_pi2_prev_qdelay;   /* classic queue delay at last update */
+	uint64_t fcl_pi2_update;        /* time of next update (ns) */
 	struct fcl_stat fcl_stat;
 } fq_if_classq_t;
 typedef struct fq_codel_classq_group {
@@ -316,6 +327,14 @@ struct fq_codel_classstats {
 	uint64_t        fcls_ce_marked;
 	uint64_t        fcls_ce_mark_failures;
 	uint64_t        fcls_l4s_pkts;
+	uint64_t        fcls_l4s_avg_sojourn;
+	uint64_t        fcls_l4s_max_sojourn;
+	uint64_t        fcls_classic_avg_sojourn;
+	uint64_t        fcls_classic_max_sojourn;
+	uint32_t        fcls_pi2_prob;
+	uint64_t        fcls_coupled_ce_marked;
+	uint64_t        fcls_classic_ce_marked;
+	uint64_t        fcls_classic_pi2_drops;
 };
 
 #ifdef BSD_KERNEL_PRIVATE
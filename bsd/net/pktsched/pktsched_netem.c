@@ -33,6 +33,7 @@
 #include <net/if.h>
 #include <net/classq/classq.h>
 #include <net/pktsched/pktsched.h>
+#include <net/pktsched/pktsched_calq.h>
 #include <net/pktsched/pktsched_netem.h>
 
 #define NETEM_STUB \
@@ -683,21 +684,20 @@ norm_dist(uint32_t mean, uint32_t stdvar)
 	return ret;
 }
 
-struct heap_elem {
-	uint64_t key;
-	pktsched_pkt_t pkt;
-};
+/*
+ * Packets wait for their time to send on a calendar queue, in slots
+ * taken from a pool of netem_heap_size set aside when the netem is
+ * created.
+ */
+#define NETEM_CALQ_BUCKET_US    256     /* a bucket of the calendar */
 
-struct heap {
-	size_t limit;  /* max size */
-	size_t size;   /* current size */
-	struct heap_elem p[0];
+struct netem_slot {
+	struct calq_entry               ns_link;
+	SLIST_ENTRY(netem_slot)         ns_free;
+	pktsched_pkt_t                  ns_pkt;
 };
 
-static struct heap *heap_create(size_t size);
-static int heap_insert(struct heap *h, uint64_t k, pktsched_pkt_t *p);
-static int heap_peek(struct heap *h, uint64_t *k, pktsched_pkt_t *p);
-static int heap_extract(struct heap *h, uint64_t *k, pktsched_pkt_t *p);
+SLIST_HEAD(netem_slot_head, netem_slot);
 
 typedef enum {
 	NETEM_MODEL_NULL = IF_NETEM_MODEL_NULL,
@@ -721,7 +721,10 @@ struct netem {
 	uint32_t                netem_output_max_batch_size;
 	uint32_t                netem_output_ival_ms;
 
-	struct heap             *netem_heap;
+	struct calq             *netem_calq;
+	struct netem_slot       *netem_slots;
+	uint32_t                netem_nslots;
+	struct netem_slot_head  netem_free_slots;
 
 	/*********************** Parameters variables *************************/
 	netem_model_t           netem_model;
@@ -799,113 +802,71 @@ struct netem {
 #define NETEM_OUTPUT_IVAL_ONLY(_ne)             \
 	((_ne->netem_flags & NETEMF_OUTPUT_IVAL_ONLY) != 0)
 
-static struct heap *
-heap_create(size_t limit)
+static void
+netem_sched_create(struct netem *ne, uint32_t nslots)
 {
-	struct heap *h = NULL;
-
-	// verify limit
-	h = kalloc_type(struct heap, struct heap_elem, limit, Z_WAITOK | Z_ZERO);
-	if (h == NULL) {
-		return NULL;
+	uint64_t width;
+
+	ne->netem_calq = kalloc_type(struct calq, Z_WAITOK | Z_NOFAIL);
+	nanoseconds_to_absolutetime(NETEM_CALQ_BUCKET_US * NSEC_PER_USEC,
+	    &width);
+	calq_init(ne->netem_calq, (uint32_t)(63 - __builtin_clzll(width)));
+
+	ne->netem_slots = kalloc_type(struct netem_slot, nslots,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	ne->netem_nslots = nslots;
+	SLIST_INIT(&ne->netem_free_slots);
+	for (uint32_t i = nslots; i > 0; i--) {
+		SLIST_INSERT_HEAD(&ne->netem_free_slots,
+		    &ne->netem_slots[i - 1], ns_free);
 	}
-
-	h->limit = limit;
-	h->size = 0;
-
-	return h;
 }
 
 static void
-heap_destroy(struct heap *h)
+netem_sched_destroy(struct netem *ne)
 {
-	ASSERT(h->size == 0);
+	ASSERT(ne->netem_calq->cq_count == 0);
 
-	kfree_type(struct heap, struct heap_elem, h->limit, h);
+	kfree_type(struct netem_slot, ne->netem_nslots, ne->netem_slots);
+	kfree_type(struct calq, ne->netem_calq);
 }
 
-#define HEAP_FATHER(child) (((child) - 1) / 2)
-#define HEAP_SWAP(a, b, tmp) { tmp = a; a = b; b = tmp; }
-#define HEAP_LEFT(x) (2 * (x) + 1)
-
 static int
-heap_insert(struct heap *h, uint64_t key, pktsched_pkt_t *pkt)
+netem_sched_insert(struct netem *ne, uint64_t tts, pktsched_pkt_t *pkt)
 {
-	ASSERT(h != NULL);
+	struct netem_slot *slot = SLIST_FIRST(&ne->netem_free_slots);
 
-	if (h->size == h->limit) {
+	if (slot == NULL) {
 		return ENOBUFS;
 	}
-
-	uint64_t child, parent;
-	if (pkt == NULL) {
-		child = key;
-		ASSERT(child < h->size);
-	} else {
-		child = h->size;
-		h->p[child].key = key;
-		h->p[child].pkt = *pkt;
-		h->size++;
-	}
-
-	while (child > 0) {
-		struct heap_elem tmp;
-		parent = HEAP_FATHER(child);
-		if (h->p[parent].key < h->p[child].key) {
-			break;
-		}
-		HEAP_SWAP(h->p[child], h->p[parent], tmp);
-		child = parent;
-	}
-
-	return 0;
-}
-
-static int
-heap_peek(struct heap *h, uint64_t *key, pktsched_pkt_t *pkt)
-{
-	if (h->size == 0) {
-		return ENOENT;
-	}
-
-	*key = h->p[0].key;
-	*pkt = h->p[0].pkt;
+	SLIST_REMOVE_HEAD(&ne->netem_free_slots, ns_free);
+	slot->ns_pkt = *pkt;
+	calq_insert(ne->netem_calq, &slot->ns_link, tts);
 	return 0;
 }
 
+/*
+ * Take off the packet with the earliest time to send, provided that
+ * time is no later than `until'.  EAGAIN if it is, ENOENT if there is
+ * no packet.
+ */
 static int
-heap_extract(struct heap *h, uint64_t *key, pktsched_pkt_t *pkt)
+netem_sched_extract(struct netem *ne, uint64_t until, pktsched_pkt_t *pkt)
 {
-	uint64_t child, parent, max;
+	struct calq_entry *ce = calq_first(ne->netem_calq);
+	struct netem_slot *slot;
 
-	if (h->size == 0) {
+	if (ce == NULL) {
 		return ENOENT;
 	}
-
-	*key = h->p[0].key;
-	*pkt = h->p[0].pkt;
-
-	/* re-heapify */
-	parent = 0;
-	child = HEAP_LEFT(parent);      /* start from left child */
-	max = h->size - 1;
-	while (child <= max) {
-		if (child != max && h->p[child + 1].key < h->p[child].key) {
-			child = child + 1;        /* right child */
-		}
-		h->p[parent] = h->p[child];
-		parent = child;
-		child = HEAP_LEFT(child);       /* left child for next loop */
-	}
-
-	h->size--;
-	if (parent != max) {
-		/* Fill hole with last entry, bubble up reusing insert code */
-		h->p[parent] = h->p[max];
-		_PKTSCHED_PKT_INIT(&h->p[max].pkt);
-		heap_insert(h, parent, NULL); /* this one cannot fail */
+	if (ce->ce_key > until) {
+		return EAGAIN;
 	}
-
+	calq_remove(ne->netem_calq, ce);
+	slot = __container_of(ce, struct netem_slot, ns_link);
+	*pkt = slot->ns_pkt;
+	_PKTSCHED_PKT_INIT(&slot->ns_pkt);
+	SLIST_INSERT_HEAD(&ne->netem_free_slots, slot, ns_free);
 	return 0;
 }
 
@@ -1119,10 +1080,10 @@ nlc_enqueue(struct netem *ne, classq_pkt_t *p, bool *pdrop)
 
 		abs_time_to_send = latency_event(ne, abs_time_to_send);
 
-		ret = heap_insert(ne->netem_heap, abs_time_to_send, &pkt);
+		ret = netem_sched_insert(ne, abs_time_to_send, &pkt);
 		if (ret != 0) {
 			NETEM_LOG(LOG_WARNING,
-			    "| heap_insert p %p err(%d), freeing pkt",
+			    "| netem_sched_insert p %p err(%d), freeing pkt",
 			    p->cp_mbuf, ret);
 			pktsched_free_pkt(&pkt);
 			goto done;
@@ -1166,35 +1127,22 @@ netem_dequeue_internal_locked(struct netem *ne, pktsched_pkt_t *pp,
     bool *more)
 {
 	int ret = 0;
-	uint64_t time_to_send;
-	pktsched_pkt_t pkt;
+	uint64_t now;
 
 	ASSERT(ne != NULL);
 	NETEM_MTX_LOCK_ASSERT_HELD(ne);
 
 	NETEM_LOG(LOG_DEBUG, "┌ begin");
 
-	ret = heap_peek(ne->netem_heap, &time_to_send, &pkt);
-	if (ret != 0) {
-		NETEM_LOG(LOG_DEBUG, "| heap empty");
-		ret = ENOENT;
-		goto done;
-	}
-
-	if (time_to_send > mach_absolute_time()) {
-		NETEM_LOG(LOG_DEBUG,
-		    "| TTS not yet reached: %llu now %llu",
-		    time_to_send, mach_absolute_time());
+	now = mach_absolute_time();
+	ret = netem_sched_extract(ne, now, pp);
+	if (ret == ENOENT) {
+		NETEM_LOG(LOG_DEBUG, "| queue empty");
+	} else if (ret == EAGAIN) {
+		NETEM_LOG(LOG_DEBUG, "| TTS not yet reached, now %llu", now);
 		*more = true;
-		ret = EAGAIN;
-		goto done;
 	}
 
-	ret = heap_extract(ne->netem_heap, &time_to_send, &pkt);
-	ASSERT(ret == 0);
-	*pp = pkt;
-
-done:
 	NETEM_LOG(LOG_DEBUG, "└ end");
 
 	return ret;
@@ -1306,7 +1254,7 @@ netem_create(const char *name, struct ifnet *ifp, void *output_handle,
 
 	lck_mtx_init(&ne->netem_lock, &netem_lock_group, LCK_ATTR_NULL);
 
-	ne->netem_heap = heap_create(netem_heap_size);
+	netem_sched_create(ne, netem_heap_size);
 	ne->netem_flags = NETEMF_INITIALIZED;
 	ne->netem_output_handle = output_handle;
 	ne->netem_output = output;
@@ -1332,8 +1280,6 @@ netem_destroy(struct netem *ne)
 	uint64_t f = (1 * NSEC_PER_MSEC);       /* 1 ms */
 	uint64_t s = (1000 * NSEC_PER_MSEC);    /* 1 sec */
 	uint32_t i = 0;
-	int ret = 0;
-	uint64_t key = 0;
 	pktsched_pkt_t pkt;
 
 	ASSERT(ne != NULL);
@@ -1370,10 +1316,10 @@ netem_destroy(struct netem *ne)
 
 	lck_mtx_destroy(&ne->netem_lock, &netem_lock_group);
 
-	while ((ret = heap_extract(ne->netem_heap, &key, &pkt)) == 0) {
+	while (netem_sched_extract(ne, UINT64_MAX, &pkt) == 0) {
 		pktsched_free_pkt(&pkt);
 	}
-	heap_destroy(ne->netem_heap);
+	netem_sched_destroy(ne);
 
 
 	kfree_type(struct netem, ne);
@@ -1665,6 +1611,116 @@ done:
 	return ret;
 }
 
+#if (DEVELOPMENT || DEBUG)
+/*
+ * Packets per second through `in' netem instances, as many interfaces
+ * each with netem on, from netem_enqueue() through the calendar and the
+ * output thread to the output function.  There is no rate limit or
+ * latency; packets go to the instances round robin, with no more than
+ * half of one slot pool in flight so that none is dropped.  Every
+ * instance has an output thread, hence the smaller limit than the
+ * dummynet_pps test.
+ */
+#define NETEM_TEST_INSTANCES_MAX        1000
+#define NETEM_TEST_PACKETS              (1 << 20)
+
+static uint32_t netem_test_done;
+
+static int
+netem_test_output(__unused void *handle, pktsched_pkt_t *pkts,
+    uint32_t n_pkts)
+{
+	for (uint32_t i = 0; i < n_pkts; i++) {
+		pktsched_free_pkt(&pkts[i]);
+	}
+	os_atomic_add(&netem_test_done, n_pkts, relaxed);
+	return 0;
+}
+
+static int
+netem_pps_test(int64_t in, int64_t *out)
+{
+	static uint32_t busy;
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * NSEC_PER_USEC };
+	struct if_netem_params params;
+	struct netem **nes;
+	uint32_t nnes = (uint32_t)in, window, sent, dropped = 0;
+	uint64_t start, deadline, ns;
+	int error = 0;
+
+	if (in <= 0 || in > NETEM_TEST_INSTANCES_MAX) {
+		return EINVAL;
+	}
+	if (!os_atomic_cmpxchg(&busy, 0, 1, acquire)) {
+		return EBUSY;
+	}
+	bzero(&params, sizeof(params));
+	params.ifnetem_model = IF_NETEM_MODEL_NLC;
+	params.ifnetem_bandwidth_bps = UINT64_MAX;
+	nes = kalloc_type(struct netem *, nnes, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	for (uint32_t i = 0; i < nnes && error == 0; i++) {
+		char name[MAXTHREADNAMESIZE];
+
+		snprintf(name, sizeof(name), "netem_pps_%u", i);
+		error = netem_config(&nes[i], name, lo_ifp, &params, NULL,
+		    netem_test_output, NETEM_MAX_BATCH_SIZE);
+		if (error == 0 && nes[i] == NULL) {
+			error = ENXIO;  /* no traffic shaping on lo0 */
+		}
+	}
+	if (error != 0) {
+		goto done;
+	}
+	window = MAX(netem_heap_size / 2, 1);
+
+	os_atomic_store(&netem_test_done, 0, relaxed);
+	start = mach_absolute_time();
+	for (sent = 0; sent < NETEM_TEST_PACKETS; sent++) {
+		struct mbuf *m;
+		classq_pkt_t pkt;
+		bool drop = false;
+
+		while (sent - os_atomic_load(&netem_test_done, relaxed) >=
+		    window) {
+			(void)msleep(&netem_test_done, NULL, PSOCK, "netem_pps",
+			    &ts);
+		}
+		m = m_gethdr(M_WAITOK, MT_DATA);
+		m->m_len = m->m_pkthdr.len = 64;
+		CLASSQ_PKT_INIT_MBUF(&pkt, m);
+		if (netem_enqueue(nes[sent % nnes], &pkt, &drop) != 0 || drop) {
+			/* dropped, and freed */
+			os_atomic_inc(&netem_test_done, relaxed);
+			dropped++;
+		}
+	}
+	clock_interval_to_deadline(10, NSEC_PER_SEC, &deadline);
+	while (os_atomic_load(&netem_test_done, relaxed) < NETEM_TEST_PACKETS) {
+		if (mach_absolute_time() > deadline) {
+			error = ETIMEDOUT;
+			break;
+		}
+		(void)msleep(&netem_test_done, NULL, PSOCK, "netem_pps", &ts);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	if (error == 0) {
+		*out = (int64_t)((uint64_t)(NETEM_TEST_PACKETS - dropped) *
+		    NSEC_PER_SEC / MAX(ns, 1));
+	}
+done:
+	/* anything left over is freed with the instances */
+	for (uint32_t i = 0; i < nnes; i++) {
+		if (nes[i] != NULL) {
+			netem_destroy(nes[i]);
+		}
+	}
+	kfree_type(struct netem *, nnes, nes);
+	os_atomic_store(&busy, 0, release);
+	return error;
+}
+SYSCTL_TEST_REGISTER(netem_pps, netem_pps_test);
+#endif /* DEVELOPMENT || DEBUG */
+
 #else /* !CONFIG_NETEM */
 NETEM_STUB
 #endif /* !CONFIG_NETEM */
@@ -0,0 +1,1001 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Poptrie (H. Asai, Y. Ohara, SIGCOMM 2015) over the AF_INET and
+ * AF_INET6 radix trees, answering non-scoped longest-prefix matches
+ * without walking the tree bit by bit.
+ *
+ * Addresses are handled as 128-bit numbers, IPv4 ones in the top 32
+ * bits.  A slot of the direct-pointing array holds either the leaf for
+ * its whole /16, or a node tagged with RN_FIB_NODE.  A node at bit
+ * `pos' has a child for each value of bits pos to pos + RN_FIB_STRIDE;
+ * bit c of rfn_vector is set when child c is a node, which is then
+ * rfn_nodes[popcount(rfn_vector & bits 0..c) - 1].  The other children
+ * are leaves, stored once per run: bit c of rfn_leafvec is set when
+ * leaf child c differs from the previous leaf child, and the leaf of
+ * child c is rfn_leaves[popcount(rfn_leafvec & bits 0..c) - 1].
+ *
+ * Parts of the FIB are rebuilt from the tree: the routes within the
+ * range of a slot or node are collected with the tree's walker and
+ * sorted, the route covering the whole range is looked up, and the
+ * nodes are built top-down.  After a route longer than /16 is added or
+ * deleted, only the deepest node above it is rebuilt, as in poptrie;
+ * shorter routes swap the leaves they cover (see rn_fib_replace()), so
+ * that even the default route does not cause a full rebuild.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <kern/zalloc.h>
+#include <libkern/OSByteOrder.h>
+
+#include <netinet/in.h>
+
+#include <net/radix_fib.h>
+
+extern void qsort(void *a, size_t n, size_t es,
+    int (*cmp)(const void *, const void *));
+
+/* nodes needed below the slots for the longest IPv6 prefix */
+#define RN_FIB_LEVELS \
+	((128 - RN_FIB_SLOT_BITS + RN_FIB_STRIDE - 1) / RN_FIB_STRIDE)
+
+struct rn_fib_node {
+	uint64_t                rfn_vector;     /* children that are nodes */
+	uint64_t                rfn_leafvec;    /* children starting a run of leaves */
+	struct rn_fib_node      *rfn_nodes;     /* one per bit of rfn_vector */
+	struct radix_node       **rfn_leaves;   /* one per bit of rfn_leafvec */
+};
+
+/* A slot holds a leaf, or a node tagged with RN_FIB_NODE */
+#define RN_FIB_NODE             ((uintptr_t)1)
+
+struct rn_fib {
+	struct radix_node_head  *rf_rnh;
+	rn_matchf_t             *rf_transient;
+	uintptr_t               *rf_slots;      /* RN_FIB_SLOTS entries */
+	uint8_t                 *rf_transients; /* transient hosts by address hash */
+	uint8_t                 rf_af;
+	uint8_t                 rf_off;         /* offset of the address in keys */
+	uint8_t                 rf_alen;        /* length of the address */
+	uint8_t                 rf_keylen;      /* length of the keys */
+	uint32_t                rf_noncontig;   /* routes with non-contiguous masks */
+	size_t                  rf_size;        /* bytes of nodes and leaves */
+};
+
+/* A route as a prefix of the 128-bit address */
+struct rn_fib_prefix {
+	uint64_t                rfp_hi;
+	uint64_t                rfp_lo;
+	struct radix_node       *rfp_rn;
+	u_int                   rfp_plen;
+};
+
+/* Scratch space of one level of a slot rebuild */
+struct rn_fib_level {
+	struct radix_node       *rfl_leaf[64];  /* leaf of each child */
+	struct radix_node       *rfl_runs[64];  /* leaf of each run */
+	u_int                   rfl_first[64];  /* routes below each child */
+	u_int                   rfl_last[64];
+	uint8_t                 rfl_plen[64];   /* length of rfl_leaf[] */
+};
+
+struct rn_fib_walk {
+	struct rn_fib           *rfw_fib;
+	uint64_t                rfw_hi;         /* range being rebuilt */
+	uint64_t                rfw_lo;
+	uint64_t                rfw_mask_hi;
+	uint64_t                rfw_mask_lo;
+	u_int                   rfw_plen;
+	struct rn_fib_prefix    *rfw_prefixes;  /* NULL while counting */
+	u_int                   rfw_count;
+	u_int                   rfw_max;
+};
+
+enum {
+	RN_FIB_SKIP,            /* never matches a non-scoped destination */
+	RN_FIB_NONCONTIG,       /* non-contiguous netmask */
+	RN_FIB_TRANSIENT,       /* transient host route, left to the tree */
+	RN_FIB_PREFIX,
+};
+
+/*
+ * Transient host routes are counted in RN_FIB_TRANSIENTS buckets by a
+ * hash of their address, so that only lookups of addresses that share
+ * a bucket with one look for them in the tree.  A count sticks at
+ * UINT8_MAX once there, and its bucket then always defers to the tree.
+ */
+#define RN_FIB_TRANSIENT_BITS   18
+#define RN_FIB_TRANSIENTS       (1 << RN_FIB_TRANSIENT_BITS)
+#define RN_FIB_TRANSIENTS_MAX   UINT8_MAX
+
+static inline void
+rn_fib_load(const struct rn_fib *fib, const u_char *addr, uint64_t *hi,
+    uint64_t *lo)
+{
+	if (fib->rf_alen == sizeof(struct in_addr)) {
+		uint32_t a;
+
+		memcpy(&a, addr, sizeof(a));
+		*hi = (uint64_t)ntohl(a) << 32;
+		*lo = 0;
+	} else {
+		uint64_t a[2];
+
+		memcpy(a, addr, sizeof(a));
+		*hi = OSSwapBigToHostInt64(a[0]);
+		*lo = OSSwapBigToHostInt64(a[1]);
+	}
+}
+
+/* `len' bits of the address from bit `pos', counting from the top */
+static inline u_int
+rn_fib_bits(uint64_t hi, uint64_t lo, u_int pos, u_int len)
+{
+	uint64_t v;
+
+	if (pos >= 64) {
+		v = lo << (pos - 64);
+	} else if (pos == 0) {
+		v = hi;
+	} else {
+		v = (hi << pos) | (lo >> (64 - pos));
+	}
+	return (u_int)(v >> (64 - len));
+}
+
+static inline void
+rn_fib_mask(u_int plen, uint64_t *hi, uint64_t *lo)
+{
+	*hi = (plen == 0) ? 0 : ~0ULL << (64 - MIN(plen, 64));
+	*lo = (plen <= 64) ? 0 : ~0ULL << (128 - plen);
+}
+
+/*
+ * Reads the route of leaf `rn' as a prefix.  The destinations looked up
+ * have zeroes past the address, where scoped routes keep their scope
+ * under their mask, so those never match and are skipped.
+ */
+static int
+rn_fib_prefix(const struct rn_fib *fib, struct radix_node *rn,
+    struct rn_fib_prefix *p)
+{
+	const u_char *key = (const u_char *)rn->rn_key;
+	const u_char *mask = (const u_char *)rn->rn_mask;
+	u_char addr[sizeof(struct in6_addr)];
+	u_int klen, mlen, i, plen = 0;
+	bool scoped = false, noncontig = false, tail = false;
+
+	if (rn->rn_flags & RNF_ROOT) {
+		return RN_FIB_SKIP;
+	}
+	klen = key[0];
+	mlen = (mask != NULL) ? mask[0] : klen;
+	for (i = fib->rf_off; i < fib->rf_keylen; i++) {
+		u_char m = 0, inv;
+
+		if (i < klen && i < mlen) {
+			m = (mask != NULL) ? mask[i] : 0xff;
+		}
+		if (i >= fib->rf_off + fib->rf_alen) {
+			scoped |= (key[i] & m) != 0;
+			continue;
+		}
+		addr[i - fib->rf_off] = key[i] & m;
+		inv = (u_char)~m;
+		if ((tail && m != 0) || (inv & (inv + 1)) != 0) {
+			noncontig = true;
+		}
+		plen += __builtin_popcount(m);
+		tail |= (m != 0xff);
+	}
+	if (scoped) {
+		return RN_FIB_SKIP;
+	}
+	if (noncontig) {
+		return RN_FIB_NONCONTIG;
+	}
+	rn_fib_load(fib, addr, &p->rfp_hi, &p->rfp_lo);
+	p->rfp_rn = rn;
+	p->rfp_plen = plen;
+	if (plen == fib->rf_alen * 8 && fib->rf_transient != NULL &&
+	    fib->rf_transient(rn, NULL)) {
+		return RN_FIB_TRANSIENT;
+	}
+	return RN_FIB_PREFIX;
+}
+
+/* Fills `sa' with the address `hi':`lo' in the form of the tree's keys */
+static void
+rn_fib_key(const struct rn_fib *fib, u_char *sa, uint64_t hi, uint64_t lo)
+{
+	uint64_t a[2] = { OSSwapHostToBigInt64(hi), OSSwapHostToBigInt64(lo) };
+
+	bzero(sa, fib->rf_keylen);
+	sa[0] = fib->rf_keylen;
+	sa[1] = fib->rf_af;
+	memcpy(sa + fib->rf_off, a, fib->rf_alen);
+}
+
+/*
+ * Sets up `w' for the routes within the prefix `hi':`lo'/`plen', and
+ * the key and mask to walk the tree below it.
+ */
+static void
+rn_fib_walk_init(struct rn_fib *fib, struct rn_fib_walk *w, uint64_t hi,
+    uint64_t lo, u_int plen, u_char *key, u_char *mask)
+{
+	bzero(w, sizeof(*w));
+	w->rfw_fib = fib;
+	w->rfw_plen = plen;
+	rn_fib_mask(plen, &w->rfw_mask_hi, &w->rfw_mask_lo);
+	w->rfw_hi = hi & w->rfw_mask_hi;
+	w->rfw_lo = lo & w->rfw_mask_lo;
+	rn_fib_key(fib, key, w->rfw_hi, w->rfw_lo);
+	rn_fib_key(fib, mask, w->rfw_mask_hi, w->rfw_mask_lo);
+}
+
+static int
+rn_fib_collect(struct radix_node *rn, void *arg)
+{
+	struct rn_fib_walk *w = arg;
+	struct rn_fib_prefix p;
+
+	if (rn_fib_prefix(w->rfw_fib, rn, &p) != RN_FIB_PREFIX ||
+	    p.rfp_plen <= w->rfw_plen ||
+	    ((p.rfp_hi ^ w->rfw_hi) & w->rfw_mask_hi) != 0 ||
+	    ((p.rfp_lo ^ w->rfw_lo) & w->rfw_mask_lo) != 0) {
+		return 0;
+	}
+	if (w->rfw_prefixes != NULL) {
+		if (w->rfw_count == w->rfw_max) {
+			return EINVAL;
+		}
+		w->rfw_prefixes[w->rfw_count] = p;
+	}
+	w->rfw_count++;
+	return 0;
+}
+
+/* rn_matchf_t for the routes no longer than the range being rebuilt */
+static int
+rn_fib_covers(struct radix_node *rn, void *arg)
+{
+	struct rn_fib_walk *w = arg;
+	struct rn_fib_prefix p;
+
+	return rn_fib_prefix(w->rfw_fib, rn, &p) == RN_FIB_PREFIX &&
+	       p.rfp_plen <= w->rfw_plen;
+}
+
+/* Returns the route of the tree for the prefix `hi':`lo'/`plen', if any */
+static struct radix_node *
+rn_fib_find(struct rn_fib *fib, uint64_t hi, uint64_t lo, u_int plen)
+{
+	struct radix_node *t;
+	struct rn_fib_prefix p;
+	u_char key[sizeof(struct sockaddr_in6)];
+	uint64_t mask_hi, mask_lo;
+
+	rn_fib_mask(plen, &mask_hi, &mask_lo);
+	hi &= mask_hi;
+	lo &= mask_lo;
+	rn_fib_key(fib, key, hi, lo);
+	for (t = fib->rf_rnh->rnh_treetop; t->rn_bit >= 0;) {
+		t = (t->rn_bmask & key[t->rn_offset]) ? t->rn_right : t->rn_left;
+	}
+	for (; t != NULL; t = t->rn_dupedkey) {
+		if (rn_fib_prefix(fib, t, &p) == RN_FIB_PREFIX &&
+		    p.rfp_plen == plen && p.rfp_hi == hi && p.rfp_lo == lo) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the longest route of `plen' bits or less covering the address
+ * `hi':`lo'.  rn_match_args() gives up when the filter turns down the
+ * first route of a leaf right below the top of the tree, as with the
+ * routes to 0/1 and 0/0, so when it finds nothing every length is
+ * looked up in turn.
+ */
+static struct radix_node *
+rn_fib_cover(struct rn_fib *fib, uint64_t hi, uint64_t lo, u_int plen)
+{
+	struct rn_fib_walk w = { .rfw_fib = fib, .rfw_plen = plen };
+	struct radix_node *rn;
+	u_char key[sizeof(struct sockaddr_in6)];
+
+	rn_fib_key(fib, key, hi, lo);
+	rn = rn_match_args(key, fib->rf_rnh, rn_fib_covers, &w);
+	for (u_int len = plen + 1; rn == NULL && len-- > 0;) {
+		rn = rn_fib_find(fib, hi, lo, len);
+	}
+	return rn;
+}
+
+static inline u_int
+rn_fib_transient_hash(uint64_t hi, uint64_t lo)
+{
+	return (u_int)(((hi ^ (lo * 0xff51afd7ed558ccdULL)) *
+	       0x9e3779b97f4a7c15ULL) >> (64 - RN_FIB_TRANSIENT_BITS));
+}
+
+/* Accounts for the transient host route `p' in the count of its bucket */
+static void
+rn_fib_transient_count(struct rn_fib *fib, const struct rn_fib_prefix *p,
+    bool add)
+{
+	uint8_t *count = &fib->rf_transients[
+		rn_fib_transient_hash(p->rfp_hi, p->rfp_lo)];
+
+	if (*count == RN_FIB_TRANSIENTS_MAX) {
+		return;
+	}
+	if (add) {
+		(*count)++;
+	} else {
+		VERIFY(*count > 0);
+		(*count)--;
+	}
+}
+
+static int
+rn_fib_count(struct radix_node *rn, void *arg)
+{
+	struct rn_fib *fib = arg;
+	struct rn_fib_prefix p;
+
+	switch (rn_fib_prefix(fib, rn, &p)) {
+	case RN_FIB_NONCONTIG:
+		fib->rf_noncontig++;
+		break;
+	case RN_FIB_TRANSIENT:
+		rn_fib_transient_count(fib, &p, true);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* Levels of scratch space to build a node at bit `pos' */
+static inline u_int
+rn_fib_levels(const struct rn_fib *fib, u_int pos)
+{
+	return (fib->rf_alen * 8 - pos + RN_FIB_STRIDE - 1) / RN_FIB_STRIDE;
+}
+
+static int
+rn_fib_prefix_cmp(const void *a, const void *b)
+{
+	const struct rn_fib_prefix *pa = a, *pb = b;
+
+	if (pa->rfp_hi != pb->rfp_hi) {
+		return pa->rfp_hi < pb->rfp_hi ? -1 : 1;
+	}
+	if (pa->rfp_lo != pb->rfp_lo) {
+		return pa->rfp_lo < pb->rfp_lo ? -1 : 1;
+	}
+	return (int)pa->rfp_plen - (int)pb->rfp_plen;
+}
+
+static void
+rn_fib_node_free(struct rn_fib *fib, struct rn_fib_node *node)
+{
+	u_int nnodes = __builtin_popcountll(node->rfn_vector);
+	u_int nleaves = __builtin_popcountll(node->rfn_leafvec);
+
+	for (u_int i = 0; i < nnodes; i++) {
+		rn_fib_node_free(fib, &node->rfn_nodes[i]);
+	}
+	if (nnodes != 0) {
+		kfree_type(struct rn_fib_node, nnodes, node->rfn_nodes);
+		fib->rf_size -= nnodes * sizeof(struct rn_fib_node);
+	}
+	if (nleaves != 0) {
+		kfree_type(struct radix_node *, nleaves, node->rfn_leaves);
+		fib->rf_size -= nleaves * sizeof(struct radix_node *);
+	}
+	node->rfn_vector = node->rfn_leafvec = 0;
+}
+
+static void
+rn_fib_slot_free(struct rn_fib *fib, uintptr_t slot)
+{
+	struct rn_fib_node *node;
+
+	if (slot & RN_FIB_NODE) {
+		node = (struct rn_fib_node *)(slot & ~RN_FIB_NODE);
+		rn_fib_node_free(fib, node);
+		kfree_type(struct rn_fib_node, node);
+		fib->rf_size -= sizeof(*node);
+	}
+}
+
+/*
+ * Builds `node', at bit `pos', from the `n' sorted routes in `p' that
+ * share its first `pos' bits; those no longer than `pos' are ignored,
+ * having been accounted for in `def', the route covering the node.
+ */
+static int
+rn_fib_build(struct rn_fib *fib, struct rn_fib_node *node,
+    struct rn_fib_level *lv, const struct rn_fib_prefix *p, u_int n,
+    u_int pos, struct radix_node *def)
+{
+	struct radix_node *prev = NULL;
+	uint64_t vector = 0, leafvec = 0;
+	u_int nnodes, nleaves = 0, c, i, k;
+	int error;
+
+	for (c = 0; c < 64; c++) {
+		lv->rfl_leaf[c] = def;
+		lv->rfl_plen[c] = 0;
+	}
+	for (i = 0; i < n; i++) {
+		u_int plen = p[i].rfp_plen, span;
+
+		if (plen <= pos) {
+			continue;
+		}
+		c = rn_fib_bits(p[i].rfp_hi, p[i].rfp_lo, pos, RN_FIB_STRIDE);
+		if (plen > pos + RN_FIB_STRIDE) {
+			if (!(vector & (1ULL << c))) {
+				vector |= 1ULL << c;
+				lv->rfl_first[c] = i;
+			}
+			lv->rfl_last[c] = i;
+			continue;
+		}
+		span = 1U << (pos + RN_FIB_STRIDE - plen);
+		for (k = c; k < c + span; k++) {
+			if (plen > lv->rfl_plen[k]) {
+				lv->rfl_plen[k] = (uint8_t)plen;
+				lv->rfl_leaf[k] = p[i].rfp_rn;
+			}
+		}
+	}
+	for (c = 0; c < 64; c++) {
+		if (vector & (1ULL << c)) {
+			continue;
+		}
+		if (nleaves == 0 || lv->rfl_leaf[c] != prev) {
+			leafvec |= 1ULL << c;
+			prev = lv->rfl_runs[nleaves++] = lv->rfl_leaf[c];
+		}
+	}
+
+	nnodes = __builtin_popcountll(vector);
+	if (nnodes != 0) {
+		node->rfn_nodes = kalloc_type(struct rn_fib_node, nnodes,
+		    Z_WAITOK | Z_ZERO);
+		if (node->rfn_nodes == NULL) {
+			return ENOMEM;
+		}
+		node->rfn_vector = vector;
+		fib->rf_size += nnodes * sizeof(struct rn_fib_node);
+	}
+	if (nleaves != 0) {
+		node->rfn_leaves = kalloc_type(struct radix_node *, nleaves,
+		    Z_WAITOK);
+		if (node->rfn_leaves == NULL) {
+			return ENOMEM;
+		}
+		memcpy(node->rfn_leaves, lv->rfl_runs,
+		    nleaves * sizeof(lv->rfl_runs[0]));
+		node->rfn_leafvec = leafvec;
+		fib->rf_size += nleaves * sizeof(struct radix_node *);
+	}
+
+	for (k = 0; vector != 0; k++) {
+		u_int first;
+
+		c = __builtin_ctzll(vector);
+		vector &= vector - 1;
+		first = lv->rfl_first[c];
+		error = rn_fib_build(fib, &node->rfn_nodes[k], lv + 1, p + first,
+		    lv->rfl_last[c] - first + 1, pos + RN_FIB_STRIDE,
+		    lv->rfl_leaf[c]);
+		if (error != 0) {
+			return error;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collects the routes of the tree within the range of `w', sorted by
+ * address, into w->rfw_prefixes.
+ */
+static int
+rn_fib_walk_collect(struct rn_fib_walk *w, u_char *key, u_char *mask)
+{
+	struct radix_node_head *rnh = w->rfw_fib->rf_rnh;
+	int error;
+
+	error = rnh->rnh_walktree_from(rnh, key, mask, rn_fib_collect, w);
+	if (error != 0 || w->rfw_count == 0) {
+		return error;
+	}
+	w->rfw_prefixes = kalloc_type(struct rn_fib_prefix, w->rfw_count,
+	    Z_WAITOK);
+	if (w->rfw_prefixes == NULL) {
+		return ENOMEM;
+	}
+	w->rfw_max = w->rfw_count;
+	w->rfw_count = 0;
+	error = rnh->rnh_walktree_from(rnh, key, mask, rn_fib_collect, w);
+	qsort(w->rfw_prefixes, w->rfw_count, sizeof(struct rn_fib_prefix),
+	    rn_fib_prefix_cmp);
+	return error;
+}
+
+static void
+rn_fib_walk_done(struct rn_fib_walk *w)
+{
+	if (w->rfw_prefixes != NULL) {
+		kfree_type(struct rn_fib_prefix, w->rfw_max, w->rfw_prefixes);
+	}
+}
+
+/*
+ * Rebuilds the slots covered by the prefix `hi'/`plen' from the tree.
+ * On failure the slots not yet rebuilt are left as they were, and the
+ * FIB must be destroyed.
+ */
+static int
+rn_fib_rebuild_slots(struct rn_fib *fib, uint64_t hi, u_int plen)
+{
+	struct rn_fib_walk w;
+	struct rn_fib_level *levels = NULL;
+	struct radix_node **leaf = NULL, *def;
+	uint8_t *leaf_plen = NULL;
+	u_char key[sizeof(struct sockaddr_in6)], mask[sizeof(struct sockaddr_in6)];
+	u_int first_slot, nslots, nlevels = 0, s, i, j;
+	int error;
+
+	plen = MIN(plen, RN_FIB_SLOT_BITS);
+	rn_fib_walk_init(fib, &w, hi, 0, plen, key, mask);
+	first_slot = (u_int)(w.rfw_hi >> (64 - RN_FIB_SLOT_BITS));
+	nslots = 1U << (RN_FIB_SLOT_BITS - plen);
+	if ((error = rn_fib_walk_collect(&w, key, mask)) != 0) {
+		goto done;
+	}
+
+	/* paint the leaf of each slot, starting from the covering route */
+	def = rn_fib_cover(fib, w.rfw_hi, 0, plen);
+	leaf = kalloc_type(struct radix_node *, nslots, Z_WAITOK);
+	leaf_plen = kalloc_data(nslots, Z_WAITOK | Z_ZERO);
+	nlevels = rn_fib_levels(fib, RN_FIB_SLOT_BITS);
+	levels = kalloc_type(struct rn_fib_level, nlevels, Z_WAITOK);
+	if (leaf == NULL || leaf_plen == NULL || levels == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	for (s = 0; s < nslots; s++) {
+		leaf[s] = def;
+	}
+	for (i = 0; i < w.rfw_count; i++) {
+		const struct rn_fib_prefix *p = &w.rfw_prefixes[i];
+		u_int span;
+
+		if (p->rfp_plen > RN_FIB_SLOT_BITS) {
+			continue;
+		}
+		s = (u_int)(p->rfp_hi >> (64 - RN_FIB_SLOT_BITS)) - first_slot;
+		span = 1U << (RN_FIB_SLOT_BITS - p->rfp_plen);
+		for (j = s; j < s + span; j++) {
+			if (p->rfp_plen > leaf_plen[j]) {
+				leaf_plen[j] = (uint8_t)p->rfp_plen;
+				leaf[j] = p->rfp_rn;
+			}
+		}
+	}
+
+	/* then rebuild each slot from the routes longer than it */
+	for (s = 0, i = 0; s < nslots; s++, i = j) {
+		struct rn_fib_node *node = NULL;
+		uintptr_t old;
+		bool deeper = false;
+
+		for (j = i; j < w.rfw_count &&
+		    (w.rfw_prefixes[j].rfp_hi >> (64 - RN_FIB_SLOT_BITS)) ==
+		    first_slot + s; j++) {
+			deeper |= w.rfw_prefixes[j].rfp_plen > RN_FIB_SLOT_BITS;
+		}
+		if (deeper) {
+			node = kalloc_type(struct rn_fib_node, Z_WAITOK | Z_ZERO);
+			if (node == NULL) {
+				error = ENOMEM;
+				goto done;
+			}
+			fib->rf_size += sizeof(*node);
+			error = rn_fib_build(fib, node, levels, &w.rfw_prefixes[i],
+			    j - i, RN_FIB_SLOT_BITS, leaf[s]);
+			if (error != 0) {
+				rn_fib_slot_free(fib, (uintptr_t)node | RN_FIB_NODE);
+				goto done;
+			}
+		}
+		old = fib->rf_slots[first_slot + s];
+		fib->rf_slots[first_slot + s] = (node != NULL) ?
+		    ((uintptr_t)node | RN_FIB_NODE) : (uintptr_t)leaf[s];
+		rn_fib_slot_free(fib, old);
+	}
+
+done:
+	if (levels != NULL) {
+		kfree_type(struct rn_fib_level, nlevels, levels);
+	}
+	if (leaf_plen != NULL) {
+		kfree_data(leaf_plen, nslots);
+	}
+	if (leaf != NULL) {
+		kfree_type(struct radix_node *, nslots, leaf);
+	}
+	rn_fib_walk_done(&w);
+	return error;
+}
+
+/*
+ * Rebuilds `node', at bit `pos' on the path of `p', from the tree.
+ * Returns ENOENT, leaving the node as it was, when no route is longer
+ * than `pos' within the node any more, so that its parent must turn it
+ * into a leaf.
+ */
+static int
+rn_fib_rebuild_node(struct rn_fib *fib, struct rn_fib_node *node,
+    const struct rn_fib_prefix *p, u_int pos)
+{
+	struct rn_fib_walk w;
+	struct rn_fib_node new = { 0 };
+	struct rn_fib_level *levels = NULL;
+	struct radix_node *def;
+	u_char key[sizeof(struct sockaddr_in6)], mask[sizeof(struct sockaddr_in6)];
+	u_int nlevels = 0;
+	int error;
+
+	rn_fib_walk_init(fib, &w, p->rfp_hi, p->rfp_lo, pos, key, mask);
+	if ((error = rn_fib_walk_collect(&w, key, mask)) != 0) {
+		goto done;
+	}
+	if (w.rfw_count == 0) {
+		error = ENOENT;
+		goto done;
+	}
+	def = rn_fib_cover(fib, w.rfw_hi, w.rfw_lo, pos);
+	nlevels = rn_fib_levels(fib, pos);
+	levels = kalloc_type(struct rn_fib_level, nlevels, Z_WAITOK);
+	if (levels == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	error = rn_fib_build(fib, &new, levels, w.rfw_prefixes, w.rfw_count,
+	    pos, def);
+	if (error != 0) {
+		rn_fib_node_free(fib, &new);
+		goto done;
+	}
+	rn_fib_node_free(fib, node);
+	*node = new;
+
+done:
+	if (levels != NULL) {
+		kfree_type(struct rn_fib_level, nlevels, levels);
+	}
+	rn_fib_walk_done(&w);
+	return error;
+}
+
+static void
+rn_fib_node_replace(struct rn_fib_node *node, struct radix_node *from,
+    struct radix_node *to)
+{
+	u_int nnodes = __builtin_popcountll(node->rfn_vector);
+	u_int nleaves = __builtin_popcountll(node->rfn_leafvec);
+
+	for (u_int i = 0; i < nleaves; i++) {
+		if (node->rfn_leaves[i] == from) {
+			node->rfn_leaves[i] = to;
+		}
+	}
+	for (u_int i = 0; i < nnodes; i++) {
+		rn_fib_node_replace(&node->rfn_nodes[i], from, to);
+	}
+}
+
+/*
+ * Routes of /16 or shorter never make nodes.  Within the range of such
+ * a route `p', the leaves it takes over when added are exactly those of
+ * the route covering it, and those it leaves when deleted go back to
+ * that route, so the leaves are swapped without rebuilding anything.
+ * Runs of equal leaves may end up split, which lookups do not mind.
+ */
+static void
+rn_fib_replace(struct rn_fib *fib, const struct rn_fib_prefix *p, bool add)
+{
+	struct radix_node *cover = NULL, *from, *to;
+	u_int first_slot, nslots;
+
+	if (p->rfp_plen > 0) {
+		cover = rn_fib_cover(fib, p->rfp_hi, p->rfp_lo, p->rfp_plen - 1);
+	}
+	from = add ? cover : p->rfp_rn;
+	to = add ? p->rfp_rn : cover;
+
+	first_slot = (u_int)(p->rfp_hi >> (64 - RN_FIB_SLOT_BITS));
+	nslots = 1U << (RN_FIB_SLOT_BITS - p->rfp_plen);
+	for (u_int s = first_slot; s < first_slot + nslots; s++) {
+		uintptr_t slot = fib->rf_slots[s];
+
+		if (slot & RN_FIB_NODE) {
+			rn_fib_node_replace((struct rn_fib_node *)
+			    (slot & ~RN_FIB_NODE), from, to);
+		} else if ((struct radix_node *)slot == from) {
+			fib->rf_slots[s] = (uintptr_t)to;
+		}
+	}
+}
+
+/*
+ * Brings the FIB up to date after the route `p' was added or deleted,
+ * rebuilding the deepest node above it, which holds its leaves or the
+ * node below which it lies.
+ */
+static int
+rn_fib_update(struct rn_fib *fib, const struct rn_fib_prefix *p, bool add)
+{
+	struct rn_fib_node *path[RN_FIB_LEVELS], *node;
+	uintptr_t slot;
+	u_int depth = 0, pos, c;
+	int error;
+
+	if (p->rfp_plen <= RN_FIB_SLOT_BITS) {
+		rn_fib_replace(fib, p, add);
+		return 0;
+	}
+	slot = fib->rf_slots[p->rfp_hi >> (64 - RN_FIB_SLOT_BITS)];
+	if (!(slot & RN_FIB_NODE)) {
+		return rn_fib_rebuild_slots(fib, p->rfp_hi, RN_FIB_SLOT_BITS);
+	}
+	path[0] = (struct rn_fib_node *)(slot & ~RN_FIB_NODE);
+	for (pos = RN_FIB_SLOT_BITS; pos + RN_FIB_STRIDE < p->rfp_plen;
+	    pos += RN_FIB_STRIDE) {
+		node = path[depth];
+		c = rn_fib_bits(p->rfp_hi, p->rfp_lo, pos, RN_FIB_STRIDE);
+		if (!(node->rfn_vector & (1ULL << c))) {
+			break;
+		}
+		path[++depth] = &node->rfn_nodes[
+			__builtin_popcountll(node->rfn_vector << (63 - c)) - 1];
+	}
+	for (;;) {
+		error = rn_fib_rebuild_node(fib, path[depth], p, pos);
+		if (error != ENOENT) {
+			return error;
+		}
+		if (depth-- == 0) {
+			return rn_fib_rebuild_slots(fib, p->rfp_hi,
+			           RN_FIB_SLOT_BITS);
+		}
+		pos -= RN_FIB_STRIDE;
+	}
+}
+
+struct rn_fib *
+rn_fib_create(struct radix_node_head *rnh, int af, rn_matchf_t *transient)
+{
+	struct rn_fib *fib;
+
+	fib = kalloc_type(struct rn_fib, Z_WAITOK | Z_ZERO);
+	if (fib == NULL) {
+		return NULL;
+	}
+	fib->rf_rnh = rnh;
+	fib->rf_transient = transient;
+	fib->rf_af = (uint8_t)af;
+	switch (af) {
+	case AF_INET:
+		fib->rf_off = offsetof(struct sockaddr_in, sin_addr);
+		fib->rf_alen = sizeof(struct in_addr);
+		fib->rf_keylen = sizeof(struct sockaddr_in);
+		break;
+	case AF_INET6:
+		fib->rf_off = offsetof(struct sockaddr_in6, sin6_addr);
+		fib->rf_alen = sizeof(struct in6_addr);
+		fib->rf_keylen = sizeof(struct sockaddr_in6);
+		break;
+	default:
+		kfree_type(struct rn_fib, fib);
+		return NULL;
+	}
+	fib->rf_slots = kalloc_type(uintptr_t, RN_FIB_SLOTS, Z_WAITOK | Z_ZERO);
+	if (transient != NULL) {
+		fib->rf_transients = kalloc_data(RN_FIB_TRANSIENTS *
+		    sizeof(uint8_t), Z_WAITOK | Z_ZERO);
+	}
+	if (fib->rf_slots == NULL ||
+	    (transient != NULL && fib->rf_transients == NULL)) {
+		rn_fib_destroy(fib);
+		return NULL;
+	}
+	(void)rnh->rnh_walktree(rnh, rn_fib_count, fib);
+	if (rn_fib_rebuild_slots(fib, 0, 0) != 0) {
+		rn_fib_destroy(fib);
+		return NULL;
+	}
+	return fib;
+}
+
+void
+rn_fib_destroy(struct rn_fib *fib)
+{
+	if (fib->rf_slots != NULL) {
+		for (u_int s = 0; s < RN_FIB_SLOTS; s++) {
+			rn_fib_slot_free(fib, fib->rf_slots[s]);
+		}
+		kfree_type(uintptr_t, RN_FIB_SLOTS, fib->rf_slots);
+	}
+	if (fib->rf_transients != NULL) {
+		kfree_data(fib->rf_transients, RN_FIB_TRANSIENTS * sizeof(uint8_t));
+	}
+	kfree_type(struct rn_fib, fib);
+}
+
+/*
+ * Called after `rn' went into the tree; the FIB must be destroyed if
+ * this fails.
+ */
+int
+rn_fib_add(struct rn_fib *fib, struct radix_node *rn)
+{
+	struct rn_fib_prefix p;
+
+	switch (rn_fib_prefix(fib, rn, &p)) {
+	case RN_FIB_SKIP:
+		return 0;
+	case RN_FIB_NONCONTIG:
+		fib->rf_noncontig++;
+		return 0;
+	case RN_FIB_TRANSIENT:
+		rn_fib_transient_count(fib, &p, true);
+		return 0;
+	default:
+		return rn_fib_update(fib, &p, true);
+	}
+}
+
+/*
+ * Called after `rn' was taken out of the tree; the FIB must be
+ * destroyed if this fails.
+ */
+int
+rn_fib_delete(struct rn_fib *fib, struct radix_node *rn)
+{
+	struct rn_fib_prefix p;
+
+	switch (rn_fib_prefix(fib, rn, &p)) {
+	case RN_FIB_SKIP:
+		return 0;
+	case RN_FIB_NONCONTIG:
+		VERIFY(fib->rf_noncontig > 0);
+		fib->rf_noncontig--;
+		return 0;
+	case RN_FIB_TRANSIENT:
+		rn_fib_transient_count(fib, &p, false);
+		return 0;
+	default:
+		return rn_fib_update(fib, &p, false);
+	}
+}
+
+/*
+ * Returns the host route of the tree for the key `key', which is what
+ * rn_match() settles on when there is one.
+ */
+static struct radix_node *
+rn_fib_host(const struct rn_fib *fib, const u_char *key)
+{
+	struct radix_node *t;
+
+	for (t = fib->rf_rnh->rnh_treetop; t->rn_bit >= 0;) {
+		t = (t->rn_bmask & key[t->rn_offset]) ? t->rn_right : t->rn_left;
+	}
+	if (t->rn_flags & RNF_ROOT) {
+		t = t->rn_dupedkey;
+	}
+	if (t == NULL || t->rn_mask != NULL ||
+	    bcmp((const u_char *)t->rn_key + fib->rf_off, key + fib->rf_off,
+	    fib->rf_keylen - fib->rf_off) != 0) {
+		return NULL;
+	}
+	return t;
+}
+
+/*
+ * Looks up the key `v' as rn_match() would, leaving the leaf or NULL
+ * in `rnp'.  Returns false, leaving the lookup to the tree, for keys
+ * with anything set past the address, such as a scope.
+ */
+bool
+rn_fib_lookup(struct rn_fib *fib, void *v, struct radix_node **rnp)
+{
+	const u_char *key = v;
+	const struct rn_fib_node *node;
+	uint64_t hi, lo;
+	uintptr_t slot;
+	u_int pos, c;
+
+	if (fib->rf_noncontig != 0 || key[0] != fib->rf_keylen) {
+		return false;
+	}
+	for (u_int i = fib->rf_off + fib->rf_alen; i < fib->rf_keylen; i++) {
+		if (key[i] != 0) {
+			return false;
+		}
+	}
+
+	rn_fib_load(fib, key + fib->rf_off, &hi, &lo);
+	if (fib->rf_transients != NULL &&
+	    fib->rf_transients[rn_fib_transient_hash(hi, lo)] != 0 &&
+	    (*rnp = rn_fib_host(fib, key)) != NULL) {
+		return true;
+	}
+	slot = fib->rf_slots[hi >> (64 - RN_FIB_SLOT_BITS)];
+	if (!(slot & RN_FIB_NODE)) {
+		*rnp = (struct radix_node *)slot;
+		return true;
+	}
+	node = (const struct rn_fib_node *)(slot & ~RN_FIB_NODE);
+	for (pos = RN_FIB_SLOT_BITS;; pos += RN_FIB_STRIDE) {
+		c = rn_fib_bits(hi, lo, pos, RN_FIB_STRIDE);
+		if (!(node->rfn_vector & (1ULL << c))) {
+			break;
+		}
+		node = &node->rfn_nodes[
+			__builtin_popcountll(node->rfn_vector << (63 - c)) - 1];
+	}
+	*rnp = node->rfn_leaves[__builtin_popcountll(node->rfn_leafvec <<
+	    (63 - c)) - 1];
+	return true;
+}
+
+size_t
+rn_fib_size(struct rn_fib *fib)
+{
+	size_t size = sizeof(*fib) + RN_FIB_SLOTS * sizeof(uintptr_t) + fib->rf_size;
+
+	if (fib->rf_transients != NULL) {
+		size += RN_FIB_TRANSIENTS * sizeof(uint8_t);
+	}
+	return size;
+}
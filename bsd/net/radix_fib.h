@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_RADIX_FIB_H_
+#define _NET_RADIX_FIB_H_
+
+#ifdef BSD_KERNEL_PRIVATE
+#include <sys/types.h>
+#include <stdbool.h>
+#include <net/radix.h>
+
+/*
+ * Compressed multibit FIB kept alongside an AF_INET or AF_INET6 radix
+ * tree, answering the longest-prefix match that rn_match() would give
+ * for a non-scoped destination.  It is a poptrie: the first
+ * RN_FIB_SLOT_BITS bits of the address index a direct-pointing array,
+ * and below it every node splits the next RN_FIB_STRIDE bits 64 ways,
+ * with one bit vector marking which of the 64 children are nodes and
+ * another marking where each run of identical leaves starts, so that a
+ * child is found with a popcount.  Leaves point at the radix leaves.
+ *
+ * The FIB is updated from the radix tree after each route is added to
+ * or deleted from it, rebuilding only the part below the route.  Routes
+ * that cannot match a non-scoped destination (scoped routes) are left
+ * out.  Routes with non-contiguous netmasks cannot be represented,
+ * and while any is in the tree rn_fib_lookup() declines to answer.
+ *
+ * Host routes for which the `transient' callback of rn_fib_create()
+ * returns nonzero, such as cloned routes, come and go too often to be
+ * worth a rebuild: they are only counted, by a hash of their address,
+ * and lookups of an address whose count is not zero check the tree for
+ * a host route first.
+ *
+ * The FIB does no locking of its own; the owner of the radix tree
+ * serializes updates and lookups.
+ */
+#define RN_FIB_SLOT_BITS        16
+#define RN_FIB_SLOTS            (1 << RN_FIB_SLOT_BITS)
+#define RN_FIB_STRIDE           6
+
+struct rn_fib;
+
+__BEGIN_DECLS
+extern struct rn_fib *rn_fib_create(struct radix_node_head *rnh, int af,
+    rn_matchf_t *transient);
+extern void rn_fib_destroy(struct rn_fib *fib);
+extern int rn_fib_add(struct rn_fib *fib, struct radix_node *rn);
+extern int rn_fib_delete(struct rn_fib *fib, struct radix_node *rn);
+extern bool rn_fib_lookup(struct rn_fib *fib, void *v, struct radix_node **rnp);
+extern size_t rn_fib_size(struct rn_fib *fib);
+__END_DECLS
+#endif /* BSD_KERNEL_PRIVATE */
+#endif /* _NET_RADIX_FIB_H_ */
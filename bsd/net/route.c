@@ -84,6 +84,7 @@
 #include <net/dlil.h>
 #include <net/if.h>
 #include <net/route.h>
+#include <net/radix_fib.h>
 #include <net/ntstat.h>
 #include <net/nwk_wq.h>
 #if NECP
@@ -221,6 +222,18 @@ __private_extern__ struct rtstat rtstat  = {
 };
 struct radix_node_head *rt_tables[AF_MAX + 1];
 
+/*
+ * Compressed FIBs of the AF_INET and AF_INET6 trees, which answer the
+ * non-scoped lookups of node_lookup() when rt_fib_enable is set; see
+ * radix_fib.h.  A FIB that fails to update is dropped and built again
+ * on the next route change.  Protected by rnh_lock.
+ *
+ * Off by default: each FIB takes 768KB before any route and only pays
+ * off with large tables, i.e. on hosts acting as routers.
+ */
+static int rt_fib_enable = 0;
+static struct rn_fib *rt_fibs[AF_MAX + 1];
+
 static LCK_GRP_DECLARE(rnh_lock_grp, "route");
 LCK_MTX_DECLARE(rnh_lock_data, &rnh_lock_grp); /* global routing tables mutex */
 
@@ -315,6 +328,8 @@ static struct sockaddr *sa_trim(struct sockaddr *, uint8_t);
 static struct radix_node *node_lookup(struct sockaddr *, struct sockaddr *,
     unsigned int);
 static struct radix_node *node_lookup_default(int);
+static void rt_fib_update(int, struct radix_node *, boolean_t);
+static int rt_fib_cloned(struct radix_node *, void *);
 static struct rtentry *rt_lookup_common(boolean_t, boolean_t, struct sockaddr *,
     struct sockaddr *, struct radix_node_head *, unsigned int);
 static int rn_match_ifscope(struct radix_node *, void *);
@@ -392,9 +407,15 @@ static unsigned int primary6_ifscope = IFSCOPE_NONE;
 #define RN(r)           ((struct radix_node *)r)
 #define RT_HOST(r)      (RT(r)->rt_flags & RTF_HOST)
 
+SYSCTL_DECL(_net_route);
+
+static int sysctl_rt_fib_enable SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_route, OID_AUTO, fib_lookup,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &rt_fib_enable, 0,
+    sysctl_rt_fib_enable, "I", "Look up routes in the compressed FIB");
+
 unsigned int rt_verbose = 0;
 #if (DEVELOPMENT || DEBUG)
-SYSCTL_DECL(_net_route);
 SYSCTL_UINT(_net_route, OID_AUTO, verbose, CTLFLAG_RW | CTLFLAG_LOCKED,
     &rt_verbose, 0, "");
 #endif /* (DEVELOPMENT || DEBUG) */
@@ -1960,6 +1981,7 @@ rtrequest_common_locked(int req, struct sockaddr *dst0,
 			panic("rtrequest delete");
 			/* NOTREACHED */
 		}
+		rt_fib_update(af, rn, FALSE);
 		rt = (struct rtentry *)rn;
 
 		RT_LOCK(rt);
@@ -2335,6 +2357,7 @@ makeroute:
 			rte_free(rt);
 			senderr(EEXIST);
 		}
+		rt_fib_update(af, rn, TRUE);
 
 		rt->rt_parent = NULL;
 
@@ -3004,6 +3027,12 @@ node_lookup(struct sockaddr *dst, struct sockaddr *netmask,
 
 	if (ifscope == IFSCOPE_NONE) {
 		f = w = NULL;
+
+		/* The FIB answers for the tree when there is no filter */
+		if (netmask == NULL && rt_fibs[af] != NULL &&
+		    rn_fib_lookup(rt_fibs[af], dst, &rn)) {
+			return rn;
+		}
 	}
 
 	rn = rnh->rnh_lookup_args(dst, netmask, rnh, f, w);
@@ -3014,6 +3043,73 @@ node_lookup(struct sockaddr *dst, struct sockaddr *netmask,
 	return rn;
 }
 
+/*
+ * Bring the FIB of the tree of `af' up to date after `rn' was added to
+ * or removed from the tree, building it if there is none.
+ */
+static void
+rt_fib_update(int af, struct radix_node *rn, boolean_t add)
+{
+	struct rn_fib *fib;
+	int error;
+
+	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if ((af != AF_INET && af != AF_INET6) || !rt_fib_enable) {
+		return;
+	}
+	if ((fib = rt_fibs[af]) == NULL) {
+		rt_fibs[af] = rn_fib_create(rt_tables[af], af, rt_fib_cloned);
+		return;
+	}
+	error = add ? rn_fib_add(fib, rn) : rn_fib_delete(fib, rn);
+	if (error != 0) {
+		rn_fib_destroy(fib);
+		rt_fibs[af] = NULL;
+	}
+}
+
+/*
+ * Cloned host routes are created and expired with the connections that
+ * use them, so the FIB only counts them instead of being rebuilt for
+ * each (see radix_fib.h).  RTF_WASCLONED is set at creation and never
+ * changes, so a route is seen the same way when it is deleted.
+ */
+static int
+rt_fib_cloned(struct radix_node *rn, void *arg)
+{
+#pragma unused(arg)
+	return (RT(rn)->rt_flags & RTF_WASCLONED) != 0;
+}
+
+static int
+sysctl_rt_fib_enable SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	static const int afs[] = { AF_INET, AF_INET6 };
+	int error, enable = rt_fib_enable;
+
+	error = sysctl_handle_int(oidp, &enable, 0, req);
+	if (error != 0 || req->newptr == USER_ADDR_NULL) {
+		return error;
+	}
+
+	lck_mtx_lock(rnh_lock);
+	rt_fib_enable = (enable != 0);
+	for (size_t i = 0; i < sizeof(afs) / sizeof(afs[0]); i++) {
+		int af = afs[i];
+
+		if (rt_fib_enable && rt_fibs[af] == NULL) {
+			rt_fibs[af] = rn_fib_create(rt_tables[af], af, rt_fib_cloned);
+		} else if (!rt_fib_enable && rt_fibs[af] != NULL) {
+			rn_fib_destroy(rt_fibs[af]);
+			rt_fibs[af] = NULL;
+		}
+	}
+	lck_mtx_unlock(rnh_lock);
+	return 0;
+}
+
 /*
  * Lookup the AF_INET/AF_INET6 non-scoped default route.
  */
@@ -106,6 +106,67 @@ struct _mbuf {
 extern uint32_t os_cpu_in_cksum(const void *, uint32_t, uint32_t);
 extern uint32_t os_cpu_in_cksum_mbuf(struct _mbuf *, int, int, uint32_t);
 
+#if defined(KERNEL) && defined(__x86_64__)
+#include <kern/startup.h>
+#include <i386/cpuid.h>
+
+/*
+ * Vector kernels for the bulk of a span (bsd/dev/i386/cpu_in_cksum.s);
+ * they sum a multiple of 64 bytes into a 64-bit accumulator.  Spans
+ * shorter than IN_CKSUM_SIMD_MINLEN are left to the scalar loop, which
+ * is cheaper there than saving and restoring the vector registers.
+ */
+extern uint64_t os_cpu_in_cksum_sse2(const void *, uint32_t);
+extern uint64_t os_cpu_in_cksum_avx2(const void *, uint32_t);
+
+#define IN_CKSUM_SIMD_NONE      0       /* scalar loop only */
+#define IN_CKSUM_SIMD_SSE2      1
+#define IN_CKSUM_SIMD_AVX2      2
+
+#define IN_CKSUM_SIMD_MINLEN    256
+
+extern uint32_t os_cpu_in_cksum_simd;
+extern int os_cpu_in_cksum_simd_set(uint32_t);
+
+uint32_t os_cpu_in_cksum_simd = IN_CKSUM_SIMD_NONE;
+static uint32_t os_cpu_in_cksum_simd_max = IN_CKSUM_SIMD_NONE;
+
+/*
+ * The AVX2 kernel saves and restores only the low 256 bits of the
+ * registers it uses, and its VEX-encoded instructions clear the bits
+ * above; on processors with AVX-512, where the interrupted thread may
+ * have live zmm state, the SSE2 kernel is used instead, since legacy
+ * SSE instructions leave the upper bits alone.
+ */
+static void
+os_cpu_in_cksum_simd_init(void)
+{
+	if ((cpuid_features() & CPUID_FEATURE_AVX1_0) &&
+	    (cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_AVX2) &&
+	    !(cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_AVX512F)) {
+		os_cpu_in_cksum_simd_max = IN_CKSUM_SIMD_AVX2;
+	} else if (cpuid_features() & CPUID_FEATURE_SSE2) {
+		os_cpu_in_cksum_simd_max = IN_CKSUM_SIMD_SSE2;
+	}
+	os_cpu_in_cksum_simd = os_cpu_in_cksum_simd_max;
+}
+STARTUP(EARLY_BOOT, STARTUP_RANK_MIDDLE, os_cpu_in_cksum_simd_init);
+
+/*
+ * Select the kernel used for long spans; levels above what the processor
+ * supports are refused.
+ */
+int
+os_cpu_in_cksum_simd_set(uint32_t level)
+{
+	if (level > os_cpu_in_cksum_simd_max) {
+		return EINVAL;
+	}
+	os_cpu_in_cksum_simd = level;
+	return 0;
+}
+#endif /* KERNEL && __x86_64__ */
+
 uint32_t
 os_cpu_in_cksum(const void *data, uint32_t len, uint32_t initial_sum)
 {
@@ -438,6 +499,23 @@ post_initial_offset:
 			data += 2;
 			mlen -= 2;
 		}
+#if defined(KERNEL) && defined(__x86_64__)
+		if (mlen >= IN_CKSUM_SIMD_MINLEN &&
+		    os_cpu_in_cksum_simd != IN_CKSUM_SIMD_NONE) {
+			uint32_t blen = (uint32_t)mlen & ~63U;
+			uint64_t vsum;
+
+			if (os_cpu_in_cksum_simd == IN_CKSUM_SIMD_AVX2) {
+				vsum = os_cpu_in_cksum_avx2(data, blen);
+			} else {
+				vsum = os_cpu_in_cksum_sse2(data, blen);
+			}
+			/* 2^32 is 1 mod 0xffff; fold so partial can't carry out */
+			partial += (vsum >> 32) + (vsum & 0xffffffff);
+			data += blen;
+			mlen -= (int)blen;
+		}
+#endif /* KERNEL && __x86_64__ */
 		while (mlen >= 64) {
 			__builtin_prefetch(data + 32);
 			__builtin_prefetch(data + 64);
@@ -636,4 +636,276 @@ trailing_bytes:
 	return final_acc & 0xffff;
 }
 #endif /* __LP64 */
+
+#include <sys/sysctl.h>
+#include <sys/uio_internal.h>
+#include <kern/clock.h>
+#include <kern/kalloc.h>
+#include <kern/startup.h>
+
+#define IN_CKSUM_TEST_ROUNDS    2000
+#define IN_CKSUM_TEST_MBUFS     4
+#define IN_CKSUM_TEST_MAXLEN    (IN_CKSUM_TEST_MBUFS * MCLBYTES)
+
+static uint32_t
+in_cksum_test_rand(uint64_t *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (uint32_t)(*seed >> 33);
+}
+
+/*
+ * A chain of clusters, each with its data at a random alignment and of
+ * a random length from a few bytes to a full cluster; the same bytes
+ * are laid out flat in buf.  Some chains are all ones, to exercise the
+ * carries.
+ */
+static struct mbuf *
+in_cksum_test_chain(uint64_t *seed, uint8_t *buf, int *lenp)
+{
+	struct mbuf *top = NULL, **mp = &top, *m;
+	boolean_t ones = (in_cksum_test_rand(seed) % 8 == 0);
+	int n, i, mlen, len = 0;
+
+	n = 1 + (int)(in_cksum_test_rand(seed) % IN_CKSUM_TEST_MBUFS);
+	while (n-- > 0) {
+		m = m_getcl(M_WAITOK, MT_DATA, 0);
+		m->m_data += in_cksum_test_rand(seed) % 8;
+		switch (in_cksum_test_rand(seed) % 4) {
+		case 0:
+			mlen = (int)(in_cksum_test_rand(seed) % 8);
+			break;
+		case 1:
+			mlen = (int)(in_cksum_test_rand(seed) % 512);
+			break;
+		default:
+			mlen = (int)(in_cksum_test_rand(seed) % (MCLBYTES - 8 + 1));
+			break;
+		}
+		for (i = 0; i < mlen; i++) {
+			buf[len + i] = (uint8_t)(ones ? 0xff :
+			    in_cksum_test_rand(seed));
+		}
+		bcopy(&buf[len], mtod(m, uint8_t *), (size_t)mlen);
+		m->m_len = mlen;
+		len += mlen;
+		*mp = m;
+		mp = &m->m_next;
+	}
+	*lenp = len;
+	return top;
+}
+
+/*
+ * Sum random spans of random chains with os_cpu_in_cksum_mbuf() and
+ * os_cpu_in_cksum(), under every vector unit the processor has, and
+ * move them with uiomove_cksum(), both flat and into the chain an mbuf
+ * at a time as sosend() does; count the sums that differ from
+ * in_cksum_mbuf_ref() and the copies that differ from the source.
+ */
+static int
+in_cksum_simd_test(int64_t in, int64_t *out)
+{
+	uint64_t seed = (uint64_t)in;
+	uint32_t i, spans = 0, mismatches = 0;
+	uint8_t *buf, *copy;
+#if defined(__x86_64__)
+	uint32_t level, saved = os_cpu_in_cksum_simd;
+#endif /* __x86_64__ */
+
+	buf = kalloc_data(IN_CKSUM_TEST_MAXLEN, Z_WAITOK | Z_NOFAIL);
+	copy = kalloc_data(IN_CKSUM_TEST_MAXLEN + 1, Z_WAITOK | Z_NOFAIL);
+
+	for (i = 0; i < IN_CKSUM_TEST_ROUNDS; i++) {
+		struct mbuf *m, *n;
+		uint32_t init, psum;
+		int len, off, span, moff, done, piece, error;
+		uint16_t ref;
+		uio_t uio;
+
+		m = in_cksum_test_chain(&seed, buf, &len);
+		if (len == 0) {
+			m_freem(m);
+			continue;
+		}
+		off = (int)(in_cksum_test_rand(&seed) % (uint32_t)len);
+		span = 1 + (int)(in_cksum_test_rand(&seed) % (uint32_t)(len - off));
+		init = in_cksum_test_rand(&seed) & 0xffff;
+		ref = (uint16_t)in_cksum_mbuf_ref(m, span, off, init);
+		spans++;
+
+#if defined(__x86_64__)
+		for (level = 0; os_cpu_in_cksum_simd_set(level) == 0; level++)
+#endif /* __x86_64__ */
+		{
+			if ((uint16_t)os_cpu_in_cksum_mbuf(m, span, off, init) != ref) {
+				mismatches++;
+			}
+			if ((uint16_t)os_cpu_in_cksum(&buf[off], (uint32_t)span,
+			    init) != ref) {
+				mismatches++;
+			}
+		}
+#if defined(__x86_64__)
+		(void)os_cpu_in_cksum_simd_set(saved);
+#endif /* __x86_64__ */
+
+		/* into a destination of either alignment */
+		psum = init;
+		uio = uio_create(1, 0, UIO_SYSSPACE, UIO_WRITE);
+		uio_addiov(uio, CAST_USER_ADDR_T(&buf[off]), (user_size_t)span);
+		error = uiomove_cksum((const char *)&copy[i & 1], span, uio, 0,
+		    &psum);
+		uio_free(uio);
+		if (error != 0 || (uint16_t)psum != ref ||
+		    bcmp(&copy[i & 1], &buf[off], (size_t)span) != 0) {
+			mismatches++;
+		}
+
+		/* across the mbufs, each piece at its offset in the span */
+		psum = init;
+		done = 0;
+		moff = off;
+		uio = uio_create(1, 0, UIO_SYSSPACE, UIO_WRITE);
+		uio_addiov(uio, CAST_USER_ADDR_T(&buf[off]), (user_size_t)span);
+		for (n = m; n != NULL && done < span && error == 0; n = n->m_next) {
+			if (moff >= n->m_len) {
+				moff -= n->m_len;
+				continue;
+			}
+			piece = MIN(n->m_len - moff, span - done);
+			bzero(mtod(n, uint8_t *) + moff, (size_t)piece);
+			error = uiomove_cksum(mtod(n, const char *) + moff, piece,
+			    uio, done, &psum);
+			done += piece;
+			moff = 0;
+		}
+		uio_free(uio);
+		m_copydata(m, off, span, copy);
+		if (error != 0 || done != span || (uint16_t)psum != ref ||
+		    bcmp(copy, &buf[off], (size_t)span) != 0) {
+			mismatches++;
+		}
+		m_freem(m);
+	}
+
+	kfree_data(copy, IN_CKSUM_TEST_MAXLEN + 1);
+	kfree_data(buf, IN_CKSUM_TEST_MAXLEN);
+	printf("%s: %u spans, %u mismatches\n", __func__, spans, mismatches);
+	*out = (mismatches == 0 && spans > 0);
+	return 0;
+}
+SYSCTL_TEST_REGISTER(in_cksum_simd, in_cksum_simd_test);
+
+#define IN_CKSUM_BENCH_BYTES    (256 * 1024 * 1024)
+#define IN_CKSUM_BENCH_MAXLEN   (1024 * 1024)
+
+/*
+ * Nanoseconds per MiB to sum about IN_CKSUM_BENCH_BYTES in spans of the
+ * given length with os_cpu_in_cksum(); in is (vector unit << 32) | length.
+ * Returns -1 for a vector unit the processor does not have.
+ */
+static int
+in_cksum_simd_bench(int64_t in, int64_t *out)
+{
+	uint32_t level = (uint32_t)((uint64_t)in >> 32);
+	uint32_t len = (uint32_t)in, n, i, sum = 0;
+	uint64_t start, ns;
+	uint8_t *buf;
+#if defined(__x86_64__)
+	uint32_t saved = os_cpu_in_cksum_simd;
+#endif /* __x86_64__ */
+
+	if (len == 0 || len > IN_CKSUM_BENCH_MAXLEN) {
+		return EINVAL;
+	}
+#if defined(__x86_64__)
+	if (os_cpu_in_cksum_simd_set(level) != 0) {
+		*out = -1;
+		return 0;
+	}
+#else /* !__x86_64__ */
+	if (level != 0) {
+		*out = -1;
+		return 0;
+	}
+#endif /* !__x86_64__ */
+
+	buf = kalloc_data(len, Z_WAITOK | Z_NOFAIL);
+	for (i = 0; i < len; i++) {
+		buf[i] = (uint8_t)(i * 7);
+	}
+	n = MAX(1U, IN_CKSUM_BENCH_BYTES / len);
+	start = mach_absolute_time();
+	for (i = 0; i < n; i++) {
+		sum += os_cpu_in_cksum(buf, len, 0);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	kfree_data(buf, len);
+#if defined(__x86_64__)
+	(void)os_cpu_in_cksum_simd_set(saved);
+#endif /* __x86_64__ */
+
+	if (sum == 0) {
+		return EINVAL;
+	}
+	*out = (int64_t)((ns << 20) / ((uint64_t)n * len));
+	return 0;
+}
+SYSCTL_TEST_REGISTER(in_cksum_simd_bench, in_cksum_simd_bench);
+
+/*
+ * Nanoseconds per MiB to move about IN_CKSUM_BENCH_BYTES through a uio in
+ * pieces of the given length and checksum them, either as uiomove() and
+ * then os_cpu_in_cksum() over the whole piece (in >> 32 == 0) or with
+ * uiomove_cksum().
+ */
+static int
+uiomove_cksum_bench(int64_t in, int64_t *out)
+{
+	boolean_t fused = ((uint64_t)in >> 32) != 0;
+	uint32_t len = (uint32_t)in, n, i, sum = 0;
+	uint8_t *src, *dst;
+	uint64_t start, ns;
+	int error = 0;
+
+	if (len == 0 || len > IN_CKSUM_BENCH_MAXLEN) {
+		return EINVAL;
+	}
+	src = kalloc_data(len, Z_WAITOK | Z_NOFAIL);
+	dst = kalloc_data(len, Z_WAITOK | Z_NOFAIL);
+	for (i = 0; i < len; i++) {
+		src[i] = (uint8_t)(i * 7);
+	}
+	n = MAX(1U, IN_CKSUM_BENCH_BYTES / len);
+	start = mach_absolute_time();
+	for (i = 0; i < n && error == 0; i++) {
+		uio_t uio = uio_create(1, 0, UIO_SYSSPACE, UIO_WRITE);
+		uint32_t psum = 0;
+
+		uio_addiov(uio, CAST_USER_ADDR_T(src), (user_size_t)len);
+		if (fused) {
+			error = uiomove_cksum((const char *)dst, (int)len, uio, 0,
+			    &psum);
+		} else {
+			error = uiomove((const char *)dst, (int)len, uio);
+			psum = os_cpu_in_cksum(dst, len, 0);
+		}
+		uio_free(uio);
+		sum += psum;
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	kfree_data(dst, len);
+	kfree_data(src, len);
+
+	if (error != 0) {
+		return error;
+	}
+	if (sum == 0) {
+		return EINVAL;
+	}
+	*out = (int64_t)((ns << 20) / ((uint64_t)n * len));
+	return 0;
+}
+SYSCTL_TEST_REGISTER(uiomove_cksum_bench, uiomove_cksum_bench);
 #endif /* DEBUG || DEVELOPMENT */
@@ -142,11 +142,21 @@ static boolean_t inpcb_fast_timer_on = FALSE;
 
 #define INPCB_GCREQ_THRESHOLD   50000
 
+/* bucket lock stripes per pcb hash table; a power of 2 */
+#define INPCB_HASHLOCKS_MAX     256
+
+/* buckets of the SO_REUSEPORT_LB group table; a power of 2 */
+#define INPCB_LBGROUP_HASHSIZE  64
+
 static thread_call_t inpcb_thread_call, inpcb_fast_thread_call;
 static void inpcb_sched_timeout(void);
 static void inpcb_sched_lazy_timeout(void);
 static void _inpcb_sched_timeout(unsigned int);
 static void inpcb_timeout(void *, void *);
+static boolean_t _inp_restricted_recv(struct inpcb *, struct ifnet *);
+static void in_pcbfree_smr(void *);
+static void in_pcblbgroup_free(void *);
+static u_int32_t inp_lbgroup_seed = 0;
 const int inpcb_timeout_lazy = 10;      /* 10 seconds leeway for lazy timers */
 extern int tvtohz(struct timeval *);
 
@@ -541,11 +551,58 @@ inpcb_timer_sched(struct inpcbinfo *ipi, u_int32_t type)
 	lck_mtx_unlock(&inpcb_timeout_lock);
 }
 
+/*
+ * Allocate the bucket lock stripes of the pcb hash tables, which
+ * the protocol has set up by now along with its lock group.
+ */
+static void
+in_pcbinfo_hashlocks_init(struct inpcbinfo *ipi)
+{
+	u_long n;
+
+	n = MIN(ipi->ipi_hashmask + 1, INPCB_HASHLOCKS_MAX);
+	ipi->ipi_hashlocks = kalloc_type(lck_mtx_t, n,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	for (u_long i = 0; i < n; i++) {
+		lck_mtx_init(&ipi->ipi_hashlocks[i], ipi->ipi_lock_grp,
+		    &ipi->ipi_lock_attr);
+	}
+	ipi->ipi_hashlockmask = n - 1;
+
+	n = MIN(ipi->ipi_porthashmask + 1, INPCB_HASHLOCKS_MAX);
+	ipi->ipi_porthashlocks = kalloc_type(lck_mtx_t, n,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	for (u_long i = 0; i < n; i++) {
+		lck_mtx_init(&ipi->ipi_porthashlocks[i], ipi->ipi_lock_grp,
+		    &ipi->ipi_lock_attr);
+	}
+	ipi->ipi_porthashlockmask = n - 1;
+}
+
+/*
+ * Set up the table of SO_REUSEPORT_LB groups; see in_pcblbgroup_join().
+ */
+static void
+in_pcbinfo_lbgroup_init(struct inpcbinfo *ipi)
+{
+	ipi->ipi_lbgrouphashbase = kalloc_type(struct smrq_slist_head,
+	    INPCB_LBGROUP_HASHSIZE, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	ipi->ipi_lbgrouphashmask = INPCB_LBGROUP_HASHSIZE - 1;
+	lck_mtx_init(&ipi->ipi_lbgrouplock, ipi->ipi_lock_grp,
+	    &ipi->ipi_lock_attr);
+	if (inp_lbgroup_seed == 0) {
+		inp_lbgroup_seed = RandomULong();
+	}
+}
+
 void
 in_pcbinfo_attach(struct inpcbinfo *ipi)
 {
 	struct inpcbinfo *ipi0;
 
+	in_pcbinfo_hashlocks_init(ipi);
+	in_pcbinfo_lbgroup_init(ipi);
+
 	lck_mtx_lock(&inpcb_lock);
 	TAILQ_FOREACH(ipi0, &inpcb_head, ipi_entry) {
 		if (ipi0 == ipi) {
@@ -754,7 +811,8 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	unsigned short *lastport;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	u_short lport = 0, rand_port = 0;
-	int wild = 0, reuseport = (so->so_options & SO_REUSEPORT);
+	int wild = 0, reuseport =
+	    (so->so_options & (SO_REUSEPORT | SO_REUSEPORT_LB));
 	int error, randomport, conflict = 0;
 	boolean_t anonport = FALSE;
 	kauth_cred_t cred;
@@ -764,7 +822,8 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	if (TAILQ_EMPTY(&in_ifaddrhead)) { /* XXX broken! */
 		return EADDRNOTAVAIL;
 	}
-	if (!(so->so_options & (SO_REUSEADDR | SO_REUSEPORT))) {
+	if (!(so->so_options &
+	    (SO_REUSEADDR | SO_REUSEPORT | SO_REUSEPORT_LB))) {
 		wild = 1;
 	}
 
@@ -928,7 +987,8 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				    INPLOOKUP_WILDCARD)) != NULL &&
 			    (SIN(nam)->sin_addr.s_addr != INADDR_ANY ||
 			    t->inp_laddr.s_addr != INADDR_ANY ||
-			    !(t->inp_socket->so_options & SO_REUSEPORT)) &&
+			    !(t->inp_socket->so_options &
+			    (SO_REUSEPORT | SO_REUSEPORT_LB))) &&
 			    (u != kauth_cred_getuid(t->inp_socket->so_cred)) &&
 			    !(t->inp_socket->so_flags & SOF_REUSESHAREUID) &&
 			    (SIN(nam)->sin_addr.s_addr != INADDR_ANY ||
@@ -1723,6 +1783,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 	struct in_addr laddr;
 	struct sockaddr_in *sin = (struct sockaddr_in *)(void *)nam;
 	struct inpcb *pcb;
+	lck_mtx_t *mtx;
 	int error;
 	struct socket *so = inp->inp_socket;
 
@@ -1765,15 +1826,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 				return error;
 			}
 		}
-		if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets.
-			 */
-			socket_unlock(so, 0);
-			lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-			socket_lock(so, 0);
-		}
+		mtx = in_pcbhash_lock(inp);
 		inp->inp_laddr = laddr;
 		/* no reference needed */
 		inp->inp_last_outifp = (outif != NULL) ? *outif : NULL;
@@ -1796,23 +1849,15 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 		if (inp->inp_lport == 0) {
 			return EINVAL;
 		}
-		if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets.
-			 */
-			socket_unlock(so, 0);
-			lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-			socket_lock(so, 0);
-		}
+		mtx = in_pcbhash_lock(inp);
 	}
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
+	lck_mtx_unlock(mtx);
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP) {
 		nstat_pcb_invalidate_cache(inp);
 	}
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 	return 0;
 }
 
@@ -1820,13 +1865,16 @@ void
 in_pcbdisconnect(struct inpcb *inp)
 {
 	struct socket *so = inp->inp_socket;
+	lck_mtx_t *mtx;
 
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP) {
 		nstat_pcb_cache(inp);
 	}
 
+	mtx = in_pcbhash_lock(inp);
 	inp->inp_faddr.s_addr = INADDR_ANY;
 	inp->inp_fport = 0;
+	lck_mtx_unlock(mtx);
 
 #if CONTENT_FILTER
 	if (so) {
@@ -1834,15 +1882,7 @@ in_pcbdisconnect(struct inpcb *inp)
 	}
 #endif
 
-	if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
-
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
 	 * so check for SOF_MP_SUBFLOW socket flag before detaching the PCB;
@@ -1865,6 +1905,9 @@ in_pcbdetach(struct inpcb *inp)
 		/* NOTREACHED */
 	}
 
+	/* stop new connections from being steered to it */
+	in_pcblbgroup_leave(inp);
+
 #if IPSEC
 	if (inp->inp_sp != NULL) {
 		(void) ipsec4_delete_pcbpolicy(inp);
@@ -2023,13 +2066,29 @@ in_pcbdispose(struct inpcb *inp)
 		 * we deallocate the structure.
 		 */
 		ROUTE_RELEASE(&inp->inp_route);
-		if ((so->so_flags1 & SOF1_CACHED_IN_SOCK_LAYER) == 0) {
-			zfree(ipi->ipi_zone, inp);
-		}
-		sodealloc(so);
+		/*
+		 * Lockless lookups may still be looking at the pcb.
+		 */
+		smr_global_retire(so, sizeof(*so), in_pcbfree_smr);
 	}
 }
 
+/*
+ * Free a disposed of pcb and its socket, once no in_pcblookup_hash()
+ * SMR section can still reference them.
+ */
+static void
+in_pcbfree_smr(void *arg)
+{
+	struct socket *so = arg;
+	struct inpcb *inp = (struct inpcb *)(void *)so->so_saved_pcb;
+
+	if ((so->so_flags1 & SOF1_CACHED_IN_SOCK_LAYER) == 0) {
+		zfree(inp->inp_pcbinfo->ipi_zone, inp);
+	}
+	sodealloc(so);
+}
+
 /*
  * The calling convention of in_getsockaddr() and in_getpeeraddr() was
  * modified to match the pru_sockaddr() and pru_peeraddr() entry points
@@ -2227,14 +2286,17 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 	KERNEL_DEBUG(DBG_FNC_PCB_LOOKUP | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	if (!wild_okay) {
-		struct inpcbhead *head;
+		struct smrq_list_head *head;
+		u_int32_t bucket;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		bucket = INP_PCBHASH(INADDR_ANY, lport, 0,
+		    pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[bucket];
+		lck_mtx_lock(INP_HASHLOCK(pcbinfo, bucket));
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV4)) {
 				continue;
 			}
@@ -2244,9 +2306,11 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 				/*
 				 * Found.
 				 */
+				lck_mtx_unlock(INP_HASHLOCK(pcbinfo, bucket));
 				return inp;
 			}
 		}
+		lck_mtx_unlock(INP_HASHLOCK(pcbinfo, bucket));
 		/*
 		 * Not found.
 		 */
@@ -2256,14 +2320,16 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 		struct inpcbporthead *porthash;
 		struct inpcbport *phd;
 		struct inpcb *match = NULL;
+		u_int32_t bucket;
 		/*
 		 * Best fit PCB lookup.
 		 *
 		 * First see if this local port is in use by looking on the
 		 * port hash list.
 		 */
-		porthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(lport,
-		    pcbinfo->ipi_porthashmask)];
+		bucket = INP_PCBPORTHASH(lport, pcbinfo->ipi_porthashmask);
+		porthash = &pcbinfo->ipi_porthashbase[bucket];
+		lck_mtx_lock(INP_PORTHASHLOCK(pcbinfo, bucket));
 		LIST_FOREACH(phd, porthash, phd_hash) {
 			if (phd->phd_port == lport) {
 				break;
@@ -2303,6 +2369,7 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 				}
 			}
 		}
+		lck_mtx_unlock(INP_PORTHASHLOCK(pcbinfo, bucket));
 		KERNEL_DEBUG(DBG_FNC_PCB_LOOKUP | DBG_FUNC_END, match,
 		    0, 0, 0, 0);
 		return match;
@@ -2317,28 +2384,26 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
     u_int fport_arg, struct in_addr laddr, u_int lport_arg, int wildcard,
     uid_t *uid, gid_t *gid, struct ifnet *ifp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
 	struct inpcb *inp;
 	u_short fport = (u_short)fport_arg, lport = (u_short)lport_arg;
 	int found = 0;
 	struct inpcb *local_wild = NULL;
 	struct inpcb *local_wild_mapped = NULL;
+	lck_mtx_t *mtx;
+	u_int32_t bucket;
 
 	*uid = UID_MAX;
 	*gid = GID_MAX;
 
-	/*
-	 * We may have found the pcb in the last lookup - check this first.
-	 */
-
-	lck_rw_lock_shared(&pcbinfo->ipi_lock);
-
 	/*
 	 * First look for an exact match.
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	bucket = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2365,22 +2430,24 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 				*gid = kauth_cred_getgid(
 					inp->inp_socket->so_cred);
 			}
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return found;
 		}
 	}
+	lck_mtx_unlock(mtx);
 
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(&pcbinfo->ipi_lock);
 		return 0;
 	}
 
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	bucket = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2403,7 +2470,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 					*gid = kauth_cred_getgid(
 						inp->inp_socket->so_cred);
 				}
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return found;
 			} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
 				if (inp->inp_socket &&
@@ -2423,10 +2490,10 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 				*gid = kauth_cred_getgid(
 					local_wild_mapped->inp_socket->so_cred);
 			}
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return found;
 		}
-		lck_rw_done(&pcbinfo->ipi_lock);
+		lck_mtx_unlock(mtx);
 		return 0;
 	}
 	if ((found = (local_wild->inp_socket != NULL))) {
@@ -2435,10 +2502,31 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		*gid = kauth_cred_getgid(
 			local_wild->inp_socket->so_cred);
 	}
-	lck_rw_done(&pcbinfo->ipi_lock);
+	lck_mtx_unlock(mtx);
 	return found;
 }
 
+/*
+ * Take a reference on a connected pcb found by an exact-match lookup
+ * inside an SMR read section.  The pcb's memory stays valid until the
+ * section ends (in_pcbdispose() defers the free), and the reference
+ * then keeps it from being disposed of.
+ *
+ * Fails, without a reference, when the pcb is going away or may not
+ * receive on ifp; the caller then retries under the bucket lock, which
+ * applies (and logs) the full set of checks.  A connected pcb always
+ * passes necp_socket_is_allowed_to_recv_on_interface(), which may block
+ * and so is left to the locked path.
+ */
+boolean_t
+in_pcb_smr_acquire(struct inpcb *inp, struct ifnet *ifp)
+{
+	if (_inp_restricted_recv(inp, ifp)) {
+		return FALSE;
+	}
+	return in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING;
+}
+
 /*
  * Lookup PCB in hash list.
  */
@@ -2447,24 +2535,47 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
     u_int fport_arg, struct in_addr laddr, u_int lport_arg, int wildcard,
     struct ifnet *ifp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
 	struct inpcb *inp;
 	u_short fport = (u_short)fport_arg, lport = (u_short)lport_arg;
 	struct inpcb *local_wild = NULL;
 	struct inpcb *local_wild_mapped = NULL;
+	lck_mtx_t *mtx;
+	u_int32_t bucket;
+
+	bucket = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
+	 * Fast path: an established flow, found without taking any lock.
+	 * A miss here is not authoritative, as a reader can be carried off
+	 * its chain by a concurrent in_pcbrehash(); it, and any match that
+	 * in_pcb_smr_acquire() turns down, is retried under the lock.
 	 */
-
-	lck_rw_lock_shared(&pcbinfo->ipi_lock);
+	if (faddr.s_addr != INADDR_ANY) {
+		smr_global_enter();
+		smrq_entered_foreach(inp, head, inp_hash) {
+			if ((inp->inp_vflag & INP_IPV4) &&
+			    inp->inp_faddr.s_addr == faddr.s_addr &&
+			    inp->inp_laddr.s_addr == laddr.s_addr &&
+			    inp->inp_fport == fport &&
+			    inp->inp_lport == lport) {
+				break;
+			}
+		}
+		if (inp != NULL && in_pcb_smr_acquire(inp, ifp)) {
+			smr_global_leave();
+			return inp;
+		}
+		smr_global_leave();
+	}
 
 	/*
 	 * First look for an exact match.
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2487,27 +2598,35 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return inp;
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return NULL;
 			}
 		}
 	}
+	lck_mtx_unlock(mtx);
 
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(&pcbinfo->ipi_lock);
 		return NULL;
 	}
 
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	inp = in_pcblookup_lbgroup(pcbinfo, INP_IPV4, &faddr, fport,
+	    &laddr, lport, ifp);
+	if (inp != NULL) {
+		return inp;
+	}
+
+	bucket = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2526,11 +2645,11 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			if (inp->inp_laddr.s_addr == laddr.s_addr) {
 				if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 				    WNT_STOPUSING) {
-					lck_rw_done(&pcbinfo->ipi_lock);
+					lck_mtx_unlock(mtx);
 					return inp;
 				} else {
 					/* it's dead; say it isn't found */
-					lck_rw_done(&pcbinfo->ipi_lock);
+					lck_mtx_unlock(mtx);
 					return NULL;
 				}
 			} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
@@ -2546,71 +2665,306 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		if (local_wild_mapped != NULL) {
 			if (in_pcb_checkstate(local_wild_mapped,
 			    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return local_wild_mapped;
 			} else {
 				/* it's dead; say it isn't found */
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return NULL;
 			}
 		}
-		lck_rw_done(&pcbinfo->ipi_lock);
+		lck_mtx_unlock(mtx);
 		return NULL;
 	}
 	if (in_pcb_checkstate(local_wild, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-		lck_rw_done(&pcbinfo->ipi_lock);
+		lck_mtx_unlock(mtx);
 		return local_wild;
 	}
 	/*
 	 * It's either not found or is already dead.
 	 */
-	lck_rw_done(&pcbinfo->ipi_lock);
+	lck_mtx_unlock(mtx);
 	return NULL;
 }
 
+/*
+ * SO_REUSEPORT_LB groups.  The listeners that set SO_REUSEPORT_LB and
+ * share a local address and port form a group, and in_pcblookup_hash()
+ * hands each new connection to one of them by flow hash rather than to
+ * whichever is first on the hash chain.  Membership is an array that is
+ * never modified once published: a join or leave, serialized by
+ * ipi_lbgrouplock, puts a copy in its place and retires the original,
+ * so a lookup sees either all of a change or none of it.
+ */
+static struct inpcblbgroup *
+in_pcblbgroup_alloc(struct inpcb *inp, uint32_t count)
+{
+	struct inpcblbgroup *grp;
+
+	grp = kalloc_type(struct inpcblbgroup, struct inpcb *, count,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	grp->il_lport = inp->inp_lport;
+	grp->il_vflag = inp->inp_vflag;
+	grp->il6_laddr = inp->in6p_laddr;
+	grp->il_count = count;
+	return grp;
+}
+
+static void
+in_pcblbgroup_free(void *arg)
+{
+	struct inpcblbgroup *grp = arg;
+
+	kfree_type(struct inpcblbgroup, struct inpcb *, grp->il_count, grp);
+}
+
+static void
+in_pcblbgroup_retire(struct inpcblbgroup *grp)
+{
+	smr_global_retire(grp, sizeof(*grp) +
+	    grp->il_count * sizeof(grp->il_inp[0]), in_pcblbgroup_free);
+}
+
+/*
+ * Add a listening pcb to the group for its local address and port,
+ * creating the group if there is none.  Called with the socket locked
+ * once the pcb is listening; a no-op unless SO_REUSEPORT_LB is set.
+ */
+void
+in_pcblbgroup_join(struct inpcb *inp)
+{
+	struct inpcbinfo *ipi = inp->inp_pcbinfo;
+	struct inpcblbgroup *grp, *ngrp;
+	struct smrq_slist_head *head;
+	uint32_t count = 0;
+
+	if (!(inp->inp_socket->so_options & SO_REUSEPORT_LB) ||
+	    (inp->inp_flags2 & INP2_INLBGROUP) || inp->inp_lport == 0) {
+		return;
+	}
+
+	head = &ipi->ipi_lbgrouphashbase[INP_PCBPORTHASH(inp->inp_lport,
+	    ipi->ipi_lbgrouphashmask)];
+
+	lck_mtx_lock(&ipi->ipi_lbgrouplock);
+	smrq_serialized_foreach(grp, head, il_link) {
+		if (grp->il_lport == inp->inp_lport &&
+		    grp->il_vflag == inp->inp_vflag &&
+		    IN6_ARE_ADDR_EQUAL(&grp->il6_laddr, &inp->in6p_laddr)) {
+			count = grp->il_count;
+			break;
+		}
+	}
+	ngrp = in_pcblbgroup_alloc(inp, count + 1);
+	if (grp != NULL) {
+		bcopy(grp->il_inp, ngrp->il_inp, count * sizeof(grp->il_inp[0]));
+		smrq_serialized_replace(head, &grp->il_link, &ngrp->il_link);
+	} else {
+		smrq_serialized_insert_head(head, &ngrp->il_link);
+	}
+	ngrp->il_inp[count] = inp;
+	inp->inp_flags2 |= INP2_INLBGROUP;
+	lck_mtx_unlock(&ipi->ipi_lbgrouplock);
+
+	if (grp != NULL) {
+		in_pcblbgroup_retire(grp);
+	}
+}
+
+/*
+ * Take a pcb out of its group, freeing the group with its last member.
+ * Called with the socket locked when the pcb is detached, so that no
+ * new connection is handed to a listener that is going away.
+ */
+void
+in_pcblbgroup_leave(struct inpcb *inp)
+{
+	struct inpcbinfo *ipi = inp->inp_pcbinfo;
+	struct inpcblbgroup *grp, *ngrp = NULL;
+	struct smrq_slist_head *head;
+	uint32_t i, j;
+
+	if (!(inp->inp_flags2 & INP2_INLBGROUP)) {
+		return;
+	}
+
+	head = &ipi->ipi_lbgrouphashbase[INP_PCBPORTHASH(inp->inp_lport,
+	    ipi->ipi_lbgrouphashmask)];
+
+	lck_mtx_lock(&ipi->ipi_lbgrouplock);
+	smrq_serialized_foreach(grp, head, il_link) {
+		if (grp->il_lport != inp->inp_lport) {
+			continue;
+		}
+		for (i = 0; i < grp->il_count; i++) {
+			if (grp->il_inp[i] == inp) {
+				break;
+			}
+		}
+		if (i < grp->il_count) {
+			break;
+		}
+	}
+	VERIFY(grp != NULL);
+
+	if (grp->il_count == 1) {
+		smrq_serialized_remove(head, &grp->il_link);
+	} else {
+		ngrp = in_pcblbgroup_alloc(inp, grp->il_count - 1);
+		ngrp->il_vflag = grp->il_vflag;
+		ngrp->il6_laddr = grp->il6_laddr;
+		for (i = 0, j = 0; i < grp->il_count; i++) {
+			if (grp->il_inp[i] != inp) {
+				ngrp->il_inp[j++] = grp->il_inp[i];
+			}
+		}
+		smrq_serialized_replace(head, &grp->il_link, &ngrp->il_link);
+	}
+	inp->inp_flags2 &= ~INP2_INLBGROUP;
+	lck_mtx_unlock(&ipi->ipi_lbgrouplock);
+
+	in_pcblbgroup_retire(grp);
+}
+
+/*
+ * Choose the listener for a new connection from the group bound to
+ * the local address and port, or failing that to the wildcard address.
+ * The addresses are struct in_addr for INP_IPV4 and struct in6_addr
+ * for INP_IPV6.  Returns the pcb with a want count reference held, or
+ * NULL to have the caller search the hash as it otherwise would.
+ */
+struct inpcb *
+in_pcblookup_lbgroup(struct inpcbinfo *ipi, u_char vflag,
+    const void *faddr, u_short fport, const void *laddr, u_short lport,
+    struct ifnet *ifp)
+{
+	struct smrq_slist_head *head;
+	struct inpcblbgroup *grp, *wild = NULL;
+	struct inpcb *inp = NULL;
+	struct {
+		struct in6_addr faddr;
+		u_short         fport;
+		u_short         lport;
+	} key;
+
+	head = &ipi->ipi_lbgrouphashbase[INP_PCBPORTHASH(lport,
+	    ipi->ipi_lbgrouphashmask)];
+	if (smr_unsafe_load(&head->first) == NULL) {
+		return NULL;
+	}
+
+	bzero(&key, sizeof(key));
+	if (vflag == INP_IPV4) {
+		bcopy(faddr, &key.faddr.s6_addr32[3], sizeof(struct in_addr));
+	} else {
+		bcopy(faddr, &key.faddr, sizeof(struct in6_addr));
+	}
+	key.fport = fport;
+	key.lport = lport;
+
+	smr_global_enter();
+	smrq_entered_foreach(grp, head, il_link) {
+		if (grp->il_lport != lport || !(grp->il_vflag & vflag)) {
+			continue;
+		}
+		if (vflag == INP_IPV4) {
+			const struct in_addr *in = laddr;
+
+			if (grp->il_laddr.s_addr == in->s_addr) {
+				break;
+			}
+			/* as with local_wild, prefer IPv4 to mapped */
+			if (grp->il_laddr.s_addr == INADDR_ANY &&
+			    (wild == NULL || (wild->il_vflag & INP_IPV6))) {
+				wild = grp;
+			}
+		} else {
+			if (IN6_ARE_ADDR_EQUAL(&grp->il6_laddr,
+			    (const struct in6_addr *)laddr)) {
+				break;
+			}
+			if (IN6_IS_ADDR_UNSPECIFIED(&grp->il6_laddr)) {
+				wild = grp;
+			}
+		}
+	}
+	if (grp == NULL) {
+		grp = wild;
+	}
+	if (grp != NULL) {
+		inp = grp->il_inp[net_flowhash(&key, sizeof(key),
+		    inp_lbgroup_seed) % grp->il_count];
+		if (!in_pcb_smr_acquire(inp, ifp)) {
+			inp = NULL;
+		}
+	}
+	smr_global_leave();
+
+#if NECP
+	if (inp != NULL &&
+	    !necp_socket_is_allowed_to_recv_on_interface(inp, ifp)) {
+		(void) in_pcb_checkstate(inp, WNT_RELEASE, 0);
+		inp = NULL;
+	}
+#endif /* NECP */
+	return inp;
+}
+
 /*
  * @brief	Insert PCB onto various hash lists.
  *
  * @param	inp Pointer to internet protocol control block
  * @param	locked	Implies if ipi_lock (protecting pcb list)
- *              is already locked or not.
+ *              is already locked or not.  The hash lists are
+ *              protected by their bucket locks, so it is not
+ *              needed here either way.
  *
  * @return	int error on failure and 0 on success
  */
 int
 in_pcbinshash(struct inpcb *inp, int locked)
 {
-	struct inpcbhead *pcbhash;
+#pragma unused(locked)
+	struct smrq_list_head *pcbhash;
 	struct inpcbporthead *pcbporthash;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
-	struct inpcbport *phd;
+	struct inpcbport *phd, *newphd = NULL;
+	lck_mtx_t *portmtx, *mtx;
 	u_int32_t hashkey_faddr;
 
-	if (!locked) {
-		if (!lck_rw_try_lock_exclusive(&pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets
-			 */
-			socket_unlock(inp->inp_socket, 0);
-			lck_rw_lock_exclusive(&pcbinfo->ipi_lock);
-			socket_lock(inp->inp_socket, 0);
-		}
-	}
-
 	/*
-	 * This routine or its caller may have given up
+	 * This routine's caller may have given up the
 	 * socket's protocol lock briefly.
 	 * During that time the socket may have been dropped.
 	 * Safe-guarding against that.
 	 */
 	if (inp->inp_state == INPCB_STATE_DEAD) {
-		if (!locked) {
-			lck_rw_done(&pcbinfo->ipi_lock);
-		}
 		return ECONNABORTED;
 	}
 
+	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
+
+#if SKYWALK
+	int err;
+	struct socket *so = inp->inp_socket;
+	if ((SOCK_PROTO(so) == IPPROTO_TCP || SOCK_PROTO(so) == IPPROTO_UDP) &&
+	    !(inp->inp_flags2 & INP2_EXTERNAL_PORT)) {
+		if (inp->inp_vflag & INP_IPV6) {
+			err = netns_reserve_in6(&inp->inp_netns_token,
+			    inp->in6p_laddr, (uint8_t)SOCK_PROTO(so), inp->inp_lport,
+			    NETNS_BSD | NETNS_PRERESERVED, NULL);
+		} else {
+			err = netns_reserve_in(&inp->inp_netns_token,
+			    inp->inp_laddr, (uint8_t)SOCK_PROTO(so), inp->inp_lport,
+			    NETNS_BSD | NETNS_PRERESERVED, NULL);
+		}
+		if (err) {
+			return err;
+		}
+		netns_set_ifnet(&inp->inp_netns_token, inp->inp_last_outifp);
+		inp_update_netns_flags(so);
+	}
+#endif /* SKYWALK */
 
 	if (inp->inp_vflag & INP_IPV6) {
 		hashkey_faddr = inp->in6p_faddr.s6_addr32[3] /* XXX */;
@@ -2622,10 +2976,15 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	    inp->inp_fport, pcbinfo->ipi_hashmask);
 
 	pcbhash = &pcbinfo->ipi_hashbase[inp->inp_hash_element];
+	mtx = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
 
 	pcbporthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(inp->inp_lport,
 	    pcbinfo->ipi_porthashmask)];
+	portmtx = INP_PORTHASHLOCK(pcbinfo,
+	    INP_PCBPORTHASH(inp->inp_lport, pcbinfo->ipi_porthashmask));
 
+	lck_mtx_lock(portmtx);
+again:
 	/*
 	 * Go through port list and look for a head for this lport.
 	 */
@@ -2636,49 +2995,33 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	}
 
 	/*
-	 * If none exists, malloc one and tack it on.
+	 * If none exists, malloc one and tack it on; the allocation
+	 * may block, so it is done without the bucket lock.
 	 */
 	if (phd == NULL) {
-		phd = kalloc_type(struct inpcbport, Z_WAITOK | Z_NOFAIL);
+		if (newphd == NULL) {
+			lck_mtx_unlock(portmtx);
+			newphd = kalloc_type(struct inpcbport, Z_WAITOK | Z_NOFAIL);
+			lck_mtx_lock(portmtx);
+			goto again;
+		}
+		phd = newphd;
+		newphd = NULL;
 		phd->phd_port = inp->inp_lport;
 		LIST_INIT(&phd->phd_pcblist);
 		LIST_INSERT_HEAD(pcbporthash, phd, phd_hash);
 	}
 
-	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
-
-#if SKYWALK
-	int err;
-	struct socket *so = inp->inp_socket;
-	if ((SOCK_PROTO(so) == IPPROTO_TCP || SOCK_PROTO(so) == IPPROTO_UDP) &&
-	    !(inp->inp_flags2 & INP2_EXTERNAL_PORT)) {
-		if (inp->inp_vflag & INP_IPV6) {
-			err = netns_reserve_in6(&inp->inp_netns_token,
-			    inp->in6p_laddr, (uint8_t)SOCK_PROTO(so), inp->inp_lport,
-			    NETNS_BSD | NETNS_PRERESERVED, NULL);
-		} else {
-			err = netns_reserve_in(&inp->inp_netns_token,
-			    inp->inp_laddr, (uint8_t)SOCK_PROTO(so), inp->inp_lport,
-			    NETNS_BSD | NETNS_PRERESERVED, NULL);
-		}
-		if (err) {
-			if (!locked) {
-				lck_rw_done(&pcbinfo->ipi_lock);
-			}
-			return err;
-		}
-		netns_set_ifnet(&inp->inp_netns_token, inp->inp_last_outifp);
-		inp_update_netns_flags(so);
-	}
-#endif /* SKYWALK */
-
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
-	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	lck_mtx_lock(mtx);
+	smrq_serialized_insert_head(pcbhash, &inp->inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	lck_mtx_unlock(mtx);
+	lck_mtx_unlock(portmtx);
 
-	if (!locked) {
-		lck_rw_done(&pcbinfo->ipi_lock);
+	if (newphd != NULL) {
+		kfree_type(struct inpcbport, newphd);
 	}
 
 #if NECP
@@ -2689,16 +3032,37 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	return 0;
 }
 
+/*
+ * Lock the hash bucket the PCB currently sits in (or would sit in),
+ * for callers about to change the addresses or ports it is hashed by;
+ * lookups walking that bucket under its lock then never see them
+ * half-updated.  Returns the lock to drop, before in_pcbrehash().
+ */
+lck_mtx_t *
+in_pcbhash_lock(struct inpcb *inp)
+{
+	lck_mtx_t *mtx = INP_HASHLOCK(inp->inp_pcbinfo, inp->inp_hash_element);
+
+	lck_mtx_lock(mtx);
+	return mtx;
+}
+
 /*
  * Move PCB to the proper hash bucket when { faddr, fport } have  been
  * changed. NOTE: This does not handle the case of the lport changing (the
  * hashed port list would have to be updated as well), so the lport must
  * not change after in_pcbinshash() has been called.
+ *
+ * The PCB is unlinked from its old bucket and linked onto the new one
+ * under each bucket's lock in turn; lockless readers that race with this
+ * may miss it, and fall back to a locked lookup when they do.
  */
 void
 in_pcbrehash(struct inpcb *inp)
 {
-	struct inpcbhead *head;
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	struct smrq_list_head *head;
+	lck_mtx_t *mtx;
 	u_int32_t hashkey_faddr;
 
 #if SKYWALK
@@ -2738,6 +3102,15 @@ in_pcbrehash(struct inpcb *inp)
 		inp_update_netns_flags(so);
 	}
 #endif /* SKYWALK */
+	if (inp->inp_flags2 & INP2_INHASHLIST) {
+		head = &pcbinfo->ipi_hashbase[inp->inp_hash_element];
+		mtx = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
+		lck_mtx_lock(mtx);
+		smrq_serialized_remove(head, &inp->inp_hash);
+		inp->inp_flags2 &= ~INP2_INHASHLIST;
+		lck_mtx_unlock(mtx);
+	}
+
 	if (inp->inp_vflag & INP_IPV6) {
 		hashkey_faddr = inp->in6p_faddr.s6_addr32[3] /* XXX */;
 	} else {
@@ -2745,17 +3118,15 @@ in_pcbrehash(struct inpcb *inp)
 	}
 
 	inp->inp_hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
-	    inp->inp_fport, inp->inp_pcbinfo->ipi_hashmask);
-	head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
-
-	if (inp->inp_flags2 & INP2_INHASHLIST) {
-		LIST_REMOVE(inp, inp_hash);
-		inp->inp_flags2 &= ~INP2_INHASHLIST;
-	}
+	    inp->inp_fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[inp->inp_hash_element];
+	mtx = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
 
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
-	LIST_INSERT_HEAD(head, inp, inp_hash);
+	lck_mtx_lock(mtx);
+	smrq_serialized_insert_head(head, &inp->inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	lck_mtx_unlock(mtx);
 
 #if NECP
 	// This call catches updates to the remote addresses
@@ -2766,11 +3137,19 @@ in_pcbrehash(struct inpcb *inp)
 /*
  * Remove PCB from various lists.
  * Must be called pcbinfo lock is held in exclusive mode.
+ *
+ * The PCB stays linked to its hash neighbours for the benefit of
+ * lockless readers still walking past it; in_pcbdispose() defers
+ * freeing it until they are done.
  */
 void
 in_pcbremlists(struct inpcb *inp)
 {
-	inp->inp_gencnt = ++inp->inp_pcbinfo->ipi_gencnt;
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+
+	inp->inp_gencnt = ++pcbinfo->ipi_gencnt;
+
+	in_pcblbgroup_leave(inp);
 
 	/*
 	 * Check if it's in hashlist -- an inp is placed in hashlist when
@@ -2779,18 +3158,30 @@ in_pcbremlists(struct inpcb *inp)
 	 */
 	if (inp->inp_flags2 & INP2_INHASHLIST) {
 		struct inpcbport *phd = inp->inp_phd;
+		lck_mtx_t *portmtx, *mtx;
 
 		VERIFY(phd != NULL && inp->inp_lport > 0);
 
-		LIST_REMOVE(inp, inp_hash);
-		inp->inp_hash.le_next = NULL;
-		inp->inp_hash.le_prev = NULL;
+		portmtx = INP_PORTHASHLOCK(pcbinfo,
+		    INP_PCBPORTHASH(inp->inp_lport, pcbinfo->ipi_porthashmask));
+		mtx = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
+
+		lck_mtx_lock(portmtx);
+		lck_mtx_lock(mtx);
+		smrq_serialized_remove(&pcbinfo->ipi_hashbase[inp->inp_hash_element],
+		    &inp->inp_hash);
+		lck_mtx_unlock(mtx);
 
 		LIST_REMOVE(inp, inp_portlist);
 		inp->inp_portlist.le_next = NULL;
 		inp->inp_portlist.le_prev = NULL;
 		if (LIST_EMPTY(&phd->phd_pcblist)) {
 			LIST_REMOVE(phd, phd_hash);
+		} else {
+			phd = NULL;
+		}
+		lck_mtx_unlock(portmtx);
+		if (phd != NULL) {
 			kfree_type(struct inpcbport, phd);
 		}
 		inp->inp_phd = NULL;
@@ -2807,8 +3198,8 @@ in_pcbremlists(struct inpcb *inp)
 		/* Remove from time-wait queue */
 		tcp_remove_from_time_wait(inp);
 		inp->inp_flags2 &= ~INP2_TIMEWAIT;
-		VERIFY(inp->inp_pcbinfo->ipi_twcount != 0);
-		inp->inp_pcbinfo->ipi_twcount--;
+		VERIFY(pcbinfo->ipi_twcount != 0);
+		pcbinfo->ipi_twcount--;
 	} else {
 		/* Remove from global inp list if it is not time-wait */
 		LIST_REMOVE(inp, inp_list);
@@ -2819,7 +3210,7 @@ in_pcbremlists(struct inpcb *inp)
 		VERIFY(!(inp->inp_flags2 & INP2_IN_FCTREE));
 	}
 
-	inp->inp_pcbinfo->ipi_count--;
+	pcbinfo->ipi_count--;
 }
 
 /*
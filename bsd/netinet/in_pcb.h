@@ -79,6 +79,7 @@
 #include <sys/bitstring.h>
 #include <sys/tree.h>
 #include <kern/locks.h>
+#include <kern/smr.h>
 #include <kern/zalloc.h>
 #include <netinet/in_stat.h>
 #endif /* BSD_KERNEL_PRIVATE */
@@ -154,7 +155,7 @@ struct inp_necp_attributes {
  */
 struct inpcb {
 	decl_lck_mtx_data(, inpcb_mtx); /* inpcb per-socket mutex */
-	LIST_ENTRY(inpcb) inp_hash;     /* hash list */
+	struct smrq_link inp_hash;      /* hash list (SMR) */
 	LIST_ENTRY(inpcb) inp_list;     /* list for all PCBs of this proto */
 	void    *inp_ppcb;              /* pointer to per-protocol pcb */
 	struct inpcbinfo *inp_pcbinfo;  /* PCB list info */
@@ -612,16 +613,33 @@ struct inpcbinfo {
 
 	/*
 	 * Per-protocol hash of pcbs, hashed by local and foreign
-	 * addresses and port numbers.
+	 * addresses and port numbers.  Chains are modified with the
+	 * bucket's stripe of ipi_hashlocks held, and may be walked
+	 * either under that lock or inside an smr_global_enter()
+	 * section; see in_pcblookup_hash().
 	 */
-	struct inpcbhead        *ipi_hashbase;
+	struct smrq_list_head   *ipi_hashbase;
 	u_long                  ipi_hashmask;
+	lck_mtx_t               *ipi_hashlocks;
+	u_long                  ipi_hashlockmask;
 
 	/*
-	 * Per-protocol hash of pcbs, hashed by only local port number.
+	 * Per-protocol hash of pcbs, hashed by only local port number,
+	 * protected by the bucket's stripe of ipi_porthashlocks.
 	 */
 	struct inpcbporthead    *ipi_porthashbase;
 	u_long                  ipi_porthashmask;
+	lck_mtx_t               *ipi_porthashlocks;
+	u_long                  ipi_porthashlockmask;
+
+	/*
+	 * SO_REUSEPORT_LB groups of listeners, hashed by local port.
+	 * Groups are replaced rather than modified, with ipi_lbgrouplock
+	 * held, and are looked up inside an smr_global_enter() section.
+	 */
+	struct smrq_slist_head  *ipi_lbgrouphashbase;
+	u_long                  ipi_lbgrouphashmask;
+	lck_mtx_t               ipi_lbgrouplock;
 
 	/*
 	 * Misc.
@@ -639,6 +657,36 @@ struct inpcbinfo {
 #define INP_PCBPORTHASH(lport, mask) \
 	(ntohs((lport)) & (mask))
 
+/*
+ * A load-balancing group: the listeners that share a local address
+ * and port through SO_REUSEPORT_LB, among which incoming connections
+ * are spread by flow hash.  A group is immutable once published; a
+ * join or leave publishes a copy and retires the old one.
+ */
+struct inpcblbgroup {
+	struct smrq_slink       il_link;        /* ipi_lbgrouphashbase chain */
+	u_short                 il_lport;       /* local port */
+	u_char                  il_vflag;       /* INP_IPV4 and/or INP_IPV6 */
+	uint32_t                il_count;       /* number of members */
+	union {
+		struct in_addr_4in6 il46_local;
+		struct in6_addr il6_local;
+	} il_dependladdr;
+	struct inpcb            *il_inp[];      /* members */
+};
+
+#define il_laddr        il_dependladdr.il46_local.ia46_addr4
+#define il6_laddr       il_dependladdr.il6_local
+
+/*
+ * Bucket locks are striped over the hash tables; they are leaf locks,
+ * taken after ipi_lock and the socket lock, port hash before hash.
+ */
+#define INP_HASHLOCK(ipi, bucket) \
+	(&(ipi)->ipi_hashlocks[(bucket) & (ipi)->ipi_hashlockmask])
+#define INP_PORTHASHLOCK(ipi, bucket) \
+	(&(ipi)->ipi_porthashlocks[(bucket) & (ipi)->ipi_porthashlockmask])
+
 #define INP_IS_FLOW_CONTROLLED(_inp_) \
 	((_inp_)->inp_flags & INP_FLOW_CONTROLLED)
 #define INP_IS_FLOW_SUSPENDED(_inp_) \
@@ -742,6 +790,7 @@ struct inpcbinfo {
 #define INP2_NO_IFF_CONSTRAINED 0x00000800 /* do not use constrained interface */
 #define INP2_DONTFRAG           0x00001000 /* mark the DF bit in the IP header to avoid fragmentation */
 #define INP2_SCOPED_BY_NECP     0x00002000 /* NECP scoped the pcb */
+#define INP2_INLBGROUP          0x00004000 /* pcb is in an SO_REUSEPORT_LB group */
 
 /*
  * Flags passed to in_pcblookup*() functions.
@@ -799,6 +848,7 @@ extern void in_pcbdetach(struct inpcb *);
 extern void in_pcbdispose(struct inpcb *);
 extern void in_pcbdisconnect(struct inpcb *);
 extern int in_pcbinshash(struct inpcb *, int);
+extern lck_mtx_t *in_pcbhash_lock(struct inpcb *);
 extern int in_pcbladdr(struct inpcb *, struct sockaddr *, struct in_addr *,
     unsigned int, struct ifnet **, int);
 extern struct inpcb *in_pcblookup_local(struct inpcbinfo *, struct in_addr,
@@ -809,6 +859,11 @@ extern struct inpcb *in_pcblookup_hash(struct inpcbinfo *, struct in_addr,
     u_int, struct in_addr, u_int, int, struct ifnet *);
 extern int in_pcblookup_hash_exists(struct inpcbinfo *, struct in_addr,
     u_int, struct in_addr, u_int, int, uid_t *, gid_t *, struct ifnet *);
+extern boolean_t in_pcb_smr_acquire(struct inpcb *, struct ifnet *);
+extern void in_pcblbgroup_join(struct inpcb *);
+extern void in_pcblbgroup_leave(struct inpcb *);
+extern struct inpcb *in_pcblookup_lbgroup(struct inpcbinfo *, u_char,
+    const void *, u_short, const void *, u_short, struct ifnet *);
 extern void in_pcbnotifyall(struct inpcbinfo *, struct in_addr, int,
     void (*)(struct inpcb *, int));
 extern void in_pcbrehash(struct inpcb *);
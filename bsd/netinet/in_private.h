@@ -268,6 +268,11 @@ extern u_int32_t in_netof(struct in_addr);
 
 extern uint32_t os_cpu_in_cksum_mbuf(struct mbuf *m, int len, int off,
     uint32_t initial_sum);
+#if defined(__x86_64__)
+/* 0: scalar, 1: SSE2, 2: AVX2; see cpu_in_cksum_gen.c */
+extern uint32_t os_cpu_in_cksum_simd;
+extern int os_cpu_in_cksum_simd_set(uint32_t);
+#endif /* __x86_64__ */
 
 extern uint16_t inet_cksum(struct mbuf *, uint32_t, uint32_t, uint32_t);
 extern uint16_t inet_cksum_buffer(const void *__sized_by(__len), uint32_t, uint32_t, uint32_t __len);
@@ -127,7 +127,7 @@ static struct protosw inetsw[] = {
 		.pr_type =              SOCK_DGRAM,
 		.pr_protocol =          IPPROTO_UDP,
 		.pr_flags =             PR_ATOMIC | PR_ADDR | PR_PROTOLOCK | PR_PCBLOCK |
-    PR_EVCONNINFO | PR_PRECONN_WRITE,
+    PR_EVCONNINFO | PR_PRECONN_WRITE | PR_DATA_CKSUM,
 		.pr_input =             udp_input,
 		.pr_ctlinput =          udp_ctlinput,
 		.pr_ctloutput =         udp_ctloutput,
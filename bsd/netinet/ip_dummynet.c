@@ -62,10 +62,12 @@
  * Here you mainly find the following blocks of code:
  *  + variable declarations;
  *  + heap management functions;
+ *  + the calendar queues of timed events;
  *  + scheduler and dummynet functions;
  *  + configuration and initialization.
  *
- * NOTA BENE: critical sections are protected by the "dummynet lock".
+ * NOTA BENE: critical sections are protected by the dummynet locks,
+ * see the comment above dn_lock.
  *
  * Most important Changes:
  *
@@ -89,6 +91,7 @@
 #include <sys/socketvar.h>
 #include <sys/time.h>
 #include <sys/sysctl.h>
+#include <kern/clock.h>
 #include <net/if.h>
 #include <net/route.h>
 #include <net/kpi_protocol.h>
@@ -130,19 +133,33 @@ static int red_lookup_depth = 256;      /* RED - default lookup table depth */
 static int red_avg_pkt_size = 512;      /* RED - default medium packet size */
 static int red_max_pkt_size = 1500;     /* RED - default max packet size */
 
+/* ticks with a chain of packets still being sent, see transmit_event() */
 static int serialize = 0;
 
+#if (DEVELOPMENT || DEBUG)
+/* packets from debug.test.dummynet_pps, counted and freed on the way out */
+#define DN_TO_TEST      0x100
+static uint32_t dn_test_done;
+#endif /* DEVELOPMENT || DEBUG */
+
 /*
- * Three heaps contain queues and pipes that the scheduler handles:
+ * Three calendar queues, keyed by tick, contain queues and pipes that
+ * the scheduler handles:
  *
- * ready_heap contains all dn_flow_queue related to fixed-rate pipes.
+ * ready_calq contains all dn_flow_queue related to fixed-rate pipes.
  *
- * wfq_ready_heap contains the pipes associated with WF2Q flows
+ * wfq_ready_calq contains the pipes associated with WF2Q flows
  *
- * extract_heap contains pipes associated with delay lines.
+ * extract_calq contains pipes associated with delay lines.
  *
+ * With one bucket per tick the calendar spans about a second.  The
+ * calendars are shared by all pipes and covered by dn_sched_lock.
  */
-static struct dn_heap ready_heap, extract_heap, wfq_ready_heap;
+static struct calq ready_calq, extract_calq, wfq_ready_calq;
+
+/* pipes with idle WF2Q flow_queues to expire, swept on every tick */
+static TAILQ_HEAD(, dn_pipe) dn_idle_pipes =
+    TAILQ_HEAD_INITIALIZER(dn_idle_pipes);
 
 static int heap_init(struct dn_heap *h, int size);
 static int heap_insert(struct dn_heap *h, dn_key key1, void *p);
@@ -163,8 +180,9 @@ static void     ready_event_wfq(struct dn_pipe *p, struct mbuf **head,
  */
 static void dummynet_send(struct mbuf *m);
 
-#define HASHSIZE        16
-#define HASH(num)       ((((num) >> 8) ^ ((num) >> 4) ^ (num)) & 0x0f)
+/* pipe and flow set numbers are 16 bits; keep chains short with 10k pipes */
+#define HASHSIZE        1024
+#define HASH(num)       (((num) ^ ((num) >> 10)) & (HASHSIZE - 1))
 static struct dn_pipe_head      pipehash[HASHSIZE];     /* all pipes */
 static struct dn_flow_set_head  flowsethash[HASHSIZE];  /* all flowsets */
 
@@ -175,10 +193,12 @@ SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, hash_size,
     CTLFLAG_RW | CTLFLAG_LOCKED, &dn_hash_size, 0, "Default hash table size");
 SYSCTL_QUAD(_net_inet_ip_dummynet, OID_AUTO, curr_time,
     CTLFLAG_RD | CTLFLAG_LOCKED, &curr_time, "Current tick");
-SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, ready_heap,
-    CTLFLAG_RD | CTLFLAG_LOCKED, &ready_heap.size, 0, "Size of ready heap");
-SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, extract_heap,
-    CTLFLAG_RD | CTLFLAG_LOCKED, &extract_heap.size, 0, "Size of extract heap");
+SYSCTL_UINT(_net_inet_ip_dummynet, OID_AUTO, ready_heap,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &ready_calq.cq_count, 0,
+    "Events in the ready queue");
+SYSCTL_UINT(_net_inet_ip_dummynet, OID_AUTO, extract_heap,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &extract_calq.cq_count, 0,
+    "Events in the extract queue");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, searches,
     CTLFLAG_RD | CTLFLAG_LOCKED, &searches, 0, "Number of queue searches");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, search_steps,
@@ -207,9 +227,24 @@ SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, debug, CTLFLAG_RW | CTLFLAG_LOCKED,
 #define DPRINTF(X)
 #endif
 
-/* dummynet lock */
-static LCK_GRP_DECLARE(dn_mutex_grp, "dn");
-static LCK_MTX_DECLARE(dn_mutex, &dn_mutex_grp);
+/*
+ * dummynet locks, taken in this order:
+ *
+ * dn_lock covers the pipe and flow set hash tables and the parameters
+ * of every pipe and flow set.  Configuration takes it exclusive; the
+ * packet path and the tick take it shared, so pipes and flow sets stay
+ * around while they run.
+ *
+ * pipe_lock covers a pipe's delay line and WF2Q state, its flow sets
+ * and their flow_queues.  A WF2Q flow set is scheduled on its parent
+ * pipe's heaps, so it is covered by the parent's lock; fs->pipe is only
+ * set and cleared with dn_lock exclusive.
+ *
+ * dn_sched_lock covers the calendars, dn_idle_pipes and timer_enabled.
+ */
+static LCK_GRP_DECLARE(dn_lock_grp, "dn");
+static LCK_RW_DECLARE(dn_lock, &dn_lock_grp);
+static LCK_MTX_DECLARE(dn_sched_lock, &dn_lock_grp);
 
 static int config_pipe(struct dn_pipe *p);
 static int ip_dn_ctl(struct sockopt *sopt);
@@ -694,6 +729,96 @@ heap_free(struct dn_heap *h)
  * --- end of heap management functions ---
  */
 
+/*
+ * File an event on one of the calendars.  An object is there at most
+ * once; if it is already, the earlier of the two times is kept, and
+ * the event handler reschedules it as needed when it runs.
+ */
+static void
+dn_schedule(struct calq *cq, struct calq_entry *ce, dn_key key)
+{
+	lck_mtx_lock(&dn_sched_lock);
+	if (calq_queued(ce)) {
+		if (DN_KEY_LEQ(ce->ce_key, key)) {
+			goto done;
+		}
+		calq_remove(cq, ce);
+	}
+	calq_insert(cq, ce, key);
+done:
+	lck_mtx_unlock(&dn_sched_lock);
+}
+
+static void
+dn_unschedule(struct calq *cq, struct calq_entry *ce)
+{
+	lck_mtx_lock(&dn_sched_lock);
+	if (calq_queued(ce)) {
+		calq_remove(cq, ce);
+	}
+	lck_mtx_unlock(&dn_sched_lock);
+}
+
+/*
+ * Take the earliest event off a calendar if it is due.  The caller
+ * handles it under the lock of the pipe it belongs to.
+ */
+static struct calq_entry *
+dn_next_event(struct calq *cq)
+{
+	struct calq_entry *ce;
+
+	lck_mtx_lock(&dn_sched_lock);
+	ce = calq_first(cq);
+	if (ce != NULL && DN_KEY_LEQ(ce->ce_key, curr_time)) {
+		calq_remove(cq, ce);
+	} else {
+		ce = NULL;
+	}
+	lck_mtx_unlock(&dn_sched_lock);
+	return ce;
+}
+
+/* keep a pipe on dn_idle_pipes while its idle_heap has entries */
+static void
+dn_idle_update_locked(struct dn_pipe *p)
+{
+	bool linked = (p->idle_link.tqe_prev != NULL);
+
+	LCK_MTX_ASSERT(&dn_sched_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (p->idle_heap.elements > 0 && !linked) {
+		TAILQ_INSERT_TAIL(&dn_idle_pipes, p, idle_link);
+	} else if (p->idle_heap.elements == 0 && linked) {
+		TAILQ_REMOVE(&dn_idle_pipes, p, idle_link);
+		p->idle_link.tqe_next = NULL;
+		p->idle_link.tqe_prev = NULL;
+	}
+}
+
+static void
+dn_idle_update(struct dn_pipe *p)
+{
+	lck_mtx_lock(&dn_sched_lock);
+	dn_idle_update_locked(p);
+	lck_mtx_unlock(&dn_sched_lock);
+}
+
+/*
+ * Advance the simulation time.  All time measurements are in
+ * milliseconds; the packet path and the tick both update it, so it
+ * only moves forward.
+ */
+static void
+dn_update_time(void)
+{
+	struct timeval tv;
+
+	microuptime(&tv);
+	os_atomic_max(&curr_time,
+	    (dn_key)((tv.tv_sec * 1000) + (tv.tv_usec / 1000)), relaxed);
+}
+
 /*
  * Return the mbuf tag holding the dummynet state.  As an optimization
  * this is assumed to be the first tag on the list.  If this turns out
@@ -739,9 +864,14 @@ transmit_event(struct dn_pipe *pipe, struct mbuf **head, struct mbuf **tail)
 	struct dn_pkt_tag *pkt = NULL;
 	u_int64_t schedule_time;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
-	ASSERT(serialize >= 0);
-	if (serialize == 0) {
+	LCK_MTX_ASSERT(&pipe->pipe_lock, LCK_MTX_ASSERT_OWNED);
+	ASSERT(os_atomic_load(&serialize, relaxed) >= 0);
+	/*
+	 * While a tick sends its chain, others leave packets in the delay
+	 * line so that each pipe's packets go out in order.  The tick that
+	 * holds the count keeps adding to its own chain.
+	 */
+	if (os_atomic_load(&serialize, relaxed) == 0 || *head != NULL) {
 		while ((m = pipe->head) != NULL) {
 			pkt = dn_tag_get(m);
 			if (!DN_KEY_LEQ(pkt->dn_output_time, curr_time)) {
@@ -765,13 +895,9 @@ transmit_event(struct dn_pipe *pipe, struct mbuf **head, struct mbuf **tail)
 	schedule_time = pkt == NULL || DN_KEY_LEQ(pkt->dn_output_time, curr_time) ?
 	    curr_time + 1 : pkt->dn_output_time;
 
-	/* if there are leftover packets, put the pipe into the heap for next ready event */
+	/* if there are leftover packets, schedule the pipe for the next ready event */
 	if ((m = pipe->head) != NULL) {
-		pkt = dn_tag_get(m);
-		/* XXX should check errors on heap_insert, by draining the
-		 * whole pipe p and hoping in the future we are more successful
-		 */
-		heap_insert(&extract_heap, schedule_time, pipe);
+		dn_schedule(&extract_calq, &pipe->extract_ent, schedule_time);
 	}
 }
 
@@ -830,12 +956,11 @@ ready_event(struct dn_flow_queue *q, struct mbuf **head, struct mbuf **tail)
 	struct dn_pipe *p = q->fs->pipe;
 	int p_was_empty;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
-
 	if (p == NULL) {
 		printf("dummynet: ready_event pipe is gone\n");
 		return;
 	}
+	LCK_MTX_ASSERT(&p->pipe_lock, LCK_MTX_ASSERT_OWNED);
 	p_was_empty = (p->head == NULL);
 
 	/*
@@ -866,10 +991,7 @@ ready_event(struct dn_flow_queue *q, struct mbuf **head, struct mbuf **tail)
 	if ((pkt = q->head) != NULL) { /* this implies bandwidth != 0 */
 		dn_key t = SET_TICKS(pkt, q, p); /* ticks i have to wait */
 		q->sched_time = curr_time;
-		heap_insert(&ready_heap, curr_time + t, (void *)q );
-		/* XXX should check errors on heap_insert, and drain the whole
-		 * queue on error hoping next time we are luckier.
-		 */
+		dn_schedule(&ready_calq, &q->ready_ent, curr_time + t);
 	} else { /* RED needs to know when the queue becomes empty */
 		q->q_time = curr_time;
 		q->numbytes = 0;
@@ -899,7 +1021,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 	struct dn_heap *neh = &(p->not_eligible_heap);
 	int64_t p_numbytes = p->numbytes;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_MTX_ASSERT(&p->pipe_lock, LCK_MTX_ASSERT_OWNED);
 
 	if (p->if_name[0] == 0) { /* tx clock is simulated */
 		p_numbytes += (curr_time - p->sched_time) * p->bandwidth;
@@ -933,6 +1055,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 			if (q->len == 0) { /* Flow not backlogged any more */
 				fs->backlogged--;
 				heap_insert(&(p->idle_heap), q->F, q);
+				dn_idle_update(p);
 			} else { /* still backlogged */
 				/*
 				 * update F and position in backlogged queue, then
@@ -984,6 +1107,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 		p->sum = 0;
 		p->V = 0;
 		p->idle_heap.elements = 0;
+		dn_idle_update(p);
 	}
 	/*
 	 * If we are getting clocks from dummynet (not a real interface) and
@@ -998,10 +1122,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 		}
 		dn_tag_get(p->tail)->dn_output_time += t;
 		p->sched_time = curr_time;
-		heap_insert(&wfq_ready_heap, curr_time + t, (void *)p);
-		/* XXX should check errors on heap_insert, and drain the whole
-		 * queue on error hoping next time we are luckier.
-		 */
+		dn_schedule(&wfq_ready_calq, &p->wfq_ent, curr_time + t);
 	}
 
 	/* Fit (adjust if necessary) 64bit result into 32bit variable. */
@@ -1029,73 +1150,82 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 static void
 dummynet(__unused void * unused)
 {
-	void *p; /* generic parameter to handler */
-	struct dn_heap *h;
-	struct dn_heap *heaps[3];
+	struct calq_entry *ce;
+	struct calq *calqs[3];
 	struct mbuf *head = NULL, *tail = NULL;
 	int i;
-	struct dn_pipe *pe;
+	struct dn_pipe *pe, *pe1;
 	struct timespec ts;
-	struct timeval      tv;
+	bool sending = false;
 
-	heaps[0] = &ready_heap;         /* fixed-rate queues */
-	heaps[1] = &wfq_ready_heap;     /* wfq queues */
-	heaps[2] = &extract_heap;       /* delay line */
+	calqs[0] = &ready_calq;         /* fixed-rate queues */
+	calqs[1] = &wfq_ready_calq;     /* wfq queues */
+	calqs[2] = &extract_calq;       /* delay line */
 
-	lck_mtx_lock(&dn_mutex);
-
-	/* make all time measurements in milliseconds (ms) -
-	 * here we convert secs and usecs to msecs (just divide the
-	 * usecs and take the closest whole number).
-	 */
-	microuptime(&tv);
-	curr_time = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	lck_rw_lock_shared(&dn_lock);
+	dn_update_time();
 
 	for (i = 0; i < 3; i++) {
-		h = heaps[i];
-		while (h->elements > 0 && DN_KEY_LEQ(h->p[0].key, curr_time)) {
-			if (h->p[0].key > curr_time) {
-				printf("dummynet: warning, heap %d is %d ticks late\n",
-				    i, (int)(curr_time - h->p[0].key));
-			}
-			p = h->p[0].object; /* store a copy before heap_extract */
-			heap_extract(h, NULL); /* need to extract before processing */
+		while ((ce = dn_next_event(calqs[i])) != NULL) {
+			struct dn_pipe *pipe;
+
 			if (i == 0) {
-				ready_event(p, &head, &tail);
+				struct dn_flow_queue *q = __container_of(ce,
+				    struct dn_flow_queue, ready_ent);
+
+				/* fixed-rate queues belong to the pipe's own flow set */
+				pipe = q->fs->pipe;
+				lck_mtx_lock(&pipe->pipe_lock);
+				ready_event(q, &head, &tail);
 			} else if (i == 1) {
-				struct dn_pipe *pipe = p;
+				pipe = __container_of(ce, struct dn_pipe, wfq_ent);
+				lck_mtx_lock(&pipe->pipe_lock);
 				if (pipe->if_name[0] != '\0') {
 					printf("dummynet: bad ready_event_wfq for pipe %s\n",
 					    pipe->if_name);
 				} else {
-					ready_event_wfq(p, &head, &tail);
+					ready_event_wfq(pipe, &head, &tail);
 				}
 			} else {
-				transmit_event(p, &head, &tail);
+				pipe = __container_of(ce, struct dn_pipe, extract_ent);
+				lck_mtx_lock(&pipe->pipe_lock);
+				transmit_event(pipe, &head, &tail);
+			}
+			/* hold off other senders before the pipe is unlocked */
+			if (head != NULL && !sending) {
+				os_atomic_inc(&serialize, relaxed);
+				sending = true;
 			}
+			lck_mtx_unlock(&pipe->pipe_lock);
 		}
 	}
-	/* sweep pipes trying to expire idle flow_queues */
-	for (i = 0; i < HASHSIZE; i++) {
-		SLIST_FOREACH(pe, &pipehash[i], next) {
-			if (pe->idle_heap.elements > 0 &&
-			    DN_KEY_LT(pe->idle_heap.p[0].key, pe->V)) {
-				struct dn_flow_queue *q = pe->idle_heap.p[0].object;
-
-				heap_extract(&(pe->idle_heap), NULL);
-				q->S = q->F + 1; /* mark timestamp as invalid */
-				pe->sum -= q->fs->weight;
-			}
+
+	lck_mtx_lock(&dn_sched_lock);
+	/*
+	 * Sweep pipes trying to expire idle flow_queues.  The pipe lock
+	 * comes before dn_sched_lock, so a busy pipe waits for the next tick.
+	 */
+	TAILQ_FOREACH_SAFE(pe, &dn_idle_pipes, idle_link, pe1) {
+		if (!lck_mtx_try_lock(&pe->pipe_lock)) {
+			continue;
+		}
+		if (DN_KEY_LT(pe->idle_heap.p[0].key, pe->V)) {
+			struct dn_flow_queue *q = pe->idle_heap.p[0].object;
+
+			heap_extract(&(pe->idle_heap), NULL);
+			q->S = q->F + 1; /* mark timestamp as invalid */
+			pe->sum -= q->fs->weight;
+			dn_idle_update_locked(pe);
 		}
+		lck_mtx_unlock(&pe->pipe_lock);
 	}
 
-	/* check the heaps to see if there's still stuff in there, and
+	/* check the calendars to see if there's still stuff in there, and
 	 * only set the timer if there are packets to process
 	 */
 	timer_enabled = 0;
 	for (i = 0; i < 3; i++) {
-		h = heaps[i];
-		if (h->elements > 0) { // set the timer
+		if (calqs[i]->cq_count > 0) { // set the timer
 			ts.tv_sec = 0;
 			ts.tv_nsec = 1 * 1000000;       // 1ms
 			timer_enabled = 1;
@@ -1103,19 +1233,14 @@ dummynet(__unused void * unused)
 			break;
 		}
 	}
+	lck_mtx_unlock(&dn_sched_lock);
 
-	if (head != NULL) {
-		serialize++;
-	}
-
-	lck_mtx_unlock(&dn_mutex);
+	lck_rw_unlock_shared(&dn_lock);
 
 	/* Send out the de-queued list of ready-to-send packets */
 	if (head != NULL) {
 		dummynet_send(head);
-		lck_mtx_lock(&dn_mutex);
-		serialize--;
-		lck_mtx_unlock(&dn_mutex);
+		os_atomic_dec(&serialize, relaxed);
 	}
 }
 
@@ -1167,6 +1292,12 @@ dummynet_send(struct mbuf *m)
 		case DN_TO_IP6_IN:
 			proto_inject(PF_INET6, m);
 			break;
+#if (DEVELOPMENT || DEBUG)
+		case DN_TO_TEST:
+			m_freem(m);
+			os_atomic_inc(&dn_test_done, relaxed);
+			break;
+#endif /* DEVELOPMENT || DEBUG */
 		default:
 			printf("dummynet: bad switch %d!\n", pkt->dn_dir);
 			m_freem(m);
@@ -1308,9 +1439,9 @@ find_queue(struct dn_flow_set *fs, struct ip_flow_id *id)
 		}
 		i = i % fs->rq_size;
 		/* finally, scan the current list for a match */
-		searches++;
+		os_atomic_inc(&searches, relaxed);
 		for (prev = NULL, q = fs->rq[i]; q;) {
-			search_steps++;
+			os_atomic_inc(&search_steps, relaxed);
 			if (is_v6 &&
 			    IN6_ARE_ADDR_EQUAL(&id->dst_ip6, &q->id.dst_ip6) &&
 			    IN6_ARE_ADDR_EQUAL(&id->src_ip6, &q->id.src_ip6) &&
@@ -1517,12 +1648,13 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 	struct dn_pkt_tag *pkt;
 	struct m_tag *mtag;
 	struct dn_flow_set *fs = NULL;
-	struct dn_pipe *pipe;
+	struct dn_pipe *pipe = NULL;
 	u_int32_t len = m->m_pkthdr.len;
 	struct dn_flow_queue *q = NULL;
 	int is_pipe = 0;
+	bool locked = false;
+	int error;
 	struct timespec ts;
-	struct timeval      tv;
 
 	DPRINTF(("dummynet_io m: 0x%llx pipe: %d dir: %d\n",
 	    (uint64_t)VM_KERNEL_ADDRPERM(m), pipe_nr, dir));
@@ -1534,14 +1666,8 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 
 	pipe_nr &= 0xffff;
 
-	lck_mtx_lock(&dn_mutex);
-
-	/* make all time measurements in milliseconds (ms) -
-	 * here we convert secs and usecs to msecs (just divide the
-	 * usecs and take the closest whole number).
-	 */
-	microuptime(&tv);
-	curr_time = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	lck_rw_lock_shared(&dn_lock);
+	dn_update_time();
 
 	/*
 	 * This is a dummynet rule, so we expect an O_PIPE or O_QUEUE rule.
@@ -1560,17 +1686,13 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 		goto dropit; /* this queue/pipe does not exist! */
 	}
 	pipe = fs->pipe;
-	if (pipe == NULL) { /* must be a queue, try find a matching pipe */
-		pipe = locate_pipe(fs->parent_nr);
-
-		if (pipe != NULL) {
-			fs->pipe = pipe;
-		} else {
-			printf("dummynet: no pipe %d for queue %d, drop pkt\n",
-			    fs->parent_nr, fs->fs_nr);
-			goto dropit;
-		}
+	if (pipe == NULL) { /* must be a queue without its pipe */
+		printf("dummynet: no pipe %d for queue %d, drop pkt\n",
+		    fs->parent_nr, fs->fs_nr);
+		goto dropit;
 	}
+	lck_mtx_lock(&pipe->pipe_lock);
+	locked = true;
 	q = find_queue(fs, &(fwa->fwa_id));
 	if (q == NULL) {
 		goto dropit;    /* cannot allocate queue		*/
@@ -1681,7 +1803,7 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 	 */
 	if (is_pipe) {
 		/*
-		 * Fixed-rate queue: just insert into the ready_heap.
+		 * Fixed-rate queue: just file it on the ready_calq.
 		 */
 		dn_key t = 0;
 		if (pipe->bandwidth) {
@@ -1691,7 +1813,7 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 		if (t == 0) { /* must process it now */
 			ready_event( q, &head, &tail );
 		} else {
-			heap_insert(&ready_heap, curr_time + t, q );
+			dn_schedule(&ready_calq, &q->ready_ent, curr_time + t);
 		}
 	} else {
 		/*
@@ -1708,6 +1830,7 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 			pipe->sum += fs->weight; /* add weight of new queue */
 		} else {
 			heap_extract(&(pipe->idle_heap), q);
+			dn_idle_update(pipe);
 			q->S = MAX64(q->F, pipe->V );
 		}
 		q->F = q->S + (len << MY_M) / (u_int64_t) fs->weight;
@@ -1749,15 +1872,19 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa)
 		}
 	}
 done:
+	lck_mtx_unlock(&pipe->pipe_lock);
+
 	/* start the timer and set global if not already set */
+	lck_mtx_lock(&dn_sched_lock);
 	if (!timer_enabled) {
 		ts.tv_sec = 0;
 		ts.tv_nsec = 1 * 1000000;       // 1ms
 		timer_enabled = 1;
 		bsd_timeout(dummynet, NULL, &ts);
 	}
+	lck_mtx_unlock(&dn_sched_lock);
 
-	lck_mtx_unlock(&dn_mutex);
+	lck_rw_unlock_shared(&dn_lock);
 
 	if (head != NULL) {
 		dummynet_send(head);
@@ -1769,9 +1896,13 @@ dropit:
 	if (q) {
 		q->drops++;
 	}
-	lck_mtx_unlock(&dn_mutex);
+	error = (fs && (fs->flags_fs & DN_NOERROR)) ? 0 : ENOBUFS;
+	if (locked) {
+		lck_mtx_unlock(&pipe->pipe_lock);
+	}
+	lck_rw_unlock_shared(&dn_lock);
 	m_freem(m);
-	return (fs && (fs->flags_fs & DN_NOERROR)) ? 0 : ENOBUFS;
+	return error;
 }
 
 /*
@@ -1792,7 +1923,7 @@ dropit:
  * Dispose all packets and flow_queues on a flow_set.
  * If all=1, also remove red lookup table and other storage,
  * including the descriptor itself.
- * For the one in dn_pipe MUST also cleanup ready_heap...
+ * Queues waiting on ready_calq are taken off it.
  */
 static void
 purge_flow_set(struct dn_flow_set *fs, int all)
@@ -1800,7 +1931,7 @@ purge_flow_set(struct dn_flow_set *fs, int all)
 	struct dn_flow_queue *q, *qn;
 	int i;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_RW_ASSERT(&dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
 	for (i = 0; i <= fs->rq_size; i++) {
 		for (q = fs->rq[i]; q; q = qn) {
@@ -1812,6 +1943,7 @@ purge_flow_set(struct dn_flow_set *fs, int all)
 				DN_FREE_PKT(m);
 			}
 			qn = q->next;
+			dn_unschedule(&ready_calq, &q->ready_ent);
 			kfree_type(struct dn_flow_queue, q);
 		}
 		fs->rq[i] = NULL;
@@ -1851,6 +1983,11 @@ purge_pipe(struct dn_pipe *pipe)
 	heap_free( &(pipe->scheduler_heap));
 	heap_free( &(pipe->not_eligible_heap));
 	heap_free( &(pipe->idle_heap));
+	dn_idle_update(pipe);
+
+	/* and take it off the calendars */
+	dn_unschedule(&wfq_ready_calq, &pipe->wfq_ent);
+	dn_unschedule(&extract_calq, &pipe->extract_ent);
 }
 
 /*
@@ -1863,16 +2000,11 @@ dummynet_flush(void)
 	struct dn_flow_set *fs, *fs1;
 	int i;
 
-	lck_mtx_lock(&dn_mutex);
-
-
-	/* Free heaps so we don't have unwanted events. */
-	heap_free(&ready_heap);
-	heap_free(&wfq_ready_heap);
-	heap_free(&extract_heap);
+	lck_rw_lock_exclusive(&dn_lock);
 
 	/*
-	 * Now purge all queued pkts and delete all pipes.
+	 * Purge all queued pkts and delete all pipes; this takes them
+	 * off the calendars so we don't have unwanted events.
 	 *
 	 * XXXGL: can we merge the for(;;) cycles into one or not?
 	 */
@@ -1886,10 +2018,11 @@ dummynet_flush(void)
 		SLIST_FOREACH_SAFE(pipe, &pipehash[i], next, pipe1) {
 			SLIST_REMOVE(&pipehash[i], pipe, dn_pipe, next);
 			purge_pipe(pipe);
+			lck_mtx_destroy(&pipe->pipe_lock, &dn_lock_grp);
 			kfree_type(struct dn_pipe, pipe);
 		}
 	}
-	lck_mtx_unlock(&dn_mutex);
+	lck_rw_done(&dn_lock);
 }
 
 /*
@@ -2029,7 +2162,7 @@ config_pipe(struct dn_pipe *p)
 	if (p->pipe_nr != 0) { /* this is a pipe */
 		struct dn_pipe *x, *b;
 		struct dummynet_event dn_event;
-		lck_mtx_lock(&dn_mutex);
+		lck_rw_lock_exclusive(&dn_lock);
 
 		/* locate pipe */
 		b = locate_pipe(p->pipe_nr);
@@ -2038,7 +2171,7 @@ config_pipe(struct dn_pipe *p)
 			is_new = true;
 			x = kalloc_type(struct dn_pipe, Z_NOWAIT | Z_ZERO);
 			if (x == NULL) {
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				printf("dummynet: no memory for new pipe\n");
 				return ENOSPC;
 			}
@@ -2065,7 +2198,7 @@ config_pipe(struct dn_pipe *p)
 		x->delay = p->delay;
 		r = set_fs_parms(&(x->fs), pfs);
 		if (r != 0) {
-			lck_mtx_unlock(&dn_mutex);
+			lck_rw_done(&dn_lock);
 			if (is_new) { /* a new pipe */
 				kfree_type(struct dn_pipe, x);
 			}
@@ -2073,18 +2206,30 @@ config_pipe(struct dn_pipe *p)
 		}
 
 		if (x->fs.rq == NULL) { /* a new pipe */
+			struct dn_flow_set *fs;
+
 			r = alloc_hash(&(x->fs), pfs);
 			if (r) {
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				if (is_new) {
 					kfree_type(struct dn_pipe, x);
 				}
 				return r;
 			}
+			lck_mtx_init(&x->pipe_lock, &dn_lock_grp, LCK_ATTR_NULL);
 			SLIST_INSERT_HEAD(&pipehash[HASH(x->pipe_nr)],
 			    x, next);
+
+			/* adopt the queues that were waiting for this pipe */
+			for (i = 0; i < HASHSIZE; i++) {
+				SLIST_FOREACH(fs, &flowsethash[i], next) {
+					if (fs->parent_nr == x->pipe_nr) {
+						fs->pipe = x;
+					}
+				}
+			}
 		}
-		lck_mtx_unlock(&dn_mutex);
+		lck_rw_done(&dn_lock);
 
 		bzero(&dn_event, sizeof(dn_event));
 		dn_event.dn_event_code = DUMMYNET_PIPE_CONFIG;
@@ -2096,19 +2241,19 @@ config_pipe(struct dn_pipe *p)
 	} else { /* config queue */
 		struct dn_flow_set *x, *b;
 
-		lck_mtx_lock(&dn_mutex);
+		lck_rw_lock_exclusive(&dn_lock);
 		/* locate flow_set */
 		b = locate_flowset(pfs->fs_nr);
 
 		if (b == NULL || b->fs_nr != pfs->fs_nr) { /* new  */
 			is_new = true;
 			if (pfs->parent_nr == 0) { /* need link to a pipe */
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				return EINVAL;
 			}
 			x = kalloc_type(struct dn_flow_set, Z_NOWAIT | Z_ZERO);
 			if (x == NULL) {
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				printf("dummynet: no memory for new flow_set\n");
 				return ENOSPC;
 			}
@@ -2123,14 +2268,14 @@ config_pipe(struct dn_pipe *p)
 		} else {
 			/* Change parent pipe not allowed; must delete and recreate */
 			if (pfs->parent_nr != 0 && b->parent_nr != pfs->parent_nr) {
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				return EINVAL;
 			}
 			x = b;
 		}
 		r = set_fs_parms(x, pfs);
 		if (r != 0) {
-			lck_mtx_unlock(&dn_mutex);
+			lck_rw_done(&dn_lock);
 			printf("dummynet: no memory for new flow_set\n");
 			if (is_new) {
 				kfree_type(struct dn_flow_set, x);
@@ -2141,14 +2286,15 @@ config_pipe(struct dn_pipe *p)
 		if (x->rq == NULL) { /* a new flow_set */
 			r = alloc_hash(x, pfs);
 			if (r) {
-				lck_mtx_unlock(&dn_mutex);
+				lck_rw_done(&dn_lock);
 				kfree_type(struct dn_flow_set, x);
 				return r;
 			}
+			x->pipe = locate_pipe(x->parent_nr);
 			SLIST_INSERT_HEAD(&flowsethash[HASH(x->fs_nr)],
 			    x, next);
 		}
-		lck_mtx_unlock(&dn_mutex);
+		lck_rw_done(&dn_lock);
 	}
 	return 0;
 }
@@ -2175,25 +2321,6 @@ fs_remove_from_heap(struct dn_heap *h, struct dn_flow_set *fs)
 	}
 }
 
-/*
- * helper function to remove a pipe from a heap (can be there at most once)
- */
-static void
-pipe_remove_from_heap(struct dn_heap *h, struct dn_pipe *p)
-{
-	if (h->elements > 0) {
-		int i = 0;
-		for (i = 0; i < h->elements; i++) {
-			if (h->p[i].object == p) { /* found it */
-				h->elements--;
-				h->p[i] = h->p[h->elements];
-				heapify(h);
-				break;
-			}
-		}
-	}
-}
-
 /*
  * drain all queues. Called in case of severe mbuf shortage.
  */
@@ -2205,11 +2332,8 @@ dummynet_drain(void)
 	struct mbuf *m, *mnext;
 	int i;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_RW_ASSERT(&dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
-	heap_free(&ready_heap);
-	heap_free(&wfq_ready_heap);
-	heap_free(&extract_heap);
 	/* remove all references to this pipe from flow_sets */
 	for (i = 0; i < HASHSIZE; i++) {
 		SLIST_FOREACH(fs, &flowsethash[i], next) {
@@ -2227,6 +2351,8 @@ dummynet_drain(void)
 				DN_FREE_PKT(m);
 			}
 			p->head = p->tail = NULL;
+			dn_unschedule(&wfq_ready_calq, &p->wfq_ent);
+			dn_unschedule(&extract_calq, &p->extract_ent);
 		}
 	}
 }
@@ -2248,11 +2374,11 @@ delete_pipe(struct dn_pipe *p)
 		struct dn_flow_set *fs;
 		int i;
 
-		lck_mtx_lock(&dn_mutex);
+		lck_rw_lock_exclusive(&dn_lock);
 		/* locate pipe */
 		b = locate_pipe(p->pipe_nr);
 		if (b == NULL) {
-			lck_mtx_unlock(&dn_mutex);
+			lck_rw_done(&dn_lock);
 			return EINVAL; /* not found */
 		}
 
@@ -2271,23 +2397,20 @@ delete_pipe(struct dn_pipe *p)
 				}
 			}
 		}
-		fs_remove_from_heap(&ready_heap, &(b->fs));
-
-		purge_pipe(b); /* remove all data associated to this pipe */
-		/* remove reference to here from extract_heap and wfq_ready_heap */
-		pipe_remove_from_heap(&extract_heap, b);
-		pipe_remove_from_heap(&wfq_ready_heap, b);
-		lck_mtx_unlock(&dn_mutex);
+		/* remove all data associated to this pipe, and its events */
+		purge_pipe(b);
+		lck_rw_done(&dn_lock);
 
+		lck_mtx_destroy(&b->pipe_lock, &dn_lock_grp);
 		kfree_type(struct dn_pipe, b);
 	} else { /* this is a WF2Q queue (dn_flow_set) */
 		struct dn_flow_set *b;
 
-		lck_mtx_lock(&dn_mutex);
+		lck_rw_lock_exclusive(&dn_lock);
 		/* locate set */
 		b = locate_flowset(p->fs.fs_nr);
 		if (b == NULL) {
-			lck_mtx_unlock(&dn_mutex);
+			lck_rw_done(&dn_lock);
 			return EINVAL; /* not found */
 		}
 
@@ -2302,10 +2425,11 @@ delete_pipe(struct dn_pipe *p)
 			fs_remove_from_heap(&(b->pipe->scheduler_heap), b);
 #if 1   /* XXX should i remove from idle_heap as well ? */
 			fs_remove_from_heap(&(b->pipe->idle_heap), b);
+			dn_idle_update(b->pipe);
 #endif
 		}
 		purge_flow_set(b, 1);
-		lck_mtx_unlock(&dn_mutex);
+		lck_rw_done(&dn_lock);
 	}
 	return 0;
 }
@@ -2321,7 +2445,7 @@ dn_copy_set_32(struct dn_flow_set *set, char *bp)
 	struct dn_flow_queue *q;
 	struct dn_flow_queue_32 *qp = (struct dn_flow_queue_32 *)(void *)bp;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_RW_ASSERT(&dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
 	for (i = 0; i <= set->rq_size; i++) {
 		for (q = set->rq[i]; q; q = q->next, qp++) {
@@ -2358,7 +2482,7 @@ dn_copy_set_64(struct dn_flow_set *set, char *bp)
 	struct dn_flow_queue *q;
 	struct dn_flow_queue_64 *qp = (struct dn_flow_queue_64 *)(void *)bp;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_RW_ASSERT(&dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
 	for (i = 0; i <= set->rq_size; i++) {
 		for (q = set->rq[i]; q; q = q->next, qp++) {
@@ -2399,7 +2523,7 @@ dn_calc_size(int is64user)
 	size_t setsize;
 	int i;
 
-	LCK_MTX_ASSERT(&dn_mutex, LCK_MTX_ASSERT_OWNED);
+	LCK_RW_ASSERT(&dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 	if (is64user) {
 		pipesize = sizeof(struct dn_pipe_64);
 		queuesize = sizeof(struct dn_flow_queue_64);
@@ -2436,7 +2560,7 @@ dummynet_get(struct sockopt *sopt)
 	int is64user = 0;
 
 	/* XXX lock held too long */
-	lck_mtx_lock(&dn_mutex);
+	lck_rw_lock_exclusive(&dn_lock);
 	/*
 	 * XXX: Ugly, but we need to allocate memory with M_WAITOK flag
 	 * and we cannot use this flag while holding a mutex.
@@ -2446,12 +2570,12 @@ dummynet_get(struct sockopt *sopt)
 	}
 	for (i = 0; i < 10; i++) {
 		size = dn_calc_size(is64user);
-		lck_mtx_unlock(&dn_mutex);
+		lck_rw_done(&dn_lock);
 		buf = kalloc_data(size, Z_WAITOK | Z_ZERO);
 		if (buf == NULL) {
 			return ENOBUFS;
 		}
-		lck_mtx_lock(&dn_mutex);
+		lck_rw_lock_exclusive(&dn_lock);
 		if (size == dn_calc_size(is64user)) {
 			break;
 		}
@@ -2459,7 +2583,7 @@ dummynet_get(struct sockopt *sopt)
 		buf = NULL;
 	}
 	if (buf == NULL) {
-		lck_mtx_unlock(&dn_mutex);
+		lck_rw_done(&dn_lock);
 		return ENOBUFS;
 	}
 
@@ -2495,7 +2619,7 @@ dummynet_get(struct sockopt *sopt)
 			bp = dn_copy_set_64( set, bp );
 		}
 	}
-	lck_mtx_unlock(&dn_mutex);
+	lck_rw_done(&dn_lock);
 	error = sooptcopyout(sopt, buf, size);
 	kfree_data(buf, size);
 	return error;
@@ -2568,15 +2692,10 @@ dummynet_init(void)
 void
 ip_dn_init(void)
 {
-	/* setup locks */
-	ready_heap.size = ready_heap.elements = 0;
-	ready_heap.offset = 0;
-
-	wfq_ready_heap.size = wfq_ready_heap.elements = 0;
-	wfq_ready_heap.offset = 0;
-
-	extract_heap.size = extract_heap.elements = 0;
-	extract_heap.offset = 0;
+	/* one bucket per tick */
+	calq_init(&ready_calq, 0);
+	calq_init(&wfq_ready_calq, 0);
+	calq_init(&extract_calq, 0);
 	ip_dn_ctl_ptr = ip_dn_ctl;
 	ip_dn_io_ptr = dummynet_io;
 }
@@ -2609,3 +2728,112 @@ dummynet_event_enqueue_nwk_wq_entry(struct dummynet_event *p_dn_event)
 	p_ev->dn_ev_arg = *p_dn_event;
 	nwk_wq_enqueue(&p_ev->nwk_wqe);
 }
+
+#if (DEVELOPMENT || DEBUG)
+/*
+ * Packets per second through `in' pipes, from dummynet_io() through
+ * the calendars and the dummynet() tick to dummynet_send().  Each pipe
+ * delays packets by a tick and has no bandwidth limit; packets go to
+ * the pipes round robin, with at most DN_TEST_WINDOW in flight.  The
+ * pipes are numbered from DN_TEST_PIPE_BASE and must not exist yet.
+ */
+#define DN_TEST_PIPE_BASE       50000
+#define DN_TEST_PIPES_MAX       10000
+#define DN_TEST_PACKETS         (1 << 20)
+#define DN_TEST_WINDOW          (1 << 16)
+
+static int
+dn_test_pipes(uint32_t npipes, bool create)
+{
+	struct dn_pipe *p;
+	int error = 0;
+
+	p = kalloc_type(struct dn_pipe, Z_WAITOK | Z_NOFAIL);
+	for (uint32_t i = 0; i < npipes && error == 0; i++) {
+		bzero(p, sizeof(*p));
+		p->pipe_nr = DN_TEST_PIPE_BASE + i;
+		if (create) {
+			p->delay = 1;   /* ms */
+			error = config_pipe(p);
+		} else {
+			(void)delete_pipe(p);
+		}
+	}
+	kfree_type(struct dn_pipe, p);
+	return error;
+}
+
+static int
+dummynet_pps_test(int64_t in, int64_t *out)
+{
+	static uint32_t busy;
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * NSEC_PER_USEC };
+	struct ip_fw_args fwa;
+	uint32_t npipes = (uint32_t)in, sent, dropped = 0;
+	uint64_t start, deadline, ns;
+	int error = 0;
+
+	if (in <= 0 || in > DN_TEST_PIPES_MAX) {
+		return EINVAL;
+	}
+	if (!os_atomic_cmpxchg(&busy, 0, 1, acquire)) {
+		return EBUSY;
+	}
+	lck_rw_lock_shared(&dn_lock);
+	for (uint32_t i = 0; i < npipes; i++) {
+		if (locate_pipe(DN_TEST_PIPE_BASE + i) != NULL) {
+			error = EEXIST;
+			break;
+		}
+	}
+	lck_rw_done(&dn_lock);
+	if (error != 0) {
+		goto done;
+	}
+	error = dn_test_pipes(npipes, true);
+	if (error != 0) {
+		goto out;
+	}
+
+	os_atomic_store(&dn_test_done, 0, relaxed);
+	bzero(&fwa, sizeof(fwa));
+	fwa.fwa_flags = DN_IS_PIPE;
+	start = mach_absolute_time();
+	for (sent = 0; sent < DN_TEST_PACKETS; sent++) {
+		struct mbuf *m;
+
+		while (sent - os_atomic_load(&dn_test_done, relaxed) >=
+		    DN_TEST_WINDOW) {
+			(void)msleep(&dn_test_done, NULL, PSOCK, "dn_pps", &ts);
+		}
+		m = m_gethdr(M_WAITOK, MT_DATA);
+		m->m_len = m->m_pkthdr.len = 64;
+		if (dummynet_io(m, DN_TEST_PIPE_BASE + sent % npipes,
+		    DN_TO_TEST, &fwa) != 0) {
+			/* dropped, and freed */
+			os_atomic_inc(&dn_test_done, relaxed);
+			dropped++;
+		}
+	}
+	clock_interval_to_deadline(10, NSEC_PER_SEC, &deadline);
+	while (os_atomic_load(&dn_test_done, relaxed) < DN_TEST_PACKETS) {
+		if (mach_absolute_time() > deadline) {
+			error = ETIMEDOUT;
+			break;
+		}
+		(void)msleep(&dn_test_done, NULL, PSOCK, "dn_pps", &ts);
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	if (error == 0) {
+		*out = (int64_t)((uint64_t)(DN_TEST_PACKETS - dropped) *
+		    NSEC_PER_SEC / MAX(ns, 1));
+	}
+out:
+	/* anything left over is purged with the pipes */
+	(void)dn_test_pipes(npipes, false);
+done:
+	os_atomic_store(&busy, 0, release);
+	return error;
+}
+SYSCTL_TEST_REGISTER(dummynet_pps, dummynet_pps_test);
+#endif /* DEVELOPMENT || DEBUG */
@@ -61,6 +61,10 @@
 
 #ifdef PRIVATE
 #include <netinet/ip_flowid.h>
+#ifdef BSD_KERNEL_PRIVATE
+#include <kern/locks.h>
+#include <net/pktsched/pktsched_calq.h>
+#endif /* BSD_KERNEL_PRIVATE */
 
 /* Apply ipv6 mask on ipv6 addr */
 #define APPLY_MASK(addr, mask)                          \
@@ -294,6 +298,9 @@ struct dn_flow_queue {
 	 * Setting F < S means the timestamp is invalid. We only need
 	 * to test this when the queue is empty.
 	 */
+#ifdef BSD_KERNEL_PRIVATE
+	struct calq_entry ready_ent;    /* on ready_calq, keyed by finish time */
+#endif /* BSD_KERNEL_PRIVATE */
 };
 
 /*
@@ -404,6 +411,14 @@ struct dn_pipe {                /* a pipe */
 	int ready; /* set if ifp != NULL and we got a signal from it */
 
 	struct dn_flow_set fs; /* used with fixed-rate flows */
+
+#ifdef BSD_KERNEL_PRIVATE
+	/* covers the pipe, its flow sets and their flow_queues */
+	decl_lck_mtx_data(, pipe_lock);
+	struct calq_entry wfq_ent;      /* on wfq_ready_calq */
+	struct calq_entry extract_ent;  /* on extract_calq, keyed by output time */
+	TAILQ_ENTRY(dn_pipe) idle_link; /* on dn_idle_pipes while idle_heap is not empty */
+#endif /* BSD_KERNEL_PRIVATE */
 };
 
 SLIST_HEAD(dn_pipe_head, dn_pipe);
@@ -3361,6 +3361,11 @@ ip_output_checksum(struct ifnet *ifp, struct mbuf *m, int hlen, int ip_len,
 		}
 	}
 
+	/* a super-segment split in software is checksummed per segment */
+	if (GSO_IPV4_NEEDED(ifp, m)) {
+		*sw_csum &= ~CSUM_DELAY_DATA;
+	}
+
 	if (*sw_csum & CSUM_DELAY_DATA) {
 		in_delayed_cksum(m);
 		*sw_csum &= ~CSUM_DELAY_DATA;
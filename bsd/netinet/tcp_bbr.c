@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * BBR congestion control, after "BBR: Congestion-Based Congestion
+ * Control" (Cardwell et al., ACM Queue 14(5)) and draft-cardwell-iccrg-bbr.
+ *
+ * Instead of reacting to loss or delay, BBR builds a model of the path
+ * from two estimates: the bottleneck bandwidth, the windowed maximum of
+ * the delivery rate samples taken by tcp_rate_ack(), and the round-trip
+ * propagation time, the windowed minimum of the RTT samples.  Their
+ * product is the bandwidth-delay product.  Data is paced at a gain times
+ * the bandwidth estimate, and the congestion window only caps the data
+ * in flight at a small multiple of the BDP.
+ *
+ * The connection goes through four modes:
+ *  - STARTUP doubles the sending rate every round trip, until the
+ *    bandwidth estimate stops growing by a quarter over three rounds;
+ *  - DRAIN then paces below the estimate until the queue built during
+ *    startup is gone;
+ *  - PROBE_BW cycles the pacing gain through 5/4, 3/4 and six rounds of
+ *    1, to probe for more bandwidth and drain what the probe queued;
+ *  - PROBE_RTT, when the min RTT has not been refreshed for 10 seconds,
+ *    drops to four segments in flight for 200ms so that the path's
+ *    queues empty and a fresh minimum can be seen.
+ *
+ * Loss only matters during recovery, where the window is held near the
+ * data in flight for a round trip and restored afterwards.
+ */
+
+#include "tcp_includes.h"
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/random.h>
+
+#include <netinet/in.h>
+
+static int tcp_bbr_init(struct tcpcb *tp);
+static int tcp_bbr_cleanup(struct tcpcb *tp);
+static void tcp_bbr_cwnd_init(struct tcpcb *tp);
+static void tcp_bbr_pre_fr(struct tcpcb *tp);
+static void tcp_bbr_post_fr(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_after_idle(struct tcpcb *tp);
+static void tcp_bbr_after_timeout(struct tcpcb *tp);
+static int tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_switch_cc(struct tcpcb *tp);
+static void tcp_bbr_rate_sample(struct tcpcb *tp, struct tcp_rate_sample *rs);
+
+struct tcp_cc_algo tcp_cc_bbr = {
+	.name = "bbr",
+	.init = tcp_bbr_init,
+	.cleanup = tcp_bbr_cleanup,
+	.cwnd_init = tcp_bbr_cwnd_init,
+	.pre_fr = tcp_bbr_pre_fr,
+	.post_fr = tcp_bbr_post_fr,
+	.after_idle = tcp_bbr_after_idle,
+	.after_timeout = tcp_bbr_after_timeout,
+	.delay_ack = tcp_bbr_delay_ack,
+	.switch_to = tcp_bbr_switch_cc,
+	.rate_sample = tcp_bbr_rate_sample
+};
+
+/* Gains are fixed point, with BBR_UNIT being 1 */
+#define BBR_UNIT                256
+#define BBR_HIGH_GAIN           739     /* 2/ln(2): doubles the rate each round */
+#define BBR_DRAIN_GAIN          88      /* 1/BBR_HIGH_GAIN */
+#define BBR_CWND_GAIN           512     /* allows for delayed and stretched acks */
+#define BBR_FULL_BW_GROWTH      320     /* 5/4: bandwidth still growing */
+#define BBR_FULL_BW_ROUNDS      3       /* rounds without growth in STARTUP */
+#define BBR_PACING_MARGIN       99      /* percent of the estimate to pace at */
+
+#define BBR_CYCLE_LEN           8
+static const uint16_t bbr_pacing_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT
+};
+
+#define BBR_BW_ROUNDS           10      /* length of the max bandwidth filter */
+#define BBR_MIN_RTT_WIN         (10 * TCP_RETRANSHZ)
+#define BBR_PROBE_RTT_TIME      (200 * TCP_RETRANSHZ / 1000)
+#define BBR_MIN_CWND(tp)        (4 * (tp)->t_maxseg)
+#define BBR_MAX_CWND            (TCP_MAXWIN << TCP_MAX_WINSHIFT)
+
+/* values of bbr_mode */
+#define BBR_STARTUP             0
+#define BBR_DRAIN               1
+#define BBR_PROBE_BW            2
+#define BBR_PROBE_RTT           3
+
+/* bbr_flags */
+#define BBR_F_ROUND_START       0x01    /* this ack started a new round */
+#define BBR_F_FULL_BW           0x02    /* STARTUP found the bottleneck */
+#define BBR_F_CONSERVE          0x04    /* packet conservation in recovery */
+#define BBR_F_IDLE_RESTART      0x08    /* restarting after idle */
+#define BBR_F_PROBE_RTT_ROUND   0x10    /* a round has passed in PROBE_RTT */
+
+static inline uint64_t
+tcp_bbr_bw(struct tcpcb *tp)
+{
+	return tp->t_ccstate->bbr_bw_max[0];
+}
+
+/*
+ * Windowed max filter over BBR_BW_ROUNDS rounds, keeping the best, second
+ * best and third best samples from successive sub-windows (Kathleen
+ * Nichols' algorithm, as used by the Linux minmax library).
+ */
+static void
+tcp_bbr_bw_filter(struct tcpcb *tp, uint32_t round, uint64_t bw)
+{
+	uint64_t *m = tp->t_ccstate->bbr_bw_max;
+	uint32_t *r = tp->t_ccstate->bbr_bw_round;
+
+	if (bw >= m[0] || round - r[2] > BBR_BW_ROUNDS) {
+		m[0] = m[1] = m[2] = bw;
+		r[0] = r[1] = r[2] = round;
+		return;
+	}
+	if (bw >= m[1]) {
+		m[1] = m[2] = bw;
+		r[1] = r[2] = round;
+	} else if (bw >= m[2]) {
+		m[2] = bw;
+		r[2] = round;
+	}
+
+	if (round - r[0] > BBR_BW_ROUNDS) {
+		/* the best sample aged out, promote the others */
+		m[0] = m[1];
+		r[0] = r[1];
+		m[1] = m[2];
+		r[1] = r[2];
+		m[2] = bw;
+		r[2] = round;
+		if (round - r[0] > BBR_BW_ROUNDS) {
+			m[0] = m[1];
+			r[0] = r[1];
+			m[1] = m[2];
+			r[1] = r[2];
+		}
+	} else if (r[1] == r[0] && round - r[1] > BBR_BW_ROUNDS / 4) {
+		m[1] = m[2] = bw;
+		r[1] = r[2] = round;
+	} else if (r[2] == r[1] && round - r[2] > BBR_BW_ROUNDS / 2) {
+		m[2] = bw;
+		r[2] = round;
+	}
+}
+
+/* gain times the estimated bandwidth-delay product, in bytes */
+static uint32_t
+tcp_bbr_bdp(struct tcpcb *tp, uint32_t gain)
+{
+	uint64_t bdp;
+
+	if (tp->t_ccstate->bbr_min_rtt_us == 0 || tcp_bbr_bw(tp) == 0) {
+		/* no model yet */
+		return tcp_initial_cwnd(tp) * gain / BBR_UNIT;
+	}
+	bdp = tcp_bbr_bw(tp) * tp->t_ccstate->bbr_min_rtt_us / USEC_PER_SEC;
+	bdp = bdp * gain / BBR_UNIT;
+	return (uint32_t)MIN(bdp, BBR_MAX_CWND);
+}
+
+static void
+tcp_bbr_set_pacing_rate(struct tcpcb *tp, uint32_t gain)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint64_t bw = tcp_bbr_bw(tp), rate;
+
+	if (bw == 0) {
+		/* no sample yet: the window over the RTT seen so far */
+		uint64_t srtt_us = (tp->t_srtt >> TCP_RTT_SHIFT) *
+		    (USEC_PER_SEC / TCP_RETRANSHZ);
+
+		bw = (uint64_t)tp->snd_cwnd * USEC_PER_SEC /
+		    MAX(srtt_us, USEC_PER_SEC / TCP_RETRANSHZ);
+	}
+	rate = bw * gain / BBR_UNIT * BBR_PACING_MARGIN / 100;
+	rate = MAX(rate, tp->t_maxseg);
+
+	/* in STARTUP, never slow down on a low early sample */
+	if ((cs->bbr_flags & BBR_F_FULL_BW) || rate > tp->t_pacing_rate) {
+		tp->t_pacing_rate = rate;
+	}
+}
+
+static inline void
+tcp_bbr_save_cwnd(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	if (IN_FASTRECOVERY(tp) || cs->bbr_mode == BBR_PROBE_RTT) {
+		cs->bbr_prior_cwnd = max(cs->bbr_prior_cwnd, tp->snd_cwnd);
+	} else {
+		cs->bbr_prior_cwnd = tp->snd_cwnd;
+	}
+}
+
+/*
+ * BBR does not use ssthresh.  Keeping it at the BDP once the pipe is full
+ * lets header prediction take in-sequence acks, and leaves it unbounded
+ * while STARTUP is still probing.
+ */
+static inline void
+tcp_bbr_set_ssthresh(struct tcpcb *tp)
+{
+	if (tp->t_ccstate->bbr_flags & BBR_F_FULL_BW) {
+		tp->snd_ssthresh = max(tcp_bbr_bdp(tp, BBR_UNIT),
+		    BBR_MIN_CWND(tp));
+	} else {
+		tp->snd_ssthresh = BBR_MAX_CWND;
+	}
+}
+
+static void
+tcp_bbr_enter_startup(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	cs->bbr_mode = BBR_STARTUP;
+	cs->bbr_pacing_gain = BBR_HIGH_GAIN;
+	cs->bbr_cwnd_gain = BBR_HIGH_GAIN;
+}
+
+static void
+tcp_bbr_advance_cycle(struct tcpcb *tp, uint64_t now_us)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	cs->bbr_cycle_idx = (cs->bbr_cycle_idx + 1) % BBR_CYCLE_LEN;
+	cs->bbr_cycle_start_us = now_us;
+	cs->bbr_pacing_gain = bbr_pacing_gain[cs->bbr_cycle_idx];
+}
+
+static void
+tcp_bbr_enter_probe_bw(struct tcpcb *tp, uint64_t now_us)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint32_t rnd;
+
+	cs->bbr_mode = BBR_PROBE_BW;
+	cs->bbr_cwnd_gain = BBR_CWND_GAIN;
+	/* start at a random phase, but not in the draining one */
+	read_frandom(&rnd, sizeof(rnd));
+	cs->bbr_cycle_idx = (uint8_t)(BBR_CYCLE_LEN - 1 -
+	    rnd % (BBR_CYCLE_LEN - 1));
+	tcp_bbr_advance_cycle(tp, now_us);
+}
+
+/* a round trip ends when the data sent at its start is delivered */
+static void
+tcp_bbr_update_round(struct tcpcb *tp, struct tcp_rate_sample *rs)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	cs->bbr_flags &= ~BBR_F_ROUND_START;
+	if (rs->rs_delivered != 0 &&
+	    rs->rs_prior_delivered >= cs->bbr_next_round_delivered) {
+		cs->bbr_next_round_delivered = rs->rs_delivered_total;
+		cs->bbr_round++;
+		cs->bbr_flags |= BBR_F_ROUND_START;
+		cs->bbr_flags &= ~BBR_F_CONSERVE;
+	}
+}
+
+static void
+tcp_bbr_update_bw(struct tcpcb *tp, struct tcp_rate_sample *rs)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint64_t bw;
+
+	/*
+	 * An interval shorter than the min RTT comes from acks that were
+	 * compressed on the way back and would overestimate the rate.
+	 */
+	if (rs->rs_delivered == 0 || rs->rs_interval_us == 0 ||
+	    rs->rs_interval_us < cs->bbr_min_rtt_us) {
+		return;
+	}
+	bw = rs->rs_delivered * USEC_PER_SEC / rs->rs_interval_us;
+
+	/* an application-limited sample only counts if it raises the max */
+	if (!rs->rs_app_limited || bw >= tcp_bbr_bw(tp)) {
+		tcp_bbr_bw_filter(tp, cs->bbr_round, bw);
+	}
+}
+
+static void
+tcp_bbr_update_cycle(struct tcpcb *tp, struct tcp_rate_sample *rs,
+    uint64_t now_us)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	boolean_t full_length, next;
+
+	if (cs->bbr_mode != BBR_PROBE_BW) {
+		return;
+	}
+	full_length = now_us - cs->bbr_cycle_start_us > cs->bbr_min_rtt_us;
+	if (cs->bbr_pacing_gain > BBR_UNIT) {
+		/* probe until the extra data is in flight, or there is loss */
+		next = full_length && (IN_FASTRECOVERY(tp) ||
+		    rs->rs_inflight >= tcp_bbr_bdp(tp, cs->bbr_pacing_gain));
+	} else if (cs->bbr_pacing_gain < BBR_UNIT) {
+		/* drain until the queue is gone, at most a round */
+		next = full_length ||
+		    rs->rs_inflight <= tcp_bbr_bdp(tp, BBR_UNIT);
+	} else {
+		next = full_length;
+	}
+	if (next) {
+		tcp_bbr_advance_cycle(tp, now_us);
+	}
+}
+
+static void
+tcp_bbr_check_full_pipe(struct tcpcb *tp, struct tcp_rate_sample *rs)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint64_t bw = tcp_bbr_bw(tp);
+
+	if ((cs->bbr_flags & BBR_F_FULL_BW) ||
+	    !(cs->bbr_flags & BBR_F_ROUND_START) || rs->rs_app_limited) {
+		return;
+	}
+	if (bw * BBR_UNIT >= cs->bbr_full_bw * BBR_FULL_BW_GROWTH) {
+		cs->bbr_full_bw = bw;
+		cs->bbr_full_bw_cnt = 0;
+		return;
+	}
+	if (++cs->bbr_full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+		cs->bbr_flags |= BBR_F_FULL_BW;
+	}
+}
+
+static void
+tcp_bbr_check_drain(struct tcpcb *tp, struct tcp_rate_sample *rs,
+    uint64_t now_us)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	if (cs->bbr_mode == BBR_STARTUP && (cs->bbr_flags & BBR_F_FULL_BW)) {
+		cs->bbr_mode = BBR_DRAIN;
+		cs->bbr_pacing_gain = BBR_DRAIN_GAIN;
+		cs->bbr_cwnd_gain = BBR_HIGH_GAIN;
+		tcp_bbr_set_ssthresh(tp);
+	}
+	if (cs->bbr_mode == BBR_DRAIN &&
+	    rs->rs_inflight <= tcp_bbr_bdp(tp, BBR_UNIT)) {
+		tcp_bbr_enter_probe_bw(tp, now_us);
+	}
+}
+
+static void
+tcp_bbr_update_min_rtt(struct tcpcb *tp, struct tcp_rate_sample *rs,
+    uint64_t now_us)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	boolean_t expired;
+
+	expired = TSTMP_GT(tcp_now, cs->bbr_min_rtt_stamp + BBR_MIN_RTT_WIN);
+	if (rs->rs_rtt_us != 0 && (cs->bbr_min_rtt_us == 0 ||
+	    rs->rs_rtt_us <= cs->bbr_min_rtt_us || expired)) {
+		cs->bbr_min_rtt_us = rs->rs_rtt_us;
+		cs->bbr_min_rtt_stamp = tcp_now;
+	}
+
+	if (expired && cs->bbr_mode != BBR_PROBE_RTT &&
+	    !(cs->bbr_flags & BBR_F_IDLE_RESTART)) {
+		tcp_bbr_save_cwnd(tp);
+		cs->bbr_mode = BBR_PROBE_RTT;
+		cs->bbr_pacing_gain = BBR_UNIT;
+		cs->bbr_cwnd_gain = BBR_UNIT;
+		cs->bbr_probe_rtt_done = 0;
+	}
+
+	if (cs->bbr_mode != BBR_PROBE_RTT) {
+		return;
+	}
+	/* the low rate in this mode says nothing about the path */
+	tp->t_rate->trs_app_limited = MAX(rs->rs_delivered_total +
+	    rs->rs_inflight, 1);
+
+	if (cs->bbr_probe_rtt_done == 0 &&
+	    rs->rs_inflight <= BBR_MIN_CWND(tp)) {
+		/* hold the small window for a while and a round trip */
+		cs->bbr_probe_rtt_done = max(tcp_now + BBR_PROBE_RTT_TIME, 1);
+		cs->bbr_flags &= ~BBR_F_PROBE_RTT_ROUND;
+		cs->bbr_next_round_delivered = rs->rs_delivered_total;
+	} else if (cs->bbr_probe_rtt_done != 0) {
+		if (cs->bbr_flags & BBR_F_ROUND_START) {
+			cs->bbr_flags |= BBR_F_PROBE_RTT_ROUND;
+		}
+		if ((cs->bbr_flags & BBR_F_PROBE_RTT_ROUND) &&
+		    TSTMP_GEQ(tcp_now, cs->bbr_probe_rtt_done)) {
+			cs->bbr_min_rtt_stamp = tcp_now;
+			tp->snd_cwnd = max(tp->snd_cwnd, cs->bbr_prior_cwnd);
+			if (cs->bbr_flags & BBR_F_FULL_BW) {
+				tcp_bbr_enter_probe_bw(tp, now_us);
+			} else {
+				tcp_bbr_enter_startup(tp);
+			}
+		}
+	}
+}
+
+static void
+tcp_bbr_set_cwnd(struct tcpcb *tp, struct tcp_rate_sample *rs)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint32_t cwnd = tp->snd_cwnd, target;
+
+	/* the BDP at the window gain, plus room for TSO and delayed acks */
+	target = tcp_bbr_bdp(tp, cs->bbr_cwnd_gain) + 3 * tp->t_maxseg;
+
+	if (IN_FASTRECOVERY(tp) && (cs->bbr_flags & BBR_F_CONSERVE)) {
+		/* first round of recovery: send one for each delivered */
+		cwnd = max(cwnd, rs->rs_inflight + rs->rs_acked);
+	} else if (cs->bbr_flags & BBR_F_FULL_BW) {
+		cwnd = min(cwnd + rs->rs_acked, target);
+	} else if (cwnd < target ||
+	    rs->rs_delivered_total < tcp_initial_cwnd(tp)) {
+		cwnd += rs->rs_acked;
+	}
+	cwnd = max(cwnd, BBR_MIN_CWND(tp));
+	if (cs->bbr_mode == BBR_PROBE_RTT) {
+		cwnd = min(cwnd, BBR_MIN_CWND(tp));
+	}
+	tp->snd_cwnd = min(cwnd, BBR_MAX_CWND);
+}
+
+static void
+tcp_bbr_rate_sample(struct tcpcb *tp, struct tcp_rate_sample *rs)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint64_t now_us = tcp_rate_now_us();
+
+	tcp_bbr_update_round(tp, rs);
+	tcp_bbr_update_bw(tp, rs);
+	tcp_bbr_update_cycle(tp, rs, now_us);
+	tcp_bbr_check_full_pipe(tp, rs);
+	tcp_bbr_check_drain(tp, rs, now_us);
+	tcp_bbr_update_min_rtt(tp, rs, now_us);
+
+	tcp_bbr_set_pacing_rate(tp, cs->bbr_pacing_gain);
+	tcp_bbr_set_cwnd(tp, rs);
+	if (cs->bbr_flags & BBR_F_FULL_BW) {
+		tcp_bbr_set_ssthresh(tp);
+	}
+	if (rs->rs_acked > 0) {
+		cs->bbr_flags &= ~BBR_F_IDLE_RESTART;
+	}
+}
+
+static void
+tcp_bbr_clear_state(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	bzero(&cs->__u__._bbr_state_, sizeof(cs->__u__._bbr_state_));
+	cs->bbr_min_rtt_stamp = tcp_now;
+	tcp_bbr_enter_startup(tp);
+	if (tp->t_rate != NULL) {
+		/* the next round starts with what is delivered from now on */
+		cs->bbr_next_round_delivered = tp->t_rate->trs_delivered;
+	}
+}
+
+static int
+tcp_bbr_init(struct tcpcb *tp)
+{
+	os_atomic_inc(&tcp_cc_bbr.num_sockets, relaxed);
+
+	VERIFY(tp->t_ccstate != NULL);
+	tcp_rate_alloc(tp);
+	tcp_bbr_clear_state(tp);
+	return 0;
+}
+
+static int
+tcp_bbr_cleanup(struct tcpcb *tp)
+{
+	tcp_pacing_stop(tp);
+	tcp_rate_free(tp);
+	os_atomic_dec(&tcp_cc_bbr.num_sockets, relaxed);
+	return 0;
+}
+
+/*
+ * Initial window at the start of a connection, or after the MSS changed.
+ * The model is kept; pacing starts from the window over the handshake RTT.
+ */
+static void
+tcp_bbr_cwnd_init(struct tcpcb *tp)
+{
+	tcp_cc_cwnd_init_or_reset(tp);
+	tcp_bbr_set_ssthresh(tp);
+	tcp_bbr_set_pacing_rate(tp, tp->t_ccstate->bbr_pacing_gain);
+}
+
+static void
+tcp_bbr_pre_fr(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint32_t inflight = tp->snd_max - tp->snd_una;
+
+	tcp_bbr_save_cwnd(tp);
+	cs->bbr_flags |= BBR_F_CONSERVE;
+	if (tp->t_rate != NULL) {
+		cs->bbr_next_round_delivered = tp->t_rate->trs_delivered;
+	}
+	/*
+	 * tcp_input sets the window to ssthresh on entering recovery; make
+	 * that the data in flight, so recovery starts by conserving packets
+	 * rather than by halving.
+	 */
+	tp->snd_ssthresh = max(inflight, BBR_MIN_CWND(tp));
+}
+
+static void
+tcp_bbr_post_fr(struct tcpcb *tp, struct tcphdr *th)
+{
+#pragma unused(th)
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	cs->bbr_flags &= ~BBR_F_CONSERVE;
+	tp->snd_cwnd = min(max(tp->snd_cwnd, cs->bbr_prior_cwnd), BBR_MAX_CWND);
+	tcp_bbr_set_ssthresh(tp);
+}
+
+/*
+ * Restarting from idle, pace at the estimated bandwidth rather than in
+ * a burst of the whole window; the window itself is kept.
+ */
+static void
+tcp_bbr_after_idle(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+
+	cs->bbr_flags |= BBR_F_IDLE_RESTART;
+	if (cs->bbr_mode == BBR_PROBE_BW) {
+		tcp_bbr_set_pacing_rate(tp, BBR_UNIT);
+	}
+}
+
+static void
+tcp_bbr_after_timeout(struct tcpcb *tp)
+{
+	/*
+	 * Avoid adjusting congestion window due to SYN retransmissions.
+	 * If more than one byte (SYN) is outstanding then it is still
+	 * needed to adjust the window.
+	 */
+	if (tp->t_state < TCPS_ESTABLISHED &&
+	    ((int)(tp->snd_max - tp->snd_una) <= 1)) {
+		return;
+	}
+
+	/*
+	 * Go back to one segment; set_cwnd grows the window back towards
+	 * the model's target as the retransmissions are delivered.
+	 */
+	tcp_bbr_save_cwnd(tp);
+	tp->t_ccstate->bbr_flags &= ~BBR_F_CONSERVE;
+	tp->snd_cwnd = tp->t_maxseg;
+}
+
+static int
+tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th)
+{
+	return tcp_cc_delay_ack(tp, th);
+}
+
+/*
+ * Switching from another CC, start with a fresh model: the state of the
+ * previous algorithm shares the same storage and says nothing about the
+ * bandwidth.  Delivery is counted from here on.
+ */
+static void
+tcp_bbr_switch_cc(struct tcpcb *tp)
+{
+	tcp_rate_alloc(tp);
+	tcp_bbr_clear_state(tp);
+	tcp_bbr_set_ssthresh(tp);
+	tcp_bbr_set_pacing_rate(tp, tp->t_ccstate->bbr_pacing_gain);
+
+	os_atomic_inc(&tcp_cc_bbr.num_sockets, relaxed);
+}
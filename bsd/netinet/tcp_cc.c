@@ -43,6 +43,7 @@
 extern struct tcp_cc_algo tcp_cc_newreno;
 extern struct tcp_cc_algo tcp_cc_ledbat;
 extern struct tcp_cc_algo tcp_cc_cubic;
+extern struct tcp_cc_algo tcp_cc_bbr;
 
  #define SET_SNDSB_IDEAL_SIZE(sndsb, size) \
 	sndsb->sb_idealsize = min(max(tcp_sendspace, tp->snd_ssthresh), \
@@ -66,6 +67,7 @@ tcp_cc_init(void)
 	tcp_cc_algo_list[TCP_CC_ALGO_NEWRENO_INDEX] = &tcp_cc_newreno;
 	tcp_cc_algo_list[TCP_CC_ALGO_BACKGROUND_INDEX] = &tcp_cc_ledbat;
 	tcp_cc_algo_list[TCP_CC_ALGO_CUBIC_INDEX] = &tcp_cc_cubic;
+	tcp_cc_algo_list[TCP_CC_ALGO_BBR_INDEX] = &tcp_cc_bbr;
 
 	tcp_ccdbg_control_register();
 }
@@ -213,7 +215,8 @@ void
 tcp_cc_allocate_state(struct tcpcb *tp)
 {
 	if ((tp->tcp_cc_index == TCP_CC_ALGO_CUBIC_INDEX ||
-	    tp->tcp_cc_index == TCP_CC_ALGO_BACKGROUND_INDEX) &&
+	    tp->tcp_cc_index == TCP_CC_ALGO_BACKGROUND_INDEX ||
+	    tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX) &&
 	    tp->t_ccstate == NULL) {
 		tp->t_ccstate = &tp->_t_ccstate;
 
@@ -322,3 +325,237 @@ tcp_clear_pipeack_state(struct tcpcb *tp)
 	tp->t_pipeack_ind = 0;
 	tp->t_lossflightsize = 0;
 }
+
+/*
+ * Delivery rate sampling (draft-cheng-iccrg-delivery-rate-estimation).
+ *
+ * Each flight of data that leaves is recorded with the delivered count and
+ * time at that moment.  When an ack delivers data, the newest flight it
+ * covers yields a sample: the bytes delivered since that flight was sent,
+ * over the longer of the send and the ack intervals.  Bytes are counted
+ * as delivered once, when the scoreboard marks them SACKed or when the
+ * cumulative ack passes them, so the count only grows.  The state is only
+ * allocated for connections whose congestion control takes rate samples.
+ */
+void
+tcp_rate_alloc(struct tcpcb *tp)
+{
+	if (tp->t_rate == NULL) {
+		tp->t_rate = kalloc_type(struct tcp_rate_state,
+		    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	}
+}
+
+void
+tcp_rate_free(struct tcpcb *tp)
+{
+	if (tp->t_rate != NULL) {
+		kfree_type(struct tcp_rate_state, tp->t_rate);
+		tp->t_rate = NULL;
+	}
+}
+
+uint64_t
+tcp_rate_now_us(void)
+{
+	struct timeval now;
+
+	microuptime(&now);
+	return (uint64_t)now.tv_sec * USEC_PER_SEC + (uint64_t)now.tv_usec;
+}
+
+static inline struct tcp_rate_rec *
+tcp_rate_rec_at(struct tcp_rate_state *trs, uint32_t i)
+{
+	return &trs->trs_recs[(trs->trs_head + i) % TCP_RATE_NRECS];
+}
+
+/*
+ * Count len bytes newly marked in the SACK scoreboard as delivered.  The
+ * part that was SACKed once already, before the scoreboard was cleared,
+ * is not counted again.
+ */
+void
+tcp_rate_sacked(struct tcpcb *tp, uint32_t len)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+	uint32_t seen = min(trs->trs_resacked, len);
+
+	trs->trs_resacked -= seen;
+	trs->trs_delivered += len - seen;
+	trs->trs_sacked += len;
+}
+
+/*
+ * Count len bytes newly acked cumulatively as delivered, less those the
+ * scoreboard already counted when they were SACKed.
+ */
+void
+tcp_rate_acked(struct tcpcb *tp, uint32_t len)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+	uint32_t seen;
+
+	seen = min(trs->trs_sacked, len);
+	trs->trs_sacked -= seen;
+	len -= seen;
+	seen = min(trs->trs_resacked, len);
+	trs->trs_resacked -= seen;
+	trs->trs_delivered += len - seen;
+}
+
+/*
+ * The scoreboard was cleared: what it had SACKed above snd_una stays
+ * counted, and is not counted again when it is SACKed or acked anew.
+ */
+void
+tcp_rate_sack_reset(struct tcpcb *tp)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+
+	trs->trs_resacked += trs->trs_sacked;
+	trs->trs_sacked = 0;
+}
+
+/*
+ * Record len bytes starting at seq as sent now.  Called by tcp_output
+ * for every segment carrying data.
+ */
+void
+tcp_rate_sent(struct tcpcb *tp, tcp_seq seq, uint32_t len, boolean_t rexmt)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+	struct tcp_rate_rec *rr;
+	uint64_t now = tcp_rate_now_us();
+	uint32_t quantum, i;
+
+	if (rexmt) {
+		/* samples over retransmitted data have no usable RTT */
+		for (i = 0; i < trs->trs_count; i++) {
+			rr = tcp_rate_rec_at(trs, i);
+			if (SEQ_LT(seq, rr->rr_end) &&
+			    SEQ_GT(seq + len, rr->rr_start)) {
+				rr->rr_flags |= TCP_RATE_REXMT;
+			}
+		}
+		return;
+	}
+
+	if (tp->snd_max == tp->snd_una) {
+		/* nothing in flight: intervals restart from now */
+		trs->trs_first_sent_us = now;
+		trs->trs_delivered_us = now;
+	}
+
+	/*
+	 * Extend the newest record while this flight is still small, so
+	 * that a burst is sampled as one; a record per segment would make
+	 * the ring too short to cover a window.
+	 */
+	quantum = max(2 * tp->t_maxseg, tp->snd_cwnd >> 3);
+	if (trs->trs_count > 0) {
+		rr = tcp_rate_rec_at(trs, trs->trs_count - 1);
+		if (rr->rr_end == seq && rr->rr_flags == 0 &&
+		    trs->trs_app_limited == 0 &&
+		    rr->rr_end - rr->rr_start < quantum) {
+			rr->rr_end = seq + len;
+			rr->rr_sent_us = now;
+			return;
+		}
+	}
+
+	if (trs->trs_count == TCP_RATE_NRECS) {
+		trs->trs_head = (trs->trs_head + 1) % TCP_RATE_NRECS;
+		trs->trs_count--;
+	}
+	rr = tcp_rate_rec_at(trs, trs->trs_count);
+	trs->trs_count++;
+	rr->rr_start = seq;
+	rr->rr_end = seq + len;
+	rr->rr_sent_us = now;
+	rr->rr_first_sent_us = trs->trs_first_sent_us;
+	rr->rr_delivered = trs->trs_delivered;
+	rr->rr_delivered_us = trs->trs_delivered_us;
+	rr->rr_flags = trs->trs_app_limited != 0 ? TCP_RATE_APP_LIMITED : 0;
+}
+
+/*
+ * The sender ran out of data with room left in the window, so samples
+ * until what is in flight now is delivered measure the application and
+ * not the path.
+ */
+void
+tcp_rate_app_limited(struct tcpcb *tp)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+
+	trs->trs_app_limited = MAX(trs->trs_delivered +
+	    (tp->snd_max - tp->snd_una), 1);
+}
+
+/*
+ * Take a rate sample after snd_una and the scoreboard have been updated
+ * for an ack, and hand it to the congestion control.
+ */
+void
+tcp_rate_ack(struct tcpcb *tp)
+{
+	struct tcp_rate_state *trs = tp->t_rate;
+	struct tcp_rate_sample rs;
+	struct tcp_rate_rec *rr = NULL;
+	tcp_seq high;
+	uint64_t delivered = trs->trs_delivered, now, snd_us, ack_us;
+	uint32_t i;
+
+	if (delivered == trs->trs_sampled) {
+		return;
+	}
+	now = tcp_rate_now_us();
+	bzero(&rs, sizeof(rs));
+	rs.rs_acked = (uint32_t)(delivered - trs->trs_sampled);
+	trs->trs_sampled = delivered;
+	trs->trs_delivered_us = now;
+
+	/* the newest flight this ack delivered (at least in part) */
+	high = SEQ_MAX(tp->snd_una, tp->snd_fack);
+	for (i = trs->trs_count; i > 0; i--) {
+		struct tcp_rate_rec *cand = tcp_rate_rec_at(trs, i - 1);
+
+		if (SEQ_LT(cand->rr_start, high)) {
+			rr = cand;
+			break;
+		}
+	}
+
+	if (rr != NULL) {
+		rs.rs_prior_delivered = rr->rr_delivered;
+		rs.rs_delivered = delivered - rr->rr_delivered;
+		rs.rs_app_limited = (rr->rr_flags & TCP_RATE_APP_LIMITED) != 0;
+		snd_us = rr->rr_sent_us - rr->rr_first_sent_us;
+		ack_us = now - rr->rr_delivered_us;
+		rs.rs_interval_us = (uint32_t)MIN(MAX(snd_us, ack_us), UINT32_MAX);
+		if (!(rr->rr_flags & TCP_RATE_REXMT)) {
+			rs.rs_rtt_us = (uint32_t)MIN(now - rr->rr_sent_us,
+			    UINT32_MAX);
+		}
+		trs->trs_first_sent_us = rr->rr_sent_us;
+	}
+
+	/* forget the flights that are now cumulatively acked */
+	while (trs->trs_count > 0 &&
+	    SEQ_LEQ(tcp_rate_rec_at(trs, 0)->rr_end, tp->snd_una)) {
+		trs->trs_head = (trs->trs_head + 1) % TCP_RATE_NRECS;
+		trs->trs_count--;
+	}
+	if (trs->trs_app_limited != 0 && delivered > trs->trs_app_limited) {
+		trs->trs_app_limited = 0;
+	}
+
+	rs.rs_delivered_total = delivered;
+	rs.rs_inflight = tp->snd_max - tp->snd_una;
+	rs.rs_inflight -= min(rs.rs_inflight, trs->trs_sacked);
+
+	if (CC_ALGO(tp)->rate_sample != NULL) {
+		CC_ALGO(tp)->rate_sample(tp, &rs);
+	}
+}
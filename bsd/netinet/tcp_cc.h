@@ -99,6 +99,13 @@ struct tcp_cc_debug_state {
 		struct {
 			u_int32_t led_base_rtt;
 		} ledbat_state;
+		struct {
+			uint32_t ccd_bw_kbps;
+			uint32_t ccd_min_rtt_us;
+			uint32_t ccd_pacing_kbps;
+			uint32_t ccd_mode;
+			uint32_t ccd_round;
+		} bbr_state;
 	} u;
 };
 
@@ -109,7 +116,8 @@ struct tcp_cc_debug_state {
 #define TCP_CC_ALGO_NEWRENO_INDEX       1
 #define TCP_CC_ALGO_BACKGROUND_INDEX    2 /* CC for background transport */
 #define TCP_CC_ALGO_CUBIC_INDEX         3 /* default CC algorithm */
-#define TCP_CC_ALGO_COUNT               4 /* Count of CC algorithms */
+#define TCP_CC_ALGO_BBR_INDEX           4 /* model-based, rate sampling and pacing */
+#define TCP_CC_ALGO_COUNT               5 /* Count of CC algorithms */
 
 /*
  * Values of ccd_event
@@ -216,11 +224,32 @@ struct tcp_cc_algo {
 
 	/* Switch a connection to this CC algorithm after sending some packets */
 	void (*switch_to)(struct tcpcb *tp);
+
+	/*
+	 * Optional: called with a delivery rate sample on every ack that
+	 * advances delivery, when tp->t_rate has been allocated
+	 */
+	void (*rate_sample)(struct tcpcb *tp, struct tcp_rate_sample *rs);
+
+	/*
+	 * Optional: scalable (L4S) response to the CE marks counted in
+	 * tp->t_snd_ce_packets, called on every ack that acknowledges
+	 * data while L4S is in use on the connection
+	 */
+	void (*ecn_ack)(struct tcpcb *tp, struct tcphdr *th);
 } __attribute__((aligned(4)));
 
 extern struct tcp_cc_algo* tcp_cc_algo_list[TCP_CC_ALGO_COUNT];
 
 #define CC_ALGO(tp) (tcp_cc_algo_list[tp->tcp_cc_index])
+
+/*
+ * L4S is in use: it is enabled, accurate ECN was negotiated and the
+ * congestion control algorithm has a scalable response to CE
+ */
+#define TCP_L4S_ON(_tp_) \
+	(tcp_l4s == 1 && TCP_ACC_ECN_ON(_tp_) && \
+	CC_ALGO(_tp_)->ecn_ack != NULL)
 #define TCP_CC_CWND_INIT_PKTS 10
 #define TCP_CC_CWND_INIT_BYTES  4380
 /*
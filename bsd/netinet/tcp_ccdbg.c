@@ -135,6 +135,16 @@ tcp_ccdbg_trace(struct tcpcb *tp, struct tcphdr *th, int32_t event)
 			dbg_state.u.ledbat_state.led_base_rtt =
 			    get_base_rtt(tp);
 			break;
+		case TCP_CC_ALGO_BBR_INDEX:
+			dbg_state.u.bbr_state.ccd_bw_kbps = (uint32_t)
+			    (tp->t_ccstate->bbr_bw_max[0] * 8 / 1000);
+			dbg_state.u.bbr_state.ccd_min_rtt_us =
+			    tp->t_ccstate->bbr_min_rtt_us;
+			dbg_state.u.bbr_state.ccd_pacing_kbps = (uint32_t)
+			    (tp->t_pacing_rate * 8 / 1000);
+			dbg_state.u.bbr_state.ccd_mode = tp->t_ccstate->bbr_mode;
+			dbg_state.u.bbr_state.ccd_round = tp->t_ccstate->bbr_round;
+			break;
 		default:
 			break;
 		}
@@ -48,6 +48,7 @@ static void tcp_cubic_post_fr(struct tcpcb *tp, struct tcphdr *th);
 static void tcp_cubic_after_timeout(struct tcpcb *tp);
 static int tcp_cubic_delay_ack(struct tcpcb *tp, struct tcphdr *th);
 static void tcp_cubic_switch_cc(struct tcpcb *tp);
+static void tcp_cubic_ecn_ack(struct tcpcb *tp, struct tcphdr *th);
 static uint32_t tcp_cubic_update(struct tcpcb *tp, uint32_t rtt);
 static inline void tcp_cubic_clear_state(struct tcpcb *tp);
 
@@ -65,7 +66,8 @@ struct tcp_cc_algo tcp_cc_cubic = {
 	.after_idle = tcp_cubic_cwnd_init_or_reset,
 	.after_timeout = tcp_cubic_after_timeout,
 	.delay_ack = tcp_cubic_delay_ack,
-	.switch_to = tcp_cubic_switch_cc
+	.switch_to = tcp_cubic_switch_cc,
+	.ecn_ack = tcp_cubic_ecn_ack
 };
 
 static float tcp_cubic_backoff = 0.2f; /* multiplicative decrease factor */
@@ -476,6 +478,52 @@ tcp_cubic_pre_fr(struct tcpcb *tp)
 	tcp_cc_resize_sndbuf(tp);
 }
 
+/*
+ * Scalable response to CE for L4S (RFC 9331): once per round trip,
+ * take the fraction of packets that were CE marked into a moving
+ * average alpha (gain 1/16) and, if any were marked, reduce the window
+ * by alpha / 2 rather than backing off on the first mark.  The cubic
+ * epoch then starts over from the reduced window.
+ */
+static void
+tcp_cubic_ecn_ack(struct tcpcb *tp, struct tcphdr *th)
+{
+	struct tcp_ccstate *cs = tp->t_ccstate;
+	uint32_t pkts, ce, frac, win;
+
+	cs->cub_l4s_acked += BYTES_ACKED(th, tp);
+	if (cs->cub_l4s_end != 0 && SEQ_LT(th->th_ack, cs->cub_l4s_end)) {
+		return;
+	}
+
+	pkts = max(cs->cub_l4s_acked / tp->t_maxseg, 1);
+	ce = min(tp->t_snd_ce_packets - cs->cub_l4s_ce, pkts);
+	frac = (ce << 10) / pkts;
+	cs->cub_l4s_alpha = cs->cub_l4s_alpha - (cs->cub_l4s_alpha >> 4) +
+	    (frac >> 4);
+
+	if (ce > 0 && !IN_FASTRECOVERY(tp)) {
+		win = tp->snd_cwnd;
+		cs->cub_last_max = win;
+		cs->cub_epoch_start = 0;
+		cs->cub_tcp_win = 0;
+		cs->cub_tcp_bytes_acked = 0;
+
+		win -= (uint32_t)(((uint64_t)win * cs->cub_l4s_alpha) >> 11);
+		win = tcp_round_to(win, tp->t_maxseg);
+		if (win < 2 * tp->t_maxseg) {
+			win = 2 * tp->t_maxseg;
+		}
+		tp->snd_cwnd = win;
+		tp->snd_ssthresh = win;
+		tcp_cc_resize_sndbuf(tp);
+	}
+
+	cs->cub_l4s_acked = 0;
+	cs->cub_l4s_ce = tp->t_snd_ce_packets;
+	cs->cub_l4s_end = tp->snd_max;
+}
+
 static void
 tcp_cubic_post_fr(struct tcpcb *tp, struct tcphdr *th)
 {
@@ -605,4 +653,8 @@ tcp_cubic_clear_state(struct tcpcb *tp)
 	tp->t_ccstate->cub_tcp_win = 0;
 	tp->t_ccstate->cub_tcp_bytes_acked = 0;
 	tp->t_ccstate->cub_epoch_period = 0;
+	tp->t_ccstate->cub_l4s_alpha = 1 << 10;
+	tp->t_ccstate->cub_l4s_acked = 0;
+	tp->t_ccstate->cub_l4s_ce = tp->t_snd_ce_packets;
+	tp->t_ccstate->cub_l4s_end = 0;
 }
@@ -1810,6 +1810,9 @@ tcp_handle_wakeup(struct socket *so, int read_wakeup, int write_wakeup)
 static void
 tcp_update_snd_una(struct tcpcb *tp, uint32_t ack)
 {
+	if (tp->t_rate != NULL && SEQ_GT(ack, tp->snd_una)) {
+		tcp_rate_acked(tp, ack - tp->snd_una);
+	}
 	tp->snd_una = ack;
 	if (SACK_ENABLED(tp) && SEQ_LT(tp->send_highest_sack, tp->snd_una)) {
 		tp->send_highest_sack = tp->snd_una;
@@ -1819,6 +1822,43 @@ tcp_update_snd_una(struct tcpcb *tp, uint32_t ack)
 	}
 }
 
+/*
+ * Enter fast recovery: let the congestion control set ssthresh and,
+ * with SACK, start the recovery episode at a reduced cwnd.  Shared by
+ * the dupack threshold and RACK loss detection; the caller has set
+ * snd_recover and sends what the new cwnd allows.
+ */
+void
+tcp_enter_fast_recovery(struct tcpcb *tp)
+{
+	tcp_rexmt_save_state(tp);
+	/*
+	 * If the current tcp cc module has
+	 * defined a hook for tasks to run
+	 * before entering FR, call it
+	 */
+	if (CC_ALGO(tp)->pre_fr != NULL) {
+		CC_ALGO(tp)->pre_fr(tp);
+	}
+	ENTER_FASTRECOVERY(tp);
+	tp->t_timer[TCPT_REXMT] = 0;
+	if (!TCP_ACC_ECN_ON(tp) && TCP_ECN_ENABLED(tp)) {
+		tp->ecn_flags |= TE_SENDCWR;
+	}
+
+	if (SACK_ENABLED(tp)) {
+		tcpstat.tcps_sack_recovery_episode++;
+		tp->t_sack_recovery_episode++;
+		tp->sack_newdata = tp->snd_nxt;
+		if (tcp_do_better_lr) {
+			tp->snd_cwnd = tp->snd_ssthresh;
+		} else {
+			tp->snd_cwnd = tp->t_maxseg;
+		}
+		tp->t_flagsext &= ~TF_CWND_NONVALIDATED;
+	}
+}
+
 static bool
 tcp_syn_data_valid(struct tcpcb *tp, struct tcphdr *tcp_hdr, int tlen)
 {
@@ -2146,6 +2186,22 @@ findpcb:
 		    ip->ip_dst, th->th_dport, 1, m->m_pkthdr.rcvif);
 	}
 
+	/*
+	 * A segment for a connection that went to compact TIME_WAIT finds
+	 * no pcb, or at most the listener.
+	 */
+	if (tcp_tw_count != 0 && (inp == NULL ||
+	    (isipv6 ? IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_faddr) :
+	    inp->inp_faddr.s_addr == INADDR_ANY)) &&
+	    tcp_tw_input(m, mtod(m, void *), th, &to, optp, optlen, tlen,
+	    ifscope)) {
+		if (inp != NULL) {
+			in_pcb_checkstate(inp, WNT_RELEASE, 0);
+		}
+		KERNEL_DEBUG(DBG_FNC_TCP_INPUT | DBG_FUNC_END, 0, 0, 0, 0, 0);
+		return;
+	}
+
 	/*
 	 * Use the interface scope information from the PCB for outbound
 	 * segments.  If the PCB isn't present and if scoped routing is
@@ -3052,6 +3108,9 @@ findpcb:
 				if (CC_ALGO(tp)->congestion_avd != NULL) {
 					CC_ALGO(tp)->congestion_avd(tp, th);
 				}
+				if (TCP_L4S_ON(tp)) {
+					CC_ALGO(tp)->ecn_ack(tp, th);
+				}
 				tcp_ccdbg_trace(tp, th, TCP_CC_INSEQ_ACK_RCVD);
 				sbdrop(&so->so_snd, acked);
 				tcp_sbsnd_trim(&so->so_snd);
@@ -3062,6 +3121,12 @@ findpcb:
 				}
 
 				tcp_update_snd_una(tp, th->th_ack);
+				if (tp->t_rate != NULL) {
+					tcp_rate_ack(tp);
+				}
+				if (tp->t_rack != NULL) {
+					tcp_rack_ack(tp);
+				}
 
 				TCP_RESET_REXMT_STATE(tp);
 
@@ -4601,6 +4666,16 @@ close:
 		    (to.to_nsacks > 0 || !TAILQ_EMPTY(&tp->snd_holes))) {
 			tcp_sack_doack(tp, &to, th, &sack_bytes_acked, &sack_bytes_newly_acked);
 		}
+		/*
+		 * A duplicate ack that SACKs new data still delivers it; the
+		 * acks that advance snd_una are sampled at step6.
+		 */
+		if (tp->t_rate != NULL && SEQ_LEQ(th->th_ack, tp->snd_una)) {
+			tcp_rate_ack(tp);
+		}
+		if (tp->t_rack != NULL && SEQ_LEQ(th->th_ack, tp->snd_una)) {
+			tcp_rack_ack(tp);
+		}
 
 #if MPTCP
 		if (tp->t_mpuna && SEQ_GEQ(th->th_ack, tp->t_mpuna)) {
@@ -4691,7 +4766,8 @@ process_dupack:
 				if (SACK_ENABLED(tp) && tcp_do_better_lr) {
 					tp->t_new_dupacks += (sack_bytes_newly_acked / tp->t_maxseg);
 
-					if (tp->t_new_dupacks >= tp->t_rexmtthresh && IN_FASTRECOVERY(tp)) {
+					if (tp->t_new_dupacks >= tp->t_rexmtthresh && IN_FASTRECOVERY(tp) &&
+					    tp->t_rack == NULL) {
 						/* Let's restart the retransmission */
 						tcp_sack_lost_rexmit(tp);
 
@@ -4775,8 +4851,8 @@ process_dupack:
 					tp->t_dupacks = 0;
 					tp->t_rexmtthresh = tcprexmtthresh;
 					tp->t_new_dupacks = 0;
-				} else if ((tp->t_dupacks > tp->t_rexmtthresh && (!tcp_do_better_lr || old_dupacks >= tp->t_rexmtthresh)) ||
-				    IN_FASTRECOVERY(tp)) {
+				} else if ((tp->t_dupacks > tp->t_rexmtthresh && (!tcp_do_better_lr || old_dupacks >= tp->t_rexmtthresh) &&
+				    tp->t_rack == NULL) || IN_FASTRECOVERY(tp)) {
 					/*
 					 * If this connection was seeing packet
 					 * reordering, then recovery might be
@@ -4832,8 +4908,10 @@ process_dupack:
 					(void) tcp_output(tp);
 
 					goto drop;
-				} else if ((!tcp_do_better_lr && tp->t_dupacks == tp->t_rexmtthresh) ||
-				    (tcp_do_better_lr && tp->t_dupacks >= tp->t_rexmtthresh)) {
+				} else if (((!tcp_do_better_lr && tp->t_dupacks == tp->t_rexmtthresh) ||
+				    (tcp_do_better_lr && tp->t_dupacks >= tp->t_rexmtthresh)) &&
+				    /* with RACK, tcp_rack_ack decides on recovery */
+				    tp->t_rack == NULL) {
 					tcp_seq onxt = tp->snd_nxt;
 
 					/*
@@ -4888,32 +4966,9 @@ process_dupack:
 						break;
 					}
 
-					tcp_rexmt_save_state(tp);
-					/*
-					 * If the current tcp cc module has
-					 * defined a hook for tasks to run
-					 * before entering FR, call it
-					 */
-					if (CC_ALGO(tp)->pre_fr != NULL) {
-						CC_ALGO(tp)->pre_fr(tp);
-					}
-					ENTER_FASTRECOVERY(tp);
-					tp->t_timer[TCPT_REXMT] = 0;
-					if (!TCP_ACC_ECN_ON(tp) && TCP_ECN_ENABLED(tp)) {
-						tp->ecn_flags |= TE_SENDCWR;
-					}
+					tcp_enter_fast_recovery(tp);
 
 					if (SACK_ENABLED(tp)) {
-						tcpstat.tcps_sack_recovery_episode++;
-						tp->t_sack_recovery_episode++;
-						tp->sack_newdata = tp->snd_nxt;
-						if (tcp_do_better_lr) {
-							tp->snd_cwnd = tp->snd_ssthresh;
-						} else {
-							tp->snd_cwnd = tp->t_maxseg;
-						}
-						tp->t_flagsext &= ~TF_CWND_NONVALIDATED;
-
 						/* Process any window updates */
 						if (tiwin > tp->snd_wnd) {
 							tcp_update_window(tp, thflags, th, tiwin, tlen);
@@ -5094,7 +5149,17 @@ process_ACK:
 		 * For classic ECN, congestion event is receiving TH_ECE.
 		 */
 		if ((tp->ecn_flags & TE_SENDIPECT)) {
-			if (TCP_ACC_ECN_ON(tp)) {
+			if (TCP_L4S_ON(tp)) {
+				/*
+				 * L4S: the CC module reduces the window in
+				 * proportion to the marks, once per round trip.
+				 */
+				if (tp->t_delta_ce_packets > 0) {
+					tcpstat.tcps_ecn_ace_recv_ce += tp->t_delta_ce_packets;
+					tcp_ccdbg_trace(tp, th, TCP_CC_ECN_RCVD);
+				}
+				CC_ALGO(tp)->ecn_ack(tp, th);
+			} else if (TCP_ACC_ECN_ON(tp)) {
 				if (!IN_FASTRECOVERY(tp) && tp->t_delta_ce_packets > 0) {
 					tcp_reduce_congestion_window(tp);
 					tp->ecn_flags |= (TE_INRECOVERY);
@@ -5286,6 +5351,12 @@ process_ACK:
 	}
 
 step6:
+	if (tp->t_rate != NULL) {
+		tcp_rate_ack(tp);
+	}
+	if (tp->t_rack != NULL) {
+		tcp_rack_ack(tp);
+	}
 	/*
 	 * Update window information.
 	 */
@@ -5642,7 +5713,10 @@ dodata:
 		(void) tcp_output(tp);
 	}
 
-	tcp_check_timer_state(tp);
+	/* A closed server connection can finish TIME_WAIT without its pcb */
+	if (tp->t_state != TCPS_TIME_WAIT || !tcp_twstart(tp)) {
+		tcp_check_timer_state(tp);
+	}
 
 	tcp_handle_wakeup(so, read_wakeup, write_wakeup);
 
@@ -6998,6 +7072,8 @@ tcp_set_foreground_cc(struct socket *so)
 		/* Only used for testing */
 		tcp_set_new_cc(so, TCP_CC_ALGO_BACKGROUND_INDEX);
 #endif
+	} else if (tcp_use_bbr) {
+		tcp_set_new_cc(so, TCP_CC_ALGO_BBR_INDEX);
 	} else {
 		tcp_set_new_cc(so, TCP_CC_ALGO_CUBIC_INDEX);
 	}
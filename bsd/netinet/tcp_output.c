@@ -107,6 +107,7 @@
 #include <netinet/tcp_var.h>
 #include <netinet/tcpip.h>
 #include <netinet/tcp_cc.h>
+#include <netinet/tcp_sysctls.h>
 #if TCPDEBUG
 #include <netinet/tcp_debug.h>
 #endif
@@ -126,6 +127,8 @@
 #endif
 
 #include <corecrypto/ccaes.h>
+#include <kern/percpu.h>
+#include <kern/thread_call.h>
 
 #define DBG_LAYER_BEG           NETDBG_CODE(DBG_NETTCP, 1)
 #define DBG_LAYER_END           NETDBG_CODE(DBG_NETTCP, 3)
@@ -150,6 +153,10 @@ SYSCTL_SKMEM_TCP_INT(OID_AUTO, accurate_ecn,
     CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_acc_ecn, 0,
     "Accurate ECN mode (0: disable, 1: enable ACE feedback");
 
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, l4s,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_l4s, 0,
+    "Send ECT(1) and scale the response to CE when accurate ECN is negotiated");
+
 // TO BE REMOVED
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, do_ack_compression,
     CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_do_ack_compression, 1,
@@ -287,6 +294,8 @@ extern u_int32_t kipf_count;
 static int tcp_ip_output(struct socket *, struct tcpcb *, struct mbuf *,
     int, struct mbuf *, int, int, boolean_t);
 static int tcp_recv_throttle(struct tcpcb *tp);
+static int32_t tcp_pacing_tso_max(struct tcpcb *tp, int32_t tso_maxlen,
+    int32_t hdrlen);
 
 __attribute__((noinline))
 static int32_t
@@ -976,6 +985,14 @@ again:
 		} else {
 			len = ((int32_t)min(cwin, p->end - p->rxmit));
 		}
+		/* With RACK, only retransmit what has been marked lost */
+		if (tp->t_rack != NULL) {
+			if (SEQ_GEQ(p->rxmit, tp->t_rack->tr_lost_high)) {
+				p = NULL;
+				goto after_sack_rexmit;
+			}
+			len = min(len, (int32_t)(tp->t_rack->tr_lost_high - p->rxmit));
+		}
 		if (len > 0) {
 			off = p->rxmit - tp->snd_una;
 			sack_rxmit = 1;
@@ -1650,6 +1667,16 @@ after_sack_rexmit:
 		TCP_RESET_REXMT_STATE(tp);
 		tcp_setpersist(tp);
 	}
+	/*
+	 * Everything written has been sent and the window is not full:
+	 * until this flight is delivered the rate samples measure the
+	 * application, not the path.
+	 */
+	if (tp->t_rate != NULL &&
+	    so->so_snd.sb_cc <= tp->snd_max - tp->snd_una &&
+	    tp->snd_max - tp->snd_una < tp->snd_cwnd) {
+		tcp_rate_app_limited(tp);
+	}
 just_return:
 	/*
 	 * If there is no reason to send a segment, just return.
@@ -1679,6 +1706,15 @@ just_return:
 	return 0;
 
 send:
+	/*
+	 * If the connection is paced, hold data back until the pacer says
+	 * it is due.  Segments that carry an ack we owe go out now.
+	 */
+	if (len > 0 && !(flags & TH_SYN) &&
+	    !(tp->t_flagsext & TF_FORCE) && !(tp->t_flags & TF_ACKNOW) &&
+	    tcp_pacing_delay(tp, len)) {
+		goto just_return;
+	}
 	/*
 	 * Set TF_MAXSEGSNT flag if the segment size is greater than
 	 * the max segment size.
@@ -2183,6 +2219,8 @@ send:
 
 			tso_maxlen = tp->tso_max_segment_size ?
 			    tp->tso_max_segment_size : TCP_MAXWIN;
+			tso_maxlen = tcp_pacing_tso_max(tp, tso_maxlen,
+			    (int32_t)hdrlen);
 
 			/* hdrlen includes optlen */
 			if (len > tso_maxlen - hdrlen) {
@@ -2447,7 +2485,9 @@ send:
 		tcp_fillheaders(m, tp, ip6, th);
 		if ((tp->ecn_flags & TE_SENDIPECT) != 0 && len &&
 		    !SEQ_LT(tp->snd_nxt, tp->snd_max) && !sack_rxmit) {
-			ip6->ip6_flow |= htonl(IPTOS_ECN_ECT0 << 20);
+			ip6->ip6_flow |= TCP_L4S_ON(tp) ?
+			    htonl(IPTOS_ECN_ECT1 << 20) :
+			    htonl(IPTOS_ECN_ECT0 << 20);
 		}
 		svc_flags |= PKT_SCF_IPV6;
 #if PF_ECN
@@ -2462,7 +2502,8 @@ send:
 		if ((tp->ecn_flags & TE_SENDIPECT) != 0 && len &&
 		    !SEQ_LT(tp->snd_nxt, tp->snd_max) &&
 		    !sack_rxmit && !(flags & TH_SYN)) {
-			ip->ip_tos |= IPTOS_ECN_ECT0;
+			ip->ip_tos |= TCP_L4S_ON(tp) ? IPTOS_ECN_ECT1 :
+			    IPTOS_ECN_ECT0;
 		}
 #if PF_ECN
 		m_pftag(m)->pftag_hdr = (void *)ip;
@@ -2528,6 +2569,16 @@ send:
 		p->rxmit += len;
 		tp->sackhint.sack_bytes_rexmit += len;
 	}
+	if (len > 0 && tp->t_rate != NULL) {
+		tcp_rate_sent(tp, ntohl(th->th_seq), len,
+		    sack_rxmit || SEQ_LT(tp->snd_nxt, tp->snd_max));
+	}
+	if (len > 0 && SACK_ENABLED(tp) && (tp->t_rack != NULL || tcp_do_rack)) {
+		tcp_rack_sent(tp, ntohl(th->th_seq), len);
+	}
+	if (len > 0) {
+		tcp_pacing_sent(tp, len);
+	}
 	th->th_ack = htonl(tp->rcv_nxt);
 	tp->last_ack_sent = tp->rcv_nxt;
 	if (optlen) {
@@ -2711,7 +2762,9 @@ timer:
 		    tp->snd_nxt == tp->snd_max &&
 		    SEQ_GT(tp->snd_nxt, tp->snd_una) &&
 		    tp->t_rxtshift == 0 &&
-		    (tp->t_flagsext & (TF_SENT_TLPROBE | TF_PKTS_REORDERED)) == 0) {
+		    (tp->t_flagsext & TF_SENT_TLPROBE) == 0 &&
+		    /* RACK's reordering window copes with a reordered probe */
+		    (tp->t_rack != NULL || !(tp->t_flagsext & TF_PKTS_REORDERED))) {
 			uint32_t pto, srtt;
 
 			if (tcp_do_better_lr) {
@@ -3562,3 +3615,312 @@ tcp_recv_throttle(struct tcpcb *tp)
 
 	return 0;
 }
+
+/*
+ * Sender pacing.  A connection is paced at the rate its congestion
+ * control sets in t_pacing_rate or, failing that, at a multiple of
+ * cwnd/srtt when net.inet.tcp.pace_all is set or the socket has a
+ * SO_MAX_PACING_RATE, which also caps the rate in either case.
+ * tcp_output holds a segment back when it is not due yet and files the
+ * connection in a timer wheel, and the wheel calls tcp_output again
+ * once the deadline has passed.
+ *
+ * There is a wheel per CPU with its own lock and thread call, so that
+ * connections sending on different CPUs do not contend for the pacer.
+ * A wheel has TCP_PACING_SLOTS slots of TCP_PACING_SLOT_US each and a
+ * bitmap of the occupied ones.  A deadline beyond the wheel's horizon
+ * goes in its last slot and is filed again when that slot comes due.
+ */
+#define TCP_PACING_SLOT_US      64
+#define TCP_PACING_SLOTS        256     /* a 16ms horizon */
+#define TCP_PACING_SLOT_MASK    (TCP_PACING_SLOTS - 1)
+#define TCP_PACING_WORDS        (TCP_PACING_SLOTS / 64)
+
+/* release segments this close to their deadline rather than rearm */
+#define TCP_PACING_SLOP_US      50
+
+/* a paced TSO burst is kept to about this much time at the pacing rate */
+#define TCP_PACING_TSO_US       1000
+
+TAILQ_HEAD(tcpcb_pacing_head, tcpcb);
+
+struct tcp_pacing_wheel {
+	decl_lck_mtx_data(, tpw_lock);
+	thread_call_t           tpw_call;
+	uint64_t                tpw_slot;       /* first slot not yet serviced */
+	uint64_t                tpw_armed_us;   /* deadline the call is set for, 0 if idle */
+	uint32_t                tpw_count;      /* connections on the wheel */
+	uint64_t                tpw_occupied[TCP_PACING_WORDS];
+	struct tcpcb_pacing_head tpw_slots[TCP_PACING_SLOTS];
+};
+
+static LCK_GRP_DECLARE(tcp_pacing_mtx_grp, "tcppacing");
+static struct tcp_pacing_wheel *PERCPU_DATA(tcp_pacing_wheels);
+
+static void tcp_pacing_run(thread_call_param_t, thread_call_param_t);
+
+void
+tcp_pacing_init(void)
+{
+	percpu_foreach(wp, tcp_pacing_wheels) {
+		struct tcp_pacing_wheel *w;
+
+		w = kalloc_type(struct tcp_pacing_wheel,
+		    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+		lck_mtx_init(&w->tpw_lock, &tcp_pacing_mtx_grp, LCK_ATTR_NULL);
+		for (int i = 0; i < TCP_PACING_SLOTS; i++) {
+			TAILQ_INIT(&w->tpw_slots[i]);
+		}
+		w->tpw_call = thread_call_allocate_with_options(tcp_pacing_run,
+		    w, THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+		if (w->tpw_call == NULL) {
+			panic("failed to allocate the tcp pacing thread call");
+		}
+		*wp = w;
+	}
+}
+
+/*
+ * The rate to pace at in bytes per second, or 0 if the connection is
+ * not paced.
+ */
+static uint64_t
+tcp_pacing_rate(struct tcpcb *tp)
+{
+	uint64_t rate = tp->t_pacing_rate;
+	uint64_t cap = tp->t_inpcb->inp_socket->so_max_pacing_rate;
+
+	if (!tcp_pacing_enabled) {
+		return 0;
+	}
+	if (rate == 0 && (tcp_pace_all || cap != 0) && tp->t_srtt != 0) {
+		uint32_t ratio = (uint32_t)(tp->snd_cwnd < tp->snd_ssthresh ?
+		    tcp_pacing_ss_ratio : tcp_pacing_ca_ratio);
+
+		/* t_srtt is in TCP_RETRANSHZ ticks, scaled by TCP_RTT_SHIFT */
+		rate = (((uint64_t)tp->snd_cwnd * ratio * TCP_RETRANSHZ) <<
+		    TCP_RTT_SHIFT) / (100 * (uint64_t)tp->t_srtt);
+		rate = MAX(rate, tp->t_maxseg);
+	}
+	if (cap != 0 && (rate == 0 || rate > cap)) {
+		rate = cap;
+	}
+	return rate;
+}
+
+/*
+ * Bound a TSO burst of a paced connection, so that a single send does
+ * not put a large part of the window on the wire back to back.
+ */
+static int32_t
+tcp_pacing_tso_max(struct tcpcb *tp, int32_t tso_maxlen, int32_t hdrlen)
+{
+	uint64_t rate = tcp_pacing_rate(tp);
+	uint64_t burst;
+
+	if (rate == 0) {
+		return tso_maxlen;
+	}
+	burst = (rate * TCP_PACING_TSO_US) / USEC_PER_SEC;
+	burst = MAX(burst, 2 * (uint64_t)tp->t_maxopd) + (uint64_t)hdrlen;
+	return (int32_t)MIN(burst, (uint64_t)tso_maxlen);
+}
+
+/* distance from tpw_slot to the next occupied slot, or -1 */
+static int
+tcp_pacing_next_slot(struct tcp_pacing_wheel *w)
+{
+	uint32_t start = (uint32_t)(w->tpw_slot & TCP_PACING_SLOT_MASK);
+
+	for (uint32_t i = 0; i <= TCP_PACING_WORDS; i++) {
+		uint32_t word = ((start / 64) + i) % TCP_PACING_WORDS;
+		uint64_t bits = w->tpw_occupied[word];
+
+		if (i == 0) {
+			bits &= ~0ULL << (start % 64);
+		} else if (i == TCP_PACING_WORDS) {
+			/* wrapped around to the part of the first word before start */
+			bits &= (1ULL << (start % 64)) - 1;
+		}
+		if (bits != 0) {
+			uint32_t slot = word * 64 + (uint32_t)__builtin_ctzll(bits);
+
+			return (int)((slot - start) & TCP_PACING_SLOT_MASK);
+		}
+	}
+	return -1;
+}
+
+static void
+tcp_pacing_arm_locked(struct tcp_pacing_wheel *w, uint64_t now_us)
+{
+	uint64_t next_us, deadline, leeway;
+	int dist;
+
+	LCK_MTX_ASSERT(&w->tpw_lock, LCK_MTX_ASSERT_OWNED);
+
+	if ((dist = tcp_pacing_next_slot(w)) < 0) {
+		return;
+	}
+	/* a slot is due once all of it has passed */
+	next_us = (w->tpw_slot + (uint64_t)dist + 1) * TCP_PACING_SLOT_US;
+	if (w->tpw_armed_us != 0 && w->tpw_armed_us <= next_us) {
+		return;
+	}
+	w->tpw_armed_us = next_us;
+	clock_interval_to_deadline((uint32_t)(next_us > now_us ?
+	    next_us - now_us : 1), NSEC_PER_USEC, &deadline);
+	clock_interval_to_absolutetime_interval(TCP_PACING_SLOP_US,
+	    NSEC_PER_USEC, &leeway);
+	thread_call_enter_delayed_with_leeway(w->tpw_call, NULL, deadline,
+	    leeway, THREAD_CALL_DELAY_LEEWAY);
+}
+
+static void
+tcp_pacing_file_locked(struct tcp_pacing_wheel *w, struct tcpcb *tp,
+    uint64_t now_us)
+{
+	uint64_t slot = tp->t_pacing_next_us / TCP_PACING_SLOT_US;
+	uint32_t idx;
+
+	LCK_MTX_ASSERT(&w->tpw_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (w->tpw_count == 0) {
+		w->tpw_slot = MAX(w->tpw_slot, now_us / TCP_PACING_SLOT_US);
+	}
+	slot = MAX(slot, w->tpw_slot);
+	slot = MIN(slot, w->tpw_slot + TCP_PACING_SLOTS - 1);
+	idx = (uint32_t)(slot & TCP_PACING_SLOT_MASK);
+
+	TAILQ_INSERT_TAIL(&w->tpw_slots[idx], tp, t_pacing_link);
+	w->tpw_occupied[idx / 64] |= 1ULL << (idx % 64);
+	w->tpw_count++;
+}
+
+/*
+ * Called by tcp_output with len bytes of data ready to go.  Returns TRUE
+ * when the segment has to wait for the pacer.
+ */
+boolean_t
+tcp_pacing_delay(struct tcpcb *tp, uint32_t len)
+{
+	struct tcp_pacing_wheel *w;
+	uint64_t now;
+
+	if (len == 0) {
+		return FALSE;
+	}
+	if (tp->t_pacing_queued) {
+		return TRUE;
+	}
+	if (tcp_pacing_rate(tp) == 0) {
+		return FALSE;
+	}
+	now = tcp_rate_now_us();
+	if (tp->t_pacing_next_us <= now + TCP_PACING_SLOP_US) {
+		return FALSE;
+	}
+
+	/* the pacer's reference keeps the pcb around until it runs */
+	if (in_pcb_checkstate(tp->t_inpcb, WNT_ACQUIRE, 1) == WNT_STOPUSING) {
+		return FALSE;
+	}
+	tp->t_pacing_queued = 1;
+
+	/* any wheel will do; the local one is the least contended */
+	w = *PERCPU_GET(tcp_pacing_wheels);
+	lck_mtx_lock(&w->tpw_lock);
+	tcp_pacing_file_locked(w, tp, now);
+	tcp_pacing_arm_locked(w, now);
+	lck_mtx_unlock(&w->tpw_lock);
+	return TRUE;
+}
+
+/*
+ * Account for len bytes that were just sent: the next segment is due
+ * once these have drained at the pacing rate.
+ */
+void
+tcp_pacing_sent(struct tcpcb *tp, uint32_t len)
+{
+	uint64_t rate = tcp_pacing_rate(tp);
+	uint64_t now;
+
+	if (rate == 0) {
+		return;
+	}
+	now = tcp_rate_now_us();
+	tp->t_pacing_next_us = MAX(tp->t_pacing_next_us, now) +
+	    ((uint64_t)len * USEC_PER_SEC) / rate;
+}
+
+/*
+ * Stop pacing at the congestion control's rate.  An entry still on a
+ * wheel is left for the pacer to drop, since only it may unlink entries
+ * it has taken.
+ */
+void
+tcp_pacing_stop(struct tcpcb *tp)
+{
+	tp->t_pacing_rate = 0;
+	tp->t_pacing_next_us = 0;
+}
+
+static void
+tcp_pacing_run(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg1)
+	struct tcp_pacing_wheel *w = arg0;
+	struct tcpcb_pacing_head ready = TAILQ_HEAD_INITIALIZER(ready);
+	struct tcpcb *tp, *tpnext;
+	uint64_t now = tcp_rate_now_us();
+	uint64_t last, n;
+
+	lck_mtx_lock(&w->tpw_lock);
+	w->tpw_armed_us = 0;
+
+	/* collect the slots that have passed, at most one turn's worth */
+	last = (now + TCP_PACING_SLOP_US) / TCP_PACING_SLOT_US;
+	n = last > w->tpw_slot ? MIN(last - w->tpw_slot, TCP_PACING_SLOTS) : 0;
+	for (uint64_t i = 0; i < n; i++) {
+		uint32_t idx = (uint32_t)((w->tpw_slot + i) & TCP_PACING_SLOT_MASK);
+
+		TAILQ_CONCAT(&ready, &w->tpw_slots[idx], t_pacing_link);
+		w->tpw_occupied[idx / 64] &= ~(1ULL << (idx % 64));
+	}
+	w->tpw_slot = MAX(w->tpw_slot, last);
+
+	TAILQ_FOREACH_SAFE(tp, &ready, t_pacing_link, tpnext) {
+		w->tpw_count--;
+		/* filed at the horizon and not due yet */
+		if (tp->t_pacing_next_us > now + TCP_PACING_SLOP_US) {
+			TAILQ_REMOVE(&ready, tp, t_pacing_link);
+			tcp_pacing_file_locked(w, tp, now);
+		}
+	}
+	tcp_pacing_arm_locked(w, now);
+	lck_mtx_unlock(&w->tpw_lock);
+
+	if (TAILQ_EMPTY(&ready)) {
+		return;
+	}
+	calculate_tcp_clock();
+
+	while ((tp = TAILQ_FIRST(&ready)) != NULL) {
+		struct inpcb *inp = tp->t_inpcb;
+		struct socket *so = inp->inp_socket;
+
+		TAILQ_REMOVE(&ready, tp, t_pacing_link);
+
+		socket_lock(so, 1);
+		tp->t_pacing_queued = 0;
+		if (in_pcb_checkstate(inp, WNT_RELEASE, 1) == WNT_STOPUSING) {
+			socket_unlock(so, 1);
+			continue;
+		}
+		if (tp->t_state != TCPS_CLOSED) {
+			(void) tcp_output(tp);
+		}
+		socket_unlock(so, 1);
+	}
+}
@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * RACK-TLP loss detection (RFC 8985).
+ *
+ * Counting duplicate acks says nothing about a retransmission that is
+ * lost again, or about the last segments of a flight, and gets
+ * reordering wrong in both directions.  RACK instead keeps the time each
+ * segment was last sent.  When an ack delivers a segment, every segment
+ * sent before it that is still outstanding is lost once it has also
+ * been out for the RTT of the delivered one plus a reordering window.
+ * The window starts at zero for a connection that has not reordered
+ * anything and otherwise is a quarter of the min RTT, grown on DSACKs
+ * for spurious retransmissions.  Where the window has not yet passed,
+ * the TCPT_DELAYFR timer is armed for the remainder.
+ *
+ * The tail loss probe (see TCPT_PTO) elicits an ack, usually with a
+ * SACK, for the end of a flight; RACK then finds whatever was lost
+ * before it.  With RACK the probe is also rearmed on every ack and no
+ * longer turned off by reordering.
+ *
+ * Only data in a hole of the SACK scoreboard is marked lost, since the
+ * SACK recovery in tcp_output only retransmits from holes; in recovery,
+ * retransmission is limited to the data marked lost.
+ */
+
+#include "tcp_includes.h"
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/sysctl.h>
+#include <kern/zalloc.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp_timer.h>
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, rack, CTLFLAG_RW | CTLFLAG_LOCKED,
+    int, tcp_do_rack, 0, "Detect losses with RACK-TLP (RFC 8985)");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, rack_maxsegs, CTLFLAG_RW | CTLFLAG_LOCKED,
+    static int, tcp_rack_maxsegs, 1024,
+    "Maximum number of segments in a connection's RACK map");
+
+static KALLOC_TYPE_DEFINE(tcp_rack_seg_zone, struct tcp_rack_seg,
+    NET_KT_DEFAULT);
+
+#define TCP_RACK_MERGE_US       100     /* sends this close share a segment */
+#define TCP_RACK_MINRTT_WIN_US  (10 * USEC_PER_SEC)
+#define TCP_RACK_REO_PERSIST    16      /* recoveries a grown window lasts */
+#define TCP_RACK_US_PER_TICK    (USEC_PER_SEC / TCP_RETRANSHZ)
+
+static inline boolean_t
+tcp_rack_sent_after(uint64_t t1, tcp_seq seq1, uint64_t t2, tcp_seq seq2)
+{
+	return t1 > t2 || (t1 == t2 && SEQ_GT(seq1, seq2));
+}
+
+static inline boolean_t
+tcp_rack_in_flight(struct tcp_rack_seg *rs)
+{
+	return (rs->rs_flags & (TCP_RACK_SACKED | TCP_RACK_LOST)) == 0;
+}
+
+/*
+ * The map only starts on an idle connection, so that it covers all
+ * the data in flight.
+ */
+static struct tcp_rack *
+tcp_rack_alloc(struct tcpcb *tp)
+{
+	struct tcp_rack *tr;
+
+	if (!tcp_do_rack || !SACK_ENABLED(tp) || tp->snd_una != tp->snd_max) {
+		return NULL;
+	}
+	tr = kalloc_type(struct tcp_rack, Z_NOWAIT | Z_ZERO);
+	if (tr == NULL) {
+		return NULL;
+	}
+	TAILQ_INIT(&tr->tr_segs);
+	TAILQ_INIT(&tr->tr_tsorted);
+	tr->tr_end_seq = tp->snd_una;
+	tr->tr_fack = tr->tr_fack_next = tp->snd_una;
+	tr->tr_lost_high = tp->snd_una;
+	tr->tr_min_rtt_us = UINT32_MAX;
+	tr->tr_reo_wnd_mult = 1;
+	tp->t_rack = tr;
+	return tr;
+}
+
+static void
+tcp_rack_seg_free(struct tcp_rack *tr, struct tcp_rack_seg *rs)
+{
+	if (tr->tr_hint == rs) {
+		tr->tr_hint = NULL;
+	}
+	TAILQ_REMOVE(&tr->tr_segs, rs, rs_link);
+	if (tcp_rack_in_flight(rs)) {
+		TAILQ_REMOVE(&tr->tr_tsorted, rs, rs_tslink);
+	}
+	if (rs->rs_flags & TCP_RACK_LOST) {
+		tr->tr_nlost--;
+	}
+	if (rs->rs_flags & TCP_RACK_SACKED) {
+		tr->tr_sacked -= rs->rs_end - rs->rs_start;
+	}
+	tr->tr_nsegs--;
+	zfree(tcp_rack_seg_zone, rs);
+}
+
+void
+tcp_rack_free(struct tcpcb *tp)
+{
+	struct tcp_rack *tr = tp->t_rack;
+	struct tcp_rack_seg *rs;
+
+	if (tr == NULL) {
+		return;
+	}
+	while ((rs = TAILQ_FIRST(&tr->tr_segs)) != NULL) {
+		tcp_rack_seg_free(tr, rs);
+	}
+	kfree_type(struct tcp_rack, tr);
+	tp->t_rack = NULL;
+}
+
+/* the first segment that ends after seq */
+static struct tcp_rack_seg *
+tcp_rack_find(struct tcp_rack *tr, tcp_seq seq)
+{
+	struct tcp_rack_seg *rs = tr->tr_hint;
+
+	if (rs == NULL || SEQ_GT(rs->rs_start, seq)) {
+		rs = TAILQ_FIRST(&tr->tr_segs);
+	}
+	while (rs != NULL && SEQ_LEQ(rs->rs_end, seq)) {
+		rs = TAILQ_NEXT(rs, rs_link);
+	}
+	if (rs != NULL) {
+		tr->tr_hint = rs;
+	}
+	return rs;
+}
+
+/*
+ * Split the segment that seq falls inside of, so that one starts at seq.
+ * Returns the first segment starting at or after seq.
+ */
+static struct tcp_rack_seg *
+tcp_rack_split(struct tcp_rack *tr, tcp_seq seq)
+{
+	struct tcp_rack_seg *rs, *n;
+
+	rs = tcp_rack_find(tr, seq);
+	if (rs == NULL || SEQ_LEQ(seq, rs->rs_start)) {
+		return rs;
+	}
+	n = zalloc_flags(tcp_rack_seg_zone, Z_NOWAIT);
+	if (n == NULL) {
+		/* leave the straddling segment be */
+		return TAILQ_NEXT(rs, rs_link);
+	}
+	*n = *rs;
+	n->rs_start = seq;
+	rs->rs_end = seq;
+	TAILQ_INSERT_AFTER(&tr->tr_segs, rs, n, rs_link);
+	if (tcp_rack_in_flight(rs)) {
+		TAILQ_INSERT_AFTER(&tr->tr_tsorted, rs, n, rs_tslink);
+	}
+	if (rs->rs_flags & TCP_RACK_LOST) {
+		tr->tr_nlost++;
+	}
+	tr->tr_nsegs++;
+	return n;
+}
+
+/*
+ * Hold the map to tcp_rack_maxsegs by forgetting the lowest segments;
+ * nothing RACK knows about them is needed for data it still tracks,
+ * and their holes stay in the SACK scoreboard.
+ */
+static void
+tcp_rack_trim(struct tcp_rack *tr)
+{
+	struct tcp_rack_seg *rs;
+
+	while (tr->tr_nsegs > (uint32_t)tcp_rack_maxsegs &&
+	    (rs = TAILQ_FIRST(&tr->tr_segs)) != NULL) {
+		tcp_rack_seg_free(tr, rs);
+	}
+}
+
+/*
+ * Record len bytes at seq as sent now.  Called by tcp_output for every
+ * segment carrying data; data below the end of the map is being sent
+ * again.
+ */
+void
+tcp_rack_sent(struct tcpcb *tp, tcp_seq seq, uint32_t len)
+{
+	struct tcp_rack *tr = tp->t_rack;
+	struct tcp_rack_seg *rs, *tail;
+	tcp_seq end = seq + len;
+	uint64_t now;
+
+	if (tr == NULL && (tr = tcp_rack_alloc(tp)) == NULL) {
+		return;
+	}
+	now = tcp_rate_now_us();
+
+	tail = TAILQ_LAST(&tr->tr_segs, tcp_rack_seghead);
+	if (tail != NULL && SEQ_LT(seq, tail->rs_end)) {
+		tcp_seq high = tail->rs_end;
+
+		rs = tcp_rack_split(tr, seq);
+		(void) tcp_rack_split(tr, SEQ_MIN(end, high));
+		for (; rs != NULL && SEQ_LT(rs->rs_start, end);
+		    rs = TAILQ_NEXT(rs, rs_link)) {
+			if (rs->rs_flags & TCP_RACK_SACKED) {
+				continue;
+			}
+			if (rs->rs_flags & TCP_RACK_LOST) {
+				rs->rs_flags &= ~TCP_RACK_LOST;
+				tr->tr_nlost--;
+			} else {
+				TAILQ_REMOVE(&tr->tr_tsorted, rs, rs_tslink);
+			}
+			rs->rs_xmit_us = now;
+			if (rs->rs_xmits < UINT16_MAX) {
+				rs->rs_xmits++;
+			}
+			TAILQ_INSERT_TAIL(&tr->tr_tsorted, rs, rs_tslink);
+		}
+		if (SEQ_LEQ(end, high)) {
+			tcp_rack_trim(tr);
+			return;
+		}
+		/* the rest is new data */
+		seq = high;
+		tail = TAILQ_LAST(&tr->tr_segs, tcp_rack_seghead);
+	}
+
+	/*
+	 * A burst from one call to tcp_output shares a segment; a later
+	 * send time only delays the detection of a loss.
+	 */
+	if (tail != NULL && tail->rs_end == seq && tail->rs_flags == 0 &&
+	    tail->rs_xmits == 1 && now - tail->rs_xmit_us <= TCP_RACK_MERGE_US) {
+		tail->rs_end = end;
+		tail->rs_xmit_us = now;
+		TAILQ_REMOVE(&tr->tr_tsorted, tail, rs_tslink);
+		TAILQ_INSERT_TAIL(&tr->tr_tsorted, tail, rs_tslink);
+		return;
+	}
+	rs = zalloc_flags(tcp_rack_seg_zone, Z_NOWAIT | Z_ZERO);
+	if (rs == NULL) {
+		tcp_rack_trim(tr);
+		return;
+	}
+	rs->rs_start = seq;
+	rs->rs_end = end;
+	rs->rs_xmit_us = now;
+	rs->rs_xmits = 1;
+	TAILQ_INSERT_TAIL(&tr->tr_segs, rs, rs_link);
+	TAILQ_INSERT_TAIL(&tr->tr_tsorted, rs, rs_tslink);
+	tr->tr_nsegs++;
+	tcp_rack_trim(tr);
+}
+
+/*
+ * A segment was delivered: advance RACK to it if it is the most recently
+ * sent, and take note of reordering.
+ */
+static void
+tcp_rack_delivered(struct tcp_rack *tr, struct tcp_rack_seg *rs,
+    uint64_t now)
+{
+	uint32_t rtt = (uint32_t)MIN(now - rs->rs_xmit_us, UINT32_MAX);
+
+	if (rs->rs_xmits > 1) {
+		/* too quick to be for the last transmission */
+		if (rtt < tr->tr_min_rtt_us) {
+			return;
+		}
+	} else if (SEQ_LT(rs->rs_end, tr->tr_fack)) {
+		/* delivered after data sent later in sequence */
+		tr->tr_reordering_seen = 1;
+	} else {
+		tr->tr_fack_next = SEQ_MAX(tr->tr_fack_next, rs->rs_end);
+	}
+
+	if (rtt < tr->tr_min_rtt_us ||
+	    now - tr->tr_min_rtt_stamp_us > TCP_RACK_MINRTT_WIN_US) {
+		tr->tr_min_rtt_us = rtt;
+		tr->tr_min_rtt_stamp_us = now;
+	}
+	if (tcp_rack_sent_after(rs->rs_xmit_us, rs->rs_end, tr->tr_xmit_us,
+	    tr->tr_end_seq)) {
+		tr->tr_xmit_us = rs->rs_xmit_us;
+		tr->tr_end_seq = rs->rs_end;
+		tr->tr_rtt_us = rtt;
+	}
+}
+
+/*
+ * Called by tcp_sack_doack for each range of the scoreboard that the
+ * ack SACKs for the first time.
+ */
+void
+tcp_rack_sacked(struct tcpcb *tp, tcp_seq start, tcp_seq end)
+{
+	struct tcp_rack *tr = tp->t_rack;
+	struct tcp_rack_seg *rs;
+	uint64_t now;
+
+	if (tr == NULL) {
+		return;
+	}
+	now = tcp_rate_now_us();
+	rs = tcp_rack_split(tr, start);
+	(void) tcp_rack_split(tr, end);
+	for (; rs != NULL && SEQ_LEQ(rs->rs_end, end);
+	    rs = TAILQ_NEXT(rs, rs_link)) {
+		if (rs->rs_flags & TCP_RACK_SACKED) {
+			continue;
+		}
+		tcp_rack_delivered(tr, rs, now);
+		if (rs->rs_flags & TCP_RACK_LOST) {
+			rs->rs_flags &= ~TCP_RACK_LOST;
+			tr->tr_nlost--;
+		} else {
+			TAILQ_REMOVE(&tr->tr_tsorted, rs, rs_tslink);
+		}
+		rs->rs_flags |= TCP_RACK_SACKED;
+		tr->tr_sacked += rs->rs_end - rs->rs_start;
+	}
+}
+
+/*
+ * A valid DSACK was received: some retransmission was spurious.
+ */
+void
+tcp_rack_dsack(struct tcpcb *tp)
+{
+	if (tp->t_rack != NULL) {
+		tp->t_rack->tr_dsack_pending = 1;
+	}
+}
+
+/*
+ * Grow the reordering window by a quarter min RTT at most once a round
+ * trip for DSACKs, and shrink it back after 16 recoveries without one.
+ */
+static void
+tcp_rack_update_reo_wnd(struct tcpcb *tp, struct tcp_rack *tr)
+{
+	if (tr->tr_dsack_round_valid &&
+	    SEQ_GEQ(tp->snd_una, tr->tr_dsack_round)) {
+		tr->tr_dsack_round_valid = 0;
+	}
+	if (tr->tr_dsack_pending && !tr->tr_dsack_round_valid) {
+		tr->tr_dsack_round = tp->snd_nxt;
+		tr->tr_dsack_round_valid = 1;
+		if (tr->tr_reo_wnd_mult < UINT8_MAX) {
+			tr->tr_reo_wnd_mult++;
+		}
+		tr->tr_reo_wnd_persist = TCP_RACK_REO_PERSIST;
+	} else if (tr->tr_in_recovery && !IN_FASTRECOVERY(tp) &&
+	    tr->tr_reo_wnd_persist > 0) {
+		if (--tr->tr_reo_wnd_persist == 0) {
+			tr->tr_reo_wnd_mult = 1;
+		}
+	}
+	tr->tr_dsack_pending = 0;
+}
+
+static uint64_t
+tcp_rack_reo_wnd(struct tcpcb *tp, struct tcp_rack *tr)
+{
+	uint64_t srtt_us;
+
+	/* without reordering, a dupthresh worth of SACKs is enough */
+	if (!tr->tr_reordering_seen &&
+	    (IN_FASTRECOVERY(tp) || tp->t_rxtshift > 0 ||
+	    tr->tr_sacked >= tcprexmtthresh * tp->t_maxseg)) {
+		return 0;
+	}
+	srtt_us = (uint64_t)(tp->t_srtt >> TCP_RTT_SHIFT) * TCP_RACK_US_PER_TICK;
+	if (tr->tr_min_rtt_us == UINT32_MAX) {
+		return srtt_us;
+	}
+	return MIN((uint64_t)tr->tr_reo_wnd_mult * tr->tr_min_rtt_us / 4,
+	    srtt_us);
+}
+
+static void
+tcp_rack_mark_lost(struct tcpcb *tp, struct tcp_rack *tr,
+    struct tcp_rack_seg *rs)
+{
+	TAILQ_REMOVE(&tr->tr_tsorted, rs, rs_tslink);
+	rs->rs_flags |= TCP_RACK_LOST;
+	tr->tr_nlost++;
+	tr->tr_lost_high = SEQ_MAX(tr->tr_lost_high, rs->rs_end);
+	if (rs->rs_xmits > 1) {
+		/* the retransmission was lost too */
+		tcp_sack_lost_range(tp, rs->rs_start, rs->rs_end);
+	}
+}
+
+/*
+ * Mark lost what was sent before the RACK segment and has been out for
+ * longer than its RTT plus the reordering window.  Returns the time
+ * until the next segment would be, or 0.
+ */
+static uint64_t
+tcp_rack_detect_loss(struct tcpcb *tp, struct tcp_rack *tr, uint64_t now)
+{
+	struct tcp_rack_seg *rs, *next;
+	uint64_t reo_wnd, deadline, timeout = 0;
+
+	if (TAILQ_EMPTY(&tp->snd_holes) || tr->tr_xmit_us == 0) {
+		return 0;
+	}
+	reo_wnd = tcp_rack_reo_wnd(tp, tr);
+	TAILQ_FOREACH_SAFE(rs, &tr->tr_tsorted, rs_tslink, next) {
+		if (!tcp_rack_sent_after(tr->tr_xmit_us, tr->tr_end_seq,
+		    rs->rs_xmit_us, rs->rs_end)) {
+			break;
+		}
+		if (SEQ_GEQ(rs->rs_start, tp->snd_fack)) {
+			continue;
+		}
+		deadline = rs->rs_xmit_us + tr->tr_rtt_us + reo_wnd;
+		if (deadline <= now) {
+			tcp_rack_mark_lost(tp, tr, rs);
+		} else {
+			timeout = MAX(timeout, deadline - now);
+		}
+	}
+	return timeout;
+}
+
+static void
+tcp_rack_enter_recovery(struct tcpcb *tp)
+{
+	if (tp->t_flags & TF_SENTFIN) {
+		tp->snd_recover = tp->snd_max - 1;
+	} else {
+		tp->snd_recover = tp->snd_max;
+	}
+	tp->t_timer[TCPT_PTO] = 0;
+	tp->t_rtttime = 0;
+
+	tcp_enter_fast_recovery(tp);
+	tcp_ccdbg_trace(tp, NULL, TCP_CC_ENTER_FASTRECOVERY);
+	(void) tcp_output(tp);
+}
+
+/*
+ * Run loss detection, start recovery on a loss and arm the reordering
+ * timer for what is not yet known to be lost.
+ */
+static void
+tcp_rack_check(struct tcpcb *tp, struct tcp_rack *tr, uint64_t now)
+{
+	uint64_t timeout = tcp_rack_detect_loss(tp, tr, now);
+
+	if (timeout > 0) {
+		tp->t_timer[TCPT_DELAYFR] = OFFSET_FROM_START(tp,
+		    (uint32_t)howmany(timeout, TCP_RACK_US_PER_TICK));
+	} else {
+		tp->t_timer[TCPT_DELAYFR] = 0;
+	}
+	if (tr->tr_nlost > 0 && !IN_FASTRECOVERY(tp) && tp->t_rxtshift == 0 &&
+	    tp->t_state >= TCPS_ESTABLISHED && tp->t_state < TCPS_TIME_WAIT) {
+		tcp_rack_enter_recovery(tp);
+	}
+}
+
+/*
+ * Rearm the tail loss probe on an ack, as long as there is no recovery
+ * under way and no probe outstanding.
+ */
+static void
+tcp_rack_arm_pto(struct tcpcb *tp)
+{
+	uint32_t pto;
+
+	if (!tcp_enable_tlp || tp->t_state != TCPS_ESTABLISHED ||
+	    IN_FASTRECOVERY(tp) || tp->t_rxtshift > 0 ||
+	    tp->snd_una == tp->snd_max ||
+	    (tp->t_flagsext & TF_SENT_TLPROBE) || tp->t_srtt == 0) {
+		return;
+	}
+	pto = 2 * (tp->t_srtt >> TCP_RTT_SHIFT);
+	if (tp->snd_max - tp->snd_una <= tp->t_maxseg) {
+		pto += tcp_delack;
+	} else {
+		pto += 2;
+	}
+	pto = min(pto, tp->t_rxtcur);
+	tp->t_timer[TCPT_PTO] = OFFSET_FROM_START(tp, pto);
+}
+
+/*
+ * Called after snd_una and the scoreboard have been updated for an ack.
+ */
+void
+tcp_rack_ack(struct tcpcb *tp)
+{
+	struct tcp_rack *tr = tp->t_rack;
+	struct tcp_rack_seg *rs;
+	uint64_t now;
+
+	if (tr == NULL) {
+		return;
+	}
+	now = tcp_rate_now_us();
+
+	/* deliver and forget what is cumulatively acked */
+	while ((rs = TAILQ_FIRST(&tr->tr_segs)) != NULL &&
+	    SEQ_LEQ(rs->rs_end, tp->snd_una)) {
+		if (!(rs->rs_flags & TCP_RACK_SACKED)) {
+			tcp_rack_delivered(tr, rs, now);
+		}
+		tcp_rack_seg_free(tr, rs);
+	}
+	if (rs != NULL && SEQ_LT(rs->rs_start, tp->snd_una)) {
+		if (rs->rs_flags & TCP_RACK_SACKED) {
+			tr->tr_sacked -= tp->snd_una - rs->rs_start;
+		}
+		rs->rs_start = tp->snd_una;
+	}
+	tr->tr_fack = tr->tr_fack_next = SEQ_MAX(tr->tr_fack, tr->tr_fack_next);
+	tr->tr_lost_high = SEQ_MAX(tr->tr_lost_high, tp->snd_una);
+
+	tcp_rack_update_reo_wnd(tp, tr);
+	tcp_rack_check(tp, tr, now);
+	tcp_rack_arm_pto(tp);
+	tr->tr_in_recovery = IN_FASTRECOVERY(tp) ? 1 : 0;
+}
+
+/*
+ * The reordering window ran out for a segment (TCPT_DELAYFR).
+ */
+void
+tcp_rack_timeout(struct tcpcb *tp)
+{
+	struct tcp_rack *tr = tp->t_rack;
+	boolean_t in_recovery = IN_FASTRECOVERY(tp) ? TRUE : FALSE;
+
+	/* entering recovery sends the retransmissions */
+	tcp_rack_check(tp, tr, tcp_rate_now_us());
+	if (in_recovery && tr->tr_nlost > 0) {
+		(void) tcp_output(tp);
+	}
+	tr->tr_in_recovery = IN_FASTRECOVERY(tp) ? 1 : 0;
+}
@@ -66,6 +66,9 @@ rledbat_clear_state(struct tcpcb *tp)
 	tp->t_rlstate.rcvd_bytes = 0;
 	tp->t_rlstate.md_rcvd_bytes = 0;
 	tp->t_rlstate.drained_bytes = 0;
+	tp->t_rlstate.ce_seen = tp->t_ecn_recv_ce;
+	tp->t_rlstate.ce_round_pkts = 0;
+	tp->t_rlstate.ce_round_bytes = 0;
 }
 
 void
@@ -212,6 +215,94 @@ rledbat_congestion_avd(struct tcpcb *tp, uint32_t segment_len,
 	}
 }
 
+/*
+ * Halve the window on a congestion signal, at most once per RTT.
+ */
+static void
+rledbat_halve(struct tcpcb *tp, uint32_t now, uint32_t srtt)
+{
+	uint32_t win;
+
+	if (now < tp->t_rlstate.reduction_end) {
+		/* still need to wait for reduction end to elapse */
+		return;
+	}
+
+	win = tp->t_rlstate.win / 2;
+	win = tcp_round_to(win, tp->t_maxseg);
+	if (win < 2 * tp->t_maxseg) {
+		win = 2 * tp->t_maxseg;
+	}
+	tp->t_rlstate.ssthresh = win;
+	tp->t_rlstate.win = win;
+
+	/* Reset the received bytes */
+	tp->t_rlstate.rcvd_bytes = 0;
+	tp->t_rlstate.md_rcvd_bytes = 0;
+
+	/* Update the reduction end time */
+	tp->t_rlstate.reduction_end = now + 2 * srtt;
+
+	if (tp->t_rlstate.slowdown_ts != 0) {
+		/* As the window has been halved, defer the slowdown. */
+		tp->t_rlstate.slowdown_ts = now + TCP_BASE_RTT_INTERVAL;
+	}
+}
+
+/*
+ * React to CE marks on the received data.  A sender using L4S (sending
+ * ECT(1), as accurate ECN reports) expects a reduction in proportion to
+ * the marks: the window shrinks by half the marked fraction of each
+ * window of data.  Classic ECN marks are treated like a loss.
+ *
+ * Returns true if the window was reduced.
+ */
+static bool
+rledbat_ce_rcvd(struct tcpcb *tp, uint32_t segment_len, uint32_t now,
+    uint32_t srtt)
+{
+	uint32_t ce = tp->t_ecn_recv_ce - tp->t_rlstate.ce_seen;
+	uint32_t win, update;
+
+	tp->t_rlstate.ce_seen = tp->t_ecn_recv_ce;
+
+	if (tp->t_rcv_ect1_bytes <= tp->t_rcv_ect0_bytes) {
+		if (ce == 0) {
+			return false;
+		}
+		rledbat_halve(tp, now, srtt);
+		return true;
+	}
+
+	tp->t_rlstate.ce_round_pkts += ce;
+	tp->t_rlstate.ce_round_bytes += segment_len;
+	if (tp->t_rlstate.ce_round_bytes < tp->t_rlstate.win) {
+		return false;
+	}
+
+	win = tp->t_rlstate.win;
+	update = (uint32_t)MIN((uint64_t)win * tp->t_rlstate.ce_round_pkts *
+	    tp->t_maxseg / (2 * (uint64_t)tp->t_rlstate.ce_round_bytes),
+	    win / 2);
+	tp->t_rlstate.ce_round_pkts = 0;
+	tp->t_rlstate.ce_round_bytes = 0;
+	if (update == 0) {
+		return false;
+	}
+
+	win = tcp_round_to(win - update, tp->t_maxseg);
+	if (win < bg_ss_fltsz * tp->t_maxseg) {
+		win = bg_ss_fltsz * tp->t_maxseg;
+	}
+	tp->t_rlstate.win = win;
+	if (tp->t_rlstate.ssthresh > win) {
+		tp->t_rlstate.ssthresh = win;
+	}
+	tp->t_rlstate.rcvd_bytes = 0;
+	tp->t_rlstate.md_rcvd_bytes = 0;
+	return true;
+}
+
 /*
  * Update win based on ledbat++ algo
  */
@@ -268,31 +359,11 @@ tcp_rledbat_data_rcvd(struct tcpcb *tp, struct tcphdr *th,
 	 */
 	if (SEQ_LT(th->th_seq + segment_len, tp->rcv_high) &&
 	    TSTMP_GEQ(to->to_tsval, tp->tsv_high)) {
-		if (tcp_globals_now(globals) < tp->t_rlstate.reduction_end) {
-			/* still need to wait for reduction end to elapse */
-			return;
-		}
-
-		uint32_t win = tp->t_rlstate.win / 2;
-		win = tcp_round_to(win, tp->t_maxseg);
-		if (win < 2 * tp->t_maxseg) {
-			win = 2 * tp->t_maxseg;
-		}
-		tp->t_rlstate.ssthresh = win;
-		tp->t_rlstate.win = win;
-
-		/* Reset the received bytes */
-		tp->t_rlstate.rcvd_bytes = 0;
-		tp->t_rlstate.md_rcvd_bytes = 0;
-
-		/* Update the reduction end time */
-		tp->t_rlstate.reduction_end = tcp_globals_now(globals) + 2 * srtt;
+		rledbat_halve(tp, tcp_globals_now(globals), srtt);
+		return;
+	}
 
-		if (tp->t_rlstate.slowdown_ts != 0) {
-			/* As the window has been halved, defer the slowdown. */
-			tp->t_rlstate.slowdown_ts = tcp_globals_now(globals) +
-			    TCP_BASE_RTT_INTERVAL;
-		}
+	if (rledbat_ce_rcvd(tp, segment_len, tcp_globals_now(globals), srtt)) {
 		return;
 	}
 
@@ -72,6 +72,8 @@
 #include <sys/socket.h>
 #include <sys/socketvar.h>
 
+#include <kern/clock.h>
+#include <kern/startup.h>
 #include <kern/zalloc.h>
 
 #include <net/route.h>
@@ -117,8 +119,35 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, sack_globalholes, CTLFLAG_RD | CTLFLAG_LOCKE
     &tcp_sack_globalholes, 0,
     "Global number of TCP SACK holes currently allocated");
 
+#if (DEVELOPMENT || DEBUG)
+static int tcp_sack_debug = 0;
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, sack_debug, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &tcp_sack_debug, 0, "Cross-check the SACK hints against the scoreboard");
+#endif /* (DEVELOPMENT || DEBUG) */
+
 static KALLOC_TYPE_DEFINE(sack_hole_zone, struct sackhole, NET_KT_DEFAULT);
 
+/*
+ * The holes of the scoreboard never overlap, so ordering them by their
+ * start sequence number is a total order.  doack may move start forward
+ * in place; it never moves it past the start of the next hole.
+ */
+static int
+tcp_sackhole_cmp(struct sackhole *a, struct sackhole *b)
+{
+	if (SEQ_LT(a->start, b->start)) {
+		return -1;
+	}
+	if (SEQ_GT(a->start, b->start)) {
+		return 1;
+	}
+	return 0;
+}
+
+RB_PROTOTYPE_SC(__private_extern__, sackhole_tree, sackhole, scbtree,
+    tcp_sackhole_cmp);
+RB_GENERATE(sackhole_tree, sackhole, scbtree, tcp_sackhole_cmp);
+
 #define TCP_VALIDATE_SACK_SEQ_NUMBERS(_tp_, _sb_, _ack_) \
     (SEQ_GT((_sb_)->end, (_sb_)->start) && \
     SEQ_GT((_sb_)->start, (_tp_)->snd_una) && \
@@ -260,6 +289,7 @@ tcp_sackhole_alloc(struct tcpcb *tp, tcp_seq start, tcp_seq end)
 	hole->rxmit = start;
 
 	tp->snd_numholes++;
+	tp->sackhint.sack_hole_bytes += (end - start);
 	OSIncrementAtomic(&tcp_sack_globalholes);
 
 	return hole;
@@ -271,6 +301,7 @@ tcp_sackhole_alloc(struct tcpcb *tp, tcp_seq start, tcp_seq end)
 static void
 tcp_sackhole_free(struct tcpcb *tp, struct sackhole *hole)
 {
+	tp->sackhint.sack_hole_bytes -= (hole->end - hole->start);
 	zfree(sack_hole_zone, hole);
 
 	tp->snd_numholes--;
@@ -298,6 +329,7 @@ tcp_sackhole_insert(struct tcpcb *tp, tcp_seq start, tcp_seq end,
 	} else {
 		TAILQ_INSERT_TAIL(&tp->snd_holes, hole, scblink);
 	}
+	RB_INSERT(sackhole_tree, &tp->snd_holes_tree, hole);
 
 	/* Update SACK hint. */
 	if (tp->sackhint.nexthole == NULL) {
@@ -320,10 +352,29 @@ tcp_sackhole_remove(struct tcpcb *tp, struct sackhole *hole)
 
 	/* Remove this SACK hole. */
 	TAILQ_REMOVE(&tp->snd_holes, hole, scblink);
+	RB_REMOVE(sackhole_tree, &tp->snd_holes_tree, hole);
 
 	/* Free this SACK hole. */
 	tcp_sackhole_free(tp, hole);
 }
+
+/*
+ * Find the last hole that starts before seq, or NULL if there is none.
+ * This is the only hole that can contain seq - 1.
+ */
+static struct sackhole *
+tcp_sackhole_lookup(struct tcpcb *tp, tcp_seq seq)
+{
+	struct sackhole key, *hole;
+
+	key.start = seq;
+	hole = RB_NFIND(sackhole_tree, &tp->snd_holes_tree, &key);
+	if (hole == NULL) {
+		return TAILQ_LAST(&tp->snd_holes, sackhole_head);
+	}
+	return TAILQ_PREV(hole, sackhole_head, scblink);
+}
+
 /*
  * When a new ack with SACK is received, check if it indicates packet
  * reordering. If there is packet reordering, the socket is marked and
@@ -423,6 +474,12 @@ tcp_sack_update_byte_counter(struct tcpcb *tp, uint32_t start, uint32_t end,
 	if (SEQ_GEQ(start, tp->send_highest_sack)) {
 		*towards_fr_acked += (end - start);
 	}
+	if (tp->t_rate != NULL) {
+		tcp_rate_sacked(tp, end - start);
+	}
+	if (tp->t_rack != NULL) {
+		tcp_rack_sacked(tp, start, end);
+	}
 }
 
 /*
@@ -493,6 +550,14 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		 * the logic that adds holes to the tail of the scoreboard).
 		 */
 		tp->snd_fack = SEQ_MAX(tp->snd_una, th_ack);
+		/*
+		 * The cumulative part of this ack is not a hole, so it is
+		 * not marked below; count it here for the rate sampler, as
+		 * it would be with holes, for tcp_rate_acked() to settle.
+		 */
+		if (tp->t_rate != NULL && SEQ_LT(tp->snd_una, th_ack)) {
+			tcp_rate_sacked(tp, th_ack - tp->snd_una);
+		}
 	}
 
 	old_snd_fack = tp->snd_fack;
@@ -564,10 +629,12 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		}
 		if (SEQ_LEQ(sblkp->end, cur->start)) {
 			/*
-			 * SACKs data before the current hole.
-			 * Go to the previous hole.
+			 * SACKs data before the current hole.  Skip
+			 * straight to the hole it may overlap: with a large
+			 * scoreboard, a cumulative ACK would otherwise walk
+			 * every hole between snd_fack and snd_una.
 			 */
-			cur = TAILQ_PREV(cur, sackhole_head, scblink);
+			cur = tcp_sackhole_lookup(tp, sblkp->end);
 			continue;
 		}
 		tp->sackhint.sack_bytes_rexmit -= (cur->rxmit - cur->start);
@@ -596,6 +663,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				tcp_sack_update_byte_counter(tp, cur->start, sblkp->end, newbytes_acked, after_rexmit_acked);
 				tcp_sack_detect_reordering(tp, cur,
 				    sblkp->end, old_snd_fack);
+				tp->sackhint.sack_hole_bytes -=
+				    (sblkp->end - cur->start);
 				cur->start = sblkp->end;
 				cur->rxmit = SEQ_MAX(cur->rxmit, cur->start);
 			}
@@ -606,6 +675,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				tcp_sack_update_byte_counter(tp, sblkp->start, cur->end, newbytes_acked, after_rexmit_acked);
 				tcp_sack_detect_reordering(tp, cur,
 				    cur->end, old_snd_fack);
+				tp->sackhint.sack_hole_bytes -=
+				    (cur->end - sblkp->start);
 				cur->end = sblkp->start;
 				cur->rxmit = SEQ_MIN(cur->rxmit, cur->end);
 			} else {
@@ -625,6 +696,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 						        += (temp->rxmit
 						    - temp->start);
 					}
+					tp->sackhint.sack_hole_bytes -=
+					    (cur->end - sblkp->start);
 					cur->end = sblkp->start;
 					cur->rxmit = SEQ_MIN(cur->rxmit,
 					    cur->end);
@@ -663,6 +736,9 @@ tcp_free_sackholes(struct tcpcb *tp)
 	while ((q = TAILQ_FIRST(&tp->snd_holes)) != NULL) {
 		tcp_sackhole_remove(tp, q);
 	}
+	if (tp->t_rate != NULL) {
+		tcp_rate_sack_reset(tp);
+	}
 	tp->sackhint.sack_bytes_rexmit = 0;
 	tp->sackhint.sack_bytes_acked = 0;
 	tp->t_new_dupacks = 0;
@@ -719,9 +795,10 @@ tcp_sack_partialack(struct tcpcb *tp, struct tcphdr *th)
 	(void) tcp_output(tp);
 }
 
+#if (DEVELOPMENT || DEBUG)
 /*
- * Debug version of tcp_sack_output() that walks the scoreboard. Used for
- * now to sanity check the hint.
+ * Debug version of tcp_sack_output() that walks the scoreboard. Used to
+ * sanity check the hint when net.inet.tcp.sack_debug is set.
  */
 static struct sackhole *
 tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
@@ -741,6 +818,7 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 	}
 	return p;
 }
+#endif /* (DEVELOPMENT || DEBUG) */
 
 /*
  * Returns the next hole to retransmit and the number of retransmitted bytes
@@ -762,10 +840,12 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 struct sackhole *
 tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 {
-	struct sackhole *hole = NULL, *dbg_hole = NULL;
+	struct sackhole *hole = NULL;
+#if (DEVELOPMENT || DEBUG)
+	struct sackhole *dbg_hole;
 	int dbg_bytes_rexmt;
+#endif /* (DEVELOPMENT || DEBUG) */
 
-	dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
 	*sack_bytes_rexmt = tp->sackhint.sack_bytes_rexmit;
 	hole = tp->sackhint.nexthole;
 	if (hole == NULL || SEQ_LT(hole->rxmit, hole->end)) {
@@ -778,6 +858,11 @@ tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 		}
 	}
 out:
+#if (DEVELOPMENT || DEBUG)
+	if (!tcp_sack_debug) {
+		return hole;
+	}
+	dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
 	if (dbg_hole != hole) {
 		printf("%s: Computed sack hole not the same as cached value\n", __func__);
 		hole = dbg_hole;
@@ -788,6 +873,7 @@ out:
 		    __func__, dbg_bytes_rexmt, *sack_bytes_rexmt);
 		*sack_bytes_rexmt = dbg_bytes_rexmt;
 	}
+#endif /* (DEVELOPMENT || DEBUG) */
 	return hole;
 }
 
@@ -808,6 +894,41 @@ tcp_sack_lost_rexmit(struct tcpcb *tp)
 	tp->sack_newdata = tp->snd_nxt;
 }
 
+/*
+ * A retransmission of [start, end) was lost as well: rewind the holes it
+ * falls in so that tcp_sack_output hands it out again.  Data retransmitted
+ * after it in the same hole is sent again too.
+ */
+void
+tcp_sack_lost_range(struct tcpcb *tp, tcp_seq start, tcp_seq end)
+{
+	struct sackhole *hole;
+
+	hole = tcp_sackhole_lookup(tp, start + 1);
+	if (hole == NULL) {
+		hole = TAILQ_FIRST(&tp->snd_holes);
+	}
+	for (; hole != NULL; hole = TAILQ_NEXT(hole, scblink)) {
+		tcp_seq from;
+
+		if (SEQ_LEQ(hole->end, start)) {
+			continue;
+		}
+		if (SEQ_GEQ(hole->start, end)) {
+			break;
+		}
+		from = SEQ_MAX(hole->start, start);
+		if (SEQ_GT(hole->rxmit, from)) {
+			tp->sackhint.sack_bytes_rexmit -= (hole->rxmit - from);
+			hole->rxmit = from;
+			if (tp->sackhint.nexthole == NULL ||
+			    SEQ_GT(tp->sackhint.nexthole->start, hole->start)) {
+				tp->sackhint.nexthole = hole;
+			}
+		}
+	}
+}
+
 /*
  * After a timeout, the SACK list may be rebuilt.  This SACK information
  * should be used to avoid retransmitting SACKed data.  This function
@@ -816,9 +937,9 @@ tcp_sack_lost_rexmit(struct tcpcb *tp)
 void
 tcp_sack_adjust(struct tcpcb *tp)
 {
-	struct sackhole *p, *cur = TAILQ_FIRST(&tp->snd_holes);
+	struct sackhole *p, *cur;
 
-	if (cur == NULL) {
+	if (TAILQ_EMPTY(&tp->snd_holes)) {
 		return; /* No holes */
 	}
 	if (SEQ_GEQ(tp->snd_nxt, tp->snd_fack)) {
@@ -829,21 +950,12 @@ tcp_sack_adjust(struct tcpcb *tp)
 	 * i) snd_nxt lies between end of one hole and beginning of another
 	 * ii) snd_nxt lies between end of last hole and snd_fack
 	 */
-	while ((p = TAILQ_NEXT(cur, scblink)) != NULL) {
-		if (SEQ_LT(tp->snd_nxt, cur->end)) {
-			return;
-		}
-		if (SEQ_GEQ(tp->snd_nxt, p->start)) {
-			cur = p;
-		} else {
-			tp->snd_nxt = p->start;
-			return;
-		}
-	}
-	if (SEQ_LT(tp->snd_nxt, cur->end)) {
+	cur = tcp_sackhole_lookup(tp, tp->snd_nxt + 1);
+	if (cur == NULL || SEQ_LT(tp->snd_nxt, cur->end)) {
 		return;
 	}
-	tp->snd_nxt = tp->snd_fack;
+	p = TAILQ_NEXT(cur, scblink);
+	tp->snd_nxt = (p != NULL) ? p->start : tp->snd_fack;
 	return;
 }
 
@@ -854,8 +966,8 @@ tcp_sack_adjust(struct tcpcb *tp)
 boolean_t
 tcp_sack_byte_islost(struct tcpcb *tp)
 {
-	u_int32_t unacked_bytes, sndhole_bytes = 0;
-	struct sackhole *sndhole;
+	u_int32_t unacked_bytes, sndhole_bytes;
+
 	if (!SACK_ENABLED(tp) || IN_FASTRECOVERY(tp) ||
 	    TAILQ_EMPTY(&tp->snd_holes) ||
 	    (tp->t_flagsext & TF_PKTS_REORDERED)) {
@@ -864,9 +976,7 @@ tcp_sack_byte_islost(struct tcpcb *tp)
 
 	unacked_bytes = tp->snd_max - tp->snd_una;
 
-	TAILQ_FOREACH(sndhole, &tp->snd_holes, scblink) {
-		sndhole_bytes += (sndhole->end - sndhole->start);
-	}
+	sndhole_bytes = tp->sackhint.sack_hole_bytes;
 
 	VERIFY(unacked_bytes >= sndhole_bytes);
 	return (unacked_bytes - sndhole_bytes) >
@@ -947,6 +1057,7 @@ tcp_sack_process_dsack(struct tcpcb *tp, struct tcpopt *to,
 	to->to_sacks += TCPOLEN_SACK;
 	tcpstat.tcps_dsack_recvd++;
 	tp->t_dsack_recvd++;
+	tcp_rack_dsack(tp);
 
 	/* Update the sender's retransmit segment state */
 	if (((tp->t_rxtshift == 1 && first_sack.start == tp->snd_una) ||
@@ -971,3 +1082,94 @@ tcp_sack_process_dsack(struct tcpcb *tp, struct tcpopt *to,
 	}
 	return TRUE;
 }
+
+#if (DEVELOPMENT || DEBUG)
+/*
+ * Nanoseconds per ACK to replay a recovery episode over a synthetic
+ * scoreboard of `in' one-segment holes.  Every other segment of the window
+ * is SACKed first; each hole is then retransmitted in turn and filled by a
+ * cumulative ACK carrying the highest SACK block, which is the pattern
+ * that has tcp_sack_doack() go from the tail of the scoreboard down to
+ * snd_una.  The window starts just below the sequence wrap.
+ */
+static int
+tcp_sack_replay_test(int64_t in, int64_t *out)
+{
+	struct tcpcb *tp;
+	struct tcpopt to;
+	struct tcphdr th;
+	struct sackblk blk;
+	struct sackhole *hole;
+	uint32_t nholes = (uint32_t)in, mss = 1448, i;
+	uint32_t newbytes_acked, after_rexmit_acked;
+	int sack_bytes_rexmt, error = 0;
+	uint64_t start, ns;
+	tcp_seq iss;
+
+	if (in <= 0 || in > tcp_sack_maxholes || in > tcp_sack_globalmaxholes) {
+		return EINVAL;
+	}
+	iss = (tcp_seq)0 - nholes * mss;
+
+	tp = kalloc_type(struct tcpcb, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	TAILQ_INIT(&tp->snd_holes);
+	RB_INIT(&tp->snd_holes_tree);
+	SLIST_INIT(&tp->t_rxt_segments);
+	tp->t_flagsext |= TF_SACK_ENABLE;
+	tp->t_maxseg = mss;
+	tp->snd_una = iss;
+	tp->snd_nxt = tp->snd_max = iss + 2 * nholes * mss;
+
+	bzero(&to, sizeof(to));
+	bzero(&th, sizeof(th));
+	to.to_flags = TOF_SACK;
+	to.to_nsacks = 1;
+	to.to_sacks = (u_char *)&blk;
+
+	th.th_ack = tp->snd_una;
+	for (i = 0; i < nholes; i++) {
+		blk.start = htonl(iss + (2 * i + 1) * mss);
+		blk.end = htonl(iss + (2 * i + 2) * mss);
+		newbytes_acked = after_rexmit_acked = 0;
+		tcp_sack_doack(tp, &to, &th, &newbytes_acked,
+		    &after_rexmit_acked);
+	}
+	if (tp->snd_numholes != (int)nholes) {
+		error = ENOBUFS;
+		goto done;
+	}
+
+	start = mach_absolute_time();
+	for (i = 0; i < nholes; i++) {
+		hole = tcp_sack_output(tp, &sack_bytes_rexmt);
+		if (hole == NULL) {
+			error = EIO;
+			goto done;
+		}
+		tp->sackhint.sack_bytes_rexmit += (hole->end - hole->rxmit);
+		hole->rxmit = hole->end;
+
+		th.th_ack = (i + 1 < nholes) ?
+		    iss + 2 * (i + 1) * mss : tp->snd_fack;
+		blk.start = htonl(tp->snd_fack - mss);
+		blk.end = htonl(tp->snd_fack);
+		newbytes_acked = after_rexmit_acked = 0;
+		tcp_sack_doack(tp, &to, &th, &newbytes_acked,
+		    &after_rexmit_acked);
+		tp->snd_una = th.th_ack;
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+
+	if (tp->snd_numholes != 0 || tp->sackhint.sack_hole_bytes != 0 ||
+	    tp->sackhint.sack_bytes_rexmit != 0) {
+		error = EIO;
+		goto done;
+	}
+	*out = (int64_t)(ns / nholes);
+done:
+	tcp_free_sackholes(tp);
+	kfree_type(struct tcpcb, tp);
+	return error;
+}
+SYSCTL_TEST_REGISTER(tcp_sack_replay, tcp_sack_replay_test);
+#endif /* (DEVELOPMENT || DEBUG) */
@@ -90,6 +90,7 @@
 
 #include <net/route.h>
 #include <net/if.h>
+#include <net/dlil.h>
 #include <net/content_filter.h>
 #include <net/ntstat.h>
 #include <net/multi_layer_pkt_log.h>
@@ -607,6 +608,9 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	/* Initialize TCP Cache */
 	tcp_cache_init();
 
+	tcp_pacing_init();
+	tcp_tw_init();
+
 	tcp_mpkl_log_object = MPKL_CREATE_LOGOBJECT("com.apple.xnu.tcp");
 	if (tcp_mpkl_log_object == NULL) {
 		panic("MPKL_CREATE_LOGOBJECT failed");
@@ -736,6 +740,7 @@ tcp_respond(struct tcpcb *tp, void *ipgen, struct tcphdr *th, struct mbuf *m,
     tcp_seq ack, tcp_seq seq, uint8_t flags, struct tcp_respond_args *tra)
 {
 	uint16_t tlen;
+	uint16_t optlen = 0;
 	int win = 0;
 	struct route *ro = 0;
 	struct route sro;
@@ -787,14 +792,14 @@ tcp_respond(struct tcpcb *tp, void *ipgen, struct tcphdr *th, struct mbuf *m,
 		m->m_data += max_linkhdr;
 		if (isipv6) {
 			VERIFY((MHLEN - max_linkhdr) >=
-			    (sizeof(*ip6) + sizeof(*nth)));
+			    (sizeof(*ip6) + sizeof(*nth) + TCPOLEN_TSTAMP_APPA));
 			bcopy((caddr_t)ip6, mtod(m, caddr_t),
 			    sizeof(struct ip6_hdr));
 			ip6 = mtod(m, struct ip6_hdr *);
 			nth = (struct tcphdr *)(void *)(ip6 + 1);
 		} else {
 			VERIFY((MHLEN - max_linkhdr) >=
-			    (sizeof(*ip) + sizeof(*nth)));
+			    (sizeof(*ip) + sizeof(*nth) + TCPOLEN_TSTAMP_APPA));
 			bcopy((caddr_t)ip, mtod(m, caddr_t), sizeof(struct ip));
 			ip = mtod(m, struct ip *);
 			nth = (struct tcphdr *)(void *)(ip + 1);
@@ -806,6 +811,16 @@ tcp_respond(struct tcpcb *tp, void *ipgen, struct tcphdr *th, struct mbuf *m,
 		} else
 #endif
 		flags = TH_ACK;
+		if (tra->tstamp) {
+			uint32_t *lp = (uint32_t *)(void *)(nth + 1);
+
+			/* Form timestamp option as shown in appendix A of RFC 1323. */
+			*lp++ = htonl(TCPOPT_TSTAMP_HDR);
+			*lp++ = htonl(tra->tsval);
+			*lp = htonl(tra->tsecr);
+			optlen = TCPOLEN_TSTAMP_APPA;
+			tlen = optlen;
+		}
 	} else {
 		m_freem(m->m_next);
 		m->m_next = 0;
@@ -862,7 +877,7 @@ tcp_respond(struct tcpcb *tp, void *ipgen, struct tcphdr *th, struct mbuf *m,
 	nth->th_seq = htonl(seq);
 	nth->th_ack = htonl(ack);
 	nth->th_x2 = 0;
-	nth->th_off = sizeof(struct tcphdr) >> 2;
+	nth->th_off = (sizeof(struct tcphdr) + optlen) >> 2;
 	nth->th_flags = flags;
 	if (tp) {
 		nth->th_win = htons((u_short) (win >> tp->rcv_scale));
@@ -1101,6 +1116,7 @@ tcp_newtcpcb(struct inpcb *inp)
 	tp->t_flagsext |= TF_SACK_ENABLE;
 
 	TAILQ_INIT(&tp->snd_holes);
+	RB_INIT(&tp->snd_holes_tree);
 	SLIST_INIT(&tp->t_rxt_segments);
 	SLIST_INIT(&tp->t_notify_ack);
 	tp->t_inpcb = inp;
@@ -1123,6 +1139,8 @@ tcp_newtcpcb(struct inpcb *inp)
 		/* use ledbat for testing */
 		tp->tcp_cc_index = TCP_CC_ALGO_BACKGROUND_INDEX;
 #endif
+	} else if (tcp_use_bbr) {
+		tp->tcp_cc_index = TCP_CC_ALGO_BBR_INDEX;
 	} else {
 		tp->tcp_cc_index = TCP_CC_ALGO_CUBIC_INDEX;
 	}
@@ -1616,6 +1634,7 @@ no_valid_rt:
 	tcp_update_stats_per_flow(&ifs, inp->inp_last_outifp);
 
 	tcp_free_sackholes(tp);
+	tcp_rack_free(tp);
 	tcp_notify_ack_free(tp);
 
 	inp_decr_sndbytes_allunsent(so, tp->snd_una);
@@ -3485,6 +3504,10 @@ tcp_set_tso(struct tcpcb *tp, struct ifnet *ifp)
 			} else {
 				tp->tso_max_segment_size = TCP_MAXWIN;
 			}
+		} else if (if_gso_enabled && IFNET_IS_SW_GSO(ifp)) {
+			/* segmented in software before the driver */
+			tp->t_flags |= TF_TSO;
+			tp->tso_max_segment_size = TCP_MAXWIN;
 		}
 	} else {
 		if (ifp->if_hwassist & IFNET_TSO_IPV4) {
@@ -3498,6 +3521,11 @@ tcp_set_tso(struct tcpcb *tp, struct ifnet *ifp)
 				tp->tso_max_segment_size -=
 				    CLAT46_HDR_EXPANSION_OVERHD;
 			}
+		} else if (if_gso_enabled && IFNET_IS_SW_GSO(ifp) &&
+		    !IS_INTF_CLAT46(ifp)) {
+			/* segmented in software before the driver */
+			tp->t_flags |= TF_TSO;
+			tp->tso_max_segment_size = TCP_MAXWIN;
 		}
 	}
 
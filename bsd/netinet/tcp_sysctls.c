@@ -133,3 +133,28 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, cubic_sockets,
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_newreno,
     CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_newreno, 0,
     "Use TCP NewReno by default");
+
+extern struct tcp_cc_algo tcp_cc_bbr;
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, bbr_sockets,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_cc_bbr.num_sockets,
+    0, "Number of sockets using BBR");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_bbr,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_bbr, 0,
+    "Use TCP BBR by default");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pacing,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_pacing_enabled, 1,
+    "Pace transmissions at the congestion control's or the socket's pacing rate");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pace_all,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_pace_all, 0,
+    "Pace every connection at a rate derived from cwnd and srtt");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pacing_ss_ratio,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_pacing_ss_ratio, 200,
+    "Pacing rate in slow start, as a percentage of cwnd/srtt");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pacing_ca_ratio,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_pacing_ca_ratio, 120,
+    "Pacing rate in congestion avoidance, as a percentage of cwnd/srtt");
@@ -48,5 +48,10 @@ extern int tcp_rledbat;
 extern int tcp_cc_debug;
 extern int tcp_use_ledbat;
 extern int tcp_use_newreno;
+extern int tcp_use_bbr;
+extern int tcp_pacing_enabled;
+extern int tcp_pace_all;
+extern int tcp_pacing_ss_ratio;
+extern int tcp_pacing_ca_ratio;
 
 #endif /* _NETINET_TCP_SYSCTLS_H_ */
@@ -842,6 +842,9 @@ tcp_gc(struct inpcbinfo *ipi)
 
 	lck_rw_done(&ipi->ipi_lock);
 
+	/* Reap the compact TIME_WAIT entries, keep going if any are left */
+	atomic_add_32(&ipi->ipi_gc_req.intimer_lazy, tcp_tw_expire());
+
 	/* Clean up the socache while we are here */
 	if (so_cache_timer()) {
 		atomic_add_32(&ipi->ipi_gc_req.intimer_lazy, 1);
@@ -1823,6 +1826,11 @@ fc_output:
 		break;
 	}
 	case TCPT_DELAYFR:
+		/* RACK's reordering window ran out */
+		if (tp->t_rack != NULL) {
+			tcp_rack_timeout(tp);
+			break;
+		}
 		tp->t_flagsext &= ~TF_DELAY_RECOVERY;
 
 		/*
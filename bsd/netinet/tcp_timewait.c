@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Compact TIME_WAIT.
+ *
+ * A connection in TIME_WAIT keeps its socket, inpcb and tcpcb for 2*MSL
+ * after the application is done with it, and tcp_gc walks every one of
+ * them on each run.  A server that closes first and turns connections
+ * over quickly ends up holding hundreds of thousands.
+ *
+ * Once an accepted connection is in TIME_WAIT and its socket has been
+ * closed, tcp_twstart() copies the little that TIME_WAIT still needs --
+ * the 4-tuple, the sequence numbers and the timestamp state -- into a
+ * struct tcp_tw and closes the tcpcb, so that the socket and the pcb go
+ * at the next garbage collection.  When no connected pcb matches a
+ * segment, tcp_input() hands it to tcp_tw_input(), which answers it the
+ * way the full TIME_WAIT would, or lets a SYN for a new incarnation of
+ * the connection (RFC 6191) through to the listener.
+ *
+ * Entries are spread over TCP_TW_NSHARDS shards by a hash of the
+ * 4-tuple.  Each shard has its own lock, hash table and timing wheel;
+ * an entry sits in the wheel slot of the tick it expires in, and
+ * tcp_tw_expire() reaps the slots of the ticks that have passed.  An
+ * entry that lives longer than a revolution of the wheel is left in its
+ * slot until it comes round again.
+ *
+ * Only passively opened connections are compacted: their local port
+ * belongs to the listener, so releasing the pcb early cannot hand a
+ * port still in TIME_WAIT to a new outgoing connection.
+ */
+
+#include "tcp_includes.h"
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/sysctl.h>
+#include <sys/socketvar.h>
+#include <kern/locks.h>
+#include <kern/zalloc.h>
+#include <net/flowhash.h>
+#include <dev/random/randomdev.h>
+
+#include <netinet/in.h>
+#include <netinet/in_pcb.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp_timer.h>
+#include <netinet6/in6_var.h>
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, tw_compact, CTLFLAG_RW | CTLFLAG_LOCKED,
+    static int, tcp_tw_compact, 0,
+    "Keep closed server connections in TIME_WAIT in a compact form");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, tw_compact_max, CTLFLAG_RW | CTLFLAG_LOCKED,
+    static int, tcp_tw_compact_max, 262144,
+    "Maximum number of compact TIME_WAIT entries");
+
+uint32_t tcp_tw_count;
+SYSCTL_UINT(_net_inet_tcp, OID_AUTO, tw_compact_count,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_tw_count, 0,
+    "Number of compact TIME_WAIT entries");
+
+struct tcp_tw_key {
+	struct in6_addr twk_faddr;      /* IPv4 in the last word */
+	struct in6_addr twk_laddr;
+	in_port_t       twk_fport;
+	in_port_t       twk_lport;
+	uint32_t        twk_v6;
+};
+
+struct tcp_tw {
+	LIST_ENTRY(tcp_tw) tw_hash;
+	LIST_ENTRY(tcp_tw) tw_wheel;
+	struct tcp_tw_key tw_key;
+	tcp_seq         tw_snd_nxt;     /* past our FIN */
+	tcp_seq         tw_rcv_nxt;     /* past the peer's FIN */
+	uint32_t        tw_ts_recent;
+	uint32_t        tw_ts_offset;
+	uint32_t        tw_expire;      /* in tcp_now */
+	uint16_t        tw_ifscope;
+	uint8_t         tw_flags;
+#define TCP_TW_TSTAMP   0x01            /* timestamps in use */
+};
+
+LIST_HEAD(tcp_tw_head, tcp_tw);
+
+#define TCP_TW_NSHARDS          32
+#define TCP_TW_SLOTS            64
+#define TCP_TW_TICK_SHIFT       9       /* 512ms wheel ticks */
+#define TCP_TW_TICK_MASK        (UINT32_MAX >> TCP_TW_TICK_SHIFT)
+
+struct tcp_tw_shard {
+	decl_lck_mtx_data(, twsh_lock);
+	uint32_t                twsh_tick;      /* next tick to reap */
+	uint32_t                twsh_hashmask;
+	struct tcp_tw_head      *twsh_hash;
+	struct tcp_tw_head      twsh_wheel[TCP_TW_SLOTS];
+};
+
+static struct tcp_tw_shard tcp_tw_shards[TCP_TW_NSHARDS];
+static uint32_t tcp_tw_hash_seed;
+
+static KALLOC_TYPE_DEFINE(tcp_tw_zone, struct tcp_tw, NET_KT_DEFAULT);
+
+static LCK_ATTR_DECLARE(tcp_tw_mtx_attr, 0, 0);
+static LCK_GRP_DECLARE(tcp_tw_mtx_grp, "tcptimewait");
+
+static inline uint32_t
+tcp_tw_slot(uint32_t tick)
+{
+	return tick & (TCP_TW_SLOTS - 1);
+}
+
+static struct tcp_tw_shard *
+tcp_tw_hash(const struct tcp_tw_key *key, struct tcp_tw_head **bucket)
+{
+	struct tcp_tw_shard *sh;
+	uint32_t hash;
+
+	hash = net_flowhash(key, sizeof(*key), tcp_tw_hash_seed);
+	sh = &tcp_tw_shards[hash & (TCP_TW_NSHARDS - 1)];
+	*bucket = &sh->twsh_hash[(hash / TCP_TW_NSHARDS) & sh->twsh_hashmask];
+	return sh;
+}
+
+static struct tcp_tw *
+tcp_tw_lookup(struct tcp_tw_head *bucket, const struct tcp_tw_key *key)
+{
+	struct tcp_tw *tw;
+
+	LIST_FOREACH(tw, bucket, tw_hash) {
+		if (bcmp(&tw->tw_key, key, sizeof(*key)) == 0) {
+			return tw;
+		}
+	}
+	return NULL;
+}
+
+static void
+tcp_tw_remove(struct tcp_tw *tw)
+{
+	LIST_REMOVE(tw, tw_hash);
+	LIST_REMOVE(tw, tw_wheel);
+	zfree(tcp_tw_zone, tw);
+	os_atomic_dec(&tcp_tw_count, relaxed);
+}
+
+static void
+tcp_tw_schedule(struct tcp_tw_shard *sh, struct tcp_tw *tw)
+{
+	uint32_t tick;
+
+	tw->tw_expire = tcp_now + 2 * tcp_msl;
+	tick = tw->tw_expire >> TCP_TW_TICK_SHIFT;
+	LIST_INSERT_HEAD(&sh->twsh_wheel[tcp_tw_slot(tick)], tw, tw_wheel);
+}
+
+/*
+ * Look for a timestamp option in options that tcp_input() has not
+ * already parsed; SYNs, which are the ones we care about, never take
+ * its fast path.
+ */
+static boolean_t
+tcp_tw_tsopt(u_char *cp, int cnt, uint32_t *tsval)
+{
+	int opt, optlen;
+
+	for (; cnt > 0; cnt -= optlen, cp += optlen) {
+		opt = cp[0];
+		if (opt == TCPOPT_EOL) {
+			break;
+		}
+		if (opt == TCPOPT_NOP) {
+			optlen = 1;
+			continue;
+		}
+		if (cnt < 2) {
+			break;
+		}
+		optlen = cp[1];
+		if (optlen < 2 || optlen > cnt) {
+			break;
+		}
+		if (opt == TCPOPT_TIMESTAMP && optlen == TCPOLEN_TIMESTAMP) {
+			bcopy(cp + 2, tsval, sizeof(*tsval));
+			*tsval = ntohl(*tsval);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Move a connection that has just entered TIME_WAIT into a compact
+ * entry and close its tcpcb.  Returns TRUE if the tcpcb was closed.
+ */
+boolean_t
+tcp_twstart(struct tcpcb *tp)
+{
+	struct inpcb *inp = tp->t_inpcb;
+	struct socket *so = inp->inp_socket;
+	struct tcp_tw_shard *sh;
+	struct tcp_tw_head *bucket;
+	struct tcp_tw *tw, *otw;
+
+	if (!tcp_tw_compact || tp->t_state != TCPS_TIME_WAIT ||
+	    !(so->so_state & SS_NOFDREF) ||
+	    !(so->so_flags1 & SOF1_INBOUND) ||
+	    (so->so_flags & SOF_MP_SUBFLOW) ||
+	    (tp->t_flags & TF_CLOSING) || inp->inp_sndinprog_cnt > 0 ||
+	    tcp_tw_count >= (uint32_t)tcp_tw_compact_max) {
+		return FALSE;
+	}
+	if ((inp->inp_vflag & INP_IPV6) &&
+	    (IN6_IS_SCOPE_EMBED(&inp->in6p_faddr) ||
+	    IN6_IS_SCOPE_EMBED(&inp->in6p_laddr))) {
+		return FALSE;
+	}
+
+	tw = zalloc_flags(tcp_tw_zone, Z_NOWAIT | Z_ZERO);
+	if (tw == NULL) {
+		return FALSE;
+	}
+	if (inp->inp_vflag & INP_IPV6) {
+		tw->tw_key.twk_faddr = inp->in6p_faddr;
+		tw->tw_key.twk_laddr = inp->in6p_laddr;
+		tw->tw_key.twk_v6 = 1;
+	} else {
+		tw->tw_key.twk_faddr.s6_addr32[3] = inp->inp_faddr.s_addr;
+		tw->tw_key.twk_laddr.s6_addr32[3] = inp->inp_laddr.s_addr;
+	}
+	tw->tw_key.twk_fport = inp->inp_fport;
+	tw->tw_key.twk_lport = inp->inp_lport;
+	tw->tw_snd_nxt = tp->snd_max;
+	tw->tw_rcv_nxt = tp->rcv_nxt;
+	if (TSTMP_SUPPORTED(tp) && !(tp->t_flags & TF_NOOPT)) {
+		tw->tw_flags |= TCP_TW_TSTAMP;
+		tw->tw_ts_recent = tp->ts_recent;
+		tw->tw_ts_offset = tp->t_ts_offset;
+	}
+	if (inp->inp_flags & INP_BOUND_IF) {
+		tw->tw_ifscope = (uint16_t)inp->inp_boundifp->if_index;
+	}
+
+	sh = tcp_tw_hash(&tw->tw_key, &bucket);
+	lck_mtx_lock(&sh->twsh_lock);
+	otw = tcp_tw_lookup(bucket, &tw->tw_key);
+	if (otw != NULL) {
+		tcp_tw_remove(otw);
+	}
+	LIST_INSERT_HEAD(bucket, tw, tw_hash);
+	tcp_tw_schedule(sh, tw);
+	os_atomic_inc(&tcp_tw_count, relaxed);
+	lck_mtx_unlock(&sh->twsh_lock);
+
+	(void) tcp_close(tp);
+	inpcb_gc_sched(&tcbinfo, INPCB_TIMER_LAZY);
+	return TRUE;
+}
+
+/*
+ * Process a segment that matched no connected pcb against the compact
+ * TIME_WAIT entries.  Returns TRUE if the segment was consumed, in which
+ * case the mbuf has been freed; FALSE if tcp_input() should carry on.
+ * The header fields of th are in host order.
+ */
+boolean_t
+tcp_tw_input(struct mbuf *m, void *ipgen, struct tcphdr *th,
+    struct tcpopt *to, u_char *optp, int optlen, int tlen,
+    unsigned int ifscope)
+{
+	struct ip *ip = ipgen;
+	struct ip6_hdr *ip6 = ipgen;
+	boolean_t isipv6 = IP_VHL_V(ip->ip_vhl) == 6;
+	struct tcp_respond_args tra;
+	struct tcp_tw_shard *sh;
+	struct tcp_tw_head *bucket;
+	struct tcp_tw_key key;
+	struct tcp_tw *tw;
+	struct tcphdr nth;
+	union {
+		struct ip ip;
+		struct ip6_hdr ip6;
+	} hdr;
+	uint8_t thflags = th->th_flags;
+	boolean_t hasts = FALSE;
+	uint32_t tsval = 0;
+	tcp_seq snd_nxt, rcv_nxt;
+
+	bzero(&key, sizeof(key));
+	if (isipv6) {
+		if (IN6_IS_SCOPE_EMBED(&ip6->ip6_src) ||
+		    IN6_IS_SCOPE_EMBED(&ip6->ip6_dst)) {
+			return FALSE;
+		}
+		key.twk_faddr = ip6->ip6_src;
+		key.twk_laddr = ip6->ip6_dst;
+		key.twk_v6 = 1;
+	} else {
+		key.twk_faddr.s6_addr32[3] = ip->ip_src.s_addr;
+		key.twk_laddr.s6_addr32[3] = ip->ip_dst.s_addr;
+	}
+	key.twk_fport = th->th_sport;
+	key.twk_lport = th->th_dport;
+
+	if (to->to_flags & TOF_TS) {
+		hasts = TRUE;
+		tsval = to->to_tsval;
+	} else if (optp != NULL) {
+		hasts = tcp_tw_tsopt(optp, optlen, &tsval);
+	}
+
+	sh = tcp_tw_hash(&key, &bucket);
+	lck_mtx_lock(&sh->twsh_lock);
+	tw = tcp_tw_lookup(bucket, &key);
+	if (tw == NULL) {
+		lck_mtx_unlock(&sh->twsh_lock);
+		return FALSE;
+	}
+
+	/* RFC 1337: a RST in TIME_WAIT is ignored. */
+	if (thflags & TH_RST) {
+		goto drop;
+	}
+
+	/*
+	 * A SYN that is newer than anything in the old connection, by
+	 * timestamp if both ends used them (RFC 6191) and by sequence
+	 * number otherwise, may start a new one; the listener gets it.
+	 */
+	if ((thflags & (TH_SYN | TH_ACK)) == TH_SYN) {
+		if (((tw->tw_flags & TCP_TW_TSTAMP) && hasts) ?
+		    TSTMP_GT(tsval, tw->tw_ts_recent) :
+		    SEQ_GT(th->th_seq, tw->tw_rcv_nxt)) {
+			tcp_tw_remove(tw);
+			lck_mtx_unlock(&sh->twsh_lock);
+			return FALSE;
+		}
+	} else if (!(thflags & TH_ACK)) {
+		goto drop;
+	}
+
+	/* A retransmitted FIN means our ACK of it was lost; wait again. */
+	if ((thflags & TH_FIN) &&
+	    th->th_seq + tlen + 1 == tw->tw_rcv_nxt) {
+		LIST_REMOVE(tw, tw_wheel);
+		tcp_tw_schedule(sh, tw);
+	}
+
+	/* A duplicate of the final ACK needs no answer. */
+	if (thflags == TH_ACK && tlen == 0 &&
+	    th->th_seq == tw->tw_rcv_nxt && th->th_ack == tw->tw_snd_nxt) {
+		goto drop;
+	}
+
+	bzero(&tra, sizeof(tra));
+	tra.ifscope = tw->tw_ifscope != 0 ? tw->tw_ifscope : ifscope;
+	tra.awdl_unrestricted = 1;
+	tra.intcoproc_allowed = 1;
+	if (tw->tw_flags & TCP_TW_TSTAMP) {
+		tra.tstamp = 1;
+		tra.tsval = tcp_now + tw->tw_ts_offset;
+		tra.tsecr = tw->tw_ts_recent;
+	}
+	snd_nxt = tw->tw_snd_nxt;
+	rcv_nxt = tw->tw_rcv_nxt;
+	lck_mtx_unlock(&sh->twsh_lock);
+
+	bzero(&hdr, sizeof(hdr));
+	if (isipv6) {
+		hdr.ip6.ip6_vfc = IPV6_VERSION;
+		hdr.ip6.ip6_nxt = IPPROTO_TCP;
+		hdr.ip6.ip6_src = key.twk_laddr;
+		hdr.ip6.ip6_dst = key.twk_faddr;
+	} else {
+		hdr.ip.ip_vhl = IP_VHL_BORING;
+		hdr.ip.ip_p = IPPROTO_TCP;
+		hdr.ip.ip_src.s_addr = key.twk_laddr.s6_addr32[3];
+		hdr.ip.ip_dst.s_addr = key.twk_faddr.s6_addr32[3];
+	}
+	bzero(&nth, sizeof(nth));
+	nth.th_sport = key.twk_lport;
+	nth.th_dport = key.twk_fport;
+
+	m_freem(m);
+	tcp_respond(NULL, &hdr, &nth, NULL, rcv_nxt, snd_nxt, TH_ACK, &tra);
+	return TRUE;
+
+drop:
+	lck_mtx_unlock(&sh->twsh_lock);
+	m_freem(m);
+	return TRUE;
+}
+
+/*
+ * Reap the entries whose 2*MSL has passed.  Called from tcp_gc();
+ * returns the number of entries left, to keep the lazy timer going.
+ */
+uint32_t
+tcp_tw_expire(void)
+{
+	uint32_t now = tcp_now >> TCP_TW_TICK_SHIFT;
+
+	if (tcp_tw_count == 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < TCP_TW_NSHARDS; i++) {
+		struct tcp_tw_shard *sh = &tcp_tw_shards[i];
+		struct tcp_tw *tw, *ntw;
+		uint32_t n;
+
+		lck_mtx_lock(&sh->twsh_lock);
+		n = MIN((now - sh->twsh_tick) & TCP_TW_TICK_MASK, TCP_TW_SLOTS);
+		for (uint32_t t = 0; t < n; t++) {
+			uint32_t slot = tcp_tw_slot(sh->twsh_tick + t);
+
+			LIST_FOREACH_SAFE(tw, &sh->twsh_wheel[slot], tw_wheel, ntw) {
+				if (TSTMP_GEQ(tcp_now, tw->tw_expire)) {
+					tcp_tw_remove(tw);
+				}
+			}
+		}
+		sh->twsh_tick = now;
+		lck_mtx_unlock(&sh->twsh_lock);
+	}
+
+	return tcp_tw_count;
+}
+
+void
+tcp_tw_init(void)
+{
+	uint64_t sane_size_meg = sane_size / 1024 / 1024;
+	uint32_t hashsize = 64;
+
+	/* Roughly a bucket per 8MB of memory, between 64 and 2048 a shard */
+	while (hashsize < 2048 && hashsize < (sane_size_meg >> 3)) {
+		hashsize <<= 1;
+	}
+
+	for (int i = 0; i < TCP_TW_NSHARDS; i++) {
+		struct tcp_tw_shard *sh = &tcp_tw_shards[i];
+
+		lck_mtx_init(&sh->twsh_lock, &tcp_tw_mtx_grp,
+		    &tcp_tw_mtx_attr);
+		sh->twsh_hash = zalloc_permanent(
+			sizeof(struct tcp_tw_head) * hashsize,
+			ZALIGN(struct tcp_tw_head));
+		sh->twsh_hashmask = hashsize - 1;
+		for (uint32_t b = 0; b < hashsize; b++) {
+			LIST_INIT(&sh->twsh_hash[b]);
+		}
+		for (int s = 0; s < TCP_TW_SLOTS; s++) {
+			LIST_INIT(&sh->twsh_wheel[s]);
+		}
+		sh->twsh_tick = tcp_now >> TCP_TW_TICK_SHIFT;
+	}
+
+	tcp_tw_hash_seed = RandomULong();
+}
@@ -398,6 +398,7 @@ tcp_usr_listen(struct socket *so, struct proc *p)
 	if (error == 0) {
 		TCP_LOG_STATE(tp, TCPS_LISTEN);
 		tp->t_state = TCPS_LISTEN;
+		in_pcblbgroup_join(inp);
 	}
 	TCP_LOG_LISTEN(tp, error);
 	COMMON_END(PRU_LISTEN);
@@ -421,6 +422,7 @@ tcp6_usr_listen(struct socket *so, struct proc *p)
 	if (error == 0) {
 		TCP_LOG_STATE(tp, TCPS_LISTEN);
 		tp->t_state = TCPS_LISTEN;
+		in_pcblbgroup_join(inp);
 	}
 	TCP_LOG_LISTEN(tp, error);
 	COMMON_END(PRU_LISTEN);
@@ -1457,6 +1459,7 @@ tcp_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 	struct in_addr laddr;
 	int error = 0;
 	struct ifnet *outif = NULL;
+	lck_mtx_t *mtx;
 
 	if (inp->inp_lport == 0) {
 		error = in_pcbbind(inp, NULL, p);
@@ -1529,12 +1532,7 @@ skip_oinp:
 		}
 	}
 #endif /* SKYWALK */
-	if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-		/*lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(inp->inp_socket, 0);
-		lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-		socket_lock(inp->inp_socket, 0);
-	}
+	mtx = in_pcbhash_lock(inp);
 	if (inp->inp_laddr.s_addr == INADDR_ANY) {
 		inp->inp_laddr = laddr;
 		/* no reference needed */
@@ -1549,8 +1547,8 @@ skip_oinp:
 	}
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
+	lck_mtx_unlock(mtx);
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0) {
 		inp_calc_flowhash(inp);
@@ -1591,6 +1589,7 @@ tcp6_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 	struct in6_addr addr6;
 	int error = 0;
 	struct ifnet *outif = NULL;
+	lck_mtx_t *mtx;
 
 	if (inp->inp_lport == 0) {
 		error = in6_pcbbind(inp, NULL, p);
@@ -1651,12 +1650,7 @@ tcp6_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 		}
 	}
 #endif /* SKYWALK */
-	if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-		/*lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(inp->inp_socket, 0);
-		lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-		socket_lock(inp->inp_socket, 0);
-	}
+	mtx = in_pcbhash_lock(inp);
 	if (IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_laddr)) {
 		inp->in6p_laddr = addr6;
 		inp->in6p_last_outifp = outif;  /* no reference needed */
@@ -1676,8 +1670,8 @@ tcp6_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 	if ((sin6->sin6_flowinfo & IPV6_FLOWINFO_MASK) != 0) {
 		inp->inp_flow = sin6->sin6_flowinfo;
 	}
+	lck_mtx_unlock(mtx);
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0) {
 		inp_calc_flowhash(inp);
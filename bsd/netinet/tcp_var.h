@@ -85,6 +85,7 @@ struct name {                           \
 #endif
 
 #ifdef KERNEL_PRIVATE
+#include <sys/tree.h>
 
 #define TCP_RETRANSHZ   1000    /* granularity of TCP timestamps, 1ms */
 /* Minimum time quantum within which the timers are coalesced */
@@ -180,12 +181,14 @@ struct sackhole {
 	tcp_seq rxmit;          /* next seq. no in hole to be retransmitted */
 	u_int32_t rxmit_start;  /* timestamp of first retransmission */
 	TAILQ_ENTRY(sackhole) scblink;  /* scoreboard linkage */
+	RB_ENTRY(sackhole) scbtree;     /* scoreboard index, keyed by start */
 };
 
 struct sackhint {
 	struct sackhole *nexthole;
 	int     sack_bytes_rexmit;
 	int sack_bytes_acked;
+	uint32_t sack_hole_bytes;       /* bytes in all holes of the scoreboard */
 };
 
 struct tcp_rxt_seg {
@@ -221,6 +224,92 @@ struct bwmeas {
 	uint32_t bw_rcvbw_max;  /* Max receive bandwidth measured */
 };
 
+/*
+ * Delivery rate sampling.  Every flight of data sent is recorded along with
+ * the count of bytes delivered at the time it left; when an ack covers it,
+ * the bytes delivered in between over the longer of the send and ack
+ * intervals is a sample of the delivery rate.
+ */
+#define TCP_RATE_NRECS  16
+struct tcp_rate_rec {
+	tcp_seq         rr_start;               /* first byte of this flight */
+	tcp_seq         rr_end;                 /* last byte + 1 */
+	uint64_t        rr_sent_us;             /* when the last byte was sent */
+	uint64_t        rr_first_sent_us;       /* start of the send interval */
+	uint64_t        rr_delivered;           /* trs_delivered when sent */
+	uint64_t        rr_delivered_us;        /* trs_delivered_us when sent */
+	uint32_t        rr_flags;
+#define TCP_RATE_APP_LIMITED    0x1     /* sent while application-limited */
+#define TCP_RATE_REXMT          0x2     /* part of it was retransmitted */
+};
+
+struct tcp_rate_state {
+	struct tcp_rate_rec trs_recs[TCP_RATE_NRECS];
+	uint32_t        trs_head;               /* oldest record */
+	uint32_t        trs_count;
+	uint64_t        trs_delivered;          /* bytes acked or SACKed, counted once */
+	uint64_t        trs_sampled;            /* trs_delivered at the last sample */
+	uint64_t        trs_delivered_us;       /* when trs_delivered last grew */
+	uint32_t        trs_sacked;             /* of those, SACKed above snd_una */
+	uint32_t        trs_resacked;           /* SACKed before the scoreboard was cleared */
+	uint64_t        trs_first_sent_us;      /* send time of the newest acked flight */
+	uint64_t        trs_app_limited;        /* delivered mark ending an app-limited period */
+};
+
+struct tcp_rate_sample {
+	uint64_t        rs_delivered;           /* bytes delivered over the interval */
+	uint64_t        rs_prior_delivered;     /* trs_delivered when the flight left */
+	uint64_t        rs_delivered_total;     /* trs_delivered now */
+	uint32_t        rs_interval_us;         /* 0 when no flight was acked */
+	uint32_t        rs_rtt_us;              /* 0 when ambiguous */
+	uint32_t        rs_acked;               /* newly acked or SACKed bytes */
+	uint32_t        rs_inflight;            /* bytes outstanding after the ack */
+	uint8_t         rs_app_limited;
+};
+
+/*
+ * RACK-TLP (RFC 8985) loss detection.  The data in flight is kept as a
+ * map of segments in sequence order, each with the time it was last
+ * sent; the ones neither SACKed nor marked lost are also on a list in
+ * the order they were sent.  A segment is lost once a segment sent
+ * after it has been delivered and a reordering window has passed.
+ */
+struct tcp_rack_seg {
+	TAILQ_ENTRY(tcp_rack_seg) rs_link;      /* in the sequence map */
+	TAILQ_ENTRY(tcp_rack_seg) rs_tslink;    /* in send order */
+	tcp_seq         rs_start;
+	tcp_seq         rs_end;
+	uint64_t        rs_xmit_us;             /* last (re)transmission */
+	uint16_t        rs_xmits;               /* times sent */
+	uint16_t        rs_flags;
+#define TCP_RACK_SACKED         0x1
+#define TCP_RACK_LOST           0x2     /* lost and not yet retransmitted */
+};
+
+struct tcp_rack {
+	TAILQ_HEAD(tcp_rack_seghead, tcp_rack_seg) tr_segs; /* sequence order */
+	struct tcp_rack_seghead tr_tsorted;     /* send order, in flight only */
+	struct tcp_rack_seg *tr_hint;           /* last segment looked up */
+	uint32_t        tr_nsegs;
+	uint32_t        tr_nlost;               /* segments marked lost */
+	uint32_t        tr_sacked;              /* bytes SACKed above snd_una */
+	uint64_t        tr_xmit_us;             /* RACK.xmit_ts */
+	tcp_seq         tr_end_seq;             /* RACK.end_seq */
+	uint32_t        tr_rtt_us;              /* RACK.rtt */
+	uint32_t        tr_min_rtt_us;
+	uint64_t        tr_min_rtt_stamp_us;
+	tcp_seq         tr_fack;                /* highest end delivered in order */
+	tcp_seq         tr_fack_next;           /* tr_fack after this ack */
+	tcp_seq         tr_lost_high;           /* end of the highest lost segment */
+	tcp_seq         tr_dsack_round;         /* snd_nxt at the last DSACK */
+	uint8_t         tr_reo_wnd_mult;        /* reordering window, in min_rtt/4 */
+	uint8_t         tr_reo_wnd_persist;     /* recoveries before it resets */
+	uint8_t         tr_reordering_seen;
+	uint8_t         tr_dsack_pending;       /* a DSACK came with this ack */
+	uint8_t         tr_dsack_round_valid;
+	uint8_t         tr_in_recovery;         /* IN_FASTRECOVERY at the last ack */
+};
+
 /* MPTCP Data sequence map entry */
 struct mpt_dsn_map {
 	uint64_t                mpt_dsn;        /* data seq num recvd */
@@ -242,6 +331,10 @@ struct tcp_ccstate {
 			u_int32_t tc_avg_lastmax; /* Average of last max */
 			u_int32_t tc_mean_deviation; /* Mean absolute deviation */
 			float     tc_epoch_period; /* K parameter */
+			u_int32_t tc_l4s_alpha; /* L4S: average CE fraction, of 1024 */
+			u_int32_t tc_l4s_acked; /* L4S: bytes acked this round */
+			u_int32_t tc_l4s_ce; /* L4S: CE count at round start */
+			tcp_seq   tc_l4s_end; /* L4S: snd_max at round start */
 		} _cubic_state_;
 #define cub_last_max __u__._cubic_state_.tc_last_max
 #define cub_epoch_start __u__._cubic_state_.tc_epoch_start
@@ -251,6 +344,10 @@ struct tcp_ccstate {
 #define cub_epoch_period __u__._cubic_state_.tc_epoch_period
 #define cub_avg_lastmax __u__._cubic_state_.tc_avg_lastmax
 #define cub_mean_dev __u__._cubic_state_.tc_mean_deviation
+#define cub_l4s_alpha __u__._cubic_state_.tc_l4s_alpha
+#define cub_l4s_acked __u__._cubic_state_.tc_l4s_acked
+#define cub_l4s_ce __u__._cubic_state_.tc_l4s_ce
+#define cub_l4s_end __u__._cubic_state_.tc_l4s_end
 		struct tcp_ledbat_state {
 			uint32_t num_slowdown_events;
 			uint32_t slowdown_ts;
@@ -261,6 +358,40 @@ struct tcp_ccstate {
 #define ledbat_slowdown_ts __u__._ledbat_state_.slowdown_ts
 #define ledbat_slowdown_begin __u__._ledbat_state_.slowdown_begin
 #define ledbat_md_bytes_acked __u__._ledbat_state_.md_bytes_acked
+		struct tcp_bbr_state {
+			uint64_t bw_max[3];       /* windowed max delivery rate, bytes/s */
+			uint32_t bw_round[3];     /* round of each bw_max entry */
+			uint64_t full_bw;         /* bw at the last full-pipe check */
+			uint64_t next_round_delivered; /* delivered mark ending this round */
+			uint64_t cycle_start_us;  /* start of the current gain phase */
+			uint32_t round;           /* packet-timed round trips */
+			uint32_t min_rtt_us;      /* windowed min RTT */
+			uint32_t min_rtt_stamp;   /* tcp_now when min_rtt_us was taken */
+			uint32_t probe_rtt_done;  /* tcp_now to leave PROBE_RTT, 0 if unset */
+			uint32_t prior_cwnd;      /* cwnd saved across recovery */
+			uint16_t pacing_gain;     /* BBR_UNIT fixed point */
+			uint16_t cwnd_gain;
+			uint8_t  mode;
+			uint8_t  cycle_idx;
+			uint8_t  full_bw_cnt;
+			uint8_t  flags;
+		} _bbr_state_;
+#define bbr_bw_max __u__._bbr_state_.bw_max
+#define bbr_bw_round __u__._bbr_state_.bw_round
+#define bbr_full_bw __u__._bbr_state_.full_bw
+#define bbr_next_round_delivered __u__._bbr_state_.next_round_delivered
+#define bbr_cycle_start_us __u__._bbr_state_.cycle_start_us
+#define bbr_round __u__._bbr_state_.round
+#define bbr_min_rtt_us __u__._bbr_state_.min_rtt_us
+#define bbr_min_rtt_stamp __u__._bbr_state_.min_rtt_stamp
+#define bbr_probe_rtt_done __u__._bbr_state_.probe_rtt_done
+#define bbr_prior_cwnd __u__._bbr_state_.prior_cwnd
+#define bbr_pacing_gain __u__._bbr_state_.pacing_gain
+#define bbr_cwnd_gain __u__._bbr_state_.cwnd_gain
+#define bbr_mode __u__._bbr_state_.mode
+#define bbr_cycle_idx __u__._bbr_state_.cycle_idx
+#define bbr_full_bw_cnt __u__._bbr_state_.full_bw_cnt
+#define bbr_flags __u__._bbr_state_.flags
 	} __u__;
 };
 
@@ -275,6 +406,9 @@ struct tcp_rledbat_state {
 	uint32_t ssthresh;             /* receive Ledbat ssthresh */
 	uint32_t drained_bytes;        /* bytes drained from the flight-size */
 	uint32_t win_ws;               /* receive Ledbat window after avoiding window shrinking */
+	uint32_t ce_seen;              /* t_ecn_recv_ce when last looked at */
+	uint32_t ce_round_pkts;        /* CE marked packets in this window of data */
+	uint32_t ce_round_bytes;       /* bytes received in this window of data */
 };
 
 /*
@@ -492,6 +626,8 @@ struct tcpcb {
 	                                 *   episode starts at this seq number */
 	TAILQ_HEAD(sackhole_head, sackhole) snd_holes;
 	/* SACK scoreboard (sorted) */
+	RB_HEAD(sackhole_tree, sackhole) snd_holes_tree;
+	/* snd_holes indexed by start seq */
 	tcp_seq snd_fack;               /* last seq number(+1) sack'd by rcv'r*/
 	int     rcv_numsacks;           /* # distinct sack blks present */
 	struct sackblk sackblks[MAX_SACK_BLKS]; /* seq nos. of sack blocks */
@@ -579,6 +715,13 @@ struct tcpcb {
 	TAILQ_ENTRY(tcpcb) t_twentry;           /* link for time wait queue */
 	struct tcp_ccstate      *t_ccstate;     /* congestion control related state */
 	struct tcp_ccstate      _t_ccstate;     /* congestion control related state, non-allocated */
+	struct tcp_rate_state   *t_rate;        /* delivery rate sampling, for rate-based CC */
+	struct tcp_rack         *t_rack;        /* RACK-TLP loss detection, if enabled */
+/* Sender pacing state */
+	uint64_t        t_pacing_rate;          /* set by the CC, bytes per second, 0 if none */
+	uint64_t        t_pacing_next_us;       /* earliest time for the next segment */
+	TAILQ_ENTRY(tcpcb) t_pacing_link;       /* entry in a pacing wheel slot */
+	uint8_t         t_pacing_queued;        /* on a pacing wheel */
 /* Tail loss probe related state */
 	tcp_seq         t_tlphighrxt;           /* snd_nxt after PTO */
 	u_int32_t       t_tlpstart;             /* timestamp at PTO */
@@ -806,6 +949,9 @@ extern int tcp_acc_ecn;
     (TCP_ACC_ECN_ENABLED() && \
     (((_tp_)->ecn_flags & (TE_ACC_ECN_ON)) == (TE_ACC_ECN_ON)))
 
+/* Send ECT(1) and respond to CE in proportion (L4S), see TCP_L4S_ON */
+extern int tcp_l4s;
+
 /*
  * Gives number of bytes acked by this ack
  */
@@ -1627,6 +1773,8 @@ extern int tcp_use_min_curr_rtt;
 #define TCP_ACK_COMPRESSION_DUMMY 1
 
 extern int tcp_do_better_lr;
+extern int tcp_do_rack;
+extern int32_t tcp_enable_tlp;
 extern int tcp_cubic_minor_fixes;
 extern int tcp_cubic_rfc_compliant;
 extern int tcp_flow_control_response;
@@ -1643,7 +1791,10 @@ struct tcp_respond_args {
 	    awdl_unrestricted:1,
 	    intcoproc_allowed:1,
 	    keep_alive:1,
-	    noconstrained:1;
+	    noconstrained:1,
+	    tstamp:1;
+	uint32_t tsval;         /* timestamp option, if tstamp */
+	uint32_t tsecr;
 };
 
 void     tcp_canceltimers(struct tcpcb *);
@@ -1709,6 +1860,32 @@ uint32_t tcp_find_anypcb_byaddr(struct ifaddr *ifa);
 void tcp_set_max_rwinscale(struct tcpcb *tp, struct socket *so);
 struct bwmeas* tcp_bwmeas_alloc(struct tcpcb *tp);
 void tcp_bwmeas_free(struct tcpcb *tp);
+extern void tcp_rate_alloc(struct tcpcb *tp);
+extern void tcp_rate_free(struct tcpcb *tp);
+extern uint64_t tcp_rate_now_us(void);
+extern void tcp_rate_sent(struct tcpcb *tp, tcp_seq seq, uint32_t len, boolean_t rexmt);
+extern void tcp_rate_app_limited(struct tcpcb *tp);
+extern void tcp_rate_sacked(struct tcpcb *tp, uint32_t len);
+extern void tcp_rate_acked(struct tcpcb *tp, uint32_t len);
+extern void tcp_rate_sack_reset(struct tcpcb *tp);
+extern void tcp_rate_ack(struct tcpcb *tp);
+extern void tcp_pacing_init(void);
+extern boolean_t tcp_pacing_delay(struct tcpcb *tp, uint32_t len);
+extern void tcp_pacing_sent(struct tcpcb *tp, uint32_t len);
+extern void tcp_pacing_stop(struct tcpcb *tp);
+extern void tcp_rack_free(struct tcpcb *tp);
+extern void tcp_rack_sent(struct tcpcb *tp, tcp_seq seq, uint32_t len);
+extern void tcp_rack_sacked(struct tcpcb *tp, tcp_seq start, tcp_seq end);
+extern void tcp_rack_dsack(struct tcpcb *tp);
+extern void tcp_rack_ack(struct tcpcb *tp);
+extern void tcp_rack_timeout(struct tcpcb *tp);
+extern void tcp_sack_lost_range(struct tcpcb *tp, tcp_seq start, tcp_seq end);
+extern uint32_t tcp_tw_count;
+extern void tcp_tw_init(void);
+extern boolean_t tcp_twstart(struct tcpcb *tp);
+extern boolean_t tcp_tw_input(struct mbuf *m, void *ipgen, struct tcphdr *th,
+    struct tcpopt *to, u_char *optp, int optlen, int tlen, unsigned int ifscope);
+extern uint32_t tcp_tw_expire(void);
 extern int32_t timer_diff(uint32_t t1, uint32_t toff1, uint32_t t2, uint32_t toff2);
 
 extern void tcp_set_background_cc(struct socket *);
@@ -1754,6 +1931,7 @@ extern boolean_t tcp_rxtseg_detect_bad_rexmt(struct tcpcb *, tcp_seq);
 extern boolean_t tcp_rxtseg_dsack_for_tlp(struct tcpcb *);
 extern u_int32_t tcp_rxtseg_total_size(struct tcpcb *tp);
 extern void tcp_rexmt_save_state(struct tcpcb *tp);
+extern void tcp_enter_fast_recovery(struct tcpcb *tp);
 extern void tcp_interface_send_probe(u_int16_t if_index_available);
 extern void tcp_probe_connectivity(struct ifnet *ifp, u_int32_t enable);
 extern void tcp_get_connectivity_status(struct tcpcb *,
@@ -1522,6 +1522,8 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	struct ifnet *origoutifp = NULL;
 	int flowadv = 0;
 	int tos = IPTOS_UNSPEC;
+	bool data_sum_valid = false;
+	uint16_t data_sum = 0;
 
 	/* Enable flow advisory only when connected */
 	flowadv = (so->so_state & SS_ISCONNECTED) ? 1 : 0;
@@ -1531,6 +1533,14 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 
 	socket_lock_assert_owned(so);
 
+	/* sosend() may have summed the data while copying it in */
+	if (m->m_pkthdr.pkt_ext_flags & PKTF_EXT_DATA_SUM) {
+		data_sum_valid = true;
+		data_sum = m->m_pkthdr.csum_rx_val;
+		m->m_pkthdr.pkt_ext_flags &= ~PKTF_EXT_DATA_SUM;
+		m->m_pkthdr.csum_data = 0;
+	}
+
 #if CONTENT_FILTER
 	/*
 	 * If socket is subject to UDP Content Filter and no addr is passed in,
@@ -1851,8 +1861,30 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	    (udpcksum && !(inp->inp_flags & INP_UDP_NOCKSUM))) {
 		ui->ui_sum = in_pseudo(ui->ui_src.s_addr, ui->ui_dst.s_addr,
 		    htons((u_short)len + sizeof(struct udphdr) + IPPROTO_UDP));
-		m->m_pkthdr.csum_flags = (CSUM_UDP | CSUM_ZERO_INVERT);
-		m->m_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
+		if (data_sum_valid && !(inp->inp_flags2 & INP2_CLAT46_FLOW) &&
+		    origoutifp != NULL && (!hwcksum_tx ||
+		    !(IF_HWASSIST_CSUM_FLAGS(origoutifp->if_hwassist) & CSUM_UDP))) {
+			/*
+			 * The interface last used cannot checksum UDP, and
+			 * the data was summed as it was copied in; finish
+			 * the checksum here instead of summing the data again
+			 * in ip_output().
+			 */
+			uint32_t sum = ui->ui_sum + ui->ui_sport + ui->ui_dport +
+			    ui->ui_ulen + data_sum;
+
+			sum = (sum >> 16) + (sum & 0xffff);
+			sum += (sum >> 16);
+			ui->ui_sum = ~sum & 0xffff;
+			/* RFC1122 4.1.3.4 */
+			if (ui->ui_sum == 0) {
+				ui->ui_sum = 0xffff;
+			}
+			udp_out_cksum_stats(len);
+		} else {
+			m->m_pkthdr.csum_flags = (CSUM_UDP | CSUM_ZERO_INVERT);
+			m->m_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
+		}
 	} else {
 		ui->ui_sum = 0;
 	}
@@ -188,7 +188,8 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	struct socket *so = inp->inp_socket;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	u_short lport = 0;
-	int wild = 0, reuseport = (so->so_options & SO_REUSEPORT);
+	int wild = 0, reuseport =
+	    (so->so_options & (SO_REUSEPORT | SO_REUSEPORT_LB));
 	struct ifnet *outif = NULL;
 	struct sockaddr_in6 sin6;
 	uint32_t lifscope = IFSCOPE_NONE;
@@ -200,7 +201,8 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	if (TAILQ_EMPTY(&in6_ifaddrhead)) { /* XXX broken! */
 		return EADDRNOTAVAIL;
 	}
-	if (!(so->so_options & (SO_REUSEADDR | SO_REUSEPORT))) {
+	if (!(so->so_options &
+	    (SO_REUSEADDR | SO_REUSEPORT | SO_REUSEPORT_LB))) {
 		wild = 1;
 	}
 
@@ -383,7 +385,8 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				if (t != NULL &&
 				    (!IN6_IS_ADDR_UNSPECIFIED(&sin6.sin6_addr) ||
 				    !IN6_IS_ADDR_UNSPECIFIED(&t->in6p_laddr) ||
-				    !(t->inp_socket->so_options & SO_REUSEPORT)) &&
+				    !(t->inp_socket->so_options &
+				    (SO_REUSEPORT | SO_REUSEPORT_LB))) &&
 				    (u != kauth_cred_getuid(t->inp_socket->so_cred)) &&
 				    !(t->inp_socket->so_flags & SOF_REUSESHAREUID) &&
 				    (!(t->inp_flags2 & INP2_EXTERNAL_PORT) ||
@@ -402,7 +405,8 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 						pcbinfo, sin.sin_addr, lport,
 						INPLOOKUP_WILDCARD);
 					if (t != NULL &&
-					    !(t->inp_socket->so_options & SO_REUSEPORT) &&
+					    !(t->inp_socket->so_options &
+					    (SO_REUSEPORT | SO_REUSEPORT_LB)) &&
 					    (kauth_cred_getuid(so->so_cred) !=
 					    kauth_cred_getuid(t->inp_socket->so_cred)) &&
 					    (t->inp_laddr.s_addr != INADDR_ANY ||
@@ -692,6 +696,7 @@ in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	struct in6_addr addr6;
 	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)(void *)nam;
 	struct inpcb *pcb;
+	lck_mtx_t *mtx;
 	int error = 0;
 	struct ifnet *outif = NULL;
 	struct socket *so = inp->inp_socket;
@@ -765,21 +770,16 @@ in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 #endif /* SKYWALK */
 		inp->in6p_flags |= INP_IN6ADDR_ANY;
 	}
-	if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
+	mtx = in_pcbhash_lock(inp);
 	inp->in6p_faddr = sin6->sin6_addr;
 	inp->inp_fport = sin6->sin6_port;
 	inp->inp_fifscope = sin6->sin6_scope_id;
 	in6_verify_ifscope(&inp->in6p_faddr, inp->inp_fifscope);
+	lck_mtx_unlock(mtx);
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP) {
 		nstat_pcb_invalidate_cache(inp);
 	}
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 
 done:
 	if (outif != NULL) {
@@ -793,6 +793,7 @@ void
 in6_pcbdisconnect(struct inpcb *inp)
 {
 	struct socket *so = inp->inp_socket;
+	lck_mtx_t *mtx;
 
 #if CONTENT_FILTER
 	if (so) {
@@ -800,21 +801,16 @@ in6_pcbdisconnect(struct inpcb *inp)
 	}
 #endif
 
-	if (!lck_rw_try_lock_exclusive(&inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(&inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP) {
 		nstat_pcb_cache(inp);
 	}
+	mtx = in_pcbhash_lock(inp);
 	bzero((caddr_t)&inp->in6p_faddr, sizeof(inp->in6p_faddr));
 	inp->inp_fport = 0;
 	/* clear flowinfo - RFC 6437 */
 	inp->inp_flow &= ~IPV6_FLOWLABEL_MASK;
+	lck_mtx_unlock(mtx);
 	in_pcbrehash(inp);
-	lck_rw_done(&inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
 	 * so check for SOF_MP_SUBFLOW socket flag before detaching the PCB;
@@ -1194,16 +1190,19 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 	struct inpcbporthead *porthash;
 	struct inpcb *match = NULL;
 	struct inpcbport *phd;
+	u_int32_t bucket;
 
 	if (!wild_okay) {
-		struct inpcbhead *head;
+		struct smrq_list_head *head;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		bucket = INP_PCBHASH(INADDR_ANY, lport, 0,
+		    pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[bucket];
+		lck_mtx_lock(INP_HASHLOCK(pcbinfo, bucket));
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1213,9 +1212,11 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 				/*
 				 * Found.
 				 */
+				lck_mtx_unlock(INP_HASHLOCK(pcbinfo, bucket));
 				return inp;
 			}
 		}
+		lck_mtx_unlock(INP_HASHLOCK(pcbinfo, bucket));
 		/*
 		 * Not found.
 		 */
@@ -1227,8 +1228,9 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 	 * First see if this local port is in use by looking on the
 	 * port hash list.
 	 */
-	porthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(lport,
-	    pcbinfo->ipi_porthashmask)];
+	bucket = INP_PCBPORTHASH(lport, pcbinfo->ipi_porthashmask);
+	porthash = &pcbinfo->ipi_porthashbase[bucket];
+	lck_mtx_lock(INP_PORTHASHLOCK(pcbinfo, bucket));
 	LIST_FOREACH(phd, porthash, phd_hash) {
 		if (phd->phd_port == lport) {
 			break;
@@ -1268,6 +1270,7 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 			}
 		}
 	}
+	lck_mtx_unlock(INP_PORTHASHLOCK(pcbinfo, bucket));
 	return match;
 }
 
@@ -1328,7 +1331,9 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
     u_int fport_arg, uint32_t fifscope, struct in6_addr *laddr, u_int lport_arg, uint32_t lifscope, int wildcard,
     uid_t *uid, gid_t *gid, struct ifnet *ifp, bool relaxed)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
+	lck_mtx_t *mtx;
+	u_int32_t bucket;
 	struct inpcb *inp;
 	uint16_t fport = (uint16_t)fport_arg, lport = (uint16_t)lport_arg;
 	int found;
@@ -1336,14 +1341,15 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	*uid = UID_MAX;
 	*gid = GID_MAX;
 
-	lck_rw_lock_shared(&pcbinfo->ipi_lock);
-
 	/*
 	 * First look for an exact match.
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	bucket = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6)) {
 			continue;
 		}
@@ -1374,16 +1380,21 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				*gid = kauth_cred_getgid(
 					inp->inp_socket->so_cred);
 			}
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return found;
 		}
 	}
+	lck_mtx_unlock(mtx);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		bucket = INP_PCBHASH(INADDR_ANY, lport, 0,
+		    pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[bucket];
+		mtx = INP_HASHLOCK(pcbinfo, bucket);
+		lck_mtx_lock(mtx);
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1410,7 +1421,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 						*gid = kauth_cred_getgid(
 							inp->inp_socket->so_cred);
 					}
-					lck_rw_done(&pcbinfo->ipi_lock);
+					lck_mtx_unlock(mtx);
 					return found;
 				} else if (IN6_IS_ADDR_UNSPECIFIED(
 					    &inp->in6p_laddr)) {
@@ -1425,15 +1436,15 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				*gid = kauth_cred_getgid(
 					local_wild->inp_socket->so_cred);
 			}
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return found;
 		}
+		lck_mtx_unlock(mtx);
 	}
 
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(&pcbinfo->ipi_lock);
 	return 0;
 }
 
@@ -1445,18 +1456,43 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
     u_int fport_arg, uint32_t fifscope, struct in6_addr *laddr, u_int lport_arg, uint32_t lifscope, int wildcard,
     struct ifnet *ifp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
+	lck_mtx_t *mtx;
+	u_int32_t bucket;
 	struct inpcb *inp;
 	uint16_t fport = (uint16_t)fport_arg, lport = (uint16_t)lport_arg;
 
-	lck_rw_lock_shared(&pcbinfo->ipi_lock);
+	bucket = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[bucket];
+
+	/*
+	 * Fast path for established flows; see in_pcblookup_hash().
+	 */
+	if (!IN6_IS_ADDR_UNSPECIFIED(faddr)) {
+		smr_global_enter();
+		smrq_entered_foreach(inp, head, inp_hash) {
+			if ((inp->inp_vflag & INP_IPV6) &&
+			    in6_are_addr_equal_scoped(&inp->in6p_faddr, faddr, inp->inp_fifscope, fifscope) &&
+			    in6_are_addr_equal_scoped(&inp->in6p_laddr, laddr, inp->inp_lifscope, lifscope) &&
+			    inp->inp_fport == fport &&
+			    inp->inp_lport == lport) {
+				break;
+			}
+		}
+		if (inp != NULL && in_pcb_smr_acquire(inp, ifp)) {
+			smr_global_leave();
+			return inp;
+		}
+		smr_global_leave();
+	}
 
 	/*
 	 * First look for an exact match.
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	mtx = INP_HASHLOCK(pcbinfo, bucket);
+	lck_mtx_lock(mtx);
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6)) {
 			continue;
 		}
@@ -1480,21 +1516,32 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return inp;
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(&pcbinfo->ipi_lock);
+				lck_mtx_unlock(mtx);
 				return NULL;
 			}
 		}
 	}
+	lck_mtx_unlock(mtx);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		inp = in_pcblookup_lbgroup(pcbinfo, INP_IPV6, faddr, fport,
+		    laddr, lport, ifp);
+		if (inp != NULL) {
+			return inp;
+		}
+
+		bucket = INP_PCBHASH(INADDR_ANY, lport, 0,
+		    pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[bucket];
+		mtx = INP_HASHLOCK(pcbinfo, bucket);
+		lck_mtx_lock(mtx);
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1515,11 +1562,11 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				    laddr, inp->inp_lifscope, lifscope)) {
 					if (in_pcb_checkstate(inp, WNT_ACQUIRE,
 					    0) != WNT_STOPUSING) {
-						lck_rw_done(&pcbinfo->ipi_lock);
+						lck_mtx_unlock(mtx);
 						return inp;
 					} else {
 						/* dead; say it isn't found */
-						lck_rw_done(&pcbinfo->ipi_lock);
+						lck_mtx_unlock(mtx);
 						return NULL;
 					}
 				} else if (IN6_IS_ADDR_UNSPECIFIED(
@@ -1530,10 +1577,10 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 		}
 		if (local_wild && in_pcb_checkstate(local_wild,
 		    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return local_wild;
 		} else {
-			lck_rw_done(&pcbinfo->ipi_lock);
+			lck_mtx_unlock(mtx);
 			return NULL;
 		}
 	}
@@ -1541,7 +1588,6 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(&pcbinfo->ipi_lock);
 	return NULL;
 }
 
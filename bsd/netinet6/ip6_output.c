@@ -4218,6 +4218,11 @@ ip6_output_checksum(struct ifnet *ifp, uint32_t mtu, struct mbuf *m,
 		}
 	}
 
+	/* a super-segment split in software is checksummed per segment */
+	if (GSO_IPV6_NEEDED(ifp, m)) {
+		sw_csum &= ~CSUM_DELAY_IPV6_DATA;
+	}
+
 	if (sw_csum & CSUM_DELAY_IPV6_DATA) {
 		in6_delayed_cksum_offset(m, 0, optlen, nxt0);
 		sw_csum &= ~CSUM_DELAY_IPV6_DATA;
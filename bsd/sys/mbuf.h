@@ -563,6 +563,7 @@ struct pkthdr {
 #define PKTF_EXT_OUTPUT_SCOPE   0x1     /* outgoing packet has ipv6 address scope id */
 #define PKTF_EXT_L4S            0x2     /* pkts is from a L4S connection */
 #define PKTF_EXT_QUIC           0x4     /* flag to denote a QUIC packet */
+#define PKTF_EXT_DATA_SUM       0x8     /* csum_rx_val is the sum of the data sosend copied in */
 
 #define PKT_CRUMB_TS_COMP_REQ   0x0001 /* timestamp completion requested */
 #define PKT_CRUMB_TS_COMP_CB    0x0002 /* timestamp callback called */
@@ -723,19 +724,32 @@ struct mbuf {
 #define CSUM_TSO_IPV6           0x00200000      /* This mbuf needs to be segmented by the NIC */
 
 #define TSO_IPV4_OK(_ifp, _m)                                           \
-    (((_ifp)->if_hwassist & IFNET_TSO_IPV4) &&                          \
+    ((((_ifp)->if_hwassist & IFNET_TSO_IPV4) || IFNET_IS_SW_GSO(_ifp)) && \
     ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV4))                        \
 
 #define TSO_IPV4_NOTOK(_ifp, _m)                                        \
     (!((_ifp)->if_hwassist & IFNET_TSO_IPV4) &&                         \
+    !IFNET_IS_SW_GSO(_ifp) &&                                           \
     ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV4))                        \
 
 #define TSO_IPV6_OK(_ifp, _m)                                           \
-    (((_ifp)->if_hwassist & IFNET_TSO_IPV6) &&                          \
+    ((((_ifp)->if_hwassist & IFNET_TSO_IPV6) || IFNET_IS_SW_GSO(_ifp)) && \
     ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV6))                        \
 
 #define TSO_IPV6_NOTOK(_ifp, _m)                                        \
     (!((_ifp)->if_hwassist & IFNET_TSO_IPV6) &&                         \
+    !IFNET_IS_SW_GSO(_ifp) &&                                           \
+    ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV6))                        \
+
+/* TSO requested on an interface that segments in software (if_gso.c) */
+#define GSO_IPV4_NEEDED(_ifp, _m)                                       \
+    (!((_ifp)->if_hwassist & IFNET_TSO_IPV4) &&                         \
+    IFNET_IS_SW_GSO(_ifp) &&                                            \
+    ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV4))                        \
+
+#define GSO_IPV6_NEEDED(_ifp, _m)                                       \
+    (!((_ifp)->if_hwassist & IFNET_TSO_IPV6) &&                         \
+    IFNET_IS_SW_GSO(_ifp) &&                                            \
     ((_m)->m_pkthdr.csum_flags & CSUM_TSO_IPV6))                        \
 
 #endif /* XNU_KERNEL_PRIVATE */
@@ -161,6 +161,7 @@
 #define SO_NOWAKEFROMSLEEP      0x10000 /* Don't wake for traffic to this socket */
 #define SO_NOAPNFALLBK          0x20000 /* Don't attempt APN fallback for the socket */
 #define SO_TIMESTAMP_CONTINUOUS 0x40000 /* Continuous monotonic timestamp on rcvd dgram */
+#define SO_REUSEPORT_LB         0x80000 /* reuseport with load balancing of connections */
 #endif
 
 #endif  /* (!__APPLE__) */
@@ -366,6 +367,7 @@
 #define SO_RESOLVER_SIGNATURE      0x1131  /* A signed data blob from the system resolver */
 #ifdef PRIVATE
 #define SO_MARK_CELLFALLBACK_UUID  0x1132  /* Mark as initiated by cell fallback using UUID of the connection */
+#define SO_MAX_PACING_RATE         0x1133  /* cap on the pacing rate in bytes per second, 0 for none (uint64_t) */
 
 struct so_mark_cellfallback_uuid_args {
 	uuid_t flow_uuid;
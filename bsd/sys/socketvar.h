@@ -351,6 +351,8 @@ struct socket {
 	u_int8_t        so_log_seqn;    /* Multi-layer Packet Logging rolling sequence number */
 	uint8_t         so_mpkl_send_proto;
 	uuid_t          so_mpkl_send_uuid;
+
+	uint64_t        so_max_pacing_rate; /* SO_MAX_PACING_RATE, bytes/s */
 };
 
 /* Control message accessor in mbufs */
@@ -187,6 +187,8 @@ typedef char __attribute__((aligned(_Alignof(union iovecs)))) uio_stackbuf_t;
 	  (a_uio_t)->uio_segflg == UIO_SYSSPACE32 )
 
 extern int ureadc(int c, struct uio *uio);
+extern int uiomove_cksum(const char *cp, int n, struct uio *uio, int off,
+    uint32_t *sum);
 
 #endif /* KERNEL_PRIVATE */
 #endif /* !_SYS_UIO_INTERNAL_H_ */
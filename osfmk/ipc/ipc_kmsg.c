@@ -94,6 +94,7 @@
 #include <kern/cpu_data.h>
 #include <kern/policy_internal.h>
 #include <kern/mach_filter.h>
+#include <kern/counter.h>
 
 #include <pthread/priority_private.h>
 
@@ -1472,6 +1473,25 @@ ZONE_DEFINE(ipc_kmsg_zone, "ipc kmsgs", IKM_SAVED_KMSG_SIZE,
     ZC_CACHING | ZC_ZFREE_CLEARMEM);
 static TUNABLE(bool, enforce_strict_reply, "ipc_strict_reply", false);
 
+/*
+ * Inline message content spanning at least this many page-aligned bytes in
+ * the sender is not copied into the kmsg udata buffer at send time.  The
+ * aligned span is captured copy-on-write instead, and moved to the receiver
+ * with vm_map_copy_overwrite(), which saves one of the two copies of the
+ * payload (and both of them when the receive buffer is page-congruent).
+ *
+ * Below this size, the cost of setting up the VM copy (and of taking the
+ * C-O-W faults later) dominates the copy costs.  0 disables the optimization.
+ */
+TUNABLE_DEV_WRITEABLE(uint32_t, ipc_kmsg_udata_cow_threshold,
+    "ipc_kmsg_udata_cow_threshold", 16 * 1024);
+
+SCALABLE_COUNTER_DEFINE(ipc_kmsg_udata_cow_count);
+SCALABLE_COUNTER_DEFINE(ipc_kmsg_udata_cow_bytes);
+
+static_assert(PAGE_MAX_SIZE <= (1u << 24),
+    "ikm_udata_copy_offset holds any offset within a page");
+
 /*
  * Forward declarations
  */
@@ -1910,6 +1930,12 @@ ipc_kmsg_free(
 		udata_buf_size = kmsg->ikm_udata_size;
 	}
 
+	/* content captured copy-on-write which was never copied out */
+	if (kmsg->ikm_udata_copy != VM_MAP_COPY_NULL) {
+		vm_map_copy_discard(kmsg->ikm_udata_copy);
+		kmsg->ikm_udata_copy = VM_MAP_COPY_NULL;
+	}
+
 	switch (kmsg->ikm_type) {
 	case IKM_TYPE_ALL_INLINED:
 		/*
@@ -2424,6 +2450,185 @@ ipc_kmsg_too_large(
 	return false;
 }
 
+/*
+ *	Routine:	ipc_kmsg_copyin_udata
+ *	Purpose:
+ *		Copies in user message content to the udata buffer of
+ *		a non-linear kmsg.
+ *
+ *		If the content spans enough page-aligned bytes in the
+ *		sender (see ipc_kmsg_udata_cow_threshold), only the
+ *		unaligned head and tail are copied in, and the aligned
+ *		middle is captured copy-on-write in ikm_udata_copy.
+ *	Conditions:
+ *		Nothing locked.  ikm_udata can fit content_size bytes.
+ */
+static mach_msg_return_t
+ipc_kmsg_copyin_udata(
+	ipc_kmsg_t             kmsg,
+	mach_vm_address_t      content_addr,
+	mach_msg_size_t        content_size)
+{
+	vm_map_t map = current_map();
+	mach_vm_address_t cow_start, cow_end;
+	mach_msg_size_t head_size, tail_size, threshold;
+	vm_map_copy_t copy;
+
+	assert(!ikm_is_linear(kmsg));
+
+	threshold = ipc_kmsg_udata_cow_threshold;
+	if (threshold == 0 || content_size < threshold ||
+	    VM_MAP_PAGE_SHIFT(map) != PAGE_SHIFT) {
+		goto copyin;
+	}
+
+	cow_start = vm_map_round_page(content_addr, VM_MAP_PAGE_MASK(map));
+	cow_end = vm_map_trunc_page(content_addr + content_size, VM_MAP_PAGE_MASK(map));
+	if (cow_end <= cow_start || cow_end - cow_start < threshold) {
+		goto copyin;
+	}
+
+	/*
+	 * Force a virtual copy: vm_map_copyin() would otherwise fall back
+	 * to a kernel buffer (i.e. a physical copy) for small ranges.
+	 */
+	if (vm_map_copyin_internal(map, cow_start, cow_end - cow_start,
+	    VM_MAP_COPYIN_ENTRY_LIST, &copy) != KERN_SUCCESS) {
+		/* let the physical copy report what is wrong with the range */
+		goto copyin;
+	}
+
+	head_size = (mach_msg_size_t)(cow_start - content_addr);
+	tail_size = (mach_msg_size_t)(content_addr + content_size - cow_end);
+
+	if (copyinmsg(content_addr, (char *)kmsg->ikm_udata, head_size) ||
+	    copyinmsg(cow_end, (char *)kmsg->ikm_udata + content_size - tail_size,
+	    tail_size)) {
+		vm_map_copy_discard(copy);
+		return MACH_SEND_INVALID_DATA;
+	}
+
+	kmsg->ikm_udata_copy = copy;
+	kmsg->ikm_udata_copy_offset = head_size;
+
+	counter_inc(&ipc_kmsg_udata_cow_count);
+	counter_add(&ipc_kmsg_udata_cow_bytes, cow_end - cow_start);
+	return MACH_MSG_SUCCESS;
+
+copyin:
+	if (copyinmsg(content_addr, (char *)kmsg->ikm_udata, content_size)) {
+		return MACH_SEND_INVALID_DATA;
+	}
+	return MACH_MSG_SUCCESS;
+}
+
+/*
+ *	Routine:	ipc_kmsg_udata_cow_materialize
+ *	Purpose:
+ *		Copies the content captured copy-on-write by
+ *		ipc_kmsg_copyin_udata() into the udata buffer,
+ *		for consumers which need the whole content in
+ *		kernel memory.
+ *
+ *		On failure, the content is zero-filled instead so
+ *		that the udata buffer never holds stale data.
+ *	Conditions:
+ *		Nothing locked.  Consumes ikm_udata_copy.
+ */
+static kern_return_t
+ipc_kmsg_udata_cow_materialize(
+	ipc_kmsg_t                 kmsg)
+{
+	vm_map_copy_t copy = kmsg->ikm_udata_copy;
+	char *dst = (char *)kmsg->ikm_udata + kmsg->ikm_udata_copy_offset;
+	vm_map_size_t size = copy->size;
+	vm_map_offset_t addr;
+	kern_return_t kr;
+
+	assert(kmsg->ikm_udata_copy_offset + size <= kmsg->ikm_udata_size);
+
+	kmsg->ikm_udata_copy = VM_MAP_COPY_NULL;
+	kr = vm_map_copyout(ipc_kernel_map, &addr, copy);
+	if (kr == KERN_SUCCESS) {
+		memcpy(dst, (const void *)addr, size);
+		mach_vm_deallocate(ipc_kernel_map, addr, size);
+	} else {
+		vm_map_copy_discard(copy);
+		bzero(dst, size);
+	}
+
+	return kr;
+}
+
+/*
+ *	Routine:	ipc_kmsg_copyout_udata
+ *	Purpose:
+ *		Copies out the first copyout_size bytes of the udata
+ *		buffer of a non-linear kmsg to the current map.
+ *
+ *		Content captured copy-on-write at send time is moved
+ *		with vm_map_copy_overwrite(), which shares the pages
+ *		with the receiver when its buffer is page-congruent
+ *		with the sender's, and copies them once otherwise.
+ *	Conditions:
+ *		Nothing locked.
+ */
+static mach_msg_return_t
+ipc_kmsg_copyout_udata(
+	ipc_kmsg_t             kmsg,
+	mach_vm_address_t      rcv_addr,
+	mach_msg_size_t        copyout_size)
+{
+	vm_map_t map = current_map();
+	vm_map_copy_t copy = kmsg->ikm_udata_copy;
+	mach_msg_size_t start, end;
+	kern_return_t kr;
+
+	if (copy != VM_MAP_COPY_NULL) {
+		start = kmsg->ikm_udata_copy_offset;
+		end = start + (mach_msg_size_t)copy->size;
+
+		/*
+		 * Partial receives (msg_receive_error()) and receivers with
+		 * a different page size take the slow path.
+		 */
+		if (copyout_size < end || VM_MAP_PAGE_SHIFT(map) != PAGE_SHIFT) {
+			if (ipc_kmsg_udata_cow_materialize(kmsg) != KERN_SUCCESS) {
+				return MACH_RCV_INVALID_DATA;
+			}
+			copy = VM_MAP_COPY_NULL;
+		}
+	}
+
+	if (copy == VM_MAP_COPY_NULL) {
+		if (copyoutmsg((const char *)kmsg->ikm_udata, rcv_addr, copyout_size)) {
+			return MACH_RCV_INVALID_DATA;
+		}
+		return MACH_MSG_SUCCESS;
+	}
+
+	kmsg->ikm_udata_copy = VM_MAP_COPY_NULL;
+	if (copyoutmsg((const char *)kmsg->ikm_udata, rcv_addr, start)) {
+		kr = KERN_INVALID_ADDRESS;
+	} else {
+		/* consumes copy on success */
+		kr = vm_map_copy_overwrite(map, rcv_addr + start, copy,
+		    copy->size, FALSE);
+	}
+	if (kr != KERN_SUCCESS) {
+		/* the content goes away with the copy, leave no stale data instead */
+		vm_map_copy_discard(copy);
+		bzero((char *)kmsg->ikm_udata + start, end - start);
+		return MACH_RCV_INVALID_DATA;
+	}
+
+	if (copyoutmsg((const char *)kmsg->ikm_udata + end, rcv_addr + end,
+	    copyout_size - end)) {
+		return MACH_RCV_INVALID_DATA;
+	}
+	return MACH_MSG_SUCCESS;
+}
+
 /*
  *	Routine:	ipc_kmsg_get_body_and_aux_from_user
  *	Purpose:
@@ -2511,10 +2716,11 @@ ipc_kmsg_get_body_and_aux_from_user(
 
 					assert(kmsg->ikm_udata != NULL);
 					assert((vm_offset_t)kmsg->ikm_udata + copyin_size <= ikm_udata_end(kmsg));
-					if (copyinmsg(msg_addr + sizeof(mach_msg_user_base_t) + dsc_size,
-					    (char *)kmsg->ikm_udata,
-					    copyin_size)) {
-						return MACH_SEND_INVALID_DATA;
+					mr = ipc_kmsg_copyin_udata(kmsg,
+					    msg_addr + sizeof(mach_msg_user_base_t) + dsc_size,
+					    copyin_size);
+					if (mr != MACH_MSG_SUCCESS) {
+						return mr;
 					}
 				}
 
@@ -2529,19 +2735,23 @@ ipc_kmsg_get_body_and_aux_from_user(
 		assert(desc_count == 0);
 		/* copy in the rest of the message, after user_header */
 		if (kmsg_size > sizeof(mach_msg_header_t)) {
-			char *msg_content = ikm_is_linear(kmsg) ?
-			    (char *)hdr + sizeof(mach_msg_header_t) :
-			    (char *)kmsg->ikm_udata;
-
 			if (ikm_is_linear(kmsg)) {
 				assert((vm_offset_t)hdr + kmsg_size <= ikm_kdata_end(kmsg));
+
+				if (copyinmsg(msg_addr + sizeof(mach_msg_user_header_t),
+				    (char *)hdr + sizeof(mach_msg_header_t),
+				    kmsg_size - sizeof(mach_msg_header_t))) {
+					return MACH_SEND_INVALID_DATA;
+				}
 			} else {
 				assert((vm_offset_t)kmsg->ikm_udata + kmsg_size - sizeof(mach_msg_header_t) <= ikm_udata_end(kmsg));
-			}
 
-			if (copyinmsg(msg_addr + sizeof(mach_msg_user_header_t), msg_content,
-			    kmsg_size - sizeof(mach_msg_header_t))) {
-				return MACH_SEND_INVALID_DATA;
+				mach_msg_return_t mr = ipc_kmsg_copyin_udata(kmsg,
+				    msg_addr + sizeof(mach_msg_user_header_t),
+				    kmsg_size - sizeof(mach_msg_header_t));
+				if (mr != MACH_MSG_SUCCESS) {
+					return mr;
+				}
 			}
 		}
 	}
@@ -3285,7 +3495,7 @@ copyout_msg:
 		}
 
 		/* Then copy out udata */
-		if (copyoutmsg((const char *)kmsg->ikm_udata, rcv_msg_addr + kdata_copyout_size,
+		if (ipc_kmsg_copyout_udata(kmsg, rcv_msg_addr + kdata_copyout_size,
 		    udata_copyout_size)) {
 			mr = MACH_RCV_INVALID_DATA;
 			cpout_msg_size = 0;
@@ -3393,7 +3603,7 @@ ipc_kmsg_put_scalar_to_user(
 		}
 
 		/* Then copy out udata */
-		if (copyoutmsg((const char *)kmsg->ikm_udata, rcv_addr + kdata_copyout_size,
+		if (ipc_kmsg_copyout_udata(kmsg, rcv_addr + kdata_copyout_size,
 		    udata_copyout_size)) {
 			mr = MACH_RCV_INVALID_DATA;
 			copyout_size = 0;
@@ -3495,7 +3705,13 @@ ipc_kmsg_put_to_kernel(
 		assert(rcv_size >= kdata_size);
 		(void)memcpy((void *)msg, (const void *)hdr, kdata_size);
 
-		/* Fill the remaining space with udata */
+		/*
+		 * Fill the remaining space with udata; no errors allowed, the
+		 * copy-on-write content reads as zeroes if it cannot be copied.
+		 */
+		if (kmsg->ikm_udata_copy != VM_MAP_COPY_NULL) {
+			(void)ipc_kmsg_udata_cow_materialize(kmsg);
+		}
 		(void)memcpy((void *)((vm_offset_t)msg + kdata_size),
 		    (const void *)kmsg->ikm_udata, rcv_size - kdata_size);
 	}
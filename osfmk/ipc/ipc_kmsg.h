@@ -157,9 +157,13 @@ struct ipc_kmsg {
 
 	mach_msg_type_name_t       ikm_voucher_type: 6; /* disposition type the voucher came in with */
 	ipc_kmsg_type_t            ikm_type: 2;
+	/* offset in ikm_udata of ikm_udata_copy, less than a page */
+	mach_msg_size_t            ikm_udata_copy_offset: 24;
 
 	/* size of buffer pointed to by ikm_udata, unused for IKM_TYPE_ALL_INLINED. */
 	mach_msg_size_t            ikm_udata_size;
+	/* page aligned content not (yet) copied into ikm_udata, see ipc_kmsg_copyin_udata() */
+	vm_map_copy_t              XNU_PTRAUTH_SIGNED_PTR("kmsg.ikm_udata_copy") ikm_udata_copy;
 	/* inline data of size IKM_SAVED_MSG_SIZE follows */
 };
 
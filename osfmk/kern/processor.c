@@ -590,11 +590,18 @@ pset_init(
 #endif
 	pset->pending_spill_cpu_mask = 0;
 	pset->rt_pending_spill_cpu_mask = 0;
+	pset->pending_steal_cpu_mask = 0;
 	pset_lock_init(pset);
 	pset->pset_self = IP_NULL;
 	pset->pset_name_self = IP_NULL;
 	pset->pset_list = PROCESSOR_SET_NULL;
 	pset->is_SMT = false;
+#if __AMP__
+	pset->pset_steal_count = 0;
+	pset->pset_steal_cross_type_count = 0;
+	pset->pset_steal_declined_count = 0;
+	pset->pset_steal_saved_latency_us = 0;
+#endif /* __AMP__ */
 #if CONFIG_SCHED_EDGE
 	bzero(&pset->pset_execution_time, sizeof(pset->pset_execution_time));
 	pset->cpu_running_foreign = 0;
@@ -252,6 +252,7 @@ struct processor_set {
 #endif
 	cpumap_t                pending_spill_cpu_mask;
 	cpumap_t                rt_pending_spill_cpu_mask;
+	cpumap_t                pending_steal_cpu_mask; /* see sched_steal_signal_idle() */
 
 	struct ipc_port *       pset_self;              /* port for operations */
 	struct ipc_port *       pset_name_self; /* port for information */
@@ -280,6 +281,13 @@ struct processor_set {
 	pset_execution_time_t   pset_execution_time[TH_BUCKET_SCHED_MAX];
 	uint64_t                pset_cluster_shared_rsrc_load[CLUSTER_SHARED_RSRC_TYPE_COUNT];
 #endif /* CONFIG_SCHED_EDGE */
+#if __AMP__
+	/* Idle steal statistics for processors in this pset; see sched_steal_record() */
+	uint64_t                pset_steal_count;               /* threads stolen from other psets */
+	uint64_t                pset_steal_cross_type_count;    /* ... of which from a pset of another cluster type */
+	uint64_t                pset_steal_declined_count;      /* cross type steals declined as not worth the migration cost */
+	uint64_t                pset_steal_saved_latency_us;    /* estimated run queue latency saved by steals */
+#endif /* __AMP__ */
 	bool                    is_SMT;                 /* pset contains SMT processors */
 };
 
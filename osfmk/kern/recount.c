@@ -987,6 +987,27 @@ recount_processor_usage(struct recount_processor *pr,
 	*idle_time_out = idle_time;
 }
 
+void
+recount_sched_latency_sum(recount_cpu_kind_t kind,
+    struct recount_sched_latency *sum)
+{
+	*sum = (struct recount_sched_latency){ 0 };
+	percpu_foreach(processor, processor) {
+		if (recount_topo_index(RCT_TOPO_CPU_KIND, processor) != kind) {
+			continue;
+		}
+		const struct recount_sched_latency *lat =
+		    &processor->pr_recount.rpr_sched_latency;
+		for (unsigned int b = 0; b < RCT_SCHED_BUCKET_COUNT; b++) {
+			for (unsigned int j = 0; j < RCT_SCHED_LATENCY_BIN_COUNT; j++) {
+				// Single writer, so relaxed loads see a consistent count.
+				sum->rsl_bins[b][j] += os_atomic_load_wide(
+					&lat->rsl_bins[b][j], relaxed);
+			}
+		}
+	}
+}
+
 bool
 recount_task_thread_perf_level_usage(struct task *task, uint64_t tid,
     struct recount_usage *usage_levels)
@@ -203,6 +203,25 @@ void recount_task_terminated_usage_perf_only(struct task *task,
 int proc_pidthreadcounts(struct proc *p, uint64_t thuniqueid, user_addr_t uaddr,
     size_t usize, int *ret);
 
+// Scheduling latency histograms.
+//
+// Each processor counts the time threads spent runnable before it dispatched
+// them, indexed by scheduling bucket (see `sched_bucket_t`, which has one less
+// bucket without the clutch scheduler).  Bins are log2-spaced in Mach time
+// units: bin 0 counts dispatches with no latency, bin `i` counts latencies in
+// [2^(i - 1), 2^i), and the last bin also absorbs anything longer.
+#define RCT_SCHED_BUCKET_COUNT (6)
+#define RCT_SCHED_LATENCY_BIN_COUNT (32)
+
+struct recount_sched_latency {
+	uint64_t rsl_bins[RCT_SCHED_BUCKET_COUNT][RCT_SCHED_LATENCY_BIN_COUNT];
+};
+
+// Sum the scheduling latency histograms of all processors of a CPU kind.  On
+// systems with a single kind of CPU, every processor is `RCT_CPU_EFFICIENCY`.
+void recount_sched_latency_sum(recount_cpu_kind_t kind,
+    struct recount_sched_latency *sum);
+
 #endif // XNU_KERNEL_PRIVATE
 
 #if MACH_KERNEL_PRIVATE
@@ -293,9 +312,30 @@ struct recount_processor {
 	// Cache the RCT_TOPO_CPU_KIND offset, which cannot change.
 	uint8_t rpr_cpu_kind_index;
 #endif // __AMP__
+	// Only updated by the processor itself, at dispatch.
+	struct recount_sched_latency rpr_sched_latency;
 };
 void recount_processor_init(struct processor *processor);
 
+// Count a thread dispatched by this processor after waiting `latency_mach`
+// since it was made runnable.
+//
+// Preemption must be disabled.
+OS_ALWAYS_INLINE
+static inline void
+recount_processor_sched_latency(struct recount_processor *pr,
+    unsigned int bucket, uint64_t latency_mach)
+{
+	unsigned int bin = 0;
+	if (latency_mach != 0) {
+		bin = 64 - (unsigned int)__builtin_clzll(latency_mach);
+		if (bin >= RCT_SCHED_LATENCY_BIN_COUNT) {
+			bin = RCT_SCHED_LATENCY_BIN_COUNT - 1;
+		}
+	}
+	pr->rpr_sched_latency.rsl_bins[bucket][bin]++;
+}
+
 // Get a snapshot of the processor's usage, along with an up-to-date snapshot
 // of its idle time (to now if the processor is currently idle).
 void recount_processor_usage(struct recount_processor *pr,
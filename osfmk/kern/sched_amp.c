@@ -482,15 +482,63 @@ sched_amp_processor_queue_remove(
 	return processor != PROCESSOR_NULL;
 }
 
+/*
+ * sched_amp_steal_saved_latency_us()
+ *
+ * Estimate how long a thread at the head of the P-cluster runqueue would
+ * have waited for a P-core, i.e. the time until the earliest quantum expiry
+ * among the running P-cores. Called with pset locked.
+ */
+static uint64_t
+sched_amp_steal_saved_latency_us(processor_set_t pset, uint64_t ctime)
+{
+	uint64_t earliest_quantum_end = UINT64_MAX;
+	uint64_t running_map = pset->cpu_state_map[PROCESSOR_RUNNING];
+
+	for (int cpuid = lsb_first(running_map); cpuid >= 0; cpuid = lsb_next(running_map, cpuid)) {
+		earliest_quantum_end = MIN(earliest_quantum_end, processor_array[cpuid]->quantum_end);
+	}
+	if ((earliest_quantum_end == UINT64_MAX) || (earliest_quantum_end <= ctime)) {
+		return 0;
+	}
+
+	uint64_t saved_latency_ns = 0;
+	absolutetime_to_nanoseconds(earliest_quantum_end - ctime, &saved_latency_ns);
+	return saved_latency_ns / NSEC_PER_USEC;
+}
+
+/*
+ * sched_amp_steal_possible()
+ *
+ * Allow steal if load average still OK, no idle cores, and more threads on
+ * runq than active cores DISPATCHING. Called with pset (the P-cluster) locked.
+ */
+static bool
+sched_amp_steal_possible(processor_set_t pset, bool spill_pending)
+{
+	return (sched_get_pset_load_average(pset, 0) >= sched_amp_steal_threshold(pset, spill_pending)) &&
+	       (pset->pset_runq.count > bit_count(pset->cpu_state_map[PROCESSOR_DISPATCHING])) &&
+	       (bit_count(pset->recommended_bitmask & pset->cpu_state_map[PROCESSOR_IDLE]) == 0);
+}
+
 /*
  * sched_amp_steal_thread()
  *
+ * The P-cluster is the only steal candidate for an idle E-core. The steal
+ * thresholds act as the cost limit for moving a thread down to an E-core:
+ * a runnable P-cluster thread is only stolen once the P-cluster load is
+ * above its capacity. Steals are accounted with sched_steal_record() and,
+ * if the P-cluster is still overloaded afterwards, the next idle E-core is
+ * signalled to steal as well.
  */
 thread_t
 sched_amp_steal_thread(processor_set_t pset)
 {
 	thread_t thread = THREAD_NULL;
+	processor_set_t idle_pset = pset;
 	processor_set_t nset = pset;
+	uint64_t saved_latency_us = 0;
+	bool steal_more = false;
 
 	assert(pset->pset_cluster_type != PSET_AMP_P);
 
@@ -499,6 +547,7 @@ sched_amp_steal_thread(processor_set_t pset)
 
 	bool spill_pending = bit_test(pset->pending_spill_cpu_mask, processor->cpu_id);
 	bit_clear(pset->pending_spill_cpu_mask, processor->cpu_id);
+	bit_clear(pset->pending_steal_cpu_mask, processor->cpu_id);
 
 	if (!pcore_set) {
 		return THREAD_NULL;
@@ -515,17 +564,27 @@ sched_amp_steal_thread(processor_set_t pset)
 
 		pset_lock(pset);
 
-		/* Allow steal if load average still OK, no idle cores, and more threads on runq than active cores DISPATCHING */
-		if ((sched_get_pset_load_average(pset, 0) >= sched_amp_steal_threshold(pset, spill_pending)) &&
-		    (pset->pset_runq.count > bit_count(pset->cpu_state_map[PROCESSOR_DISPATCHING])) &&
-		    (bit_count(pset->recommended_bitmask & pset->cpu_state_map[PROCESSOR_IDLE]) == 0)) {
+		if (sched_amp_steal_possible(pset, spill_pending)) {
+			uint64_t ctime = mach_absolute_time();
+			saved_latency_us = sched_amp_steal_saved_latency_us(pset, ctime);
 			thread = run_queue_dequeue(&pset->pset_runq, SCHED_HEADQ);
-			KDBG(MACHDBG_CODE(DBG_MACH_SCHED, MACH_AMP_STEAL) | DBG_FUNC_NONE, spill_pending, 0, 0, 0);
+			KDBG(MACHDBG_CODE(DBG_MACH_SCHED, MACH_AMP_STEAL) | DBG_FUNC_NONE, spill_pending, saved_latency_us, 0, 0);
 			sched_update_pset_load_average(pset, 0);
+			steal_more = sched_amp_steal_possible(pset, false);
 		}
+	} else if (nset->pset_runq.count > 0) {
+		/* Runnable P-cluster threads were left behind as not worth moving to an E-core */
+		os_atomic_inc(&idle_pset->pset_steal_declined_count, relaxed);
 	}
 
 	pset_unlock(pset);
+
+	if (thread != THREAD_NULL) {
+		sched_steal_record(idle_pset, nset, saved_latency_us);
+		if (steal_more) {
+			sched_steal_signal_idle(idle_pset);
+		}
+	}
 	return thread;
 }
 
@@ -1639,6 +1639,14 @@ sched_clutch_bucket_group_cpu_pending_adjust(
 {
 	uint64_t cpu_used_adjusted = 0;
 	if (cpu_blocked < cpu_used) {
+		/*
+		 * A bucket group which never blocks can have its blocked time scaled
+		 * down to zero by sched_clutch_bucket_group_cpu_adjust(); avoid the
+		 * division by zero (which yields 0 on arm64 and traps on x86_64).
+		 */
+		if (cpu_blocked == 0 && pending_intervals == 0) {
+			return 0;
+		}
 		cpu_used_adjusted = (sched_clutch_bucket_group_interactive_pri * cpu_blocked * cpu_used);
 		cpu_used_adjusted = cpu_used_adjusted / ((sched_clutch_bucket_group_interactive_pri * cpu_blocked) + (cpu_used * pending_intervals));
 	} else {
@@ -2175,6 +2183,8 @@ sched_clutch_bucket_group_interactivity_score_calculate(
 		        os_atomic_rmw_loop_give_up();
 		}
 		new_interactivity_data.scct_timestamp = timestamp;
+		/* The first update only stamps the time and keeps the initial (interactive) score */
+		new_interactivity_data.scct_count = old_interactivity_data.scct_count;
 		if (old_interactivity_data.scct_timestamp != 0) {
 		        new_interactivity_data.scct_count = interactivity_score;
 		}
@@ -3770,6 +3780,18 @@ sched_edge_cluster_load_metric(processor_set_t pset, sched_bucket_t sched_bucket
  *         perform rebalancing as part of SCHED(processor_balance) i.e. sched_edge_balance()
  * (3) Steal a thread from another cluster based on edge
  *     weights (sched_edge_steal_thread())
+ *         - The most overloaded cluster is picked as the victim; steals
+ *         across cluster types need the load delta to cover the edge
+ *         weight, except from unavailable clusters which are always
+ *         drained (sched_edge_steal_load())
+ *         - If the victim is still overloaded after the steal, another idle
+ *         CPU in the cluster is signalled to come and steal as well
+ *         (sched_steal_signal_idle())
+ *
+ * Every thread pulled by (1) or (3) is accounted to the idle cluster along with
+ * the run queue latency it was expected to save, in usecs
+ * (sched_edge_steal_saved_latency_us(), sched_steal_record()); the totals are
+ * exported via the kern.sched_steal_stats sysctl.
  *
  * = SCHED(processor_balance) for Edge Scheduler =
  *
@@ -3803,10 +3825,84 @@ sched_edge_steal_thread_enabled(__unused processor_set_t pset)
 	return true;
 }
 
+/*
+ * sched_edge_steal_load()
+ *
+ * Routine to evaluate candidate_pset as a steal candidate for a processor going
+ * idle in idle_pset. Returns SCHED_EDGE_STEAL_NONE if nothing should be stolen
+ * from the candidate; otherwise returns how much more loaded the candidate is
+ * than idle_pset (in terms of sched_edge_cluster_load_metric()), which is used to
+ * pick the most overloaded candidate.
+ *
+ * Steals between homogeneous clusters are always allowed. A steal across cluster
+ * types moves the thread onto a core with different performance and a cold cache,
+ * so it is only worthwhile if the load delta covers the edge weight. If that is
+ * the only reason a runnable candidate was rejected, *cost_declined is set.
+ *
+ * Clusters which are not available for scheduling have no load metrics and
+ * nobody else to run their threads, so they are drained into any cluster and
+ * ahead of every other candidate.
+ */
+#define SCHED_EDGE_STEAL_NONE (-1)
+
+static int64_t
+sched_edge_steal_load(processor_set_t idle_pset, processor_set_t candidate_pset, bool *cost_declined)
+{
+	int highest_runnable_bucket = bitmap_lsb_first(candidate_pset->pset_clutch_root.scr_unbound_runnable_bitmap, TH_BUCKET_SCHED_MAX);
+	if (highest_runnable_bucket == -1) {
+		/* Candidate cluster runq is empty */
+		return SCHED_EDGE_STEAL_NONE;
+	}
+
+	if (sched_edge_pset_available(candidate_pset) == false) {
+		return UINT32_MAX;
+	}
+
+	bool homogeneous = (idle_pset->pset_cluster_type == candidate_pset->pset_cluster_type);
+
+	/* Use the load metrics for highest runnable bucket since that would be stolen next */
+	uint32_t candidate_load = sched_edge_cluster_load_metric(candidate_pset, (sched_bucket_t)highest_runnable_bucket);
+	uint32_t idle_load = sched_edge_cluster_load_metric(idle_pset, (sched_bucket_t)highest_runnable_bucket);
+	uint32_t steal_delta = (candidate_load > idle_load) ? (candidate_load - idle_load) : 0;
+
+	if (homogeneous) {
+		/* Always allow stealing from homogeneous clusters */
+		return steal_delta;
+	}
+	if (steal_delta == 0) {
+		return SCHED_EDGE_STEAL_NONE;
+	}
+	if (steal_delta < candidate_pset->sched_edges[idle_pset->pset_cluster_id].sce_migration_weight) {
+		*cost_declined = true;
+		return SCHED_EDGE_STEAL_NONE;
+	}
+	return steal_delta;
+}
+
+/*
+ * sched_edge_steal_saved_latency_us()
+ *
+ * The load metric of a cluster is the work queued in its run queue for a bucket,
+ * in usecs (the run queue depth times the average thread execution time). A thread
+ * stolen by an idle processor runs right away instead of waiting for that work to
+ * be spread over the CPUs of pset. Returns 0 when there is no estimate, i.e. for
+ * clusters which are not available for scheduling.
+ */
+static uint64_t
+sched_edge_steal_saved_latency_us(processor_set_t pset, sched_bucket_t sched_bucket)
+{
+	int cpu_count = pset_available_cpu_count(pset);
+	if (cpu_count <= 0) {
+		return 0;
+	}
+	return sched_edge_cluster_load_metric(pset, sched_bucket) / (uint32_t)cpu_count;
+}
+
 static processor_set_t
 sched_edge_steal_candidate(processor_set_t pset)
 {
 	uint32_t dst_cluster_id = pset->pset_cluster_id;
+	bool cost_declined = false;
 	for (int cluster_id = 0; cluster_id < sched_edge_max_clusters; cluster_id++) {
 		processor_set_t candidate_pset = pset_array[cluster_id];
 		if (cluster_id == dst_cluster_id) {
@@ -3816,7 +3912,7 @@ sched_edge_steal_candidate(processor_set_t pset)
 			continue;
 		}
 		sched_clutch_edge *incoming_edge = &pset_array[cluster_id]->sched_edges[dst_cluster_id];
-		if (incoming_edge->sce_steal_allowed && (bitmap_lsb_first(candidate_pset->pset_clutch_root.scr_unbound_runnable_bitmap, TH_BUCKET_SCHED_MAX) != -1)) {
+		if (incoming_edge->sce_steal_allowed && (sched_edge_steal_load(pset, candidate_pset, &cost_declined) != SCHED_EDGE_STEAL_NONE)) {
 			return candidate_pset;
 		}
 	}
@@ -3871,9 +3967,13 @@ sched_edge_foreign_runnable_thread_remove(processor_set_t pset, uint64_t ctime)
 		 * Looks like there are runnable foreign threads in the hierarchy; lock the pset
 		 * and get the highest priority thread.
 		 */
+		uint64_t saved_latency_us = 0;
 		pset_lock(target_pset);
 		if (sched_edge_pset_available(target_pset)) {
 			thread = sched_clutch_root_highest_foreign_thread_remove(&target_pset->pset_clutch_root);
+			if (thread != THREAD_NULL) {
+				saved_latency_us = sched_edge_steal_saved_latency_us(target_pset, thread->th_sched_bucket);
+			}
 			sched_update_pset_load_average(target_pset, ctime);
 		}
 		pset_unlock(target_pset);
@@ -3887,7 +3987,8 @@ sched_edge_foreign_runnable_thread_remove(processor_set_t pset, uint64_t ctime)
 		 * some form of global state across psets to make that kind of a check cheap.
 		 */
 		if (thread != THREAD_NULL) {
-			KDBG(MACHDBG_CODE(DBG_MACH_SCHED_CLUTCH, MACH_SCHED_EDGE_REBAL_RUNNABLE) | DBG_FUNC_NONE, thread_tid(thread), pset->pset_cluster_id, target_pset->pset_cluster_id, 0);
+			KDBG(MACHDBG_CODE(DBG_MACH_SCHED_CLUTCH, MACH_SCHED_EDGE_REBAL_RUNNABLE) | DBG_FUNC_NONE, thread_tid(thread), pset->pset_cluster_id, target_pset->pset_cluster_id, saved_latency_us);
+			sched_steal_record(pset, target_pset, saved_latency_us);
 			break;
 		}
 		/* Looks like the thread escaped after the check but before the pset lock was taken; continue the search */
@@ -3942,61 +4043,79 @@ sched_edge_foreign_running_thread_available(processor_set_t pset)
 	return false;
 }
 
-static bool
-sched_edge_steal_possible(processor_set_t idle_pset, processor_set_t candidate_pset)
-{
-	int highest_runnable_bucket = bitmap_lsb_first(candidate_pset->pset_clutch_root.scr_unbound_runnable_bitmap, TH_BUCKET_SCHED_MAX);
-	if (highest_runnable_bucket == -1) {
-		/* Candidate cluster runq is empty */
-		return false;
-	}
-
-	if (idle_pset->pset_cluster_type == candidate_pset->pset_cluster_type) {
-		/* Always allow stealing from homogeneous clusters */
-		return true;
-	} else {
-		/* Use the load metrics for highest runnable bucket since that would be stolen next */
-		int32_t candidate_load = sched_edge_cluster_load_metric(candidate_pset, (sched_bucket_t)highest_runnable_bucket);
-		return candidate_load > 0;
-	}
-}
-
 static thread_t
 sched_edge_steal_thread(processor_set_t pset, uint64_t candidate_pset_bitmap)
 {
 	thread_t thread = THREAD_NULL;
+	bool cost_declined = false;
 
 	/*
-	 * Edge Scheduler Optimization
-	 *
-	 * The logic today bails as soon as it finds a cluster where the cluster load is
-	 * greater than the edge weight. Maybe it should have a more advanced version
-	 * which looks for the maximum delta etc.
+	 * Steal from the most overloaded candidate cluster, i.e. the one where the next
+	 * runnable thread is expected to wait the longest. The loads are sampled without
+	 * the candidate pset locks, so the choice is re-validated once the lock is held;
+	 * if the candidate no longer qualifies, the search is repeated without it. Since
+	 * sched_edge_iterate_clusters_ordered() visits die local clusters first, ties are
+	 * broken in favor of the closest cluster.
 	 */
-	int cluster_id = -1;
-	while ((cluster_id = sched_edge_iterate_clusters_ordered(pset, candidate_pset_bitmap, cluster_id)) != -1) {
-		processor_set_t steal_from_pset = pset_array[cluster_id];
-		if (steal_from_pset == NULL) {
-			continue;
+	while (thread == THREAD_NULL) {
+		processor_set_t steal_from_pset = PROCESSOR_SET_NULL;
+		int64_t max_steal_load = SCHED_EDGE_STEAL_NONE;
+
+		int cluster_id = -1;
+		while ((cluster_id = sched_edge_iterate_clusters_ordered(pset, candidate_pset_bitmap, cluster_id)) != -1) {
+			processor_set_t candidate_pset = pset_array[cluster_id];
+			if (candidate_pset == NULL) {
+				continue;
+			}
+			sched_clutch_edge *incoming_edge = &candidate_pset->sched_edges[pset->pset_cluster_id];
+			if (incoming_edge->sce_steal_allowed == false) {
+				continue;
+			}
+			int64_t steal_load = sched_edge_steal_load(pset, candidate_pset, &cost_declined);
+			if (steal_load > max_steal_load) {
+				max_steal_load = steal_load;
+				steal_from_pset = candidate_pset;
+			}
 		}
-		sched_clutch_edge *incoming_edge = &pset_array[cluster_id]->sched_edges[pset->pset_cluster_id];
-		if (incoming_edge->sce_steal_allowed == false) {
-			continue;
+		if (steal_from_pset == PROCESSOR_SET_NULL) {
+			break;
 		}
+		bit_clear(candidate_pset_bitmap, steal_from_pset->pset_cluster_id);
+
+		bool steal_more = false;
+		uint64_t saved_latency_us = 0;
 		pset_lock(steal_from_pset);
-		if (sched_edge_steal_possible(pset, steal_from_pset)) {
+		int64_t steal_load = sched_edge_steal_load(pset, steal_from_pset, &cost_declined);
+		if (steal_load != SCHED_EDGE_STEAL_NONE) {
 			uint64_t current_timestamp = mach_absolute_time();
 			sched_clutch_root_bucket_t root_bucket = sched_clutch_root_highest_root_bucket(&steal_from_pset->pset_clutch_root, current_timestamp, SCHED_CLUTCH_HIGHEST_ROOT_BUCKET_UNBOUND_ONLY);
 			thread = sched_clutch_thread_unbound_lookup(&steal_from_pset->pset_clutch_root, root_bucket);
+			saved_latency_us = sched_edge_steal_saved_latency_us(steal_from_pset, thread->th_sched_bucket);
 			sched_clutch_thread_remove(&steal_from_pset->pset_clutch_root, thread, current_timestamp, SCHED_CLUTCH_BUCKET_OPTIONS_SAMEPRI_RR);
-			KDBG(MACHDBG_CODE(DBG_MACH_SCHED_CLUTCH, MACH_SCHED_EDGE_STEAL) | DBG_FUNC_NONE, thread_tid(thread), pset->pset_cluster_id, steal_from_pset->pset_cluster_id, 0);
+			KDBG(MACHDBG_CODE(DBG_MACH_SCHED_CLUTCH, MACH_SCHED_EDGE_STEAL) | DBG_FUNC_NONE, thread_tid(thread), pset->pset_cluster_id, steal_from_pset->pset_cluster_id, saved_latency_us);
 			sched_update_pset_load_average(steal_from_pset, current_timestamp);
+
+			/*
+			 * If the cluster still has more runnable threads than processors on their way to
+			 * pick them up, have another idle processor in this cluster come and steal too.
+			 */
+			bool next_cost_declined = false;
+			steal_more = (steal_from_pset->pset_clutch_root.scr_thr_count > bit_count(steal_from_pset->cpu_state_map[PROCESSOR_DISPATCHING])) &&
+			    (sched_edge_steal_load(pset, steal_from_pset, &next_cost_declined) != SCHED_EDGE_STEAL_NONE);
 		}
 		pset_unlock(steal_from_pset);
+
 		if (thread != THREAD_NULL) {
-			break;
+			sched_steal_record(pset, steal_from_pset, saved_latency_us);
+			if (steal_more) {
+				sched_steal_signal_idle(pset);
+			}
 		}
 	}
+
+	if ((thread == THREAD_NULL) && cost_declined) {
+		os_atomic_inc(&pset->pset_steal_declined_count, relaxed);
+	}
 	return thread;
 }
 
@@ -4014,6 +4133,7 @@ sched_edge_processor_idle(processor_set_t pset)
 
 	processor_t processor = current_processor();
 	bit_clear(pset->pending_spill_cpu_mask, processor->cpu_id);
+	bit_clear(pset->pending_steal_cpu_mask, processor->cpu_id);
 
 	/* Each of the operations acquire the lock for the pset they target */
 	pset_unlock(pset);
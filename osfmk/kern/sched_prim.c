@@ -137,6 +137,9 @@
 struct sched_statistics PERCPU_DATA(sched_stats);
 bool sched_stats_active;
 
+/* Scheduling latency histograms are kept per bucket by recount */
+static_assert(TH_BUCKET_SCHED_MAX <= RCT_SCHED_BUCKET_COUNT);
+
 static uint64_t
 deadline_add(uint64_t d, uint64_t e)
 {
@@ -3717,6 +3720,11 @@ thread_dispatch(
 		latency = processor->last_dispatch - self->last_made_runnable_time;
 		assert(latency >= self->same_pri_latency);
 
+		if (self->th_sched_bucket < TH_BUCKET_SCHED_MAX) {
+			recount_processor_sched_latency(&processor->pr_recount,
+			    self->th_sched_bucket, latency);
+		}
+
 		urgency = thread_get_urgency(self, &arg1, &arg2);
 
 		thread_tell_urgency(urgency, arg1, arg2, latency, self);
@@ -4793,9 +4801,10 @@ sched_ipi_policy(processor_t dst, thread_t thread, boolean_t dst_idle, sched_ipi
 	case SCHED_IPI_EVENT_REBALANCE:
 	case SCHED_IPI_EVENT_BOUND_THR:
 	case SCHED_IPI_EVENT_RT_PREEMPT:
+	case SCHED_IPI_EVENT_STEAL:
 		/*
-		 * The RT preempt, spill, SMT rebalance, rebalance and the bound thread
-		 * scenarios use immediate IPIs always.
+		 * The RT preempt, spill, steal, SMT rebalance, rebalance and the bound
+		 * thread scenarios use immediate IPIs always.
 		 */
 		ipi_type = dst_idle ? SCHED_IPI_IDLE : SCHED_IPI_IMMEDIATE;
 		break;
@@ -8263,6 +8272,98 @@ sched_update_pset_avg_execution_time(__unused processor_set_t pset, __unused uin
 
 #endif /* CONFIG_SCHED_EDGE */
 
+#if __AMP__
+
+/*
+ * sched_steal_record()
+ *
+ * Account for a thread stolen from src_pset's runqueue by an idle
+ * processor in dst_pset. saved_latency_us is the policy's estimate of the
+ * time the thread would have waited on src_pset had it not been stolen.
+ * The counters are only ever read for reporting, so they are updated
+ * without the pset lock.
+ */
+void
+sched_steal_record(processor_set_t dst_pset, processor_set_t src_pset, uint64_t saved_latency_us)
+{
+	os_atomic_inc(&dst_pset->pset_steal_count, relaxed);
+	if (dst_pset->pset_type != src_pset->pset_type) {
+		os_atomic_inc(&dst_pset->pset_steal_cross_type_count, relaxed);
+	}
+	os_atomic_add(&dst_pset->pset_steal_saved_latency_us, saved_latency_us, relaxed);
+}
+
+/*
+ * sched_steal_signal_idle()
+ *
+ * Called by a processor which just stole a thread from a pset which still
+ * has more runnable threads than processors about to pick them up. Idle
+ * processors only look for work to steal when they come out of idle, so
+ * without this the other idle processors in pset stay idle until an
+ * enqueue happens to pick them. Signal one of them so that it runs
+ * SCHED(steal_thread) as well; it re-evaluates the steal on its own and
+ * signals the next one only if the steal was still worthwhile.
+ *
+ * The signal is kept apart from spills (pending_steal_cpu_mask and
+ * SCHED_IPI_EVENT_STEAL): a spill target steals with the lower spill
+ * threshold, while a chained steal must meet the idle steal threshold.
+ *
+ * Called with pset unlocked.
+ */
+void
+sched_steal_signal_idle(processor_set_t pset)
+{
+	processor_t processor = PROCESSOR_NULL;
+	sched_ipi_type_t ipi_type = SCHED_IPI_NONE;
+
+	pset_lock(pset);
+	cpumap_t idle_map = pset->recommended_bitmask & pset->primary_map & pset->cpu_state_map[PROCESSOR_IDLE] &
+	    ~(pset->pending_spill_cpu_mask | pset->pending_steal_cpu_mask);
+	bit_clear(idle_map, current_processor()->cpu_id);
+	int cpuid = lsb_first(idle_map);
+	if (cpuid >= 0) {
+		processor = processor_array[cpuid];
+		bit_set(pset->pending_steal_cpu_mask, cpuid);
+		processor->deadline = UINT64_MAX;
+		ipi_type = sched_ipi_action(processor, THREAD_NULL, SCHED_IPI_EVENT_STEAL);
+	}
+	pset_unlock(pset);
+
+	if (processor != PROCESSOR_NULL) {
+		sched_ipi_perform(processor, ipi_type);
+	}
+}
+
+/*
+ * sched_steal_stats_get()
+ *
+ * Copy out the idle steal statistics of up to count psets, in pset id
+ * order. Returns the number of entries filled in.
+ */
+uint32_t
+sched_steal_stats_get(struct sched_steal_stats *stats, uint32_t count)
+{
+	uint32_t filled = 0;
+
+	for (int pset_id = 0; (pset_id < MAX_PSETS) && (filled < count); pset_id++) {
+		processor_set_t pset = os_atomic_load(&pset_array[pset_id], acquire);
+		if (pset == PROCESSOR_SET_NULL) {
+			continue;
+		}
+		stats[filled++] = (struct sched_steal_stats){
+			.sss_cluster_id = pset->pset_cluster_id,
+			.sss_cluster_type = pset->pset_type,
+			.sss_steal_count = os_atomic_load(&pset->pset_steal_count, relaxed),
+			.sss_cross_type_steal_count = os_atomic_load(&pset->pset_steal_cross_type_count, relaxed),
+			.sss_declined_count = os_atomic_load(&pset->pset_steal_declined_count, relaxed),
+			.sss_saved_latency_us = os_atomic_load(&pset->pset_steal_saved_latency_us, relaxed),
+		};
+	}
+	return filled;
+}
+
+#endif /* __AMP__ */
+
 /* pset is locked */
 static bool
 processor_is_fast_track_candidate_for_realtime_thread(processor_set_t pset, processor_t processor)
@@ -365,6 +365,7 @@ typedef enum {
 	SCHED_IPI_EVENT_SPILL       = 0x4,
 	SCHED_IPI_EVENT_REBALANCE   = 0x5,
 	SCHED_IPI_EVENT_RT_PREEMPT  = 0x6,
+	SCHED_IPI_EVENT_STEAL       = 0x7,
 } sched_ipi_event_t;
 
 
@@ -395,6 +396,12 @@ extern sched_ipi_type_t sched_ipi_policy(processor_t dst, thread_t thread,
 extern sched_ipi_type_t sched_ipi_deferred_policy(processor_set_t pset,
     processor_t dst, thread_t thread, sched_ipi_event_t event);
 
+#if __AMP__
+/* Idle steal accounting and chaining, shared by the AMP and Edge schedulers */
+extern void             sched_steal_record(processor_set_t dst_pset, processor_set_t src_pset, uint64_t saved_latency_us);
+extern void             sched_steal_signal_idle(processor_set_t pset);
+#endif /* __AMP__ */
+
 #if defined(CONFIG_SCHED_TIMESHARE_CORE)
 
 extern boolean_t        thread_update_add_thread(thread_t thread);
@@ -559,6 +566,24 @@ __options_decl(thread_bind_option_t, uint64_t, {
 });
 extern kern_return_t thread_bind_cluster_id(thread_t thread, uint32_t cluster_id, thread_bind_option_t options);
 
+#if __AMP__
+/*
+ * Idle steal statistics for one pset, as exported by the
+ * kern.sched_steal_stats sysctl. The counters are cumulative since boot
+ * and describe threads stolen by the processors of the pset.
+ */
+struct sched_steal_stats {
+	uint32_t        sss_cluster_id;
+	uint32_t        sss_cluster_type;               /* cluster_type_t */
+	uint64_t        sss_steal_count;                /* threads stolen from other psets */
+	uint64_t        sss_cross_type_steal_count;     /* ... of which from a pset of another cluster type */
+	uint64_t        sss_declined_count;             /* cross type steals declined as not worth the migration cost */
+	uint64_t        sss_saved_latency_us;           /* estimated run queue latency saved by steals */
+};
+
+extern uint32_t sched_steal_stats_get(struct sched_steal_stats *stats, uint32_t count);
+#endif /* __AMP__ */
+
 extern int sched_get_rt_n_backup_processors(void);
 extern void sched_set_rt_n_backup_processors(int n);
 
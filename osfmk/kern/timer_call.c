@@ -31,6 +31,7 @@
 
 #include <mach/mach_types.h>
 
+#include <kern/bits.h>
 #include <kern/clock.h>
 #include <kern/counter.h>
 #include <kern/smp.h>
@@ -144,8 +145,53 @@ typedef struct {
 	uint64_t        latency_max;    /*   maximum threshold latency */
 } threshold_t;
 
+/*
+ * Longterm timers are kept on a hierarchical hashed timer wheel, so that
+ * entering and cancelling one is O(1) and a scan only visits the timers
+ * that may have become due since the last one, rather than the entire list.
+ *
+ * Each level has TIMER_WHEEL_SLOTS slots and each slot of a level spans
+ * TIMER_WHEEL_SLOTS slots of the level below; level 0 slots span
+ * 2^shift absolute time units, which is chosen at boot to be about
+ * TIMER_WHEEL_GRANULARITY. A timer is filed by soft deadline on the finest
+ * level that can represent it relative to the wheel clock, and the farthest
+ * slot of the last level catches everything beyond that. A scan detaches
+ * every slot covering times up to the longterm threshold; timers that are
+ * not yet due are filed again, relative to the new clock, on a finer level.
+ * So a timer is looked at no more than about once per level on its way to
+ * the short-term queues and the coalescing and leeway applied when it was
+ * entered are untouched.
+ *
+ * Slots are not tracked per timer, so a cancelled timer may leave its slot's
+ * occupied bit set; stale bits are cleared when the next deadline is looked
+ * up. The wheel is protected by the longterm queue lock.
+ *
+ * The wheel clock is where the last scan left off: no timer with a soft
+ * deadline before it may be filed, since no scan would look at it until the
+ * clock came round again. Such timers (seen after the threshold is lowered)
+ * go straight to the short-term queues instead.
+ *
+ * On DEVELOPMENT and DEBUG kernels, kern.timer.longterm.wheel=0 keeps the
+ * longterm timers on the unordered list that the wheel replaced, so that
+ * the two can be compared.
+ */
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_LEVEL_BITS  6
+#define TIMER_WHEEL_SLOTS       (1u << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_GRANULARITY (64ULL * NSEC_PER_MSEC)
+
 typedef struct {
-	mpqueue_head_t  queue;          /* longterm timer list */
+	uint64_t        clock;          /* slots before this time are empty */
+	uint32_t        shift;          /* log2 of the level 0 slot span */
+	uint64_t        occupied[TIMER_WHEEL_LEVELS];
+	queue_head_t    slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t        cascades;       /* num timers filed again by a scan */
+} timer_wheel_t;
+
+typedef struct {
+	mpqueue_head_t  queue;          /* longterm timer count and lock */
+	timer_wheel_t   wheel;          /* longterm timers */
+	boolean_t       use_wheel;      /* else longterm timers are on queue */
 	uint64_t        enqueues;       /* num timers queued */
 	uint64_t        dequeues;       /* num timers dequeued */
 	uint64_t        escalates;      /* num timers becoming shortterm */
@@ -159,6 +205,7 @@ typedef struct {
 timer_longterm_t                timer_longterm = {
 	.scan_limit = TIMER_LONGTERM_SCAN_LIMIT,
 	.scan_interval = TIMER_LONGTERM_SCAN_INTERVAL,
+	.use_wheel = TRUE,
 };
 
 static mpqueue_head_t           *timer_longterm_queue = NULL;
@@ -218,6 +265,135 @@ int32_t nc_tcl, rt_tcl, bg_tcl, kt_tcl, fp_tcl, ts_tcl, qos_tcl;
 #define TCOAL_PRIO_STAT(x)
 #endif
 
+static void
+timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+	uint64_t granularity;
+
+	nanoseconds_to_absolutetime(TIMER_WHEEL_GRANULARITY, &granularity);
+	wheel->shift = (uint32_t)bit_floor(granularity);
+	wheel->clock = now;
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		wheel->occupied[level] = 0;
+		for (uint32_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			queue_init(&wheel->slots[level][slot]);
+		}
+	}
+}
+
+static inline uint32_t
+timer_wheel_level_shift(timer_wheel_t *wheel, int level)
+{
+	return wheel->shift + level * TIMER_WHEEL_LEVEL_BITS;
+}
+
+/*
+ * File a timer on the wheel by its soft deadline.
+ * Overdue timers go in the current level 0 slot and are seen by the next scan.
+ */
+static void
+timer_wheel_insert(timer_wheel_t *wheel, timer_call_t call)
+{
+	uint64_t        deadline = MAX(call->tc_soft_deadline, wheel->clock);
+	uint64_t        unit = 0;
+	int             level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t shift = timer_wheel_level_shift(wheel, level);
+
+		unit = deadline >> shift;
+		if (unit - (wheel->clock >> shift) < TIMER_WHEEL_SLOTS) {
+			break;
+		}
+	}
+	if (level == TIMER_WHEEL_LEVELS) {
+		level = TIMER_WHEEL_LEVELS - 1;
+		unit = (wheel->clock >> timer_wheel_level_shift(wheel, level)) +
+		    TIMER_WHEEL_SLOTS - 1;
+	}
+
+	uint32_t slot = (uint32_t)(unit & (TIMER_WHEEL_SLOTS - 1));
+	enqueue_tail(&wheel->slots[level][slot], &call->tc_qlink);
+	bit_set(wheel->occupied[level], slot);
+}
+
+/*
+ * Move every timer in a slot covering times up to horizon onto the due list
+ * and advance the wheel clock to horizon. The caller either escalates each
+ * timer or files it again with timer_wheel_insert().
+ */
+static void
+timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, uint64_t horizon,
+    queue_t due)
+{
+	if (horizon < wheel->clock) {
+		/* The threshold was lowered: nothing new can be due */
+		return;
+	}
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t shift = timer_wheel_level_shift(wheel, level);
+		uint64_t first = wheel->clock >> shift;
+		uint64_t span;
+
+		span = (horizon >> shift) - first;
+		span = (span >= TIMER_WHEEL_SLOTS) ? TIMER_WHEEL_SLOTS : span + 1;
+
+		for (uint64_t i = 0; i < span; i++) {
+			uint32_t slot = (uint32_t)((first + i) & (TIMER_WHEEL_SLOTS - 1));
+			queue_t head = &wheel->slots[level][slot];
+
+			if (!bit_test(wheel->occupied[level], slot)) {
+				continue;
+			}
+			bit_clear(wheel->occupied[level], slot);
+			while (!queue_empty(head)) {
+				enqueue_tail(due, dequeue_head(head));
+			}
+		}
+	}
+
+	if (horizon == TIMER_LONGTERM_NONE) {
+		/* Everything was detached: restart the wheel from now */
+		wheel->clock = now;
+	} else {
+		wheel->clock = horizon;
+	}
+}
+
+/*
+ * Return the earliest time any timer on the wheel can be due, or
+ * TIMER_LONGTERM_NONE if the wheel is empty.
+ */
+static uint64_t
+timer_wheel_next_deadline(timer_wheel_t *wheel)
+{
+	uint64_t        next = TIMER_LONGTERM_NONE;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t shift = timer_wheel_level_shift(wheel, level);
+		uint64_t first = wheel->clock >> shift;
+		uint32_t offset = (uint32_t)(first & (TIMER_WHEEL_SLOTS - 1));
+		uint64_t map = bit_ror64(wheel->occupied[level], offset);
+		int i;
+
+		while ((i = lsb_first(map)) >= 0) {
+			uint32_t slot = (offset + (uint32_t)i) & (TIMER_WHEEL_SLOTS - 1);
+
+			bit_clear(map, i);
+			if (queue_empty(&wheel->slots[level][slot])) {
+				/* Only cancellations since this slot was filled */
+				bit_clear(wheel->occupied[level], slot);
+				continue;
+			}
+			next = MIN(next, MAX((first + (uint64_t)i) << shift, wheel->clock));
+			break;
+		}
+	}
+
+	return next;
+}
+
 static void
 timer_call_init_abstime(void)
 {
@@ -445,12 +621,16 @@ timer_call_entry_enqueue_tail(
 	assert(entry->tc_queue == NULL);
 
 	/*
-	 * this is only used for timer_longterm_queue, which is unordered
-	 * and thus needs no priority queueing
+	 * this is only used for timer_longterm_queue, whose timers are kept
+	 * on the longterm timer wheel (or list) rather than in deadline order
 	 */
 	assert(queue == timer_longterm_queue);
 
-	enqueue_tail(&queue->head, &entry->tc_qlink);
+	if (timer_longterm.use_wheel) {
+		timer_wheel_insert(&timer_longterm.wheel, entry);
+	} else {
+		enqueue_tail(&queue->head, &entry->tc_qlink);
+	}
 
 	entry->tc_queue = &queue->head;
 
@@ -662,7 +842,7 @@ timer_call_enter_internal(
 	boolean_t               ratelimited)
 {
 	mpqueue_head_t          *queue = NULL;
-	mpqueue_head_t          *old_queue;
+	mpqueue_head_t          *old_queue = NULL;
 	spl_t                   s;
 	uint64_t                slop;
 	uint32_t                urgency;
@@ -722,8 +902,14 @@ timer_call_enter_internal(
 	}
 
 	if (queue == NULL) {
+		mpqueue_head_t *prev_queue;
+
 		queue = timer_queue_assign(deadline);
-		old_queue = timer_call_enqueue_deadline_unlocked(call, queue, deadline, sdeadline, ttd, param1, flags);
+		prev_queue = timer_call_enqueue_deadline_unlocked(call, queue, deadline, sdeadline, ttd, param1, flags);
+		/* the longterm path may have dequeued the call already */
+		if (old_queue == NULL) {
+			old_queue = prev_queue;
+		}
 	}
 
 #if TIMER_TRACE
@@ -1252,6 +1438,17 @@ timer_queue_trace(
 	splx(s);
 }
 
+/*
+ * Whether a timer due at soft_deadline has to go short-term because the
+ * longterm wheel has already been scanned up to (or past) its deadline.
+ */
+static inline boolean_t
+timer_longterm_escalate_on_entry(timer_longterm_t *tlp, uint64_t soft_deadline)
+{
+	return tlp->use_wheel && timer_longterm_queue->count != 0 &&
+	       soft_deadline <= os_atomic_load(&tlp->wheel.clock, relaxed);
+}
+
 void
 timer_longterm_dequeued_locked(timer_call_t call)
 {
@@ -1287,11 +1484,14 @@ timer_longterm_enqueue_unlocked(timer_call_t    call,
 	 * Return NULL without doing anything if:
 	 *  - this timer is local, or
 	 *  - the longterm mechanism is disabled, or
-	 *  - this deadline is too short.
+	 *  - this deadline is too short, or
+	 *  - the wheel was already scanned past it (the threshold was lowered).
+	 * The wheel clock is re-checked once the longterm queue is locked.
 	 */
 	if ((callout_flags & TIMER_CALL_LOCAL) != 0 ||
 	    (tlp->threshold.interval == TIMER_LONGTERM_NONE) ||
-	    (deadline <= longterm_threshold)) {
+	    (deadline <= longterm_threshold) ||
+	    timer_longterm_escalate_on_entry(tlp, soft_deadline)) {
 		return NULL;
 	}
 
@@ -1307,6 +1507,15 @@ timer_longterm_enqueue_unlocked(timer_call_t    call,
 	assert(!ml_get_interrupts_enabled());
 	simple_lock(&call->tc_lock, LCK_GRP_NULL);
 	timer_queue_lock_spin(timer_longterm_queue);
+	if (timer_longterm_queue->count == 0) {
+		/* Don't file relative to a wheel clock left behind long ago */
+		tlp->wheel.clock = now;
+	} else if (timer_longterm_escalate_on_entry(tlp, soft_deadline)) {
+		/* A scan went past it meanwhile: the caller files it short-term */
+		timer_queue_unlock(timer_longterm_queue);
+		simple_unlock(&call->tc_lock);
+		return NULL;
+	}
 	call->tc_pqlink.deadline = deadline;
 	call->tc_param1 = param1;
 	call->tc_ttd = ttd;
@@ -1349,14 +1558,17 @@ timer_longterm_enqueue_unlocked(timer_call_t    call,
  * calling thread is running).
  * Both the local (boot) queue and the longterm queue are locked.
  * The scan is similar to the timer migrate sequence but is performed by
- * successively examining each timer on the longterm queue:
+ * successively examining each timer in the longterm wheel slots that cover
+ * times up to the threshold:
  *  - if within the short-term threshold
  *    - enter on the local queue (unless being deleted),
  *  - otherwise:
- *    - if sooner, deadline becomes the next threshold deadline.
+ *    - file it again on a finer level of the wheel.
+ * The next threshold deadline is then the earliest occupied wheel slot.
  * The total scan time is limited to TIMER_LONGTERM_SCAN_LIMIT. Should this be
- * exceeded, we abort and reschedule again so that we don't shut others from
- * the timer queues. Longterm timers firing late is not critical.
+ * exceeded, we stop escalating, file the remaining timers back on the wheel
+ * and reschedule again so that we don't shut others from the timer queues.
+ * Longterm timers firing late is not critical.
  */
 void
 timer_longterm_scan(timer_longterm_t    *tlp,
@@ -1367,6 +1579,9 @@ timer_longterm_scan(timer_longterm_t    *tlp,
 	uint64_t        deadline;
 	uint64_t        time_limit = time_start + tlp->scan_limit;
 	mpqueue_head_t  *timer_master_queue;
+	queue_head_t    due;
+	queue_t         scan_queue;
+	boolean_t       paused = FALSE;
 
 	assert(!ml_get_interrupts_enabled());
 	assert(cpu_number() == master_cpu);
@@ -1378,14 +1593,22 @@ timer_longterm_scan(timer_longterm_t    *tlp,
 	tlp->threshold.deadline = TIMER_LONGTERM_NONE;
 	tlp->threshold.call = NULL;
 
-	if (queue_empty(&timer_longterm_queue->head)) {
+	if (timer_longterm_queue->count == 0) {
 		return;
 	}
 
+	if (tlp->use_wheel) {
+		queue_init(&due);
+		timer_wheel_advance(&tlp->wheel, time_start, threshold, &due);
+		scan_queue = &due;
+	} else {
+		scan_queue = &timer_longterm_queue->head;
+	}
+
 	timer_master_queue = timer_queue_cpu(master_cpu);
 	timer_queue_lock_spin(timer_master_queue);
 
-	qe_foreach_element_safe(call, &timer_longterm_queue->head, tc_qlink) {
+	qe_foreach_element_safe(call, scan_queue, tc_qlink) {
 		deadline = call->tc_soft_deadline;
 		if (!simple_lock_try(&call->tc_lock, LCK_GRP_NULL)) {
 			/* case (2c) lock order inversion, dequeue only */
@@ -1400,7 +1623,7 @@ timer_longterm_scan(timer_longterm_t    *tlp,
 			timer_call_entry_dequeue_async(call);
 			continue;
 		}
-		if (deadline < threshold) {
+		if (deadline < threshold && !paused) {
 			/*
 			 * This timer needs moving (escalating)
 			 * to the local (boot) processor's queue.
@@ -1432,24 +1655,36 @@ timer_longterm_scan(timer_longterm_t    *tlp,
 			 * the actual hardware deadline if required.
 			 */
 			(void) timer_queue_assign(deadline);
-		} else {
-			if (deadline < tlp->threshold.deadline) {
-				tlp->threshold.deadline = deadline;
-				tlp->threshold.call = call;
-			}
+		} else if (tlp->use_wheel) {
+			/* Not due yet (or out of time): back on the wheel */
+			remqueue(&call->tc_qlink);
+			timer_wheel_insert(&tlp->wheel, call);
+			tlp->wheel.cascades++;
+		} else if (deadline < tlp->threshold.deadline) {
+			tlp->threshold.deadline = deadline;
+			tlp->threshold.call = call;
 		}
 		simple_unlock(&call->tc_lock);
 
-		/* Abort scan if we're taking too long. */
-		if (mach_absolute_time() > time_limit) {
-			tlp->threshold.deadline = TIMER_LONGTERM_SCAN_AGAIN;
+		/* Stop escalating if we're taking too long. */
+		if (!paused && mach_absolute_time() > time_limit) {
+			paused = TRUE;
 			tlp->scan_pauses++;
 			DBG("timer_longterm_scan() paused %llu, qlen: %llu\n",
 			    time_limit, tlp->queue.count);
-			break;
+			if (!tlp->use_wheel) {
+				/* the rest stays on the list */
+				break;
+			}
 		}
 	}
 
+	if (paused) {
+		tlp->threshold.deadline = TIMER_LONGTERM_SCAN_AGAIN;
+	} else if (tlp->use_wheel) {
+		tlp->threshold.deadline = timer_wheel_next_deadline(&tlp->wheel);
+	}
+
 	timer_queue_unlock(timer_master_queue);
 }
 
@@ -1589,6 +1824,7 @@ timer_longterm_init(void)
 	tlp->threshold.deadline = TIMER_LONGTERM_NONE;
 
 	mpqueue_init(&tlp->queue, &timer_longterm_lck_grp, LCK_ATTR_NULL);
+	timer_wheel_init(&tlp->wheel, mach_absolute_time());
 
 	timer_call_setup(&tlp->threshold.timer,
 	    timer_longterm_callout, (timer_call_param_t) tlp);
@@ -1602,6 +1838,7 @@ enum {
 	LATENCY, LATENCY_MIN, LATENCY_MAX, LONG_TERM_SCAN_LIMIT,
 	LONG_TERM_SCAN_INTERVAL, LONG_TERM_SCAN_PAUSES,
 	SCAN_LIMIT, SCAN_INTERVAL, SCAN_PAUSES, SCAN_POSTPONES,
+	LONG_TERM_CASCADES, LONG_TERM_WHEEL,
 };
 uint64_t
 timer_sysctl_get(int oid)
@@ -1644,6 +1881,10 @@ timer_sysctl_get(int oid)
 		return counter_load(&timer_scan_pauses_cnt);
 	case SCAN_POSTPONES:
 		return counter_load(&timer_scan_postpones_cnt);
+	case LONG_TERM_CASCADES:
+		return tlp->wheel.cascades;
+	case LONG_TERM_WHEEL:
+		return tlp->use_wheel;
 
 	default:
 		return 0;
@@ -1669,6 +1910,10 @@ timer_master_scan(timer_longterm_t      *tlp,
 		threshold = TIMER_LONGTERM_NONE;
 	}
 
+	if (tlp->use_wheel && timer_longterm_queue->count == 0) {
+		tlp->wheel.clock = now;
+	}
+
 	timer_master_queue = timer_queue_cpu(master_cpu);
 	timer_queue_lock_spin(timer_master_queue);
 
@@ -1682,20 +1927,43 @@ timer_master_scan(timer_longterm_t      *tlp,
 			timer_call_entry_dequeue_async(call);
 			continue;
 		}
-		if (deadline > threshold) {
+		if (deadline > threshold &&
+		    !timer_longterm_escalate_on_entry(tlp, call->tc_soft_deadline)) {
 			/* move from master to longterm */
 			timer_call_entry_dequeue(call);
 			timer_call_entry_enqueue_tail(call, timer_longterm_queue);
-			if (deadline < tlp->threshold.deadline) {
+			if (!tlp->use_wheel && deadline < tlp->threshold.deadline) {
 				tlp->threshold.deadline = deadline;
 				tlp->threshold.call = call;
 			}
 		}
 		simple_unlock(&call->tc_lock);
 	}
+	if (tlp->use_wheel) {
+		tlp->threshold.deadline = MIN(tlp->threshold.deadline,
+		    timer_wheel_next_deadline(&tlp->wheel));
+	}
 	timer_queue_unlock(timer_master_queue);
 }
 
+/*
+ * Set the threshold timer for the threshold deadline just computed.
+ * Called on the master cpu with the longterm queue locked.
+ */
+static void
+timer_longterm_threshold_rearm(timer_longterm_t *tlp)
+{
+	tlp->threshold.deadline_set = tlp->threshold.deadline;
+	if (tlp->threshold.deadline != TIMER_LONGTERM_NONE) {
+		tlp->threshold.deadline_set -= tlp->threshold.margin;
+		tlp->threshold.deadline_set -= tlp->threshold.latency;
+		timer_call_enter(
+			&tlp->threshold.timer,
+			tlp->threshold.deadline_set,
+			TIMER_CALL_LOCAL | TIMER_CALL_SYS_CRITICAL);
+	}
+}
+
 static void
 timer_sysctl_set_threshold(void* valp)
 {
@@ -1741,22 +2009,14 @@ timer_sysctl_set_threshold(void* valp)
 		timer_master_scan(tlp, mach_absolute_time());
 	}
 
-	/* Set new timer accordingly */
-	tlp->threshold.deadline_set = tlp->threshold.deadline;
-	if (tlp->threshold.deadline != TIMER_LONGTERM_NONE) {
-		tlp->threshold.deadline_set -= tlp->threshold.margin;
-		tlp->threshold.deadline_set -= tlp->threshold.latency;
-		timer_call_enter(
-			&tlp->threshold.timer,
-			tlp->threshold.deadline_set,
-			TIMER_CALL_LOCAL | TIMER_CALL_SYS_CRITICAL);
-	}
+	timer_longterm_threshold_rearm(tlp);
 
 	/* Reset stats */
 	tlp->enqueues = 0;
 	tlp->dequeues = 0;
 	tlp->escalates = 0;
 	tlp->scan_pauses = 0;
+	tlp->wheel.cascades = 0;
 	tlp->threshold.scans = 0;
 	tlp->threshold.preempts = 0;
 	tlp->threshold.latency = 0;
@@ -1767,6 +2027,48 @@ timer_sysctl_set_threshold(void* valp)
 	splx(s);
 }
 
+#if DEVELOPMENT || DEBUG
+/*
+ * Move the longterm timers between the wheel and the list it replaced.
+ */
+static void
+timer_sysctl_set_wheel(void* valp)
+{
+	boolean_t               use_wheel = (valp != NULL);
+	timer_longterm_t        *tlp = &timer_longterm;
+	spl_t                   s = splclock();
+	uint64_t                now = mach_absolute_time();
+	timer_call_t            call;
+
+	timer_queue_lock_spin(timer_longterm_queue);
+
+	if (tlp->use_wheel == use_wheel) {
+		goto out;
+	}
+
+	timer_call_cancel(&tlp->threshold.timer);
+	if (use_wheel) {
+		tlp->wheel.clock = now;
+		qe_foreach_element_safe(call, &timer_longterm_queue->head, tc_qlink) {
+			remqueue(&call->tc_qlink);
+			timer_wheel_insert(&tlp->wheel, call);
+		}
+	} else {
+		/* detaches every slot */
+		timer_wheel_advance(&tlp->wheel, now, TIMER_LONGTERM_NONE,
+		    &timer_longterm_queue->head);
+	}
+	tlp->use_wheel = use_wheel;
+
+	timer_longterm_scan(tlp, now);
+	timer_longterm_threshold_rearm(tlp);
+
+out:
+	timer_queue_unlock(timer_longterm_queue);
+	splx(s);
+}
+#endif /* DEVELOPMENT || DEBUG */
+
 int
 timer_sysctl_set(int oid, uint64_t value)
 {
@@ -1777,6 +2079,14 @@ timer_sysctl_set(int oid, uint64_t value)
 			timer_sysctl_set_threshold,
 			(void *) value);
 		return KERN_SUCCESS;
+#if DEVELOPMENT || DEBUG
+	case LONG_TERM_WHEEL:
+		timer_call_cpu(
+			master_cpu,
+			timer_sysctl_set_wheel,
+			(void *)(uintptr_t)(value != 0));
+		return KERN_SUCCESS;
+#endif /* DEVELOPMENT || DEBUG */
 	case LONG_TERM_SCAN_LIMIT:
 		timer_longterm.scan_limit = value;
 		return KERN_SUCCESS;
@@ -2176,3 +2486,227 @@ running_timers_deactivate(processor_t processor)
 	processor->running_timers_active = false;
 	running_timers_sync();
 }
+
+#if DEVELOPMENT || DEBUG
+#include <kern/sched_prim.h>
+#include <sys/errno.h>
+
+#define TIMER_LONGTERM_TEST_COUNT 32
+
+/* Static, so that a timer firing after the test gives up is harmless */
+static timer_call_data_t timer_longterm_test_calls[TIMER_LONGTERM_TEST_COUNT];
+static uint64_t timer_longterm_test_fired_at[TIMER_LONGTERM_TEST_COUNT];
+static _Atomic uint32_t timer_longterm_test_fired;
+static _Atomic bool timer_longterm_test_running;
+
+static void
+timer_longterm_test_callout(__unused timer_call_param_t p0, timer_call_param_t p1)
+{
+	timer_longterm_test_fired_at[(uintptr_t)p1] = mach_absolute_time();
+	os_atomic_inc(&timer_longterm_test_fired, relaxed);
+	thread_wakeup(&timer_longterm_test_fired);
+}
+
+/*
+ * Arm timers on both sides of the longterm threshold and check that each
+ * fires, and that none fires before its deadline.
+ */
+static int
+timer_longterm_test(__unused int64_t in, int64_t *out)
+{
+	uint64_t        interval = timer_longterm.threshold.interval;
+	uint64_t        deadlines[TIMER_LONGTERM_TEST_COUNT];
+	uint64_t        now, give_up, spacing;
+	int             error = 0;
+
+	if (os_atomic_xchg(&timer_longterm_test_running, true, relaxed)) {
+		return EALREADY;
+	}
+
+	if (interval == TIMER_LONGTERM_NONE) {
+		nanoseconds_to_absolutetime(NSEC_PER_SEC, &interval);
+	}
+	os_atomic_store(&timer_longterm_test_fired, 0, relaxed);
+
+	now = mach_absolute_time();
+	spacing = interval / TIMER_LONGTERM_TEST_COUNT;
+	for (uint32_t i = 0; i < TIMER_LONGTERM_TEST_COUNT; i++) {
+		timer_call_t call = &timer_longterm_test_calls[i];
+
+		/* Half of the timers start out short-term, half longterm */
+		deadlines[i] = now + interval / 2 + (i + 1) * spacing;
+		timer_longterm_test_fired_at[i] = 0;
+		timer_call_setup(call, timer_longterm_test_callout, NULL);
+		timer_call_enter1(call, (timer_call_param_t)(uintptr_t)i,
+		    deadlines[i], TIMER_CALL_SYS_CRITICAL);
+	}
+
+	give_up = now + 3 * interval;
+	while (os_atomic_load(&timer_longterm_test_fired, relaxed) <
+	    TIMER_LONGTERM_TEST_COUNT && mach_absolute_time() < give_up) {
+		assert_wait_timeout(&timer_longterm_test_fired, THREAD_UNINT, 10,
+		    NSEC_PER_MSEC);
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+
+	for (uint32_t i = 0; i < TIMER_LONGTERM_TEST_COUNT; i++) {
+		if (timer_call_cancel(&timer_longterm_test_calls[i])) {
+			printf("timer_longterm_test: timer %u never fired\n", i);
+			error = ETIMEDOUT;
+		} else if (timer_longterm_test_fired_at[i] < deadlines[i]) {
+			printf("timer_longterm_test: timer %u fired %llu early\n",
+			    i, deadlines[i] - timer_longterm_test_fired_at[i]);
+			error = EINVAL;
+		}
+	}
+
+	os_atomic_store(&timer_longterm_test_running, false, relaxed);
+	*out = (error == 0);
+	return error;
+}
+SYSCTL_TEST_REGISTER(timer_longterm, timer_longterm_test);
+
+static void
+timer_call_bench_callout(__unused timer_call_param_t p0,
+    __unused timer_call_param_t p1)
+{
+	panic("timer_call_bench: timer fired");
+}
+
+/*
+ * Arm count timers with deadlines spread from past the longterm threshold
+ * to an hour out, and return how long that took.
+ */
+static uint64_t
+timer_call_bench_arm(timer_call_data_t *calls, uint32_t count)
+{
+	uint64_t        interval = timer_longterm.threshold.interval;
+	uint64_t        hour, now;
+	uint64_t        seed = 0x9e3779b97f4a7c15ULL;
+
+	if (interval == TIMER_LONGTERM_NONE) {
+		nanoseconds_to_absolutetime(NSEC_PER_SEC, &interval);
+	}
+	nanoseconds_to_absolutetime(3600 * NSEC_PER_SEC, &hour);
+
+	for (uint32_t i = 0; i < count; i++) {
+		timer_call_setup(&calls[i], timer_call_bench_callout, NULL);
+	}
+
+	now = mach_absolute_time();
+	for (uint32_t i = 0; i < count; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		timer_call_enter(&calls[i], now + 2 * interval + (seed >> 11) % hour,
+		    TIMER_CALL_SYS_NORMAL);
+	}
+	return mach_absolute_time() - now;
+}
+
+/*
+ * Cancel count timers armed by timer_call_bench_arm(), and return how
+ * long that took, or 0 if any of them had fired.
+ */
+static uint64_t
+timer_call_bench_cancel(timer_call_data_t *calls, uint32_t count)
+{
+	uint64_t        start = mach_absolute_time();
+	boolean_t       all_armed = TRUE;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (!timer_call_cancel(&calls[i])) {
+			all_armed = FALSE;
+		}
+	}
+	return all_armed ? mach_absolute_time() - start : 0;
+}
+
+/*
+ * Arm, then cancel, |in| timers with deadlines spread from past the longterm
+ * threshold to an hour out and return the average cost, in nanoseconds, of
+ * arming one (in > 0) or cancelling one (in < 0).
+ */
+static int
+timer_call_bench(int64_t in, int64_t *out)
+{
+	uint32_t        count;
+	uint64_t        arm_time, cancel_time, ns;
+	timer_call_data_t *calls;
+
+	if (in == 0 || in > (1 << 20) || in < -(1 << 20)) {
+		return EINVAL;
+	}
+	count = (uint32_t)(in < 0 ? -in : in);
+
+	calls = kalloc_type(timer_call_data_t, count, Z_WAITOK | Z_ZERO);
+	if (calls == NULL) {
+		return ENOMEM;
+	}
+	arm_time = timer_call_bench_arm(calls, count);
+	cancel_time = timer_call_bench_cancel(calls, count);
+	kfree_type(timer_call_data_t, count, calls);
+
+	if (cancel_time == 0) {
+		return EINVAL;
+	}
+	absolutetime_to_nanoseconds(in > 0 ? arm_time : cancel_time, &ns);
+	*out = (int64_t)(ns / count);
+	return 0;
+}
+SYSCTL_TEST_REGISTER(timer_call_bench, timer_call_bench);
+
+/*
+ * With in timers armed as by timer_call_bench, return the time, in
+ * nanoseconds, that one threshold scan of the longterm timers takes
+ * with interrupts masked.
+ */
+static int
+timer_longterm_scan_bench(int64_t in, int64_t *out)
+{
+	timer_longterm_t        *tlp = &timer_longterm;
+	uint32_t                count;
+	uint64_t                start, scan_time, ns;
+	timer_call_data_t       *calls;
+	processor_t             prev;
+	spl_t                   s;
+
+	if (in <= 0 || in > (1 << 20)) {
+		return EINVAL;
+	}
+	count = (uint32_t)in;
+
+	calls = kalloc_type(timer_call_data_t, count, Z_WAITOK | Z_ZERO);
+	if (calls == NULL) {
+		return ENOMEM;
+	}
+	timer_call_bench_arm(calls, count);
+
+	/* scans run on the master cpu */
+	prev = thread_bind(master_processor);
+	thread_block(THREAD_CONTINUE_NULL);
+
+	s = splclock();
+	timer_queue_lock_spin(timer_longterm_queue);
+	timer_call_cancel(&tlp->threshold.timer);
+	start = mach_absolute_time();
+	timer_longterm_scan(tlp, start);
+	scan_time = mach_absolute_time() - start;
+	timer_longterm_threshold_rearm(tlp);
+	timer_queue_unlock(timer_longterm_queue);
+	splx(s);
+
+	thread_bind(prev);
+	thread_block(THREAD_CONTINUE_NULL);
+
+	if (timer_call_bench_cancel(calls, count) == 0) {
+		kfree_type(timer_call_data_t, count, calls);
+		return EINVAL;
+	}
+	kfree_type(timer_call_data_t, count, calls);
+
+	absolutetime_to_nanoseconds(scan_time, &ns);
+	*out = (int64_t)ns;
+	return 0;
+}
+SYSCTL_TEST_REGISTER(timer_longterm_scan_bench, timer_longterm_scan_bench);
+
+#endif /* DEVELOPMENT || DEBUG */
@@ -0,0 +1,324 @@
+/*
+ * Capture loopback traffic through a bpf capture ring (BIOCSETRING), and
+ * compare capture throughput and drops against read() on the device.
+ */
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/bpf.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "bpflib.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net.bpf"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define RING_BLOCK_SIZE         (64 * 1024)
+#define RING_BLOCK_COUNT        64
+#define READ_BUFSIZE            (512 * 1024)
+#define RUN_SECONDS             3
+
+struct ring {
+	struct bpf_ring_hdr     *hdr;
+	size_t                  size;
+};
+
+static int
+capture_open(struct ring *ring, bool immediate)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+	int fd;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd = bpf_new(), "bpf_new");
+	if (ring != NULL) {
+		struct bpf_ring_req brr = {
+			.brr_block_size = RING_BLOCK_SIZE,
+			.brr_block_count = RING_BLOCK_COUNT,
+		};
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, BIOCSETRING, &brr),
+		    "BIOCSETRING");
+		ring->hdr = (struct bpf_ring_hdr *)(uintptr_t)brr.brr_addr;
+		ring->size = (size_t)brr.brr_size;
+		T_QUIET; T_ASSERT_EQ(ring->hdr->brh_block_count, RING_BLOCK_COUNT, NULL);
+	} else {
+		u_int blen = READ_BUFSIZE;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, BIOCSBLEN, &blen), "BIOCSBLEN");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_immediate(fd, immediate), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_timeout(fd, &tv), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_setif(fd, "lo0"), "attach to lo0");
+	return fd;
+}
+
+static void
+capture_close(int fd, struct ring *ring)
+{
+	bpf_dispose(fd);
+	if (ring != NULL) {
+		munmap(ring->hdr, ring->size);
+	}
+}
+
+static uint64_t
+count_packets(const char *buf, size_t len)
+{
+	uint64_t npkts = 0;
+	size_t off = 0;
+
+	while (off + sizeof(struct bpf_hdr) <= len) {
+		const struct bpf_hdr *bh = (const struct bpf_hdr *)(const void *)(buf + off);
+
+		npkts++;
+		off += BPF_WORDALIGN(bh->bh_hdrlen + bh->bh_caplen);
+	}
+	return npkts;
+}
+
+/*
+ * Consume every completed block and hand it back to the kernel.
+ */
+static uint64_t
+ring_drain(struct ring *ring)
+{
+	struct bpf_ring_hdr *hdr = ring->hdr;
+	uint32_t prod = __atomic_load_n(&hdr->brh_prod, __ATOMIC_ACQUIRE);
+	uint32_t cons = hdr->brh_cons;
+	uint64_t npkts = 0;
+
+	for (; cons != prod; cons++) {
+		const struct bpf_ring_block *blk = (const struct bpf_ring_block *)
+		    (const void *)((const char *)hdr + hdr->brh_block_offset +
+		    (size_t)(cons % hdr->brh_block_count) * hdr->brh_block_size);
+
+		T_QUIET; T_ASSERT_EQ(blk->brb_seq, (uint64_t)cons, "block sequence");
+		T_QUIET; T_ASSERT_EQ(count_packets((const char *)(blk + 1), blk->brb_len),
+		    (uint64_t)blk->brb_npkts, "packets in block %u", cons);
+		npkts += blk->brb_npkts;
+	}
+	__atomic_store_n(&hdr->brh_cons, cons, __ATOMIC_RELEASE);
+	return npkts;
+}
+
+struct sender {
+	int             tx;
+	int             rx;
+	uint64_t        sent;
+};
+
+static atomic_bool running;
+
+static void
+sender_open(struct sender *s)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s->rx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(s->rx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(s->rx, (struct sockaddr *)&sin,
+	    &len), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s->tx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(s->tx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	s->sent = 0;
+}
+
+static void
+sender_close(struct sender *s)
+{
+	close(s->tx);
+	close(s->rx);
+}
+
+static void *
+sender_run(void *arg)
+{
+	struct sender *s = arg;
+	char buf[256] = { 0 };
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		if (send(s->tx, buf, sizeof(buf), 0) == sizeof(buf)) {
+			s->sent++;
+		}
+		while (recv(s->rx, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+			;
+		}
+	}
+	return NULL;
+}
+
+T_DECL(bpf_ring_capture, "packets captured into a bpf ring are all accounted for")
+{
+	struct sender s;
+	struct ring ring;
+	struct kevent kev;
+	struct timespec ts = { .tv_sec = 1 };
+	uint64_t captured = 0;
+	char buf[64] = { 0 };
+	int fd, kq;
+
+	fd = capture_open(&ring, true);
+	T_EXPECT_POSIX_FAILURE(read(fd, buf, sizeof(buf)), EOPNOTSUPP,
+	    "read() is not supported in ring mode");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq = kqueue(), NULL);
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL), NULL);
+
+	sender_open(&s);
+	for (int i = 0; i < 1000; i++) {
+		T_QUIET; T_ASSERT_EQ(send(s.tx, buf, sizeof(buf), 0), (ssize_t)sizeof(buf), NULL);
+	}
+	/* loopback traffic is captured once on the way out */
+	while (captured < 1000 && kevent(kq, NULL, 0, &kev, 1, &ts) == 1) {
+		captured += ring_drain(&ring);
+	}
+	T_EXPECT_GE(captured, 1000ull, "captured %llu packets", captured);
+	T_EXPECT_EQ(ring.hdr->brh_drops, 0ull, "no drops");
+
+	sender_close(&s);
+	close(kq);
+	capture_close(fd, &ring);
+}
+
+/*
+ * Without immediate mode, each expiry of the read timeout hands over one
+ * partially filled block; the timeout must keep batching packets after
+ * it first expired rather than completing a block per packet.
+ */
+T_DECL(bpf_ring_timeout, "the bpf read timeout batches packets into ring blocks")
+{
+	struct sender s;
+	struct ring ring;
+	struct kevent kev;
+	struct timespec ts = { .tv_sec = 1 };
+	char buf[64] = { 0 };
+	int fd, kq;
+
+	fd = capture_open(&ring, false);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq = kqueue(), NULL);
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL), NULL);
+
+	sender_open(&s);
+	for (int round = 0; round < 3; round++) {
+		uint32_t cons = ring.hdr->brh_cons;
+		uint64_t captured = 0;
+		uint32_t blocks;
+
+		for (int i = 0; i < 10; i++) {
+			T_QUIET; T_ASSERT_EQ(send(s.tx, buf, sizeof(buf), 0), (ssize_t)sizeof(buf), NULL);
+		}
+		while (captured < 10 && kevent(kq, NULL, 0, &kev, 1, &ts) == 1) {
+			captured += ring_drain(&ring);
+		}
+		blocks = ring.hdr->brh_cons - cons;
+		T_EXPECT_GE(captured, 10ull, "round %d: captured %llu packets", round, captured);
+		T_EXPECT_LT(blocks, 10u, "round %d: %u blocks for %llu packets",
+		    round, blocks, captured);
+	}
+
+	sender_close(&s);
+	close(kq);
+	capture_close(fd, &ring);
+}
+
+/*
+ * Capture a loopback UDP flood for RUN_SECONDS, through the ring or
+ * through read(), and report captured packets per second and the share
+ * of packets the descriptor dropped.
+ */
+static void
+capture_perf(bool use_ring)
+{
+	const char *mode = use_ring ? "ring" : "read";
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+	struct sender s;
+	struct ring ring;
+	struct bpf_stat bs;
+	struct kevent kev;
+	pthread_t thread;
+	uint64_t captured = 0;
+	char *buf = NULL;
+	char name[64];
+	time_t end;
+	int fd, kq;
+	double drop_rate;
+
+	fd = capture_open(use_ring ? &ring : NULL, false);
+	if (!use_ring) {
+		T_QUIET; T_ASSERT_NOTNULL(buf = malloc(READ_BUFSIZE), NULL);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq = kqueue(), NULL);
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL), NULL);
+
+	sender_open(&s);
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, sender_run, &s), NULL);
+
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		if (kevent(kq, NULL, 0, &kev, 1, &ts) != 1) {
+			continue;
+		}
+		if (use_ring) {
+			captured += ring_drain(&ring);
+		} else {
+			ssize_t n = read(fd, buf, READ_BUFSIZE);
+
+			if (n > 0) {
+				captured += count_packets(buf, (size_t)n);
+			}
+		}
+	}
+	atomic_store(&running, false);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, BIOCGSTATS, &bs), "BIOCGSTATS");
+	drop_rate = bs.bs_recv != 0 ? (double)bs.bs_drop / bs.bs_recv : 0;
+	T_EXPECT_GT(captured, 0ull, "%s: captured packets", mode);
+	T_LOG("%s: sent %llu, captured %llu (%.0f pps), received %u, dropped %u (%.2f%%)",
+	    mode, s.sent, captured, (double)captured / RUN_SECONDS, bs.bs_recv,
+	    bs.bs_drop, drop_rate * 100);
+
+	snprintf(name, sizeof(name), "bpf_capture_pps_%s", mode);
+	T_PERF(name, (double)captured / RUN_SECONDS, "pps", "packets captured per second");
+	snprintf(name, sizeof(name), "bpf_capture_drop_rate_%s", mode);
+	T_PERF(name, drop_rate * 100, "%", "share of packets dropped by bpf");
+
+	sender_close(&s);
+	close(kq);
+	free(buf);
+	capture_close(fd, use_ring ? &ring : NULL);
+}
+
+T_DECL(bpf_ring_perf, "bpf capture throughput and drops, ring and read()",
+    T_META_TAG_PERF)
+{
+	capture_perf(false);
+	capture_perf(true);
+}
@@ -0,0 +1,47 @@
+#include <sys/sysctl.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net.bpf"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+T_DECL(bpf_threaded_code_differential,
+    "threaded bpf code matches the interpreter on fuzzed filters and packets")
+{
+	for (int64_t seed = 1; seed <= 16; seed++) {
+		T_EXPECT_EQ(1ll, run_sysctl_test("bpf_threaded_code", seed),
+		    "fuzzed programs and packets, seed %lld", seed);
+	}
+}
+
+T_DECL(bpf_threaded_code_perf, "bpf filter cost, interpreted and threaded",
+    T_META_TAG_PERF)
+{
+	int64_t interp = run_sysctl_test("bpf_threaded_code_bench", 0);
+	int64_t threaded = run_sysctl_test("bpf_threaded_code_bench", 1);
+
+	T_LOG("tcp port 80 filter: interpreter %.1f ns, threaded %.1f ns per packet",
+	    interp / 1000.0, threaded / 1000.0);
+	T_PERF("bpf_filter_interpreted", interp / 1000.0, "ns",
+	    "interpreted filter cost per packet");
+	T_PERF("bpf_filter_threaded", threaded / 1000.0, "ns",
+	    "threaded filter cost per packet");
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * feth_pair.c
+ * - a pair of peered fake ethernet interfaces and TCP connections over
+ *   them, for tests that push traffic through the output path
+ */
+
+#include <darwintest.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <net/if_fake_var.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "feth_pair.h"
+
+#define FETH_PAIRS_MAX          4
+#define SAVED_SYSCTLS_MAX       8
+
+static feth_pair feth_pairs[FETH_PAIRS_MAX];
+static int feth_pairs_count;
+
+static struct {
+	const char      *name;
+	int             value;
+} saved_sysctls[SAVED_SYSCTLS_MAX];
+static int saved_sysctls_count;
+
+static bool atend_registered;
+
+static void
+feth_pair_atend(void)
+{
+	for (int i = 0; i < feth_pairs_count; i++) {
+		feth_pair_destroy(&feth_pairs[i]);
+	}
+	for (int i = 0; i < saved_sysctls_count; i++) {
+		(void)sysctlbyname(saved_sysctls[i].name, NULL, NULL,
+		    &saved_sysctls[i].value, sizeof(saved_sysctls[i].value));
+	}
+}
+
+static void
+feth_pair_register_atend(void)
+{
+	if (!atend_registered) {
+		atend_registered = true;
+		T_ATEND(feth_pair_atend);
+	}
+}
+
+void
+sysctl_set_int(const char *name, int value)
+{
+	int i;
+
+	for (i = 0; i < saved_sysctls_count; i++) {
+		if (strcmp(saved_sysctls[i].name, name) == 0) {
+			break;
+		}
+	}
+	if (i == saved_sysctls_count) {
+		size_t size = sizeof(saved_sysctls[i].value);
+
+		T_QUIET; T_ASSERT_LT(i, SAVED_SYSCTLS_MAX, "saved sysctls");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name,
+		    &saved_sysctls[i].value, &size, NULL, 0), "%s", name);
+		saved_sysctls[i].name = name;
+		saved_sysctls_count++;
+		feth_pair_register_atend();
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, NULL, NULL, &value,
+	    sizeof(value)), "%s = %d", name, value);
+}
+
+void
+inet_ifaddr_add(int s, const char *ifname, const char *addr,
+    const char *dstaddr)
+{
+	struct ifaliasreq ifra;
+	struct sockaddr_in *sin;
+
+	bzero(&ifra, sizeof(ifra));
+	strlcpy(ifra.ifra_name, ifname, sizeof(ifra.ifra_name));
+	sin = (struct sockaddr_in *)(void *)&ifra.ifra_addr;
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, addr, &sin->sin_addr);
+	sin = (struct sockaddr_in *)(void *)&ifra.ifra_mask;
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(dstaddr != NULL ? INADDR_BROADCAST :
+	    IN_CLASSC_NET);
+	if (dstaddr != NULL) {
+		sin = (struct sockaddr_in *)(void *)&ifra.ifra_broadaddr;
+		sin->sin_len = sizeof(*sin);
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, dstaddr, &sin->sin_addr);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCAIFADDR, &ifra),
+	    "SIOCAIFADDR %s %s", ifname, addr);
+}
+
+void
+feth_pair_destroy(const feth_pair *fp)
+{
+	struct ifreq ifr;
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (s >= 0) {
+		bzero(&ifr, sizeof(ifr));
+		strlcpy(ifr.ifr_name, fp->fp_tx, sizeof(ifr.ifr_name));
+		(void)ioctl(s, SIOCIFDESTROY, &ifr);
+		strlcpy(ifr.ifr_name, fp->fp_rx, sizeof(ifr.ifr_name));
+		(void)ioctl(s, SIOCIFDESTROY, &ifr);
+		close(s);
+	}
+}
+
+void
+feth_pair_create(const feth_pair *fp)
+{
+	struct if_fake_request iffr;
+	struct ifdrv ifd;
+	struct ifreq ifr;
+	const char *names[] = { fp->fp_tx, fp->fp_rx };
+	int i, s;
+
+	for (i = 0; i < feth_pairs_count; i++) {
+		if (strcmp(feth_pairs[i].fp_tx, fp->fp_tx) == 0) {
+			break;
+		}
+	}
+	if (i == feth_pairs_count) {
+		T_QUIET; T_ASSERT_LT(i, FETH_PAIRS_MAX, "feth pairs");
+		feth_pairs[i] = *fp;
+		feth_pairs_count++;
+		feth_pair_register_atend();
+	}
+
+	feth_pair_destroy(fp);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	for (i = 0; i < 2; i++) {
+		bzero(&ifr, sizeof(ifr));
+		strlcpy(ifr.ifr_name, names[i], sizeof(ifr.ifr_name));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCIFCREATE, &ifr),
+		    "create %s", names[i]);
+	}
+	bzero(&iffr, sizeof(iffr));
+	strlcpy(iffr.iffr_peer_name, fp->fp_rx, sizeof(iffr.iffr_peer_name));
+	bzero(&ifd, sizeof(ifd));
+	strlcpy(ifd.ifd_name, fp->fp_tx, sizeof(ifd.ifd_name));
+	ifd.ifd_cmd = IF_FAKE_S_CMD_SET_PEER;
+	ifd.ifd_len = sizeof(iffr);
+	ifd.ifd_data = &iffr;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSDRVSPEC, &ifd),
+	    "set %s peer %s", fp->fp_tx, fp->fp_rx);
+	for (i = 0; i < 2; i++) {
+		bzero(&ifr, sizeof(ifr));
+		strlcpy(ifr.ifr_name, names[i], sizeof(ifr.ifr_name));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCGIFFLAGS, &ifr), NULL);
+		ifr.ifr_flags |= IFF_UP;
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFFLAGS, &ifr), NULL);
+	}
+	inet_ifaddr_add(s, fp->fp_tx, fp->fp_tx_addr, NULL);
+	inet_ifaddr_add(s, fp->fp_rx, fp->fp_rx_addr, NULL);
+	close(s);
+}
+
+void
+inet_tcp_pair(const char *src, const char *dst, const char *lst,
+    const char *ifname, tcp_pair_sockopt_func sockopt, void *arg,
+    int *tx, int *rx)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+	};
+	struct sockaddr_in local = {
+		.sin_len = sizeof(local),
+		.sin_family = AF_INET,
+	};
+	socklen_t len = sizeof(sin);
+	int on = 1, ls;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ls = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	inet_pton(AF_INET, lst, &sin.sin_addr);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(ls, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin,
+	    &len), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(ls, 1), NULL);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*tx = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	/* the receiver may go away first */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(*tx, SOL_SOCKET, SO_NOSIGPIPE,
+	    &on, sizeof(on)), "SO_NOSIGPIPE");
+	if (ifname != NULL) {
+		unsigned int ifindex = if_nametoindex(ifname);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(*tx, IPPROTO_IP,
+		    IP_BOUND_IF, &ifindex, sizeof(ifindex)), "IP_BOUND_IF");
+	}
+	if (sockopt != NULL) {
+		(*sockopt)(*tx, arg);
+	}
+	inet_pton(AF_INET, src, &local.sin_addr);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(*tx, (struct sockaddr *)&local,
+	    sizeof(local)), NULL);
+	inet_pton(AF_INET, dst, &sin.sin_addr);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(*tx, (struct sockaddr *)&sin,
+	    sizeof(sin)), "connect to %s", dst);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*rx = accept(ls, NULL, NULL), NULL);
+	close(ls);
+}
+
+void
+feth_pair_tcp(const feth_pair *fp, tcp_pair_sockopt_func sockopt,
+    void *arg, int *tx, int *rx)
+{
+	inet_tcp_pair(fp->fp_tx_addr, fp->fp_rx_addr, fp->fp_rx_addr,
+	    fp->fp_tx, sockopt, arg, tx, rx);
+}
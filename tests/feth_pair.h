@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * feth_pair.h
+ * - a pair of peered fake ethernet interfaces and TCP connections over
+ *   them, for tests that push traffic through the output path
+ */
+
+#ifndef _S_FETH_PAIR_H
+#define _S_FETH_PAIR_H
+
+/*
+ * Data is sent on fp_tx and received on fp_rx.  Every test uses its own
+ * interface names and /24, so that tests run side by side do not clash.
+ */
+typedef struct {
+	const char      *fp_tx;
+	const char      *fp_rx;
+	const char      *fp_tx_addr;
+	const char      *fp_rx_addr;
+} feth_pair, *feth_pair_t;
+
+/* Set options on the connecting socket of a pair, before it connects */
+typedef void (*tcp_pair_sockopt_func)(int fd, void *arg);
+
+/*
+ * (Re)create the pair, up and addressed; it is destroyed when the test
+ * ends, if not before.
+ */
+void
+feth_pair_create(const feth_pair *fp);
+
+void
+feth_pair_destroy(const feth_pair *fp);
+
+/* A TCP connection from fp_tx_addr, bound to fp_tx, to fp_rx_addr */
+void
+feth_pair_tcp(const feth_pair *fp, tcp_pair_sockopt_func sockopt,
+    void *arg, int *tx, int *rx);
+
+/*
+ * Add addr to ifname, in a /24, or point-to-point to dstaddr if that is
+ * not NULL.
+ */
+void
+inet_ifaddr_add(int s, const char *ifname, const char *addr,
+    const char *dstaddr);
+
+/*
+ * A TCP connection from src to dst, the listening end bound to lst; with
+ * ifname set, the connecting end is bound to that interface.
+ */
+void
+inet_tcp_pair(const char *src, const char *dst, const char *lst,
+    const char *ifname, tcp_pair_sockopt_func sockopt, void *arg,
+    int *tx, int *rx);
+
+/* Set an int sysctl, restoring the value it had when the test ends */
+void
+sysctl_set_int(const char *name, int value);
+
+#endif /* _S_FETH_PAIR_H */
@@ -0,0 +1,86 @@
+#include <sys/sysctl.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+static double
+mib_per_sec(int64_t ns_per_mib)
+{
+	return 1e9 / (double)ns_per_mib;
+}
+
+T_DECL(in_cksum_simd_differential,
+    "vector checksum kernels match the reference on fuzzed mbuf chains")
+{
+	for (int64_t seed = 1; seed <= 16; seed++) {
+		T_EXPECT_EQ(1ll, run_sysctl_test("in_cksum_simd", seed),
+		    "fuzzed chains and spans, seed %lld", seed);
+	}
+}
+
+T_DECL(in_cksum_simd_perf, "software checksum throughput per vector unit",
+    T_META_TAG_PERF)
+{
+	static const char *units[] = { "scalar", "sse2", "avx2" };
+	static const int64_t lens[] = { 64, 1500, 9000, 65536 };
+
+	for (int64_t unit = 0; unit < 3; unit++) {
+		for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+			int64_t ns = run_sysctl_test("in_cksum_simd_bench",
+			    (unit << 32) | lens[i]);
+			char name[64];
+
+			if (ns < 0) {
+				T_LOG("%s: not supported", units[unit]);
+				break;
+			}
+			T_LOG("%s, %lld byte spans: %.0f MiB/s", units[unit],
+			    lens[i], mib_per_sec(ns));
+			snprintf(name, sizeof(name), "in_cksum_%s_%lld",
+			    units[unit], lens[i]);
+			T_PERF(name, mib_per_sec(ns), "MiB/s",
+			    "os_cpu_in_cksum() throughput");
+		}
+	}
+}
+
+T_DECL(uiomove_cksum_perf, "uiomove then checksum, and both fused",
+    T_META_TAG_PERF)
+{
+	static const int64_t lens[] = { 1500, 16384, 262144 };
+
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		int64_t split = run_sysctl_test("uiomove_cksum_bench", lens[i]);
+		int64_t fused = run_sysctl_test("uiomove_cksum_bench",
+		    (1ll << 32) | lens[i]);
+		char name[64];
+
+		T_LOG("%lld byte moves: %.0f MiB/s split, %.0f MiB/s fused",
+		    lens[i], mib_per_sec(split), mib_per_sec(fused));
+		snprintf(name, sizeof(name), "uiomove_then_cksum_%lld", lens[i]);
+		T_PERF(name, mib_per_sec(split), "MiB/s",
+		    "uiomove() followed by os_cpu_in_cksum()");
+		snprintf(name, sizeof(name), "uiomove_cksum_%lld", lens[i]);
+		T_PERF(name, mib_per_sec(fused), "MiB/s", "uiomove_cksum()");
+	}
+}
@@ -0,0 +1,335 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/mach_vm.h>
+#include <mach/message.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Large inline message content is transferred copy-on-write when it spans
+ * at least kern.ipc_kmsg_udata_cow_threshold page-aligned bytes in the
+ * sender. These tests check that receivers observe the exact bytes that
+ * were sent, whatever the sender does to its buffer afterwards, and
+ * measure the throughput across payload sizes with and without the
+ * optimization.
+ */
+
+#define COW_THRESHOLD_SYSCTL "kern.ipc_kmsg_udata_cow_threshold"
+#define COW_COUNT_SYSCTL     "kern.ipc_kmsg_udata_cow_count"
+
+#define MAX_PAYLOAD_SIZE     (256 * 1024)
+
+static mach_port_t
+make_port(void)
+{
+	mach_port_options_t opts = {
+		.flags = MPO_INSERT_SEND_RIGHT,
+	};
+	mach_port_t port;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_port_construct(mach_task_self(),
+	    &opts, 0, &port), "mach_port_construct");
+	return port;
+}
+
+static void *
+alloc_buffer(size_t size)
+{
+	mach_vm_address_t addr = 0;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_vm_allocate(mach_task_self(), &addr,
+	    size, VM_FLAGS_ANYWHERE), "mach_vm_allocate");
+	return (void *)addr;
+}
+
+static void
+fill_pattern(uint8_t *buf, size_t size, uint8_t seed)
+{
+	for (size_t i = 0; i < size; i++) {
+		buf[i] = (uint8_t)(seed + i * 7);
+	}
+}
+
+static uint64_t
+cow_count(void)
+{
+	uint64_t count = 0;
+	size_t size = sizeof(count);
+
+	if (sysctlbyname(COW_COUNT_SYSCTL, &count, &size, NULL, 0) != 0) {
+		return 0;
+	}
+	return count;
+}
+
+static uint32_t saved_cow_threshold;
+
+static bool
+set_cow_threshold(uint32_t threshold, uint32_t *old)
+{
+	size_t size = sizeof(*old);
+
+	return sysctlbyname(COW_THRESHOLD_SYSCTL, old, old ? &size : NULL,
+	           &threshold, sizeof(threshold)) == 0;
+}
+
+static uint32_t
+cow_threshold(void)
+{
+	uint32_t threshold = 0;
+	size_t size = sizeof(threshold);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(COW_THRESHOLD_SYSCTL,
+	    &threshold, &size, NULL, 0), COW_THRESHOLD_SYSCTL);
+	return threshold;
+}
+
+/*
+ * Whether the kernel captures the content of send_msg copy-on-write:
+ * the page-aligned span of the content must reach the threshold.
+ */
+static bool
+expect_cow(mach_msg_header_t *send_msg, mach_msg_size_t payload_size,
+    uint32_t threshold)
+{
+	uintptr_t start = (uintptr_t)(send_msg + 1);
+	uintptr_t end = start + payload_size;
+
+	if (threshold == 0 || payload_size < threshold ||
+	    vm_page_size != vm_kernel_page_size) {
+		return false;
+	}
+	start = (start + vm_page_mask) & ~(uintptr_t)vm_page_mask;
+	end &= ~(uintptr_t)vm_page_mask;
+	return end > start && end - start >= threshold;
+}
+
+/*
+ * Sends payload_size bytes of inline content to port.
+ * Message sizes must be 4-byte multiples.
+ */
+static void
+send_payload(mach_port_t port, mach_msg_header_t *send_msg,
+    mach_msg_size_t payload_size)
+{
+	mach_msg_return_t mr;
+
+	send_msg->msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_MAKE_SEND, 0, 0, 0);
+	send_msg->msgh_size = (mach_msg_size_t)sizeof(*send_msg) + payload_size;
+	send_msg->msgh_remote_port = port;
+	send_msg->msgh_local_port = MACH_PORT_NULL;
+	send_msg->msgh_id = 0x636f77;
+
+	mr = mach_msg(send_msg, MACH_SEND_MSG, send_msg->msgh_size, 0,
+	    MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg(SEND) of %u bytes", payload_size);
+}
+
+static void
+receive_payload(mach_port_t port, mach_msg_header_t *send_msg,
+    mach_msg_header_t *rcv_msg, mach_msg_size_t rcv_size)
+{
+	mach_msg_return_t mr;
+
+	mr = mach_msg(rcv_msg, MACH_RCV_MSG, 0, rcv_size, port,
+	    MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg(RCV) of %u bytes",
+	    send_msg->msgh_size);
+	T_QUIET; T_ASSERT_EQ(rcv_msg->msgh_size, send_msg->msgh_size, "message size");
+}
+
+/*
+ * Sends payload_size bytes of inline content to port, and receives
+ * the message back into rcv_msg.
+ */
+static void
+send_and_receive(mach_port_t port, mach_msg_header_t *send_msg,
+    mach_msg_size_t payload_size, mach_msg_header_t *rcv_msg,
+    mach_msg_size_t rcv_size)
+{
+	send_payload(port, send_msg, payload_size);
+	receive_payload(port, send_msg, rcv_msg, rcv_size);
+}
+
+T_DECL(inline_cow_integrity,
+    "large inline content is received intact, whatever the alignment")
+{
+	static const mach_msg_size_t sizes[] = {
+		4 * 1024, 16 * 1024, 16 * 1024 + 12, 64 * 1024, 64 * 1024 + 100,
+		MAX_PAYLOAD_SIZE - 256,
+	};
+	static const mach_msg_size_t rcv_offsets[] = { 0, 8, 4096 + 24 };
+
+	size_t buf_size = MAX_PAYLOAD_SIZE + 2 * PAGE_SIZE;
+	mach_port_t port = make_port();
+	uint8_t *send_buf = alloc_buffer(buf_size);
+	uint8_t *rcv_buf = alloc_buffer(buf_size);
+	uint32_t threshold = cow_threshold();
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (size_t j = 0; j < sizeof(rcv_offsets) / sizeof(rcv_offsets[0]); j++) {
+			mach_msg_header_t *send_msg = (mach_msg_header_t *)send_buf;
+			mach_msg_header_t *rcv_msg = (mach_msg_header_t *)(rcv_buf + rcv_offsets[j]);
+			uint8_t seed = (uint8_t)(i * 16 + j);
+			uint64_t cow_before;
+
+			fill_pattern((uint8_t *)(send_msg + 1), sizes[i], seed);
+			memset(rcv_buf, 0xa5, buf_size);
+
+			cow_before = cow_count();
+			send_and_receive(port, send_msg, sizes[i], rcv_msg,
+			    (mach_msg_size_t)(buf_size - rcv_offsets[j]));
+
+			if (expect_cow(send_msg, sizes[i], threshold)) {
+				T_QUIET; T_ASSERT_GT(cow_count(), cow_before,
+				    "payload of %u bytes transferred copy-on-write", sizes[i]);
+			} else {
+				T_QUIET; T_ASSERT_EQ(cow_count(), cow_before,
+				    "payload of %u bytes copied (threshold %u)", sizes[i], threshold);
+			}
+			T_QUIET; T_ASSERT_EQ(memcmp(send_msg + 1, rcv_msg + 1, sizes[i]), 0,
+			    "payload of %u bytes received at offset %u", sizes[i], rcv_offsets[j]);
+		}
+	}
+	T_PASS("received all payloads intact, copy-on-write above %u bytes", threshold);
+
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)send_buf, buf_size);
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)rcv_buf, buf_size);
+	mach_port_destruct(mach_task_self(), port, 0, 0);
+}
+
+T_DECL(inline_cow_snapshot,
+    "the receiver observes the content at send time, not later sender writes")
+{
+	mach_msg_size_t payload_size = 128 * 1024;
+	size_t buf_size = payload_size + 2 * PAGE_SIZE;
+	mach_port_t port = make_port();
+	uint8_t *send_buf = alloc_buffer(buf_size);
+	uint8_t *rcv_buf = alloc_buffer(buf_size);
+	uint8_t *expected = malloc(payload_size);
+	mach_msg_header_t *send_msg = (mach_msg_header_t *)send_buf;
+	mach_msg_header_t *rcv_msg = (mach_msg_header_t *)rcv_buf;
+	uint64_t cow_before = cow_count();
+
+	T_QUIET; T_ASSERT_NOTNULL(expected, "malloc");
+
+	fill_pattern((uint8_t *)(send_msg + 1), payload_size, 0x11);
+	memcpy(expected, send_msg + 1, payload_size);
+
+	send_payload(port, send_msg, payload_size);
+	if (expect_cow(send_msg, payload_size, cow_threshold())) {
+		T_ASSERT_GT(cow_count(), cow_before, "content captured copy-on-write");
+	}
+
+	/* scribble over the sender buffer while the message is enqueued */
+	memset(send_msg + 1, 0xee, payload_size);
+
+	receive_payload(port, send_msg, rcv_msg, (mach_msg_size_t)buf_size);
+	T_ASSERT_EQ(memcmp(rcv_msg + 1, expected, payload_size), 0,
+	    "receiver sees the content at send time");
+
+	/* and the receiver writing to its copy does not leak back either */
+	memset(rcv_msg + 1, 0x77, payload_size);
+	for (mach_msg_size_t i = 0; i < payload_size; i++) {
+		if (((uint8_t *)(send_msg + 1))[i] != 0xee) {
+			T_FAIL("sender buffer modified at offset %u", i);
+			break;
+		}
+	}
+
+	free(expected);
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)send_buf, buf_size);
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)rcv_buf, buf_size);
+	mach_port_destruct(mach_task_self(), port, 0, 0);
+}
+
+T_DECL(inline_cow_truncated_receive,
+    "a too-small receive buffer does not lose a copy-on-write message")
+{
+	mach_msg_size_t payload_size = 64 * 1024;
+	size_t buf_size = payload_size + 2 * PAGE_SIZE;
+	mach_port_t port = make_port();
+	uint8_t *send_buf = alloc_buffer(buf_size);
+	uint8_t *rcv_buf = alloc_buffer(buf_size);
+	mach_msg_header_t *send_msg = (mach_msg_header_t *)send_buf;
+	mach_msg_header_t *rcv_msg = (mach_msg_header_t *)rcv_buf;
+	mach_msg_return_t mr;
+
+	fill_pattern((uint8_t *)(send_msg + 1), payload_size, 0x42);
+	send_payload(port, send_msg, payload_size);
+
+	mr = mach_msg(rcv_msg, MACH_RCV_MSG | MACH_RCV_LARGE, 0, 1024, port,
+	    MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+	T_ASSERT_EQ(mr, MACH_RCV_TOO_LARGE, "receive into a 1KB buffer");
+
+	receive_payload(port, send_msg, rcv_msg, (mach_msg_size_t)buf_size);
+	T_ASSERT_EQ(memcmp(rcv_msg + 1, send_msg + 1, payload_size), 0,
+	    "payload received intact");
+
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)send_buf, buf_size);
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)rcv_buf, buf_size);
+	mach_port_destruct(mach_task_self(), port, 0, 0);
+}
+
+static void
+measure_throughput(const char *variant)
+{
+	static const mach_msg_size_t sizes[] = {
+		4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024,
+		MAX_PAYLOAD_SIZE - 256,
+	};
+
+	size_t buf_size = MAX_PAYLOAD_SIZE + 2 * PAGE_SIZE;
+	mach_port_t port = make_port();
+	uint8_t *send_buf = alloc_buffer(buf_size);
+	uint8_t *rcv_buf = alloc_buffer(buf_size);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char label[64];
+		dt_stat_time_t s;
+
+		snprintf(label, sizeof(label), "%s_%uKB", variant, sizes[i] / 1024);
+		s = dt_stat_time_create(label);
+		fill_pattern(send_buf + sizeof(mach_msg_header_t), sizes[i], 0x5a);
+
+		T_STAT_MEASURE_LOOP(s) {
+			send_and_receive(port, (mach_msg_header_t *)send_buf, sizes[i],
+			    (mach_msg_header_t *)rcv_buf, (mach_msg_size_t)buf_size);
+		}
+		dt_stat_finalize(s);
+	}
+
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)send_buf, buf_size);
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)rcv_buf, buf_size);
+	mach_port_destruct(mach_task_self(), port, 0, 0);
+}
+
+static void
+restore_cow_threshold(void)
+{
+	(void)set_cow_threshold(saved_cow_threshold, NULL);
+}
+
+T_DECL(perf_inline_cow_throughput,
+    "send/receive latency of inline payloads, copy-on-write vs. copied",
+    T_META_TAG_PERF, T_META_ASROOT(true))
+{
+	measure_throughput("default");
+
+	if (!set_cow_threshold(0, &saved_cow_threshold)) {
+		T_SKIP("cannot change " COW_THRESHOLD_SYSCTL " on this kernel");
+	}
+	T_ATEND(restore_cow_threshold);
+	measure_throughput("copied");
+}
@@ -0,0 +1,199 @@
+/*
+ * net_classq_l4s_coupled: run an L4S TCP flow (net.inet.tcp.l4s, ECT(1))
+ * next to a classic one through a rate-limited fake ethernet interface
+ * whose fq_codel couples L4S marking to a PI2 controller on the classic
+ * traffic (net.classq.l4s_coupled), and report the queueing delay each
+ * kind of traffic saw.
+ */
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <net/if.h>
+#include <net/if_private.h>
+#include <net/pktsched/pktsched.h>
+#include <net/classq/if_classq.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_private.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define FETH_TX         "feth7760"
+#define FETH_RX         "feth7761"
+#define TX_ADDR         "10.77.60.1"
+#define RX_ADDR         "10.77.60.2"
+#define LINK_RATE       (20ull * 1000 * 1000)   /* bits per second */
+#define SEND_SECONDS    5
+#define BUF_SIZE        (64 * 1024)
+#define FQ_IF_BE_INDEX  7
+
+static const char *knobs[] = {
+	"net.classq.enable_l4s",
+	"net.classq.l4s_coupled",
+	"net.inet.tcp.accurate_ecn",
+	"net.inet.tcp.l4s",
+	"net.inet.tcp.ecn_initiate_out",
+	"net.inet.tcp.ecn_negotiate_in",
+};
+#define NKNOBS          (sizeof(knobs) / sizeof(knobs[0]))
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+static atomic_bool stop;
+
+/* Turned on before the interfaces attach, so fq_codel picks them up. */
+static void
+enable_l4s(void)
+{
+	for (size_t i = 0; i < NKNOBS; i++) {
+		sysctl_set_int(knobs[i], 1);
+	}
+}
+
+static void
+feth_setup(void)
+{
+	struct if_linkparamsreq iflpr;
+	int s;
+
+	feth_pair_create(&pair);
+
+	/* the token bucket holds packets back in fq_codel, so a queue builds */
+	bzero(&iflpr, sizeof(iflpr));
+	strlcpy(iflpr.iflpr_name, FETH_TX, sizeof(iflpr.iflpr_name));
+	iflpr.iflpr_output_tbr_rate = LINK_RATE;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFLINKPARAMS, &iflpr),
+	    "%s limited to %llu bit/s", FETH_TX, LINK_RATE);
+	close(s);
+}
+
+/* A classic flow: no ECN, so not ECT(1) either */
+static void
+set_classic(int fd, void *arg)
+{
+#pragma unused(arg)
+	int mode = ECN_MODE_DISABLE;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, IPPROTO_TCP,
+	    TCP_ECN_MODE, &mode, sizeof(mode)), "TCP_ECN_MODE");
+}
+
+static void *
+sender(void *arg)
+{
+	static uint8_t buf[BUF_SIZE];
+	int fd = *(int *)arg;
+
+	while (!atomic_load(&stop)) {
+		if (send(fd, buf, sizeof(buf), 0) <= 0) {
+			break;
+		}
+	}
+	shutdown(fd, SHUT_WR);
+	return NULL;
+}
+
+static void *
+receiver(void *arg)
+{
+	uint8_t buf[BUF_SIZE];
+	int fd = *(int *)arg;
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0) {
+		;
+	}
+	return NULL;
+}
+
+static void
+queue_stats(struct if_ifclassq_stats *ifqs)
+{
+	struct if_qstatsreq ifqr;
+	int s;
+
+	bzero(&ifqr, sizeof(ifqr));
+	strlcpy(ifqr.ifqr_name, FETH_TX, sizeof(ifqr.ifqr_name));
+	ifqr.ifqr_slot = FQ_IF_BE_INDEX;
+	ifqr.ifqr_buf = ifqs;
+	ifqr.ifqr_len = sizeof(*ifqs);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCGIFQUEUESTATS, &ifqr),
+	    "SIOCGIFQUEUESTATS %s", FETH_TX);
+	close(s);
+}
+
+T_DECL(classq_l4s_coupled_sojourn,
+    "queueing delay of L4S and classic TCP flows with coupled L4S marking",
+    T_META_TAG_PERF)
+{
+	struct if_ifclassq_stats *ifqs;
+	struct fq_codel_classstats *fcls;
+	pthread_t threads[4];
+	int fds[2][2];
+
+	enable_l4s();
+	feth_setup();
+
+	/* flow 0 negotiates AccECN and sends ECT(1), flow 1 has no ECN */
+	atomic_store(&stop, false);
+	for (int i = 0; i < 2; i++) {
+		feth_pair_tcp(&pair, i ? set_classic : NULL, NULL, &fds[i][0],
+		    &fds[i][1]);
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[2 * i], NULL,
+		    sender, &fds[i][0]), "pthread_create");
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[2 * i + 1],
+		    NULL, receiver, &fds[i][1]), "pthread_create");
+	}
+	sleep(SEND_SECONDS);
+	atomic_store(&stop, true);
+	for (int i = 0; i < 4; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL),
+		    "pthread_join");
+	}
+
+	T_QUIET; T_ASSERT_NOTNULL(ifqs = calloc(1, sizeof(*ifqs)), NULL);
+	queue_stats(ifqs);
+	for (int i = 0; i < 2; i++) {
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	feth_pair_destroy(&pair);
+
+	fcls = &ifqs->ifqs_fq_codel_stats;
+	T_EXPECT_GT(fcls->fcls_l4s_pkts, 0ull, "%llu L4S packets queued",
+	    fcls->fcls_l4s_pkts);
+	T_EXPECT_GT(fcls->fcls_ce_marked + fcls->fcls_coupled_ce_marked, 0ull,
+	    "L4S packets marked: %llu on the step, %llu coupled",
+	    fcls->fcls_ce_marked, fcls->fcls_coupled_ce_marked);
+	T_LOG("classic: %llu marked, %llu dropped by PI2, p' %.4f",
+	    fcls->fcls_classic_ce_marked, fcls->fcls_classic_pi2_drops,
+	    (double)fcls->fcls_pi2_prob / 4294967296.0);
+
+	T_PERF("coupled_l4s_avg_sojourn", (double)fcls->fcls_l4s_avg_sojourn / 1000,
+	    "us", "average queueing delay of L4S packets");
+	T_PERF("coupled_l4s_max_sojourn", (double)fcls->fcls_l4s_max_sojourn / 1000,
+	    "us", "maximum queueing delay of L4S packets");
+	T_PERF("coupled_classic_avg_sojourn",
+	    (double)fcls->fcls_classic_avg_sojourn / 1000, "us",
+	    "average queueing delay of classic packets");
+	T_LOG("sojourn avg/max: L4S %llu/%llu ns, classic %llu/%llu ns",
+	    fcls->fcls_l4s_avg_sojourn, fcls->fcls_l4s_max_sojourn,
+	    fcls->fcls_classic_avg_sojourn, fcls->fcls_classic_max_sojourn);
+	free(ifqs);
+}
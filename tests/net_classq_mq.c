@@ -0,0 +1,124 @@
+/*
+ * net_classq_mq: send small UDP datagrams from several threads over a
+ * pair of fake ethernet interfaces, with the transmit queue a single
+ * fq_codel instance and split into several (net.classq.mq_queues), and
+ * report the packets per second that got through.
+ */
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define MQ_QUEUES       "net.classq.mq_queues"
+#define FETH_TX         "feth7750"
+#define FETH_RX         "feth7751"
+#define TX_ADDR         "10.77.50.1"
+#define RX_ADDR         "10.77.50.2"
+#define SEND_THREADS    8
+#define SEND_SECONDS    3
+#define DGRAM_SIZE      64
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+static atomic_bool stop;
+
+/* The setting applies to interfaces attached after it is changed. */
+static void
+set_queues(unsigned int queues)
+{
+	sysctl_set_int(MQ_QUEUES, (int)queues);
+}
+
+/* One flow per thread: its own socket, so its own source port. */
+static void *
+sender(void *arg)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_port = htons(9),
+	};
+	char buf[DGRAM_SIZE] = { 0 };
+	uint64_t *sent = arg;
+	int s;
+
+	inet_pton(AF_INET, RX_ADDR, &sin.sin_addr);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0),
+	    "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(s, (struct sockaddr *)&sin,
+	    sizeof(sin)), "connect");
+	while (!atomic_load(&stop)) {
+		if (send(s, buf, sizeof(buf), 0) == sizeof(buf)) {
+			(*sent)++;
+		} else {
+			T_QUIET; T_ASSERT_TRUE(errno == ENOBUFS ||
+			    errno == EHOSTDOWN, "send: %s", strerror(errno));
+		}
+	}
+	close(s);
+	return NULL;
+}
+
+static double
+run(unsigned int queues)
+{
+	pthread_t threads[SEND_THREADS];
+	uint64_t sent[SEND_THREADS] = { 0 };
+	uint64_t total = 0;
+	char name[64];
+	double pps;
+
+	set_queues(queues);
+	feth_pair_create(&pair);
+
+	atomic_store(&stop, false);
+	for (int i = 0; i < SEND_THREADS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    sender, &sent[i]), "pthread_create");
+	}
+	sleep(SEND_SECONDS);
+	atomic_store(&stop, true);
+	for (int i = 0; i < SEND_THREADS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL),
+		    "pthread_join");
+		total += sent[i];
+	}
+	feth_pair_destroy(&pair);
+
+	pps = (double)total / SEND_SECONDS;
+	T_EXPECT_GT(total, 0ull, "%u queue(s): %llu datagrams sent", queues,
+	    total);
+	snprintf(name, sizeof(name), "classq_%u_queues_pps", queues);
+	T_PERF(name, pps, "pps", "UDP datagrams sent from several threads");
+	return pps;
+}
+
+T_DECL(classq_mq_send_pps,
+    "multi-threaded send rate, single vs multi-queue fq_codel",
+    T_META_TAG_PERF)
+{
+	double single, multi;
+
+	single = run(1);
+	multi = run(4);
+	T_LOG("%d threads: %.0f pps with one queue, %.0f pps with four "
+	    "(%.2fx)", SEND_THREADS, single, multi, multi / single);
+}
@@ -0,0 +1,251 @@
+/*
+ * Generic receive offload (net.link.generic.system.gro) on loopback: a
+ * bulk TCP transfer with an Ethernet-sized MSS, checked for integrity,
+ * and its CPU cost per byte received with and without coalescing.
+ */
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define TCP_MSS         1448
+#define BUF_SIZE        (128 * 1024)
+#define RUN_SECONDS     3
+
+static int saved_enabled = -1;
+
+static void
+cleanup(void)
+{
+	if (saved_enabled != -1) {
+		(void)sysctlbyname("net.link.generic.system.gro.enabled",
+		    NULL, NULL, &saved_enabled, sizeof(saved_enabled));
+	}
+}
+
+static void
+set_gro(int on)
+{
+	size_t size = sizeof(saved_enabled);
+
+	if (saved_enabled == -1) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+			    "net.link.generic.system.gro.enabled", &saved_enabled,
+			    &size, NULL, 0), "gro.enabled");
+		T_ATEND(cleanup);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+		    "net.link.generic.system.gro.enabled", NULL, NULL, &on,
+		    sizeof(on)), "gro.enabled = %d", on);
+}
+
+static uint64_t
+gro_merged(void)
+{
+	uint64_t merged = 0;
+	size_t size = sizeof(merged);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+		    "net.link.generic.system.gro.merged", &merged, &size, NULL, 0),
+	    "gro.merged");
+	return merged;
+}
+
+/*
+ * Busy CPU ticks of the host, summed over all processors.
+ */
+static uint64_t
+cpu_busy_ticks(void)
+{
+	host_cpu_load_info_data_t info;
+	mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(host_statistics(mach_host_self(),
+	    HOST_CPU_LOAD_INFO, (host_info_t)&info, &count), NULL);
+	return (uint64_t)info.cpu_ticks[CPU_STATE_USER] +
+	       info.cpu_ticks[CPU_STATE_SYSTEM] + info.cpu_ticks[CPU_STATE_NICE];
+}
+
+static void
+tcp_pair(int *tx, int *rx)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	int mss = TCP_MSS, on = 1;
+	int ls;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ls = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(ls, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin,
+	    &len), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(ls, 1), NULL);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*tx = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	/* segments the size of an Ethernet frame, rather than lo0's MTU */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(*tx, IPPROTO_TCP, TCP_MAXSEG,
+	    &mss, sizeof(mss)), "TCP_MAXSEG");
+	/* the receiver may go away first */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(*tx, SOL_SOCKET, SO_NOSIGPIPE,
+	    &on, sizeof(on)), "SO_NOSIGPIPE");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(*tx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*rx = accept(ls, NULL, NULL), NULL);
+	close(ls);
+}
+
+struct sender {
+	int             fd;
+	uint64_t        limit;          /* bytes to send, or 0 until stopped */
+};
+
+static atomic_bool running;
+
+static void *
+sender_run(void *arg)
+{
+	struct sender *s = arg;
+	static uint8_t buf[BUF_SIZE];
+	uint64_t off = 0;
+
+	while (atomic_load_explicit(&running, memory_order_relaxed) &&
+	    (s->limit == 0 || off < s->limit)) {
+		size_t len = sizeof(buf);
+		ssize_t n;
+
+		if (s->limit != 0 && s->limit - off < len) {
+			len = (size_t)(s->limit - off);
+		}
+		for (size_t i = 0; i < len; i++) {
+			buf[i] = (uint8_t)((off + i) % 251);
+		}
+		n = send(s->fd, buf, len, 0);
+		if (n <= 0) {
+			break;
+		}
+		off += (uint64_t)n;
+	}
+	shutdown(s->fd, SHUT_WR);
+	return NULL;
+}
+
+T_DECL(net_gro_integrity, "coalesced loopback TCP segments deliver the stream intact")
+{
+	struct sender s = { .limit = 64 * 1024 * 1024 };
+	static uint8_t buf[BUF_SIZE];
+	uint64_t before, off = 0;
+	pthread_t thread;
+	int rx;
+
+	set_gro(1);
+	before = gro_merged();
+	tcp_pair(&s.fd, &rx);
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, sender_run, &s), NULL);
+
+	for (;;) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "recv");
+		if (n == 0) {
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] != (uint8_t)((off + (uint64_t)i) % 251)) {
+				T_ASSERT_FAIL("byte %llu corrupted", off + (uint64_t)i);
+			}
+		}
+		off += (uint64_t)n;
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+	T_EXPECT_EQ(off, s.limit, "received the whole stream");
+	T_EXPECT_GT(gro_merged(), before, "segments were coalesced");
+
+	close(s.fd);
+	close(rx);
+}
+
+/*
+ * Bulk receive for RUN_SECONDS; returns the host CPU time spent per
+ * byte received, in nanoseconds.
+ */
+static double
+bulk_receive(uint64_t *bytes)
+{
+	struct sender s = { .limit = 0 };
+	static uint8_t buf[BUF_SIZE];
+	uint64_t busy0, busy1;
+	pthread_t thread;
+	time_t end;
+	int rx;
+
+	*bytes = 0;
+	tcp_pair(&s.fd, &rx);
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, sender_run, &s), NULL);
+
+	busy0 = cpu_busy_ticks();
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		*bytes += (uint64_t)n;
+	}
+	busy1 = cpu_busy_ticks();
+
+	atomic_store(&running, false);
+	close(rx);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+	close(s.fd);
+
+	if (*bytes == 0) {
+		return 0;
+	}
+	/* one tick is 1/100 s on every processor */
+	return (double)(busy1 - busy0) * (NSEC_PER_SEC / 100) / *bytes;
+}
+
+T_DECL(net_gro_perf, "loopback bulk TCP receive CPU per byte, with and without GRO",
+    T_META_TAG_PERF)
+{
+	for (int on = 0; on <= 1; on++) {
+		uint64_t bytes;
+		double ns;
+		char name[64];
+
+		set_gro(on);
+		ns = bulk_receive(&bytes);
+		T_EXPECT_GT(bytes, 0ull, "gro %d: data received", on);
+		T_LOG("gro %d: %.1f MB/s, %.3f ns CPU per byte", on,
+		    (double)bytes / RUN_SECONDS / (1024 * 1024), ns);
+		snprintf(name, sizeof(name), "tcp_rx_ns_per_byte_gro_%s",
+		    on ? "on" : "off");
+		T_PERF(name, ns, "ns", "host CPU time per byte received");
+		snprintf(name, sizeof(name), "tcp_rx_mbps_gro_%s", on ? "on" : "off");
+		T_PERF(name, (double)bytes * 8 / RUN_SECONDS / 1000000, "Mbps",
+		    "bulk TCP receive throughput");
+	}
+}
@@ -0,0 +1,325 @@
+/*
+ * Software segmentation of TCP super-segments (net.link.generic.system.gso)
+ * on interfaces without TSO: bulk TCP over a utun whose reader reflects
+ * every packet back into the interface, and over a pair of fake ethernet
+ * interfaces; the stream is checked for integrity, and the CPU cost per
+ * byte sent is measured with and without GSO.
+ */
+#include <sys/ioctl.h>
+#include <sys/kern_control.h>
+#include <sys/socket.h>
+#include <sys/sys_domain.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <net/if_utun.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define FETH_TX         "feth7710"
+#define FETH_RX         "feth7711"
+#define TX_ADDR         "10.77.10.1"
+#define RX_ADDR         "10.77.10.2"
+#define UTUN_ADDR       "10.77.11.1"
+#define UTUN_PEER_ADDR  "10.77.11.2"
+#define BUF_SIZE        (128 * 1024)
+#define RUN_SECONDS     3
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+
+static void
+set_gso(int on)
+{
+	sysctl_set_int("net.link.generic.system.gso.enabled", on);
+}
+
+static uint64_t
+gso_packets(void)
+{
+	uint64_t packets = 0;
+	size_t size = sizeof(packets);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+		    "net.link.generic.system.gso.packets", &packets, &size, NULL, 0),
+	    "gso.packets");
+	return packets;
+}
+
+/*
+ * Busy CPU ticks of the host, summed over all processors.
+ */
+static uint64_t
+cpu_busy_ticks(void)
+{
+	host_cpu_load_info_data_t info;
+	mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(host_statistics(mach_host_self(),
+	    HOST_CPU_LOAD_INFO, (host_info_t)&info, &count), NULL);
+	return (uint64_t)info.cpu_ticks[CPU_STATE_USER] +
+	       info.cpu_ticks[CPU_STATE_SYSTEM] + info.cpu_ticks[CPU_STATE_NICE];
+}
+
+/*
+ * A utun interface in legacy mode, i.e. without a netif nexus, so that
+ * it is eligible for software GSO.
+ */
+static int
+utun_create(char *ifname, socklen_t ifnamelen)
+{
+	struct ctl_info info;
+	struct sockaddr_ctl addr;
+	int fd, s;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd = socket(PF_SYSTEM, SOCK_DGRAM,
+	    SYSPROTO_CONTROL), NULL);
+	bzero(&info, sizeof(info));
+	strlcpy(info.ctl_name, UTUN_CONTROL_NAME, sizeof(info.ctl_name));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, CTLIOCGINFO, &info), NULL);
+	bzero(&addr, sizeof(addr));
+	addr.sc_len = sizeof(addr);
+	addr.sc_family = AF_SYSTEM;
+	addr.ss_sysaddr = AF_SYS_CONTROL;
+	addr.sc_id = info.ctl_id;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fd, (struct sockaddr *)&addr,
+	    sizeof(addr)), "utun connect");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockopt(fd, SYSPROTO_CONTROL,
+	    UTUN_OPT_IFNAME, ifname, &ifnamelen), "UTUN_OPT_IFNAME");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	inet_ifaddr_add(s, ifname, UTUN_ADDR, UTUN_PEER_ADDR);
+	close(s);
+	return fd;
+}
+
+static atomic_bool running;
+
+/*
+ * Write every packet read from the utun back into it with the source
+ * and destination addresses swapped, which leaves the checksums valid:
+ * a connection from UTUN_ADDR:A to UTUN_PEER_ADDR:B is received by a
+ * listener on UTUN_ADDR:B as coming from UTUN_PEER_ADDR:A.
+ */
+static void *
+utun_reflect(void *arg)
+{
+	int fd = *(int *)arg;
+	static uint8_t buf[sizeof(uint32_t) + IP_MAXPACKET];
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		struct ip *ip = (struct ip *)(void *)(buf + sizeof(uint32_t));
+		struct in_addr a;
+
+		if (n < (ssize_t)(sizeof(uint32_t) + sizeof(*ip)) ||
+		    ip->ip_v != IPVERSION) {
+			continue;
+		}
+		a = ip->ip_src;
+		ip->ip_src = ip->ip_dst;
+		ip->ip_dst = a;
+		(void)send(fd, buf, (size_t)n, 0);
+	}
+	return NULL;
+}
+
+struct sender {
+	int             fd;
+	uint64_t        limit;          /* bytes to send, or 0 until stopped */
+};
+
+static void *
+sender_run(void *arg)
+{
+	struct sender *s = arg;
+	static uint8_t buf[BUF_SIZE];
+	uint64_t off = 0;
+
+	while (atomic_load_explicit(&running, memory_order_relaxed) &&
+	    (s->limit == 0 || off < s->limit)) {
+		size_t len = sizeof(buf);
+		ssize_t n;
+
+		if (s->limit != 0 && s->limit - off < len) {
+			len = (size_t)(s->limit - off);
+		}
+		for (size_t i = 0; i < len; i++) {
+			buf[i] = (uint8_t)((off + i) % 251);
+		}
+		n = send(s->fd, buf, len, 0);
+		if (n <= 0) {
+			break;
+		}
+		off += (uint64_t)n;
+	}
+	shutdown(s->fd, SHUT_WR);
+	return NULL;
+}
+
+T_DECL(net_gso_utun_integrity, "TCP over utun, segmented in software, is intact")
+{
+	char ifname[IFXNAMSIZ];
+	struct sender s = { .limit = 16 * 1024 * 1024 };
+	static uint8_t buf[BUF_SIZE];
+	uint64_t before, off = 0;
+	pthread_t sender, reflector;
+	int fd, rx;
+
+	set_gso(1);
+	fd = utun_create(ifname, sizeof(ifname));
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reflector, NULL,
+	    utun_reflect, &fd), NULL);
+	before = gso_packets();
+	inet_tcp_pair(UTUN_ADDR, UTUN_PEER_ADDR, UTUN_ADDR, NULL, NULL, NULL,
+	    &s.fd, &rx);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sender, NULL, sender_run, &s), NULL);
+
+	for (;;) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "recv");
+		if (n == 0) {
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] != (uint8_t)((off + (uint64_t)i) % 251)) {
+				T_ASSERT_FAIL("byte %llu corrupted", off + (uint64_t)i);
+			}
+		}
+		off += (uint64_t)n;
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sender, NULL), NULL);
+	T_EXPECT_EQ(off, s.limit, "received the whole stream over %s", ifname);
+	T_EXPECT_GT(gso_packets(), before, "super-segments were split");
+
+	atomic_store(&running, false);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reflector, NULL), NULL);
+	close(s.fd);
+	close(rx);
+	close(fd);
+}
+
+/*
+ * Bulk transfer for RUN_SECONDS; returns the host CPU time spent per
+ * byte sent, in nanoseconds.
+ */
+static double
+bulk_send(const char *src, const char *dst, const char *lst,
+    const char *ifname, uint64_t *bytes)
+{
+	struct sender s = { .limit = 0 };
+	static uint8_t buf[BUF_SIZE];
+	uint64_t busy0, busy1;
+	pthread_t thread;
+	time_t end;
+	int rx;
+
+	*bytes = 0;
+	inet_tcp_pair(src, dst, lst, ifname, NULL, NULL, &s.fd, &rx);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, sender_run, &s), NULL);
+
+	busy0 = cpu_busy_ticks();
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		*bytes += (uint64_t)n;
+	}
+	busy1 = cpu_busy_ticks();
+
+	/* stop the sender, not the utun reflector */
+	close(rx);
+	shutdown(s.fd, SHUT_RDWR);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+	close(s.fd);
+
+	if (*bytes == 0) {
+		return 0;
+	}
+	/* one tick is 1/100 s on every processor */
+	return (double)(busy1 - busy0) * (NSEC_PER_SEC / 100) / *bytes;
+}
+
+static void
+gso_perf(const char *name, const char *src, const char *dst, const char *lst,
+    const char *ifname)
+{
+	for (int on = 1; on >= 0; on--) {
+		uint64_t before = gso_packets(), bytes;
+		char metric[64];
+		double ns;
+
+		set_gso(on);
+		ns = bulk_send(src, dst, lst, ifname, &bytes);
+		T_EXPECT_GT(bytes, 0ull, "%s gso %d: data received", name, on);
+		if (on && gso_packets() == before) {
+			T_SKIP("%s: TCP did not send super-segments", name);
+		}
+		T_LOG("%s gso %d: %.1f MB/s, %.3f ns CPU per byte", name, on,
+		    (double)bytes / RUN_SECONDS / (1024 * 1024), ns);
+		snprintf(metric, sizeof(metric), "%s_tx_ns_per_byte_gso_%s", name,
+		    on ? "on" : "off");
+		T_PERF(metric, ns, "ns", "host CPU time per byte sent");
+		snprintf(metric, sizeof(metric), "%s_tx_mbps_gso_%s", name,
+		    on ? "on" : "off");
+		T_PERF(metric, (double)bytes * 8 / RUN_SECONDS / 1000000, "Mbps",
+		    "bulk TCP send throughput");
+	}
+}
+
+T_DECL(net_gso_utun_perf, "bulk TCP send CPU per byte over utun, with and without GSO",
+    T_META_TAG_PERF)
+{
+	char ifname[IFXNAMSIZ];
+	pthread_t reflector;
+	int fd;
+
+	set_gso(1);
+	fd = utun_create(ifname, sizeof(ifname));
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reflector, NULL,
+	    utun_reflect, &fd), NULL);
+
+	gso_perf("utun", UTUN_ADDR, UTUN_PEER_ADDR, UTUN_ADDR, NULL);
+
+	atomic_store(&running, false);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reflector, NULL), NULL);
+	close(fd);
+}
+
+/*
+ * The sending end is bound to FETH_TX, so that data leaves through it
+ * rather than through lo0, and is received on FETH_RX.
+ */
+T_DECL(net_gso_feth_perf, "bulk TCP send CPU per byte over feth, with and without GSO",
+    T_META_TAG_PERF)
+{
+	set_gso(1);
+	feth_pair_create(&pair);
+	atomic_store(&running, true);
+	gso_perf("feth", TX_ADDR, RX_ADDR, RX_ADDR, FETH_TX);
+	atomic_store(&running, false);
+}
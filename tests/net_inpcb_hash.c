@@ -0,0 +1,245 @@
+/*
+ * Scalability of the inpcb hash: loopback TCP connection churn from
+ * several threads at once, which inserts, rehashes and removes pcbs,
+ * and UDP receive spread over many connected flows, which looks one
+ * up per datagram.
+ */
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define RUN_SECONDS     3
+#define MAX_THREADS     8
+#define UDP_FLOWS       1024
+#define UDP_PAYLOAD     64
+
+static atomic_bool running;
+
+static int
+ncpus(void)
+{
+	int n = 1;
+	size_t size = sizeof(n);
+
+	(void)sysctlbyname("hw.activecpu", &n, &size, NULL, 0);
+	return n;
+}
+
+static void
+loopback(struct sockaddr_in *sin)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+struct churn {
+	struct sockaddr_in      sin;            /* the listener */
+	uint64_t                conns;
+};
+
+static void *
+churn_run(void *arg)
+{
+	struct churn *c = arg;
+	struct linger l = { .l_onoff = 1, .l_linger = 0 };
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		int s;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+		/* reset on close, so that TIME_WAIT does not exhaust the ports */
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(s, SOL_SOCKET, SO_LINGER,
+		    &l, sizeof(l)), "SO_LINGER");
+		if (connect(s, (struct sockaddr *)&c->sin, sizeof(c->sin)) == 0) {
+			c->conns++;
+		}
+		close(s);
+	}
+	return NULL;
+}
+
+static void *
+accept_run(void *arg)
+{
+	int ls = *(int *)arg;
+
+	for (;;) {
+		int s = accept(ls, NULL, NULL);
+
+		if (s < 0) {
+			break;
+		}
+		close(s);
+	}
+	return NULL;
+}
+
+T_DECL(net_inpcb_hash_churn_perf,
+    "loopback TCP connect/accept/close rate from concurrent threads",
+    T_META_TAG_PERF)
+{
+	struct churn churn[MAX_THREADS];
+	pthread_t threads[MAX_THREADS], acceptor;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int nthreads = ncpus() < MAX_THREADS ? ncpus() : MAX_THREADS;
+	uint64_t total = 0;
+	int ls;
+
+	loopback(&sin);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ls = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(ls, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin,
+	    &len), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(ls, 1024), NULL);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&acceptor, NULL, accept_run,
+	    &ls), NULL);
+
+	atomic_store(&running, true);
+	for (int i = 0; i < nthreads; i++) {
+		churn[i] = (struct churn){ .sin = sin };
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    churn_run, &churn[i]), NULL);
+	}
+	sleep(RUN_SECONDS);
+	atomic_store(&running, false);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+		total += churn[i].conns;
+	}
+	shutdown(ls, SHUT_RDWR);
+	close(ls);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(acceptor, NULL), NULL);
+
+	T_EXPECT_GT(total, 0ull, "connections were made");
+	T_LOG("%d threads: %.0f connections/s", nthreads,
+	    (double)total / RUN_SECONDS);
+	T_PERF("tcp_connections_per_sec", (double)total / RUN_SECONDS, "conn/s",
+	    "loopback connect, accept and close");
+}
+
+struct flows {
+	int                     rx[UDP_FLOWS];  /* bound and connected */
+	int                     tx[UDP_FLOWS];
+	int                     first;          /* of this receiver's flows */
+	int                     count;
+	uint64_t                packets;
+};
+
+static void *
+udp_send_run(void *arg)
+{
+	struct flows *f = arg;
+	uint8_t buf[UDP_PAYLOAD] = { 0 };
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		for (int i = 0; i < UDP_FLOWS; i++) {
+			(void)send(f->tx[i], buf, sizeof(buf), MSG_DONTWAIT);
+		}
+	}
+	return NULL;
+}
+
+static void *
+udp_recv_run(void *arg)
+{
+	struct flows *f = arg;
+	uint8_t buf[UDP_PAYLOAD];
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		for (int i = f->first; i < f->first + f->count; i++) {
+			while (recv(f->rx[i], buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+				f->packets++;
+			}
+		}
+	}
+	return NULL;
+}
+
+T_DECL(net_inpcb_hash_flows_perf,
+    "UDP receive rate spread over many connected loopback flows",
+    T_META_TAG_PERF)
+{
+	static struct flows flows;
+	struct flows rxs[MAX_THREADS];
+	pthread_t sender, threads[MAX_THREADS];
+	int nthreads = ncpus() < MAX_THREADS ? ncpus() : MAX_THREADS;
+	struct rlimit rl = { .rlim_cur = 4 * UDP_FLOWS, .rlim_max = 4 * UDP_FLOWS };
+	uint64_t total = 0;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl),
+	    "RLIMIT_NOFILE");
+	for (int i = 0; i < UDP_FLOWS; i++) {
+		struct sockaddr_in rsin, tsin;
+		socklen_t len = sizeof(rsin);
+
+		loopback(&rsin);
+		loopback(&tsin);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(flows.rx[i] = socket(AF_INET,
+		    SOCK_DGRAM, 0), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(flows.tx[i] = socket(AF_INET,
+		    SOCK_DGRAM, 0), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(flows.rx[i],
+		    (struct sockaddr *)&rsin, sizeof(rsin)), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(flows.rx[i],
+		    (struct sockaddr *)&rsin, &len), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(flows.tx[i],
+		    (struct sockaddr *)&tsin, sizeof(tsin)), NULL);
+		len = sizeof(tsin);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(flows.tx[i],
+		    (struct sockaddr *)&tsin, &len), NULL);
+		/* both ends connected, so every datagram is an exact match */
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(flows.rx[i],
+		    (struct sockaddr *)&tsin, sizeof(tsin)), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(flows.tx[i],
+		    (struct sockaddr *)&rsin, sizeof(rsin)), NULL);
+	}
+
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sender, NULL, udp_send_run,
+	    &flows), NULL);
+	for (int i = 0; i < nthreads; i++) {
+		rxs[i] = flows;
+		rxs[i].first = i * (UDP_FLOWS / nthreads);
+		rxs[i].count = UDP_FLOWS / nthreads;
+		rxs[i].packets = 0;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    udp_recv_run, &rxs[i]), NULL);
+	}
+	sleep(RUN_SECONDS);
+	atomic_store(&running, false);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sender, NULL), NULL);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+		total += rxs[i].packets;
+	}
+	for (int i = 0; i < UDP_FLOWS; i++) {
+		close(flows.rx[i]);
+		close(flows.tx[i]);
+	}
+
+	T_EXPECT_GT(total, 0ull, "datagrams were received");
+	T_LOG("%d flows, %d receivers: %.0f datagrams/s", UDP_FLOWS, nthreads,
+	    (double)total / RUN_SECONDS);
+	T_PERF("udp_flows_rx_pps", (double)total / RUN_SECONDS, "pkts/s",
+	    "UDP receive over many connected flows");
+}
@@ -0,0 +1,120 @@
+/*
+ * net_necp_policy_match: match sockets and outgoing packets against
+ * synthetic NECP tables of 1k to 16k policies, walking each table
+ * linearly, through its compiled index (net.necp.policy_compiler) and,
+ * for packets, through the flow cache (net.necp.flow_cache), and report
+ * the lookups per second of each.
+ */
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+static const char *knobs[] = {
+	"net.necp.policy_compiler",
+	"net.necp.flow_cache",
+};
+#define NKNOBS          (sizeof(knobs) / sizeof(knobs[0]))
+
+static int saved_knobs[NKNOBS];
+static int saved = 0;
+
+static void
+restore_knobs(void)
+{
+	for (size_t i = 0; saved && i < NKNOBS; i++) {
+		(void)sysctlbyname(knobs[i], NULL, NULL, &saved_knobs[i],
+		    sizeof(saved_knobs[i]));
+	}
+}
+
+static void
+set_knobs(int compiler, int cache)
+{
+	int values[NKNOBS] = { compiler, cache };
+
+	if (!saved) {
+		for (size_t i = 0; i < NKNOBS; i++) {
+			size_t size = sizeof(saved_knobs[i]);
+
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(knobs[i],
+			    &saved_knobs[i], &size, NULL, 0), "%s", knobs[i]);
+		}
+		saved = 1;
+		T_ATEND(restore_knobs);
+	}
+	for (size_t i = 0; i < NKNOBS; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(knobs[i], NULL, NULL,
+		    &values[i], sizeof(values[i])), "%s = %d", knobs[i], values[i]);
+	}
+}
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+static const int64_t policies[] = { 1000, 4000, 16000 };
+#define NPOLICIES       (sizeof(policies) / sizeof(policies[0]))
+
+static void
+run_match(const char *test, int compiler, int cache, const char *mode,
+    int64_t *rates)
+{
+	set_knobs(compiler, cache);
+	for (size_t i = 0; i < NPOLICIES; i++) {
+		char name[64];
+
+		rates[i] = run_sysctl_test(test, policies[i]);
+		T_EXPECT_GT(rates[i], 0ll, "%s %s, %lld policies: %lld lookups/s",
+		    test, mode, policies[i], rates[i]);
+		snprintf(name, sizeof(name), "%s_%s_%lld", test, mode, policies[i]);
+		T_PERF(name, (double)rates[i], "lookups/s",
+		    "NECP policy lookups per second");
+	}
+}
+
+T_DECL(necp_socket_match,
+    "socket policy matching rate, linear and compiled",
+    T_META_TAG_PERF)
+{
+	int64_t linear[NPOLICIES], compiled[NPOLICIES];
+
+	run_match("necp_socket_match", 0, 0, "linear", linear);
+	run_match("necp_socket_match", 1, 0, "compiled", compiled);
+	T_LOG("%lld policies: compiled matching runs at %.2fx the linear rate",
+	    policies[NPOLICIES - 1],
+	    (double)compiled[NPOLICIES - 1] / (double)MAX(linear[NPOLICIES - 1], 1));
+}
+
+T_DECL(necp_ip_output_match,
+    "IP output policy matching rate, linear, compiled and cached",
+    T_META_TAG_PERF)
+{
+	int64_t linear[NPOLICIES], compiled[NPOLICIES], cached[NPOLICIES];
+
+	run_match("necp_ip_output_match", 0, 0, "linear", linear);
+	run_match("necp_ip_output_match", 1, 0, "compiled", compiled);
+	run_match("necp_ip_output_match", 1, 1, "cached", cached);
+	T_LOG("%lld policies: compiled matching runs at %.2fx and cached at "
+	    "%.2fx the linear rate", policies[NPOLICIES - 1],
+	    (double)compiled[NPOLICIES - 1] / (double)MAX(linear[NPOLICIES - 1], 1),
+	    (double)cached[NPOLICIES - 1] / (double)MAX(linear[NPOLICIES - 1], 1));
+}
@@ -0,0 +1,85 @@
+/*
+ * net_pktsched_calq: report the packets per second sustained by the
+ * calendar queue that netem and dummynet schedule on, and by the two
+ * emulators themselves, from 1 to 10k pipes.
+ */
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+/* Run debug.test.<t> for each count, and report the packet rates */
+static void
+pps_sweep(const char *t, const int64_t *counts, size_t n, const char *what,
+    const char *desc)
+{
+	int64_t first = 0, pps = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		char name[64];
+
+		pps = run_sysctl_test(t, counts[i]);
+		T_EXPECT_GT(pps, 0ll, "%lld %s: %lld pps", counts[i], what, pps);
+		snprintf(name, sizeof(name), "%s_%lld_%s", t, counts[i], what);
+		T_PERF(name, (double)pps, "pps", desc);
+		if (i == 0) {
+			first = pps;
+		}
+	}
+	T_LOG("%lld %s run at %.2fx the packet rate of %lld",
+	    counts[n - 1], what, (double)pps / (double)MAX(first, 1),
+	    counts[0]);
+}
+
+T_DECL(pktsched_calq_pps,
+    "calendar queue packet rate against the number of pipes",
+    T_META_TAG_PERF)
+{
+	static const int64_t pipes[] = { 1, 10, 100, 1000, 10000 };
+
+	pps_sweep("calq_pps", pipes, sizeof(pipes) / sizeof(pipes[0]),
+	    "pipes", "packets scheduled through the calendar queue");
+}
+
+T_DECL(pktsched_dummynet_pps,
+    "dummynet packet rate against the number of pipes",
+    T_META_TAG_PERF)
+{
+	static const int64_t pipes[] = { 1, 10, 100, 1000, 10000 };
+
+	pps_sweep("dummynet_pps", pipes, sizeof(pipes) / sizeof(pipes[0]),
+	    "pipes", "packets through dummynet pipes with a 1ms delay");
+}
+
+T_DECL(pktsched_netem_pps,
+    "netem packet rate against the number of netem instances",
+    T_META_TAG_PERF)
+{
+	static const int64_t instances[] = { 1, 10, 100, 1000 };
+
+	pps_sweep("netem_pps", instances,
+	    sizeof(instances) / sizeof(instances[0]), "instances",
+	    "packets through netem instances");
+}
@@ -0,0 +1,256 @@
+/*
+ * SO_REUSEPORT_LB: loopback accept throughput with a listening socket
+ * in each of several processes sharing one port, how evenly the
+ * connections are spread among them, and that a closed listener stops
+ * being handed connections.
+ */
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#ifndef SO_REUSEPORT_LB
+#define SO_REUSEPORT_LB         0x80000
+#endif
+
+#define RUN_SECONDS     3
+#define MAX_LISTENERS   8
+#define MAX_THREADS     8
+#define CLOSE_CONNECTS  200
+
+static atomic_bool running;
+static volatile sig_atomic_t stopping;
+
+static int
+ncpus(void)
+{
+	int n = 1;
+	size_t size = sizeof(n);
+
+	(void)sysctlbyname("hw.activecpu", &n, &size, NULL, 0);
+	return n;
+}
+
+static void
+loopback(struct sockaddr_in *sin, in_port_t port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin->sin_port = port;
+}
+
+/* a free port, released again for the listeners to bind */
+static in_port_t
+free_port(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int s;
+
+	loopback(&sin, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(s, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(s, (struct sockaddr *)&sin,
+	    &len), NULL);
+	close(s);
+	return sin.sin_port;
+}
+
+static int
+lb_listen(in_port_t port)
+{
+	struct sockaddr_in sin;
+	int one = 1, s;
+
+	loopback(&sin, port);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(s, SOL_SOCKET,
+	    SO_REUSEPORT_LB, &one, sizeof(one)), "SO_REUSEPORT_LB");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(s, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(s, 1024), NULL);
+	return s;
+}
+
+static void
+stop_handler(int sig)
+{
+#pragma unused(sig)
+	stopping = 1;
+}
+
+/*
+ * A listener process: accept until told to stop, then report the count
+ * on the pipe.  The handler is installed without SA_RESTART so that the
+ * signal breaks accept() out.
+ */
+static void
+listener_run(in_port_t port, int fd)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	uint64_t accepts = 0;
+	int ls;
+
+	(void)sigaction(SIGUSR1, &sa, NULL);
+	ls = lb_listen(port);
+	(void)write(fd, &accepts, sizeof(accepts));
+	while (!stopping) {
+		int s = accept(ls, NULL, NULL);
+
+		if (s >= 0) {
+			accepts++;
+			close(s);
+		}
+	}
+	(void)write(fd, &accepts, sizeof(accepts));
+	_exit(0);
+}
+
+struct connector {
+	in_port_t               port;
+	uint64_t                conns;
+};
+
+static void *
+connect_run(void *arg)
+{
+	struct connector *c = arg;
+	struct linger l = { .l_onoff = 1, .l_linger = 0 };
+	struct sockaddr_in sin;
+
+	loopback(&sin, c->port);
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		int s;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+		/* reset on close, so that TIME_WAIT does not exhaust the ports */
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(s, SOL_SOCKET, SO_LINGER,
+		    &l, sizeof(l)), "SO_LINGER");
+		if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+			c->conns++;
+		}
+		close(s);
+	}
+	return NULL;
+}
+
+T_DECL(net_reuseport_lb_accept_perf,
+    "loopback accept rate and spread over SO_REUSEPORT_LB listener processes",
+    T_META_TAG_PERF)
+{
+	struct connector conns[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	pid_t pids[MAX_LISTENERS];
+	int fds[MAX_LISTENERS][2];
+	int nlisteners = ncpus() < MAX_LISTENERS ? ncpus() : MAX_LISTENERS;
+	int nthreads = ncpus() < MAX_THREADS ? ncpus() : MAX_THREADS;
+	uint64_t accepts[MAX_LISTENERS], total = 0, connected = 0;
+	in_port_t port = free_port();
+
+	if (nlisteners < 2) {
+		nlisteners = 2;
+	}
+	for (int i = 0; i < nlisteners; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds[i]), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pids[i] = fork(), NULL);
+		if (pids[i] == 0) {
+			close(fds[i][0]);
+			listener_run(port, fds[i][1]);
+		}
+		close(fds[i][1]);
+		/* wait for it to be listening */
+		T_QUIET; T_ASSERT_EQ(read(fds[i][0], &accepts[i],
+		    sizeof(accepts[i])), (ssize_t)sizeof(accepts[i]), NULL);
+	}
+
+	atomic_store(&running, true);
+	for (int i = 0; i < nthreads; i++) {
+		conns[i] = (struct connector){ .port = port };
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    connect_run, &conns[i]), NULL);
+	}
+	sleep(RUN_SECONDS);
+	atomic_store(&running, false);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+		connected += conns[i].conns;
+	}
+
+	for (int i = 0; i < nlisteners; i++) {
+		int status;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kill(pids[i], SIGUSR1), NULL);
+		T_QUIET; T_ASSERT_EQ(read(fds[i][0], &accepts[i],
+		    sizeof(accepts[i])), (ssize_t)sizeof(accepts[i]), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(waitpid(pids[i], &status, 0), NULL);
+		close(fds[i][0]);
+		total += accepts[i];
+	}
+
+	T_EXPECT_GT(connected, 0ull, "connections were made");
+	for (int i = 0; i < nlisteners; i++) {
+		T_LOG("listener %d: %llu accepts (%.1f%%)", i, accepts[i],
+		    total ? 100.0 * (double)accepts[i] / (double)total : 0.0);
+		/* a fair share is 1/n; allow for hash imbalance */
+		T_EXPECT_GT(accepts[i] * (uint64_t)nlisteners * 4, total,
+		    "listener %d got a share of the connections", i);
+	}
+	T_LOG("%d listeners, %d connectors: %.0f accepts/s", nlisteners,
+	    nthreads, (double)total / RUN_SECONDS);
+	T_PERF("tcp_lb_accepts_per_sec", (double)total / RUN_SECONDS, "conn/s",
+	    "loopback accept over SO_REUSEPORT_LB listeners");
+}
+
+T_DECL(net_reuseport_lb_close,
+    "connections are not steered to a closed SO_REUSEPORT_LB listener")
+{
+	struct linger l = { .l_onoff = 1, .l_linger = 0 };
+	struct sockaddr_in sin;
+	in_port_t port = free_port();
+	int ls1, ls2, refused = 0;
+
+	ls1 = lb_listen(port);
+	ls2 = lb_listen(port);
+	close(ls2);
+
+	loopback(&sin, port);
+	for (int i = 0; i < CLOSE_CONNECTS; i++) {
+		int s, as;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(s, SOL_SOCKET, SO_LINGER,
+		    &l, sizeof(l)), "SO_LINGER");
+		if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+			T_QUIET; T_EXPECT_EQ(errno, ECONNREFUSED, "connect");
+			refused++;
+		} else {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(as = accept(ls1, NULL, NULL),
+			    NULL);
+			close(as);
+		}
+		close(s);
+	}
+	close(ls1);
+
+	T_EXPECT_EQ(refused, 0, "%d connects all reached the remaining listener",
+	    CLOSE_CONNECTS);
+}
@@ -0,0 +1,302 @@
+/*
+ * Receive flow steering (net.link.generic.system.rx_steer_queues) on a
+ * pair of fake ethernet interfaces: broadcast UDP flows leave feth0 and
+ * are received on feth1, whose input is spread across input threads.
+ */
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <net/if_fake_var.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define FETH_TX         "feth7770"
+#define FETH_RX         "feth7771"
+#define STEER_MAX       16
+#define MAX_FLOWS       16
+#define RUN_SECONDS     3
+
+static int saved_queues = -1;
+
+static void
+ifnet_ioctl(int s, u_long cmd, const char *ifname, bool fail_on_error)
+{
+	struct ifreq ifr;
+
+	bzero(&ifr, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	if (ioctl(s, cmd, &ifr) != 0 && fail_on_error) {
+		T_ASSERT_FAIL("ioctl(%s, 0x%lx) failed", ifname, cmd);
+	}
+}
+
+static void
+ifnet_up(int s, const char *ifname)
+{
+	struct ifreq ifr;
+
+	bzero(&ifr, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCGIFFLAGS, &ifr), "SIOCGIFFLAGS");
+	ifr.ifr_flags |= IFF_UP;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFFLAGS, &ifr), "SIOCSIFFLAGS");
+}
+
+static void
+fake_set_peer(int s, const char *feth, const char *feth_peer)
+{
+	struct if_fake_request iffr;
+	struct ifdrv ifd;
+
+	bzero(&iffr, sizeof(iffr));
+	strlcpy(iffr.iffr_peer_name, feth_peer, sizeof(iffr.iffr_peer_name));
+	bzero(&ifd, sizeof(ifd));
+	strlcpy(ifd.ifd_name, feth, sizeof(ifd.ifd_name));
+	ifd.ifd_cmd = IF_FAKE_S_CMD_SET_PEER;
+	ifd.ifd_len = sizeof(iffr);
+	ifd.ifd_data = &iffr;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSDRVSPEC, &ifd),
+	    "set %s peer %s", feth, feth_peer);
+}
+
+static void
+set_addr(int s, const char *ifname, const char *addr)
+{
+	struct ifaliasreq ifra;
+	struct sockaddr_in *sin;
+
+	bzero(&ifra, sizeof(ifra));
+	strlcpy(ifra.ifra_name, ifname, sizeof(ifra.ifra_name));
+	sin = (struct sockaddr_in *)(void *)&ifra.ifra_addr;
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, addr, &sin->sin_addr);
+	sin = (struct sockaddr_in *)(void *)&ifra.ifra_mask;
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(IN_CLASSC_NET);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCAIFADDR, &ifra),
+	    "SIOCAIFADDR %s %s", ifname, addr);
+}
+
+static void
+destroy_feths(void)
+{
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (s >= 0) {
+		ifnet_ioctl(s, SIOCIFDESTROY, FETH_TX, false);
+		ifnet_ioctl(s, SIOCIFDESTROY, FETH_RX, false);
+		close(s);
+	}
+}
+
+static void
+cleanup(void)
+{
+	destroy_feths();
+	if (saved_queues != -1) {
+		(void)sysctlbyname("net.link.generic.system.rx_steer_queues",
+		    NULL, NULL, &saved_queues, sizeof(saved_queues));
+	}
+}
+
+/*
+ * The number of steering queues is picked up when an interface attaches,
+ * so (re)create the pair after setting it.
+ */
+static void
+setup_feths(int queues)
+{
+	size_t size = sizeof(saved_queues);
+	int s;
+
+	if (saved_queues == -1) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+			    "net.link.generic.system.rx_steer_queues", &saved_queues,
+			    &size, NULL, 0), "rx_steer_queues");
+		T_ATEND(cleanup);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(
+		    "net.link.generic.system.rx_steer_queues", NULL, NULL,
+		    &queues, sizeof(queues)), "rx_steer_queues = %d", queues);
+
+	destroy_feths();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	ifnet_ioctl(s, SIOCIFCREATE, FETH_TX, true);
+	ifnet_ioctl(s, SIOCIFCREATE, FETH_RX, true);
+	fake_set_peer(s, FETH_TX, FETH_RX);
+	ifnet_up(s, FETH_TX);
+	ifnet_up(s, FETH_RX);
+	ifnet_ioctl(s, SIOCPROTOATTACH, FETH_TX, true);
+	set_addr(s, FETH_TX, "10.77.70.1");
+	close(s);
+}
+
+static uint32_t
+steer_stats(uint64_t *counts)
+{
+	int mib[CTL_MAXNAME];
+	size_t miblen = CTL_MAXNAME - 1;
+	size_t len = STEER_MAX * sizeof(counts[0]);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlnametomib(
+		    "net.link.generic.system.rx_steer_stats", mib, &miblen), NULL);
+	mib[miblen] = (int)if_nametoindex(FETH_RX);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctl(mib, (u_int)miblen + 1, counts,
+	    &len, NULL, 0), "rx_steer_stats");
+	return (uint32_t)(len / sizeof(counts[0]));
+}
+
+static uint64_t
+rx_packets(void)
+{
+	struct ifaddrs *ifap, *ifa;
+	uint64_t packets = 0;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getifaddrs(&ifap), NULL);
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr != NULL && ifa->ifa_addr->sa_family == AF_LINK &&
+		    strcmp(ifa->ifa_name, FETH_RX) == 0 && ifa->ifa_data != NULL) {
+			packets = ((struct if_data *)ifa->ifa_data)->ifi_ipackets;
+		}
+	}
+	freeifaddrs(ifap);
+	return packets;
+}
+
+struct flow {
+	pthread_t       thread;
+	int             fd;
+	uint64_t        sent;
+};
+
+static struct flow flows[MAX_FLOWS];
+static atomic_bool running;
+
+/*
+ * Every socket has its own source port, so every socket is a flow.
+ */
+static void
+flow_open(struct flow *f)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_port = htons(7777),
+	};
+	unsigned int ifindex = if_nametoindex(FETH_TX);
+	int on = 1;
+
+	inet_pton(AF_INET, "10.77.70.255", &sin.sin_addr);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(f->fd = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(f->fd, SOL_SOCKET, SO_BROADCAST,
+	    &on, sizeof(on)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(f->fd, IPPROTO_IP, IP_BOUND_IF,
+	    &ifindex, sizeof(ifindex)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(f->fd, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	f->sent = 0;
+}
+
+static void *
+flow_run(void *arg)
+{
+	struct flow *f = arg;
+	char buf[64] = { 0 };
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		if (send(f->fd, buf, sizeof(buf), 0) == sizeof(buf)) {
+			f->sent++;
+		}
+	}
+	return NULL;
+}
+
+static double
+run_flows(int nflows, uint64_t *sent)
+{
+	uint64_t before = rx_packets();
+
+	*sent = 0;
+	for (int i = 0; i < nflows; i++) {
+		flow_open(&flows[i]);
+	}
+	atomic_store(&running, true);
+	for (int i = 0; i < nflows; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&flows[i].thread, NULL,
+		    flow_run, &flows[i]), NULL);
+	}
+	sleep(RUN_SECONDS);
+	atomic_store(&running, false);
+	for (int i = 0; i < nflows; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(flows[i].thread, NULL), NULL);
+		*sent += flows[i].sent;
+		close(flows[i].fd);
+	}
+	/* let the input threads drain */
+	sleep(1);
+	return (double)(rx_packets() - before) / RUN_SECONDS;
+}
+
+T_DECL(net_rx_steer_spread, "flows received on feth are spread across input threads")
+{
+	uint64_t counts[STEER_MAX], total = 0, sent;
+	uint32_t n, busy = 0;
+
+	if (dt_ncpu() < 2) {
+		T_SKIP("flow steering needs more than one processor");
+	}
+	setup_feths(4);
+	run_flows(MAX_FLOWS, &sent);
+
+	n = steer_stats(counts);
+	T_ASSERT_GT(n, 1u, "%u steering queues on %s", n, FETH_RX);
+	for (uint32_t i = 0; i < n; i++) {
+		T_LOG("queue %u: %llu packets", i, counts[i]);
+		total += counts[i];
+		busy += (counts[i] != 0);
+	}
+	T_EXPECT_GT(total, 0ull, "sent %llu, steered %llu packets", sent, total);
+	T_EXPECT_GT(busy, 1u, "%d flows used %u of %u queues", MAX_FLOWS, busy, n);
+}
+
+T_DECL(net_rx_steer_perf, "feth receive throughput with and without flow steering",
+    T_META_TAG_PERF)
+{
+	int ncpu = dt_ncpu();
+	int queues[] = { 0, 2, 4, 8 };
+
+	for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+		char name[64];
+		uint64_t sent;
+		double pps;
+
+		if (queues[i] > ncpu) {
+			break;
+		}
+		setup_feths(queues[i]);
+		pps = run_flows(MAX_FLOWS, &sent);
+		T_EXPECT_GT(pps, 0.0, "%d queues: traffic received", queues[i]);
+		T_LOG("%d queues: sent %llu, received %.0f packets/s", queues[i],
+		    sent, pps);
+		snprintf(name, sizeof(name), "rx_steer_pps_%d_queues", queues[i]);
+		T_PERF(name, pps, "pps", "packets received on feth per second");
+	}
+}
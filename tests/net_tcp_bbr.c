@@ -0,0 +1,324 @@
+/*
+ * BBR congestion control (net.inet.tcp.use_bbr) against CUBIC over an
+ * emulated long, shallow-buffered path: bulk TCP over a pair of fake
+ * ethernet interfaces, with the sending side's output going through
+ * netem with a bandwidth limit, a one way delay, a small queue and a
+ * little random loss.  Throughput and queueing delay (smoothed RTT above
+ * the minimum RTT) are reported for both, and the bandwidth BBR estimates
+ * from its delivery rate samples is checked against the emulated one.
+ */
+#include <sys/ioctl.h>
+#include <sys/kern_control.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <sys/sys_domain.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <net/if_private.h>
+#include <net/if_var_private.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_cc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define FETH_TX         "feth7720"
+#define FETH_RX         "feth7721"
+#define TX_ADDR         "10.77.20.1"
+#define RX_ADDR         "10.77.20.2"
+#define BUF_SIZE        (128 * 1024)
+#define RUN_SECONDS     10
+#define SAMPLE_MS       50
+
+/* the emulated path */
+#define PATH_BPS        (50ull * 1000 * 1000)
+#define PATH_DELAY_MS   20
+#define PATH_LOSS_P     50      /* 0.05%, in IF_NETEM_PARAMS_PSCALE */
+#define PATH_PACKETS    128     /* netem holds packets in flight and queued */
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+static atomic_bool running;
+
+/*
+ * Data leaves through netem on FETH_TX; the acks come back over
+ * FETH_RX undelayed.  netem keeps every packet it holds, in flight or
+ * queued, in a heap of net.pktsched.netem.heap_size entries and drops
+ * when it is full, which makes for a buffer of well under a BDP here.
+ */
+static void
+netem_setup(void)
+{
+	struct if_linkparamsreq iflpr;
+	int s;
+
+	sysctl_set_int("net.pktsched.netem.heap_size", PATH_PACKETS);
+
+	bzero(&iflpr, sizeof(iflpr));
+	strlcpy(iflpr.iflpr_name, FETH_TX, sizeof(iflpr.iflpr_name));
+	iflpr.iflpr_output_netem.ifnetem_model = IF_NETEM_MODEL_NLC;
+	iflpr.iflpr_output_netem.ifnetem_bandwidth_bps = PATH_BPS;
+	iflpr.iflpr_output_netem.ifnetem_latency_ms = PATH_DELAY_MS;
+	iflpr.iflpr_output_netem.ifnetem_loss_p_gr_gl = PATH_LOSS_P;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFLINKPARAMS, &iflpr),
+	    "netem on %s: %llu Mbps, %u ms, %u/%u loss", FETH_TX,
+	    PATH_BPS / 1000000, PATH_DELAY_MS, PATH_LOSS_P,
+	    IF_NETEM_PARAMS_PSCALE);
+	close(s);
+}
+
+static void *
+sender_run(void *arg)
+{
+	int fd = *(int *)arg;
+	static uint8_t buf[BUF_SIZE];
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		if (send(fd, buf, sizeof(buf), 0) <= 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+struct rtt_samples {
+	int             fd;
+	uint32_t        min_rtt_ms;     /* lowest RTT seen */
+	uint64_t        srtt_sum_ms;
+	uint64_t        count;
+	uint64_t        retransmitted;  /* bytes */
+};
+
+static void *
+sampler_run(void *arg)
+{
+	struct rtt_samples *rs = arg;
+
+	rs->min_rtt_ms = UINT32_MAX;
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		struct tcp_connection_info ci;
+		socklen_t len = sizeof(ci);
+
+		usleep(SAMPLE_MS * 1000);
+		if (getsockopt(rs->fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &ci,
+		    &len) != 0 || ci.tcpi_srtt == 0) {
+			continue;
+		}
+		if (ci.tcpi_rttcur != 0 && ci.tcpi_rttcur < rs->min_rtt_ms) {
+			rs->min_rtt_ms = ci.tcpi_rttcur;
+		}
+		rs->srtt_sum_ms += ci.tcpi_srtt;
+		rs->count++;
+		rs->retransmitted = ci.tcpi_txretransmitbytes;
+	}
+	return NULL;
+}
+
+static int
+cc_sockets(const char *name)
+{
+	char oid[64];
+	int n = 0;
+	size_t size = sizeof(n);
+
+	snprintf(oid, sizeof(oid), "net.inet.tcp.%s_sockets", name);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(oid, &n, &size, NULL, 0),
+	    "%s", oid);
+	return n;
+}
+
+/*
+ * One bulk transfer for RUN_SECONDS with the given congestion control;
+ * returns the goodput in Mbps and the mean queueing delay in ms.
+ */
+static void
+bulk_transfer(const char *cc, double *mbps, double *qdelay_ms)
+{
+	static uint8_t buf[BUF_SIZE];
+	struct rtt_samples rs = { 0 };
+	pthread_t sender, sampler;
+	uint64_t bytes = 0;
+	time_t end;
+	int tx, rx;
+
+	/* the congestion control is picked when the socket is created */
+	sysctl_set_int("net.inet.tcp.use_bbr", strcmp(cc, "bbr") == 0);
+	feth_pair_tcp(&pair, NULL, NULL, &tx, &rx);
+	T_EXPECT_GT(cc_sockets(cc), 0, "%s is in use", cc);
+
+	rs.fd = tx;
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sender, NULL, sender_run,
+	    &tx), NULL);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sampler, NULL, sampler_run,
+	    &rs), NULL);
+
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		bytes += (uint64_t)n;
+	}
+
+	atomic_store(&running, false);
+	close(rx);
+	shutdown(tx, SHUT_RDWR);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sender, NULL), NULL);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sampler, NULL), NULL);
+	close(tx);
+
+	*mbps = (double)bytes * 8 / RUN_SECONDS / 1000000;
+	*qdelay_ms = 0;
+	if (rs.count > 0 && rs.min_rtt_ms != UINT32_MAX) {
+		*qdelay_ms = (double)rs.srtt_sum_ms / (double)rs.count -
+		    (double)rs.min_rtt_ms;
+	}
+	T_LOG("%s: %.1f Mbps, min RTT %u ms, mean queueing delay %.1f ms, "
+	    "%llu bytes retransmitted", cc, *mbps, rs.min_rtt_ms, *qdelay_ms,
+	    rs.retransmitted);
+}
+
+T_DECL(net_tcp_bbr_netem_perf,
+    "BBR and CUBIC throughput and queueing delay over a lossy, shallow-buffered netem path",
+    T_META_TAG_PERF)
+{
+	const char *ccs[] = { "cubic", "bbr" };
+	double mbps[2], qdelay[2];
+
+	feth_pair_create(&pair);
+	netem_setup();
+
+	for (int i = 0; i < 2; i++) {
+		char metric[64];
+
+		bulk_transfer(ccs[i], &mbps[i], &qdelay[i]);
+		T_EXPECT_GT(mbps[i], 0.0, "%s moved data", ccs[i]);
+		snprintf(metric, sizeof(metric), "tcp_%s_netem_mbps", ccs[i]);
+		T_PERF(metric, mbps[i], "Mbps", "bulk TCP goodput over netem");
+		snprintf(metric, sizeof(metric), "tcp_%s_netem_qdelay_ms", ccs[i]);
+		T_PERF(metric, qdelay[i], "ms", "smoothed RTT above the minimum");
+	}
+	T_LOG("bbr/cubic: %.2fx throughput, queueing delay %.1f ms vs %.1f ms",
+	    mbps[0] > 0 ? mbps[1] / mbps[0] : 0.0, qdelay[1], qdelay[0]);
+}
+
+/*
+ * The bandwidth estimate BBR reports through the congestion control debug
+ * channel, one record per ack; a run has well under 64K acks.
+ */
+struct bw_samples {
+	int             ctl;
+	uint32_t        kbps[64 * 1024];
+	size_t          count;
+};
+
+static int
+ccdbg_open(void)
+{
+	struct ctl_info info;
+	struct sockaddr_ctl addr;
+	int fd, rcvbuf = 4 * 1024 * 1024;
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+
+	sysctl_set_int("net.inet.tcp.cc_debug", 1);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd = socket(PF_SYSTEM, SOCK_DGRAM,
+	    SYSPROTO_CONTROL), NULL);
+	bzero(&info, sizeof(info));
+	strlcpy(info.ctl_name, TCP_CC_CONTROL_NAME, sizeof(info.ctl_name));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, CTLIOCGINFO, &info),
+	    TCP_CC_CONTROL_NAME);
+	bzero(&addr, sizeof(addr));
+	addr.sc_len = sizeof(addr);
+	addr.sc_family = AF_SYSTEM;
+	addr.ss_sysaddr = AF_SYS_CONTROL;
+	addr.sc_id = info.ctl_id;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fd, (struct sockaddr *)&addr,
+	    sizeof(addr)), "connect to %s", TCP_CC_CONTROL_NAME);
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+	    &tv, sizeof(tv)), NULL);
+	return fd;
+}
+
+static void *
+ccdbg_run(void *arg)
+{
+	struct bw_samples *bs = arg;
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		struct tcp_cc_debug_state st;
+
+		if (recv(bs->ctl, &st, sizeof(st), 0) != sizeof(st) ||
+		    st.ccd_cc_index != TCP_CC_ALGO_BBR_INDEX ||
+		    st.u.bbr_state.ccd_bw_kbps == 0) {
+			continue;
+		}
+		if (bs->count < sizeof(bs->kbps) / sizeof(bs->kbps[0])) {
+			bs->kbps[bs->count++] = st.u.bbr_state.ccd_bw_kbps;
+		}
+	}
+	return NULL;
+}
+
+static int
+kbps_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+T_DECL(net_tcp_bbr_bw_estimate,
+    "BBR's delivery rate samples measure the bandwidth of a netem bottleneck")
+{
+	static struct bw_samples bs;
+	pthread_t reader;
+	double mbps, qdelay, est_mbps;
+	size_t half;
+
+	feth_pair_create(&pair);
+	netem_setup();
+	bs.ctl = ccdbg_open();
+
+	/* bulk_transfer() clears running when it is done */
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reader, NULL, ccdbg_run,
+	    &bs), NULL);
+	bulk_transfer("bbr", &mbps, &qdelay);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reader, NULL), NULL);
+	close(bs.ctl);
+
+	/* the estimate once past startup: the median of the later half */
+	T_ASSERT_GT(bs.count, (size_t)100, "%zu BBR debug records", bs.count);
+	half = bs.count / 2;
+	qsort(&bs.kbps[half], bs.count - half, sizeof(bs.kbps[0]), kbps_cmp);
+	est_mbps = (double)bs.kbps[half + (bs.count - half) / 2] / 1000;
+
+	/* a payload rate, as the bottleneck carries TCP/IP headers too */
+	T_LOG("BBR estimate %.1f Mbps, goodput %.1f Mbps, bottleneck %llu Mbps",
+	    est_mbps, mbps, PATH_BPS / 1000000);
+	T_EXPECT_GE(est_mbps, 0.8 * PATH_BPS / 1000000,
+	    "bandwidth estimate no less than 80%% of the bottleneck");
+	T_EXPECT_LE(est_mbps, 1.1 * PATH_BPS / 1000000,
+	    "bandwidth estimate no more than 110%% of the bottleneck");
+}
@@ -0,0 +1,373 @@
+/*
+ * TCP sender pacing (net.inet.tcp.pace_all, SO_MAX_PACING_RATE) over a
+ * pair of fake ethernet interfaces: the size of the bursts the sender
+ * puts on the wire, captured with bpf on the receiving side with the
+ * RTT added on the ack path, and the retransmission rate and goodput
+ * through a netem bottleneck with a shallow buffer, paced and unpaced.
+ */
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <net/bpf.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_private.h>
+#include <net/if_var_private.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "bpflib.h"
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE      0x1133
+#endif
+
+#define FETH_TX         "feth7730"
+#define FETH_RX         "feth7731"
+#define TX_ADDR         "10.77.30.1"
+#define RX_ADDR         "10.77.30.2"
+#define BUF_SIZE        (128 * 1024)
+#define BPF_BUFSIZE     (512 * 1024)
+#define RUN_SECONDS     5
+
+/* packets closer together than this belong to the same burst */
+#define BURST_GAP_US    20
+
+/* the ack path delay for the burst runs */
+#define ACK_DELAY_MS    20
+
+/* the bottleneck for the retransmission runs */
+#define PATH_BPS        (100ull * 1000 * 1000)
+#define PATH_DELAY_MS   10
+#define PATH_PACKETS    64
+
+/* SO_MAX_PACING_RATE for the capped runs, bytes per second */
+#define PACING_CAP      (2ull * 1000 * 1000)
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+static atomic_bool running;
+
+static void
+set_pace_all(int on)
+{
+	sysctl_set_int("net.inet.tcp.pace_all", on);
+}
+
+/* netem on the output of ifname, UINT64_MAX bps for no rate limit */
+static void
+netem_set(const char *ifname, uint64_t bps, uint32_t delay_ms)
+{
+	struct if_linkparamsreq iflpr;
+	int s;
+
+	bzero(&iflpr, sizeof(iflpr));
+	strlcpy(iflpr.iflpr_name, ifname, sizeof(iflpr.iflpr_name));
+	iflpr.iflpr_output_netem.ifnetem_model = IF_NETEM_MODEL_NLC;
+	iflpr.iflpr_output_netem.ifnetem_bandwidth_bps = bps;
+	iflpr.iflpr_output_netem.ifnetem_latency_ms = delay_ms;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFLINKPARAMS, &iflpr),
+	    "netem on %s: %u ms", ifname, delay_ms);
+	close(s);
+}
+
+static void
+set_max_pacing_rate(int fd, void *arg)
+{
+	uint64_t max_rate = *(uint64_t *)arg;
+
+	if (max_rate != 0) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, SOL_SOCKET,
+		    SO_MAX_PACING_RATE, &max_rate, sizeof(max_rate)),
+		    "SO_MAX_PACING_RATE");
+	}
+}
+
+static void *
+sender_run(void *arg)
+{
+	int fd = *(int *)arg;
+	static uint8_t buf[BUF_SIZE];
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		if (send(fd, buf, sizeof(buf), 0) <= 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+struct bursts {
+	int             fd;             /* bpf on the receiving interface */
+	uint64_t        last_us;        /* arrival of the previous data packet */
+	uint64_t        cur;            /* bytes in the burst so far */
+	uint64_t        count;
+	uint64_t        bytes;
+	uint64_t        max;
+};
+
+static void
+burst_end(struct bursts *b)
+{
+	if (b->cur == 0) {
+		return;
+	}
+	b->count++;
+	b->bytes += b->cur;
+	if (b->cur > b->max) {
+		b->max = b->cur;
+	}
+	b->cur = 0;
+}
+
+/* account one captured frame, if it is data from the sender */
+static void
+burst_packet(struct bursts *b, const struct bpf_hdr *bh)
+{
+	const uint8_t *frame = (const uint8_t *)bh + bh->bh_hdrlen;
+	const struct ether_header *eh = (const struct ether_header *)frame;
+	const struct ip *ip = (const struct ip *)(frame + sizeof(*eh));
+	const struct tcphdr *th;
+	struct in_addr src;
+	uint64_t now;
+	uint32_t payload;
+
+	if (bh->bh_caplen < sizeof(*eh) + sizeof(*ip) + sizeof(*th) ||
+	    ntohs(eh->ether_type) != ETHERTYPE_IP || ip->ip_p != IPPROTO_TCP) {
+		return;
+	}
+	inet_pton(AF_INET, TX_ADDR, &src);
+	if (ip->ip_src.s_addr != src.s_addr) {
+		return;
+	}
+	th = (const struct tcphdr *)((const uint8_t *)ip + (ip->ip_hl << 2));
+	payload = ntohs(ip->ip_len) - (ip->ip_hl << 2) - (th->th_off << 2);
+	if (payload == 0) {
+		return;
+	}
+
+	now = (uint64_t)bh->bh_tstamp.tv_sec * 1000000 + bh->bh_tstamp.tv_usec;
+	if (b->last_us != 0 && now - b->last_us > BURST_GAP_US) {
+		burst_end(b);
+	}
+	b->cur += payload;
+	b->last_us = now;
+}
+
+static void *
+capture_run(void *arg)
+{
+	struct bursts *b = arg;
+	uint8_t *buf = malloc(BPF_BUFSIZE);
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, NULL);
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		ssize_t n = read(b->fd, buf, BPF_BUFSIZE);
+
+		for (ssize_t off = 0; off < n;) {
+			const struct bpf_hdr *bh = (const struct bpf_hdr *)(buf + off);
+
+			burst_packet(b, bh);
+			off += BPF_WORDALIGN(bh->bh_hdrlen + bh->bh_caplen);
+		}
+	}
+	burst_end(b);
+	free(buf);
+	return NULL;
+}
+
+static int
+capture_open(void)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+	u_int blen = BPF_BUFSIZE;
+	int fd;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd = bpf_new(), "bpf_new");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, BIOCSBLEN, &blen), "BIOCSBLEN");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_setif(fd, FETH_RX), "bpf_setif");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_see_sent(fd, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_timeout(fd, &tv), NULL);
+	return fd;
+}
+
+struct result {
+	double          mbps;
+	double          rexmt_pct;      /* of the bytes sent */
+	double          mean_burst;     /* bytes, with a capture */
+	uint64_t        max_burst;
+};
+
+/*
+ * One bulk transfer for RUN_SECONDS, with a bpf capture of the bursts
+ * when capture is set.
+ */
+static void
+bulk_transfer(const char *name, bool capture, uint64_t max_rate,
+    struct result *r)
+{
+	static uint8_t buf[BUF_SIZE];
+	struct tcp_connection_info ci;
+	socklen_t len = sizeof(ci);
+	struct bursts b = { .fd = -1 };
+	pthread_t sender, capturer;
+	uint64_t bytes = 0;
+	time_t end;
+	int tx, rx;
+
+	feth_pair_tcp(&pair, set_max_pacing_rate, &max_rate, &tx, &rx);
+	if (capture) {
+		b.fd = capture_open();
+	}
+
+	atomic_store(&running, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sender, NULL, sender_run,
+	    &tx), NULL);
+	if (capture) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&capturer, NULL,
+		    capture_run, &b), NULL);
+	}
+
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		bytes += (uint64_t)n;
+	}
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockopt(tx, IPPROTO_TCP,
+	    TCP_CONNECTION_INFO, &ci, &len), "TCP_CONNECTION_INFO");
+	atomic_store(&running, false);
+	close(rx);
+	shutdown(tx, SHUT_RDWR);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sender, NULL), NULL);
+	if (capture) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(capturer, NULL), NULL);
+		close(b.fd);
+	}
+	close(tx);
+
+	bzero(r, sizeof(*r));
+	r->mbps = (double)bytes * 8 / RUN_SECONDS / 1000000;
+	if (ci.tcpi_txbytes != 0) {
+		r->rexmt_pct = 100.0 * (double)ci.tcpi_txretransmitbytes /
+		    (double)ci.tcpi_txbytes;
+	}
+	if (b.count != 0) {
+		r->mean_burst = (double)b.bytes / (double)b.count;
+		r->max_burst = b.max;
+	}
+	T_LOG("%s: %.1f Mbps, %.3f%% retransmitted, srtt %u ms", name, r->mbps,
+	    r->rexmt_pct, ci.tcpi_srtt);
+	if (capture) {
+		T_LOG("%s: %llu bursts, mean %.0f bytes, max %llu bytes", name,
+		    b.count, r->mean_burst, r->max_burst);
+	}
+}
+
+T_DECL(net_tcp_pacing_sockopt,
+    "SO_MAX_PACING_RATE is kept per socket and rejects negative rates")
+{
+	int64_t rate = (int64_t)PACING_CAP, bad = -1;
+	uint64_t got = 0;
+	socklen_t len = sizeof(got);
+	int s;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0), NULL);
+	T_ASSERT_POSIX_SUCCESS(setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE,
+	    &rate, sizeof(rate)), "SO_MAX_PACING_RATE %lld", rate);
+	T_ASSERT_POSIX_SUCCESS(getsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE,
+	    &got, &len), NULL);
+	T_EXPECT_EQ(got, (uint64_t)rate, "rate read back");
+	T_EXPECT_POSIX_FAILURE(setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE,
+	    &bad, sizeof(bad)), EINVAL, "negative rate");
+	close(s);
+}
+
+T_DECL(net_tcp_pacing_bursts_perf,
+    "size of TCP send bursts with and without pacing, with a 20 ms RTT",
+    T_META_TAG_PERF)
+{
+	struct result unpaced, paced, capped;
+
+	feth_pair_create(&pair);
+	/*
+	 * Delay the acks only, without a rate limit, so that arrivals at
+	 * the receiver mirror the sends.
+	 */
+	netem_set(FETH_RX, UINT64_MAX, ACK_DELAY_MS);
+
+	set_pace_all(0);
+	bulk_transfer("unpaced", true, 0, &unpaced);
+	set_pace_all(1);
+	bulk_transfer("pace_all", true, 0, &paced);
+	set_pace_all(0);
+	bulk_transfer("SO_MAX_PACING_RATE", true, PACING_CAP, &capped);
+
+	T_EXPECT_GT(unpaced.mbps, 0.0, "unpaced moved data");
+	T_EXPECT_GT(paced.mbps, 0.0, "paced moved data");
+	/* allow for the segments released up to the pacer's slop early */
+	T_EXPECT_LE(capped.mbps, (double)PACING_CAP * 8 * 1.25 / 1000000,
+	    "SO_MAX_PACING_RATE holds the sender to %llu bytes/s", PACING_CAP);
+
+	T_PERF("tcp_unpaced_mean_burst", unpaced.mean_burst, "bytes",
+	    "mean back-to-back data on the wire, unpaced");
+	T_PERF("tcp_unpaced_max_burst", (double)unpaced.max_burst, "bytes",
+	    "largest back-to-back data on the wire, unpaced");
+	T_PERF("tcp_paced_mean_burst", paced.mean_burst, "bytes",
+	    "mean back-to-back data on the wire, paced at cwnd/srtt");
+	T_PERF("tcp_paced_max_burst", (double)paced.max_burst, "bytes",
+	    "largest back-to-back data on the wire, paced at cwnd/srtt");
+	T_PERF("tcp_capped_mean_burst", capped.mean_burst, "bytes",
+	    "mean back-to-back data on the wire, SO_MAX_PACING_RATE");
+}
+
+T_DECL(net_tcp_pacing_retransmits_perf,
+    "TCP retransmissions and goodput through a shallow netem bottleneck, with and without pacing",
+    T_META_TAG_PERF)
+{
+	struct result unpaced, paced;
+
+	feth_pair_create(&pair);
+	sysctl_set_int("net.pktsched.netem.heap_size", PATH_PACKETS);
+	netem_set(FETH_TX, PATH_BPS, PATH_DELAY_MS);
+
+	set_pace_all(0);
+	bulk_transfer("unpaced", false, 0, &unpaced);
+	set_pace_all(1);
+	bulk_transfer("pace_all", false, 0, &paced);
+
+	T_EXPECT_GT(unpaced.mbps, 0.0, "unpaced moved data");
+	T_EXPECT_GT(paced.mbps, 0.0, "paced moved data");
+	T_PERF("tcp_unpaced_rexmt_pct", unpaced.rexmt_pct, "%",
+	    "bytes retransmitted through a shallow bottleneck, unpaced");
+	T_PERF("tcp_paced_rexmt_pct", paced.rexmt_pct, "%",
+	    "bytes retransmitted through a shallow bottleneck, paced");
+	T_PERF("tcp_unpaced_netem_mbps", unpaced.mbps, "Mbps",
+	    "goodput through a shallow bottleneck, unpaced");
+	T_PERF("tcp_paced_netem_mbps", paced.mbps, "Mbps",
+	    "goodput through a shallow bottleneck, paced");
+}
@@ -0,0 +1,291 @@
+/*
+ * RACK-TLP loss detection (net.inet.tcp.rack) against the duplicate ack
+ * based recovery, over a pair of fake ethernet interfaces with netem on
+ * the data path: bytes retransmitted when packets are only reordered
+ * (all of them spurious), completion time and retransmissions with
+ * random loss, and the latency of short request/response exchanges
+ * whose tail segments get lost.
+ */
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <net/if.h>
+#include <net/if_private.h>
+#include <net/if_var_private.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define FETH_TX         "feth7740"
+#define FETH_RX         "feth7741"
+#define TX_ADDR         "10.77.40.1"
+#define RX_ADDR         "10.77.40.2"
+#define BUF_SIZE        (128 * 1024)
+#define PATH_PACKETS    256     /* netem heap: packets in flight and queued */
+
+/* the bulk runs */
+#define BULK_BYTES      (64 * 1024 * 1024)
+#define BULK_BPS        (100ull * 1000 * 1000)
+#define BULK_DELAY_MS   10
+#define REORDER_JITTER_MS 3
+#define REORDER_P       2000    /* 2%, in IF_NETEM_PARAMS_PSCALE */
+#define LOSS_P          1000    /* 1% */
+
+/* the request/response runs */
+#define RR_COUNT        200
+#define RR_BYTES        (32 * 1024)
+#define RR_LOSS_P       2000    /* 2% */
+
+static const feth_pair pair = { FETH_TX, FETH_RX, TX_ADDR, RX_ADDR };
+
+static void
+set_rack(int on)
+{
+	sysctl_set_int("net.inet.tcp.rack", on);
+}
+
+static void
+feth_setup(void)
+{
+	feth_pair_create(&pair);
+	sysctl_set_int("net.pktsched.netem.heap_size", PATH_PACKETS);
+}
+
+/*
+ * netem on the data path.  A packet picked for reordering does not hold
+ * back the ones after it, so with jitter they can overtake it.
+ */
+static void
+netem_set(uint64_t bps, uint32_t delay_ms, uint32_t jitter_ms,
+    uint32_t reorder_p, uint32_t loss_p)
+{
+	struct if_linkparamsreq iflpr;
+	int s;
+
+	bzero(&iflpr, sizeof(iflpr));
+	strlcpy(iflpr.iflpr_name, FETH_TX, sizeof(iflpr.iflpr_name));
+	iflpr.iflpr_output_netem.ifnetem_model = IF_NETEM_MODEL_NLC;
+	iflpr.iflpr_output_netem.ifnetem_bandwidth_bps = bps;
+	iflpr.iflpr_output_netem.ifnetem_latency_ms = delay_ms;
+	iflpr.iflpr_output_netem.ifnetem_jitter_ms = jitter_ms;
+	iflpr.iflpr_output_netem.ifnetem_reordering_p = reorder_p;
+	iflpr.iflpr_output_netem.ifnetem_loss_p_gr_gl = loss_p;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_ASSERT_POSIX_SUCCESS(ioctl(s, SIOCSIFLINKPARAMS, &iflpr),
+	    "netem on %s: %u ms, jitter %u ms, reorder %u, loss %u (of %u)", FETH_TX,
+	    delay_ms, jitter_ms, reorder_p, loss_p, IF_NETEM_PARAMS_PSCALE);
+	close(s);
+}
+
+static void
+set_nodelay(int fd, void *arg)
+{
+#pragma unused(arg)
+	int on = 1;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+	    &on, sizeof(on)), "TCP_NODELAY");
+}
+
+static uint64_t
+retransmitted_bytes(int fd)
+{
+	struct tcp_connection_info ci;
+	socklen_t len = sizeof(ci);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockopt(fd, IPPROTO_TCP,
+	    TCP_CONNECTION_INFO, &ci, &len), "TCP_CONNECTION_INFO");
+	return ci.tcpi_txretransmitbytes;
+}
+
+static void *
+bulk_sender_run(void *arg)
+{
+	int fd = *(int *)arg;
+	static uint8_t buf[BUF_SIZE];
+	uint64_t left = BULK_BYTES;
+
+	while (left > 0) {
+		ssize_t n = send(fd, buf, MIN(left, sizeof(buf)), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		left -= (uint64_t)n;
+	}
+	return NULL;
+}
+
+/* BULK_BYTES over one connection; the seconds it took, and retransmissions */
+static void
+bulk_transfer(int rack, double *secs, uint64_t *rexmit)
+{
+	static uint8_t buf[BUF_SIZE];
+	pthread_t sender;
+	uint64_t bytes = 0, start;
+	int tx, rx;
+
+	set_rack(rack);
+	feth_pair_tcp(&pair, set_nodelay, NULL, &tx, &rx);
+
+	start = clock_gettime_nsec_np(CLOCK_MONOTONIC);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&sender, NULL,
+	    bulk_sender_run, &tx), NULL);
+	while (bytes < BULK_BYTES) {
+		ssize_t n = recv(rx, buf, sizeof(buf), 0);
+
+		if (n <= 0) {
+			break;
+		}
+		bytes += (uint64_t)n;
+	}
+	*secs = (double)(clock_gettime_nsec_np(CLOCK_MONOTONIC) - start) / 1e9;
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(sender, NULL), NULL);
+	T_QUIET; T_ASSERT_EQ(bytes, (uint64_t)BULK_BYTES, "all data arrived");
+	*rexmit = retransmitted_bytes(tx);
+	close(rx);
+	close(tx);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * RR_COUNT exchanges of RR_BYTES out and one byte back; the
+ * median and the 99th percentile time of an exchange in ms.
+ */
+static void
+request_response(int rack, double *p50_ms, double *p99_ms, uint64_t *rexmit)
+{
+	static uint8_t buf[RR_BYTES];
+	uint64_t times[RR_COUNT];
+	int tx, rx;
+
+	set_rack(rack);
+	feth_pair_tcp(&pair, set_nodelay, NULL, &tx, &rx);
+
+	for (int i = 0; i < RR_COUNT; i++) {
+		uint64_t start = clock_gettime_nsec_np(CLOCK_MONOTONIC);
+		size_t got = 0;
+		uint8_t c = 0;
+
+		T_QUIET; T_ASSERT_EQ(send(tx, buf, sizeof(buf), 0),
+		    (ssize_t)sizeof(buf), NULL);
+		while (got < sizeof(buf)) {
+			ssize_t n = recv(rx, buf, sizeof(buf) - got, 0);
+
+			T_QUIET; T_ASSERT_GT(n, 0L, "recv");
+			got += (size_t)n;
+		}
+		T_QUIET; T_ASSERT_EQ(send(rx, &c, 1, 0), 1L, NULL);
+		T_QUIET; T_ASSERT_EQ(recv(tx, &c, 1, 0), 1L, NULL);
+		times[i] = clock_gettime_nsec_np(CLOCK_MONOTONIC) - start;
+	}
+	*rexmit = retransmitted_bytes(tx);
+	close(rx);
+	close(tx);
+
+	qsort(times, RR_COUNT, sizeof(times[0]), cmp_u64);
+	*p50_ms = (double)times[RR_COUNT / 2] / 1e6;
+	*p99_ms = (double)times[RR_COUNT * 99 / 100] / 1e6;
+}
+
+T_DECL(net_tcp_rack_reordering_perf,
+    "spurious retransmissions with and without RACK when netem reorders packets",
+    T_META_TAG_PERF)
+{
+	double secs[2];
+	uint64_t rexmit[2];
+
+	feth_setup();
+	netem_set(BULK_BPS, BULK_DELAY_MS, REORDER_JITTER_MS, REORDER_P, 0);
+
+	for (int rack = 0; rack < 2; rack++) {
+		bulk_transfer(rack, &secs[rack], &rexmit[rack]);
+		T_LOG("rack %d: %.2f s, %llu bytes retransmitted (all spurious)",
+		    rack, secs[rack], rexmit[rack]);
+	}
+	T_PERF("tcp_reorder_rexmit_bytes_dupack", (double)rexmit[0], "bytes",
+	    "spurious retransmissions under reordering, dupack recovery");
+	T_PERF("tcp_reorder_rexmit_bytes_rack", (double)rexmit[1], "bytes",
+	    "spurious retransmissions under reordering, RACK");
+	T_PERF("tcp_reorder_secs_rack", secs[1], "s",
+	    "bulk transfer time under reordering, RACK");
+	T_LOG("RACK/dupack spurious retransmissions: %.2f",
+	    rexmit[0] > 0 ? (double)rexmit[1] / (double)rexmit[0] : 0.0);
+	T_EXPECT_GT(rexmit[0], 0ull,
+	    "dupack recovery retransmitted reordered segments");
+	T_EXPECT_LT(rexmit[1], rexmit[0],
+	    "RACK avoided spurious retransmissions the dupack recovery made");
+}
+
+T_DECL(net_tcp_rack_loss_perf,
+    "bulk transfer time and retransmissions with and without RACK under random loss",
+    T_META_TAG_PERF)
+{
+	double secs[2];
+	uint64_t rexmit[2];
+
+	feth_setup();
+	netem_set(BULK_BPS, BULK_DELAY_MS, 0, 0, LOSS_P);
+
+	for (int rack = 0; rack < 2; rack++) {
+		bulk_transfer(rack, &secs[rack], &rexmit[rack]);
+		T_EXPECT_GT(rexmit[rack], 0ull, "rack %d recovered from losses",
+		    rack);
+		T_LOG("rack %d: %.2f s (%.1f Mbps), %llu bytes retransmitted",
+		    rack, secs[rack], BULK_BYTES * 8 / secs[rack] / 1e6,
+		    rexmit[rack]);
+	}
+	T_PERF("tcp_loss_secs_dupack", secs[0], "s",
+	    "bulk transfer time with 1% loss, dupack recovery");
+	T_PERF("tcp_loss_secs_rack", secs[1], "s",
+	    "bulk transfer time with 1% loss, RACK");
+	T_PERF("tcp_loss_rexmit_bytes_rack", (double)rexmit[1], "bytes",
+	    "retransmissions with 1% loss, RACK");
+}
+
+T_DECL(net_tcp_rack_tail_loss_perf,
+    "request/response latency with and without RACK when tail segments are lost",
+    T_META_TAG_PERF)
+{
+	double p50[2], p99[2];
+	uint64_t rexmit[2];
+
+	feth_setup();
+	netem_set(UINT64_MAX, BULK_DELAY_MS, 0, 0, RR_LOSS_P);
+
+	for (int rack = 0; rack < 2; rack++) {
+		request_response(rack, &p50[rack], &p99[rack], &rexmit[rack]);
+		T_LOG("rack %d: %d exchanges of %d bytes, median %.1f ms, "
+		    "p99 %.1f ms, %llu bytes retransmitted", rack, RR_COUNT,
+		    RR_BYTES, p50[rack], p99[rack], rexmit[rack]);
+	}
+	T_PERF("tcp_tail_loss_p99_ms_dupack", p99[0], "ms",
+	    "99th percentile exchange time with 2% loss, dupack recovery");
+	T_PERF("tcp_tail_loss_p99_ms_rack", p99[1], "ms",
+	    "99th percentile exchange time with 2% loss, RACK");
+	T_EXPECT_GT(p50[1], 0.0, "exchanges completed");
+}
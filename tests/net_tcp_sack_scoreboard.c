@@ -0,0 +1,76 @@
+/*
+ * net_tcp_sack_scoreboard: replay a SACK recovery episode against
+ * scoreboards of increasing size and report the cost of each ACK.
+ */
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define SACK_MAXHOLES   "net.inet.tcp.sack_maxholes"
+
+static int saved_maxholes = -1;
+
+static void
+restore_maxholes(void)
+{
+	if (saved_maxholes != -1) {
+		sysctlbyname(SACK_MAXHOLES, NULL, NULL, &saved_maxholes,
+		    sizeof(saved_maxholes));
+	}
+}
+
+static void
+raise_maxholes(int value)
+{
+	size_t len = sizeof(saved_maxholes);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(SACK_MAXHOLES,
+	    &saved_maxholes, &len, &value, sizeof(value)), SACK_MAXHOLES);
+	T_ATEND(restore_maxholes);
+}
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+T_DECL(tcp_sack_scoreboard_replay,
+    "ACK processing cost against the number of SACK holes",
+    T_META_TAG_PERF)
+{
+	static const int64_t holes[] = { 16, 64, 256, 1024, 4096, 16384 };
+	int64_t ns[sizeof(holes) / sizeof(holes[0])];
+	const size_t n = sizeof(holes) / sizeof(holes[0]);
+
+	raise_maxholes(16384);
+
+	for (size_t i = 0; i < n; i++) {
+		char name[64];
+
+		ns[i] = run_sysctl_test("tcp_sack_replay", holes[i]);
+		T_EXPECT_GE(ns[i], 0ll, "%lld holes: %lld ns/ack", holes[i], ns[i]);
+		snprintf(name, sizeof(name), "tcp_sack_ack_%lld_holes", holes[i]);
+		T_PERF(name, (double)ns[i], "ns", "tcp_sack_doack() cost per ACK");
+	}
+	T_LOG("%lld holes cost %.1fx as much per ack as %lld holes",
+	    holes[n - 1], (double)ns[n - 1] / (double)MAX(ns[0], 1),
+	    holes[0]);
+}
@@ -0,0 +1,568 @@
+/*
+ * net_tcp_timewait: compact TIME_WAIT (net.inet.tcp.tw_compact).
+ *
+ * The functional tests take the part of the client over a utun: they
+ * write the segments of a connection to a listener on the utun address
+ * into the interface and read back what the server sends, close the
+ * connection from the server so that it goes to compact TIME_WAIT, and
+ * then check how the entry answers retransmitted FINs, RSTs, SYNs for a
+ * new incarnation and duplicate segments.
+ *
+ * The performance test churns short loopback connections that the
+ * server closes first, with and without compact TIME_WAIT, and reports
+ * the connection rate and the kernel memory held per connection in
+ * TIME_WAIT.
+ */
+
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/kern_control.h>
+#include <sys/socket.h>
+#include <sys/sys_domain.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <net/if_utun.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <mach/mach.h>
+#include <mach_debug/mach_debug.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+
+#include "feth_pair.h"
+#include "in_cksum.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define TW_COMPACT      "net.inet.tcp.tw_compact"
+#define TW_COUNT        "net.inet.tcp.tw_compact_count"
+#define CHURN_CONNS     10000
+
+#define UTUN_ADDR       "10.77.45.1"    /* the server */
+#define UTUN_PEER_ADDR  "10.77.45.2"    /* the client, played by the test */
+#define PEER_ISS        0x10000000
+#define PEER_TSVAL      1000
+#define REPLY_WAIT_MS   500
+#define DUP_SEGMENTS    16
+
+static int saved_compact = -1;
+
+static void
+restore_compact(void)
+{
+	if (saved_compact != -1) {
+		sysctlbyname(TW_COMPACT, NULL, NULL, &saved_compact,
+		    sizeof(saved_compact));
+	}
+}
+
+static void
+set_compact(int on)
+{
+	size_t len = sizeof(saved_compact);
+
+	if (saved_compact == -1) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(TW_COMPACT,
+		    &saved_compact, &len, NULL, 0), TW_COMPACT);
+		T_ATEND(restore_compact);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(TW_COMPACT, NULL, NULL,
+	    &on, sizeof(on)), TW_COMPACT " = %d", on);
+}
+
+static uint32_t
+read_count(const char *name)
+{
+	uint32_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len,
+	    NULL, 0), "%s", name);
+	return value;
+}
+
+/* Bytes in use across all the kernel zones. */
+static uint64_t
+zone_bytes(void)
+{
+	mach_zone_name_array_t names;
+	mach_zone_info_array_t info;
+	mach_memory_info_array_t wired;
+	mach_msg_type_number_t nnames, ninfo, nwired;
+	uint64_t total = 0;
+	kern_return_t kr;
+
+	kr = mach_memory_info(mach_host_self(), &names, &nnames, &info,
+	    &ninfo, &wired, &nwired);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_memory_info");
+	for (mach_msg_type_number_t i = 0; i < ninfo; i++) {
+		total += info[i].mzi_cur_size;
+	}
+	vm_deallocate(mach_task_self(), (vm_address_t)names,
+	    nnames * sizeof(*names));
+	vm_deallocate(mach_task_self(), (vm_address_t)info,
+	    ninfo * sizeof(*info));
+	vm_deallocate(mach_task_self(), (vm_address_t)wired,
+	    nwired * sizeof(*wired));
+	return total;
+}
+
+static int
+make_listener(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int s;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_STREAM, 0),
+	    "socket");
+	bzero(sin, sizeof(*sin));
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(s, (struct sockaddr *)sin,
+	    sizeof(*sin)), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(s, (struct sockaddr *)sin,
+	    &len), "getsockname");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(s, 128), "listen");
+	return s;
+}
+
+/*
+ * Open and tear down n connections, the server closing first so that
+ * its side goes to TIME_WAIT.  Returns the connections per second.
+ */
+static double
+churn(int lfd, const struct sockaddr_in *sin, int n)
+{
+	struct timespec start, end;
+	char c;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < n; i++) {
+		int cfd, sfd;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(cfd = socket(AF_INET,
+		    SOCK_STREAM, 0), "socket");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(cfd,
+		    (const struct sockaddr *)sin, sizeof(*sin)), "connect");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sfd = accept(lfd, NULL, NULL),
+		    "accept");
+		close(sfd);
+		T_QUIET; T_ASSERT_EQ(read(cfd, &c, 1), 0l, "EOF from server");
+		close(cfd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return n / ((end.tv_sec - start.tv_sec) +
+	       (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void
+run(int compact)
+{
+	const char *mode = compact ? "compact" : "full";
+	struct sockaddr_in sin;
+	uint64_t before, after;
+	uint32_t tw_before, tw_after;
+	const char *counter;
+	double rate;
+	char name[64];
+	int lfd;
+
+	set_compact(compact);
+	counter = compact ? TW_COUNT :
+	    "net.inet.tcp.tw_pcbcount";
+	lfd = make_listener(&sin);
+
+	tw_before = read_count(counter);
+	before = zone_bytes();
+	rate = churn(lfd, &sin, CHURN_CONNS);
+	/* let the pcbs that compact TIME_WAIT released be collected */
+	sleep(2);
+	after = zone_bytes();
+	tw_after = read_count(counter);
+	close(lfd);
+
+	T_EXPECT_GE(tw_after - tw_before, (uint32_t)(CHURN_CONNS * 9 / 10),
+	    "%s: %u more connections in TIME_WAIT", mode,
+	    tw_after - tw_before);
+
+	snprintf(name, sizeof(name), "tcp_tw_%s_conn_rate", mode);
+	T_PERF(name, rate, "conn/s", "server-closed loopback connections");
+	snprintf(name, sizeof(name), "tcp_tw_%s_bytes_per_conn", mode);
+	T_PERF(name, (double)(int64_t)(after - before) / CHURN_CONNS, "bytes",
+	    "zone memory held per connection in TIME_WAIT");
+	T_LOG("%s TIME_WAIT: %.0f conn/s, %.0f bytes per connection", mode,
+	    rate, (double)(int64_t)(after - before) / CHURN_CONNS);
+}
+
+/*
+ * The client end of a connection to a listener on UTUN_ADDR, whose
+ * segments go through the utun.  Ports are in network order.
+ */
+struct tw_conn {
+	int             fd;             /* the utun */
+	int             lfd;            /* the listener */
+	struct in_addr  laddr;
+	struct in_addr  faddr;
+	in_port_t       lport;
+	in_port_t       fport;
+	bool            ts;             /* timestamps negotiated */
+	tcp_seq         snd_nxt;
+	tcp_seq         rcv_nxt;
+	uint32_t        tsval;          /* the client's clock */
+	uint32_t        ts_recent;      /* the server's last timestamp */
+};
+
+/* A segment from the server */
+struct tw_seg {
+	uint8_t         flags;
+	tcp_seq         seq;
+	tcp_seq         ack;
+	bool            ts;
+	uint32_t        tsval;
+	uint32_t        tsecr;
+};
+
+static int
+utun_create(void)
+{
+	char ifname[IFXNAMSIZ];
+	socklen_t ifnamelen = sizeof(ifname);
+	struct ctl_info info;
+	struct sockaddr_ctl addr;
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 50000 };
+	int fd, s;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd = socket(PF_SYSTEM, SOCK_DGRAM,
+	    SYSPROTO_CONTROL), NULL);
+	bzero(&info, sizeof(info));
+	strlcpy(info.ctl_name, UTUN_CONTROL_NAME, sizeof(info.ctl_name));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, CTLIOCGINFO, &info), NULL);
+	bzero(&addr, sizeof(addr));
+	addr.sc_len = sizeof(addr);
+	addr.sc_family = AF_SYSTEM;
+	addr.ss_sysaddr = AF_SYS_CONTROL;
+	addr.sc_id = info.ctl_id;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fd, (struct sockaddr *)&addr,
+	    sizeof(addr)), "utun connect");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockopt(fd, SYSPROTO_CONTROL,
+	    UTUN_OPT_IFNAME, ifname, &ifnamelen), "UTUN_OPT_IFNAME");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, SOL_SOCKET,
+	    SO_RCVTIMEO, &tv, sizeof(tv)), "SO_RCVTIMEO");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	inet_ifaddr_add(s, ifname, UTUN_ADDR, UTUN_PEER_ADDR);
+	close(s);
+	return fd;
+}
+
+/* Write a segment from the client into the utun */
+static void
+tw_output(struct tw_conn *c, uint8_t flags, tcp_seq seq, tcp_seq ack,
+    uint32_t tsval)
+{
+	uint8_t buf[sizeof(uint32_t) + sizeof(struct ip) +
+	sizeof(struct tcphdr) + TCPOLEN_TSTAMP_APPA];
+	struct ip *ip = (struct ip *)(void *)(buf + sizeof(uint32_t));
+	struct tcphdr *th = (struct tcphdr *)(void *)(ip + 1);
+	uint32_t *opt = (uint32_t *)(void *)(th + 1);
+	struct {
+		struct in_addr  src;
+		struct in_addr  dst;
+		uint8_t         zero;
+		uint8_t         proto;
+		uint16_t        len;
+	} *ph = (void *)((uint8_t *)th - 12);
+	int thlen = sizeof(*th) + (c->ts ? TCPOLEN_TSTAMP_APPA : 0);
+
+	bzero(buf, sizeof(buf));
+	*(uint32_t *)(void *)buf = htonl(AF_INET);
+
+	th->th_sport = c->fport;
+	th->th_dport = c->lport;
+	th->th_seq = htonl(seq);
+	th->th_ack = htonl(ack);
+	th->th_off = thlen >> 2;
+	th->th_flags = flags;
+	th->th_win = htons(65535);
+	if (c->ts) {
+		opt[0] = htonl(TCPOPT_TSTAMP_HDR);
+		opt[1] = htonl(tsval);
+		opt[2] = htonl(c->ts_recent);
+	}
+
+	/* the pseudo header, overwritten by the IP header below */
+	ph->src = c->faddr;
+	ph->dst = c->laddr;
+	ph->zero = 0;
+	ph->proto = IPPROTO_TCP;
+	ph->len = htons(thlen);
+	th->th_sum = in_cksum(ph, (int)sizeof(*ph) + thlen);
+
+	bzero(ip, sizeof(*ip));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = sizeof(*ip) >> 2;
+	ip->ip_len = htons(sizeof(*ip) + thlen);
+	ip->ip_ttl = MAXTTL;
+	ip->ip_p = IPPROTO_TCP;
+	ip->ip_src = c->faddr;
+	ip->ip_dst = c->laddr;
+	ip->ip_sum = in_cksum(ip, sizeof(*ip));
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(send(c->fd, buf,
+	    sizeof(uint32_t) + sizeof(*ip) + thlen, 0), "utun send");
+}
+
+/*
+ * Wait up to REPLY_WAIT_MS for the next segment of the connection from
+ * the server; false if none came.
+ */
+static bool
+tw_input(struct tw_conn *c, struct tw_seg *seg)
+{
+	uint64_t deadline = clock_gettime_nsec_np(CLOCK_MONOTONIC) +
+	    REPLY_WAIT_MS * NSEC_PER_MSEC;
+	static uint8_t buf[sizeof(uint32_t) + IP_MAXPACKET];
+
+	while (clock_gettime_nsec_np(CLOCK_MONOTONIC) < deadline) {
+		ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+		struct ip *ip = (struct ip *)(void *)(buf + sizeof(uint32_t));
+		struct tcphdr *th;
+		uint8_t *cp;
+		int cnt;
+
+		if (n < (ssize_t)(sizeof(uint32_t) + sizeof(*ip)) ||
+		    ip->ip_v != IPVERSION || ip->ip_p != IPPROTO_TCP ||
+		    n < (ssize_t)(sizeof(uint32_t) + (ip->ip_hl << 2) +
+		    sizeof(*th))) {
+			continue;
+		}
+		th = (struct tcphdr *)(void *)((uint8_t *)ip + (ip->ip_hl << 2));
+		if (th->th_sport != c->lport || th->th_dport != c->fport) {
+			continue;
+		}
+		bzero(seg, sizeof(*seg));
+		seg->flags = th->th_flags;
+		seg->seq = ntohl(th->th_seq);
+		seg->ack = ntohl(th->th_ack);
+		cp = (uint8_t *)(th + 1);
+		for (cnt = (th->th_off << 2) - (int)sizeof(*th); cnt > 0;) {
+			int optlen;
+
+			if (cp[0] == TCPOPT_EOL) {
+				break;
+			}
+			optlen = cp[0] == TCPOPT_NOP ? 1 : cp[1];
+			if (optlen < 1 || optlen > cnt) {
+				break;
+			}
+			if (cp[0] == TCPOPT_TIMESTAMP &&
+			    optlen == TCPOLEN_TIMESTAMP) {
+				seg->ts = true;
+				seg->tsval = ntohl(*(uint32_t *)(void *)(cp + 2));
+				seg->tsecr = ntohl(*(uint32_t *)(void *)(cp + 6));
+			}
+			cp += optlen;
+			cnt -= optlen;
+		}
+		if (seg->ts) {
+			c->ts_recent = seg->tsval;
+		}
+		return true;
+	}
+	return false;
+}
+
+static void
+tw_expect(struct tw_conn *c, struct tw_seg *seg, uint8_t flags,
+    const char *what)
+{
+	T_QUIET; T_ASSERT_TRUE(tw_input(c, seg), "%s from the server", what);
+	T_QUIET; T_ASSERT_EQ(seg->flags, flags, "%s flags", what);
+}
+
+/*
+ * Connect to a new listener, with timestamps or without, and have the
+ * server close first so that its end goes to compact TIME_WAIT.
+ */
+static void
+tw_connect(struct tw_conn *c, bool ts)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct tw_seg seg;
+	uint32_t count;
+	int sfd;
+
+	set_compact(1);
+	bzero(c, sizeof(*c));
+	c->fd = utun_create();
+	c->ts = ts;
+	inet_pton(AF_INET, UTUN_ADDR, &c->laddr);
+	inet_pton(AF_INET, UTUN_PEER_ADDR, &c->faddr);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(c->lfd = socket(AF_INET, SOCK_STREAM,
+	    0), "socket");
+	bzero(&sin, sizeof(sin));
+	sin.sin_len = sizeof(sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr = c->laddr;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(c->lfd, (struct sockaddr *)&sin,
+	    sizeof(sin)), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(c->lfd,
+	    (struct sockaddr *)&sin, &len), "getsockname");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(c->lfd, 8), "listen");
+	c->lport = sin.sin_port;
+	c->fport = htons((uint16_t)(40000 + getpid() % 20000));
+
+	c->tsval = PEER_TSVAL;
+	tw_output(c, TH_SYN, PEER_ISS, 0, c->tsval);
+	tw_expect(c, &seg, TH_SYN | TH_ACK, "SYN-ACK");
+	T_QUIET; T_ASSERT_EQ(seg.ts, ts, "timestamps negotiated");
+	c->snd_nxt = PEER_ISS + 1;
+	c->rcv_nxt = seg.seq + 1;
+	tw_output(c, TH_ACK, c->snd_nxt, c->rcv_nxt, ++c->tsval);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sfd = accept(c->lfd, NULL, NULL),
+	    "accept");
+
+	count = read_count(TW_COUNT);
+	close(sfd);
+	tw_expect(c, &seg, TH_FIN | TH_ACK, "FIN");
+	c->rcv_nxt = seg.seq + 1;
+	tw_output(c, TH_FIN | TH_ACK, c->snd_nxt, c->rcv_nxt, ++c->tsval);
+	c->snd_nxt++;
+	tw_expect(c, &seg, TH_ACK, "ACK of the FIN");
+	T_QUIET; T_ASSERT_EQ(seg.ack, c->snd_nxt, "ACK of the FIN");
+	/* the entry is made once the ACK is out */
+	for (int i = 0; i < 10 && read_count(TW_COUNT) <= count; i++) {
+		usleep(10000);
+	}
+	T_ASSERT_GT(read_count(TW_COUNT), count,
+	    "the server end went to compact TIME_WAIT");
+}
+
+static void
+tw_close(struct tw_conn *c)
+{
+	close(c->lfd);
+	close(c->fd);
+}
+
+T_DECL(tcp_timewait_compact_fin,
+    "compact TIME_WAIT ACKs a retransmitted FIN")
+{
+	struct tw_conn c;
+	struct tw_seg seg;
+
+	tw_connect(&c, true);
+	for (int i = 0; i < 3; i++) {
+		tw_output(&c, TH_FIN | TH_ACK, c.snd_nxt - 1, c.rcv_nxt,
+		    ++c.tsval);
+		tw_expect(&c, &seg, TH_ACK, "ACK of the retransmitted FIN");
+		T_EXPECT_EQ(seg.seq, c.rcv_nxt, "the ACK is past our FIN");
+		T_EXPECT_EQ(seg.ack, c.snd_nxt, "the ACK covers the FIN");
+		T_EXPECT_TRUE(seg.ts && seg.tsecr == c.tsval,
+		    "the ACK echoes the FIN's timestamp");
+	}
+	tw_close(&c);
+}
+
+T_DECL(tcp_timewait_compact_rst,
+    "compact TIME_WAIT ignores an in-window RST (RFC 1337)")
+{
+	struct tw_conn c;
+	struct tw_seg seg;
+	uint32_t count;
+
+	tw_connect(&c, true);
+	count = read_count(TW_COUNT);
+	tw_output(&c, TH_RST | TH_ACK, c.snd_nxt, c.rcv_nxt, ++c.tsval);
+	T_EXPECT_FALSE(tw_input(&c, &seg), "no answer to the RST");
+	T_EXPECT_GE(read_count(TW_COUNT), count, "the entry was kept");
+
+	/* still there: a retransmitted FIN is answered */
+	tw_output(&c, TH_FIN | TH_ACK, c.snd_nxt - 1, c.rcv_nxt, ++c.tsval);
+	tw_expect(&c, &seg, TH_ACK, "ACK of the FIN after the RST");
+	T_EXPECT_EQ(seg.ack, c.snd_nxt, "the RST did not end TIME_WAIT");
+	tw_close(&c);
+}
+
+T_DECL(tcp_timewait_compact_syn_ts,
+    "compact TIME_WAIT lets a SYN with a newer timestamp through (RFC 6191)")
+{
+	struct tw_conn c;
+	struct tw_seg seg;
+
+	tw_connect(&c, true);
+
+	/* an older timestamp, even with a newer sequence number */
+	tw_output(&c, TH_SYN, c.snd_nxt + 100000, 0, PEER_TSVAL - 1);
+	tw_expect(&c, &seg, TH_ACK, "ACK of the old SYN");
+	T_EXPECT_EQ(seg.ack, c.snd_nxt, "the old SYN was answered from TIME_WAIT");
+
+	tw_output(&c, TH_SYN, PEER_ISS, 0, c.tsval + 100000);
+	tw_expect(&c, &seg, TH_SYN | TH_ACK, "SYN-ACK to the new SYN");
+	T_EXPECT_EQ(seg.ack, PEER_ISS + 1, "the listener took the new SYN");
+	tw_output(&c, TH_RST, PEER_ISS + 1, 0, c.tsval + 100001);
+	tw_close(&c);
+}
+
+T_DECL(tcp_timewait_compact_syn_seq,
+    "compact TIME_WAIT lets a SYN with a newer sequence number through")
+{
+	struct tw_conn c;
+	struct tw_seg seg;
+
+	tw_connect(&c, false);
+
+	tw_output(&c, TH_SYN, c.snd_nxt - 1, 0, 0);
+	tw_expect(&c, &seg, TH_ACK, "ACK of the old SYN");
+	T_EXPECT_EQ(seg.ack, c.snd_nxt, "the old SYN was answered from TIME_WAIT");
+
+	tw_output(&c, TH_SYN, c.snd_nxt + 100000, 0, 0);
+	tw_expect(&c, &seg, TH_SYN | TH_ACK, "SYN-ACK to the new SYN");
+	T_EXPECT_EQ(seg.ack, c.snd_nxt + 100001, "the listener took the new SYN");
+	tw_output(&c, TH_RST, c.snd_nxt + 100001, 0, 0);
+	tw_close(&c);
+}
+
+T_DECL(tcp_timewait_compact_dup,
+    "compact TIME_WAIT does not answer duplicate ACKs")
+{
+	struct tw_conn c;
+	struct tw_seg seg;
+	int replies = 0;
+
+	tw_connect(&c, true);
+	for (int i = 0; i < DUP_SEGMENTS; i++) {
+		tw_output(&c, TH_ACK, c.snd_nxt, c.rcv_nxt, ++c.tsval);
+	}
+	while (tw_input(&c, &seg)) {
+		replies++;
+	}
+	T_EXPECT_EQ(replies, 0, "no answer to %d duplicates of the final ACK",
+	    DUP_SEGMENTS);
+	tw_close(&c);
+}
+
+T_DECL(tcp_timewait_churn,
+    "connection churn and memory per TIME_WAIT, full and compact",
+    T_META_TAG_PERF)
+{
+	run(0);
+	run(1);
+}
@@ -0,0 +1,188 @@
+/*
+ * Check the compiled pf filter ruleset against a linear walk of the rules,
+ * and measure rule evaluation throughput across ruleset sizes, with and
+ * without the compiler (net.pf.rule_compiler).
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net.pf"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define PFCTL_PATH      "/sbin/pfctl"
+#define RULES_PATH      "/tmp/pf_rule_compile.conf"
+#define RUN_SECONDS     2
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+T_DECL(pf_rule_compile_differential,
+    "compiled pf rulesets pick the same rules as a linear walk")
+{
+	for (int64_t seed = 1; seed <= 4; seed++) {
+		T_EXPECT_EQ(1ll, run_sysctl_test("pf_rule_compile", seed),
+		    "random rulesets, seed %lld", seed);
+	}
+}
+
+static void
+system_cmd(const char *cmd, bool fail_on_error)
+{
+	pid_t pid = -1;
+	int exit_status = 0;
+	const char *argv[] = {
+		"/bin/sh",
+		"-c",
+		cmd,
+		NULL
+	};
+
+	int rc = dt_launch_tool(&pid, (char **)(void *)argv, false, NULL, NULL);
+	T_QUIET; T_ASSERT_EQ(rc, 0, "dt_launch_tool(%s)", cmd);
+	if (!dt_waitpid(pid, &exit_status, NULL, 60) && fail_on_error) {
+		T_FAIL("command(%s) failed", cmd);
+	}
+}
+
+static int compiler_saved = -1;
+
+static void
+cleanup_pf(void)
+{
+	if (compiler_saved != -1) {
+		(void)sysctlbyname("net.pf.rule_compiler", NULL, NULL,
+		    &compiler_saved, sizeof(compiler_saved));
+	}
+	system_cmd(PFCTL_PATH " -d", false);
+	system_cmd(PFCTL_PATH " -F all", false);
+	system_cmd(PFCTL_PATH " -f /etc/pf.conf", false);
+	unlink(RULES_PATH);
+}
+
+static void
+set_compiler(int on)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.pf.rule_compiler",
+	    NULL, NULL, &on, sizeof(on)), "net.pf.rule_compiler = %d", on);
+}
+
+/*
+ * A stateless pass followed by nrules blocks that never match the test
+ * traffic: every packet is evaluated against the whole ruleset, and the
+ * blocks differ in their source address so skip steps cannot help.
+ */
+static void
+load_rules(int nrules)
+{
+	FILE *f;
+
+	T_QUIET; T_ASSERT_NOTNULL(f = fopen(RULES_PATH, "w"), RULES_PATH);
+	fprintf(f, "pass on lo0 all no state\n");
+	for (int i = 0; i < nrules; i++) {
+		fprintf(f, "block drop on lo0 proto udp from 10.%d.%d.0/24 "
+		    "to any port %d\n", (i >> 8) & 0xff, i & 0xff, 1 + i % 1000);
+	}
+	fclose(f);
+
+	system_cmd(PFCTL_PATH " -q -o none -f " RULES_PATH, true);
+}
+
+static double
+run_flow(uint64_t *received)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	char buf[64] = { 0 };
+	uint64_t sent = 0;
+	time_t end;
+	int tx, rx;
+
+	*received = 0;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(rx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(rx, (struct sockaddr *)&sin,
+	    &len), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(tx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(tx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+
+	end = time(NULL) + RUN_SECONDS;
+	while (time(NULL) < end) {
+		for (int i = 0; i < 64; i++) {
+			if (send(tx, buf, sizeof(buf), 0) == sizeof(buf)) {
+				sent++;
+			}
+			while (recv(rx, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+				(*received)++;
+			}
+		}
+	}
+	close(tx);
+	close(rx);
+	/* every datagram is filtered out of and into lo0 */
+	return (double)sent * 2 / RUN_SECONDS;
+}
+
+T_DECL(pf_rule_compile_perf, "pf rule evaluation throughput by ruleset size",
+    T_META_TAG_PERF)
+{
+	const int sizes[] = { 10, 100, 1000, 5000 };
+	size_t size = sizeof(compiler_saved);
+	struct stat sb;
+
+	if (stat(PFCTL_PATH, &sb) != 0) {
+		T_SKIP("%s not present", PFCTL_PATH);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.pf.rule_compiler",
+	    &compiler_saved, &size, NULL, 0), "net.pf.rule_compiler");
+	T_ATEND(cleanup_pf);
+	system_cmd(PFCTL_PATH " -e", false);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		load_rules(sizes[i]);
+		for (int on = 0; on <= 1; on++) {
+			char name[64];
+			uint64_t received;
+			double pps;
+
+			set_compiler(on);
+			pps = run_flow(&received);
+			T_EXPECT_GT(received, 0ull, "%d rules, compiler %d: traffic passed",
+			    sizes[i], on);
+			T_LOG("%d rules, compiler %d: %.0f pf packets/s", sizes[i], on, pps);
+			snprintf(name, sizeof(name), "pf_rules_pps_%s_%d",
+			    on ? "compiled" : "linear", sizes[i]);
+			T_PERF(name, pps, "pps", "packets through pf per second");
+		}
+	}
+}
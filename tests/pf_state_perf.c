@@ -0,0 +1,198 @@
+/*
+ * Drive established UDP flows through pf from many threads, with and
+ * without the pf_lock-free state match (net.pf.state_fastpath).
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net.pf"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define PFCTL_PATH      "/sbin/pfctl"
+#define MAX_FLOWS       16
+#define RUN_SECONDS     3
+
+static void
+system_cmd(const char *cmd, bool fail_on_error)
+{
+	pid_t pid = -1;
+	int exit_status = 0;
+	const char *argv[] = {
+		"/bin/sh",
+		"-c",
+		cmd,
+		NULL
+	};
+
+	int rc = dt_launch_tool(&pid, (char **)(void *)argv, false, NULL, NULL);
+	T_QUIET; T_ASSERT_EQ(rc, 0, "dt_launch_tool(%s)", cmd);
+	if (!dt_waitpid(pid, &exit_status, NULL, 30) && fail_on_error) {
+		T_FAIL("command(%s) failed", cmd);
+	}
+}
+
+static int fastpath_saved = -1;
+
+static void
+cleanup_pf(void)
+{
+	if (fastpath_saved != -1) {
+		(void)sysctlbyname("net.pf.state_fastpath", NULL, NULL,
+		    &fastpath_saved, sizeof(fastpath_saved));
+	}
+	system_cmd(PFCTL_PATH " -d", false);
+	system_cmd(PFCTL_PATH " -F all", false);
+	system_cmd(PFCTL_PATH " -f /etc/pf.conf", false);
+}
+
+static void
+setup_pf(void)
+{
+	size_t size = sizeof(fastpath_saved);
+	struct stat sb;
+
+	if (stat(PFCTL_PATH, &sb) != 0) {
+		T_SKIP("%s not present", PFCTL_PATH);
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.pf.state_fastpath",
+	    &fastpath_saved, &size, NULL, 0), "net.pf.state_fastpath");
+	T_ATEND(cleanup_pf);
+
+	system_cmd("echo 'pass on lo0 all keep state' | " PFCTL_PATH " -f -", true);
+	system_cmd(PFCTL_PATH " -e", false);
+}
+
+static void
+set_fastpath(int on)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.pf.state_fastpath",
+	    NULL, NULL, &on, sizeof(on)), "net.pf.state_fastpath = %d", on);
+}
+
+struct flow {
+	pthread_t       thread;
+	int             tx;
+	int             rx;
+	uint64_t        sent;
+	uint64_t        received;
+};
+
+static struct flow flows[MAX_FLOWS];
+static atomic_bool running;
+
+static void
+flow_open(struct flow *f)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	int rcvbuf = 1 << 20;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(f->rx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(f->rx, SOL_SOCKET, SO_RCVBUF,
+	    &rcvbuf, sizeof(rcvbuf)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(f->rx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(f->rx, (struct sockaddr *)&sin,
+	    &len), NULL);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(f->tx = socket(AF_INET, SOCK_DGRAM, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(f->tx, (struct sockaddr *)&sin,
+	    sizeof(sin)), NULL);
+}
+
+static void
+flow_close(struct flow *f)
+{
+	close(f->tx);
+	close(f->rx);
+}
+
+static void *
+flow_run(void *arg)
+{
+	struct flow *f = arg;
+	char buf[64] = { 0 };
+
+	while (atomic_load_explicit(&running, memory_order_relaxed)) {
+		if (send(f->tx, buf, sizeof(buf), 0) == sizeof(buf)) {
+			f->sent++;
+		}
+		while (recv(f->rx, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+			f->received++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Every datagram crosses pf twice, out of and into lo0, and matches the
+ * state of its flow both times.
+ */
+static double
+run_flows(int nflows, uint64_t *received)
+{
+	uint64_t sent = 0;
+
+	*received = 0;
+	for (int i = 0; i < nflows; i++) {
+		flow_open(&flows[i]);
+		flows[i].sent = flows[i].received = 0;
+	}
+	atomic_store(&running, true);
+	for (int i = 0; i < nflows; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&flows[i].thread, NULL,
+		    flow_run, &flows[i]), NULL);
+	}
+	sleep(RUN_SECONDS);
+	atomic_store(&running, false);
+	for (int i = 0; i < nflows; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(flows[i].thread, NULL), NULL);
+		sent += flows[i].sent;
+		*received += flows[i].received;
+		flow_close(&flows[i]);
+	}
+	return (double)sent * 2 / RUN_SECONDS;
+}
+
+T_DECL(pf_state_multiflow_perf, "pf state matching throughput across flows and threads",
+    T_META_TAG_PERF)
+{
+	int ncpu = dt_ncpu();
+	int nflows = ncpu < MAX_FLOWS ? ncpu : MAX_FLOWS;
+
+	setup_pf();
+
+	for (int on = 0; on <= 1; on++) {
+		for (int n = 1; n <= nflows; n *= 2) {
+			char name[64];
+			uint64_t received;
+			double pps;
+
+			set_fastpath(on);
+			pps = run_flows(n, &received);
+			T_EXPECT_GT(received, 0ull, "%d flows, fastpath %d: traffic passed", n, on);
+			T_LOG("%d flows, fastpath %d: %.0f pf packets/s", n, on, pps);
+			snprintf(name, sizeof(name), "pf_pps_%s_%d_flows",
+			    on ? "fastpath" : "locked", n);
+			T_PERF(name, pps, "pps", "packets through pf per second");
+		}
+	}
+}
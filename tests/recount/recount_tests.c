@@ -8,7 +8,9 @@
 #include <mach/task_info.h>
 #include <mach/thread_info.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/resource.h>
+#include <sys/sysctl.h>
 #include <unistd.h>
 
 #include "test_utils.h"
@@ -541,3 +543,55 @@ T_DECL(proc_pidthreadcounts_invalid_tid,
 			"fail");
 	T_ASSERT_EQ(errno, ESRCH, "should fail with ESRCH");
 }
+
+// Keep in sync with `struct recount_sched_latency`.
+#define SCHED_LATENCY_BUCKETS (6)
+#define SCHED_LATENCY_BINS (32)
+#define SCHED_LATENCY_HIST_SIZE \
+		(SCHED_LATENCY_BUCKETS * SCHED_LATENCY_BINS * sizeof(uint64_t))
+
+static uint64_t
+_sched_latency_dispatches(size_t *size_out)
+{
+	size_t size = 0;
+	int ret = sysctlbyname("kern.sched_latency_histogram", NULL, &size, NULL,
+			0);
+	T_QUIET;
+	T_ASSERT_POSIX_SUCCESS(ret, "sysctlbyname(kern.sched_latency_histogram)");
+	uint64_t *bins = calloc(1, size);
+	T_QUIET; T_ASSERT_NOTNULL(bins, "allocate histograms");
+	ret = sysctlbyname("kern.sched_latency_histogram", bins, &size, NULL, 0);
+	T_QUIET;
+	T_ASSERT_POSIX_SUCCESS(ret, "sysctlbyname(kern.sched_latency_histogram)");
+
+	uint64_t total = 0;
+	for (size_t i = 0; i < size / sizeof(bins[0]); i++) {
+		total += bins[i];
+	}
+	free(bins);
+	*size_out = size;
+	return total;
+}
+
+T_DECL(sched_latency_histogram_sanity,
+		"ensure scheduling latency histograms count dispatches")
+{
+	size_t size = 0;
+	uint64_t before = _sched_latency_dispatches(&size);
+	T_LOG("%zu histogram(s), %llu dispatches", size / SCHED_LATENCY_HIST_SIZE,
+			before);
+	T_ASSERT_GT(size, (size_t)0, "histograms should be exported");
+	T_ASSERT_EQ(size % SCHED_LATENCY_HIST_SIZE, (size_t)0,
+			"should export whole histograms");
+	T_ASSERT_LE(size / SCHED_LATENCY_HIST_SIZE, (size_t)perf_level_count(),
+			"should export at most one histogram per perf-level");
+
+	const unsigned int wakeups = 100;
+	for (unsigned int i = 0; i < wakeups; i++) {
+		usleep(100);
+	}
+
+	uint64_t after = _sched_latency_dispatches(&size);
+	T_EXPECT_GE(after - before, (uint64_t)wakeups,
+			"each wakeup should be counted by the histograms");
+}
@@ -0,0 +1,153 @@
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.timer"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("scheduler"),
+	T_META_CHECK_LEAKS(false),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false));
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+static uint64_t longterm_threshold_ms;
+
+static void
+restore_longterm_threshold(void)
+{
+	(void)sysctlbyname("kern.timer.longterm.threshold", NULL, NULL,
+	    &longterm_threshold_ms, sizeof(longterm_threshold_ms));
+}
+
+static void
+set_longterm_threshold(uint64_t ms)
+{
+	static bool saved = false;
+
+	if (!saved) {
+		size_t size = sizeof(longterm_threshold_ms);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.longterm.threshold",
+		    &longterm_threshold_ms, &size, NULL, 0), "get longterm threshold");
+		T_ATEND(restore_longterm_threshold);
+		saved = true;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.longterm.threshold",
+	    NULL, NULL, &ms, sizeof(ms)), "set longterm threshold to %llu ms", ms);
+}
+
+static uint64_t longterm_wheel;
+
+static void
+restore_longterm_wheel(void)
+{
+	(void)sysctlbyname("kern.timer.longterm.wheel", NULL, NULL,
+	    &longterm_wheel, sizeof(longterm_wheel));
+}
+
+/* The switch happens on the boot processor: wait for it to be seen */
+static void
+set_longterm_wheel(uint64_t enable)
+{
+	static bool saved = false;
+	uint64_t value = !enable;
+	size_t size = sizeof(value);
+
+	if (!saved) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.longterm.wheel",
+		    &longterm_wheel, &size, NULL, 0), "get longterm wheel");
+		T_ATEND(restore_longterm_wheel);
+		saved = true;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.longterm.wheel",
+	    NULL, NULL, &enable, sizeof(enable)), "set longterm wheel to %llu", enable);
+	for (int i = 0; i < 100 && value != enable; i++) {
+		size = sizeof(value);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.longterm.wheel",
+		    &value, &size, NULL, 0), "get longterm wheel");
+		if (value != enable) {
+			usleep(1000);
+		}
+	}
+	T_QUIET; T_ASSERT_EQ(value, enable, "longterm wheel switched");
+}
+
+T_DECL(timer_longterm, "longterm timers fire, and not early")
+{
+	set_longterm_threshold(1000);
+	T_EXPECT_EQ(1ll, run_sysctl_test("timer_longterm", 0), "timers fired on time");
+
+	/*
+	 * The wheel has been scanned up to about 5s from now: timers armed
+	 * after lowering the threshold have deadlines behind its clock and
+	 * must not wait for it to come round.
+	 */
+	set_longterm_threshold(5000);
+	T_EXPECT_EQ(1ll, run_sysctl_test("timer_longterm", 0),
+	    "timers fired on time with a 5s threshold");
+	set_longterm_threshold(500);
+	T_EXPECT_EQ(1ll, run_sysctl_test("timer_longterm", 0),
+	    "timers fired on time after lowering the threshold");
+
+	set_longterm_wheel(0);
+	set_longterm_threshold(1000);
+	T_EXPECT_EQ(1ll, run_sysctl_test("timer_longterm", 0),
+	    "timers fired on time on the longterm list");
+	set_longterm_wheel(1);
+
+	set_longterm_threshold(0);
+	T_EXPECT_EQ(1ll, run_sysctl_test("timer_longterm", 0),
+	    "timers fired on time without the longterm queue");
+}
+
+/*
+ * Compare the wheel with the unordered list it replaced, both with a 1s
+ * threshold: the arm and cancel cost of a timer, and the time a threshold
+ * scan spends with interrupts masked.
+ */
+T_DECL(timer_call_arm_cancel_perf, "longterm timer arm, cancel and scan cost by timer count",
+    T_META_TAG_PERF)
+{
+	const int64_t counts[] = { 1000, 10000, 100000, 1000000 };
+	const struct {
+		const char *name;
+		uint64_t wheel;
+	} modes[] = {
+		{ "wheel", 1 },
+		{ "list", 0 },
+	};
+
+	set_longterm_threshold(1000);
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		set_longterm_wheel(modes[m].wheel);
+		for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+			char name[64];
+			int64_t arm = run_sysctl_test("timer_call_bench", counts[i]);
+			int64_t cancel = run_sysctl_test("timer_call_bench", -counts[i]);
+			int64_t scan = run_sysctl_test("timer_longterm_scan_bench", counts[i]);
+
+			T_LOG("%s: %lld timers: arm %lld ns, cancel %lld ns, scan %lld ns",
+			    modes[m].name, counts[i], arm, cancel, scan);
+			snprintf(name, sizeof(name), "%s_arm_%lld", modes[m].name, counts[i]);
+			T_PERF(name, (double)arm, "ns", "average timer_call_enter cost");
+			snprintf(name, sizeof(name), "%s_cancel_%lld", modes[m].name, counts[i]);
+			T_PERF(name, (double)cancel, "ns", "average timer_call_cancel cost");
+			snprintf(name, sizeof(name), "%s_scan_%lld", modes[m].name, counts[i]);
+			T_PERF(name, (double)scan, "ns", "longterm threshold scan time");
+		}
+	}
+}
@@ -0,0 +1,685 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fib_bench: load internet-scale IPv4 and IPv6 routing tables into the
+ * radix trees of bsd/net/radix.c, build the compressed FIB of
+ * bsd/net/radix_fib.c alongside them, and measure the longest-prefix
+ * lookups per second of both.
+ *
+ * Tables are synthetic by default, with prefix lengths distributed as in
+ * the global BGP tables (mostly /24s for IPv4, /48s and /32s for IPv6),
+ * plus a default route, host routes and scoped routes; -f reads one
+ * "address/length" per line instead, e.g. from a RouteViews dump.
+ *
+ * Every destination is looked up in the FIB and with rn_match(), and any
+ * disagreement fails the run.  The same is checked again after a batch
+ * of routes has been deleted from and added back to the tree one by one,
+ * the FIB being updated incrementally after each change, and after the
+ * default route has flapped, which rebuilds every slot.
+ *
+ * Usage: fib_bench [-4 nroutes] [-6 nroutes] [-f table]... [-l nlookups]
+ *                  [-u nupdates] [-s seed]
+ */
+
+#include "fib_bench_kern.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/radix.h>
+#include <net/radix_fib.h>
+
+struct domains_head domains = TAILQ_HEAD_INITIALIZER(domains);
+
+#define KEYLEN_MAX              sizeof(struct sockaddr_in6)
+
+/* A route; the radix nodes come first, as in struct rtentry */
+struct route {
+	struct radix_node       r_nodes[2];
+	u_char                  r_key[KEYLEN_MAX];
+	uint8_t                 r_plen;
+	bool                    r_scoped;
+	bool                    r_cloned;       /* host route to a destination */
+};
+
+struct family {
+	const char              *f_name;
+	int                     f_af;
+	u_int                   f_off;          /* offset of the address in keys */
+	u_int                   f_alen;         /* length of the address */
+	u_int                   f_keylen;       /* length of the keys */
+	u_int                   f_scope_off;    /* offset of the scope in keys */
+	struct domain           f_domain;
+	struct radix_node_head  *f_rnh;
+	struct rn_fib           *f_fib;
+	struct route            **f_routes;     /* the default route first */
+	size_t                  f_nroutes;
+	size_t                  f_maxroutes;
+	size_t                  f_dups;
+	u_char                  (*f_dests)[KEYLEN_MAX];
+	size_t                  f_ndests;
+};
+
+static struct family families[] = {
+	{
+		.f_name = "IPv4",
+		.f_af = AF_INET,
+		.f_off = offsetof(struct sockaddr_in, sin_addr),
+		.f_alen = sizeof(struct in_addr),
+		.f_keylen = sizeof(struct sockaddr_in),
+		.f_scope_off = offsetof(struct sockaddr_in, sin_zero),
+	},
+	{
+		.f_name = "IPv6",
+		.f_af = AF_INET6,
+		.f_off = offsetof(struct sockaddr_in6, sin6_addr),
+		.f_alen = sizeof(struct in6_addr),
+		.f_keylen = sizeof(struct sockaddr_in6),
+		.f_scope_off = offsetof(struct sockaddr_in6, sin6_scope_id),
+	},
+};
+#define NFAMILIES               (sizeof(families) / sizeof(families[0]))
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+#pragma mark - Tables
+
+/* Prefix length distributions, in parts per 10000 */
+struct plen_share {
+	uint8_t                 plen;
+	uint16_t                share;
+};
+
+static const struct plen_share v4_shares[] = {
+	{ 8, 10 }, { 12, 20 }, { 13, 30 }, { 14, 50 }, { 15, 70 },
+	{ 16, 150 }, { 17, 100 }, { 18, 170 }, { 19, 300 }, { 20, 420 },
+	{ 21, 500 }, { 22, 1200 }, { 23, 1000 }, { 24, 5800 }, { 25, 40 },
+	{ 26, 40 }, { 28, 30 }, { 30, 20 }, { 32, 50 },
+};
+
+static const struct plen_share v6_shares[] = {
+	{ 19, 5 }, { 20, 10 }, { 24, 20 }, { 28, 100 }, { 29, 500 },
+	{ 32, 1500 }, { 33, 100 }, { 34, 100 }, { 36, 400 }, { 40, 700 },
+	{ 44, 900 }, { 45, 100 }, { 46, 300 }, { 47, 200 }, { 48, 4500 },
+	{ 52, 50 }, { 56, 200 }, { 60, 40 }, { 64, 150 }, { 128, 20 },
+};
+
+/* /16s holding most of the IPv6 unicast space that is routed */
+static const uint16_t v6_blocks[] = {
+	0x2001, 0x2400, 0x2401, 0x2402, 0x2403, 0x2404, 0x2405, 0x2406,
+	0x2407, 0x2408, 0x2409, 0x240e, 0x2600, 0x2602, 0x2603, 0x2604,
+	0x2605, 0x2606, 0x2607, 0x2610, 0x2620, 0x2800, 0x2801, 0x2803,
+	0x2804, 0x2a00, 0x2a01, 0x2a02, 0x2a03, 0x2a04, 0x2a05, 0x2a06,
+	0x2a07, 0x2a09, 0x2a0a, 0x2a0b, 0x2a0c, 0x2a0d, 0x2a0e, 0x2a0f,
+	0x2a10, 0x2a11, 0x2a12, 0x2a13, 0x2a14, 0x2c0f,
+};
+
+static u_int
+random_plen(const struct plen_share *shares, size_t n)
+{
+	u_int r = (u_int)(rng() % 10000), total = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		total += shares[i].share;
+		if (r < total) {
+			return shares[i].plen;
+		}
+	}
+	return shares[n - 1].plen;
+}
+
+static void
+mask_address(u_char *addr, u_int alen, u_int plen)
+{
+	for (u_int i = 0; i < alen; i++, plen = (plen > 8) ? plen - 8 : 0) {
+		addr[i] &= (plen >= 8) ? 0xff : (u_char)(0xff00 >> plen);
+	}
+}
+
+static void
+make_key(const struct family *f, u_char *key, const u_char *addr)
+{
+	bzero(key, KEYLEN_MAX);
+	key[0] = (u_char)f->f_keylen;
+	key[1] = (u_char)f->f_af;
+	memcpy(key + f->f_off, addr, f->f_alen);
+}
+
+/* Returns NULL for host routes, which have no mask in the tree */
+static u_char *
+make_mask(const struct family *f, const struct route *r, u_char *mask)
+{
+	u_char addr[sizeof(struct in6_addr)];
+
+	if (r->r_plen == f->f_alen * 8 && !r->r_scoped) {
+		return NULL;
+	}
+	memset(addr, 0xff, sizeof(addr));
+	mask_address(addr, f->f_alen, r->r_plen);
+	make_key(f, mask, addr);
+	if (r->r_scoped) {
+		memset(mask + f->f_scope_off, 0xff, sizeof(uint32_t));
+	}
+	return mask;
+}
+
+static struct route *
+add_route(struct family *f, const u_char *addr, u_int plen, uint32_t scope)
+{
+	struct route *r;
+	u_char a[sizeof(struct in6_addr)], mask[KEYLEN_MAX];
+
+	if (f->f_nroutes == f->f_maxroutes) {
+		f->f_maxroutes = MAX(f->f_maxroutes * 2, 1024);
+		f->f_routes = realloc(f->f_routes,
+		    f->f_maxroutes * sizeof(f->f_routes[0]));
+		if (f->f_routes == NULL) {
+			err(1, "realloc");
+		}
+	}
+	/* the tree points into routes, so they never move */
+	if ((r = calloc(1, sizeof(*r))) == NULL) {
+		err(1, "calloc");
+	}
+	memcpy(a, addr, f->f_alen);
+	mask_address(a, f->f_alen, plen);
+	make_key(f, r->r_key, a);
+	r->r_plen = (uint8_t)plen;
+	if (scope != 0) {
+		memcpy(r->r_key + f->f_scope_off, &scope, sizeof(scope));
+		r->r_scoped = true;
+	}
+	if (rn_addroute(r->r_key, make_mask(f, r, mask), f->f_rnh,
+	    r->r_nodes) == NULL) {
+		free(r);
+		f->f_dups++;
+		return NULL;
+	}
+	f->f_routes[f->f_nroutes++] = r;
+	return r;
+}
+
+static void
+random_address(const struct family *f, u_char *addr)
+{
+	uint64_t a = rng(), b = rng();
+
+	memcpy(addr, &a, MIN(sizeof(a), f->f_alen));
+	if (f->f_af == AF_INET) {
+		/* unicast space */
+		addr[0] = (u_char)(1 + addr[0] % 223);
+	} else {
+		uint16_t block = v6_blocks[rng() %
+		    (sizeof(v6_blocks) / sizeof(v6_blocks[0]))];
+
+		memcpy(addr + sizeof(a), &b, sizeof(b));
+		addr[0] = (u_char)(block >> 8);
+		addr[1] = (u_char)block;
+	}
+}
+
+static void
+generate_table(struct family *f, size_t n)
+{
+	u_char addr[sizeof(struct in6_addr)];
+
+	while (f->f_nroutes < n) {
+		u_int plen;
+
+		if (f->f_af == AF_INET) {
+			plen = random_plen(v4_shares,
+			    sizeof(v4_shares) / sizeof(v4_shares[0]));
+		} else {
+			plen = random_plen(v6_shares,
+			    sizeof(v6_shares) / sizeof(v6_shares[0]));
+		}
+		random_address(f, addr);
+		/* one route in a thousand is scoped to an interface */
+		add_route(f, addr, plen, (rng() % 1000 == 0) ? 1 + rng() % 8 : 0);
+	}
+}
+
+static void
+load_table(const char *path)
+{
+	char line[256];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		err(1, "%s", path);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		u_char addr[sizeof(struct in6_addr)];
+		char *slash = strchr(line, '/');
+		struct family *f;
+		u_int plen;
+
+		if (slash == NULL) {
+			continue;
+		}
+		*slash = '\0';
+		plen = (u_int)strtoul(slash + 1, NULL, 10);
+		f = &families[strchr(line, ':') != NULL];
+		if (inet_pton(f->f_af, line, addr) != 1 || plen > f->f_alen * 8) {
+			warnx("%s: bad prefix %s/%u", path, line, plen);
+			continue;
+		}
+		add_route(f, addr, plen, 0);
+	}
+	fclose(fp);
+}
+
+/*
+ * Half of the destinations fall within a route of the table, the other
+ * half anywhere in the unicast space.
+ */
+static void
+generate_dests(struct family *f, size_t n)
+{
+	f->f_dests = calloc(n, KEYLEN_MAX);
+	if (f->f_dests == NULL) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < n; i++) {
+		u_char addr[sizeof(struct in6_addr)];
+
+		random_address(f, addr);
+		if (i & 1) {
+			const struct route *r = f->f_routes[rng() % f->f_nroutes];
+
+			for (u_int b = 0; b < r->r_plen; b++) {
+				u_int byte = b / 8, bit = 0x80 >> (b % 8);
+
+				addr[byte] = (u_char)((addr[byte] & ~bit) |
+				    (r->r_key[f->f_off + byte] & bit));
+			}
+		}
+		make_key(f, f->f_dests[i], addr);
+	}
+	f->f_ndests = n;
+}
+
+/*
+ * Adds `n' host routes to destinations that are looked up, as the
+ * kernel clones for the destinations a host talks to.
+ */
+static void
+add_clones(struct family *f, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		struct route *r = add_route(f,
+		    f->f_dests[rng() % f->f_ndests] + f->f_off, f->f_alen * 8, 0);
+
+		if (r != NULL) {
+			r->r_cloned = true;
+		}
+	}
+}
+
+/* The transient routes of the FIB */
+static int
+route_cloned(struct radix_node *rn, void *arg __unused)
+{
+	return ((struct route *)(void *)rn)->r_cloned;
+}
+
+#pragma mark - Lookups
+
+static struct radix_node *
+radix_lookup(struct family *f, void *key)
+{
+	struct radix_node *rn = rn_match(key, f->f_rnh);
+
+	return (rn != NULL && (rn->rn_flags & RNF_ROOT)) ? NULL : rn;
+}
+
+static struct radix_node *
+fib_lookup(struct family *f, void *key)
+{
+	struct radix_node *rn;
+
+	if (!rn_fib_lookup(f->f_fib, key, &rn)) {
+		errx(1, "%s: the FIB declined a lookup", f->f_name);
+	}
+	return rn;
+}
+
+static void
+verify(struct family *f, const char *when)
+{
+	for (size_t i = 0; i < f->f_ndests; i++) {
+		struct radix_node *expected = radix_lookup(f, f->f_dests[i]);
+		struct radix_node *rn = fib_lookup(f, f->f_dests[i]);
+
+		if (rn != expected) {
+			char buf[INET6_ADDRSTRLEN];
+
+			inet_ntop(f->f_af, f->f_dests[i] + f->f_off, buf, sizeof(buf));
+			errx(1, "%s %s: %s matches %p in the FIB, %p in the tree",
+			    f->f_name, when, buf, (void *)rn, (void *)expected);
+		}
+	}
+}
+
+/* Returns lookups per second */
+static double
+bench(struct family *f, struct radix_node *(*lookup)(struct family *, void *),
+    u_int iterations)
+{
+	uintptr_t sum = 0;
+	double start = now(), elapsed;
+
+	for (u_int it = 0; it < iterations; it++) {
+		for (size_t i = 0; i < f->f_ndests; i++) {
+			sum += (uintptr_t)lookup(f, f->f_dests[i]);
+		}
+	}
+	elapsed = now() - start;
+	if (sum == 1) {
+		printf("\n");
+	}
+	return (double)f->f_ndests * iterations / elapsed;
+}
+
+#pragma mark - Updates
+
+static void
+delete_route(struct family *f, struct route *r)
+{
+	u_char mask[KEYLEN_MAX];
+	struct radix_node *rn;
+
+	rn = rn_delete(r->r_key, make_mask(f, r, mask), f->f_rnh);
+	if (rn != r->r_nodes) {
+		errx(1, "%s: route not found in the tree", f->f_name);
+	}
+	if (rn_fib_delete(f->f_fib, rn) != 0) {
+		errx(1, "%s: FIB update failed", f->f_name);
+	}
+}
+
+static void
+readd_route(struct family *f, struct route *r)
+{
+	u_char mask[KEYLEN_MAX];
+	struct radix_node *rn;
+
+	bzero(r->r_nodes, sizeof(r->r_nodes));
+	rn = rn_addroute(r->r_key, make_mask(f, r, mask), f->f_rnh, r->r_nodes);
+	if (rn == NULL) {
+		errx(1, "%s: route could not be added back", f->f_name);
+	}
+	if (rn_fib_add(f->f_fib, rn) != 0) {
+		errx(1, "%s: FIB update failed", f->f_name);
+	}
+}
+
+/*
+ * Deletes `n' random routes other than the default one and the cloned
+ * ones, then adds them back, and returns the average time of an update
+ * in microseconds.
+ */
+static double
+update(struct family *f, size_t n)
+{
+	size_t *idx, nidx = 1;
+	double start, elapsed;
+
+	if ((idx = calloc(f->f_nroutes, sizeof(*idx))) == NULL) {
+		err(1, "calloc");
+	}
+	for (size_t i = 1; i < f->f_nroutes; i++) {
+		if (!f->f_routes[i]->r_cloned) {
+			idx[nidx++] = i;
+		}
+	}
+	n = MIN(n, nidx - 1);
+	if (n == 0) {
+		free(idx);
+		return 0;
+	}
+	/* a partial Fisher-Yates shuffle of the routes past the default */
+	for (size_t i = 1; i <= n; i++) {
+		size_t j = i + rng() % (nidx - i), tmp = idx[i];
+
+		idx[i] = idx[j];
+		idx[j] = tmp;
+	}
+
+	start = now();
+	for (size_t i = 1; i <= n; i++) {
+		delete_route(f, f->f_routes[idx[i]]);
+	}
+	elapsed = now() - start;
+	verify(f, "after deletes");
+	start = now();
+	for (size_t i = 1; i <= n; i++) {
+		readd_route(f, f->f_routes[idx[i]]);
+	}
+	elapsed += now() - start;
+	free(idx);
+	return elapsed * 1e6 / (double)(2 * n);
+}
+
+/*
+ * Deletes the cloned routes, then adds them back, and returns the average
+ * time of an update in microseconds.
+ */
+static double
+update_clones(struct family *f)
+{
+	double start, elapsed;
+	size_t n = 0;
+
+	start = now();
+	for (size_t i = 1; i < f->f_nroutes; i++) {
+		if (f->f_routes[i]->r_cloned) {
+			delete_route(f, f->f_routes[i]);
+			n++;
+		}
+	}
+	elapsed = now() - start;
+	if (n == 0) {
+		return 0;
+	}
+	verify(f, "without cloned routes");
+	start = now();
+	for (size_t i = 1; i < f->f_nroutes; i++) {
+		if (f->f_routes[i]->r_cloned) {
+			readd_route(f, f->f_routes[i]);
+		}
+	}
+	elapsed += now() - start;
+	return elapsed * 1e6 / (double)(2 * n);
+}
+
+/* Returns the time in milliseconds to delete and add back the default route */
+static double
+flap_default(struct family *f)
+{
+	double start = now(), elapsed;
+
+	delete_route(f, f->f_routes[0]);
+	elapsed = now() - start;
+	verify(f, "without a default route");
+	start = now();
+	readd_route(f, f->f_routes[0]);
+	elapsed += now() - start;
+	return elapsed * 1e3;
+}
+
+#pragma mark - main
+
+static void __dead2
+usage(const char *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-4 nroutes] [-6 nroutes] [-f table]... [-l nlookups]\n"
+	    "          [-c nclones] [-i iterations] [-u nupdates] [-s seed]\n"
+	    "\n"
+	    "  -4  routes of the synthetic IPv4 table (default 950000)\n"
+	    "  -6  routes of the synthetic IPv6 table (default 200000)\n"
+	    "  -f  read \"address/length\" prefixes from a file instead\n"
+	    "  -l  destinations to look up (default 1000000)\n"
+	    "  -c  host routes cloned to destinations (default 20000)\n"
+	    "  -i  passes over the destinations when timing (default 5)\n"
+	    "  -u  routes to delete and add back (default 10000)\n"
+	    "  -s  random seed\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *progname = argv[0];
+	size_t nroutes[NFAMILIES] = { 950000, 200000 };
+	size_t nlookups = 1000000, nupdates = 10000, nclones = 20000;
+	u_int iterations = 5;
+	char **tables = NULL;
+	int ch, ntables = 0;
+
+	while ((ch = getopt(argc, argv, "4:6:c:f:i:l:s:u:")) != -1) {
+		switch (ch) {
+		case '4':
+			nroutes[0] = strtoul(optarg, NULL, 0);
+			break;
+		case '6':
+			nroutes[1] = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			nclones = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			tables = realloc(tables, (ntables + 1) * sizeof(*tables));
+			if (tables == NULL) {
+				err(1, "realloc");
+			}
+			tables[ntables++] = optarg;
+			break;
+		case 'i':
+			iterations = (u_int)MAX(strtoul(optarg, NULL, 0), 1);
+			break;
+		case 'l':
+			nlookups = MAX(strtoul(optarg, NULL, 0), 1);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'u':
+			nupdates = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (optind != argc) {
+		usage(progname);
+	}
+
+	for (size_t i = 0; i < NFAMILIES; i++) {
+		families[i].f_domain.dom_family = families[i].f_af;
+		families[i].f_domain.dom_maxrtkey = (int)families[i].f_keylen;
+		TAILQ_INSERT_TAIL(&domains, &families[i].f_domain, dom_entry);
+	}
+	rn_init();
+	for (size_t i = 0; i < NFAMILIES; i++) {
+		struct family *f = &families[i];
+		u_char zeroes[sizeof(struct in6_addr)] = { 0 };
+
+		if (!rn_inithead((void **)&f->f_rnh, (int)f->f_off << 3)) {
+			errx(1, "rn_inithead");
+		}
+		add_route(f, zeroes, 0, 0);
+	}
+	for (int i = 0; i < ntables; i++) {
+		load_table(tables[i]);
+	}
+
+	printf("family    routes     dups  build (ms)  FIB (MB)   radix (M/s)    FIB (M/s)  "
+	    "speedup  update (us)  clone (us)  default flap (ms)\n");
+	for (size_t i = 0; i < NFAMILIES; i++) {
+		struct family *f = &families[i];
+		double start, build, radix_rate, fib_rate, update_us, clone_us, flap_ms;
+
+		if (ntables == 0) {
+			generate_table(f, nroutes[i]);
+		}
+		generate_dests(f, nlookups);
+		add_clones(f, nclones);
+
+		start = now();
+		if ((f->f_fib = rn_fib_create(f->f_rnh, f->f_af,
+		    route_cloned)) == NULL) {
+			errx(1, "%s: rn_fib_create failed", f->f_name);
+		}
+		build = (now() - start) * 1e3;
+		verify(f, "after building");
+
+		radix_rate = bench(f, radix_lookup, iterations);
+		fib_rate = bench(f, fib_lookup, iterations);
+
+		update_us = update(f, nupdates);
+		verify(f, "after updates");
+		clone_us = update_clones(f);
+		verify(f, "after cloned routes came back");
+		flap_ms = flap_default(f);
+		verify(f, "after the default route flapped");
+
+		printf("%-6s %9zu %8zu %11.1f %9.1f %13.2f %12.2f %7.1fx %12.1f %11.2f %18.1f\n",
+		    f->f_name, f->f_nroutes, f->f_dups, build,
+		    (double)rn_fib_size(f->f_fib) / (1024 * 1024),
+		    radix_rate / 1e6, fib_rate / 1e6, fib_rate / radix_rate,
+		    update_us, clone_us, flap_ms);
+	}
+	return 0;
+}
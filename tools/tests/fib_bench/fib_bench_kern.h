@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fib_bench_kern.h
+ *
+ * Mock kernel environment for building bsd/net/radix.c and
+ * bsd/net/radix_fib.c as part of a userspace program.
+ *
+ * Every kernel header those files include is shadowed by a header in
+ * fib_bench/include/ which pulls in this file instead; <net/radix.h> and
+ * <net/radix_fib.h> are used unmodified from bsd/.  Zones and typed
+ * allocations come from malloc, panics abort, and the domain list that
+ * rn_init() sizes its keys from is filled in by fib_bench.c.
+ */
+
+#ifndef _FIB_BENCH_KERN_H_
+#define _FIB_BENCH_KERN_H_
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
+#ifndef __dead2
+#define __dead2 __attribute__((__noreturn__))
+#endif
+
+#pragma mark - <sys/systm.h>
+
+#define panic(...)              (fprintf(stderr, __VA_ARGS__), abort())
+#define VERIFY(e)               assert(e)
+#define VM_KERNEL_ADDRPERM(x)   ((uintptr_t)(x))
+
+static inline int
+min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+#pragma mark - <sys/syslog.h>
+
+#define LOG_ERR                 3
+#define LOG_DEBUG               7
+#define log(level, ...)         ((void)(level), fprintf(stderr, __VA_ARGS__))
+
+#pragma mark - <libkern/OSByteOrder.h>
+
+#ifndef OSSwapHostToBigInt64
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define OSSwapHostToBigInt64(x) __builtin_bswap64(x)
+#else
+#define OSSwapHostToBigInt64(x) ((uint64_t)(x))
+#endif
+#define OSSwapBigToHostInt64(x) OSSwapHostToBigInt64(x)
+#endif
+
+#pragma mark - <sys/domain.h>
+
+struct domain {
+	TAILQ_ENTRY(domain)     dom_entry;
+	int                     dom_family;
+	int                     dom_maxrtkey;
+};
+
+TAILQ_HEAD(domains_head, domain);
+extern struct domains_head domains;
+
+#pragma mark - <kern/zalloc.h>, <kern/kalloc.h>
+
+#define Z_WAITOK                0x0000
+#define Z_ZERO                  0x0001
+#define Z_NOFAIL                0x0002
+#define Z_WAITOK_ZERO_NOFAIL    (Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define ZALIGN_NONE             0
+#define ZC_NONE                 0x0000
+#define ZC_PGZ_USE_GUARDS       0x0001
+#define ZC_ZFREE_CLEARMEM       0x0002
+
+struct zone {
+	size_t                  z_elem_size;
+};
+typedef struct zone *zone_t;
+
+#define KALLOC_TYPE_DECLARE(var) \
+	extern struct zone var[1]
+#define KALLOC_TYPE_DEFINE(var, type, flags) \
+	struct zone var[1] = { { .z_elem_size = sizeof(type) } }
+
+static inline zone_t
+zone_create(const char *name __unused, size_t size, int flags __unused)
+{
+	zone_t z = calloc(1, sizeof(*z));
+
+	z->z_elem_size = size;
+	return z;
+}
+
+static inline void *
+fib_bench_alloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (p == NULL) {
+		panic("out of memory allocating %zu bytes\n", size);
+	}
+	return p;
+}
+
+#define zalloc_flags(z, flags)          fib_bench_alloc((z)->z_elem_size)
+#define zalloc_permanent(size, align)   fib_bench_alloc(size)
+#define zfree(z, p)                     free(p)
+
+#define KALLOC_DISPATCH(_1, _2, _3, name, ...) name
+#define kalloc_type(...) \
+	KALLOC_DISPATCH(__VA_ARGS__, kalloc_type_n, kalloc_type_1, )(__VA_ARGS__)
+#define kalloc_type_1(type, flags)      ((type *)fib_bench_alloc(sizeof(type)))
+#define kalloc_type_n(type, n, flags)   ((type *)fib_bench_alloc((n) * sizeof(type)))
+#define kfree_type(...) \
+	KALLOC_DISPATCH(__VA_ARGS__, kfree_type_n, kfree_type_1, )(__VA_ARGS__)
+#define kfree_type_1(type, p)           free(p)
+#define kfree_type_n(type, n, p)        free(p)
+#define kalloc_data(size, flags)        fib_bench_alloc(size)
+#define kfree_data(p, size)             free(p)
+
+#endif /* _FIB_BENCH_KERN_H_ */
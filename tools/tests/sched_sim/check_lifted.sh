@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# Check that the osfmk/kern functions sched_sim_kern.c was lifted from have
+# not changed since it was last brought in line with them.
+#
+# lifted.txt lists each function with the checksum of its kernel definition.
+# When this fails, mirror the kernel change into sched_sim_kern.c, then run
+# with -u to record the new checksums and update the revision in lifted.txt.
+
+set -e
+
+cd "$(dirname "$0")"
+KERN=../../../osfmk/kern
+MANIFEST=lifted.txt
+
+# Every definition of $2 in $1, from its return type to its closing brace
+definition() {
+    awk -v f="$2" '
+        $0 ~ "^" f "\\(" { print prev; body = 1 }
+        body { print }
+        body && /^}/ { body = 0 }
+        { prev = $0 }
+    ' "$KERN/$1"
+}
+
+checksum() {
+    definition "$1" "$2" | cksum | awk '{ print $1 "-" $2 }'
+}
+
+UPDATE=0
+if [ "$1" = "-u" ]; then
+    UPDATE=1
+fi
+
+RESULT=0
+TMP=$(mktemp)
+trap 'rm -f "$TMP"' EXIT
+
+while IFS= read -r line; do
+    case "$line" in
+    ""|\#*)
+        echo "$line" >> "$TMP"
+        continue
+        ;;
+    esac
+    set -- $line
+    file=$1 func=$2 sum=$3
+    new=$(checksum "$file" "$func")
+    if [ "$new" = "4294967295-0" ]; then
+        echo "$file: $func() not found" >&2
+        RESULT=1
+    elif [ "$new" != "$sum" ] && [ $UPDATE -eq 0 ]; then
+        echo "$file: $func() changed since sched_sim_kern.c was lifted from it" >&2
+        RESULT=1
+    fi
+    echo "$file $func $new" >> "$TMP"
+done < "$MANIFEST"
+
+if [ $UPDATE -eq 1 ]; then
+    cp "$TMP" "$MANIFEST"
+elif [ $RESULT -ne 0 ]; then
+    echo "Mirror the changes into sched_sim_kern.c, then run $0 -u" >&2
+fi
+exit $RESULT
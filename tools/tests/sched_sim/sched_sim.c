@@ -0,0 +1,1095 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sched_sim: replay a scheduling trace against the clutch, edge or AMP
+ * scheduler policy in user space.
+ *
+ * The workload is a set of thread groups and threads, and a list of CPU
+ * bursts: at time T thread X becomes runnable and wants D of CPU time before
+ * it blocks again. The engine is a discrete event simulator that drives the
+ * mock kernel in sched_sim_kern.c with wakeups, blocks, quantum expiry,
+ * IPIs and scheduler ticks, and measures what the policy does with them.
+ *
+ * Workloads come either from a text trace (see traces/README) or from a
+ * RAW_VERSION1 kdebug file, from which bursts are reconstructed using the
+ * MACH_MAKE_RUNNABLE and MACH_SCHED context switch events.
+ *
+ * Usage: sched_sim [-p clutch|edge|amp] [-c topology] [-b bootarg=value]...
+ *                  [-k kdebug_file [-T numer/denom] [-o trace_out]] [trace]
+ */
+
+#include "sched_sim.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint64_t sched_sim_now;
+
+#pragma mark - Workload
+
+struct sim_tg {
+	uint64_t                id;
+	char                    name[32];
+	cluster_type_t          initial_recommendation;
+	struct thread_group     *tg;
+
+	uint64_t                cpu_time;
+	uint64_t                demand;
+	/* CPU time received while the trace was still issuing bursts */
+	uint64_t                window_cpu_time;
+	uint64_t                cpu_migrations;
+	uint64_t                cluster_migrations;
+	struct sim_samples      *latency;
+};
+
+struct sim_thread {
+	uint64_t                tid;
+	struct sim_tg           *tg;
+	int                     base_pri;
+	bool                    fixed;
+	thread_t                thread;
+
+	/* CPU time still owed to the current burst */
+	uint64_t                remaining;
+	uint64_t                demand;
+	uint64_t                coalesced;
+};
+
+struct sim_run {
+	uint64_t                time;
+	struct sim_thread       *thread;
+	uint64_t                demand;
+};
+
+struct sim_rec {
+	uint64_t                time;
+	struct sim_tg           *tg;
+	cluster_type_t          recommendation;
+};
+
+struct sim_samples {
+	uint64_t                *values;
+	size_t                  count;
+	size_t                  capacity;
+};
+
+static struct {
+	struct sim_tg           **tgs;
+	size_t                  ntgs;
+	struct sim_thread       **threads;
+	size_t                  nthreads;
+	struct sim_run          *runs;
+	size_t                  nruns;
+	struct sim_rec          *recs;
+	size_t                  nrecs;
+} workload;
+
+#define SIM_GROW(array, count, capacity_hint) do {                             \
+	if (((count) & ((count) - 1)) == 0) {                                  \
+	        size_t __cap = (count) ? (count) * 2 : (capacity_hint);        \
+	        (array) = realloc((array), __cap * sizeof(*(array)));          \
+	        if ((array) == NULL) {                                         \
+	                err(1, "realloc");                                     \
+	        }                                                              \
+	}                                                                      \
+} while (0)
+
+static void
+sim_samples_add(struct sim_samples *samples, uint64_t value)
+{
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+		samples->values = realloc(samples->values, samples->capacity * sizeof(uint64_t));
+		if (samples->values == NULL) {
+			err(1, "realloc");
+		}
+	}
+	samples->values[samples->count++] = value;
+}
+
+static struct sim_tg *
+workload_tg_lookup(uint64_t id, bool create)
+{
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		if (workload.tgs[i]->id == id) {
+			return workload.tgs[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	struct sim_tg *stg = calloc(1, sizeof(*stg));
+	stg->id = id;
+	snprintf(stg->name, sizeof(stg->name), "tg%llu", (unsigned long long)id);
+	stg->initial_recommendation = CLUSTER_TYPE_SMP;
+	stg->latency = calloc(1, sizeof(struct sim_samples));
+	SIM_GROW(workload.tgs, workload.ntgs, 8);
+	workload.tgs[workload.ntgs++] = stg;
+	return stg;
+}
+
+static struct sim_thread *
+workload_thread_lookup(uint64_t tid)
+{
+	for (size_t i = 0; i < workload.nthreads; i++) {
+		if (workload.threads[i]->tid == tid) {
+			return workload.threads[i];
+		}
+	}
+	return NULL;
+}
+
+static struct sim_thread *
+workload_thread_add(uint64_t tid, struct sim_tg *stg, int base_pri, bool fixed)
+{
+	struct sim_thread *st = calloc(1, sizeof(*st));
+
+	st->tid = tid;
+	st->tg = stg;
+	st->base_pri = base_pri;
+	st->fixed = fixed;
+	SIM_GROW(workload.threads, workload.nthreads, 16);
+	workload.threads[workload.nthreads++] = st;
+	return st;
+}
+
+static void
+workload_run_add(uint64_t time, struct sim_thread *st, uint64_t demand)
+{
+	SIM_GROW(workload.runs, workload.nruns, 256);
+	workload.runs[workload.nruns++] = (struct sim_run){
+		.time = time, .thread = st, .demand = demand,
+	};
+}
+
+static void
+workload_rec_add(uint64_t time, struct sim_tg *stg, cluster_type_t recommendation)
+{
+	SIM_GROW(workload.recs, workload.nrecs, 16);
+	workload.recs[workload.nrecs++] = (struct sim_rec){
+		.time = time, .tg = stg, .recommendation = recommendation,
+	};
+}
+
+static bool
+parse_cluster_type(const char *s, cluster_type_t *type)
+{
+	if (strcmp(s, "E") == 0 || strcmp(s, "e") == 0) {
+		*type = CLUSTER_TYPE_E;
+	} else if (strcmp(s, "P") == 0 || strcmp(s, "p") == 0) {
+		*type = CLUSTER_TYPE_P;
+	} else if (strcmp(s, "SMP") == 0 || strcmp(s, "smp") == 0) {
+		*type = CLUSTER_TYPE_SMP;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Text traces. One directive per line, '#' starts a comment, times and
+ * durations are in microseconds:
+ *
+ *	tg <id> <name> [E|P]
+ *	thread <tid> <tg id> <base pri> [fixed]
+ *	run <time> <tid> <cpu time>
+ *	rec <time> <tg id> <E|P|SMP>
+ */
+static void
+workload_read_text(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	unsigned lineno = 0;
+
+	if (f == NULL) {
+		err(1, "%s", path);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *argv[6];
+		int argc = 0;
+
+		lineno++;
+		char *comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		for (char *tok = strtok(line, " \t\r\n"); tok != NULL && argc < 6; tok = strtok(NULL, " \t\r\n")) {
+			argv[argc++] = tok;
+		}
+		if (argc == 0) {
+			continue;
+		}
+
+		if (strcmp(argv[0], "tg") == 0 && (argc == 3 || argc == 4)) {
+			uint64_t id = strtoull(argv[1], NULL, 0);
+			if (workload_tg_lookup(id, false) != NULL) {
+				errx(1, "%s:%u: duplicate thread group %llu", path, lineno, (unsigned long long)id);
+			}
+			struct sim_tg *stg = workload_tg_lookup(id, true);
+			snprintf(stg->name, sizeof(stg->name), "%s", argv[2]);
+			if (argc == 4 && !parse_cluster_type(argv[3], &stg->initial_recommendation)) {
+				errx(1, "%s:%u: bad cluster type \"%s\"", path, lineno, argv[3]);
+			}
+		} else if (strcmp(argv[0], "thread") == 0 && (argc == 4 || argc == 5)) {
+			uint64_t tid = strtoull(argv[1], NULL, 0);
+			struct sim_tg *stg = workload_tg_lookup(strtoull(argv[2], NULL, 0), false);
+			int pri = (int)strtol(argv[3], NULL, 0);
+			if (stg == NULL) {
+				errx(1, "%s:%u: unknown thread group %s", path, lineno, argv[2]);
+			}
+			if (workload_thread_lookup(tid) != NULL) {
+				errx(1, "%s:%u: duplicate thread %llu", path, lineno, (unsigned long long)tid);
+			}
+			if (pri < MINPRI_USER || pri >= BASEPRI_RTQUEUES) {
+				errx(1, "%s:%u: priority %d is outside [%d, %d)", path, lineno, pri, MINPRI_USER, BASEPRI_RTQUEUES);
+			}
+			if (argc == 5 && strcmp(argv[4], "fixed") != 0) {
+				errx(1, "%s:%u: unknown thread attribute \"%s\"", path, lineno, argv[4]);
+			}
+			workload_thread_add(tid, stg, pri, argc == 5);
+		} else if (strcmp(argv[0], "run") == 0 && argc == 4) {
+			struct sim_thread *st = workload_thread_lookup(strtoull(argv[2], NULL, 0));
+			if (st == NULL) {
+				errx(1, "%s:%u: unknown thread %s", path, lineno, argv[2]);
+			}
+			workload_run_add(strtoull(argv[1], NULL, 0) * NSEC_PER_USEC, st,
+			    strtoull(argv[3], NULL, 0) * NSEC_PER_USEC);
+		} else if (strcmp(argv[0], "rec") == 0 && argc == 4) {
+			struct sim_tg *stg = workload_tg_lookup(strtoull(argv[2], NULL, 0), false);
+			cluster_type_t type;
+			if (stg == NULL) {
+				errx(1, "%s:%u: unknown thread group %s", path, lineno, argv[2]);
+			}
+			if (!parse_cluster_type(argv[3], &type)) {
+				errx(1, "%s:%u: bad cluster type \"%s\"", path, lineno, argv[3]);
+			}
+			workload_rec_add(strtoull(argv[1], NULL, 0) * NSEC_PER_USEC, stg, type);
+		} else {
+			errx(1, "%s:%u: cannot parse directive \"%s\"", path, lineno, argv[0]);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * RAW_VERSION1 kdebug files, as written by trace(1) -L or kdebug_trace_read.
+ * The structures mirror those in <sys/kdebug_private.h>.
+ */
+#define SIM_RAW_VERSION1                0x55aa0101
+#define SIM_KDBG_CLASS_CODE(debugid)    ((debugid) & 0xfffffffcu)
+#define SIM_MACH_SCHED                  0x01400000u     /* MACHDBG_CODE(DBG_MACH_SCHED, MACH_SCHED) */
+#define SIM_MACH_MAKE_RUNNABLE          0x01400018u     /* MACHDBG_CODE(DBG_MACH_SCHED, MACH_MAKE_RUNNABLE) */
+#define SIM_MACH_CHANGE_PRIORITY        0x0140009cu     /* MACHDBG_CODE(DBG_MACH_SCHED, MACH_SCHED_CHANGE_PRIORITY) */
+#define SIM_MACH_THREAD_GROUP_SET       0x01a60008u     /* MACHDBG_CODE(DBG_MACH_THREAD_GROUP, MACH_THREAD_GROUP_SET) */
+
+struct sim_raw_header {
+	int32_t                 version_no;
+	int32_t                 thread_count;
+	uint64_t                TOD_secs;
+	uint32_t                TOD_usecs;
+} __attribute__((packed));
+
+struct sim_kd_threadmap {
+	uint64_t                thread;
+	int32_t                 valid;
+	char                    command[20];
+};
+
+struct sim_kd_buf {
+	uint64_t                timestamp;
+	uint64_t                arg1;
+	uint64_t                arg2;
+	uint64_t                arg3;
+	uint64_t                arg4;
+	uint64_t                arg5;
+	uint32_t                debugid;
+	uint32_t                cpuid;
+	uint64_t                unused;
+};
+
+/* Per-thread reconstruction state */
+struct sim_kd_thread {
+	uint64_t                tid;
+	uint64_t                tg_id;
+	int                     base_pri;
+	int                     sched_pri;
+	bool                    has_base_pri;
+	bool                    burst_open;
+	bool                    on_core;
+	uint64_t                burst_start;
+	uint64_t                burst_demand;
+	uint64_t                on_core_since;
+	struct sim_thread       *st;
+};
+
+static struct sim_kd_thread *
+kd_thread_lookup(struct sim_kd_thread **threads, size_t *nthreads, uint64_t tid)
+{
+	for (size_t i = 0; i < *nthreads; i++) {
+		if ((*threads)[i].tid == tid) {
+			return &(*threads)[i];
+		}
+	}
+	SIM_GROW(*threads, *nthreads, 64);
+	struct sim_kd_thread *kt = &(*threads)[(*nthreads)++];
+	memset(kt, 0, sizeof(*kt));
+	kt->tid = tid;
+	return kt;
+}
+
+static void
+kd_burst_close(struct sim_kd_thread *kt, uint64_t base)
+{
+	if (!kt->burst_open || kt->burst_demand == 0) {
+		kt->burst_open = false;
+		return;
+	}
+	kt->burst_open = false;
+
+	/* Realtime threads are outside the simulator's scope */
+	int pri = kt->has_base_pri ? kt->base_pri : kt->sched_pri;
+	if (pri >= BASEPRI_RTQUEUES) {
+		return;
+	}
+	if (pri < MINPRI_USER) {
+		pri = MINPRI_USER;
+	}
+
+	if (kt->st == NULL) {
+		kt->st = workload_thread_add(kt->tid, workload_tg_lookup(kt->tg_id, true), pri, false);
+	}
+	workload_run_add(kt->burst_start - base, kt->st, kt->burst_demand);
+}
+
+static int
+kd_buf_compare(const void *a, const void *b)
+{
+	const struct sim_kd_buf *ka = a, *kb = b;
+
+	if (ka->timestamp != kb->timestamp) {
+		return ka->timestamp < kb->timestamp ? -1 : 1;
+	}
+	return 0;
+}
+
+static void
+workload_read_kdebug(const char *path, uint32_t numer, uint32_t denom)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	struct sim_raw_header header;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		err(1, "%s", path);
+	}
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.version_no != SIM_RAW_VERSION1) {
+		errx(1, "%s: not a RAW_VERSION1 kdebug file", path);
+	}
+
+	off_t offset = sizeof(header) + (off_t)header.thread_count * (off_t)sizeof(struct sim_kd_threadmap);
+	offset = (offset + 4095) & ~(off_t)4095;
+	if (offset > st.st_size) {
+		errx(1, "%s: truncated thread map", path);
+	}
+
+	size_t nevents = (size_t)(st.st_size - offset) / sizeof(struct sim_kd_buf);
+	struct sim_kd_buf *events = malloc(MAX(nevents, 1) * sizeof(*events));
+	if (events == NULL) {
+		err(1, "malloc");
+	}
+	if (pread(fd, events, nevents * sizeof(*events), offset) != (ssize_t)(nevents * sizeof(*events))) {
+		err(1, "%s", path);
+	}
+	close(fd);
+
+	/* Per-CPU buffers are merged by the writer, but not always stably. */
+	qsort(events, nevents, sizeof(*events), kd_buf_compare);
+
+	struct sim_kd_thread *threads = NULL;
+	size_t nthreads = 0;
+	uint64_t base = nevents ? events[0].timestamp : 0;
+	uint64_t last = base;
+
+	for (size_t i = 0; i < nevents; i++) {
+		struct sim_kd_buf *kd = &events[i];
+		uint64_t t = kd->timestamp * numer / denom;
+		struct sim_kd_thread *kt;
+
+		last = t;
+		switch (SIM_KDBG_CLASS_CODE(kd->debugid)) {
+		case SIM_MACH_MAKE_RUNNABLE:
+			kt = kd_thread_lookup(&threads, &nthreads, kd->arg1);
+			kt->sched_pri = (int)kd->arg2;
+			kd_burst_close(kt, base * numer / denom);
+			kt->burst_open = true;
+			kt->burst_start = t;
+			kt->burst_demand = 0;
+			break;
+		case SIM_MACH_SCHED: {
+			struct sim_kd_thread *old = kd_thread_lookup(&threads, &nthreads, kd->arg5);
+			struct sim_kd_thread *new = kd_thread_lookup(&threads, &nthreads, kd->arg2);
+			if (old->on_core && old->burst_open) {
+				old->burst_demand += t - old->on_core_since;
+			}
+			old->on_core = false;
+			new->on_core = true;
+			new->on_core_since = t;
+			new->sched_pri = (int)kd->arg4;
+			break;
+		}
+		case SIM_MACH_CHANGE_PRIORITY:
+			kt = kd_thread_lookup(&threads, &nthreads, kd->arg1);
+			if (!kt->has_base_pri) {
+				kt->base_pri = (int)kd->arg2;
+				kt->has_base_pri = true;
+			}
+			break;
+		case SIM_MACH_THREAD_GROUP_SET:
+			kt = kd_thread_lookup(&threads, &nthreads, kd->arg3);
+			if (kt->st == NULL) {
+				kt->tg_id = kd->arg2;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < nthreads; i++) {
+		struct sim_kd_thread *kt = &threads[i];
+		if (kt->on_core && kt->burst_open) {
+			kt->burst_demand += last - kt->on_core_since;
+		}
+		kd_burst_close(kt, base * numer / denom);
+	}
+
+	free(threads);
+	free(events);
+}
+
+/*
+ * Write the workload back out as a text trace, so that a kdebug capture
+ * can be trimmed or edited by hand.
+ */
+static void
+workload_write_text(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL) {
+		err(1, "%s", path);
+	}
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		fprintf(f, "tg %llu %s\n", (unsigned long long)workload.tgs[i]->id, workload.tgs[i]->name);
+	}
+	for (size_t i = 0; i < workload.nthreads; i++) {
+		struct sim_thread *st = workload.threads[i];
+		fprintf(f, "thread %llu %llu %d%s\n", (unsigned long long)st->tid,
+		    (unsigned long long)st->tg->id, st->base_pri, st->fixed ? " fixed" : "");
+	}
+	for (size_t i = 0; i < workload.nruns; i++) {
+		struct sim_run *run = &workload.runs[i];
+		fprintf(f, "run %llu %llu %llu\n", (unsigned long long)(run->time / NSEC_PER_USEC),
+		    (unsigned long long)run->thread->tid,
+		    (unsigned long long)MAX(run->demand / NSEC_PER_USEC, 1));
+	}
+	fclose(f);
+}
+
+#pragma mark - Event queue
+
+typedef enum {
+	SIM_EVENT_WAKE,
+	SIM_EVENT_REC,
+	SIM_EVENT_AST,
+	SIM_EVENT_QUANTUM,
+	SIM_EVENT_CPU_DONE,
+	SIM_EVENT_TICK,
+} sim_event_type_t;
+
+struct sim_event {
+	uint64_t                time;
+	uint64_t                seq;
+	sim_event_type_t        type;
+	uint32_t                cpu;
+	uint64_t                generation;
+	void                    *arg;
+};
+
+static struct {
+	struct sim_event        *heap;
+	size_t                  count;
+	size_t                  capacity;
+	uint64_t                seq;
+} events;
+
+static bool
+sim_event_before(const struct sim_event *a, const struct sim_event *b)
+{
+	if (a->time != b->time) {
+		return a->time < b->time;
+	}
+	return a->seq < b->seq;
+}
+
+static void
+sim_event_push(uint64_t time, sim_event_type_t type, uint32_t cpu, uint64_t generation, void *arg)
+{
+	if (events.count == events.capacity) {
+		events.capacity = events.capacity ? events.capacity * 2 : 1024;
+		events.heap = realloc(events.heap, events.capacity * sizeof(struct sim_event));
+		if (events.heap == NULL) {
+			err(1, "realloc");
+		}
+	}
+
+	size_t i = events.count++;
+	struct sim_event ev = {
+		.time = time, .seq = events.seq++, .type = type, .cpu = cpu,
+		.generation = generation, .arg = arg,
+	};
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!sim_event_before(&ev, &events.heap[parent])) {
+			break;
+		}
+		events.heap[i] = events.heap[parent];
+		i = parent;
+	}
+	events.heap[i] = ev;
+}
+
+static struct sim_event
+sim_event_pop(void)
+{
+	struct sim_event top = events.heap[0];
+	struct sim_event last = events.heap[--events.count];
+	size_t i = 0;
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= events.count) {
+			break;
+		}
+		if (child + 1 < events.count && sim_event_before(&events.heap[child + 1], &events.heap[child])) {
+			child++;
+		}
+		if (!sim_event_before(&events.heap[child], &last)) {
+			break;
+		}
+		events.heap[i] = events.heap[child];
+		i = child;
+	}
+	if (events.count > 0) {
+		events.heap[i] = last;
+	}
+	return top;
+}
+
+#pragma mark - Engine
+
+struct sim_cpu {
+	processor_t             processor;
+	/* Bumped whenever the CPU's timers must be re-armed */
+	uint64_t                generation;
+	bool                    ast_pending;
+	uint64_t                last_account;
+	uint64_t                busy_time;
+	uint64_t                context_switches;
+};
+
+static struct sim_cpu sim_cpus[MAX_CPUS];
+static uint32_t sim_ncpus;
+
+static struct {
+	struct sim_samples      latency;
+	struct sim_samples      bucket_latency[TH_BUCKET_SCHED_MAX];
+	uint64_t                cpu_migrations;
+	uint64_t                cluster_migrations;
+	uint64_t                context_switches;
+	uint64_t                coalesced;
+	size_t                  runnable;
+	size_t                  pending_runs;
+	uint64_t                window_end;
+} stats;
+
+static bool sim_verbose;
+
+/* Charge CPU time for everything that ran up to sched_sim_now. */
+static void
+sim_account(void)
+{
+	for (uint32_t i = 0; i < sim_ncpus; i++) {
+		struct sim_cpu *cpu = &sim_cpus[i];
+		thread_t thread = cpu->processor->active_thread;
+		uint64_t delta = sched_sim_now - cpu->last_account;
+
+		cpu->last_account = sched_sim_now;
+		if (delta == 0 || (thread->state & TH_IDLE)) {
+			continue;
+		}
+
+		struct sim_thread *st = thread->sim_private;
+		thread->sim_cpu_time += delta;
+		st->tg->cpu_time += delta;
+		cpu->busy_time += delta;
+		st->remaining = (delta < st->remaining) ? st->remaining - delta : 0;
+	}
+}
+
+void
+sched_sim_signal_processor(processor_t processor)
+{
+	struct sim_cpu *cpu = &sim_cpus[processor->cpu_id];
+
+	if (!cpu->ast_pending) {
+		cpu->ast_pending = true;
+		sim_event_push(sched_sim_now, SIM_EVENT_AST, processor->cpu_id, 0, NULL);
+	}
+}
+
+void
+sched_sim_thread_switch(processor_t processor, thread_t old_thread, thread_t new_thread)
+{
+	struct sim_cpu *cpu = &sim_cpus[processor->cpu_id];
+
+	cpu->context_switches++;
+	stats.context_switches++;
+
+	if (sim_verbose) {
+		printf("%12.3f cpu%-2d %8lld -> %lld\n", (double)sched_sim_now / NSEC_PER_USEC, processor->cpu_id,
+		    (old_thread->state & TH_IDLE) ? -1LL : (long long)old_thread->thread_id,
+		    (new_thread->state & TH_IDLE) ? -1LL : (long long)new_thread->thread_id);
+	}
+
+	if (new_thread->state & TH_IDLE) {
+		return;
+	}
+
+	struct sim_thread *st = new_thread->sim_private;
+	uint64_t latency = sched_sim_now - new_thread->last_made_runnable_time;
+
+	sim_samples_add(&stats.latency, latency);
+	sim_samples_add(&stats.bucket_latency[new_thread->th_sched_bucket], latency);
+	sim_samples_add(st->tg->latency, latency);
+
+	processor_t last = new_thread->last_processor;
+	if (last != PROCESSOR_NULL && last != processor) {
+		stats.cpu_migrations++;
+		st->tg->cpu_migrations++;
+		if (last->processor_set != processor->processor_set) {
+			stats.cluster_migrations++;
+			st->tg->cluster_migrations++;
+		}
+	}
+}
+
+void
+sched_sim_processor_dispatched(processor_t processor)
+{
+	struct sim_cpu *cpu = &sim_cpus[processor->cpu_id];
+	thread_t thread = processor->active_thread;
+
+	cpu->generation++;
+	if (thread->state & TH_IDLE) {
+		return;
+	}
+
+	struct sim_thread *st = thread->sim_private;
+	sim_event_push(sched_sim_now + st->remaining, SIM_EVENT_CPU_DONE, processor->cpu_id, cpu->generation, NULL);
+	if (processor->quantum_end > sched_sim_now) {
+		sim_event_push(processor->quantum_end, SIM_EVENT_QUANTUM, processor->cpu_id, cpu->generation, NULL);
+	} else {
+		sim_event_push(sched_sim_now, SIM_EVENT_QUANTUM, processor->cpu_id, cpu->generation, NULL);
+	}
+}
+
+/*
+ * Once the last burst has arrived every thread group eventually gets all
+ * the CPU it asked for, so fairness is judged on what each group had
+ * received by the time the trace ended.
+ */
+static void
+sim_window_close(void)
+{
+	if (stats.window_end != 0) {
+		return;
+	}
+	stats.window_end = sched_sim_now;
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		workload.tgs[i]->window_cpu_time = workload.tgs[i]->cpu_time;
+	}
+}
+
+static void
+sim_wake(struct sim_run *run)
+{
+	struct sim_thread *st = run->thread;
+	thread_t thread = st->thread;
+
+	stats.pending_runs--;
+	st->demand += run->demand;
+	st->tg->demand += run->demand;
+
+	if (thread->state & TH_RUN) {
+		/* Still working on the previous burst; treat as one longer burst */
+		st->remaining += run->demand;
+		st->coalesced++;
+		stats.coalesced++;
+		if (stats.pending_runs == 0) {
+			sim_window_close();
+		}
+		return;
+	}
+
+	st->remaining = run->demand;
+	stats.runnable++;
+	sched_sim_thread_wakeup(thread);
+	if (stats.pending_runs == 0) {
+		sim_window_close();
+	}
+}
+
+static void
+sim_run(uint64_t end_time)
+{
+	for (size_t i = 0; i < workload.nruns; i++) {
+		sim_event_push(workload.runs[i].time, SIM_EVENT_WAKE, 0, 0, &workload.runs[i]);
+	}
+	stats.pending_runs = workload.nruns;
+	for (size_t i = 0; i < workload.nrecs; i++) {
+		sim_event_push(workload.recs[i].time, SIM_EVENT_REC, 0, 0, &workload.recs[i]);
+	}
+
+	uint64_t tick_interval;
+	clock_interval_to_absolutetime_interval(USEC_PER_SEC >> 3, NSEC_PER_USEC, &tick_interval);
+	sim_event_push(tick_interval, SIM_EVENT_TICK, 0, 0, NULL);
+
+	while (events.count > 0) {
+		struct sim_event ev = sim_event_pop();
+		struct sim_cpu *cpu = &sim_cpus[ev.cpu];
+
+		if (ev.time > end_time) {
+			break;
+		}
+		assert(ev.time >= sched_sim_now);
+		sched_sim_now = ev.time;
+		sim_account();
+
+		switch (ev.type) {
+		case SIM_EVENT_WAKE:
+			sim_wake(ev.arg);
+			break;
+		case SIM_EVENT_REC: {
+			struct sim_rec *rec = ev.arg;
+			sched_sim_thread_group_recommend(rec->tg->tg, rec->recommendation);
+			break;
+		}
+		case SIM_EVENT_AST:
+			cpu->ast_pending = false;
+			sched_sim_ast(cpu->processor);
+			break;
+		case SIM_EVENT_QUANTUM:
+			if (ev.generation == cpu->generation) {
+				sched_sim_quantum_expire(cpu->processor);
+			}
+			break;
+		case SIM_EVENT_CPU_DONE:
+			if (ev.generation == cpu->generation) {
+				struct sim_thread *st = cpu->processor->active_thread->sim_private;
+				if (st->remaining != 0) {
+					/* A burst was coalesced into the running one; keep going */
+					sim_event_push(sched_sim_now + st->remaining, SIM_EVENT_CPU_DONE, ev.cpu, cpu->generation, NULL);
+					break;
+				}
+				stats.runnable--;
+				sched_sim_thread_block(cpu->processor);
+			}
+			break;
+		case SIM_EVENT_TICK:
+			sched_sim_maintenance();
+			if (stats.runnable > 0 || stats.pending_runs > 0) {
+				sim_event_push(sched_sim_now + tick_interval, SIM_EVENT_TICK, 0, 0, NULL);
+			}
+			break;
+		}
+		sched_sim_idle_poll();
+	}
+	sim_window_close();
+}
+
+#pragma mark - Reporting
+
+static int
+u64_compare(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+	return (ua > ub) - (ua < ub);
+}
+
+static double
+percentile_us(struct sim_samples *samples, double pct)
+{
+	size_t idx = (size_t)ceil(pct / 100.0 * (double)samples->count);
+	idx = (idx == 0) ? 0 : idx - 1;
+	return (double)samples->values[idx] / NSEC_PER_USEC;
+}
+
+static void
+report_latency(const char *label, struct sim_samples *samples)
+{
+	if (samples->count == 0) {
+		return;
+	}
+	qsort(samples->values, samples->count, sizeof(uint64_t), u64_compare);
+	printf("  %-20s %9zu %10.1f %10.1f %10.1f %10.1f\n", label, samples->count,
+	    percentile_us(samples, 50), percentile_us(samples, 90),
+	    percentile_us(samples, 99), percentile_us(samples, 100));
+}
+
+static void
+sim_report(void)
+{
+	static const char *bucket_names[TH_BUCKET_SCHED_MAX] = {
+		[TH_BUCKET_FIXPRI] = "FIXPRI",
+		[TH_BUCKET_SHARE_FG] = "FG",
+		[TH_BUCKET_SHARE_IN] = "IN",
+		[TH_BUCKET_SHARE_DF] = "DF",
+		[TH_BUCKET_SHARE_UT] = "UT",
+		[TH_BUCKET_SHARE_BG] = "BG",
+	};
+	uint64_t total_cpu = 0;
+
+	printf("policy %s, %u CPUs in %u clusters, %zu threads in %zu groups, %zu bursts\n",
+	    sched_sim_policy_name(), sim_ncpus, sched_sim_pset_count(),
+	    workload.nthreads, workload.ntgs, workload.nruns);
+	printf("simulated %.3f ms, %llu context switches, %llu bursts coalesced\n\n",
+	    (double)sched_sim_now / NSEC_PER_MSEC, (unsigned long long)stats.context_switches,
+	    (unsigned long long)stats.coalesced);
+
+	printf("scheduling latency (us)      count        p50        p90        p99        max\n");
+	report_latency("all", &stats.latency);
+	for (int i = 0; i < TH_BUCKET_SCHED_MAX; i++) {
+		if (bucket_names[i] != NULL) {
+			char label[32];
+			snprintf(label, sizeof(label), "bucket %s", bucket_names[i]);
+			report_latency(label, &stats.bucket_latency[i]);
+		}
+	}
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		char label[40];
+		snprintf(label, sizeof(label), "tg %s", workload.tgs[i]->name);
+		report_latency(label, workload.tgs[i]->latency);
+	}
+
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		total_cpu += workload.tgs[i]->cpu_time;
+	}
+
+	/*
+	 * Jain's fairness index over the fraction of its demand each thread
+	 * group received: 1.0 when every group got the same fraction, 1/n when
+	 * one group got everything.
+	 */
+	double sum = 0, sum_sq = 0;
+	unsigned n = 0;
+
+	printf("\nthread group         cpu (ms)   share  demand (ms)  received  cpu migr  cluster migr\n");
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		struct sim_tg *stg = workload.tgs[i];
+		double received = stg->demand ? (double)stg->window_cpu_time / (double)stg->demand : 0;
+
+		if (stg->demand > 0) {
+			sum += received;
+			sum_sq += received * received;
+			n++;
+		}
+		printf("  %-16s %10.3f %6.1f%% %12.3f %8.1f%% %9llu %13llu\n", stg->name,
+		    (double)stg->cpu_time / NSEC_PER_MSEC,
+		    total_cpu ? 100.0 * (double)stg->cpu_time / (double)total_cpu : 0.0,
+		    (double)stg->demand / NSEC_PER_MSEC, 100.0 * received,
+		    (unsigned long long)stg->cpu_migrations, (unsigned long long)stg->cluster_migrations);
+	}
+	printf("  fairness (Jain)  %.4f (received = share of demand served by %.3f ms, when the trace ended)\n",
+	    (n && sum_sq > 0) ? (sum * sum) / (n * sum_sq) : 1.0, (double)stats.window_end / NSEC_PER_MSEC);
+
+	printf("\nmigrations: %llu cross-CPU, %llu cross-cluster\n",
+	    (unsigned long long)stats.cpu_migrations, (unsigned long long)stats.cluster_migrations);
+
+	static const char *types[] = { [CLUSTER_TYPE_SMP] = "SMP", [CLUSTER_TYPE_E] = "E", [CLUSTER_TYPE_P] = "P" };
+
+	/* Idle steals, as exported by kern.sched_steal_stats; always zero for clutch */
+	printf("\ncluster  steals  cross-type  declined  saved (ms)\n");
+	for (uint32_t i = 0; i < sched_sim_pset_count(); i++) {
+		processor_set_t pset = pset_array[i];
+		printf("  %3d %-3s %7llu %11llu %9llu %11.3f\n", pset->pset_id, types[pset->pset_type],
+		    (unsigned long long)pset->pset_steal_count,
+		    (unsigned long long)pset->pset_steal_cross_type_count,
+		    (unsigned long long)pset->pset_steal_declined_count,
+		    (double)pset->pset_steal_saved_latency_us / 1000.0);
+	}
+
+	printf("\ncpu  cluster  busy (ms)  util  switches\n");
+	for (uint32_t i = 0; i < sim_ncpus; i++) {
+		processor_t processor = sim_cpus[i].processor;
+		printf("  %-3u %3d %-3s %10.3f %4.0f%% %9llu\n", i, processor->processor_set->pset_id,
+		    types[processor->processor_set->pset_type],
+		    (double)sim_cpus[i].busy_time / NSEC_PER_MSEC,
+		    sched_sim_now ? 100.0 * (double)sim_cpus[i].busy_time / (double)sched_sim_now : 0.0,
+		    (unsigned long long)sim_cpus[i].context_switches);
+	}
+}
+
+#pragma mark - main
+
+static void __dead2
+usage(const char *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-v] [-p clutch|edge|amp] [-c topology] [-b bootarg[=value]]... [-e end_ms]\n"
+	    "          [-k kdebug_file [-T numer/denom] [-o trace_out] | trace_file]\n"
+	    "\n"
+	    "  -p  scheduler policy to replay against (default clutch)\n"
+	    "  -c  topology, e.g. \"8\" or \"E4,P4\" (default \"E4,P4\"; \"8\" for clutch)\n"
+	    "  -b  boot-arg visible to the scheduler, e.g. sched_clutch_bucket_group_interactive_pri=4\n"
+	    "  -e  stop the simulation at this many milliseconds\n"
+	    "  -k  read a RAW_VERSION1 kdebug file instead of a text trace\n"
+	    "  -T  mach timebase of the kdebug file (default 1/1, Apple silicon is 125/3)\n"
+	    "  -o  write the workload reconstructed from -k as a text trace and exit\n"
+	    "  -v  print every context switch\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	sched_sim_policy_t policy = SCHED_SIM_POLICY_CLUTCH;
+	const char *topology = NULL;
+	const char *kdebug_path = NULL;
+	const char *trace_out = NULL;
+	uint32_t numer = 1, denom = 1;
+	uint64_t end_time = UINT64_MAX;
+	const char *progname = argv[0];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:c:e:k:o:p:T:v")) != -1) {
+		switch (ch) {
+		case 'b':
+			if (sched_sim_boot_arg_set(optarg) != 0) {
+				errx(1, "too many boot-args");
+			}
+			break;
+		case 'c':
+			topology = optarg;
+			break;
+		case 'e':
+			end_time = strtoull(optarg, NULL, 0) * NSEC_PER_MSEC;
+			break;
+		case 'k':
+			kdebug_path = optarg;
+			break;
+		case 'o':
+			trace_out = optarg;
+			break;
+		case 'p':
+			if (strcmp(optarg, "clutch") == 0) {
+				policy = SCHED_SIM_POLICY_CLUTCH;
+			} else if (strcmp(optarg, "edge") == 0) {
+				policy = SCHED_SIM_POLICY_EDGE;
+			} else if (strcmp(optarg, "amp") == 0) {
+				policy = SCHED_SIM_POLICY_AMP;
+			} else {
+				usage(progname);
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u/%u", &numer, &denom) != 2 || numer == 0 || denom == 0) {
+				usage(progname);
+			}
+			break;
+		case 'v':
+			sim_verbose = true;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((kdebug_path == NULL) == (argc != 1) || (trace_out != NULL && kdebug_path == NULL)) {
+		usage(progname);
+	}
+	if (kdebug_path != NULL) {
+		workload_read_kdebug(kdebug_path, numer, denom);
+		if (trace_out != NULL) {
+			workload_write_text(trace_out);
+			return 0;
+		}
+	} else {
+		workload_read_text(argv[0]);
+	}
+
+	if (topology == NULL) {
+		topology = (policy == SCHED_SIM_POLICY_CLUTCH) ? "8" : "E4,P4";
+	}
+	if (sched_sim_init(policy, topology) != 0) {
+		return 1;
+	}
+
+	sim_ncpus = sched_sim_processor_count();
+	for (uint32_t i = 0; i < sim_ncpus; i++) {
+		sim_cpus[i].processor = processor_array[i];
+	}
+
+	for (size_t i = 0; i < workload.ntgs; i++) {
+		struct sim_tg *stg = workload.tgs[i];
+		stg->tg = sched_sim_thread_group_create(stg->id, stg->name);
+		if (stg->initial_recommendation != CLUSTER_TYPE_SMP) {
+			sched_sim_thread_group_recommend(stg->tg, stg->initial_recommendation);
+		}
+	}
+	for (size_t i = 0; i < workload.nthreads; i++) {
+		struct sim_thread *st = workload.threads[i];
+		st->thread = sched_sim_thread_create(st->tid, st->tg->tg, st->base_pri, st->fixed);
+		st->thread->sim_private = st;
+	}
+
+	sim_run(end_time);
+	sim_report();
+	return 0;
+}
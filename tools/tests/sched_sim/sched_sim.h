@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sched_sim.h
+ *
+ * Interface between the replay engine (sched_sim.c) and the mock kernel
+ * (sched_sim_kern.c).
+ *
+ * The mock kernel owns every piece of scheduler state and only runs when
+ * the engine calls one of the sched_sim_*() entry points below, each of
+ * which corresponds to something a CPU does in the real kernel: a thread
+ * waking up, a thread blocking, the quantum timer firing, an AST being
+ * taken or the maintenance thread running. The mock kernel calls back into
+ * the engine whenever it needs a CPU to do something in the future (take
+ * an IPI) or when a CPU switches threads.
+ */
+
+#ifndef _SCHED_SIM_H_
+#define _SCHED_SIM_H_
+
+#include "sched_sim_types.h"
+
+/*
+ * Policy under test, selected with -p.
+ */
+typedef enum {
+	SCHED_SIM_POLICY_CLUTCH,
+	SCHED_SIM_POLICY_EDGE,
+	SCHED_SIM_POLICY_AMP,
+} sched_sim_policy_t;
+
+/*
+ * Boot and topology.
+ *
+ * The topology string is a comma separated list of clusters, each an
+ * optional type letter followed by a CPU count, e.g. "8" or "E4,P4". The
+ * first cluster is the boot cluster. The clutch policy treats every
+ * cluster as SMP; the AMP policy requires exactly one E and one P cluster.
+ */
+extern int              sched_sim_boot_arg_set(const char *arg);
+extern int              sched_sim_init(sched_sim_policy_t policy, const char *topology);
+extern const char      *sched_sim_policy_name(void);
+extern uint32_t         sched_sim_processor_count(void);
+extern uint32_t         sched_sim_pset_count(void);
+
+/*
+ * Workload.
+ */
+extern struct thread_group *sched_sim_thread_group_create(uint64_t tg_id, const char *name);
+extern thread_t         sched_sim_thread_create(uint64_t tid, struct thread_group *tg, int base_pri, bool fixed);
+extern void             sched_sim_thread_group_recommend(struct thread_group *tg, cluster_type_t recommendation);
+
+/*
+ * CPU events. Each of these runs kernel code on behalf of one CPU at the
+ * current simulated time (sched_sim_now).
+ */
+extern void             sched_sim_thread_wakeup(thread_t thread);
+extern void             sched_sim_thread_block(processor_t processor);
+extern void             sched_sim_quantum_expire(processor_t processor);
+extern void             sched_sim_ast(processor_t processor);
+extern void             sched_sim_maintenance(void);
+
+/*
+ * Let idle processors notice they have been dispatched; the engine calls
+ * this after every event.
+ */
+extern void             sched_sim_idle_poll(void);
+
+/*
+ * Callbacks implemented by the engine.
+ */
+
+/* Deliver an AST check to the processor at the current time. */
+extern void             sched_sim_signal_processor(processor_t processor);
+
+/*
+ * A processor is about to switch from old_thread to new_thread; either may
+ * be the processor's idle thread. new_thread->last_processor still names
+ * the processor the thread last ran on.
+ */
+extern void             sched_sim_thread_switch(processor_t processor, thread_t old_thread, thread_t new_thread);
+
+/*
+ * The processor's running thread or quantum changed; the engine should
+ * re-arm the processor's completion and quantum timers.
+ */
+extern void             sched_sim_processor_dispatched(processor_t processor);
+
+#endif /* _SCHED_SIM_H_ */
@@ -0,0 +1,2415 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sched_sim_kern.c
+ *
+ * The policy-independent half of the scheduler, reduced to what the clutch,
+ * edge and AMP policies need in order to run against a simulated machine.
+ *
+ * Most of this file is lifted from osfmk/kern/sched_prim.c, priority.c,
+ * processor.c and sched_average.c with the following simplifications:
+ *
+ *  - No realtime threads: the RT runqueue is always empty, so the RT paths
+ *    of choose_processor(), csw_check() and thread_select() are dropped.
+ *  - No SMT: every processor is its own primary.
+ *  - No promotions, depression, failsafe demotion, SFI or affinity sets.
+ *  - Deferred IPIs are not modelled (CONFIG_SCHED_DEFERRED_AST is off).
+ *
+ * The functions keep their kernel names wherever the policy sources call
+ * them, so that a change to sched_prim.c can be mirrored here by diffing.
+ * lifted.txt records the kernel definitions this file matches, and the
+ * build fails through check_lifted.sh once any of them changes.
+ */
+
+#include "sched_sim.h"
+
+#pragma mark - Globals
+
+const struct sched_dispatch_table *sched_current_dispatch;
+static sched_sim_policy_t sched_sim_policy;
+
+struct processor_set    pset0;
+struct pset_node        pset_node0;
+static struct pset_node pset_node1;
+pset_node_t             ecore_node;
+pset_node_t             pcore_node;
+processor_t             processor_list;
+processor_t             processor_array[MAX_CPUS];
+processor_set_t         pset_array[MAX_PSETS];
+unsigned int            processor_count;
+unsigned int            processor_avail_count;
+task_t                  kernel_task;
+struct machine_info     machine_info;
+static processor_t      master_processor;
+
+static struct processor_set sched_sim_psets[MAX_PSETS - 1];
+static struct processor sched_sim_processors[MAX_CPUS];
+static struct thread    sched_sim_idle_threads[MAX_CPUS];
+static struct thread_group sched_sim_kernel_tg;
+static uint32_t         sched_sim_npsets;
+static uint32_t         sched_sim_cluster_count;
+
+/* The CPU on whose behalf kernel code is currently running */
+static processor_t      sched_sim_current_processor;
+
+/* ASTs pended on each processor by ast_on() */
+static ast_t            sched_sim_pending_ast[MAX_CPUS];
+
+uint32_t                std_quantum;
+uint32_t                min_std_quantum;
+uint32_t                bg_quantum;
+uint32_t                std_quantum_us;
+uint32_t                bg_quantum_us;
+#define DEFAULT_PREEMPTION_RATE         100
+#define DEFAULT_BG_PREEMPTION_RATE      400
+int                     default_preemption_rate = DEFAULT_PREEMPTION_RATE;
+int                     default_bg_preemption_rate = DEFAULT_BG_PREEMPTION_RATE;
+
+unsigned                sched_tick;
+uint32_t                sched_tick_interval;
+static uint64_t         sched_tick_last_abstime;
+uint64_t                sched_one_second_interval;
+
+uint32_t                sched_pri_shifts[TH_BUCKET_MAX];
+uint32_t                sched_fixed_shift;
+int8_t                  sched_load_shifts[NRQS];
+uint32_t                sched_decay_usage_age_factor = 1;
+uint32_t                sched_run_buckets[TH_BUCKET_MAX];
+uint32_t                sched_load_average, sched_mach_factor;
+static uint32_t         sched_load[TH_BUCKET_MAX];
+static uint64_t         sched_load_compute_interval_abs;
+static uint64_t         sched_load_compute_deadline;
+
+static bitmap_t         sched_preempt_pri[BITMAP_LEN(NRQS_MAX)];
+int                     sched_allow_rt_smt = 1;
+bool                    system_is_SMT = false;
+
+#define SCHED_TICK_SHIFT                3
+#define SCHED_LOAD_COMPUTE_INTERVAL_US  15000
+
+#define SCHED_LOAD_EWMA_ALPHA_OLD       6
+#define SCHED_LOAD_EWMA_ALPHA_NEW       10
+#define SCHED_LOAD_EWMA_ALPHA_SHIFT     4
+#define SCHED_LOAD_EWMA_ROUNDUP(load)   (((load) & (1ul << (SCHED_LOAD_EWMA_ALPHA_SHIFT - 1))) != 0)
+#define SCHED_LOAD_EWMA_UNSCALE(load)   (((load) >> SCHED_LOAD_EWMA_ALPHA_SHIFT) + SCHED_LOAD_EWMA_ROUNDUP(load))
+
+#define SCHED_PSET_LOAD_EWMA_TC_NSECS   10000000u
+
+#define THREAD_NOT_RUNNABLE             (~0ULL)
+
+static inline bool
+sched_sim_policy_is_clutch(void)
+{
+	return sched_sim_policy != SCHED_SIM_POLICY_AMP;
+}
+
+#pragma mark - Platform
+
+#define SCHED_SIM_MAX_BOOT_ARGS 32
+static const char *sched_sim_boot_args[SCHED_SIM_MAX_BOOT_ARGS];
+static int sched_sim_boot_arg_count;
+
+int
+sched_sim_boot_arg_set(const char *arg)
+{
+	if (sched_sim_boot_arg_count == SCHED_SIM_MAX_BOOT_ARGS) {
+		return -1;
+	}
+	sched_sim_boot_args[sched_sim_boot_arg_count++] = arg;
+	return 0;
+}
+
+boolean_t
+PE_parse_boot_argn(const char *arg_string, void *arg_ptr, int max_arg)
+{
+	size_t len = strlen(arg_string);
+
+	for (int i = 0; i < sched_sim_boot_arg_count; i++) {
+		const char *arg = sched_sim_boot_args[i];
+		if (strncmp(arg, arg_string, len) != 0 || (arg[len] != '\0' && arg[len] != '=')) {
+			continue;
+		}
+		if (arg_ptr == NULL) {
+			return TRUE;
+		}
+
+		long long value = (arg[len] == '=') ? strtoll(&arg[len + 1], NULL, 0) : 1;
+		switch (max_arg) {
+		case sizeof(uint8_t):
+			*(uint8_t *)arg_ptr = (uint8_t)value;
+			break;
+		case sizeof(uint16_t):
+			*(uint16_t *)arg_ptr = (uint16_t)value;
+			break;
+		case sizeof(uint32_t):
+			*(uint32_t *)arg_ptr = (uint32_t)value;
+			break;
+		default:
+			*(uint64_t *)arg_ptr = (uint64_t)value;
+			break;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+void
+panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "panic at %llu ns: ", (unsigned long long)sched_sim_now);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+void
+__queue_element_linkage_invalid(queue_entry_t e)
+{
+	panic("queue element %p has invalid linkage", e);
+}
+
+processor_t
+current_processor(void)
+{
+	return sched_sim_current_processor;
+}
+
+thread_t
+current_thread(void)
+{
+	return sched_sim_current_processor->active_thread;
+}
+
+void
+ast_on(ast_t reasons)
+{
+	processor_t processor = current_processor();
+
+	sched_sim_pending_ast[processor->cpu_id] |= reasons;
+	sched_sim_signal_processor(processor);
+}
+
+bool
+ml_cpu_signal_is_enabled(void)
+{
+	return true;
+}
+
+uint64_t
+ml_cpu_signal_deferred_get_timer(void)
+{
+	return 0;
+}
+
+unsigned int
+ml_get_cluster_count(void)
+{
+	return sched_sim_cluster_count;
+}
+
+unsigned int
+ml_get_die_id(__unused unsigned int cluster_id)
+{
+	return 0;
+}
+
+unsigned int
+ml_get_cpu_number_type(cluster_type_t cluster_type, __unused bool logical, __unused bool available)
+{
+	unsigned int count = 0;
+
+	for (uint32_t i = 0; i < sched_sim_npsets; i++) {
+		if (cluster_type == CLUSTER_TYPE_SMP || pset_array[i]->pset_type == cluster_type) {
+			count += pset_array[i]->cpu_set_count;
+		}
+	}
+	return count;
+}
+
+unsigned int
+ml_get_cluster_number_type(cluster_type_t cluster_type)
+{
+	unsigned int count = 0;
+
+	for (uint32_t i = 0; i < sched_sim_npsets; i++) {
+		if (cluster_type == CLUSTER_TYPE_SMP || pset_array[i]->pset_type == cluster_type) {
+			count++;
+		}
+	}
+	return count;
+}
+
+#pragma mark - Thread groups
+
+uint64_t
+thread_group_get_id(struct thread_group *tg)
+{
+	return tg->tg_id;
+}
+
+const char *
+thread_group_get_name(struct thread_group *tg)
+{
+	return tg->tg_name;
+}
+
+cluster_type_t
+thread_group_recommendation(struct thread_group *tg)
+{
+	return tg->tg_recommendation;
+}
+
+void
+thread_group_update_recommendation(struct thread_group *tg, cluster_type_t new_recommendation)
+{
+	tg->tg_recommendation = new_recommendation;
+}
+
+sched_clutch_t
+sched_clutch_for_thread(thread_t thread)
+{
+	return &thread->thread_group->tg_sched_clutch;
+}
+
+sched_clutch_t
+sched_clutch_for_thread_group(struct thread_group *thread_group)
+{
+	return &thread_group->tg_sched_clutch;
+}
+
+boolean_t
+thread_shared_rsrc_policy_get(__unused thread_t thread, __unused cluster_shared_rsrc_type_t type)
+{
+	return FALSE;
+}
+
+#pragma mark - Run queues (sched_prim.c)
+
+void
+run_queue_init(run_queue_t rq)
+{
+	rq->highq = NOPRI;
+	for (u_int i = 0; i < BITMAP_LEN(NRQS); i++) {
+		rq->bitmap[i] = 0;
+	}
+	rq->urgency = rq->count = 0;
+	for (int i = 0; i < NRQS; i++) {
+		circle_queue_init(&rq->queues[i]);
+	}
+}
+
+thread_t
+run_queue_dequeue(run_queue_t rq, sched_options_t options)
+{
+	thread_t        thread;
+	circle_queue_t  queue = &rq->queues[rq->highq];
+
+	if (options & SCHED_HEADQ) {
+		thread = cqe_dequeue_head(queue, struct thread, runq_links);
+	} else {
+		thread = cqe_dequeue_tail(queue, struct thread, runq_links);
+	}
+
+	assert(thread != THREAD_NULL);
+
+	thread->runq = PROCESSOR_NULL;
+	rq->count--;
+	if (SCHED(priority_is_urgent)(rq->highq)) {
+		rq->urgency--; assert(rq->urgency >= 0);
+	}
+	if (circle_queue_empty(queue)) {
+		bitmap_clear(rq->bitmap, rq->highq);
+		rq->highq = bitmap_first(rq->bitmap, NRQS);
+	}
+
+	return thread;
+}
+
+boolean_t
+run_queue_enqueue(run_queue_t rq, thread_t thread, sched_options_t options)
+{
+	circle_queue_t  queue = &rq->queues[thread->sched_pri];
+	boolean_t       result = FALSE;
+
+	if (circle_queue_empty(queue)) {
+		circle_enqueue_tail(queue, &thread->runq_links);
+
+		rq_bitmap_set(rq->bitmap, thread->sched_pri);
+		if (thread->sched_pri > rq->highq) {
+			rq->highq = thread->sched_pri;
+			result = TRUE;
+		}
+	} else {
+		if (options & SCHED_TAILQ) {
+			circle_enqueue_tail(queue, &thread->runq_links);
+		} else {
+			circle_enqueue_head(queue, &thread->runq_links);
+		}
+	}
+	if (SCHED(priority_is_urgent)(thread->sched_pri)) {
+		rq->urgency++;
+	}
+	rq->count++;
+
+	return result;
+}
+
+void
+run_queue_remove(run_queue_t rq, thread_t thread)
+{
+	circle_queue_t  queue = &rq->queues[thread->sched_pri];
+
+	assert(thread->runq != PROCESSOR_NULL);
+
+	circle_dequeue(queue, &thread->runq_links);
+	rq->count--;
+	if (SCHED(priority_is_urgent)(thread->sched_pri)) {
+		rq->urgency--; assert(rq->urgency >= 0);
+	}
+
+	if (circle_queue_empty(queue)) {
+		bitmap_clear(rq->bitmap, thread->sched_pri);
+		rq->highq = bitmap_first(rq->bitmap, NRQS);
+	}
+
+	thread->runq = PROCESSOR_NULL;
+}
+
+thread_t
+run_queue_peek(run_queue_t rq)
+{
+	if (rq->count > 0) {
+		circle_queue_t queue = &rq->queues[rq->highq];
+		return cqe_queue_first(queue, struct thread, runq_links);
+	} else {
+		return THREAD_NULL;
+	}
+}
+
+#define THREAD_UPDATE_SIZE 128
+
+static thread_t thread_update_array[THREAD_UPDATE_SIZE];
+static uint32_t thread_update_count = 0;
+
+boolean_t
+thread_update_add_thread(thread_t thread)
+{
+	if (thread_update_count == THREAD_UPDATE_SIZE) {
+		return FALSE;
+	}
+
+	thread_update_array[thread_update_count++] = thread;
+	return TRUE;
+}
+
+void
+thread_update_process_threads(void)
+{
+	for (uint32_t i = 0; i < thread_update_count; i++) {
+		thread_t thread = thread_update_array[i];
+		thread_update_array[i] = THREAD_NULL;
+
+		if (!(thread->state & (TH_WAIT)) && thread->sched_stamp != sched_tick) {
+			SCHED(update_priority)(thread);
+		}
+	}
+
+	thread_update_count = 0;
+}
+
+static boolean_t
+runq_scan_thread(thread_t thread, sched_update_scan_context_t scan_context)
+{
+	if (thread->sched_stamp != sched_tick &&
+	    thread->sched_mode == TH_MODE_TIMESHARE) {
+		if (thread_update_add_thread(thread) == FALSE) {
+			return TRUE;
+		}
+	}
+
+	if (thread->last_made_runnable_time < scan_context->earliest_normal_make_runnable_time) {
+		scan_context->earliest_normal_make_runnable_time = thread->last_made_runnable_time;
+	}
+
+	return FALSE;
+}
+
+boolean_t
+runq_scan(run_queue_t runq, sched_update_scan_context_t scan_context)
+{
+	int count = runq->count;
+
+	if (count == 0) {
+		return FALSE;
+	}
+
+	for (int queue_index = bitmap_first(runq->bitmap, NRQS);
+	    queue_index >= 0;
+	    queue_index = bitmap_next(runq->bitmap, queue_index)) {
+		thread_t thread;
+		circle_queue_t queue = &runq->queues[queue_index];
+
+		cqe_foreach_element(thread, queue, runq_links) {
+			assert(count > 0);
+			if (runq_scan_thread(thread, scan_context) == TRUE) {
+				return TRUE;
+			}
+			count--;
+		}
+	}
+
+	return FALSE;
+}
+
+boolean_t
+sched_clutch_timeshare_scan(queue_t thread_queue, uint16_t thread_count, sched_update_scan_context_t scan_context)
+{
+	if (thread_count == 0) {
+		return FALSE;
+	}
+
+	thread_t thread;
+	qe_foreach_element_safe(thread, thread_queue, th_clutch_timeshare_link) {
+		if (runq_scan_thread(thread, scan_context) == TRUE) {
+			return TRUE;
+		}
+		thread_count--;
+	}
+
+	assert(thread_count == 0);
+	return FALSE;
+}
+
+#pragma mark - Realtime stubs
+
+/*
+ * The simulator does not model realtime threads; the RT runqueue of every
+ * pset is permanently empty.
+ */
+
+int
+rt_runq_count(__unused processor_set_t pset)
+{
+	return 0;
+}
+
+void
+sched_rtlocal_init(__unused processor_set_t pset)
+{
+}
+
+rt_queue_t
+sched_rtlocal_runq(__unused processor_set_t pset)
+{
+	return NULL;
+}
+
+void
+sched_rtlocal_queue_shutdown(__unused processor_t processor)
+{
+}
+
+int64_t
+sched_rtlocal_runq_count_sum(void)
+{
+	return 0;
+}
+
+thread_t
+sched_rtlocal_steal_thread(__unused processor_set_t stealing_pset, __unused uint64_t earliest_deadline)
+{
+	return THREAD_NULL;
+}
+
+void
+sched_rtlocal_runq_scan(__unused sched_update_scan_context_t scan_context)
+{
+}
+
+#pragma mark - Timeshare (sched_prim.c, priority.c, sched_average.c)
+
+static void
+load_shift_init(void)
+{
+	int8_t          k, *p = sched_load_shifts;
+	uint32_t        i, j;
+
+	uint32_t        sched_decay_penalty = 1;
+
+	PE_parse_boot_argn("sched_decay_penalty", &sched_decay_penalty, sizeof(sched_decay_penalty));
+	PE_parse_boot_argn("sched_decay_usage_age_factor", &sched_decay_usage_age_factor, sizeof(sched_decay_usage_age_factor));
+
+	if (sched_decay_penalty == 0) {
+		for (i = 0; i < NRQS; i++) {
+			sched_load_shifts[i] = INT8_MIN;
+		}
+		return;
+	}
+
+	*p++ = INT8_MIN; *p++ = 0;
+
+	for (i = 2, j = 1 << sched_decay_penalty, k = 1; i < NRQS; ++k) {
+		for (j <<= 1; (i < j) && (i < NRQS); ++i) {
+			*p++ = k;
+		}
+	}
+}
+
+static void
+preempt_pri_init(void)
+{
+	bitmap_t *p = sched_preempt_pri;
+
+	for (int i = BASEPRI_FOREGROUND; i < MINPRI_KERNEL; ++i) {
+		bitmap_set(p, i);
+	}
+
+	for (int i = BASEPRI_PREEMPT; i <= MAXPRI; ++i) {
+		bitmap_set(p, i);
+	}
+}
+
+void
+sched_timeshare_init(void)
+{
+	if (default_preemption_rate < 1) {
+		default_preemption_rate = DEFAULT_PREEMPTION_RATE;
+	}
+	std_quantum_us = (1000 * 1000) / default_preemption_rate;
+
+	if (default_bg_preemption_rate < 1) {
+		default_bg_preemption_rate = DEFAULT_BG_PREEMPTION_RATE;
+	}
+	bg_quantum_us = (1000 * 1000) / default_bg_preemption_rate;
+
+	load_shift_init();
+	preempt_pri_init();
+	sched_tick = 0;
+}
+
+void
+sched_timeshare_timebase_init(void)
+{
+	uint64_t        abstime;
+	uint32_t        shift;
+
+	clock_interval_to_absolutetime_interval(std_quantum_us, NSEC_PER_USEC, &abstime);
+	std_quantum = (uint32_t)abstime;
+
+	clock_interval_to_absolutetime_interval(250, NSEC_PER_USEC, &abstime);
+	min_std_quantum = (uint32_t)abstime;
+
+	clock_interval_to_absolutetime_interval(bg_quantum_us, NSEC_PER_USEC, &abstime);
+	bg_quantum = (uint32_t)abstime;
+
+	clock_interval_to_absolutetime_interval(USEC_PER_SEC >> SCHED_TICK_SHIFT,
+	    NSEC_PER_USEC, &abstime);
+	sched_tick_interval = (uint32_t)abstime;
+
+	clock_interval_to_absolutetime_interval(SCHED_LOAD_COMPUTE_INTERVAL_US, NSEC_PER_USEC,
+	    &sched_load_compute_interval_abs);
+	sched_load_compute_deadline = sched_load_compute_interval_abs;
+
+	abstime = (abstime * 5) / 3;
+	for (shift = 0; abstime > BASEPRI_DEFAULT; ++shift) {
+		abstime >>= 1;
+	}
+	sched_fixed_shift = shift;
+
+	for (uint32_t i = 0; i < TH_BUCKET_MAX; i++) {
+		sched_pri_shifts[i] = INT8_MAX;
+	}
+}
+
+uint32_t
+sched_timeshare_initial_quantum_size(thread_t thread)
+{
+	if ((thread != THREAD_NULL) && thread->th_sched_bucket == TH_BUCKET_SHARE_BG) {
+		return bg_quantum;
+	} else {
+		return std_quantum;
+	}
+}
+
+void
+thread_quantum_init(thread_t thread, __unused uint64_t now)
+{
+	thread->quantum_remaining = SCHED(initial_quantum_size)(thread);
+}
+
+boolean_t
+priority_is_urgent(int priority)
+{
+	return bitmap_test(sched_preempt_pri, priority) ? TRUE : FALSE;
+}
+
+static const struct shift_data sched_decay_shifts[SCHED_DECAY_TICKS] = {
+	{ .shift1 = 1, .shift2 = 1 },
+	{ .shift1 = 1, .shift2 = 3 },
+	{ .shift1 = 1, .shift2 = -3 },
+	{ .shift1 = 2, .shift2 = -7 },
+	{ .shift1 = 3, .shift2 = 5 },
+	{ .shift1 = 3, .shift2 = -5 },
+	{ .shift1 = 4, .shift2 = -8 },
+	{ .shift1 = 5, .shift2 = 7 },
+	{ .shift1 = 5, .shift2 = -7 },
+	{ .shift1 = 6, .shift2 = -10 },
+	{ .shift1 = 7, .shift2 = 10 },
+	{ .shift1 = 7, .shift2 = -9 },
+	{ .shift1 = 8, .shift2 = -11 },
+	{ .shift1 = 9, .shift2 = 12 },
+	{ .shift1 = 9, .shift2 = -11 },
+	{ .shift1 = 10, .shift2 = -13 },
+	{ .shift1 = 11, .shift2 = 14 },
+	{ .shift1 = 11, .shift2 = -13 },
+	{ .shift1 = 12, .shift2 = -15 },
+	{ .shift1 = 13, .shift2 = 17 },
+	{ .shift1 = 13, .shift2 = -15 },
+	{ .shift1 = 14, .shift2 = -17 },
+	{ .shift1 = 15, .shift2 = 19 },
+	{ .shift1 = 16, .shift2 = 18 },
+	{ .shift1 = 16, .shift2 = -19 },
+	{ .shift1 = 17, .shift2 = 22 },
+	{ .shift1 = 18, .shift2 = 20 },
+	{ .shift1 = 18, .shift2 = -20 },
+	{ .shift1 = 19, .shift2 = 26 },
+	{ .shift1 = 20, .shift2 = 22 },
+	{ .shift1 = 20, .shift2 = -22 },
+	{ .shift1 = 21, .shift2 = -27 }
+};
+
+int
+sched_compute_timeshare_priority(thread_t thread)
+{
+	int priority = thread->base_pri;
+
+	if (thread->pri_shift != INT8_MAX) {
+		priority -= (thread->sched_usage >> thread->pri_shift);
+	}
+
+	if (priority < MINPRI_USER) {
+		priority = MINPRI_USER;
+	} else if (priority > MAXPRI_KERNEL) {
+		priority = MAXPRI_KERNEL;
+	}
+
+	return priority;
+}
+
+boolean_t
+can_update_priority(thread_t thread)
+{
+	if (sched_tick == thread->sched_stamp) {
+		return FALSE;
+	} else {
+		return TRUE;
+	}
+}
+
+static void set_sched_pri(thread_t thread, int16_t new_priority, bool lazy_update);
+static void processor_state_update_from_thread(processor_t processor, thread_t thread, boolean_t pset_lock_held);
+static ast_t csw_check_locked(thread_t thread, processor_t processor, processor_set_t pset, ast_t check_reason);
+
+static void
+thread_recompute_sched_pri(thread_t thread, bool lazy_update)
+{
+	int16_t priority = thread->base_pri;
+
+	if (thread->sched_mode == TH_MODE_TIMESHARE) {
+		priority = (int16_t)SCHED(compute_timeshare_priority)(thread);
+	}
+
+	set_sched_pri(thread, priority, lazy_update);
+}
+
+void
+lightweight_update_priority(thread_t thread)
+{
+	assert(thread->runq == PROCESSOR_NULL);
+	assert(thread == current_thread());
+
+	if (thread->sched_mode == TH_MODE_TIMESHARE) {
+		int priority;
+		uint32_t delta;
+
+		sched_tick_delta(thread, delta);
+
+		if (thread->pri_shift < INT8_MAX) {
+			thread->sched_usage += delta;
+		}
+
+		thread->cpu_delta += delta;
+
+		if (sched_sim_policy_is_clutch()) {
+			sched_clutch_cpu_usage_update(thread, delta);
+		}
+
+		priority = sched_compute_timeshare_priority(thread);
+
+		if (priority != thread->sched_pri) {
+			thread_recompute_sched_pri(thread, true);
+		}
+	}
+}
+
+void
+update_priority(thread_t thread)
+{
+	uint32_t ticks, delta;
+
+	ticks = sched_tick - thread->sched_stamp;
+	assert(ticks != 0);
+
+	thread->sched_stamp += ticks;
+
+	if (sched_decay_usage_age_factor > 1) {
+		ticks *= sched_decay_usage_age_factor;
+	}
+
+	sched_tick_delta(thread, delta);
+	if (ticks < SCHED_DECAY_TICKS) {
+		if (thread->pri_shift < INT8_MAX) {
+			thread->sched_usage += delta;
+		}
+
+		thread->cpu_usage += delta + thread->cpu_delta;
+		thread->cpu_delta = 0;
+
+		if (sched_sim_policy_is_clutch()) {
+			sched_clutch_cpu_usage_update(thread, delta);
+		}
+
+		const struct shift_data *shiftp = &sched_decay_shifts[ticks];
+
+		if (shiftp->shift2 > 0) {
+			thread->cpu_usage =   (thread->cpu_usage >> shiftp->shift1) +
+			    (thread->cpu_usage >> shiftp->shift2);
+			thread->sched_usage = (thread->sched_usage >> shiftp->shift1) +
+			    (thread->sched_usage >> shiftp->shift2);
+		} else {
+			thread->cpu_usage =   (thread->cpu_usage >>   shiftp->shift1) -
+			    (thread->cpu_usage >> -(shiftp->shift2));
+			thread->sched_usage = (thread->sched_usage >>   shiftp->shift1) -
+			    (thread->sched_usage >> -(shiftp->shift2));
+		}
+	} else {
+		thread->cpu_usage = thread->cpu_delta = 0;
+		thread->sched_usage = 0;
+	}
+
+	if (sched_sim_policy_is_clutch()) {
+		thread->pri_shift = sched_clutch_thread_pri_shift(thread, thread->th_sched_bucket);
+	} else {
+		thread->pri_shift = sched_pri_shifts[thread->th_sched_bucket];
+	}
+
+	if (thread->sched_mode == TH_MODE_TIMESHARE) {
+		thread_recompute_sched_pri(thread, true);
+	}
+}
+
+void
+sched_default_quantum_expire(__unused thread_t thread)
+{
+}
+
+static void
+sched_incr_bucket(sched_bucket_t bucket)
+{
+	assert(bucket >= TH_BUCKET_FIXPRI && bucket <= TH_BUCKET_SHARE_BG);
+	os_atomic_inc(&sched_run_buckets[bucket], relaxed);
+}
+
+static void
+sched_decr_bucket(sched_bucket_t bucket)
+{
+	assert(bucket >= TH_BUCKET_FIXPRI && bucket <= TH_BUCKET_SHARE_BG);
+	assert(os_atomic_load(&sched_run_buckets[bucket], relaxed) > 0);
+	os_atomic_dec(&sched_run_buckets[bucket], relaxed);
+}
+
+uint32_t
+sched_run_incr(thread_t thread)
+{
+	assert((thread->state & (TH_RUN | TH_IDLE)) == TH_RUN);
+
+	uint32_t new_count = os_atomic_inc(&sched_run_buckets[TH_BUCKET_RUN], relaxed);
+	sched_incr_bucket(thread->th_sched_bucket);
+	return new_count;
+}
+
+uint32_t
+sched_run_decr(thread_t thread)
+{
+	assert((thread->state & (TH_RUN | TH_IDLE)) != TH_RUN);
+
+	sched_decr_bucket(thread->th_sched_bucket);
+	return os_atomic_dec(&sched_run_buckets[TH_BUCKET_RUN], relaxed);
+}
+
+void
+sched_update_thread_bucket(thread_t thread)
+{
+	sched_bucket_t old_bucket = thread->th_sched_bucket;
+	sched_bucket_t new_bucket = TH_BUCKET_RUN;
+
+	switch (thread->sched_mode) {
+	case TH_MODE_FIXED:
+	case TH_MODE_REALTIME:
+		new_bucket = TH_BUCKET_FIXPRI;
+		break;
+
+	case TH_MODE_TIMESHARE:
+		if (thread->base_pri > BASEPRI_DEFAULT) {
+			new_bucket = TH_BUCKET_SHARE_FG;
+		} else if (thread->base_pri > BASEPRI_UTILITY) {
+			new_bucket = TH_BUCKET_SHARE_DF;
+		} else if (thread->base_pri > MAXPRI_THROTTLE) {
+			new_bucket = TH_BUCKET_SHARE_UT;
+		} else {
+			new_bucket = TH_BUCKET_SHARE_BG;
+		}
+		break;
+
+	default:
+		panic("unexpected mode: %d", thread->sched_mode);
+		break;
+	}
+
+	if (old_bucket != new_bucket) {
+		thread->th_sched_bucket = new_bucket;
+		thread->pri_shift = sched_pri_shifts[new_bucket];
+
+		if ((thread->state & (TH_RUN | TH_IDLE)) == TH_RUN) {
+			sched_decr_bucket(old_bucket);
+			sched_incr_bucket(new_bucket);
+		}
+	}
+}
+
+/*
+ * compute_sched_load() and the pri_shift half of compute_averages(sched_tick_delta); only
+ * used by the AMP policy, since the clutch policies compute their pri_shift
+ * per clutch bucket group.
+ */
+void
+compute_sched_load(void)
+{
+	uint32_t ncpus = processor_avail_count;
+	uint32_t load_now[TH_BUCKET_MAX];
+
+	for (uint32_t i = 0; i < TH_BUCKET_MAX; i++) {
+		load_now[i] = os_atomic_load(&sched_run_buckets[i], relaxed);
+	}
+
+	uint32_t timeshare_threads = (load_now[TH_BUCKET_RUN] - load_now[TH_BUCKET_FIXPRI]);
+	for (uint32_t i = TH_BUCKET_SHARE_FG; i <= TH_BUCKET_SHARE_BG; i++) {
+		if (load_now[i] > timeshare_threads) {
+			load_now[i] = timeshare_threads;
+		}
+	}
+
+	if (load_now[TH_BUCKET_SHARE_DF] <= (ncpus * 2)) {
+		load_now[TH_BUCKET_SHARE_FG] += load_now[TH_BUCKET_SHARE_DF];
+	} else {
+		load_now[TH_BUCKET_SHARE_FG] += (ncpus * 2);
+	}
+
+	if (load_now[TH_BUCKET_SHARE_UT] <= ncpus) {
+		load_now[TH_BUCKET_SHARE_FG] += load_now[TH_BUCKET_SHARE_UT];
+		load_now[TH_BUCKET_SHARE_DF] += load_now[TH_BUCKET_SHARE_UT];
+	} else {
+		load_now[TH_BUCKET_SHARE_FG] += ncpus;
+		load_now[TH_BUCKET_SHARE_DF] += ncpus;
+	}
+
+	if (load_now[TH_BUCKET_SHARE_BG] > 0) {
+		load_now[TH_BUCKET_SHARE_FG] += 1;
+		load_now[TH_BUCKET_SHARE_DF] += 1;
+		load_now[TH_BUCKET_SHARE_UT] += 1;
+	}
+
+	for (uint32_t i = TH_BUCKET_SHARE_FG; i <= TH_BUCKET_SHARE_BG; i++) {
+		uint32_t bucket_load = 0;
+
+		if (load_now[i] > ncpus) {
+			bucket_load = (ncpus > 1) ? load_now[i] / ncpus : load_now[i];
+			if (bucket_load > MAX_LOAD) {
+				bucket_load = MAX_LOAD;
+			}
+		}
+		sched_load[i] = (sched_load[i] * SCHED_LOAD_EWMA_ALPHA_OLD) + ((bucket_load << SCHED_LOAD_EWMA_ALPHA_SHIFT) * SCHED_LOAD_EWMA_ALPHA_NEW);
+		sched_load[i] = sched_load[i] >> SCHED_LOAD_EWMA_ALPHA_SHIFT;
+	}
+}
+
+void
+compute_averages(__unused uint64_t stdelta)
+{
+	for (uint32_t i = TH_BUCKET_SHARE_FG; i <= TH_BUCKET_SHARE_BG; i++) {
+		uint32_t bucket_load = SCHED_LOAD_EWMA_UNSCALE(sched_load[i]);
+		uint32_t shift = sched_fixed_shift - sched_load_shifts[bucket_load];
+
+		if (shift > SCHED_PRI_SHIFT_MAX) {
+			sched_pri_shifts[i] = INT8_MAX;
+		} else {
+			sched_pri_shifts[i] = shift;
+		}
+	}
+}
+
+void
+sched_timeshare_consider_maintenance(uint64_t ctime)
+{
+	if (sched_sim_policy_is_clutch()) {
+		return;
+	}
+	if (ctime >= sched_load_compute_deadline) {
+		compute_sched_load();
+		sched_load_compute_deadline = ctime + sched_load_compute_interval_abs;
+	}
+}
+
+/*
+ * One pass of the maintenance thread. The kernel blocks at the end of this
+ * function and is woken again by sched_timeshare_consider_maintenance();
+ * the replay engine calls it once per scheduler tick instead.
+ */
+void
+sched_timeshare_maintenance_continue(void)
+{
+	uint32_t sched_tick_delta;
+	struct sched_update_scan_context scan_context = {
+		.earliest_bg_make_runnable_time = UINT64_MAX,
+		.earliest_normal_make_runnable_time = UINT64_MAX,
+		.earliest_rt_make_runnable_time = UINT64_MAX
+	};
+
+	uint64_t sched_tick_ctime = mach_absolute_time();
+
+	if (sched_tick_last_abstime == 0) {
+		sched_tick_last_abstime = sched_tick_ctime;
+		sched_tick_delta = 1;
+	} else {
+		sched_tick_delta = (uint32_t)((sched_tick_ctime - sched_tick_last_abstime) / sched_tick_interval);
+		sched_tick_delta = MAX(sched_tick_delta, 1);
+		sched_tick_delta = MIN(sched_tick_delta, SCHED_TICK_MAX_DELTA);
+		sched_tick_last_abstime = sched_tick_ctime;
+	}
+
+	scan_context.sched_tick_last_abstime = sched_tick_last_abstime;
+	sched_tick += sched_tick_delta;
+
+	if (!sched_sim_policy_is_clutch()) {
+		compute_averages(sched_tick_delta);
+	}
+
+	SCHED(thread_update_scan)(&scan_context);
+	SCHED(rt_runq_scan)(&scan_context);
+}
+
+#pragma mark - Load averages (sched_prim.c)
+
+static void
+sched_edge_pset_running_higher_bucket(processor_set_t pset, uint32_t *running_higher)
+{
+	bitmap_t *active_map = &pset->cpu_state_map[PROCESSOR_RUNNING];
+
+	for (int cpu = bitmap_first(active_map, MAX_CPUS); cpu >= 0; cpu = bitmap_next(active_map, cpu)) {
+		sched_bucket_t cpu_bucket = os_atomic_load(&pset->cpu_running_buckets[cpu], relaxed);
+		for (sched_bucket_t bucket = cpu_bucket; bucket < TH_BUCKET_SCHED_MAX; bucket++) {
+			running_higher[bucket]++;
+		}
+	}
+}
+
+/*
+ * The kernel builds exactly one of the two variants below depending on
+ * CONFIG_SCHED_EDGE; the simulator picks the one matching the policy.
+ */
+void
+sched_update_pset_load_average(processor_set_t pset, uint64_t curtime)
+{
+	if (sched_sim_policy != SCHED_SIM_POLICY_EDGE) {
+		int non_rt_load = pset->pset_runq.count;
+		int load = ((bit_count(pset->cpu_state_map[PROCESSOR_RUNNING]) + non_rt_load + rt_runq_count(pset)) << PSET_LOAD_NUMERATOR_SHIFT);
+		int new_load_average = ((int)pset->load_average + load) >> 1;
+
+		pset->load_average = new_load_average;
+		return;
+	}
+
+	int avail_cpu_count = pset_available_cpu_count(pset);
+	if (avail_cpu_count == 0) {
+		return;
+	}
+
+	if (!curtime) {
+		curtime = mach_absolute_time();
+	}
+	uint64_t last_update = os_atomic_load(&pset->pset_load_last_update, relaxed);
+	int64_t delta_ticks = curtime - last_update;
+	if (delta_ticks < 0) {
+		return;
+	}
+
+	uint64_t delta_nsecs = 0;
+	absolutetime_to_nanoseconds(delta_ticks, &delta_nsecs);
+
+	if (__improbable(delta_nsecs > UINT32_MAX)) {
+		delta_nsecs = UINT32_MAX;
+	}
+
+	for (cluster_shared_rsrc_type_t shared_rsrc_type = CLUSTER_SHARED_RSRC_TYPE_MIN; shared_rsrc_type < CLUSTER_SHARED_RSRC_TYPE_COUNT; shared_rsrc_type++) {
+		uint64_t shared_rsrc_runnable_load = sched_edge_shared_rsrc_runnable_load(&pset->pset_clutch_root, shared_rsrc_type);
+		uint64_t shared_rsrc_running_load = bit_count(pset->cpu_running_cluster_shared_rsrc_thread[shared_rsrc_type]);
+		os_atomic_store(&pset->pset_cluster_shared_rsrc_load[shared_rsrc_type], shared_rsrc_runnable_load + shared_rsrc_running_load, relaxed);
+	}
+
+	uint32_t running_higher[TH_BUCKET_SCHED_MAX] = {0};
+	sched_edge_pset_running_higher_bucket(pset, running_higher);
+
+	for (sched_bucket_t sched_bucket = TH_BUCKET_FIXPRI; sched_bucket < TH_BUCKET_SCHED_MAX; sched_bucket++) {
+		uint64_t old_load_average = os_atomic_load(&pset->pset_load_average[sched_bucket], relaxed);
+		uint64_t old_load_average_factor = old_load_average * SCHED_PSET_LOAD_EWMA_TC_NSECS;
+		uint32_t current_runq_depth = (sched_edge_cluster_cumulative_count(&pset->pset_clutch_root, sched_bucket) + rt_runq_count(pset) + running_higher[sched_bucket]) / avail_cpu_count;
+		uint64_t new_load_average_factor = (current_runq_depth * delta_nsecs) << SCHED_PSET_LOAD_EWMA_FRACTION_BITS;
+
+		int old_load_shifted = (int)((old_load_average + SCHED_PSET_LOAD_EWMA_ROUND_BIT) >> SCHED_PSET_LOAD_EWMA_FRACTION_BITS);
+		boolean_t load_uptick = (old_load_shifted == 0) && (current_runq_depth != 0);
+		boolean_t load_downtick = (old_load_shifted != 0) && (current_runq_depth == 0);
+		uint64_t load_average;
+		if (load_uptick || load_downtick) {
+			load_average = (current_runq_depth << SCHED_PSET_LOAD_EWMA_FRACTION_BITS);
+		} else {
+			load_average = (old_load_average_factor + new_load_average_factor) / (delta_nsecs + SCHED_PSET_LOAD_EWMA_TC_NSECS);
+		}
+		os_atomic_store(&pset->pset_load_average[sched_bucket], load_average, relaxed);
+	}
+	os_atomic_store(&pset->pset_load_last_update, curtime, relaxed);
+}
+
+void
+sched_update_pset_avg_execution_time(processor_set_t pset, uint64_t execution_time, uint64_t curtime, sched_bucket_t sched_bucket)
+{
+	if (sched_sim_policy != SCHED_SIM_POLICY_EDGE) {
+		return;
+	}
+
+	pset_execution_time_t *pet = &pset->pset_execution_time[sched_bucket];
+	int64_t delta_ticks = curtime - pet->pset_execution_time_last_update;
+	if (delta_ticks < 0) {
+		return;
+	}
+	uint64_t delta_nsecs = 0;
+	absolutetime_to_nanoseconds(delta_ticks, &delta_nsecs);
+
+	uint64_t nanotime = 0;
+	absolutetime_to_nanoseconds(execution_time, &nanotime);
+	uint64_t execution_time_us = nanotime / NSEC_PER_USEC;
+
+	uint64_t old_execution_time = (pet->pset_avg_thread_execution_time * SCHED_PSET_LOAD_EWMA_TC_NSECS);
+	uint64_t new_execution_time = (execution_time_us * delta_nsecs);
+
+	pet->pset_avg_thread_execution_time = (old_execution_time + new_execution_time) / (delta_nsecs + SCHED_PSET_LOAD_EWMA_TC_NSECS);
+	pet->pset_execution_time_last_update = curtime;
+}
+
+uint64_t
+sched_pset_cluster_shared_rsrc_load(processor_set_t pset, cluster_shared_rsrc_type_t shared_rsrc_type)
+{
+	return os_atomic_load(&pset->pset_cluster_shared_rsrc_load[shared_rsrc_type], relaxed);
+}
+
+#pragma mark - Processor state (processor.c)
+
+cluster_type_t
+pset_type_for_id(uint32_t cluster_id)
+{
+	return pset_array[cluster_id]->pset_type;
+}
+
+pset_cluster_type_t
+recommended_pset_type(thread_t thread)
+{
+	if (thread == THREAD_NULL) {
+		return PSET_AMP_E;
+	}
+
+	if (thread->th_bound_cluster_id != THREAD_BOUND_CLUSTER_NONE) {
+		return pset_array[thread->th_bound_cluster_id]->pset_cluster_type;
+	}
+
+	if (thread->base_pri <= MAXPRI_THROTTLE) {
+		if (os_atomic_load(&sched_perfctl_policy_bg, relaxed) != SCHED_PERFCTL_POLICY_FOLLOW_GROUP) {
+			return PSET_AMP_E;
+		}
+	} else if (thread->base_pri <= BASEPRI_UTILITY) {
+		if (os_atomic_load(&sched_perfctl_policy_util, relaxed) != SCHED_PERFCTL_POLICY_FOLLOW_GROUP) {
+			return PSET_AMP_E;
+		}
+	}
+
+	cluster_type_t recommendation = thread_group_recommendation(thread->thread_group);
+	switch (recommendation) {
+	case CLUSTER_TYPE_SMP:
+	default:
+		/* Idle threads stand in for kernel_task here */
+		if (thread->state & TH_IDLE) {
+			return PSET_AMP_E;
+		}
+		return PSET_AMP_P;
+	case CLUSTER_TYPE_E:
+		return PSET_AMP_E;
+	case CLUSTER_TYPE_P:
+		return PSET_AMP_P;
+	}
+}
+
+static void
+processor_state_update_running_foreign(processor_t processor, thread_t thread)
+{
+	cluster_type_t current_processor_type = pset_type_for_id(processor->processor_set->pset_cluster_id);
+	cluster_type_t thread_type = pset_type_for_id(sched_edge_thread_preferred_cluster(thread));
+
+	boolean_t non_rt_thr = (processor->current_pri < BASEPRI_RTQUEUES);
+	boolean_t non_bound_thr = (thread->bound_processor == PROCESSOR_NULL);
+	if (non_rt_thr && non_bound_thr && (current_processor_type != thread_type)) {
+		bit_set(processor->processor_set->cpu_running_foreign, processor->cpu_id);
+	} else {
+		bit_clear(processor->processor_set->cpu_running_foreign, processor->cpu_id);
+	}
+}
+
+static void
+processor_state_update_idle(processor_t processor)
+{
+	processor->current_pri = IDLEPRI;
+	processor->current_recommended_pset_type = PSET_SMP;
+	processor->current_thread_group = NULL;
+	os_atomic_store(&processor->processor_set->cpu_running_buckets[processor->cpu_id], TH_BUCKET_SCHED_MAX, relaxed);
+	bit_clear(processor->processor_set->cpu_running_cluster_shared_rsrc_thread[CLUSTER_SHARED_RSRC_TYPE_RR], processor->cpu_id);
+	bit_clear(processor->processor_set->cpu_running_cluster_shared_rsrc_thread[CLUSTER_SHARED_RSRC_TYPE_NATIVE_FIRST], processor->cpu_id);
+	sched_update_pset_load_average(processor->processor_set, 0);
+}
+
+static void
+processor_state_update_from_thread(processor_t processor, thread_t thread, boolean_t pset_lock_held)
+{
+	processor->current_pri = thread->sched_pri;
+	processor->current_recommended_pset_type = recommended_pset_type(thread);
+	if (sched_sim_policy == SCHED_SIM_POLICY_EDGE) {
+		processor_state_update_running_foreign(processor, thread);
+		sched_bucket_t bucket = ((thread->state & TH_IDLE) || (thread->bound_processor != PROCESSOR_NULL)) ? TH_BUCKET_SCHED_MAX : thread->th_sched_bucket;
+		os_atomic_store(&processor->processor_set->cpu_running_buckets[processor->cpu_id], bucket, relaxed);
+	}
+	processor->current_thread_group = thread->thread_group;
+	if (pset_lock_held) {
+		sched_update_pset_load_average(processor->processor_set, 0);
+	}
+}
+
+#pragma mark - Processor selection (sched_prim.c)
+
+static cpumap_t
+pset_available_cpumap(processor_set_t pset)
+{
+	return pset->cpu_available_map & pset->recommended_bitmask;
+}
+
+int
+pset_available_cpu_count(processor_set_t pset)
+{
+	return bit_count(pset_available_cpumap(pset));
+}
+
+bool
+pset_is_recommended(processor_set_t pset)
+{
+	if (!pset) {
+		return false;
+	}
+	return pset_available_cpu_count(pset) > 0;
+}
+
+bool
+sched_steal_thread_enabled(processor_set_t pset)
+{
+	return bit_count(pset->node->pset_map) > 1;
+}
+
+bool
+sched_thread_should_yield(processor_t processor, __unused thread_t thread)
+{
+	return !SCHED(processor_queue_empty)(processor) || rt_runq_count(processor->processor_set) > 0;
+}
+
+uint32_t
+sched_qos_max_parallelism(__unused int qos, __unused uint64_t options)
+{
+	return processor_avail_count;
+}
+
+void
+sched_check_spill(__unused processor_set_t pset, __unused thread_t thread)
+{
+}
+
+void
+sched_SMT_balance(__unused processor_t processor, __unused processor_set_t pset)
+{
+}
+
+void
+sched_pset_made_schedulable(__unused processor_t processor, __unused processor_set_t pset, __unused boolean_t drop_lock)
+{
+}
+
+pset_node_t
+sched_choose_node(__unused thread_t thread)
+{
+	return &pset_node0;
+}
+
+static processor_set_t
+next_pset(processor_set_t pset)
+{
+	pset_map_t map = pset->node->pset_map;
+
+	int pset_id = lsb_next(map, pset->pset_id);
+	if (pset_id == -1) {
+		pset_id = lsb_first(map);
+	}
+
+	return pset_array[pset_id];
+}
+
+static processor_set_t
+choose_starting_pset(pset_node_t node, thread_t thread, processor_t *processor_hint)
+{
+	processor_set_t pset;
+	processor_t processor = PROCESSOR_NULL;
+
+	if (thread->last_processor != PROCESSOR_NULL) {
+		processor = thread->last_processor;
+		pset = processor->processor_set;
+	} else {
+		pset = next_pset(current_processor()->processor_set);
+	}
+
+	if (!bit_test(node->pset_map, pset->pset_id)) {
+		int id = lsb_first(node->pset_map);
+		assert(id >= 0);
+		pset = pset_array[id];
+	}
+
+	if (bit_count(node->pset_map) > 1) {
+		pset_map_t idle_map = atomic_load(&node->pset_idle_map);
+		if (!bit_test(idle_map, pset->pset_id)) {
+			int next_idle_pset_id = lsb_first(idle_map);
+			if (next_idle_pset_id >= 0) {
+				pset = pset_array[next_idle_pset_id];
+			}
+		}
+	}
+
+	if ((processor != PROCESSOR_NULL) && (processor->processor_set != pset)) {
+		processor = PROCESSOR_NULL;
+	}
+	if (processor != PROCESSOR_NULL) {
+		*processor_hint = processor;
+	}
+
+	return pset;
+}
+
+processor_t
+choose_processor(processor_set_t starting_pset, processor_t processor, thread_t thread)
+{
+	processor_set_t pset = starting_pset;
+	processor_set_t nset;
+
+	assert(thread->sched_pri < BASEPRI_RTQUEUES);
+
+	if (processor != PROCESSOR_NULL) {
+		if (processor->processor_set != pset || !processor->is_recommended) {
+			processor = PROCESSOR_NULL;
+		} else {
+			switch (processor->state) {
+			case PROCESSOR_IDLE:
+				return processor;
+			case PROCESSOR_RUNNING:
+			case PROCESSOR_DISPATCHING:
+				break;
+			default:
+				processor = PROCESSOR_NULL;
+				break;
+			}
+		}
+	}
+
+	integer_t lowest_priority = MAXPRI + 1;
+	integer_t lowest_count = INT_MAX;
+	processor_t lp_processor = PROCESSOR_NULL;
+	processor_t lc_processor = PROCESSOR_NULL;
+
+	if (processor != PROCESSOR_NULL) {
+		lowest_priority = processor->current_pri;
+		lp_processor = processor;
+
+		lowest_count = SCHED(processor_runq_count)(processor);
+		lc_processor = processor;
+	}
+
+	do {
+		uint64_t idle_primary_map = (pset->cpu_state_map[PROCESSOR_IDLE] &
+		    pset->primary_map &
+		    pset->recommended_bitmask);
+
+		int cpuid = lsb_first(idle_primary_map);
+		if (cpuid >= 0) {
+			return processor_array[cpuid];
+		}
+
+		uint64_t active_map = ((pset->cpu_state_map[PROCESSOR_RUNNING] | pset->cpu_state_map[PROCESSOR_DISPATCHING]) &
+		    pset->recommended_bitmask &
+		    ~pset->pending_AST_URGENT_cpu_mask);
+
+		if (SCHED(priority_is_urgent)(thread->sched_pri) == FALSE) {
+			active_map &= ~pset->pending_AST_PREEMPT_cpu_mask;
+		}
+
+		active_map = bit_ror64(active_map, (pset->last_chosen + 1));
+		for (int rotid = lsb_first(active_map); rotid >= 0; rotid = lsb_next(active_map, rotid)) {
+			cpuid = ((rotid + pset->last_chosen + 1) & 63);
+			processor = processor_array[cpuid];
+
+			integer_t cpri = processor->current_pri;
+			if (cpri < lowest_priority) {
+				lowest_priority = cpri;
+				lp_processor = processor;
+			}
+
+			integer_t ccount = SCHED(processor_runq_count)(processor);
+			if (ccount < lowest_count) {
+				lowest_count = ccount;
+				lc_processor = processor;
+			}
+		}
+
+		if (thread->sched_pri > lowest_priority) {
+			pset->last_chosen = lp_processor->cpu_id;
+			return lp_processor;
+		}
+
+		if (lc_processor == PROCESSOR_NULL) {
+			cpumap_t available_map = pset_available_cpumap(pset);
+			cpuid = lsb_first(available_map);
+			if (cpuid >= 0) {
+				lc_processor = processor_array[cpuid];
+				lowest_count = SCHED(processor_runq_count)(lc_processor);
+			}
+		}
+
+		if (sched_sim_policy == SCHED_SIM_POLICY_EDGE) {
+			nset = starting_pset;
+		} else {
+			nset = next_pset(pset);
+		}
+
+		if (nset != starting_pset) {
+			pset = nset;
+		}
+	} while (nset != starting_pset);
+
+	processor = lc_processor;
+
+	if (processor) {
+		pset = processor->processor_set;
+		cpumap_t available_map = pset_available_cpumap(pset);
+		if (bit_test(available_map, processor->cpu_id)) {
+			pset->last_chosen = processor->cpu_id;
+			return processor;
+		}
+	}
+
+	return PROCESSOR_NULL;
+}
+
+#pragma mark - IPIs (sched_prim.c)
+
+sched_ipi_type_t
+sched_ipi_deferred_policy(processor_set_t pset, processor_t dst,
+    __unused thread_t thread, __unused sched_ipi_event_t event)
+{
+	panic("Request for deferred IPI on an unsupported platform; pset: %p CPU: %d", pset, dst->cpu_id);
+}
+
+sched_ipi_type_t
+sched_ipi_policy(processor_t dst, thread_t thread, boolean_t dst_idle, sched_ipi_event_t event)
+{
+	sched_ipi_type_t ipi_type = SCHED_IPI_NONE;
+
+	switch (event) {
+	case SCHED_IPI_EVENT_SPILL:
+	case SCHED_IPI_EVENT_SMT_REBAL:
+	case SCHED_IPI_EVENT_REBALANCE:
+	case SCHED_IPI_EVENT_BOUND_THR:
+	case SCHED_IPI_EVENT_RT_PREEMPT:
+	case SCHED_IPI_EVENT_STEAL:
+		ipi_type = dst_idle ? SCHED_IPI_IDLE : SCHED_IPI_IMMEDIATE;
+		break;
+	case SCHED_IPI_EVENT_PREEMPT:
+		(void)thread;
+		(void)dst;
+		ipi_type = dst_idle ? SCHED_IPI_IDLE : SCHED_IPI_IMMEDIATE;
+		break;
+	default:
+		panic("Unrecognized scheduler IPI event type %d", event);
+	}
+	assert(ipi_type != SCHED_IPI_NONE);
+	return ipi_type;
+}
+
+sched_ipi_type_t
+sched_ipi_action(processor_t dst, thread_t thread, sched_ipi_event_t event)
+{
+	sched_ipi_type_t ipi_type = SCHED_IPI_NONE;
+	processor_set_t pset = dst->processor_set;
+
+	if (current_processor() == dst) {
+		return SCHED_IPI_NONE;
+	}
+
+	bool dst_idle = (dst->state == PROCESSOR_IDLE);
+	if (dst_idle) {
+		pset_update_processor_state(pset, dst, PROCESSOR_DISPATCHING);
+	}
+
+	ipi_type = SCHED(ipi_policy)(dst, thread, dst_idle, event);
+	switch (ipi_type) {
+	case SCHED_IPI_NONE:
+		return SCHED_IPI_NONE;
+	default:
+		bit_set(pset->pending_AST_URGENT_cpu_mask, dst->cpu_id);
+		bit_set(pset->pending_AST_PREEMPT_cpu_mask, dst->cpu_id);
+		break;
+	}
+	return ipi_type;
+}
+
+void
+sched_ipi_perform(processor_t dst, sched_ipi_type_t ipi)
+{
+	switch (ipi) {
+	case SCHED_IPI_NONE:
+		break;
+	case SCHED_IPI_IDLE:
+	case SCHED_IPI_IMMEDIATE:
+		sched_sim_signal_processor(dst);
+		break;
+	default:
+		panic("Unrecognized scheduler IPI type %d", ipi);
+	}
+}
+
+#pragma mark - Idle steal accounting (sched_prim.c)
+
+void
+sched_steal_record(processor_set_t dst_pset, processor_set_t src_pset, uint64_t saved_latency_us)
+{
+	os_atomic_inc(&dst_pset->pset_steal_count, relaxed);
+	if (dst_pset->pset_type != src_pset->pset_type) {
+		os_atomic_inc(&dst_pset->pset_steal_cross_type_count, relaxed);
+	}
+	os_atomic_add(&dst_pset->pset_steal_saved_latency_us, saved_latency_us, relaxed);
+}
+
+void
+sched_steal_signal_idle(processor_set_t pset)
+{
+	processor_t processor = PROCESSOR_NULL;
+	sched_ipi_type_t ipi_type = SCHED_IPI_NONE;
+
+	pset_lock(pset);
+	cpumap_t idle_map = pset->recommended_bitmask & pset->primary_map & pset->cpu_state_map[PROCESSOR_IDLE] &
+	    ~(pset->pending_spill_cpu_mask | pset->pending_steal_cpu_mask);
+	bit_clear(idle_map, current_processor()->cpu_id);
+	int cpuid = lsb_first(idle_map);
+	if (cpuid >= 0) {
+		processor = processor_array[cpuid];
+		bit_set(pset->pending_steal_cpu_mask, cpuid);
+		processor->deadline = UINT64_MAX;
+		ipi_type = sched_ipi_action(processor, THREAD_NULL, SCHED_IPI_EVENT_STEAL);
+	}
+	pset_unlock(pset);
+
+	if (processor != PROCESSOR_NULL) {
+		sched_ipi_perform(processor, ipi_type);
+	}
+}
+
+#pragma mark - Dispatch (sched_prim.c)
+
+static boolean_t
+thread_run_queue_remove(thread_t thread)
+{
+	processor_t processor = thread->runq;
+
+	if (processor == PROCESSOR_NULL) {
+		return FALSE;
+	}
+	return SCHED(processor_queue_remove)(processor, thread);
+}
+
+static void
+processor_setrun(processor_t processor, thread_t thread, integer_t options)
+{
+	processor_set_t pset = processor->processor_set;
+	ast_t preempt;
+	enum { eExitIdle, eInterruptRunning, eDoNothing } ipi_action = eDoNothing;
+	sched_ipi_type_t ipi_type = SCHED_IPI_NONE;
+
+	thread->chosen_processor = processor;
+
+	if (SCHED(priority_is_urgent)(thread->sched_pri) && thread->sched_pri > processor->current_pri) {
+		preempt = (AST_PREEMPT | AST_URGENT);
+	} else if ((thread->sched_mode == TH_MODE_TIMESHARE) && (thread->sched_pri < thread->base_pri)) {
+		if (SCHED(priority_is_urgent)(thread->base_pri) && thread->sched_pri > processor->current_pri) {
+			preempt = (options & SCHED_PREEMPT)? AST_PREEMPT: AST_NONE;
+		} else {
+			preempt = AST_NONE;
+		}
+	} else {
+		preempt = (options & SCHED_PREEMPT)? AST_PREEMPT: AST_NONE;
+	}
+
+	if ((options & (SCHED_PREEMPT | SCHED_REBALANCE)) == (SCHED_PREEMPT | SCHED_REBALANCE)) {
+		preempt |= AST_PREEMPT;
+	}
+
+	SCHED(processor_enqueue)(processor, thread, options);
+	sched_update_pset_load_average(pset, 0);
+
+	if (preempt != AST_NONE) {
+		if (processor->state == PROCESSOR_IDLE) {
+			ipi_action = eExitIdle;
+		} else if (processor->state == PROCESSOR_DISPATCHING) {
+			bit_set(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+		} else if (processor->state == PROCESSOR_RUNNING &&
+		    (thread->sched_pri >= processor->current_pri)) {
+			ipi_action = eInterruptRunning;
+		}
+	} else {
+		if (processor->state == PROCESSOR_IDLE) {
+			ipi_action = eExitIdle;
+		} else if (processor->state == PROCESSOR_DISPATCHING) {
+			bit_set(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+		}
+	}
+
+	if (ipi_action != eDoNothing) {
+		if (processor == current_processor()) {
+			if (ipi_action == eExitIdle) {
+				pset_update_processor_state(pset, processor, PROCESSOR_DISPATCHING);
+			}
+			if ((preempt = csw_check_locked(processor->active_thread, processor, pset, AST_NONE)) != AST_NONE) {
+				ast_on(preempt);
+			}
+
+			if ((preempt & AST_URGENT) == AST_URGENT) {
+				bit_set(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+			} else {
+				bit_clear(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+			}
+
+			if ((preempt & AST_PREEMPT) == AST_PREEMPT) {
+				bit_set(pset->pending_AST_PREEMPT_cpu_mask, processor->cpu_id);
+			} else {
+				bit_clear(pset->pending_AST_PREEMPT_cpu_mask, processor->cpu_id);
+			}
+		} else {
+			sched_ipi_event_t event = (options & SCHED_REBALANCE) ? SCHED_IPI_EVENT_REBALANCE : SCHED_IPI_EVENT_PREEMPT;
+			ipi_type = sched_ipi_action(processor, thread, event);
+		}
+	}
+	sched_ipi_perform(processor, ipi_type);
+}
+
+void
+thread_setrun(thread_t thread, sched_options_t options)
+{
+	processor_t processor = PROCESSOR_NULL;
+	processor_set_t pset;
+
+	assert((thread->state & (TH_RUN | TH_WAIT | TH_UNINT | TH_TERMINATE | TH_TERMINATE2)) == TH_RUN);
+	assert(thread->runq == PROCESSOR_NULL);
+
+	if (SCHED(can_update_priority)(thread)) {
+		SCHED(update_priority)(thread);
+	}
+
+	if (thread->bound_processor == PROCESSOR_NULL) {
+		processor_t processor_hint = PROCESSOR_NULL;
+		pset_node_t node = SCHED(choose_node)(thread);
+		processor_set_t starting_pset = choose_starting_pset(node, thread, &processor_hint);
+
+		processor = SCHED(choose_processor)(starting_pset, processor_hint, thread);
+		if (processor == PROCESSOR_NULL) {
+			processor = master_processor;
+		}
+		pset = processor->processor_set;
+	} else {
+		processor = thread->bound_processor;
+		pset = processor->processor_set;
+	}
+
+	processor_setrun(processor, thread, options);
+	if (thread->bound_processor == PROCESSOR_NULL) {
+		SCHED(check_spill)(pset, thread);
+	}
+}
+
+static void
+set_sched_pri(thread_t thread, int16_t new_priority, bool lazy_update)
+{
+	bool is_current_thread = (thread == current_thread());
+	bool removed_from_runq = false;
+	int16_t old_priority = thread->sched_pri;
+
+	if (new_priority == old_priority) {
+		return;
+	}
+
+	if (!is_current_thread) {
+		removed_from_runq = thread_run_queue_remove(thread);
+	}
+
+	thread->sched_pri = new_priority;
+	SCHED(update_thread_bucket)(thread);
+
+	if (removed_from_runq) {
+		thread_setrun(thread, SCHED_PREEMPT | SCHED_TAILQ);
+	} else if (is_current_thread) {
+		processor_t processor = thread->last_processor;
+
+		if (!lazy_update && new_priority < old_priority) {
+			ast_t preempt;
+
+			if ((preempt = csw_check_locked(thread, processor, processor->processor_set, AST_NONE)) != AST_NONE) {
+				ast_on(preempt);
+			}
+		} else {
+			processor_state_update_from_thread(processor, thread, false);
+		}
+	}
+}
+
+static ast_t
+csw_check_locked(thread_t thread, processor_t processor, __unused processor_set_t pset, ast_t check_reason)
+{
+	if (!processor->is_recommended) {
+		return check_reason | AST_PREEMPT | AST_URGENT;
+	}
+
+	ast_t result = SCHED(processor_csw_check)(processor);
+	if (result != AST_NONE) {
+		return check_reason | result;
+	}
+
+	if (SCHED(avoid_processor_enabled) && SCHED(thread_avoid_processor)(processor, thread)) {
+		return check_reason | AST_PREEMPT;
+	}
+
+	return AST_NONE;
+}
+
+static void
+clear_pending_AST_bits(processor_set_t pset, processor_t processor)
+{
+	bit_clear(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+	bit_clear(pset->pending_AST_PREEMPT_cpu_mask, processor->cpu_id);
+}
+
+static void
+pset_commit_processor_to_new_thread(processor_set_t pset, processor_t processor, thread_t new_thread)
+{
+	if (processor->state == PROCESSOR_DISPATCHING || processor->state == PROCESSOR_IDLE) {
+		pset_update_processor_state(pset, processor, PROCESSOR_RUNNING);
+	}
+
+	processor_state_update_from_thread(processor, new_thread, true);
+}
+
+static thread_t
+thread_select(thread_t thread, processor_t processor, ast_t *reason)
+{
+	processor_set_t pset = processor->processor_set;
+	thread_t new_thread = THREAD_NULL;
+
+	assert(processor == current_processor());
+
+	bool pending_AST_URGENT = false;
+	bool pending_AST_PREEMPT = false;
+
+	do {
+		if (SCHED(can_update_priority)(thread)) {
+			SCHED(update_priority)(thread);
+		}
+
+restart:
+		pending_AST_URGENT = bit_test(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id);
+		pending_AST_PREEMPT = bit_test(pset->pending_AST_PREEMPT_cpu_mask, processor->cpu_id);
+
+		processor_state_update_from_thread(processor, thread, true);
+
+		bool still_running = ((thread->state & (TH_TERMINATE | TH_IDLE | TH_WAIT | TH_RUN | TH_SUSP)) == TH_RUN);
+		bool is_yielding = (*reason & AST_YIELD) == AST_YIELD;
+		bool bound_elsewhere = thread->bound_processor != PROCESSOR_NULL && thread->bound_processor != processor;
+		bool avoid_processor = !is_yielding && SCHED(avoid_processor_enabled) && SCHED(thread_avoid_processor)(processor, thread);
+
+		bool current_thread_can_keep_running = (still_running && !bound_elsewhere && !avoid_processor);
+		if (current_thread_can_keep_running) {
+			if (SCHED(processor_queue_has_priority)(processor, thread->sched_pri, TRUE) == FALSE) {
+				sched_update_pset_load_average(pset, 0);
+				clear_pending_AST_bits(pset, processor);
+				return thread;
+			}
+		} else if (bound_elsewhere || avoid_processor) {
+			*reason |= AST_REBALANCE;
+		}
+
+		if (!processor->is_recommended && !SCHED(processor_bound_count)(processor)) {
+			goto idle;
+		}
+
+		if ((new_thread = SCHED(choose_thread)(processor, MINPRI, *reason)) != THREAD_NULL) {
+			pset_commit_processor_to_new_thread(pset, processor, new_thread);
+			clear_pending_AST_bits(pset, processor);
+			return new_thread;
+		}
+
+		if (SCHED(steal_thread_enabled)(pset)) {
+			if ((new_thread = SCHED(steal_thread)(pset)) != THREAD_NULL) {
+				pset_commit_processor_to_new_thread(pset, processor, new_thread);
+				if (!pending_AST_URGENT && bit_test(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id)) {
+					ast_on(AST_URGENT | AST_PREEMPT);
+				}
+				clear_pending_AST_bits(pset, processor);
+				return new_thread;
+			}
+
+			if (SCHED(processor_bound_count)(processor)) {
+				continue;
+			}
+			if (processor->is_recommended && !SCHED(processor_queue_empty)(processor)) {
+				continue;
+			}
+		}
+
+idle:
+		if ((!pending_AST_URGENT && bit_test(pset->pending_AST_URGENT_cpu_mask, processor->cpu_id)) ||
+		    (!pending_AST_PREEMPT && bit_test(pset->pending_AST_PREEMPT_cpu_mask, processor->cpu_id))) {
+			goto restart;
+		}
+
+		if (current_thread_can_keep_running) {
+			sched_update_pset_load_average(pset, 0);
+			clear_pending_AST_bits(pset, processor);
+			return thread;
+		}
+
+		if ((processor->state == PROCESSOR_RUNNING) || (processor->state == PROCESSOR_DISPATCHING)) {
+			pset_update_processor_state(pset, processor, PROCESSOR_IDLE);
+			processor_state_update_idle(processor);
+		}
+
+		clear_pending_AST_bits(pset, processor);
+
+		SCHED(processor_balance)(processor, pset);
+
+		new_thread = processor->idle_thread;
+	} while (new_thread == THREAD_NULL);
+
+	return new_thread;
+}
+
+/*
+ * The off-core half of thread_dispatch(): requeue or retire the thread that
+ * just stopped running on the processor.
+ */
+static void
+thread_dispatch(thread_t thread, processor_t processor)
+{
+	if (thread->state & TH_IDLE) {
+		return;
+	}
+
+	int64_t consumed;
+	int64_t remainder = 0;
+
+	if (processor->quantum_end > processor->last_dispatch) {
+		remainder = processor->quantum_end - processor->last_dispatch;
+	}
+
+	consumed = thread->quantum_remaining - remainder;
+	if (consumed > 0) {
+		sched_update_pset_avg_execution_time(processor->processor_set, consumed, processor->last_dispatch, thread->th_sched_bucket);
+	}
+
+	if (processor->first_timeslice && processor->quantum_end > processor->last_dispatch) {
+		thread->quantum_remaining = (uint32_t)remainder;
+	} else {
+		thread->quantum_remaining = 0;
+	}
+
+	if (thread->quantum_remaining < min_std_quantum) {
+		thread->reason |= AST_QUANTUM;
+		thread->quantum_remaining += SCHED(initial_quantum_size)(thread);
+	}
+
+	thread->computation_metered += (processor->last_dispatch - thread->computation_epoch);
+
+	if (!(thread->state & TH_WAIT)) {
+		thread->last_made_runnable_time = thread->last_basepri_change_time = processor->last_dispatch;
+
+		ast_t reason = thread->reason;
+		sched_options_t options = SCHED_NONE;
+
+		if (reason & AST_REBALANCE) {
+			options |= SCHED_REBALANCE;
+			if (reason & AST_QUANTUM) {
+				options |= SCHED_PREEMPT;
+			}
+		}
+		if (reason & AST_QUANTUM) {
+			options |= SCHED_TAILQ;
+		} else if (reason & AST_PREEMPT) {
+			options |= SCHED_HEADQ;
+		} else {
+			options |= (SCHED_PREEMPT | SCHED_TAILQ);
+		}
+
+		thread_setrun(thread, options);
+	} else {
+		thread->state &= ~TH_RUN;
+		thread->last_made_runnable_time = thread->last_basepri_change_time = THREAD_NOT_RUNNABLE;
+		thread->chosen_processor = PROCESSOR_NULL;
+		SCHED(run_count_decr)(thread);
+	}
+}
+
+/*
+ * thread_block_reason() for the thread running on the processor: pick the
+ * next thread, switch to it and dispose of the old one.
+ */
+static void
+sched_sim_thread_block_reason(processor_t processor, ast_t reason)
+{
+	thread_t self = processor->active_thread;
+	uint64_t ctime = mach_absolute_time();
+
+	sched_sim_current_processor = processor;
+	sched_sim_pending_ast[processor->cpu_id] &= ~AST_PREEMPTION;
+
+	thread_t thread = thread_select(self, processor, &reason);
+	if (thread == self) {
+		sched_sim_processor_dispatched(processor);
+		return;
+	}
+
+	if (!(thread->state & TH_IDLE)) {
+		sched_timeshare_consider_maintenance(ctime);
+	}
+
+	self->reason = reason;
+	sched_sim_thread_switch(processor, self, thread);
+
+	processor->active_thread = thread;
+	processor_state_update_from_thread(processor, thread, false);
+	thread->last_processor = processor;
+	processor->last_dispatch = ctime;
+
+	thread_dispatch(self, processor);
+
+	if (!(thread->state & TH_IDLE)) {
+		if (thread->quantum_remaining == 0) {
+			thread_quantum_init(thread, ctime);
+		}
+		processor->quantum_end = ctime + thread->quantum_remaining;
+		processor->first_timeslice = TRUE;
+	} else {
+		processor->first_timeslice = FALSE;
+	}
+	thread->computation_epoch = ctime;
+	thread->reason = AST_NONE;
+
+	sched_sim_processor_dispatched(processor);
+}
+
+#pragma mark - Engine entry points
+
+void
+sched_sim_thread_wakeup(thread_t thread)
+{
+	sched_sim_current_processor = thread->last_processor ? thread->last_processor : master_processor;
+
+	assert((thread->state & (TH_RUN | TH_WAIT)) == TH_WAIT);
+
+	thread->state = (thread->state | TH_RUN) & ~TH_WAIT;
+	thread->last_made_runnable_time = thread->last_basepri_change_time = mach_absolute_time();
+	SCHED(run_count_incr)(thread);
+	thread->quantum_remaining = 0;
+	thread->computation_metered = 0;
+	thread->reason = AST_NONE;
+
+	thread_setrun(thread, SCHED_PREEMPT | SCHED_TAILQ);
+}
+
+void
+sched_sim_thread_block(processor_t processor)
+{
+	thread_t thread = processor->active_thread;
+
+	assert((thread->state & (TH_RUN | TH_IDLE)) == TH_RUN);
+	thread->state |= TH_WAIT;
+	sched_sim_thread_block_reason(processor, AST_NONE);
+}
+
+/*
+ * thread_quantum_expire()
+ */
+void
+sched_sim_quantum_expire(processor_t processor)
+{
+	thread_t thread = processor->active_thread;
+	uint64_t ctime = mach_absolute_time();
+	ast_t preempt;
+
+	sched_sim_current_processor = processor;
+
+	sched_update_pset_avg_execution_time(processor->processor_set, thread->quantum_remaining, ctime, thread->th_sched_bucket);
+	processor->last_dispatch = ctime;
+
+	if (SCHED(can_update_priority)(thread)) {
+		SCHED(update_priority)(thread);
+	} else {
+		SCHED(lightweight_update_priority)(thread);
+	}
+
+	SCHED(quantum_expire)(thread);
+
+	processor->first_timeslice = FALSE;
+	thread_quantum_init(thread, ctime);
+	processor->quantum_end = ctime + thread->quantum_remaining;
+	sched_sim_processor_dispatched(processor);
+
+	if ((preempt = csw_check_locked(thread, processor, processor->processor_set, AST_QUANTUM)) != AST_NONE) {
+		ast_on(preempt);
+	}
+}
+
+/*
+ * ast_taken_kernel(), or the idle thread noticing it has been dispatched.
+ */
+void
+sched_sim_ast(processor_t processor)
+{
+	thread_t thread = processor->active_thread;
+	ast_t reason;
+
+	sched_sim_current_processor = processor;
+
+	if (thread->state & TH_IDLE) {
+		if (processor->state == PROCESSOR_IDLE && processor->processor_set->pending_AST_URGENT_cpu_mask == 0 &&
+		    SCHED(processor_queue_empty)(processor) && !SCHED(steal_thread_enabled)(processor->processor_set)) {
+			return;
+		}
+		sched_sim_thread_block_reason(processor, AST_NONE);
+		return;
+	}
+
+	reason = sched_sim_pending_ast[processor->cpu_id];
+	reason |= csw_check_locked(thread, processor, processor->processor_set, AST_NONE);
+	if (reason & AST_PREEMPTION) {
+		sched_sim_thread_block_reason(processor, reason & AST_PREEMPTION);
+	} else {
+		sched_sim_pending_ast[processor->cpu_id] = AST_NONE;
+		clear_pending_AST_bits(processor->processor_set, processor);
+	}
+}
+
+/*
+ * idle_thread(): an idle processor spins until something moves it out of
+ * PROCESSOR_IDLE. Code running on the processor itself (a wakeup or a spill
+ * targeting the current CPU) does that without sending an IPI.
+ */
+void
+sched_sim_idle_poll(void)
+{
+	for (processor_t processor = processor_list; processor != PROCESSOR_NULL; processor = processor->processor_list) {
+		if ((processor->active_thread->state & TH_IDLE) && processor->state == PROCESSOR_DISPATCHING) {
+			sched_sim_signal_processor(processor);
+		}
+	}
+}
+
+void
+sched_sim_maintenance(void)
+{
+	sched_sim_current_processor = master_processor;
+	SCHED(maintenance_continuation)();
+}
+
+#pragma mark - Topology and workload
+
+const char *
+sched_sim_policy_name(void)
+{
+	return SCHED(sched_name);
+}
+
+uint32_t
+sched_sim_processor_count(void)
+{
+	return processor_count;
+}
+
+uint32_t
+sched_sim_pset_count(void)
+{
+	return sched_sim_npsets;
+}
+
+static void
+sched_sim_idle_thread_init(thread_t thread, processor_t processor)
+{
+	thread->state = TH_RUN | TH_IDLE;
+	thread->sched_mode = TH_MODE_FIXED;
+	thread->sched_pri = thread->base_pri = thread->max_priority = IDLEPRI;
+	thread->th_sched_bucket = TH_BUCKET_FIXPRI;
+	thread->th_bound_cluster_id = THREAD_BOUND_CLUSTER_NONE;
+	thread->thread_group = &sched_sim_kernel_tg;
+	thread->bound_processor = processor;
+	thread->last_processor = processor;
+	thread->pri_shift = INT8_MAX;
+	thread->sched_stamp = sched_tick;
+	thread->thread_id = (uint64_t)-1 - (uint64_t)processor->cpu_id;
+}
+
+static void
+pset_init(processor_set_t pset, pset_node_t node)
+{
+	pset->online_processor_count = 0;
+	pset->load_average = 0;
+	pset->cpu_set_low = pset->cpu_set_hi = 0;
+	pset->cpu_set_count = 0;
+	pset->last_chosen = -1;
+	pset->pset_list = PROCESSOR_SET_NULL;
+	pset->is_SMT = false;
+
+	SCHED(pset_init)(pset);
+	SCHED(rt_init)(pset);
+
+	pset_array[pset->pset_id] = pset;
+	bit_set(node->pset_map, pset->pset_id);
+	pset->node = node;
+	if (node->psets == PROCESSOR_SET_NULL) {
+		node->psets = pset;
+	} else {
+		processor_set_t prev = node->psets;
+		while (prev->pset_list != PROCESSOR_SET_NULL) {
+			prev = prev->pset_list;
+		}
+		prev->pset_list = pset;
+	}
+}
+
+static void
+processor_init(processor_t processor, int cpu_id, processor_set_t pset)
+{
+	processor->state = PROCESSOR_OFF_LINE;
+	processor->cpu_id = cpu_id;
+	processor->processor_set = pset;
+	processor->processor_primary = processor;
+	processor->is_recommended = true;
+	processor->current_pri = IDLEPRI;
+	processor->current_sched_bucket = TH_BUCKET_SCHED_MAX;
+	processor->idle_thread = &sched_sim_idle_threads[cpu_id];
+	processor->active_thread = processor->idle_thread;
+	SCHED(processor_init)(processor);
+
+	if (pset->cpu_set_count++ == 0) {
+		pset->cpu_set_low = pset->cpu_set_hi = cpu_id;
+	} else {
+		pset->cpu_set_low = MIN(pset->cpu_set_low, cpu_id);
+		pset->cpu_set_hi = MAX(pset->cpu_set_hi, cpu_id);
+	}
+	bit_set(pset->cpu_bitmask, cpu_id);
+	bit_set(pset->recommended_bitmask, cpu_id);
+	bit_set(pset->primary_map, cpu_id);
+	bit_set(pset->cpu_state_map[PROCESSOR_OFF_LINE], cpu_id);
+	pset->cpu_running_buckets[cpu_id] = TH_BUCKET_SCHED_MAX;
+
+	processor_array[cpu_id] = processor;
+	processor->processor_list = PROCESSOR_NULL;
+	if (processor_list == PROCESSOR_NULL) {
+		processor_list = processor;
+	} else {
+		processor_t prev = processor_list;
+		while (prev->processor_list != PROCESSOR_NULL) {
+			prev = prev->processor_list;
+		}
+		prev->processor_list = processor;
+	}
+	processor_count++;
+
+	sched_sim_idle_thread_init(processor->idle_thread, processor);
+
+	/* processor_start() */
+	pset->online_processor_count++;
+	processor_avail_count++;
+	pset_update_processor_state(pset, processor, PROCESSOR_IDLE);
+	processor_state_update_idle(processor);
+}
+
+int
+sched_sim_init(sched_sim_policy_t policy, const char *topology)
+{
+	struct {
+		cluster_type_t type;
+		int ncpus;
+	} clusters[MAX_PSETS];
+	uint32_t nclusters = 0;
+	int ncpus = 0;
+
+	for (const char *p = topology; *p != '\0';) {
+		cluster_type_t type = CLUSTER_TYPE_SMP;
+		char *end;
+
+		if (nclusters == MAX_PSETS) {
+			fprintf(stderr, "too many clusters in topology \"%s\"\n", topology);
+			return -1;
+		}
+		if (*p == 'E' || *p == 'e') {
+			type = CLUSTER_TYPE_E;
+			p++;
+		} else if (*p == 'P' || *p == 'p') {
+			type = CLUSTER_TYPE_P;
+			p++;
+		}
+		long n = strtol(p, &end, 10);
+		if (end == p || n <= 0 || (*end != ',' && *end != '\0')) {
+			fprintf(stderr, "bad cluster description in topology \"%s\"\n", topology);
+			return -1;
+		}
+		clusters[nclusters].type = type;
+		clusters[nclusters].ncpus = (int)n;
+		nclusters++;
+		ncpus += (int)n;
+		p = (*end == ',') ? end + 1 : end;
+	}
+	if (nclusters == 0 || ncpus > MAX_CPUS) {
+		fprintf(stderr, "topology \"%s\" must have between 1 and %d CPUs\n", topology, MAX_CPUS);
+		return -1;
+	}
+
+	switch (policy) {
+	case SCHED_SIM_POLICY_CLUTCH:
+		sched_current_dispatch = &sched_clutch_dispatch;
+		for (uint32_t i = 0; i < nclusters; i++) {
+			clusters[i].type = CLUSTER_TYPE_SMP;
+		}
+		break;
+	case SCHED_SIM_POLICY_EDGE:
+		sched_current_dispatch = &sched_edge_dispatch;
+		break;
+	case SCHED_SIM_POLICY_AMP:
+		sched_current_dispatch = &sched_amp_dispatch;
+		if (nclusters != 2 || clusters[0].type == CLUSTER_TYPE_SMP ||
+		    clusters[1].type == CLUSTER_TYPE_SMP || clusters[0].type == clusters[1].type) {
+			fprintf(stderr, "the amp policy needs exactly one E and one P cluster\n");
+			return -1;
+		}
+		break;
+	}
+	sched_sim_policy = policy;
+	sched_sim_cluster_count = nclusters;
+
+	for (uint32_t i = 0; i < nclusters; i++) {
+		if (policy != SCHED_SIM_POLICY_CLUTCH && clusters[i].type == CLUSTER_TYPE_SMP) {
+			clusters[i].type = CLUSTER_TYPE_P;
+		}
+	}
+
+	/* sched_init() */
+	SCHED(init)();
+	SCHED(timebase_init)();
+	clock_interval_to_absolutetime_interval(1, NSEC_PER_SEC, &sched_one_second_interval);
+
+	snprintf(sched_sim_kernel_tg.tg_name, sizeof(sched_sim_kernel_tg.tg_name), "kernel");
+	sched_sim_kernel_tg.tg_recommendation = CLUSTER_TYPE_SMP;
+	sched_clutch_init_with_thread_group(&sched_sim_kernel_tg.tg_sched_clutch, &sched_sim_kernel_tg);
+
+	/* processor_bootstrap() */
+	cluster_type_t boot_type = clusters[0].type;
+	if (boot_type == CLUSTER_TYPE_SMP) {
+		pset_node0.pset_cluster_type = PSET_SMP;
+	} else if (boot_type == CLUSTER_TYPE_E) {
+		pset_node0.pset_cluster_type = PSET_AMP_E;
+		ecore_node = &pset_node0;
+		pset_node1.pset_cluster_type = PSET_AMP_P;
+		pcore_node = &pset_node1;
+		pset_node0.node_list = &pset_node1;
+	} else {
+		pset_node0.pset_cluster_type = PSET_AMP_P;
+		pcore_node = &pset_node0;
+		pset_node1.pset_cluster_type = PSET_AMP_E;
+		ecore_node = &pset_node1;
+		pset_node0.node_list = &pset_node1;
+	}
+
+	int cpu_id = 0;
+	for (uint32_t i = 0; i < nclusters; i++) {
+		processor_set_t pset = (i == 0) ? &pset0 : &sched_sim_psets[i - 1];
+		pset_node_t node = (clusters[i].type == boot_type) ? &pset_node0 : &pset_node1;
+
+		pset->pset_id = (int)i;
+		pset->pset_cluster_id = i;
+		switch (clusters[i].type) {
+		case CLUSTER_TYPE_E:
+			pset->pset_cluster_type = PSET_AMP_E;
+			pset->pset_type = CLUSTER_TYPE_E;
+			break;
+		case CLUSTER_TYPE_P:
+			pset->pset_cluster_type = PSET_AMP_P;
+			pset->pset_type = CLUSTER_TYPE_P;
+			break;
+		default:
+			pset->pset_cluster_type = PSET_SMP;
+			pset->pset_type = CLUSTER_TYPE_SMP;
+			break;
+		}
+		sched_sim_npsets++;
+		pset_init(pset, node);
+
+		for (int n = 0; n < clusters[i].ncpus; n++, cpu_id++) {
+			processor_init(&sched_sim_processors[cpu_id], cpu_id, pset);
+		}
+	}
+	master_processor = processor_array[0];
+	sched_sim_current_processor = master_processor;
+
+	machine_info.max_cpus = machine_info.avail_cpus = ncpus;
+	machine_info.physical_cpu = machine_info.physical_cpu_max = ncpus;
+	machine_info.logical_cpu = machine_info.logical_cpu_max = ncpus;
+
+	if (SCHED(cpu_init_completed) != NULL) {
+		SCHED(cpu_init_completed)();
+	}
+	return 0;
+}
+
+struct thread_group *
+sched_sim_thread_group_create(uint64_t tg_id, const char *name)
+{
+	struct thread_group *tg = calloc(1, sizeof(*tg));
+
+	tg->tg_id = tg_id;
+	snprintf(tg->tg_name, sizeof(tg->tg_name), "%s", name);
+	tg->tg_recommendation = CLUSTER_TYPE_SMP;
+	sched_clutch_init_with_thread_group(&tg->tg_sched_clutch, tg);
+	return tg;
+}
+
+thread_t
+sched_sim_thread_create(uint64_t tid, struct thread_group *tg, int base_pri, bool fixed)
+{
+	thread_t thread = calloc(1, sizeof(*thread));
+
+	thread->thread_id = tid;
+	thread->thread_group = tg;
+	thread->state = TH_WAIT;
+	thread->sched_mode = fixed ? TH_MODE_FIXED : TH_MODE_TIMESHARE;
+	thread->base_pri = thread->req_base_pri = thread->sched_pri = (int16_t)base_pri;
+	thread->max_priority = thread->task_priority = (int16_t)MAXPRI_USER;
+	thread->th_sched_bucket = TH_BUCKET_RUN;
+	thread->th_bound_cluster_id = THREAD_BOUND_CLUSTER_NONE;
+	thread->sched_stamp = sched_tick;
+	thread->last_made_runnable_time = thread->last_basepri_change_time = THREAD_NOT_RUNNABLE;
+	priority_queue_entry_init(&thread->th_clutch_runq_link);
+	priority_queue_entry_init(&thread->th_clutch_pri_link);
+
+	SCHED(update_thread_bucket)(thread);
+	if (sched_sim_policy_is_clutch()) {
+		thread->pri_shift = sched_clutch_thread_pri_shift(thread, thread->th_sched_bucket);
+	}
+	return thread;
+}
+
+/*
+ * Stand-in for CLPC: translate a cluster type recommendation into the
+ * policy's own mechanism.
+ */
+void
+sched_sim_thread_group_recommend(struct thread_group *tg, cluster_type_t recommendation)
+{
+	sched_sim_current_processor = master_processor;
+
+	switch (sched_sim_policy) {
+	case SCHED_SIM_POLICY_AMP:
+		SCHED(thread_group_recommendation_change)(tg, recommendation);
+		break;
+	case SCHED_SIM_POLICY_EDGE: {
+		uint32_t preferred[TH_BUCKET_SCHED_MAX];
+		uint32_t cluster_id = pset0.pset_cluster_id;
+
+		for (uint32_t i = 0; i < sched_sim_npsets; i++) {
+			if (pset_array[i]->pset_type == recommendation) {
+				cluster_id = pset_array[i]->pset_cluster_id;
+				break;
+			}
+		}
+		for (sched_bucket_t bucket = TH_BUCKET_FIXPRI; bucket < TH_BUCKET_SCHED_MAX; bucket++) {
+			preferred[bucket] = cluster_id;
+		}
+		thread_group_update_recommendation(tg, recommendation);
+		sched_edge_tg_preferred_cluster_change(tg, preferred,
+		    SCHED_PERFCONTROL_PREFERRED_CLUSTER_MIGRATE_RUNNING | SCHED_PERFCONTROL_PREFERRED_CLUSTER_MIGRATE_RUNNABLE);
+		break;
+	}
+	case SCHED_SIM_POLICY_CLUTCH:
+		thread_group_update_recommendation(tg, recommendation);
+		break;
+	}
+}
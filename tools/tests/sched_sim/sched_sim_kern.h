@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sched_sim_kern.h
+ *
+ * Mock kernel environment for building the scheduler policy sources
+ * (osfmk/kern/sched_clutch.c, sched_amp.c and sched_amp_common.c) as part
+ * of a userspace program.
+ *
+ * Every kernel header those files include is shadowed by a header in
+ * sched_sim/include/ which pulls in this file instead; the scheduler's own
+ * data structure headers (sched.h, sched_clutch.h, bits.h, queue.h,
+ * circle_queue.h and priority_queue.h) are used unmodified from osfmk/.
+ *
+ * The processor, processor set, thread and thread group structures only
+ * carry the fields that the policy code and the replay engine touch. The
+ * clock is virtual: one unit of absolute time is one nanosecond, and it
+ * only advances when the replay engine (sched_sim.c) processes an event.
+ * All locks are no-ops since the engine is single threaded.
+ */
+
+#ifndef _SCHED_SIM_KERN_H_
+#define _SCHED_SIM_KERN_H_
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/*
+ * Compiler and <sys/cdefs.h> extensions which the kernel headers rely on
+ * but which are not available in every userspace SDK.
+ */
+#ifndef __enum_decl
+#define __enum_decl(_name, _type, ...) \
+	typedef _type _name; enum __VA_ARGS__ __attribute__((packed))
+#endif
+#ifndef __options_decl
+#define __options_decl(_name, _type, ...) \
+	typedef _type _name; enum __VA_ARGS__ __attribute__((packed))
+#endif
+#ifndef __enum_closed_decl
+#define __enum_closed_decl __enum_decl
+#endif
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
+#ifndef __improbable
+#define __improbable(x) __builtin_expect(!!(x), 0)
+#endif
+#ifndef __probable
+#define __probable(x) __builtin_expect(!!(x), 1)
+#endif
+#ifndef __abortlike
+#define __abortlike __attribute__((__noreturn__, __cold__))
+#endif
+#ifndef __dead2
+#define __dead2 __attribute__((__noreturn__))
+#endif
+#ifndef __printflike
+#define __printflike(a, b) __attribute__((__format__(__printf__, a, b)))
+#endif
+#ifndef __container_of
+#define __container_of(ptr, type, field) __extension__({ \
+	const __typeof__(((type *)NULL)->field) *__ptr = (ptr); \
+	(type *)((uintptr_t)__ptr - offsetof(type, field)); \
+})
+#endif
+#ifndef __single
+#define __single
+#endif
+#ifndef __header_indexable
+#define __header_indexable
+#endif
+#ifndef __counted_by
+#define __counted_by(x)
+#endif
+#ifndef __static_testable
+#define __static_testable static
+#endif
+#ifndef __assert_only
+#define __assert_only __unused
+#endif
+#ifndef __kdebug_only
+#define __kdebug_only __unused
+#endif
+#ifndef OS_FALLTHROUGH
+#define OS_FALLTHROUGH __attribute__((__fallthrough__))
+#endif
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#if !defined(__clang__)
+#define __builtin_assume(e)     ((void)0)
+#endif /* !__clang__ */
+#ifndef __BEGIN_DECLS
+#define __BEGIN_DECLS
+#define __END_DECLS
+#endif
+#ifndef __ASSUME_PTR_ABI_SINGLE_BEGIN
+#define __ASSUME_PTR_ABI_SINGLE_BEGIN
+#define __ASSUME_PTR_ABI_SINGLE_END
+#endif
+
+/*
+ * Basic Mach types.
+ */
+typedef int                     boolean_t;
+typedef int                     integer_t;
+typedef unsigned int            natural_t;
+typedef int                     kern_return_t;
+typedef uint32_t                ast_t;
+typedef uint64_t                event64_t;
+typedef uint64_t                thread_id_t;
+typedef int                     wait_result_t;
+typedef int                     spl_t;
+typedef void                    *timer_call_param_t;
+typedef unsigned int            u_int;
+typedef int                     perfcontrol_class_t;
+typedef uint64_t                sched_perfcontrol_preferred_cluster_options_t;
+
+#ifndef TRUE
+#define TRUE                    1
+#endif
+#ifndef FALSE
+#define FALSE                   0
+#endif
+
+#define KERN_SUCCESS            0
+#define KERN_FAILURE            5
+
+typedef struct thread           *thread_t;
+typedef struct processor        *processor_t;
+typedef struct processor_set    *processor_set_t;
+typedef struct pset_node        *pset_node_t;
+typedef struct task             *task_t;
+typedef struct run_queue        *run_queue_t;
+typedef struct sched_update_scan_context *sched_update_scan_context_t;
+
+#define THREAD_NULL             ((thread_t) NULL)
+#define PROCESSOR_NULL          ((processor_t) NULL)
+#define PROCESSOR_SET_NULL      ((processor_set_t) NULL)
+#define PSET_NODE_NULL          ((pset_node_t) NULL)
+#define TASK_NULL               ((task_t) NULL)
+
+struct sched_update_scan_context {
+	uint64_t        earliest_bg_make_runnable_time;
+	uint64_t        earliest_normal_make_runnable_time;
+	uint64_t        earliest_rt_make_runnable_time;
+	uint64_t        sched_tick_last_abstime;
+};
+
+/* AST reasons returned by the csw_check callouts */
+#define AST_NONE                0x00
+#define AST_PREEMPT             0x01
+#define AST_QUANTUM             0x02
+#define AST_URGENT              0x04
+#define AST_HANDOFF             0x08
+#define AST_YIELD               0x10
+#define AST_REBALANCE           0x100000
+#define AST_PREEMPTION          (AST_PREEMPT | AST_QUANTUM | AST_URGENT)
+
+/* Options passed to thread_setrun() and the enqueue callouts */
+__options_decl(sched_options_t, uint32_t, {
+	SCHED_NONE      = 0x0,
+	SCHED_TAILQ     = 0x1,
+	SCHED_HEADQ     = 0x2,
+	SCHED_PREEMPT   = 0x4,
+	SCHED_REBALANCE = 0x8,
+});
+
+/*
+ * Platform configuration. The simulated topology is described at runtime
+ * (see sched_sim_init()) and must fit within these limits.
+ */
+#define MAX_CPUS                64
+#define MAX_PSETS               8
+#define MAX_CPU_CLUSTERS        MAX_PSETS
+
+typedef enum {
+	CLUSTER_TYPE_SMP,
+	CLUSTER_TYPE_E,
+	CLUSTER_TYPE_P,
+	MAX_CPU_TYPES,
+} cluster_type_t;
+
+#define PERFCONTROL_CLASS_MAX   10
+
+/*
+ * Debug and panic support.
+ */
+extern void panic(const char *fmt, ...) __printflike(1, 2) __dead2;
+
+#if !defined(assert)
+#define assert(e) \
+	((void)(__builtin_expect(!!(e), 1) ? 0 : \
+	(panic("assertion failed: %s, file: %s, line: %d", #e, __FILE__, __LINE__), 0)))
+#endif
+#define assertf(e, fmt, ...)    assert(e)
+#define release_assert(e)       assert(e)
+#ifndef static_assert
+#define static_assert           _Static_assert
+#endif
+
+#define kprintf(...)            ((void)0)
+
+/*
+ * Tracing. Scheduler tracepoints are compiled out; the replay engine
+ * produces its own accounting.
+ */
+#define KDBG(...)                               do { } while (0)
+#define KDBG_RELEASE(...)                       do { } while (0)
+#define KDBG_DEBUG(...)                         do { } while (0)
+#define KERNEL_DEBUG_CONSTANT(...)              do { } while (0)
+#define KERNEL_DEBUG_CONSTANT_IST(...)          do { } while (0)
+#define SCHED_DEBUG_PLATFORM_KERNEL_DEBUG_CONSTANT(...) do { } while (0)
+#define SCHED_DEBUG_CHOOSE_PROCESSOR_KERNEL_DEBUG_CONSTANT_IST(...) do { } while (0)
+#define SCHED_STATS_INC(field)                  do { } while (0)
+#define SCHED_STATS_CSW(...)                    do { } while (0)
+#define SCHED_STATS_RUNQ_CHANGE(...)            do { } while (0)
+
+/*
+ * Atomics. The engine is single threaded, so every memory order collapses
+ * onto the corresponding __atomic builtin with sequential consistency.
+ */
+#define os_atomic_load(p, m)                    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define os_atomic_load_wide(p, m)               __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define os_atomic_store(p, v, m)                __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_store_wide(p, v, m)           __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_add(p, v, m)                  __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_add_orig(p, v, m)             __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_sub(p, v, m)                  __atomic_sub_fetch(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_sub_orig(p, v, m)             __atomic_fetch_sub(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_inc(p, m)                     os_atomic_add(p, 1, m)
+#define os_atomic_inc_orig(p, m)                os_atomic_add_orig(p, 1, m)
+#define os_atomic_dec(p, m)                     os_atomic_sub(p, 1, m)
+#define os_atomic_dec_orig(p, m)                os_atomic_sub_orig(p, 1, m)
+#define os_atomic_or(p, v, m)                   __atomic_or_fetch(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_or_orig(p, v, m)              __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_and(p, v, m)                  __atomic_and_fetch(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_andnot(p, v, m)               __atomic_and_fetch(p, ~(v), __ATOMIC_SEQ_CST)
+#define os_atomic_xchg(p, v, m)                 __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define os_atomic_cmpxchg(p, e, v, m) __extension__({ \
+	__typeof__(*(p)) _e = (e); \
+	__atomic_compare_exchange_n(p, &_e, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+})
+#define os_atomic_rmw_loop(p, ov, nv, m, ...) __extension__({ \
+	bool _result = false; \
+	__typeof__(p) _p = (p); \
+	ov = __atomic_load_n(_p, __ATOMIC_SEQ_CST); \
+	do { \
+	        __VA_ARGS__; \
+	        _result = __atomic_compare_exchange_n(_p, &ov, nv, false, \
+	            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	} while (__improbable(!_result)); \
+	_result; \
+})
+#define os_atomic_rmw_loop_give_up(...)         ({ __VA_ARGS__; break; })
+#define os_add_overflow(a, b, res)              __builtin_add_overflow((a), (b), (res))
+#define os_sub_overflow(a, b, res)              __builtin_sub_overflow((a), (b), (res))
+#define os_inc_overflow(res)                    os_add_overflow(*(res), 1, (res))
+#define os_dec_overflow(res)                    os_sub_overflow(*(res), 1, (res))
+#define os_atomic_thread_fence(m)               __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if !defined(__clang__)
+/* <kern/bits.h> uses the clang spelling of the C11 atomic builtins */
+#define __c11_atomic_fetch_or(p, v, o)          __atomic_fetch_or(p, v, o)
+#define __c11_atomic_fetch_and(p, v, o)         __atomic_fetch_and(p, v, o)
+#endif /* !__clang__ */
+
+/*
+ * Locks.
+ */
+typedef struct { int lck_unused; } lck_spin_t;
+typedef struct { int lck_unused; } lck_ticket_t;
+typedef struct { int lck_unused; } lck_mtx_t;
+typedef struct { int lck_unused; } lck_grp_t;
+typedef struct { int lck_unused; } lck_attr_t;
+
+#define LCK_GRP_DECLARE(var, name)              lck_grp_t var
+#define LCK_ATTR_NULL                           ((lck_attr_t *)NULL)
+#define LCK_GRP_NULL                            ((lck_grp_t *)NULL)
+#define lck_spin_init(l, g, a)                  ((void)(l))
+#define lck_spin_lock(l)                        ((void)(l))
+#define lck_spin_unlock(l)                      ((void)(l))
+#define lck_spin_lock_grp(l, g)                 ((void)(l))
+#define lck_ticket_init(l, g)                   ((void)(l))
+#define lck_ticket_lock(l, g)                   ((void)(l))
+#define lck_ticket_unlock(l)                    ((void)(l))
+#define pset_lock(p)                            ((void)(p))
+#define pset_unlock(p)                          ((void)(p))
+#define pset_lock_init(p)                       ((void)(p))
+#define pset_assert_locked(p)                   ((void)(p))
+#define thread_lock(th)                         ((void)(th))
+#define thread_unlock(th)                       ((void)(th))
+#define splsched()                              0
+#define splx(s)                                 ((void)(s))
+#define disable_preemption()                    ((void)0)
+#define enable_preemption()                     ((void)0)
+
+/*
+ * Allocation.
+ */
+#define Z_WAITOK                                0x0
+#define Z_ZERO                                  0x1
+#define Z_NOFAIL                                0x2
+#define Z_WAITOK_ZERO                           (Z_WAITOK | Z_ZERO)
+#define Z_WAITOK_ZERO_NOFAIL                    (Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define kalloc_type(type, count, flags)         ((type *)calloc((count), sizeof(type)))
+#define kfree_type(type, count, ptr)            free(ptr)
+#define kalloc_data(size, flags)                calloc(1, (size))
+#define kfree_data(ptr, size)                   free(ptr)
+
+/*
+ * Time. Absolute time units are nanoseconds of simulated time.
+ */
+#define NSEC_PER_USEC                           1000ull
+#define NSEC_PER_MSEC                           1000000ull
+#define NSEC_PER_SEC                            1000000000ull
+#define USEC_PER_SEC                            1000000ull
+
+extern uint64_t sched_sim_now;
+
+static inline uint64_t
+mach_absolute_time(void)
+{
+	return sched_sim_now;
+}
+
+static inline uint64_t
+mach_approximate_time(void)
+{
+	return sched_sim_now;
+}
+
+static inline void
+clock_interval_to_absolutetime_interval(uint32_t interval, uint32_t scale_factor, uint64_t *result)
+{
+	*result = (uint64_t)interval * scale_factor;
+}
+
+static inline void
+nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result)
+{
+	*result = nanoseconds;
+}
+
+static inline void
+absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result)
+{
+	*result = abstime;
+}
+
+extern boolean_t PE_parse_boot_argn(const char *arg_string, void *arg_ptr, int max_arg);
+
+#endif /* _SCHED_SIM_KERN_H_ */
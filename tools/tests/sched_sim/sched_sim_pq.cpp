@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * The priority queue implementation used by the clutch hierarchy, built for
+ * user space the same way tests/priority_queue.cpp does.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+#define DEVELOPMENT 0
+#define DEBUG 0
+#define XNU_KERNEL_PRIVATE 1
+
+#define __container_of(ptr, type, field) __extension__({ \
+	        const __typeof__(((type *)nullptr)->field) *__ptr = (ptr); \
+	        (type *)((uintptr_t)__ptr - offsetof(type, field)); \
+	})
+
+#pragma clang diagnostic ignored "-Watomic-implicit-seq-cst"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+
+#include "../../../osfmk/kern/macro_help.h"
+#include "../../../osfmk/kern/priority_queue.h"
+#include "../../../libkern/c++/priority_queue.cpp"
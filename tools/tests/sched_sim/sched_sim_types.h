@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sched_sim_types.h
+ *
+ * Mock processor, processor set, thread and thread group structures, and
+ * the subset of <kern/sched_prim.h> which the scheduler policies call back
+ * into. Field names and types match the kernel definitions so that the
+ * policy sources compile unmodified.
+ */
+
+#ifndef _SCHED_SIM_TYPES_H_
+#define _SCHED_SIM_TYPES_H_
+
+#include "sched_sim_kern.h"
+
+#include <kern/queue.h>
+#include <kern/circle_queue.h>
+#include <kern/bits.h>
+
+/*
+ * <kern/kern_types.h>
+ */
+typedef union sched_clutch_edge {
+	struct {
+		uint32_t
+		/* boolean_t */ sce_migration_allowed : 1,
+		/* boolean_t */ sce_steal_allowed     : 1,
+		    _reserved             : 30;
+		uint32_t        sce_migration_weight;
+	};
+	uint64_t sce_edge_packed;
+} sched_clutch_edge;
+
+__options_decl(cluster_shared_rsrc_type_t, uint32_t, {
+	CLUSTER_SHARED_RSRC_TYPE_RR                     = 0,
+	CLUSTER_SHARED_RSRC_TYPE_NATIVE_FIRST           = 1,
+	CLUSTER_SHARED_RSRC_TYPE_COUNT                  = 2,
+	CLUSTER_SHARED_RSRC_TYPE_MIN                    = CLUSTER_SHARED_RSRC_TYPE_RR,
+	CLUSTER_SHARED_RSRC_TYPE_NONE                   = CLUSTER_SHARED_RSRC_TYPE_COUNT,
+});
+
+#include <kern/sched.h>
+#include <kern/sched_clutch.h>
+
+/*
+ * <kern/processor.h>
+ */
+typedef enum {
+	PROCESSOR_OFF_LINE        = 0,    /* Not available */
+	PROCESSOR_SHUTDOWN        = 1,    /* Going off-line, but schedulable */
+	PROCESSOR_START           = 2,    /* Being started */
+	PROCESSOR_PENDING_OFFLINE = 3,    /* Going off-line, not schedulable */
+	PROCESSOR_IDLE            = 4,    /* Idle (available) */
+	PROCESSOR_DISPATCHING     = 5,    /* Dispatching (idle -> active) */
+	PROCESSOR_RUNNING         = 6,    /* Normal execution */
+	PROCESSOR_STATE_LEN       = (PROCESSOR_RUNNING + 1)
+} processor_state_t;
+
+typedef enum {
+	PSET_SMP,
+	PSET_AMP_E,
+	PSET_AMP_P,
+} pset_cluster_type_t;
+
+typedef enum {
+	SCHED_PERFCTL_POLICY_DEFAULT,           /*  static policy: set at boot */
+	SCHED_PERFCTL_POLICY_FOLLOW_GROUP,      /* dynamic policy: perfctl_class follows thread group across amp clusters */
+	SCHED_PERFCTL_POLICY_RESTRICT_E,        /* dynamic policy: limits perfctl_class to amp e cluster */
+} sched_perfctl_class_policy_t;
+
+extern _Atomic sched_perfctl_class_policy_t sched_perfctl_policy_util;
+extern _Atomic sched_perfctl_class_policy_t sched_perfctl_policy_bg;
+
+typedef bitmap_t cpumap_t;
+typedef bitmap_t pset_map_t;
+
+typedef union {
+	struct {
+		uint64_t        pset_avg_thread_execution_time;
+		uint64_t        pset_execution_time_last_update;
+	};
+	unsigned __int128       pset_execution_time_packed;
+} pset_execution_time_t;
+
+struct processor_set {
+	int                     pset_id;
+	int                     online_processor_count;
+	int                     cpu_set_low, cpu_set_hi;
+	int                     cpu_set_count;
+	int                     last_chosen;
+
+	uint64_t                load_average;
+	uint64_t                pset_load_average[TH_BUCKET_SCHED_MAX];
+	uint64_t                pset_load_last_update;
+	cpumap_t                cpu_bitmask;
+	cpumap_t                recommended_bitmask;
+	cpumap_t                cpu_state_map[PROCESSOR_STATE_LEN];
+	cpumap_t                primary_map;
+	cpumap_t                realtime_map;
+	cpumap_t                cpu_available_map;
+
+	lck_ticket_t            sched_lock;
+
+	struct run_queue        pset_runq;      /* used by the AMP policy */
+	struct sched_clutch_root pset_clutch_root;
+
+	cpumap_t                pending_AST_URGENT_cpu_mask;
+	cpumap_t                pending_AST_PREEMPT_cpu_mask;
+	cpumap_t                pending_spill_cpu_mask;
+	cpumap_t                rt_pending_spill_cpu_mask;
+	cpumap_t                pending_steal_cpu_mask;
+
+	processor_set_t         pset_list;
+	pset_node_t             node;
+	uint32_t                pset_cluster_id;
+	pset_cluster_type_t     pset_cluster_type;
+	cluster_type_t          pset_type;
+
+	cpumap_t                cpu_running_foreign;
+	cpumap_t                cpu_running_cluster_shared_rsrc_thread[CLUSTER_SHARED_RSRC_TYPE_COUNT];
+	sched_bucket_t          cpu_running_buckets[MAX_CPUS];
+
+	bitmap_t                foreign_psets[BITMAP_LEN(MAX_PSETS)];
+	bitmap_t                native_psets[BITMAP_LEN(MAX_PSETS)];
+	bitmap_t                local_psets[BITMAP_LEN(MAX_PSETS)];
+	bitmap_t                remote_psets[BITMAP_LEN(MAX_PSETS)];
+	sched_clutch_edge       sched_edges[MAX_PSETS];
+	pset_execution_time_t   pset_execution_time[TH_BUCKET_SCHED_MAX];
+	uint64_t                pset_cluster_shared_rsrc_load[CLUSTER_SHARED_RSRC_TYPE_COUNT];
+	uint64_t                pset_steal_count;
+	uint64_t                pset_steal_cross_type_count;
+	uint64_t                pset_steal_declined_count;
+	uint64_t                pset_steal_saved_latency_us;
+	bool                    is_SMT;
+};
+
+struct pset_node {
+	processor_set_t         psets;
+	pset_node_t             nodes;
+	pset_node_t             node_list;
+	pset_node_t             parent;
+	pset_cluster_type_t     pset_cluster_type;
+	pset_map_t              pset_map;
+	_Atomic pset_map_t      pset_idle_map;
+	_Atomic pset_map_t      pset_idle_primary_map;
+	_Atomic pset_map_t      pset_non_rt_map;
+	_Atomic pset_map_t      pset_non_rt_primary_map;
+};
+
+struct processor {
+	processor_state_t       state;
+	bool                    is_recommended;
+	bool                    first_timeslice;
+	struct thread          *active_thread;
+	struct thread          *idle_thread;
+	processor_set_t         processor_set;
+	int                     current_pri;
+	sched_bucket_t          current_sched_bucket;
+	pset_cluster_type_t     current_recommended_pset_type;
+	struct thread_group    *current_thread_group;
+	int                     cpu_id;
+	uint64_t                deadline;
+	uint64_t                quantum_end;
+	uint64_t                last_dispatch;
+	struct run_queue        runq;
+	int                     runq_bound_count;
+	processor_t             processor_primary;
+	processor_t             processor_secondary;
+	processor_t             processor_list;
+};
+
+extern struct processor_set     pset0;
+extern struct pset_node         pset_node0;
+extern pset_node_t              ecore_node;
+extern pset_node_t              pcore_node;
+extern processor_set_t          ecore_set;
+extern processor_set_t          pcore_set;
+extern processor_t              processor_list;
+extern processor_t              processor_array[MAX_CPUS];
+extern processor_set_t          pset_array[MAX_PSETS];
+extern unsigned int             processor_count;
+extern unsigned int             processor_avail_count;
+extern task_t                   kernel_task;
+
+struct machine_info {
+	integer_t       max_cpus;
+	integer_t       avail_cpus;
+	integer_t       physical_cpu;
+	integer_t       physical_cpu_max;
+	integer_t       logical_cpu;
+	integer_t       logical_cpu_max;
+};
+extern struct machine_info machine_info;
+
+extern cluster_type_t pset_type_for_id(uint32_t cluster_id);
+extern pset_cluster_type_t recommended_pset_type(thread_t thread);
+extern void sched_update_pset_load_average(processor_set_t pset, uint64_t curtime);
+extern void sched_update_pset_avg_execution_time(processor_set_t pset, uint64_t delta, uint64_t curtime, sched_bucket_t sched_bucket);
+extern uint64_t sched_pset_cluster_shared_rsrc_load(processor_set_t pset, cluster_shared_rsrc_type_t shared_rsrc_type);
+
+#define PSET_LOAD_NUMERATOR_SHIFT           16
+#define PSET_LOAD_FRACTIONAL_SHIFT          4
+#define SCHED_PSET_LOAD_EWMA_FRACTION_BITS  8
+#define SCHED_PSET_LOAD_EWMA_ROUND_BIT      (1 << (SCHED_PSET_LOAD_EWMA_FRACTION_BITS - 1))
+#define SCHED_PSET_LOAD_EWMA_FRACTION_MASK  ((1 << SCHED_PSET_LOAD_EWMA_FRACTION_BITS) - 1)
+
+extern const struct sched_dispatch_table *sched_current_dispatch;
+extern const struct sched_dispatch_table sched_edge_dispatch;
+
+/*
+ * The kernel picks one of these two definitions at compile time
+ * (CONFIG_SCHED_EDGE); the simulator picks one based on the policy
+ * being replayed.
+ */
+inline static int
+sched_get_pset_load_average(processor_set_t pset, sched_bucket_t sched_bucket)
+{
+	if (sched_current_dispatch != &sched_edge_dispatch) {
+		return (int)pset->load_average >> (PSET_LOAD_NUMERATOR_SHIFT - PSET_LOAD_FRACTIONAL_SHIFT);
+	}
+
+	uint64_t load_average = os_atomic_load(&pset->pset_load_average[sched_bucket], relaxed);
+	return (int)(((load_average + SCHED_PSET_LOAD_EWMA_ROUND_BIT) >> SCHED_PSET_LOAD_EWMA_FRACTION_BITS) *
+	       pset->pset_execution_time[sched_bucket].pset_avg_thread_execution_time);
+}
+
+extern processor_t current_processor(void);
+
+inline static void
+pset_update_processor_state(processor_set_t pset, processor_t processor, uint new_state)
+{
+	uint old_state = processor->state;
+	uint cpuid = (uint)processor->cpu_id;
+
+	assert(processor->processor_set == pset);
+	assert(bit_test(pset->cpu_bitmask, cpuid));
+	assert(new_state < PROCESSOR_STATE_LEN);
+
+	processor->state = new_state;
+
+	bit_clear(pset->cpu_state_map[old_state], cpuid);
+	bit_set(pset->cpu_state_map[new_state], cpuid);
+
+	if (new_state < PROCESSOR_IDLE) {
+		bit_clear(pset->cpu_available_map, cpuid);
+	} else {
+		bit_set(pset->cpu_available_map, cpuid);
+	}
+
+	if ((old_state == PROCESSOR_RUNNING) || (new_state == PROCESSOR_RUNNING)) {
+		sched_update_pset_load_average(pset, 0);
+	}
+	if (new_state == PROCESSOR_IDLE) {
+		bit_set(pset->node->pset_idle_map, pset->pset_id);
+	} else if (pset->cpu_state_map[PROCESSOR_IDLE] == 0) {
+		bit_clear(pset->node->pset_idle_map, pset->pset_id);
+	}
+}
+
+/*
+ * <kern/thread_group.h>
+ */
+struct thread_group {
+	uint64_t                tg_id;
+	char                    tg_name[32];
+	cluster_type_t          tg_recommendation;
+	struct sched_clutch     tg_sched_clutch;
+};
+
+extern uint64_t thread_group_get_id(struct thread_group *tg);
+extern const char *thread_group_get_name(struct thread_group *tg);
+extern cluster_type_t thread_group_recommendation(struct thread_group *tg);
+extern void thread_group_update_recommendation(struct thread_group *tg, cluster_type_t new_recommendation);
+
+/*
+ * <kern/thread.h>
+ */
+#define TH_WAIT                 0x01            /* queued for waiting */
+#define TH_SUSP                 0x02            /* stopped or requested to stop */
+#define TH_RUN                  0x04            /* running or on runq */
+#define TH_UNINT                0x08            /* waiting uninteruptibly */
+#define TH_TERMINATE            0x10            /* halted at termination */
+#define TH_TERMINATE2           0x20            /* added to termination queue */
+#define TH_WAIT_REPORT          0x40            /* the wait is using the sched_call */
+#define TH_IDLE                 0x80            /* idling processor */
+
+#define TH_SFLAG_NO_SMT                 0x0001
+#define TH_SFLAG_FAILSAFE               0x0002
+#define TH_SFLAG_THROTTLED              0x0004
+#define TH_SFLAG_PROMOTED               0x0008
+#define TH_SFLAG_DEPRESS                0x0040
+#define TH_SFLAG_POLLDEPRESS            0x0080
+#define TH_SFLAG_DEPRESSED_MASK         (TH_SFLAG_DEPRESS | TH_SFLAG_POLLDEPRESS)
+#define TH_SFLAG_EAGERPREEMPT           0x0200
+#define TH_SFLAG_RW_PROMOTED            0x0400
+#define TH_SFLAG_BASE_PRI_FROZEN        0x0800
+#define TH_SFLAG_WAITQ_PROMOTED         0x1000
+#define TH_SFLAG_ECORE_ONLY             0x2000
+#define TH_SFLAG_PCORE_ONLY             0x4000
+#define TH_SFLAG_EXEC_PROMOTED          0x8000
+#define TH_SFLAG_BOUND_SOFT             0x20000
+#define TH_SFLAG_FLOOR_PROMOTED         0x80000
+#define TH_SFLAG_RT_DISALLOWED          0x100000
+#define TH_SFLAG_DEMOTED_MASK           (TH_SFLAG_THROTTLED | TH_SFLAG_FAILSAFE | TH_SFLAG_RT_DISALLOWED)
+#define TH_SFLAG_PROMOTE_REASON_MASK    (TH_SFLAG_RW_PROMOTED | TH_SFLAG_WAITQ_PROMOTED | TH_SFLAG_EXEC_PROMOTED | TH_SFLAG_FLOOR_PROMOTED)
+
+#define THREAD_BOUND_CLUSTER_NONE       (UINT32_MAX)
+
+struct thread {
+	union {
+		queue_chain_t                   runq_links;
+	};
+	processor_t             runq;
+	int                     state;
+	ast_t                   reason;
+	sched_mode_t            sched_mode;
+	sched_mode_t            saved_mode;
+	sched_bucket_t          th_sched_bucket;
+	uint32_t                sched_flags;
+	int16_t                 sched_pri;
+	int16_t                 base_pri;
+	int16_t                 req_base_pri;
+	int16_t                 max_priority;
+	int16_t                 task_priority;
+	uint8_t                 kern_promotion_schedpri;
+
+	struct priority_queue_entry_stable      th_clutch_runq_link;
+	struct priority_queue_entry_sched       th_clutch_pri_link;
+	queue_chain_t                           th_clutch_timeshare_link;
+
+	bool                    th_bound_cluster_enqueued;
+	bool                    th_shared_rsrc_enqueued[CLUSTER_SHARED_RSRC_TYPE_COUNT];
+	bool                    th_shared_rsrc_heavy_user[CLUSTER_SHARED_RSRC_TYPE_COUNT];
+	uint32_t                th_bound_cluster_id;
+
+	struct thread_group     *thread_group;
+	processor_t             bound_processor;
+	processor_t             last_processor;
+	processor_t             chosen_processor;
+
+	uint32_t                quantum_remaining;
+	natural_t               sched_stamp;
+	natural_t               sched_usage;
+	natural_t               pri_shift;
+	natural_t               cpu_usage;
+	natural_t               cpu_delta;
+	uint64_t                sched_time_save;
+	uint64_t                computation_metered;
+	uint64_t                computation_epoch;
+	uint64_t                last_made_runnable_time;
+	uint64_t                last_basepri_change_time;
+	uint64_t                same_pri_latency;
+
+	/* Replay state, owned by sched_sim.c */
+	uint64_t                thread_id;
+	uint64_t                sim_cpu_time;
+	void                    *sim_private;
+};
+
+#define thread_tid(thread)                      ((thread)->thread_id)
+#define recount_thread_time_mach(thread)        ((thread)->sim_cpu_time)
+
+extern thread_t current_thread(void);
+extern boolean_t thread_shared_rsrc_policy_get(thread_t thread, cluster_shared_rsrc_type_t type);
+extern void thread_bind_cluster_type(thread_t thread, char cluster_type, bool soft_bind);
+extern boolean_t thread_update_add_thread(thread_t thread);
+extern void thread_update_process_threads(void);
+
+/*
+ * <kern/sched_prim.h>
+ */
+typedef enum {
+	SCHED_IPI_EVENT_BOUND_THR   = 0x1,
+	SCHED_IPI_EVENT_PREEMPT     = 0x2,
+	SCHED_IPI_EVENT_SMT_REBAL   = 0x3,
+	SCHED_IPI_EVENT_SPILL       = 0x4,
+	SCHED_IPI_EVENT_REBALANCE   = 0x5,
+	SCHED_IPI_EVENT_RT_PREEMPT  = 0x6,
+	SCHED_IPI_EVENT_STEAL       = 0x7,
+} sched_ipi_event_t;
+
+typedef enum {
+	SCHED_IPI_NONE              = 0x0,
+	SCHED_IPI_IMMEDIATE         = 0x1,
+	SCHED_IPI_IDLE              = 0x2,
+	SCHED_IPI_DEFERRED          = 0x3,
+} sched_ipi_type_t;
+
+extern sched_ipi_type_t sched_ipi_action(processor_t dst, thread_t thread, sched_ipi_event_t event);
+extern void sched_ipi_perform(processor_t dst, sched_ipi_type_t ipi);
+extern sched_ipi_type_t sched_ipi_policy(processor_t dst, thread_t thread,
+    boolean_t dst_idle, sched_ipi_event_t event);
+extern sched_ipi_type_t sched_ipi_deferred_policy(processor_set_t pset,
+    processor_t dst, thread_t thread, sched_ipi_event_t event);
+
+extern void             sched_steal_record(processor_set_t dst_pset, processor_set_t src_pset, uint64_t saved_latency_us);
+extern void             sched_steal_signal_idle(processor_set_t pset);
+
+extern void             sched_rtlocal_init(processor_set_t pset);
+extern rt_queue_t       sched_rtlocal_runq(processor_set_t pset);
+extern void             sched_rtlocal_queue_shutdown(processor_t processor);
+extern int64_t          sched_rtlocal_runq_count_sum(void);
+extern thread_t         sched_rtlocal_steal_thread(processor_set_t stealing_pset, uint64_t earliest_deadline);
+extern void             sched_rtlocal_runq_scan(sched_update_scan_context_t scan_context);
+extern void             sched_check_spill(processor_set_t pset, thread_t thread);
+extern bool             sched_thread_should_yield(processor_t processor, thread_t thread);
+extern bool             sched_steal_thread_enabled(processor_set_t pset);
+extern boolean_t        can_update_priority(thread_t thread);
+extern void             update_priority(thread_t thread);
+extern void             lightweight_update_priority(thread_t thread);
+extern void             sched_default_quantum_expire(thread_t thread);
+extern void             thread_setrun(thread_t thread, sched_options_t options);
+extern int              pset_available_cpu_count(processor_set_t pset);
+extern bool             pset_is_recommended(processor_set_t pset);
+extern pset_node_t      sched_choose_node(thread_t thread);
+extern processor_t      choose_processor(processor_set_t pset, processor_t processor, thread_t thread);
+extern void             sched_SMT_balance(processor_t processor, processor_set_t pset);
+extern void             run_queue_init(run_queue_t runq);
+extern thread_t         run_queue_dequeue(run_queue_t runq, sched_options_t options);
+extern boolean_t        run_queue_enqueue(run_queue_t runq, thread_t thread, sched_options_t options);
+extern void             run_queue_remove(run_queue_t runq, thread_t thread);
+extern thread_t         run_queue_peek(run_queue_t runq);
+extern boolean_t        runq_scan(run_queue_t runq, sched_update_scan_context_t scan_context);
+extern void             sched_pset_made_schedulable(processor_t processor, processor_set_t pset, boolean_t drop_lock);
+extern void             sched_cpu_init_completed(void);
+extern void             sched_timeshare_init(void);
+extern void             sched_timeshare_timebase_init(void);
+extern void             sched_timeshare_maintenance_continue(void);
+extern boolean_t        priority_is_urgent(int priority);
+extern uint32_t         sched_timeshare_initial_quantum_size(thread_t thread);
+extern int              sched_compute_timeshare_priority(thread_t thread);
+extern uint32_t         sched_qos_max_parallelism(int qos, uint64_t options);
+extern int              rt_runq_count(processor_set_t pset);
+extern uint32_t         sched_run_incr(thread_t thread);
+extern uint32_t         sched_run_decr(thread_t thread);
+extern void             sched_update_thread_bucket(thread_t thread);
+extern void             thread_quantum_init(thread_t thread, uint64_t now);
+extern boolean_t        sched_clutch_timeshare_scan(queue_t thread_queue, uint16_t count, sched_update_scan_context_t scan_context);
+
+extern uint32_t         sched_debug_flags;
+extern int              sched_allow_NO_SMT_threads;
+extern uint64_t         sched_one_second_interval;
+extern uint32_t         sched_load_average, sched_mach_factor;
+extern bool             system_is_SMT;
+
+#define QOS_PARALLELISM_COUNT_LOGICAL   0x1
+#define QOS_PARALLELISM_REALTIME        0x2
+#define QOS_PARALLELISM_CLUSTER_SHARED_RESOURCE 0x4
+
+#define THREAD_QOS_UNSPECIFIED          0
+#define THREAD_QOS_MAINTENANCE          1
+#define THREAD_QOS_BACKGROUND           2
+#define THREAD_QOS_UTILITY              3
+#define THREAD_QOS_LEGACY               4
+#define THREAD_QOS_USER_INITIATED       5
+#define THREAD_QOS_USER_INTERACTIVE     6
+#define THREAD_QOS_LAST                 7
+
+struct sched_dispatch_table {
+	const char *sched_name;
+	void    (*init)(void);
+	void    (*timebase_init)(void);
+	void    (*processor_init)(processor_t processor);
+	void    (*pset_init)(processor_set_t pset);
+	void    (*maintenance_continuation)(void);
+	thread_t        (*choose_thread)(processor_t processor, int priority, ast_t reason);
+	bool    (*steal_thread_enabled)(processor_set_t pset);
+	thread_t        (*steal_thread)(processor_set_t pset);
+	int (*compute_timeshare_priority)(thread_t thread);
+	pset_node_t (*choose_node)(thread_t thread);
+	processor_t     (*choose_processor)(processor_set_t pset, processor_t processor, thread_t thread);
+	boolean_t (*processor_enqueue)(processor_t processor, thread_t thread, sched_options_t options);
+	void (*processor_queue_shutdown)(processor_t processor);
+	boolean_t       (*processor_queue_remove)(processor_t processor, thread_t thread);
+	boolean_t       (*processor_queue_empty)(processor_t processor);
+	boolean_t       (*priority_is_urgent)(int priority);
+	ast_t           (*processor_csw_check)(processor_t processor);
+	boolean_t       (*processor_queue_has_priority)(processor_t processor, int priority, boolean_t gte);
+	uint32_t        (*initial_quantum_size)(thread_t thread);
+	sched_mode_t    (*initial_thread_sched_mode)(task_t parent_task);
+	boolean_t       (*can_update_priority)(thread_t thread);
+	void            (*update_priority)(thread_t thread);
+	void            (*lightweight_update_priority)(thread_t thread);
+	void            (*quantum_expire)(thread_t thread);
+	int             (*processor_runq_count)(processor_t processor);
+	uint64_t        (*processor_runq_stats_count_sum)(processor_t processor);
+	boolean_t       (*processor_bound_count)(processor_t processor);
+	void            (*thread_update_scan)(sched_update_scan_context_t scan_context);
+	boolean_t   multiple_psets_enabled;
+	boolean_t   sched_groups_enabled;
+	boolean_t   avoid_processor_enabled;
+	bool    (*thread_avoid_processor)(processor_t processor, thread_t thread);
+	void    (*processor_balance)(processor_t processor, processor_set_t pset);
+	rt_queue_t      (*rt_runq)(processor_set_t pset);
+	void    (*rt_init)(processor_set_t pset);
+	void    (*rt_queue_shutdown)(processor_t processor);
+	void    (*rt_runq_scan)(sched_update_scan_context_t scan_context);
+	int64_t (*rt_runq_count_sum)(void);
+	thread_t (*rt_steal_thread)(processor_set_t pset, uint64_t earliest_deadline);
+	uint32_t (*qos_max_parallelism)(int qos, uint64_t options);
+	void    (*check_spill)(processor_set_t pset, thread_t thread);
+	sched_ipi_type_t (*ipi_policy)(processor_t dst, thread_t thread, boolean_t dst_idle, sched_ipi_event_t event);
+	bool    (*thread_should_yield)(processor_t processor, thread_t thread);
+	uint32_t (*run_count_incr)(thread_t thread);
+	uint32_t (*run_count_decr)(thread_t thread);
+	void (*update_thread_bucket)(thread_t thread);
+	void (*pset_made_schedulable)(processor_t processor, processor_set_t pset, boolean_t drop_lock);
+	void (*thread_group_recommendation_change)(struct thread_group *tg, cluster_type_t new_recommendation);
+	void (*cpu_init_completed)(void);
+	bool (*thread_eligible_for_pset)(thread_t thread, processor_set_t pset);
+};
+
+extern const struct sched_dispatch_table sched_clutch_dispatch;
+extern const struct sched_dispatch_table sched_edge_dispatch;
+extern const struct sched_dispatch_table sched_amp_dispatch;
+
+/*
+ * The kernel binds SCHED() to a single policy at compile time; the
+ * simulator selects the policy under test at runtime.
+ */
+extern const struct sched_dispatch_table *sched_current_dispatch;
+#define SCHED(f) (sched_current_dispatch->f)
+
+/*
+ * <machine/machine_routines.h>
+ */
+extern unsigned int ml_get_cluster_count(void);
+extern unsigned int ml_get_die_id(unsigned int cluster_id);
+extern unsigned int ml_get_cpu_number_type(cluster_type_t cluster_type, bool logical, bool available);
+extern unsigned int ml_get_cluster_number_type(cluster_type_t cluster_type);
+extern uint64_t ml_cpu_signal_deferred_get_timer(void);
+
+#define SCHED_PERFCONTROL_PREFERRED_CLUSTER_OVERRIDE_NONE         ((uint32_t)~0)
+#define SCHED_PERFCONTROL_PREFERRED_CLUSTER_MIGRATE_RUNNING       0x1
+#define SCHED_PERFCONTROL_PREFERRED_CLUSTER_MIGRATE_RUNNABLE      0x2
+
+/*
+ * <kern/ast.h>
+ */
+extern void ast_on(ast_t reasons);
+extern bool ml_cpu_signal_is_enabled(void);
+
+#endif /* _SCHED_SIM_TYPES_H_ */